@@ -0,0 +1,970 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Replays recorded pulse trains through the protocols in the
+ * same way the daemon matches them, to make the performance
+ * of the decoders measurable. The trains are read from the
+ * output of pilight-raw -L or pilight-debug, a line per train,
+ * or from a capture-file written by the daemon.
+ *
+ * The events mode generates a config of devices and rules
+ * and feeds device updates to the rules the same way the
+ * events loop does, once with the native operators and
+ * functions and once with only their lua modules.
+ *
+ * The json mode measures the codec on a few documents that
+ * are typical for pilight.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <ctype.h>
+#ifndef _WIN32
+	#include <unistd.h>
+#endif
+
+#include "libs/libuv/uv.h"
+#include "libs/pilight/core/pilight.h"
+#include "libs/pilight/core/common.h"
+#include "libs/pilight/core/options.h"
+#include "libs/pilight/core/log.h"
+#include "libs/pilight/core/json.h"
+#include "libs/pilight/core/mem.h"
+#include "libs/pilight/core/eventpool.h"
+#include "libs/pilight/core/capture.h"
+#include "libs/pilight/config/config.h"
+#include "libs/pilight/config/devices.h"
+#include "libs/pilight/config/rules.h"
+#include "libs/pilight/lua_c/lua.h"
+
+#include "libs/pilight/protocols/protocol.h"
+
+#include "libs/pilight/events/events.h"
+#include "libs/pilight/events/operator.h"
+#include "libs/pilight/events/function.h"
+
+/* Shorter lines are the other output of pilight-debug */
+#define BENCH_MINRAWLEN	10
+
+typedef struct bench_frame_t {
+	int length;
+	int pulses[MAXPULSESTREAMLENGTH];
+} bench_frame_t;
+
+typedef struct bench_stats_t {
+	struct protocol_t *protocol;
+	unsigned long validated;
+	unsigned long hits;
+	unsigned long parsed;
+	unsigned long misses;
+	unsigned long allocs;
+	unsigned long nodes;
+	uint64_t validate;
+	uint64_t parse;
+	struct bench_stats_t *next;
+} bench_stats_t;
+
+static struct bench_frame_t *frames = NULL;
+static int nrframes = 0;
+static struct bench_stats_t *stats = NULL;
+
+static uint64_t *latencies = NULL;
+static unsigned long nrlatencies = 0;
+static unsigned long latencysize = 0;
+
+static char *lua_root = LUA_ROOT;
+
+int main_gc(void) {
+	struct bench_stats_t *tmp = NULL;
+
+	log_shell_disable();
+
+#ifdef EVENTS
+	events_gc();
+#endif
+
+	while(stats) {
+		tmp = stats;
+		stats = stats->next;
+		FREE(tmp);
+	}
+	if(frames != NULL) {
+		FREE(frames);
+	}
+	nrframes = 0;
+	if(latencies != NULL) {
+		FREE(latencies);
+	}
+	nrlatencies = 0;
+	latencysize = 0;
+
+	options_gc();
+	eventpool_gc();
+	config_gc();
+	protocol_gc();
+	log_gc();
+	FREE(progname);
+
+	return EXIT_SUCCESS;
+}
+
+static struct bench_stats_t *bench_stats(struct protocol_t *protocol) {
+	struct bench_stats_t *tmp = stats;
+
+	while(tmp) {
+		if(tmp->protocol == protocol) {
+			return tmp;
+		}
+		tmp = tmp->next;
+	}
+	if((tmp = MALLOC(sizeof(struct bench_stats_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(tmp, 0, sizeof(struct bench_stats_t));
+	tmp->protocol = protocol;
+	tmp->next = stats;
+	stats = tmp;
+	return tmp;
+}
+
+static unsigned long bench_nodes(struct JsonNode *jnode) {
+	struct JsonNode *jchild = NULL;
+	unsigned long n = 1;
+
+	jchild = json_first_child(jnode);
+	while(jchild) {
+		n += bench_nodes(jchild);
+		jchild = jchild->next;
+	}
+	return n;
+}
+
+static void bench_add(struct bench_frame_t *frame) {
+	if((frames = REALLOC(frames, sizeof(struct bench_frame_t)*(size_t)(nrframes+1))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(&frames[nrframes++], frame, sizeof(struct bench_frame_t));
+}
+
+static int bench_read_capture(char *file) {
+	struct capture_t capture;
+	struct capture_train_t *train = NULL;
+	struct bench_frame_t frame;
+	int r = 0;
+
+	if(capture_open(&capture, file) != 0) {
+		return -1;
+	}
+	if((train = MALLOC(sizeof(struct capture_train_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	while((r = capture_next(&capture, train)) == 1) {
+		frame.length = train->length;
+		memcpy(frame.pulses, train->pulses, sizeof(int)*(size_t)train->length);
+		bench_add(&frame);
+	}
+	if(r == -1) {
+		logprintf(LOG_WARNING, "%s is damaged after %d trains", file, nrframes);
+	}
+	FREE(train);
+	capture_close(&capture);
+
+	return 0;
+}
+
+/*
+ * Every line with enough pulses is a train. A leading
+ * hardware name and the trailing summary of pilight-raw
+ * are skipped.
+ */
+static int bench_read(char *file) {
+	struct bench_frame_t frame;
+	char line[8192], *p = NULL, *end = NULL;
+	long pulse = 0;
+	FILE *fp = NULL;
+
+	if((fp = fopen(file, "r")) == NULL) {
+		logprintf(LOG_ERR, "cannot read %s: %s", file, strerror(errno));
+		return -1;
+	}
+	if(fread(line, 1, strlen(CAPTURE_MAGIC), fp) == strlen(CAPTURE_MAGIC) &&
+	   memcmp(line, CAPTURE_MAGIC, strlen(CAPTURE_MAGIC)) == 0) {
+		fclose(fp);
+		return bench_read_capture(file);
+	}
+	rewind(fp);
+
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		frame.length = 0;
+		p = line;
+		while(*p != '\0') {
+			while(isspace((unsigned char)*p)) {
+				p++;
+			}
+			if(*p == '-') {
+				break;
+			}
+			pulse = strtol(p, &end, 10);
+			if(end == p) {
+				/* The hardware name */
+				while(*p != '\0' && !isspace((unsigned char)*p)) {
+					p++;
+				}
+				continue;
+			}
+			p = end;
+			if(pulse > 0 && frame.length < MAXPULSESTREAMLENGTH) {
+				frame.pulses[frame.length++] = (int)pulse;
+			}
+		}
+		if(frame.length < BENCH_MINRAWLEN) {
+			continue;
+		}
+		bench_add(&frame);
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+/*
+ * The matching loop of receive_parse_code, without the repeat
+ * cache so every train is validated again.
+ */
+static void bench_frame(struct bench_frame_t *frame, struct protocol_t *expected) {
+	struct protocol_index_t *candidate = NULL;
+	struct protocol_fingerprint_t fingerprint;
+	struct protocol_t *protocol = NULL;
+	struct bench_stats_t *stat = NULL;
+	unsigned long allocs = 0;
+	uint64_t start = 0, now = 0;
+	int valid = 0, nr = 0, i = 0;
+
+	nr = protocol_index_get(frame->length, &candidate);
+	protocol_fingerprint(frame->pulses, frame->length, &fingerprint);
+	for(i=0;i<nr;i++,candidate++) {
+		protocol = candidate->listener;
+
+		if(protocol_index_match(candidate, -1, frame->pulses[frame->length-1], &fingerprint) == 0) {
+			stat = bench_stats(protocol);
+
+			protocol->raw = frame->pulses;
+			protocol->rawlen = frame->length;
+			protocol->repeats = protocol->rxrpt;
+
+			allocs = memprofile_allocs();
+			start = uv_hrtime();
+			valid = protocol->validate();
+			now = uv_hrtime();
+			stat->validate += now - start;
+			stat->validated++;
+
+			if(valid == 0) {
+				stat->hits++;
+				if(expected != NULL && protocol != expected) {
+					stat->misses++;
+				}
+				if(protocol->parseCode != NULL) {
+					start = uv_hrtime();
+					protocol->parseCode();
+					now = uv_hrtime();
+					stat->parse += now - start;
+					stat->parsed++;
+				}
+			}
+			stat->allocs += memprofile_allocs() - allocs;
+
+			if(protocol->message != NULL) {
+				stat->nodes += bench_nodes(protocol->message);
+				json_delete(protocol->message);
+				protocol->message = NULL;
+			}
+		}
+	}
+}
+
+/*
+ * A config of generic dimmers and rules on their values,
+ * mixing the stock operators, a function and the switch and
+ * dim actions. Every rule also looks at the next device, so
+ * most devices are used by several rules.
+ */
+static struct JsonNode *bench_config(int nrdevices, int nrrules) {
+	struct JsonNode *jroot = json_mkobject();
+	struct JsonNode *jdevices = json_mkobject();
+	struct JsonNode *jrules = json_mkobject();
+	struct JsonNode *jsettings = json_mkobject();
+	struct JsonNode *jdevice = NULL, *jids = NULL, *jid = NULL, *jrule = NULL;
+	char name[64], rule[512];
+	int i = 0, a = 0, b = 0;
+
+	for(i=0;i<nrdevices;i++) {
+		jdevice = json_mkobject();
+		jids = json_mkarray();
+		jid = json_mkobject();
+		json_append_member(jid, "id", json_mknumber(i, 0));
+		json_append_element(jids, jid);
+		jid = json_mkarray();
+		json_append_element(jid, json_mkstring("generic_dimmer"));
+		json_append_member(jdevice, "protocol", jid);
+		json_append_member(jdevice, "id", jids);
+		json_append_member(jdevice, "state", json_mkstring("off"));
+		json_append_member(jdevice, "dimlevel", json_mknumber(0, 0));
+		snprintf(name, sizeof(name), "dimmer%d", i);
+		json_append_member(jdevices, name, jdevice);
+	}
+
+	for(i=0;i<nrrules;i++) {
+		a = i % nrdevices;
+		b = (i + 1) % nrdevices;
+		switch(i % 4) {
+			case 0:
+				snprintf(rule, sizeof(rule),
+					"IF dimmer%d.state == on AND dimmer%d.dimlevel < 8 THEN switch DEVICE dimmer%d TO off",
+					a, b, b);
+			break;
+			case 1:
+				snprintf(rule, sizeof(rule),
+					"IF dimmer%d.dimlevel > 5 AND dimmer%d.state IS on THEN dim DEVICE dimmer%d TO 10",
+					a, b, b);
+			break;
+			case 2:
+				snprintf(rule, sizeof(rule),
+					"IF MAX(dimmer%d.dimlevel, dimmer%d.dimlevel) >= 8 OR dimmer%d.state != off THEN switch DEVICE dimmer%d TO on",
+					a, b, a, b);
+			break;
+			default:
+				snprintf(rule, sizeof(rule),
+					"IF (dimmer%d.dimlevel * 2) %% 3 == 1 AND dimmer%d.dimlevel - 1 < 10 THEN dim DEVICE dimmer%d TO 5",
+					a, b, b);
+			break;
+		}
+		jrule = json_mkobject();
+		json_append_member(jrule, "rule", json_mkstring(rule));
+		json_append_member(jrule, "active", json_mknumber(1, 0));
+		snprintf(name, sizeof(name), "rule%d", i);
+		json_append_member(jrules, name, jrule);
+	}
+
+	json_append_member(jsettings, "log-level", json_mknumber(LOG_NOTICE, 0));
+
+	json_append_member(jroot, "devices", jdevices);
+	json_append_member(jroot, "rules", jrules);
+	json_append_member(jroot, "gui", json_mkobject());
+	json_append_member(jroot, "settings", jsettings);
+	json_append_member(jroot, "hardware", json_mkobject());
+	json_append_member(jroot, "registry", json_mkobject());
+
+	return jroot;
+}
+
+#ifdef EVENTS
+static int bench_config_write(char *file, int nrdevices, int nrrules) {
+	struct JsonNode *jroot = bench_config(nrdevices, nrrules);
+	char *content = json_stringify(jroot, "\t");
+	FILE *fp = NULL;
+
+	json_delete(jroot);
+
+	if((fp = fopen(file, "w")) == NULL) {
+		logprintf(LOG_ERR, "cannot write %s: %s", file, strerror(errno));
+		json_free(content);
+		return -1;
+	}
+	fputs(content, fp);
+	fclose(fp);
+	json_free(content);
+
+	return 0;
+}
+
+static void bench_latency(uint64_t ns) {
+	if(nrlatencies == latencysize) {
+		latencysize += 1024;
+		if((latencies = REALLOC(latencies, sizeof(uint64_t)*latencysize)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+	latencies[nrlatencies++] = ns;
+}
+
+static int bench_latency_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double bench_percentile(int p) {
+	if(nrlatencies == 0) {
+		return 0.0;
+	}
+	return (double)latencies[(nrlatencies-1)*(unsigned long)p/100] / 1000.0;
+}
+
+/*
+ * Update the devices one after the other, as if the receiver
+ * received them, and run the rules using the updated devices
+ * like the events loop does. Only the rules themselves are
+ * timed. The actions are started, but as nothing handles the
+ * controlled devices their state isn't changed.
+ */
+static void bench_rules(const char *path, int nrdevices, int nrupdates) {
+	struct JsonNode *jcode = NULL, *jmessage = NULL, *jret = NULL, *jchild = NULL;
+	struct rules_list_t *tmp = NULL;
+	struct rules_t *rule = NULL;
+	unsigned long executed = 0, failed = 0;
+	uint64_t begin = 0, start = 0, now = 0, elapsed = 0, total = 0;
+	int i = 0;
+
+	nrlatencies = 0;
+	begin = uv_hrtime();
+	for(i=0;i<nrupdates;i++) {
+		jcode = json_mkobject();
+		jmessage = json_mkobject();
+		json_append_member(jmessage, "id", json_mknumber(i % nrdevices, 0));
+		json_append_member(jmessage, "state", json_mkstring(((i / nrdevices) % 2 == 0) ? "on" : "off"));
+		json_append_member(jmessage, "dimlevel", json_mknumber((i + i / nrdevices) % 16, 0));
+		json_append_member(jcode, "message", jmessage);
+
+		jret = NULL;
+		if(devices_update("generic_dimmer", jcode, RECEIVER, &jret) == 0) {
+			jchild = json_first_child(json_find_member(jret, "devices"));
+			while(jchild) {
+				if(jchild->tag == JSON_STRING) {
+					tmp = rules_index_get(jchild->string_);
+					while(tmp) {
+						rule = tmp->rule;
+						if(rule->active == 1 && rule->tree != NULL && rule->status == 0) {
+							rule->jtrigger = json_ref(jret);
+							start = uv_hrtime();
+							if(event_parse_rule(rule->rule, rule, 0, 0) == -1) {
+								failed++;
+							}
+							now = uv_hrtime();
+							bench_latency(now - start);
+							total += now - start;
+							if(rule->status == 1) {
+								executed++;
+							}
+							rule->status = 0;
+							json_delete(rule->jtrigger);
+							rule->jtrigger = NULL;
+						}
+						tmp = tmp->next;
+					}
+				}
+				jchild = jchild->next;
+			}
+			json_delete(jret);
+		}
+		json_delete(jcode);
+
+		/* Let the started actions run */
+		uv_run(uv_default_loop(), UV_RUN_NOWAIT);
+	}
+	elapsed = uv_hrtime() - begin;
+
+	if(nrlatencies > 1) {
+		qsort(latencies, (size_t)nrlatencies, sizeof(uint64_t), bench_latency_cmp);
+	}
+
+	printf("%-8s %10d %10lu %10lu %10lu %14.0f %10.1f %10.1f %10.1f %10.1f %10.3f\n",
+		path, nrupdates, nrlatencies, executed, failed,
+		(total > 0) ? (double)nrlatencies*1000000000.0/(double)total : 0.0,
+		bench_percentile(50), bench_percentile(90), bench_percentile(99), bench_percentile(100),
+		(double)elapsed/1000000000.0);
+}
+
+static int bench_events(int nrdevices, int nrrules, int nrupdates) {
+	char file[] = "/tmp/pilight-bench.XXXXXX";
+	char journal[sizeof(file)+8];
+	int fd = 0, ret = -1;
+
+	if((fd = mkstemp(file)) == -1) {
+		logprintf(LOG_ERR, "cannot create a temporary config: %s", strerror(errno));
+		return -1;
+	}
+	close(fd);
+	snprintf(journal, sizeof(journal), "%s.journal", file);
+
+	if(bench_config_write(file, nrdevices, nrrules) != 0) {
+		goto clear;
+	}
+
+	{
+		int len = strlen(lua_root)+strlen("lua/?/?.lua")+1;
+		char *lua_path = MALLOC(len);
+
+		if(lua_path == NULL) {
+			OUT_OF_MEMORY
+		}
+
+		plua_init();
+
+		memset(lua_path, '\0', len);
+		snprintf(lua_path, len, "%s/?/?.lua", lua_root);
+		plua_package_path(lua_path);
+
+		memset(lua_path, '\0', len);
+		snprintf(lua_path, len, "%s/?.lua", lua_root);
+		plua_package_path(lua_path);
+
+		FREE(lua_path);
+	}
+
+	if(config_set_file(file) == EXIT_FAILURE) {
+		goto clear;
+	}
+	eventpool_init(EVENTPOOL_NO_THREADS);
+	protocol_init();
+	config_init();
+	if(config_read(CONFIG_ALL) != 0) {
+		logprintf(LOG_ERR, "failed to read the generated config");
+		goto clear;
+	}
+
+	printf("%d devices, %d rules\n\n", nrdevices, nrrules);
+	printf("%-8s %10s %10s %10s %10s %14s %10s %10s %10s %10s %10s\n",
+		"path", "updates", "rules", "executed", "failed", "rules/s", "p50 us", "p90 us", "p99 us", "max us", "seconds");
+
+	event_operator_native_enable(1);
+	event_function_native_enable(1);
+	bench_rules("native", nrdevices, nrupdates);
+
+	/* The same trees, but every operator and function through lua */
+	event_operator_native_enable(0);
+	event_function_native_enable(0);
+	bench_rules("lua", nrdevices, nrupdates);
+
+	event_operator_native_enable(1);
+	event_function_native_enable(1);
+	ret = 0;
+
+clear:
+	unlink(file);
+	unlink(journal);
+	return ret;
+}
+#endif
+
+/* Every codec measurement runs for at least this long */
+#define BENCH_JSON_TIME	500000000ULL
+
+/* A received switch code as it is broadcasted */
+static const char *bench_json_switch =
+	"{\"message\":{\"id\":92,\"unit\":0,\"state\":\"on\"},\"origin\":\"receiver\","
+	"\"protocol\":\"arctech_switch\",\"uuid\":\"0000-b8-27-eb-0f3db7\",\"repeats\":1}";
+
+/* A weather update of a device as it is sent to the clients */
+static const char *bench_json_weather =
+	"{\"origin\":\"update\",\"type\":3,\"uuid\":\"0000-b8-27-eb-0f3db7\",\"devices\":[\"weather\"],"
+	"\"values\":{\"timestamp\":1484394556,\"location\":\"amsterdam\",\"country\":\"nl\","
+	"\"temperature\":-2.35,\"humidity\":93.00,\"sunrise\":8.46,\"sunset\":16.58,"
+	"\"sun\":\"set\",\"update\":0}}";
+
+typedef struct bench_json_stats_t {
+	unsigned long n;
+	unsigned long allocs;
+	uint64_t elapsed;
+} bench_json_stats_t;
+
+/*
+ * The values of all devices, as requested by a client
+ * right after it connected.
+ */
+static struct JsonNode *bench_values(int nrdevices) {
+	struct JsonNode *jroot = json_mkarray();
+	struct JsonNode *jvalue = NULL, *jdevices = NULL, *jvalues = NULL;
+	char name[64];
+	int i = 0;
+
+	for(i=0;i<nrdevices;i++) {
+		jvalue = json_mkobject();
+		jdevices = json_mkarray();
+		jvalues = json_mkobject();
+		snprintf(name, sizeof(name), "dimmer%d", i);
+		json_append_element(jdevices, json_mkstring(name));
+		json_append_member(jvalues, "timestamp", json_mknumber(1484394556 + i, 0));
+		json_append_member(jvalues, "state", json_mkstring((i % 2 == 0) ? "on" : "off"));
+		json_append_member(jvalues, "dimlevel", json_mknumber(i % 16, 0));
+		json_append_member(jvalue, "type", json_mknumber(1, 0));
+		json_append_member(jvalue, "devices", jdevices);
+		json_append_member(jvalue, "values", jvalues);
+		json_append_element(jroot, jvalue);
+	}
+	return jroot;
+}
+
+static unsigned long bench_json_lookup(struct JsonNode *jnode) {
+	struct JsonNode *jchild = NULL;
+	unsigned long n = 0;
+
+	jchild = json_first_child(jnode);
+	while(jchild) {
+		if(jnode->tag == JSON_OBJECT && json_find_member(jnode, jchild->key) != NULL) {
+			n++;
+		}
+		n += bench_json_lookup(jchild);
+		jchild = jchild->next;
+	}
+	return n;
+}
+
+static void bench_json_write(void *userdata, const char *buf, size_t len) {
+	*(size_t *)userdata += len;
+}
+
+static double bench_json_rate(struct bench_json_stats_t *stats, double size) {
+	if(stats->elapsed == 0) {
+		return 0.0;
+	}
+	return (double)stats->n*size*1000000000.0/(double)stats->elapsed;
+}
+
+/*
+ * Change a few bytes of the document into other json tokens,
+ * so the parser also takes its error paths. A simple LCG
+ * keeps the mutations the same between runs.
+ */
+static void bench_json_mutate(char *buf, const char *content, size_t len, unsigned int *seed) {
+	static const char tokens[] = "{}[]\":,0123456789.-etrufalsn\\ ";
+	int i = 0, x = 0;
+
+	memcpy(buf, content, len+1);
+	x = 1 + (int)((*seed >> 16) % 4);
+	for(i=0;i<x;i++) {
+		*seed = *seed * 1103515245U + 12345U;
+		buf[(*seed >> 8) % len] = tokens[(*seed >> 16) % (sizeof(tokens)-1)];
+	}
+}
+
+static void bench_json(const char *name, const char *content) {
+	struct bench_json_stats_t decode, arena, encode, stream, lookup, fuzz;
+	struct JsonNode *jroot = NULL;
+	unsigned long allocs = 0, lookups = 0, valid = 0;
+	unsigned int seed = 1;
+	uint64_t begin = 0;
+	size_t len = strlen(content), streamed = 0;
+	char *out = NULL, *buf = NULL;
+
+	if(len == 0 || (jroot = json_decode(content)) == NULL) {
+		logprintf(LOG_ERR, "%s is not in a valid json format", name);
+		return;
+	}
+	json_delete(jroot);
+
+	memset(&decode, 0, sizeof(decode));
+	allocs = json_allocs();
+	begin = uv_hrtime();
+	do {
+		jroot = json_decode(content);
+		json_delete(jroot);
+		decode.n++;
+	} while((decode.elapsed = uv_hrtime() - begin) < BENCH_JSON_TIME);
+	decode.allocs = json_allocs() - allocs;
+
+	memset(&arena, 0, sizeof(arena));
+	allocs = json_allocs();
+	begin = uv_hrtime();
+	do {
+		jroot = json_decode_arena(content);
+		json_delete(jroot);
+		arena.n++;
+	} while((arena.elapsed = uv_hrtime() - begin) < BENCH_JSON_TIME);
+	arena.allocs = json_allocs() - allocs;
+
+	jroot = json_decode(content);
+
+	memset(&encode, 0, sizeof(encode));
+	allocs = json_allocs();
+	begin = uv_hrtime();
+	do {
+		out = json_stringify(jroot, NULL);
+		json_free(out);
+		encode.n++;
+	} while((encode.elapsed = uv_hrtime() - begin) < BENCH_JSON_TIME);
+	encode.allocs = json_allocs() - allocs;
+
+	memset(&stream, 0, sizeof(stream));
+	begin = uv_hrtime();
+	do {
+		json_stream(jroot, bench_json_write, &streamed);
+		stream.n++;
+	} while((stream.elapsed = uv_hrtime() - begin) < BENCH_JSON_TIME);
+
+	memset(&lookup, 0, sizeof(lookup));
+	begin = uv_hrtime();
+	do {
+		lookups += bench_json_lookup(jroot);
+		lookup.n++;
+	} while((lookup.elapsed = uv_hrtime() - begin) < BENCH_JSON_TIME);
+
+	json_delete(jroot);
+
+	if((buf = MALLOC(len+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(&fuzz, 0, sizeof(fuzz));
+	begin = uv_hrtime();
+	do {
+		bench_json_mutate(buf, content, len, &seed);
+		if(json_validate(buf) == true) {
+			jroot = json_decode(buf);
+			json_delete(jroot);
+			valid++;
+		}
+		fuzz.n++;
+	} while((fuzz.elapsed = uv_hrtime() - begin) < BENCH_JSON_TIME);
+	FREE(buf);
+
+	printf("%-10s %10lu %10.2f %10.2f %10.2f %10.2f %14.0f %10.2f %10.2f %10.2f %10.2f %10.2f\n",
+		name, (unsigned long)len,
+		bench_json_rate(&decode, (double)len)/1000000.0,
+		bench_json_rate(&arena, (double)len)/1000000.0,
+		bench_json_rate(&encode, (double)len)/1000000.0,
+		bench_json_rate(&stream, (double)len)/1000000.0,
+		(lookup.elapsed > 0) ? (double)lookups*1000000000.0/(double)lookup.elapsed : 0.0,
+		(double)decode.allocs/(double)decode.n,
+		(double)arena.allocs/(double)arena.n,
+		(double)encode.allocs/(double)encode.n,
+		bench_json_rate(&fuzz, (double)len)/1000000.0,
+		(double)valid*100.0/(double)fuzz.n);
+}
+
+static void bench_json_all(char *file, int nrdevices, int nrrules) {
+	struct JsonNode *jroot = NULL;
+	char *content = NULL;
+
+	printf("%-10s %10s %10s %10s %10s %10s %14s %10s %10s %10s %10s %10s\n",
+		"document", "bytes", "decode", "arena", "encode", "stream", "lookups/s", "allocs", "allocs", "allocs", "fuzz", "valid");
+	printf("%-10s %10s %10s %10s %10s %10s %14s %10s %10s %10s %10s %10s\n",
+		"", "", "MB/s", "MB/s", "MB/s", "MB/s", "", "decode", "arena", "encode", "MB/s", "%");
+
+	json_count_allocs(1);
+
+	jroot = bench_config(nrdevices, nrrules);
+	content = json_stringify(jroot, "\t");
+	json_delete(jroot);
+	bench_json("config", content);
+	json_free(content);
+
+	jroot = bench_values(nrdevices);
+	content = json_stringify(jroot, NULL);
+	json_delete(jroot);
+	bench_json("values", content);
+	json_free(content);
+
+	bench_json("weather", bench_json_weather);
+	bench_json("switch", bench_json_switch);
+
+	if(file != NULL) {
+		if(file_get_contents(file, &content) == 0) {
+			bench_json("file", content);
+			FREE(content);
+		}
+	}
+
+	json_count_allocs(0);
+}
+
+static void bench_report(uint64_t elapsed, unsigned long replayed) {
+	struct bench_stats_t *tmp = stats;
+	double validate = 0.0, parse = 0.0;
+
+	printf("%lu trains replayed in %.3f seconds, %.0f trains per second\n\n",
+		replayed, (double)elapsed/1000000000.0, (elapsed > 0) ? (double)replayed*1000000000.0/(double)elapsed : 0.0);
+	printf("%-24s %10s %10s %10s %14s %14s %10s %10s\n",
+		"protocol", "validated", "hits", "false", "validate/s", "parse/s", "allocs", "nodes");
+
+	while(tmp) {
+		validate = (tmp->validate > 0) ? (double)tmp->validated*1000000000.0/(double)tmp->validate : 0.0;
+		parse = (tmp->parse > 0) ? (double)tmp->parsed*1000000000.0/(double)tmp->parse : 0.0;
+		printf("%-24s %10lu %10lu %10lu %14.0f %14.0f %10.2f %10.2f\n",
+			tmp->protocol->id, tmp->validated, tmp->hits, tmp->misses, validate, parse,
+			(tmp->hits > 0) ? (double)tmp->allocs/(double)tmp->hits : 0.0,
+			(tmp->hits > 0) ? (double)tmp->nodes/(double)tmp->hits : 0.0);
+		tmp = tmp->next;
+	}
+}
+
+int main(int argc, char **argv) {
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	memcpy((void *)&pth_main_id, &pth_cur_id, sizeof(uv_thread_t));
+
+	struct options_t *options = NULL;
+	struct protocol_t *expected = NULL;
+	struct protocols_t *pnode = NULL;
+	char *file = NULL, *name = NULL;
+	int help = 0, rate = 0, repeat = 1, i = 0, x = 0;
+	int nrdevices = 100, nrrules = 100, nrupdates = 10000;
+	unsigned long replayed = 0;
+	uint64_t begin = 0, next = 0, now = 0;
+
+	pilight.process = PROCESS_CLIENT;
+
+	log_shell_enable();
+	log_file_disable();
+	log_level_set(LOG_NOTICE);
+
+	if((progname = MALLOC(14)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	strcpy(progname, "pilight-bench");
+
+	options_add(&options, "H", "help", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, "V", "version", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, "F", "file", OPTION_HAS_VALUE, 0, JSON_STRING, NULL, NULL);
+	options_add(&options, "r", "rate", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "n", "repeat", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "p", "protocol", OPTION_HAS_VALUE, 0, JSON_STRING, NULL, NULL);
+	options_add(&options, "E", "events", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, "J", "json", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, "d", "devices", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "R", "rules", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "u", "updates", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "Ls", "storage-root", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, "Ll", "lua-root", OPTION_HAS_VALUE, 0, JSON_NULL, NULL, NULL);
+
+	if(options_parse(options, argc, argv) == -1) {
+		help = 1;
+	}
+	if(options_exists(options, "F") != 0 && options_exists(options, "V") != 0 &&
+	   options_exists(options, "E") != 0 && options_exists(options, "J") != 0) {
+		help = 1;
+	}
+
+	if(options_exists(options, "H") == 0 || help == 1) {
+		printf("Usage: %s [options]\n", progname);
+		printf("\t -H --help\t\t\tdisplay usage summary\n");
+		printf("\t -V --version\t\t\tdisplay version\n");
+		printf("\t -F --file=file\t\t\tfile with the recorded pulse trains\n");
+		printf("\t -r --rate=trains\t\ttrains per second, 0 replays as fast as possible\n");
+		printf("\t -n --repeat=times\t\tnumber of times the file is replayed\n");
+		printf("\t -p --protocol=protocol\t\tprotocol of the recording, other matches are false\n");
+		printf("\t -E --events\t\t\tbenchmark the rules instead of the protocols\n");
+		printf("\t -J --json\t\t\tbenchmark the json codec, including the json in file\n");
+		printf("\t -d --devices=number\t\tnumber of generated devices\n");
+		printf("\t -R --rules=number\t\tnumber of generated rules\n");
+		printf("\t -u --updates=number\t\tnumber of device updates\n");
+		printf("\t -Ls --storage-root=xxxx\tlocation of the storage lua modules\n");
+		printf("\t -Ll --lua-root=xxxx\t\tlocation of the plain lua modules\n");
+		goto close;
+	}
+
+	if(options_exists(options, "V") == 0) {
+		printf("%s v%s\n", progname, PILIGHT_VERSION);
+		goto close;
+	}
+
+	if(options_exists(options, "d") == 0) {
+		options_get_number(options, "d", &nrdevices);
+	}
+	if(options_exists(options, "R") == 0) {
+		options_get_number(options, "R", &nrrules);
+	}
+	if(options_exists(options, "u") == 0) {
+		options_get_number(options, "u", &nrupdates);
+	}
+	if(nrdevices <= 0 || nrrules <= 0 || nrupdates <= 0) {
+		logprintf(LOG_ERR, "the number of devices, rules and updates must be larger than 0");
+		goto close;
+	}
+
+	if(options_exists(options, "J") == 0) {
+		options_get_string(options, "F", &file);
+		bench_json_all(file, nrdevices, nrrules);
+		goto close;
+	}
+
+	if(options_exists(options, "E") == 0) {
+#ifdef EVENTS
+		if(options_exists(options, "Ls") == 0) {
+			char *arg = NULL;
+			options_get_string(options, "Ls", &arg);
+			if(config_root(arg) == -1) {
+				logprintf(LOG_ERR, "%s is not valid storage lua modules path", arg);
+				goto close;
+			}
+		}
+		if(options_exists(options, "Ll") == 0) {
+			options_get_string(options, "Ll", &lua_root);
+		}
+		bench_events(nrdevices, nrrules, nrupdates);
+#else
+		logprintf(LOG_ERR, "pilight was compiled without events");
+#endif
+		goto close;
+	}
+
+	options_get_string(options, "F", &file);
+	if(options_exists(options, "r") == 0) {
+		options_get_number(options, "r", &rate);
+	}
+	if(options_exists(options, "n") == 0) {
+		options_get_number(options, "n", &repeat);
+	}
+
+	protocol_init();
+
+	if(options_exists(options, "p") == 0) {
+		options_get_string(options, "p", &name);
+		pnode = protocols;
+		while(pnode) {
+			if(strcmp(pnode->listener->id, name) == 0) {
+				expected = pnode->listener;
+				break;
+			}
+			pnode = pnode->next;
+		}
+		if(expected == NULL) {
+			logprintf(LOG_ERR, "protocol %s does not exist", name);
+			goto close;
+		}
+	}
+
+	if(bench_read(file) != 0) {
+		goto close;
+	}
+	if(nrframes == 0) {
+		logprintf(LOG_ERR, "%s does not contain any pulse trains", file);
+		goto close;
+	}
+
+	/* Count every allocation made by the protocols */
+	memprofile(1);
+
+	begin = uv_hrtime();
+	next = begin;
+	for(x=0;x<repeat;x++) {
+		for(i=0;i<nrframes;i++) {
+			if(rate > 0) {
+				next += 1000000000ULL/(uint64_t)rate;
+				while((now = uv_hrtime()) < next) {
+					if(next - now > 1000000) {
+						usleep((unsigned int)((next - now) / 1000));
+					}
+				}
+			}
+			bench_frame(&frames[i], expected);
+			replayed++;
+		}
+	}
+
+	memprofile(0);
+	bench_report(uv_hrtime() - begin, replayed);
+
+close:
+	options_delete(options);
+	main_gc();
+
+	return (EXIT_SUCCESS);
+}
@@ -51,14 +51,12 @@ int main(int argc, char **argv) {
 
 	atomicinit();
 	struct options_t *options = NULL;
-	struct ssdp_list_t *ssdp_list = NULL;
-	struct devices_t *dev = NULL;
 	struct JsonNode *json = NULL;
-	struct JsonNode *tmp = NULL;
-	char *recvBuff = NULL, *message = NULL, *output = NULL;
+	struct JsonNode *jcode = NULL;
+	char *recvBuff = NULL, *status = NULL, *error = NULL, *output = NULL;
 	char *device = NULL, *state = NULL, *values = NULL;
 	char *server = NULL, *configtmp = CONFIG_FILE;
-	int has_values = 0, sockfd = 0, hasconfarg = 0;
+	int sockfd = 0, hasconfarg = 0;
 	int port = 0, showhelp = 0, showversion = 0;
 
 	log_file_disable();
@@ -165,17 +163,11 @@ int main(int argc, char **argv) {
 			logprintf(LOG_ERR, "could not connect to pilight-daemon");
 			goto close;
 		}
-	} else if(ssdp_seek(&ssdp_list) == -1) {
+	} else if((sockfd = socket_connect_local(SOCKET_LOCAL)) > 0) {
+		logprintf(LOG_DEBUG, "connected to the local pilight-daemon");
+	} else if((sockfd = ssdp_connect()) == -1) {
 		logprintf(LOG_NOTICE, "no pilight ssdp connections found");
 		goto close;
-	} else {
-		if((sockfd = socket_connect(ssdp_list->ip, ssdp_list->port)) == -1) {
-			logprintf(LOG_ERR, "could not connect to pilight-daemon");
-			goto close;
-		}
-	}
-	if(ssdp_list) {
-		ssdp_free(ssdp_list);
 	}
 
 	if(options_exists(options, "Ll") == 0) {
@@ -217,126 +209,63 @@ int main(int argc, char **argv) {
 		goto close;
 	}
 
+	/*
+	 * The daemon validates the device, state and values itself,
+	 * so the config doesn't have to be requested.
+	 */
+	jcode = json_mkobject();
+	json_append_member(jcode, "device", json_mkstring(device));
+	json_append_member(jcode, "state", json_mkstring(state));
+
+	if(values != NULL) {
+		struct JsonNode *jvalues = json_mkobject();
+		char *sptr = NULL;
+		char *ptr1 = strtok_r(values, ",", &sptr);
+		while(ptr1) {
+			char **array = NULL;
+			int n = explode(ptr1, "=", &array);
+			if(n != 2) {
+				array_free(&array, n);
+				logprintf(LOG_ERR, "\"%s\" requires a name=value format", ptr1);
+				json_delete(jvalues);
+				json_delete(jcode);
+				goto close;
+			}
+			if(isNumeric(array[1]) == EXIT_SUCCESS) {
+				json_append_member(jvalues, array[0], json_mknumber(atof(array[1]), nrDecimals(array[1])));
+			} else {
+				json_append_member(jvalues, array[0], json_mkstring(array[1]));
+			}
+			array_free(&array, n);
+			ptr1 = strtok_r(NULL, ",", &sptr);
+		}
+		json_append_member(jcode, "values", jvalues);
+	}
+
 	json = json_mkobject();
-	json_append_member(json, "action", json_mkstring("request config"));
+	json_append_member(json, "action", json_mkstring("control"));
+	json_append_member(json, "validate", json_mknumber(1, 0));
+	json_append_member(json, "code", jcode);
 	output = json_stringify(json, NULL);
 	socket_write(sockfd, output);
 	json_free(output);
 	json_delete(json);
+	json = NULL;
 
-	if(socket_read(sockfd, &recvBuff, 0) == 0) {
-		if(json_validate(recvBuff) == true) {
-			json = json_decode(recvBuff);
-			if(json_find_string(json, "message", &message) == 0) {
-				if(strcmp(message, "config") == 0) {
-					struct JsonNode *jconfig = NULL;
-					if((jconfig = json_find_member(json, "config")) != NULL) {
-						int match = 1;
-						while(match) {
-							struct JsonNode *jchilds = json_first_child(jconfig);
-							match = 0;
-							while(jchilds) {
-								if(strcmp(jchilds->key, "devices") != 0) {
-									json_remove_from_parent(jchilds);
-									tmp = jchilds;
-									match = 1;
-								}
-								jchilds = jchilds->next;
-								if(tmp != NULL) {
-									json_delete(tmp);
-								}
-								tmp = NULL;
-							}
-						}
-
-						struct JsonNode *jnode = json_find_member(jconfig, "devices");
-						config_devices_parse(jnode);
-						if(devices_get(device, &dev) == 0) {
-							JsonNode *joutput = json_mkobject();
-							JsonNode *jcode = json_mkobject();
-							JsonNode *jvalues = json_mkobject();
-							json_append_member(jcode, "device", json_mkstring(device));
-
-							if(values != NULL) {
-								char *sptr = NULL;
-								char *ptr1 = strtok_r(values, ",", &sptr);
-								while(ptr1) {
-									char **array = NULL;
-									int n = explode(ptr1, "=", &array), q = 0;
-									if(n == 2) {
-										char *name = MALLOC(strlen(array[0])+1);
-										if(name == NULL) {
-											logprintf(LOG_ERR, "out of memory\n");
-											exit(EXIT_FAILURE);
-										}
-										strcpy(name, array[q]);
-										char *val = MALLOC(strlen(array[q+1])+1);
-										if(val == NULL) {
-											logprintf(LOG_ERR, "out of memory\n");
-											exit(EXIT_FAILURE);
-										}
-										strcpy(val, array[1]);
-										if(devices_valid_value(device, name, val) == 0) {
-											if(isNumeric(val) == EXIT_SUCCESS) {
-												json_append_member(jvalues, name, json_mknumber(atof(val), nrDecimals(val)));
-											} else {
-												json_append_member(jvalues, name, json_mkstring(val));
-											}
-											has_values = 1;
-											FREE(name);
-											FREE(values);
-											array_free(&array, n);
-										} else {
-											logprintf(LOG_ERR, "\"%s\" is an invalid value for device \"%s\"", name, device);
-											array_free(&array, n);
-											FREE(name);
-											FREE(values);
-											json_delete(json);
-											goto close;
-										}
-									} else {
-										array_free(&array, n);
-										logprintf(LOG_ERR, "\"%s\" requires a name=value format", ptr1);
-										break;
-									}
-									ptr1 = strtok_r(NULL, ",", &sptr);
-								}
-							}
-
-							if(devices_valid_state(device, state) == 0) {
-								json_append_member(jcode, "state", json_mkstring(state));
-							} else {
-								logprintf(LOG_ERR, "\"%s\" is an invalid state for device \"%s\"", state, device);
-								json_delete(json);
-								goto close;
-							}
-
-							if(has_values == 1) {
-								json_append_member(jcode, "values", jvalues);
-							} else {
-								json_delete(jvalues);
-							}
-							json_append_member(joutput, "action", json_mkstring("control"));
-							json_append_member(joutput, "code", jcode);
-							output = json_stringify(joutput, NULL);
-							socket_write(sockfd, output);
-							json_free(output);
-							json_delete(joutput);
-							if(socket_read(sockfd, &recvBuff, 0) != 0
-							   || strcmp(recvBuff, "{\"status\":\"success\"}") != 0) {
-								logprintf(LOG_ERR, "failed to control %s", device);
-							}
-						} else {
-							logprintf(LOG_ERR, "the device \"%s\" does not exist", device);
-							json_delete(json);
-							goto close;
-						}
-					}
-				}
-			}
-			json_delete(json);
+	if(socket_read(sockfd, &recvBuff, 0) != 0 || json_validate(recvBuff) != true) {
+		logprintf(LOG_ERR, "failed to control %s", device);
+		goto close;
+	}
+	json = json_decode(recvBuff);
+	if(json_find_string(json, "status", &status) != 0 || strcmp(status, "success") != 0) {
+		if(json_find_string(json, "error", &error) == 0) {
+			logprintf(LOG_ERR, "%s", error);
+		} else {
+			logprintf(LOG_ERR, "failed to control %s", device);
 		}
 	}
+	json_delete(json);
+
 close:
 	if(recvBuff) {
 		FREE(recvBuff);
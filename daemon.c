@@ -37,6 +37,7 @@
 	#include <netinet/tcp.h>
 	#include <netdb.h>
 	#include <arpa/inet.h>
+	#include <sys/mman.h>
 	#ifdef __mips__
 		#define __USE_UNIX98
 	#endif
@@ -61,17 +62,30 @@
 #include "libs/pilight/core/ssl.h"
 #include "libs/pilight/core/options.h"
 #include "libs/pilight/core/socket.h"
+#include "libs/pilight/core/compact.h"
 #include "libs/pilight/core/json.h"
 #include "libs/pilight/core/ssdp.h"
 #include "libs/pilight/core/dso.h"
 #include "libs/pilight/core/firmware.h"
 #include "libs/pilight/core/proc.h"
 #include "libs/pilight/core/ntp.h"
+#include "libs/pilight/core/metrics.h"
+#include "libs/pilight/core/trace.h"
+#include "libs/pilight/core/profile.h"
+#include "libs/pilight/core/rawtap.h"
+#include "libs/pilight/core/devtable.h"
+#include "libs/pilight/core/capture.h"
+#include "libs/pilight/core/stage.h"
+#include "libs/pilight/core/pulsepool.h"
+#include "libs/pilight/core/ping.h"
+#include "libs/pilight/core/gpiomem.h"
 #include "libs/pilight/config/config.h"
 #include "libs/pilight/lua_c/lua.h"
 
 #ifdef EVENTS
 	#include "libs/pilight/events/events.h"
+	#include "libs/pilight/events/transition.h"
+	#include "libs/pilight/events/storm.h"
 #endif
 
 #ifdef WEBSERVER
@@ -86,6 +100,8 @@
 #include "libs/pilight/config/devices.h"
 #include "libs/pilight/config/settings.h"
 #include "libs/pilight/config/gui.h"
+#include "libs/pilight/config/journal.h"
+#include "libs/pilight/config/history.h"
 
 static uv_signal_t **signal_req = NULL;
 static int signals[5] = { SIGINT, SIGQUIT, SIGTERM, SIGABRT, SIGTSTP };
@@ -96,6 +112,19 @@ static uv_timer_t *timer_stats_req = NULL;
 static char server_name[40];
 #endif
 
+/* How far the replicated changes of another master were received */
+typedef struct replica_origin_t {
+	char uuid[UUID_LENGTH+1];
+	unsigned long epoch;
+	unsigned long seq;
+	unsigned long timestamp;
+	/* Latest change replayed so far, only taken once all of them were */
+	unsigned long catchup;
+	struct replica_origin_t *next;
+} replica_origin_t;
+
+static struct replica_origin_t *replica_origins = NULL;
+
 typedef struct clients_t {
 	char uuid[UUID_LENGTH];
 	int id;
@@ -104,73 +133,255 @@ typedef struct clients_t {
 	int core;
 	int stats;
 	int forward;
+	int delta;
+	int seconds;
+	int clock;
 	char media[8];
+	/* Subscription to the config updates of some devices */
+	struct gui_filter_t *filter;
 	double cpu;
 	double ram;
+	/* Nodes that send their updates in compact frames */
+	int compact;
+	struct compact_dict_t *dict;
+	/* Masters that replicate their changes to us */
+	int replica;
+	struct replica_origin_t *origin;
+	/* Codes this node forwarded and how often it was the first */
+	struct metric_t *metric_heard;
+	struct metric_t *metric_first;
 	struct clients_t *next;
 } clients_t;
 
 static struct clients_t *clients = NULL;
 
+/* Numbers the config updates, so delta clients can notice a gap */
+static unsigned long broadcast_seq = 0;
+
+static int client_media_nr(const char *media) {
+	if(strcmp(media, "web") == 0) {
+		return 1;
+	} else if(strcmp(media, "mobile") == 0) {
+		return 2;
+	} else if(strcmp(media, "desktop") == 0) {
+		return 3;
+	}
+	return 0;
+}
+
+/*
+ * Check a config update against the subscription of a client
+ * before anything is cloned or serialized for it.
+ */
+static int client_subscribed(struct clients_t *client, int devtype, struct JsonNode *jdevices) {
+	struct JsonNode *jchild = NULL;
+
+	if(client->filter == NULL) {
+		return 1;
+	}
+	if(gui_filter_type(client->filter, devtype) == 0) {
+		return 0;
+	}
+	if(jdevices == NULL) {
+		return 1;
+	}
+	jchild = json_first_child(jdevices);
+	while(jchild) {
+		if(jchild->tag == JSON_STRING && gui_filter_device(client->filter, jchild->string_) == 1) {
+			return 1;
+		}
+		jchild = jchild->next;
+	}
+	return 0;
+}
+
+static void client_send_delta_ids(int sd) {
+	struct JsonNode *jsend = json_mkobject();
+	json_append_member(jsend, "message", json_mkstring("delta"));
+	json_append_member(jsend, "seq", json_mknumber((double)broadcast_seq, 0));
+	devices_delta_ids(jsend);
+	char *output = json_stringify(jsend, NULL);
+	socket_write(sd, output);
+	json_free(output);
+	json_delete(jsend);
+}
+
+/*
+ * Codes are not sent in plain FIFO order. A new code for the
+ * same protocol and device id replaces a pending one, codes
+ * from clients go before rule actions, and those go before all
+ * others. A code only gets SEND_REPEAT_CHUNK repeats at a time
+ * while other codes of the same priority are waiting, so the
+ * repeats of several devices are interleaved.
+ */
+#define SEND_REPEAT_CHUNK	4
+
 typedef struct sendqueue_t {
 	unsigned int id;
-	char *protoname;
 	char *settings;
 	char *message;
+	char *key;
 	enum origin_t origin;
 	struct protocol_t *protopt;
-	int code[MAXPULSESTREAMLENGTH];
+	/* Of the pulse pool, so the room it takes fits the code */
+	int *code;
 	int length;
+	int priority;
+	int repeats;
+	int sent;
+	/* The bulk control this code is part of, if any */
+	unsigned int batch;
 	char uuid[UUID_LENGTH];
 	struct sendqueue_t *next;
 } sendqueue_t;
 
-static struct sendqueue_t *sendqueue;
-static struct sendqueue_t *sendqueue_head;
+/*
+ * Every hardware type, so every radio band, has its own
+ * queue and sender thread, so transmissions on independent
+ * radios overlap. Codes for a hardware type without its own
+ * sender go through the sender of NONE. All queues share
+ * the send queue lock.
+ */
+#define NRSENDERS	(API+1)
+
+typedef struct sender_t {
+	int active;
+	struct sendqueue_t *first;
+	struct sendqueue_t *last;
+	int number;
+	int done;
+	int sending;
+	pthread_cond_t signal;
+} sender_t;
+
+static struct sender_t senders[NRSENDERS];
+
+/*
+ * The stages of the pipeline. Received pulse trains are
+ * decoded by the receive parsers, the messages they make
+ * update the devices and are broadcasted by the broadcaster,
+ * which hands them to the rules. The receiver threads run at
+ * realtime priority, so they never wait for room in the
+ * receive stage. The pulses of a train are kept in a buffer of
+ * the pulse pool that fits them, see pulsepool.c.
+ */
+#define RECVQUEUE_SIZE	256
+#define BCQUEUE_SIZE		1024
+/* How long a message may wait for room in the broadcast stage */
+#define BCQUEUE_WAIT		10
 
 typedef struct recvqueue_t {
-	int raw[MAXPULSESTREAMLENGTH];
-	int rawlen;
 	int hwtype;
 	int plslen;
-	struct recvqueue_t *next;
+	struct trace_t trace;
+	struct pulsetrain_t code;
 } recvqueue_t;
 
-static struct recvqueue_t *recvqueue;
-static struct recvqueue_t *recvqueue_head;
+static struct stage_t recvstage;
+static volatile unsigned int recvqueue_overflow = 0;
+static unsigned short recvqueue_init = 0;
 
 static pthread_mutex_t config_lock;
 static pthread_mutexattr_t config_attr;
 
 static pthread_mutex_t sendqueue_lock;
-static pthread_cond_t sendqueue_signal;
 static pthread_mutexattr_t sendqueue_attr;
 static unsigned short sendqueue_init = 0;
 
-static int sendqueue_number = 0;
-static int recvqueue_number = 0;
-
-static pthread_mutex_t recvqueue_lock;
-static pthread_cond_t recvqueue_signal;
-static pthread_mutexattr_t recvqueue_attr;
-static unsigned short recvqueue_init = 0;
-
 typedef struct bcqueue_t {
 	struct JsonNode *jmessage;
+	/* The interned protocol, the name only when it has no handle */
+	unsigned int protocol;
 	char *protoname;
 	enum origin_t origin;
-	struct bcqueue_t *next;
+	struct trace_t trace;
+	unsigned int batch;
+	int mark;
+	/* The device of a coalesced update */
+	char *key;
+	struct bcqueue_t *pending;
+	/* Where a received code came from, for the receiver filters */
+	int hwtype;
+	int plslen;
 } bcqueue_t;
 
-static struct bcqueue_t *bcqueue;
-static struct bcqueue_t *bcqueue_head;
-
-static pthread_mutex_t bcqueue_lock;
-static pthread_cond_t bcqueue_signal;
-static pthread_mutexattr_t bcqueue_attr;
+static struct stage_t bcstage;
 static unsigned short bcqueue_init = 0;
 
-static int bcqueue_number = 0;
+/*
+ * An update of a measuring device, like a weather station,
+ * that is still waiting in the broadcast stage is replaced in
+ * place by a newer update of the same device. The device keeps
+ * its place in the stage, so the updates of different devices
+ * are still broadcasted in order. Updates the rules and clients
+ * can't miss, like those of sent codes, are never coalesced and
+ * wait for room instead of being dropped.
+ */
+#define BCPENDING_SIZE	256
+
+static struct bcqueue_t *bcpending[BCPENDING_SIZE];
+static pthread_mutex_t bcpending_lock = PTHREAD_MUTEX_INITIALIZER;
+static int bcqueue_coalesce = 1;
+static struct metric_t *metric_bcqueue_coalesced = NULL;
+
+/*
+ * An overloaded daemon sheds its work in steps, the work that
+ * is missed least goes first. A step is taken every round of
+ * the stats the cpu or the stages stay busy, and given back
+ * every round they are calm. Only the last step lets the
+ * watchdog abort the daemon.
+ */
+#define SHED_NONE					0
+/* No debug logging, no trains of a length no protocol takes */
+#define SHED_QUIET				1
+/* Coalesce the updates of all sensors, whatever the setting */
+#define SHED_COALESCE			2
+/* Only one in every few updates of a sensor goes to the gui */
+#define SHED_SAMPLE				3
+#define SHED_ABORT				4
+#define SHED_SAMPLE_RATE	4
+#define SHED_SAMPLES			64
+
+static volatile int shed_level = SHED_NONE;
+static unsigned char shed_samples[SHED_SAMPLES];
+static struct metric_t *metric_shed_level = NULL;
+static struct metric_t *metric_shed_noise = NULL;
+static struct metric_t *metric_shed_sampled = NULL;
+
+/*
+ * The codes of a bulk control, like a scene, are sent as one
+ * batch. Their config updates are held back until the last
+ * code of the batch was sent and are then broadcasted at once,
+ * updates with the same values as a single update of all their
+ * devices. The broadcast thread keeps track of the batches,
+ * codes that won't be broadcasted are marked as skipped in the
+ * broadcast queue. A batch that didn't complete in time is
+ * broadcasted as far as it got.
+ */
+#define BATCH_TIMEOUT	10
+/* Merged updates stay within what the webserver relays */
+#define BATCH_MSG_MAX	1000
+
+#define BATCH_UPDATE	0
+#define BATCH_SKIP		1
+#define BATCH_CLOSE		2
+
+typedef struct batch_t {
+	unsigned int id;
+	/* Codes queued, but not broadcasted yet */
+	int codes;
+	int closed;
+	time_t stamp;
+	struct JsonNode *jupdates;
+	struct batch_t *next;
+} batch_t;
+
+static struct batch_t *batches = NULL;
+static unsigned int batch_ids = 0;
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct metric_t *metric_sendqueue_depth = NULL;
+static struct metric_t *metric_receive_duplicates = NULL;
 
 static struct protocol_t *procProtocol;
 
@@ -186,8 +397,6 @@ static int stacktracer = 0;
 static int threadprofiler = 0;
 /* Are we already running */
 static int running = 1;
-/* Are we currently sending code */
-static int sending = 0;
 /* Socket identifier to the server if we are running as client */
 static int sockfd = 0;
 /* Thread pointers */
@@ -203,6 +412,37 @@ static char *master_server = NULL;
 static int master_port = 0;
 
 static int adhoc_pending = 0;
+/* Milliseconds a node waits before reconnecting */
+#define NODE_BACKOFF_MIN	250
+#define NODE_BACKOFF_MAX	30000
+
+/*
+ * A node talks compact frames to its master once the master
+ * accepted them. The strings sent so far are remembered in
+ * the dictionary, which starts empty on every connection.
+ */
+static int node_compact = 0;
+static int compact_refused = 0;
+static int adhoc_raw = 0;
+static struct compact_dict_t node_dict;
+static struct compact_buf_t node_buf;
+static pthread_mutex_t node_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The changes of the device states are pushed to the master
+ * set as replication-peer, in compact frames numbered within
+ * the epoch of this run. The peer tells up to where it has
+ * the stream when we connect, so only what it missed is
+ * replayed from the journal.
+ */
+static char *replica_peer = NULL;
+static unsigned short replica_port = 0;
+static int replica_fd = 0;
+static unsigned long replica_epoch = 0;
+static unsigned long replica_seq = 0;
+static struct compact_dict_t replica_dict;
+static struct compact_buf_t replica_buf;
+static pthread_mutex_t replica_lock = PTHREAD_MUTEX_INITIALIZER;
 static char *configtmp = NULL;
 static int verbosity = LOG_INFO;
 struct socket_callback_t socket_callback;
@@ -234,6 +474,7 @@ static void *reason_forward_free(void *param) {
 
 static void *reason_send_code_free(void *param) {
 	struct reason_send_code_t *data = param;
+	pulsepool_free(data->pulses);
 	FREE(data);
 	return NULL;
 }
@@ -267,166 +508,847 @@ static void client_remove(int id) {
 				prevP->next = currP->next;
 			}
 
+			gui_filter_free(&currP->filter);
+			if(currP->dict != NULL) {
+				compact_dict_clear(currP->dict);
+				FREE(currP->dict);
+			}
 			FREE(currP);
 			break;
 		}
 	}
 }
 
-static void broadcast_queue(char *protoname, struct JsonNode *json, enum origin_t origin) {
+static struct replica_origin_t *replica_origin(const char *uuid) {
+	struct replica_origin_t *tmp = replica_origins;
+
+	while(tmp) {
+		if(strcmp(tmp->uuid, uuid) == 0) {
+			return tmp;
+		}
+		tmp = tmp->next;
+	}
+	if((tmp = MALLOC(sizeof(struct replica_origin_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(tmp, 0, sizeof(struct replica_origin_t));
+	snprintf(tmp->uuid, sizeof(tmp->uuid), "%s", uuid);
+	tmp->next = replica_origins;
+	replica_origins = tmp;
+	return tmp;
+}
+
+/*
+ * Sends an update to the master, in a compact frame when
+ * the master accepted those. The json is left untouched.
+ */
+static void node_send_update(struct JsonNode *json) {
+	const unsigned char *frame = NULL;
+	struct JsonNode *jupdate = NULL;
+	char *out = NULL;
+	size_t len = 0;
+
+	pthread_mutex_lock(&node_lock);
+	if(node_compact == 1) {
+		compact_frame_init(&node_buf);
+		compact_encode(&node_dict, json, &node_buf);
+		frame = compact_frame(&node_buf, COMPACT_UPDATE, &len);
+		socket_write_frame(sockfd, frame, len);
+	} else {
+		jupdate = json_clone(json);
+		json_append_member(jupdate, "action", json_mkstring("update"));
+		out = json_stringify(jupdate, NULL);
+		socket_write(sockfd, out);
+		json_delete(jupdate);
+		json_free(out);
+	}
+	pthread_mutex_unlock(&node_lock);
+}
+
+/* Called with the replica lock held */
+static int replica_send(int fd, int flags, unsigned long timestamp, struct JsonNode *jupdate) {
+	const unsigned char *frame = NULL;
+	size_t len = 0;
+
+	compact_frame_init(&replica_buf);
+	compact_encode_replica(&replica_dict, flags, replica_epoch, replica_seq, timestamp, jupdate, &replica_buf);
+	frame = compact_frame(&replica_buf, COMPACT_REPLICA, &len);
+	return socket_write_frame(fd, frame, len);
+}
+
+/* Only the devices and their values are replicated */
+static struct JsonNode *replica_update(struct JsonNode *json) {
+	struct JsonNode *jupdate = json_mkobject();
+	struct JsonNode *jdevices = json_find_member(json, "devices");
+	struct JsonNode *jvalues = json_find_member(json, "values");
+	struct JsonNode *jtimestamp = NULL;
+
+	json_append_member(jupdate, "devices", (jdevices != NULL) ? json_clone(jdevices) : json_mkarray());
+	json_append_member(jupdate, "values", (jvalues != NULL) ? json_clone(jvalues) : json_mkobject());
+	/* The timestamp is part of the frame */
+	if((jtimestamp = json_find_member(json_find_member(jupdate, "values"), "timestamp")) != NULL) {
+		json_remove_from_parent(jtimestamp);
+		json_delete(jtimestamp);
+	}
+	return jupdate;
+}
+
+/*
+ * Pushes a change made here to the peer. Changes made while
+ * the peer can't be reached still get a number, so the peer
+ * knows it has to catch up.
+ */
+static void replica_push(struct JsonNode *jret) {
+	struct JsonNode *jupdate = NULL;
+	double timestamp = 0;
+
+	if(replica_peer == NULL) {
+		return;
+	}
+	json_find_number(json_find_member(jret, "values"), "timestamp", &timestamp);
+
+	pthread_mutex_lock(&replica_lock);
+	replica_seq++;
+	if(replica_fd > 0) {
+		jupdate = replica_update(jret);
+		if(replica_send(replica_fd, 0, (unsigned long)timestamp, jupdate) != 0) {
+			logprintf(LOG_NOTICE, "connection to replication peer lost");
+			shutdown(replica_fd, 2);
+			replica_fd = 0;
+		}
+		json_delete(jupdate);
+	}
+	pthread_mutex_unlock(&replica_lock);
+}
+
+static void replica_catchup_cb(struct JsonNode *jupdate, unsigned long timestamp, void *userdata) {
+	int *fd = userdata;
+
+	if(*fd > 0 && replica_send(*fd, COMPACT_REPLICA_CATCHUP, timestamp, jupdate) != 0) {
+		*fd = 0;
+	}
+}
+
+/*
+ * Replays the changes made at or after since, or all values
+ * when the journal doesn't go back that far. The last frame
+ * tells the peer where the stream continues. Called with the
+ * replica lock held, so nothing is pushed in between.
+ */
+static int replica_catchup(int fd, unsigned long since) {
+	struct JsonNode *jvalues = NULL, *jchild = NULL, *jupdate = NULL;
+	double timestamp = 0;
+	int nr = -1;
+
+	if(since > 0) {
+		nr = journal_since(since, replica_catchup_cb, &fd);
+	}
+	if(nr == -1) {
+		nr = 0;
+		jvalues = devices_values("all");
+		jchild = json_first_child(jvalues);
+		while(jchild && fd > 0) {
+			timestamp = 0;
+			json_find_number(json_find_member(jchild, "values"), "timestamp", &timestamp);
+			jupdate = replica_update(jchild);
+			replica_catchup_cb(jupdate, (unsigned long)timestamp, &fd);
+			json_delete(jupdate);
+			jchild = jchild->next;
+			nr++;
+		}
+		json_delete(jvalues);
+	}
+	if(fd <= 0 || replica_send(fd, COMPACT_REPLICA_CATCHUP, 0, NULL) != 0) {
+		return -1;
+	}
+	return nr;
+}
+
+/*
+ * Hands a received pulse train to the master to decode.
+ * Returns -1 when it has to be decoded here.
+ */
+static int node_send_pulses(int *pulses, int length, int hwtype) {
+	const unsigned char *frame = NULL;
+	size_t len = 0;
+	int ret = -1;
+
+	if(adhoc_raw == 0 || pilight.runmode != ADHOC || sockfd <= 0) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&node_lock);
+	if(node_compact == 1) {
+		compact_frame_init(&node_buf);
+		compact_encode_pulses(hwtype, pulses, length, &node_buf);
+		frame = compact_frame(&node_buf, COMPACT_PULSES, &len);
+		if(socket_write_frame(sockfd, frame, len) == 0) {
+			ret = 0;
+		}
+	}
+	pthread_mutex_unlock(&node_lock);
+
+	return ret;
+}
+
+/*
+ * The datetime devices update every second. Only the ticks
+ * that start a new minute are sent to all clients, the others
+ * only to clients identified with the seconds option. Clients
+ * identified without the clock option get no ticks at all, which
+ * is how the events client is set up, as the rules get every
+ * tick handed directly by the broadcaster.
+ */
+#define CLOCK_NONE		0
+#define CLOCK_MINUTE	1
+#define CLOCK_SECOND	2
+
+static int broadcast_clock(char *protoname, struct JsonNode *json) {
+	struct JsonNode *jcode = NULL;
+	double second = 0.0;
+
+	if(strcmp(protoname, "datetime") != 0) {
+		return CLOCK_NONE;
+	}
+	if((jcode = json_find_member(json, "message")) != NULL &&
+	   json_find_number(jcode, "second", &second) == 0 && (int)second != 0) {
+		return CLOCK_SECOND;
+	}
+	return CLOCK_MINUTE;
+}
+
+static int client_clock(struct clients_t *client, int tick) {
+	if(tick == CLOCK_NONE) {
+		return 1;
+	}
+	if(client->clock == 0) {
+		return 0;
+	}
+	return (tick == CLOCK_MINUTE || client->seconds == 1);
+}
+
+static void bcqueue_free(void *param) {
+	struct bcqueue_t *node = param;
+
+	if(node->protoname != NULL) {
+		FREE(node->protoname);
+	}
+	if(node->key != NULL) {
+		FREE(node->key);
+	}
+	json_delete(node->jmessage);
+}
+
+/*
+ * Received and polled values can be dropped when the stage is
+ * full. The firmware version is queued by the broadcaster
+ * itself, so it can't wait for room either.
+ */
+static int broadcast_critical(enum origin_t origin, unsigned int batch, int mark) {
+	if(batch != 0 || mark != BATCH_UPDATE) {
+		return 1;
+	}
+	/* PROTOCOL shares its value with FW */
+	switch(origin) {
+		case RECEIVER:
+		case HARDWARE:
+		case NODE:
+		case MASTER:
+		case STATS:
+		case FW:
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+/* The protocol and the id of the device an update is for */
+static char *broadcast_coalesce_key(char *protoname, struct JsonNode *json, enum origin_t origin) {
+	struct protocol_t *protocol = NULL;
+	struct options_t *opt = NULL;
+	struct JsonNode *jcode = NULL, *jid = NULL;
+	char *key = NULL, value[256];
+	size_t len = 0, n = 0;
+
+	if((bcqueue_coalesce == 0 && shed_level < SHED_COALESCE) || (origin != RECEIVER && origin != PROTOCOL)) {
+		return NULL;
+	}
+	if((protocol = protocol_device_get(protoname)) == NULL ||
+	   (protocol->devtype != WEATHER && (shed_level < SHED_COALESCE || protocol->hwtype != SENSOR))) {
+		return NULL;
+	}
+	if((jcode = json_find_member(json, "message")) == NULL || jcode->tag != JSON_OBJECT) {
+		return NULL;
+	}
+
+	len = strlen(protoname);
+	if((key = MALLOC(len+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	strcpy(key, protoname);
+
+	for(opt=protocol->options;opt!=NULL;opt=opt->next) {
+		if(opt->conftype != DEVICES_ID || (jid = json_find_member(jcode, opt->name)) == NULL) {
+			continue;
+		}
+		if(jid->tag == JSON_NUMBER) {
+			snprintf(value, sizeof(value), "%.*f", jid->decimals_, jid->number_);
+		} else if(jid->tag == JSON_STRING) {
+			snprintf(value, sizeof(value), "%s", jid->string_);
+		} else {
+			continue;
+		}
+		n = strlen(opt->name)+strlen(value)+2;
+		if((key = REALLOC(key, len+n+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		sprintf(&key[len], "\n%s=%s", opt->name, value);
+		len += n;
+	}
+
+	return key;
+}
+
+static struct JsonNode *broadcast_message(struct JsonNode *json) {
+	struct JsonNode *jmessage = json_clone(json);
+
+	if(json_find_member(jmessage, "uuid") == NULL && strlen(pilight_uuid) > 0) {
+		json_append_member(jmessage, "uuid", json_mkstring(pilight_uuid));
+	}
+	return jmessage;
+}
+
+/*
+ * Replace the update of the same device that is still waiting
+ * in the broadcast stage.
+ */
+static int broadcast_coalesce(char *key, struct JsonNode *json, enum origin_t origin, struct trace_t *trace) {
+	struct bcqueue_t *node = NULL;
+	unsigned int hash = strhash(key)&(BCPENDING_SIZE-1);
+
+	pthread_mutex_lock(&bcpending_lock);
+	for(node=bcpending[hash];node!=NULL;node=node->pending) {
+		if(strcmp(node->key, key) == 0) {
+			break;
+		}
+	}
+	if(node == NULL) {
+		pthread_mutex_unlock(&bcpending_lock);
+		return -1;
+	}
+	json_delete(node->jmessage);
+	node->jmessage = broadcast_message(json);
+	node->origin = origin;
+	if(trace != NULL) {
+		node->trace = *trace;
+	} else {
+		node->trace.id = 0;
+	}
+	pthread_mutex_unlock(&bcpending_lock);
+
+	metrics_inc(metric_bcqueue_coalesced, 1);
+	return 0;
+}
+
+static void broadcast_pending_add(struct bcqueue_t *bnode) {
+	unsigned int hash = strhash(bnode->key)&(BCPENDING_SIZE-1);
+
+	pthread_mutex_lock(&bcpending_lock);
+	bnode->pending = bcpending[hash];
+	bcpending[hash] = bnode;
+	pthread_mutex_unlock(&bcpending_lock);
+}
+
+/* Taken by the broadcaster, so it can't be replaced anymore */
+static void broadcast_pending_remove(struct bcqueue_t *bnode) {
+	struct bcqueue_t **node = NULL;
+	unsigned int hash = strhash(bnode->key)&(BCPENDING_SIZE-1);
+
+	pthread_mutex_lock(&bcpending_lock);
+	for(node=&bcpending[hash];*node!=NULL;node=&(*node)->pending) {
+		if(*node == bnode) {
+			*node = bnode->pending;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bcpending_lock);
+}
+
+static void broadcast_queue_code(char *protoname, struct JsonNode *json, enum origin_t origin, struct trace_t *trace, unsigned int batch, int mark, int hwtype, int plslen) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	if(main_loop == 1) {
-		pthread_mutex_lock(&bcqueue_lock);
-		if(bcqueue_number <= 1024) {
-			struct bcqueue_t *bnode = MALLOC(sizeof(struct bcqueue_t));
-			if(bnode == NULL) {
-				fprintf(stderr, "out of memory\n");
-				exit(EXIT_FAILURE);
-			}
+	struct bcqueue_t *bnode = NULL;
+	char *key = NULL;
+	int critical = 0;
 
-			char *jstr = json_stringify(json, NULL);
-			bnode->jmessage = json_decode(jstr);
-			if(json_find_member(bnode->jmessage, "uuid") == NULL && strlen(pilight_uuid) > 0) {
-				json_append_member(bnode->jmessage, "uuid", json_mkstring(pilight_uuid));
+	if(main_loop == 1 && bcqueue_init == 1) {
+		critical = broadcast_critical(origin, batch, mark);
+		if(critical == 0 && (key = broadcast_coalesce_key(protoname, json, origin)) != NULL) {
+			if(broadcast_coalesce(key, json, origin, trace) == 0) {
+				FREE(key);
+				return;
 			}
-			json_free(jstr);
+		}
 
-			if((bnode->protoname = MALLOC(strlen(protoname)+1)) == NULL) {
-				fprintf(stderr, "out of memory\n");
-				exit(EXIT_FAILURE);
+		if((bnode = stage_claim(&bcstage, (critical == 1) ? -1 : BCQUEUE_WAIT)) != NULL) {
+			bnode->jmessage = broadcast_message(json);
+
+			/* Names of protocols this daemon doesn't run can still come from nodes */
+			bnode->protoname = NULL;
+			if((bnode->protocol = protocol_intern(protoname)) == 0 && protoname[0] != '\0') {
+				if((bnode->protoname = STRDUP(protoname)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
 			}
-			strcpy(bnode->protoname, protoname);
 
 			bnode->origin = origin;
-
-			if(bcqueue_number == 0) {
-				bcqueue = bnode;
-				bcqueue_head = bnode;
+			if(trace != NULL) {
+				bnode->trace = *trace;
 			} else {
-				bcqueue_head->next = bnode;
-				bcqueue_head = bnode;
+				bnode->trace.id = 0;
+			}
+			bnode->batch = batch;
+			bnode->mark = mark;
+			bnode->key = key;
+			bnode->pending = NULL;
+			bnode->hwtype = hwtype;
+			bnode->plslen = plslen;
+			if(key != NULL) {
+				broadcast_pending_add(bnode);
 			}
 
-			bcqueue_number++;
+			stage_publish(&bcstage, bnode);
 		} else {
+			if(key != NULL) {
+				FREE(key);
+			}
 			logprintf(LOG_ERR, "broadcast queue full");
 		}
-		pthread_mutex_unlock(&bcqueue_lock);
-		pthread_cond_signal(&bcqueue_signal);
 	}
 }
 
+static void broadcast_queue_trace(char *protoname, struct JsonNode *json, enum origin_t origin, struct trace_t *trace, unsigned int batch, int mark) {
+	broadcast_queue_code(protoname, json, origin, trace, batch, mark, -1, 0);
+}
+
+static void broadcast_queue(char *protoname, struct JsonNode *json, enum origin_t origin) {
+	broadcast_queue_trace(protoname, json, origin, NULL, 0, BATCH_UPDATE);
+}
+
+static unsigned int batch_open(void) {
+	struct batch_t *node = MALLOC(sizeof(struct batch_t));
+	if(node == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(node, 0, sizeof(struct batch_t));
+	node->jupdates = json_mkarray();
+	node->stamp = time(NULL);
+
+	pthread_mutex_lock(&batch_lock);
+	/* Zero means a code isn't part of a batch */
+	if(++batch_ids == 0) {
+		batch_ids++;
+	}
+	node->id = batch_ids;
+	node->next = batches;
+	batches = node;
+	pthread_mutex_unlock(&batch_lock);
+
+	return node->id;
+}
+
+/* A code of the batch was queued */
+static void batch_count(unsigned int id) {
+	struct batch_t *tmp = NULL;
+
+	pthread_mutex_lock(&batch_lock);
+	tmp = batches;
+	while(tmp != NULL && tmp->id != id) {
+		tmp = tmp->next;
+	}
+	if(tmp != NULL) {
+		tmp->codes++;
+	}
+	pthread_mutex_unlock(&batch_lock);
+}
+
+/* Let the broadcast thread know in order with the updates */
+static void batch_mark(unsigned int id, int mark) {
+	struct JsonNode *jmark = json_mkobject();
+	char pname[1] = "";
+
+	broadcast_queue_trace(pname, jmark, SENDER, NULL, id, mark);
+	json_delete(jmark);
+}
+
+/* The values of an update, apart from the time they were set */
+static char *batch_key(struct JsonNode *jupdate) {
+	struct JsonNode *jkey = json_mkarray();
+	struct JsonNode *jvalues = json_mkobject();
+	struct JsonNode *jchild = NULL;
+	double type = -1;
+	char *out = NULL;
+
+	json_find_number(jupdate, "type", &type);
+	json_append_element(jkey, json_mknumber(type, 0));
+	if((jchild = json_find_member(jupdate, "values")) != NULL) {
+		jchild = json_first_child(jchild);
+		while(jchild) {
+			if(strcmp(jchild->key, "timestamp") != 0) {
+				json_append_member(jvalues, jchild->key, json_clone(jchild));
+			}
+			jchild = jchild->next;
+		}
+	}
+	json_append_element(jkey, jvalues);
+
+	out = json_stringify(jkey, NULL);
+	json_delete(jkey);
+	return out;
+}
+
+static void batch_changed(struct JsonNode *jto, struct JsonNode *jfrom) {
+	struct JsonNode *jchild = json_first_child(jfrom), *jtmp = NULL;
+
+	while(jchild) {
+		if(jchild->tag == JSON_STRING) {
+			jtmp = json_first_child(jto);
+			while(jtmp) {
+				if(jtmp->tag == JSON_STRING && strcmp(jtmp->string_, jchild->string_) == 0) {
+					break;
+				}
+				jtmp = jtmp->next;
+			}
+			if(jtmp == NULL) {
+				json_append_element(jto, json_mkstring(jchild->string_));
+			}
+		}
+		jchild = jchild->next;
+	}
+}
+
+static void batch_merge(struct batch_t *batch, struct JsonNode *jret) {
+	struct JsonNode *jupdate = json_first_child(batch->jupdates);
+	struct JsonNode *jdevices = NULL, *jdevice = NULL, *jchild = NULL, *jtime = NULL;
+	char *key = batch_key(jret), *tmp = NULL, *out = NULL;
+	size_t len = 0;
+	double timestamp = 0;
+
+	while(jupdate) {
+		tmp = batch_key(jupdate);
+		if(strcmp(tmp, key) == 0) {
+			json_free(tmp);
+			break;
+		}
+		json_free(tmp);
+		jupdate = jupdate->next;
+	}
+	json_free(key);
+
+	if(jupdate != NULL &&
+	   (jdevices = json_find_member(jupdate, "devices")) != NULL &&
+	   (jdevice = json_find_member(jret, "devices")) != NULL) {
+		out = json_stringify(jupdate, NULL);
+		len = strlen(out);
+		json_free(out);
+
+		jchild = json_first_child(jdevice);
+		while(jchild) {
+			if(jchild->tag == JSON_STRING) {
+				len += strlen(jchild->string_)+3;
+			}
+			jchild = jchild->next;
+		}
+		if(len <= BATCH_MSG_MAX) {
+			jchild = json_first_child(jdevice);
+			while(jchild) {
+				if(jchild->tag == JSON_STRING) {
+					json_append_element(jdevices, json_mkstring(jchild->string_));
+				}
+				jchild = jchild->next;
+			}
+			/* The rules need the settings that changed on any of the devices */
+			if((jtime = json_find_member(jupdate, "changed")) != NULL &&
+			   (jchild = json_find_member(jret, "changed")) != NULL) {
+				batch_changed(jtime, jchild);
+			}
+			/* The merged update was set when its last device was */
+			if((jchild = json_find_member(jret, "values")) != NULL &&
+			   json_find_number(jchild, "timestamp", &timestamp) == 0 &&
+			   (jtime = json_find_member(jupdate, "values")) != NULL &&
+			   (jtime = json_find_member(jtime, "timestamp")) != NULL &&
+			   jtime->tag == JSON_NUMBER && jtime->number_ < timestamp) {
+				jtime->number_ = timestamp;
+			}
+			return;
+		}
+	}
+	json_append_element(batch->jupdates, json_clone(jret));
+}
+
+static void broadcast_config(struct JsonNode *jret, int tick, char *conf);
+
+/*
+ * Keep track of a batch and broadcast the batches that are
+ * complete or took too long. The update isn't used when
+ * its batch was already broadcasted.
+ */
+static int batch_update(unsigned int id, int mark, struct JsonNode *jret) {
+	struct batch_t *tmp = NULL, *prev = NULL, *done = NULL;
+	struct JsonNode *jupdate = NULL;
+	time_t now = time(NULL);
+	int found = -1;
+
+	pthread_mutex_lock(&batch_lock);
+	tmp = batches;
+	while(tmp) {
+		if(tmp->id == id && id > 0) {
+			found = 0;
+			if(mark == BATCH_CLOSE) {
+				tmp->closed = 1;
+			} else {
+				tmp->codes--;
+			}
+			if(jret != NULL) {
+				batch_merge(tmp, jret);
+			}
+		}
+		if((tmp->closed == 1 && tmp->codes <= 0) || now-tmp->stamp > BATCH_TIMEOUT) {
+			if(prev == NULL) {
+				batches = tmp->next;
+			} else {
+				prev->next = tmp->next;
+			}
+			tmp->next = done;
+			done = tmp;
+			tmp = (prev == NULL) ? batches : prev->next;
+			continue;
+		}
+		prev = tmp;
+		tmp = tmp->next;
+	}
+	pthread_mutex_unlock(&batch_lock);
+
+	while(done) {
+		tmp = done;
+		done = done->next;
+		jupdate = json_first_child(tmp->jupdates);
+		while(jupdate) {
+			broadcast_config(jupdate, CLOCK_NONE, json_stringify(jupdate, NULL));
+			jupdate = jupdate->next;
+		}
+		json_delete(tmp->jupdates);
+		FREE(tmp);
+	}
+	return found;
+}
+
+/*
+ * Write a config update to all clients that want it. The
+ * stringified update is handed over to the webserver.
+ */
+static void broadcast_config(struct JsonNode *jret, int tick, char *conf) {
+	struct clients_t *tmp_clients = clients;
+	unsigned short match1 = 0, match2 = 0;
+	/* Delta updates are serialized once per media type */
+	char *delta[4] = { NULL, NULL, NULL, NULL };
+	int m = 0;
+	/* Lagging clients only get the latest state of these devices */
+	struct JsonNode *jkey = json_find_member(jret, "devices");
+	char *key = (jkey != NULL) ? json_stringify(jkey, NULL) : NULL;
+	double devtype = -1;
+
+	json_find_number(jret, "type", &devtype);
+
+	/* The next reading of a sensor is never far away */
+	if(shed_level >= SHED_SAMPLE && (int)devtype == WEATHER && key != NULL &&
+	   (shed_samples[strhash(key) & (SHED_SAMPLES-1)]++ % SHED_SAMPLE_RATE) != 0) {
+		metrics_inc(metric_shed_sampled, 1);
+		json_free(key);
+		eventpool_trigger(REASON_BROADCAST_CORE, reason_broadcast_core_free, conf);
+		return;
+	}
+
+	broadcast_seq++;
+
+	while(tmp_clients) {
+		if(tmp_clients->config == 1 && client_clock(tmp_clients, tick) == 1 &&
+		   client_subscribed(tmp_clients, (int)devtype, jkey) == 1) {
+			struct JsonNode *jtmp = json_clone(jret);
+			struct JsonNode *jdevices = json_find_member(jtmp, "devices");
+			if(jdevices != NULL) {
+				match1 = 0;
+				struct JsonNode *jchilds = json_first_child(jdevices);
+				struct gui_values_t *gui_values = NULL;
+				while(jchilds) {
+					match2 = 0;
+					if(jchilds->tag == JSON_STRING) {
+						if((gui_values = gui_media(jchilds->string_)) != NULL) {
+							while(gui_values) {
+								if(gui_values->type == JSON_STRING) {
+									if(strcmp(gui_values->string_, tmp_clients->media) == 0 ||
+										 strcmp(gui_values->string_, "all") == 0 ||
+										 strcmp(tmp_clients->media, "all") == 0) {
+											match2 = 1;
+									}
+								}
+								gui_values = gui_values->next;
+							}
+						} else {
+							match2 = 1;
+						}
+						if(match2 == 1 && gui_filter_device(tmp_clients->filter, jchilds->string_) == 0) {
+							match2 = 0;
+						}
+						if(match2 == 1) {
+							match1 = 1;
+						}
+					}
+					if(match2 == 0) {
+						json_remove_from_parent(jchilds);
+					}
+					struct JsonNode *jtmp1 = jchilds;
+					jchilds = jchilds->next;
+					if(match2 == 0) {
+						json_delete(jtmp1);
+					}
+				}
+			}
+			if(match1 == 1 && tmp_clients->delta == 1 && tmp_clients->filter != NULL) {
+				/* A subscription makes the delta specific to this client */
+				struct JsonNode *jdelta = devices_delta(jtmp, broadcast_seq);
+				char *out = json_stringify(jdelta, NULL);
+				socket_write_buf(tmp_clients->id, out, strlen(out));
+				json_free(out);
+				json_delete(jdelta);
+			} else if(match1 == 1 && tmp_clients->delta == 1) {
+				m = client_media_nr(tmp_clients->media);
+				if(delta[m] == NULL) {
+					struct JsonNode *jdelta = devices_delta(jtmp, broadcast_seq);
+					delta[m] = json_stringify(jdelta, NULL);
+					json_delete(jdelta);
+				}
+				socket_write_buf(tmp_clients->id, delta[m], strlen(delta[m]));
+			} else if(match1 == 1) {
+				char *out = json_stringify(jtmp, NULL);
+				socket_write_state(tmp_clients->id, key, out, strlen(out));
+				logprintf(LOG_DEBUG, "broadcasted: %s", out);
+				json_free(out);
+			}
+			json_delete(jtmp);
+		}
+		tmp_clients = tmp_clients->next;
+	}
+	for(m=0;m<4;m++) {
+		if(delta[m] != NULL) {
+			json_free(delta[m]);
+		}
+	}
+	if(key != NULL) {
+		json_free(key);
+	}
+	eventpool_trigger(REASON_BROADCAST_CORE, reason_broadcast_core_free, conf);
+}
+
 void *broadcast(void *param) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
+	struct bcqueue_t *bcqueue = NULL;
 	int broadcasted = 0/*, free_conf = 1*/;
 
-	pthread_mutex_lock(&bcqueue_lock);
 	while(main_loop) {
-		if(bcqueue_number > 0) {
-			pthread_mutex_lock(&bcqueue_lock);
-
+		if((bcqueue = stage_take(&bcstage)) != NULL) {
 			logprintf(LOG_STACK, "%s::unlocked", __FUNCTION__);
 
+			if(bcqueue->key != NULL) {
+				broadcast_pending_remove(bcqueue);
+			}
+
 			broadcasted = 0;
 			struct JsonNode *jret = NULL;
 			char *origin = NULL;
+			/* Only materialized here, for the devices and the clients */
+			char *protoname = bcqueue->protoname;
+			if(protoname == NULL) {
+				protoname = (char *)protocol_interned_name(bcqueue->protocol);
+			}
 
-			if(json_find_string(bcqueue->jmessage, "origin", &origin) == 0) {
+			if(bcqueue->mark != BATCH_UPDATE) {
+				batch_update(bcqueue->batch, bcqueue->mark, NULL);
+			} else if(json_find_string(bcqueue->jmessage, "origin", &origin) == 0) {
 				if(strcmp(origin, "core") == 0) {
 					double tmp = 0;
 					json_find_number(bcqueue->jmessage, "type", &tmp);
 					char *conf = json_stringify(bcqueue->jmessage, NULL);
+					size_t conflen = strlen(conf);
 					struct clients_t *tmp_clients = clients;
 					while(tmp_clients) {
 						if(((int)tmp < 0 && tmp_clients->core == 1) ||
 						   ((int)tmp >= 0 && tmp_clients->config == 1) ||
 							 ((int)tmp == PROCESS && tmp_clients->stats == 1)) {
-							socket_write(tmp_clients->id, conf);
+							socket_write_buf(tmp_clients->id, conf, conflen);
 							broadcasted = 1;
 						}
 						tmp_clients = tmp_clients->next;
 					}
 
 					if(pilight.runmode == ADHOC && sockfd > 0) {
-						struct JsonNode *jupdate = json_decode(conf);
-						json_append_member(jupdate, "action", json_mkstring("update"));
-						char *ret = json_stringify(jupdate, NULL);
-						socket_write(sockfd, ret);
+						node_send_update(bcqueue->jmessage);
 						broadcasted = 1;
-						json_delete(jupdate);
-						json_free(ret);
 					}
 					if(broadcasted == 1) {
 						logprintf(LOG_DEBUG, "broadcasted: %s", conf);
 					}
 					eventpool_trigger(REASON_BROADCAST_CORE, reason_broadcast_core_free, conf);
+				} else if(strcmp(origin, "replica") == 0) {
+					double timestamp = 0;
+					char *uuid = NULL;
+
+					json_find_number(bcqueue->jmessage, "timestamp", &timestamp);
+					json_find_string(bcqueue->jmessage, "uuid", &uuid);
+					/* Replicated changes are not replicated again */
+					if(devices_replicate(bcqueue->jmessage, (unsigned long)timestamp, uuid, &jret) == 0) {
+						config_write_mark();
+						journal_append(jret);
+						broadcast_config(jret, CLOCK_NONE, json_stringify(jret, NULL));
+						json_delete(jret);
+					}
 				} else {
+					int tick = broadcast_clock(protoname, bcqueue->jmessage);
+
 					/* Update the config */
-					if(devices_update(bcqueue->protoname, bcqueue->jmessage, bcqueue->origin, &jret) == 0) {
+					if(devices_update(protoname, bcqueue->jmessage, bcqueue->origin, &jret) == 0) {
 						char *tmp = json_stringify(jret, NULL);
-						struct clients_t *tmp_clients = clients;
-						unsigned short match1 = 0, match2 = 0;
+						trace_stage(&bcqueue->trace, TRACE_DEVICES);
+						trace_attach(tmp, &bcqueue->trace);
 
-						while(tmp_clients) {
-							if(tmp_clients->config == 1) {
-								struct JsonNode *jtmp = json_decode(tmp);
-								struct JsonNode *jdevices = json_find_member(jtmp, "devices");
-								if(jdevices != NULL) {
-									match1 = 0;
-									struct JsonNode *jchilds = json_first_child(jdevices);
-									struct gui_values_t *gui_values = NULL;
-									while(jchilds) {
-										match2 = 0;
-										if(jchilds->tag == JSON_STRING) {
-											if((gui_values = gui_media(jchilds->string_)) != NULL) {
-												while(gui_values) {
-													if(gui_values->type == JSON_STRING) {
-														if(strcmp(gui_values->string_, tmp_clients->media) == 0 ||
-															 strcmp(gui_values->string_, "all") == 0 ||
-															 strcmp(tmp_clients->media, "all") == 0) {
-																match1 = 1;
-																match2 = 1;
-														}
-													}
-													gui_values = gui_values->next;
-												}
-											} else {
-												match1 = 1;
-												match2 = 1;
-											}
-										}
-										if(match2 == 0) {
-											json_remove_from_parent(jchilds);
-										}
-										struct JsonNode *jtmp1 = jchilds;
-										jchilds = jchilds->next;
-										if(match2 == 0) {
-											json_delete(jtmp1);
-										}
-									}
-								}
-								if(match1 == 1) {
-									char *conf = json_stringify(jtmp, NULL);
-									socket_write(tmp_clients->id, conf);
-									logprintf(LOG_DEBUG, "broadcasted: %s", conf);
-									json_free(conf);
-								}
-								json_delete(jtmp);
-							}
-							tmp_clients = tmp_clients->next;
+						config_write_mark();
+						journal_append(jret);
+						replica_push(jret);
+
+#ifdef EVENTS
+						if(tick != CLOCK_NONE && pilight.runmode == STANDALONE) {
+							events_tick(tmp);
+						}
+#endif
+						if(bcqueue->batch == 0 || batch_update(bcqueue->batch, BATCH_UPDATE, jret) != 0) {
+							broadcast_config(jret, tick, tmp);
+						} else {
+							json_free(tmp);
 						}
-						eventpool_trigger(REASON_BROADCAST_CORE, reason_broadcast_core_free, tmp);
 
-						// json_free(tmp);
 						json_delete(jret);
+					} else if(bcqueue->batch != 0) {
+						batch_update(bcqueue->batch, BATCH_SKIP, NULL);
 					}
 
 					/* The settings objects inside the broadcast queue is only of interest for the
 					   internal pilight functions. For the outside world we only communicate the
 					   message part of the queue so we remove the settings */
-					char *internal = json_stringify(bcqueue->jmessage, NULL);
+					struct JsonNode *internal = NULL;
+					if(pilight.runmode == ADHOC && sockfd > 0) {
+						internal = json_clone(bcqueue->jmessage);
+					}
 
 					struct JsonNode *jsettings = NULL;
 					if((jsettings = json_find_member(bcqueue->jmessage, "settings"))) {
@@ -440,7 +1362,7 @@ void *broadcast(void *param) {
 					}
 
 					char *out = json_stringify(bcqueue->jmessage, NULL);
-					if(strcmp(bcqueue->protoname, "pilight_firmware") == 0) {
+					if(strcmp(protoname, "pilight_firmware") == 0) {
 						struct JsonNode *code = NULL;
 						if((code = json_find_member(bcqueue->jmessage, "message")) != NULL) {
 							json_find_number(code, "version", &firmware.version);
@@ -477,95 +1399,100 @@ void *broadcast(void *param) {
 					}
 
 					/* Write the message to all receivers */
+					size_t outlen = strlen(out);
 					struct clients_t *tmp_clients = clients;
 					while(tmp_clients) {
-						if(tmp_clients->receiver == 1 && tmp_clients->forward == 0) {
+						if(tmp_clients->receiver == 1 && tmp_clients->forward == 0 &&
+						   client_clock(tmp_clients, tick) == 1 &&
+						   gui_filter_code(tmp_clients->filter, protoname, bcqueue->hwtype, bcqueue->plslen) == 1) {
 								if(strcmp(out, "{}") != 0 && nrchilds > 1) {
-									socket_write(tmp_clients->id, out);
+									socket_write_buf(tmp_clients->id, out, outlen);
 									broadcasted = 1;
 								}
 						}
 						tmp_clients = tmp_clients->next;
 					}
 
-					if(pilight.runmode == ADHOC && sockfd > 0) {
-						struct JsonNode *jupdate = json_decode(internal);
-						json_append_member(jupdate, "action", json_mkstring("update"));
-						char *ret = json_stringify(jupdate, NULL);
-						socket_write(sockfd, ret);
+#ifdef EVENTS
+					if(tick != CLOCK_NONE && pilight.runmode == STANDALONE &&
+					   strcmp(out, "{}") != 0 && nrchilds > 1) {
+						events_tick(out);
+					}
+#endif
+
+					if(internal != NULL) {
+						node_send_update(internal);
 						broadcasted = 1;
-						json_delete(jupdate);
-						json_free(ret);
 					}
 					if((broadcasted == 1 || nodaemon == 1) && (strcmp(out, "{}") != 0 && nrchilds > 1)) {
 						logprintf(LOG_DEBUG, "broadcasted: %s", out);
 					}
-					json_free(internal);
+					trace_stage(&bcqueue->trace, TRACE_BROADCAST);
+					trace_attach(out, &bcqueue->trace);
+					json_delete(internal);
 					// json_free(out);
 					eventpool_trigger(REASON_BROADCAST_CORE, reason_broadcast_core_free, out);
 				}
 			}
-			struct bcqueue_t *tmp = bcqueue;
-			FREE(tmp->protoname);
-			json_delete(tmp->jmessage);
-			bcqueue = bcqueue->next;
-			FREE(tmp);
-			bcqueue_number--;
-			pthread_mutex_unlock(&bcqueue_lock);
+			if(bcqueue->batch == 0 && batches != NULL) {
+				batch_update(0, BATCH_UPDATE, NULL);
+			}
+			bcqueue_free(bcqueue);
+			stage_release(&bcstage, bcqueue);
 		} else {
-			pthread_cond_wait(&bcqueue_signal, &bcqueue_lock);
+			break;
 		}
 	}
 	return (void *)NULL;
 }
 
-static void receive_queue(int *raw, int rawlen, int plslen, int hwtype) {
+static void recvqueue_free(void *param) {
+	struct recvqueue_t *slot = param;
+
+	pulsepool_release(&slot->code);
+}
+
+static void receive_queue(int *raw, int rawlen, int plslen, int hwtype, struct trace_t *trace) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	int i = 0;
+	struct recvqueue_t *slot = NULL;
 
-	if(main_loop == 1) {
-		pthread_mutex_lock(&recvqueue_lock);
-		if(recvqueue_number <= 1024) {
-			struct recvqueue_t *rnode = MALLOC(sizeof(struct recvqueue_t));
-			if(rnode == NULL) {
-				fprintf(stderr, "out of memory\n");
-				exit(EXIT_FAILURE);
-			}
-			for(i=0;i<rawlen;i++) {
-				rnode->raw[i] = raw[i];
-			}
-			rnode->rawlen = rawlen;
-			rnode->plslen = plslen;
-			rnode->hwtype = hwtype;
+	if(main_loop == 1 && recvqueue_init == 1) {
+		if(rawlen > MAXPULSESTREAMLENGTH) {
+			rawlen = MAXPULSESTREAMLENGTH;
+		}
 
-			if(recvqueue_number == 0) {
-				recvqueue = rnode;
-				recvqueue_head = rnode;
-			} else {
-				recvqueue_head->next = rnode;
-				recvqueue_head = rnode;
-			}
+		if((slot = stage_claim(&recvstage, 0)) == NULL) {
+			__sync_fetch_and_add(&recvqueue_overflow, 1);
+			logprintf(LOG_ERR, "receiver queue full");
+			return;
+		}
 
-			recvqueue_number++;
+		pulsepool_store(&slot->code, raw, rawlen);
+		slot->plslen = plslen;
+		slot->hwtype = hwtype;
+		if(trace != NULL) {
+			slot->trace = *trace;
+			trace_stage(&slot->trace, TRACE_QUEUED);
 		} else {
-			logprintf(LOG_ERR, "receiver queue full");
+			slot->trace.id = 0;
 		}
-		pthread_mutex_unlock(&recvqueue_lock);
-		pthread_cond_signal(&recvqueue_signal);
+
+		stage_publish(&recvstage, slot);
 	}
 }
 
-static void receiver_create_message(protocol_t *protocol) {
+static void receiver_create_message(protocol_t *protocol, struct trace_t *trace, int plslen) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	if(protocol->message != NULL) {
-		char *valid = json_stringify(protocol->message, NULL);
-		json_delete(protocol->message);
-		if(valid != NULL && json_validate(valid) == true) {
+		if(json_check(protocol->message, NULL) == false) {
+			json_delete(protocol->message);
+		} else {
 			struct JsonNode *jmessage = json_mkobject();
 
-			json_append_member(jmessage, "message", json_decode(valid));
+			/* broadcast_queue takes its own copy of the message */
+			json_append_member(jmessage, "message", protocol->message);
 			json_append_member(jmessage, "origin", json_mkstring("receiver"));
 			json_append_member(jmessage, "protocol", json_mkstring(protocol->id));
 			if(strlen(pilight_uuid) > 0) {
@@ -574,15 +1501,9 @@ static void receiver_create_message(protocol_t *protocol) {
 			if(protocol->repeats > -1) {
 				json_append_member(jmessage, "repeats", json_mknumber(protocol->repeats, 0));
 			}
-			char *output = json_stringify(jmessage, NULL);
-			struct JsonNode *json = json_decode(output);
-			broadcast_queue(protocol->id, json, RECEIVER);
-			json_free(output);
-			json_delete(json);
-			json = NULL;
+			broadcast_queue_code(protocol->id, jmessage, RECEIVER, trace, 0, BATCH_UPDATE, protocol->hwtype, plslen);
 			json_delete(jmessage);
 		}
-		json_free(valid);
 	}
 	protocol->message = NULL;
 }
@@ -596,128 +1517,419 @@ static void receive_parse_api(struct JsonNode *code, int hwtype) {
 
 		if(protocol->hwtype == hwtype && protocol->parseCommand != NULL) {
 			protocol->parseCommand(code);
-			receiver_create_message(protocol);
+			receiver_create_message(protocol, NULL, 0);
 		}
 		pnode = pnode->next;
 	}
 }
 
+/*
+ * Remotes repeat the same pulse train several times. The
+ * protocols that matched the last train are remembered with
+ * the message they parsed, so identical trains within the
+ * repeat window skip validation and parsing. Trains are
+ * compared after dividing the pulses by PULSE_DIV. Each
+ * receive parser thread keeps its own cache.
+ */
+typedef struct recvcache_t {
+	unsigned int hash;
+	int rawlen;
+	int hwtype;
+	unsigned long stamp;
+	int pulses[MAXPULSESTREAMLENGTH];
+
+	struct {
+		struct protocol_t *protocol;
+		struct JsonNode *message;
+	} *matches;
+	int nrmatches;
+	int size;
+} recvcache_t;
+
+static struct recvcache_t *recvcaches = NULL;
+/* Only match the configured protocols and these extra ones */
+static char **receive_protocols = NULL;
+static int nrreceive_protocols = 0;
+static int recvcache_window = 250;
+static int nrparsers = 1;
+
+static int receive_select(struct protocol_t *protocol) {
+	int i = 0;
+
+	if(devices_uses_protocol(protocol) == 1) {
+		return 1;
+	}
+	for(i=0;i<nrreceive_protocols;i++) {
+		if(strcmp(receive_protocols[i], protocol->id) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void recvcache_clear(struct recvcache_t *recvcache) {
+	int i = 0;
+	for(i=0;i<recvcache->nrmatches;i++) {
+		json_delete(recvcache->matches[i].message);
+	}
+	recvcache->nrmatches = 0;
+	recvcache->rawlen = 0;
+}
+
+static void recvcache_add(struct recvcache_t *recvcache, struct protocol_t *protocol) {
+	if(recvcache->nrmatches == recvcache->size) {
+		recvcache->size += 4;
+		if((recvcache->matches = REALLOC(recvcache->matches, sizeof(*recvcache->matches)*recvcache->size)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+	recvcache->matches[recvcache->nrmatches].protocol = protocol;
+	recvcache->matches[recvcache->nrmatches].message = json_clone(protocol->message);
+	recvcache->nrmatches++;
+}
+
+static void receive_repeat(struct protocol_t *protocol) {
+	if(protocol->first > 0) {
+		protocol->first = protocol->second;
+	}
+	protocol->second = pilight_monotonic_us();
+	if(protocol->first == 0) {
+		protocol->first = protocol->second;
+	}
+
+	/* Reset # of repeats after a certain delay */
+	if(((int)protocol->second-(int)protocol->first) > 500000) {
+		protocol->repeats = 0;
+	}
+
+	protocol->repeats++;
+}
+
 void *receive_parse_code(void *param) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	pthread_mutex_lock(&recvqueue_lock);
+	struct recvcache_t *recvcache = param;
+	struct recvqueue_t *slot = NULL;
+	struct rawcode_t code;
+	struct protocol_t *protocol = NULL;
+	struct protocol_index_t *candidate = NULL;
+	struct protocol_fingerprint_t fingerprint;
+	struct timespec start, stop;
+	unsigned long stamp = 0;
+	unsigned int hash = 0;
+	int window = recvcache_window, i = 0, pulse = 0, same = 0, nr = 0;
+
 	while(main_loop) {
-		if(recvqueue_number > 0) {
-			pthread_mutex_lock(&recvqueue_lock);
+		if((slot = stage_take(&recvstage)) == NULL) {
+			break;
+		}
 
-			logprintf(LOG_STACK, "%s::unlocked", __FUNCTION__);
+		logprintf(LOG_STACK, "%s::unlocked", __FUNCTION__);
+
+		/* The protocols parse the pulses as ints */
+		code.length = pulsepool_load(&slot->code, code.pulses);
+		pulsepool_release(&slot->code);
+
+		stamp = pilight_monotonic_ms();
+
+		hash = 5381;
+		for(i=0;i<code.length;i++) {
+			pulse = code.pulses[i] / PULSE_DIV;
+			hash = ((hash << 5) + hash) + (unsigned int)pulse;
+		}
+
+		same = 0;
+		if(window > 0 && recvcache->rawlen == code.length &&
+		   recvcache->hwtype == slot->hwtype && recvcache->hash == hash &&
+		   stamp - recvcache->stamp <= (unsigned long)window) {
+			same = 1;
+			for(i=0;i<code.length;i++) {
+				if(recvcache->pulses[i] != code.pulses[i] / PULSE_DIV) {
+					same = 0;
+					break;
+				}
+			}
+		}
+
+		if(same == 1) {
+			recvcache->stamp = stamp;
+			for(i=0;i<recvcache->nrmatches && main_loop;i++) {
+				protocol = recvcache->matches[i].protocol;
+				pthread_mutex_lock(&protocol->lock);
+				receive_repeat(protocol);
+				if(recvcache->matches[i].message != NULL) {
+					logprintf(LOG_DEBUG, "caught minimum # of repeats %d of %s", protocol->repeats, protocol->id);
+					protocol->message = json_clone(recvcache->matches[i].message);
+					trace_stage(&slot->trace, TRACE_PARSED);
+					receiver_create_message(protocol, &slot->trace, slot->plslen);
+				}
+				pthread_mutex_unlock(&protocol->lock);
+			}
+		} else {
+			recvcache_clear(recvcache);
+			if(window > 0) {
+				recvcache->hash = hash;
+				recvcache->rawlen = code.length;
+				recvcache->hwtype = slot->hwtype;
+				recvcache->stamp = stamp;
+				for(i=0;i<code.length;i++) {
+					recvcache->pulses[i] = code.pulses[i] / PULSE_DIV;
+				}
+			}
 
-			struct protocol_t *protocol = NULL;
-			struct protocols_t *pnode = protocols;
+			nr = protocol_index_get(code.length, &candidate);
+			protocol_fingerprint(code.pulses, code.length, &fingerprint);
 
-			while(pnode != NULL && main_loop) {
-				protocol = pnode->listener;
+			for(i=0;i<nr && main_loop;i++,candidate++) {
+				if(protocol_index_match(candidate, slot->hwtype, code.pulses[code.length-1], &fingerprint) == 0) {
+					protocol = candidate->listener;
 
-				if((protocol->hwtype == recvqueue->hwtype || protocol->hwtype == -1 || recvqueue->hwtype == -1) &&
-				   (protocol->parseCode != NULL && protocol->validate != NULL)) {
+					pthread_mutex_lock(&protocol->lock);
+					protocol->raw = code.pulses;
+					protocol->rawlen = code.length;
 
-					if(recvqueue->rawlen < MAXPULSESTREAMLENGTH) {
-						protocol->raw = recvqueue->raw;
+					if(protocol->metric_hits == NULL) {
+						protocol->metric_hits = metrics_get(METRIC_COUNTER, "pilight_protocol_validate_hits_total", "Pulse trains accepted by the validate function of a protocol", "protocol", protocol->id);
+						protocol->metric_misses = metrics_get(METRIC_COUNTER, "pilight_protocol_validate_misses_total", "Pulse trains rejected by the validate function of a protocol", "protocol", protocol->id);
+						protocol->metric_parse = metrics_get(METRIC_HISTOGRAM, "pilight_protocol_parse_seconds", "Time spent parsing a pulse train by a protocol", "protocol", protocol->id);
 					}
-					protocol->rawlen = recvqueue->rawlen;
 
 					if(protocol->validate() == 0) {
+						metrics_inc(protocol->metric_hits, 1);
 						logprintf(LOG_DEBUG, "possible %s protocol", protocol->id);
-						gettimeofday(&tv, NULL);
-						if(protocol->first > 0) {
-							protocol->first = protocol->second;
-						}
-						protocol->second = 1000000 * (unsigned int)tv.tv_sec + (unsigned int)tv.tv_usec;
-						if(protocol->first == 0) {
-							protocol->first = protocol->second;
-						}
-
-						/* Reset # of repeats after a certain delay */
-						if(((int)protocol->second-(int)protocol->first) > 500000) {
-							protocol->repeats = 0;
-						}
-
-						protocol->repeats++;
+						receive_repeat(protocol);
 						if(protocol->parseCode != NULL) {
-							logprintf(LOG_DEBUG, "recevied pulse length of %d", recvqueue->plslen);
+							logprintf(LOG_DEBUG, "recevied pulse length of %d", slot->plslen);
 							logprintf(LOG_DEBUG, "caught minimum # of repeats %d of %s", protocol->repeats, protocol->id);
 							logprintf(LOG_DEBUG, "called %s parseRaw()", protocol->id);
+							clock_gettime(CLOCK_MONOTONIC, &start);
 							protocol->parseCode();
-							receiver_create_message(protocol);
+							clock_gettime(CLOCK_MONOTONIC, &stop);
+							metrics_observe(protocol->metric_parse,
+								(uint64_t)(stop.tv_sec-start.tv_sec)*1000000000 + (uint64_t)stop.tv_nsec - (uint64_t)start.tv_nsec);
+							trace_stage(&slot->trace, TRACE_PARSED);
+							if(window > 0) {
+								recvcache_add(recvcache, protocol);
+							}
+							receiver_create_message(protocol, &slot->trace, slot->plslen);
+						} else if(window > 0) {
+							recvcache_add(recvcache, protocol);
 						}
+					} else {
+						metrics_inc(protocol->metric_misses, 1);
 					}
+					pthread_mutex_unlock(&protocol->lock);
 				}
-				pnode = pnode->next;
 			}
-
-			struct recvqueue_t *tmp = recvqueue;
-			recvqueue = recvqueue->next;
-			FREE(tmp);
-			recvqueue_number--;
-			pthread_mutex_unlock(&recvqueue_lock);
-		} else {
-			pthread_cond_wait(&recvqueue_signal, &recvqueue_lock);
 		}
+
+		/* Hand the slot back to the receivers */
+		stage_release(&recvstage, slot);
 	}
+
+	recvcache_clear(recvcache);
+	if(recvcache->matches != NULL) {
+		FREE(recvcache->matches);
+	}
+	recvcache->size = 0;
+
 	return (void *)NULL;
 }
 
+static int send_priority(enum origin_t origin) {
+	if(origin == ORIGIN_WEBSERVER || origin == SENDER) {
+		return 0;
+	} else if(origin == ACTION) {
+		return 1;
+	}
+	return 2;
+}
+
+static void sendqueue_free(struct sendqueue_t *node) {
+	if(node->message != NULL) {
+		FREE(node->message);
+	}
+	if(node->settings != NULL) {
+		FREE(node->settings);
+	}
+	if(node->key != NULL) {
+		FREE(node->key);
+	}
+	pulsepool_free(node->code);
+	FREE(node);
+}
+
+static void sendqueue_append(struct sender_t *sender, struct sendqueue_t *node) {
+	node->next = NULL;
+	if(sender->number == 0) {
+		sender->first = node;
+		sender->last = node;
+	} else {
+		sender->last->next = node;
+		sender->last = node;
+	}
+	sender->number++;
+}
+
+/* Take the first code with the highest priority from the queue */
+static struct sendqueue_t *sendqueue_pop(struct sender_t *sender) {
+	struct sendqueue_t *tmp = sender->first, *prev = NULL;
+	struct sendqueue_t *node = NULL, *nodeprev = NULL;
+
+	while(tmp) {
+		if(node == NULL || tmp->priority < node->priority) {
+			node = tmp;
+			nodeprev = prev;
+		}
+		prev = tmp;
+		tmp = tmp->next;
+	}
+	if(node == NULL) {
+		return NULL;
+	}
+	if(nodeprev == NULL) {
+		sender->first = node->next;
+	} else {
+		nodeprev->next = node->next;
+	}
+	if(sender->last == node) {
+		sender->last = nodeprev;
+	}
+	node->next = NULL;
+	sender->number--;
+	return node;
+}
+
+/* Another code with at least the same priority is waiting */
+static int sendqueue_waiting(struct sender_t *sender, int priority) {
+	struct sendqueue_t *tmp = sender->first;
+	while(tmp) {
+		if(tmp->priority <= priority) {
+			return 1;
+		}
+		tmp = tmp->next;
+	}
+	return 0;
+}
+
+static struct sender_t *sender_get(int hwtype) {
+	if(hwtype > NONE && hwtype < NRSENDERS && senders[hwtype].active == 1) {
+		return &senders[hwtype];
+	}
+	return &senders[NONE];
+}
+
+static int sender_busy(void) {
+	int i = 0;
+	for(i=0;i<NRSENDERS;i++) {
+		if(senders[i].sending == 1) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void *send_code_done(int reason, void *param) {
+	struct sender_t *sender = NULL;
+	int hwtype = NONE;
+
+	if(reason == REASON_CODE_SEND_SUCCESS) {
+		hwtype = ((struct reason_code_sent_success_t *)param)->hwtype;
+	} else {
+		hwtype = ((struct reason_code_sent_fail_t *)param)->hwtype;
+	}
+
+	pthread_mutex_lock(&sendqueue_lock);
+	sender = sender_get(hwtype);
+	sender->done = 1;
+	pthread_mutex_unlock(&sendqueue_lock);
+	pthread_cond_signal(&sender->signal);
+	return NULL;
+}
+
+/*
+ * Wait until the hardware reports the code as sent, so the
+ * remaining codes can still be reordered and replaced.
+ */
+static void send_code_wait(struct sender_t *sender, struct sendqueue_t *node, int repeats) {
+	struct timespec ts;
+	struct timeval tv;
+	unsigned long usec = 0;
+	int i = 0;
+
+	for(i=0;i<node->length;i++) {
+		usec += (unsigned long)node->code[i];
+	}
+	usec = (usec * (unsigned long)repeats) + 1000000;
+
+	gettimeofday(&tv, NULL);
+	ts.tv_sec = tv.tv_sec + (time_t)(usec / 1000000);
+	ts.tv_nsec = (long)(((unsigned long)tv.tv_usec + (usec % 1000000)) * 1000);
+	if(ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+
+	while(main_loop == 1 && sender->done == 0) {
+		if(pthread_cond_timedwait(&sender->signal, &sendqueue_lock, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+}
+
 void *send_code(void *param) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	int i = 0;
+	struct sender_t *sender = param;
+	struct sendqueue_t *node = NULL;
+	int i = 0, repeats = 0;
 
 	/* Make sure the pilight sender gets
 	   the highest priority available */
-#ifdef _WIN32
-	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
-#else
-	struct sched_param sched;
-	memset(&sched, 0, sizeof(sched));
-	sched.sched_priority = 80;
-	pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
-#endif
+	threads_realtime(THREAD_RT_SEND, SCHED_FIFO, 80);
 
 	pthread_mutex_lock(&sendqueue_lock);
 
 	while(main_loop) {
-		if(sendqueue_number > 0) {
-			pthread_mutex_lock(&sendqueue_lock);
-
+		if(sender->number > 0) {
 			logprintf(LOG_STACK, "%s::unlocked", __FUNCTION__);
 
-			sending = 1;
+			sender->sending = 1;
+
+			node = sendqueue_pop(sender);
 
-			struct protocol_t *protocol = sendqueue->protopt;
+			struct protocol_t *protocol = node->protopt;
 			struct hardware_t *hw = NULL;
 
 			struct JsonNode *message = NULL;
 
-			if(sendqueue->message != NULL && strcmp(sendqueue->message, "{}") != 0) {
-				if(json_validate(sendqueue->message) == true) {
+			repeats = node->repeats;
+			if(repeats > SEND_REPEAT_CHUNK && sendqueue_waiting(sender, node->priority) == 1) {
+				repeats = SEND_REPEAT_CHUNK;
+			}
+
+			if(node->sent == 0 && node->message != NULL && strcmp(node->message, "{}") != 0) {
+				struct JsonNode *jmessage = NULL;
+				if((jmessage = json_decode(node->message)) != NULL) {
 					if(message == NULL) {
 						message = json_mkobject();
 					}
 					json_append_member(message, "origin", json_mkstring("sender"));
 					json_append_member(message, "protocol", json_mkstring(protocol->id));
-					json_append_member(message, "message", json_decode(sendqueue->message));
-					if(strlen(sendqueue->uuid) > 0) {
-						json_append_member(message, "uuid", json_mkstring(sendqueue->uuid));
+					json_append_member(message, "message", jmessage);
+					if(strlen(node->uuid) > 0) {
+						json_append_member(message, "uuid", json_mkstring(node->uuid));
 					}
 					json_append_member(message, "repeat", json_mknumber(1, 0));
 				}
 			}
-			if(sendqueue->settings != NULL && strcmp(sendqueue->settings, "{}") != 0) {
-				if(json_validate(sendqueue->settings) == true) {
+			if(node->sent == 0 && node->settings != NULL && strcmp(node->settings, "{}") != 0) {
+				struct JsonNode *jsettings = NULL;
+				if((jsettings = json_decode(node->settings)) != NULL) {
 					if(message == NULL) {
 						message = json_mkobject();
 					}
-					json_append_member(message, "settings", json_decode(sendqueue->settings));
+					json_append_member(message, "settings", jsettings);
 				}
 			}
 
@@ -740,14 +1952,16 @@ void *send_code(void *param) {
 #else
 				if(hw->comtype == COMOOK || hw->comtype == COMPLSTRAIN) {
 #endif
-					logprintf(LOG_DEBUG, "**** RAW CODE ****");
-					if(log_level_get() >= LOG_DEBUG) {
-						for(i=0;i<sendqueue->length;i++) {
-							printf("%d ", sendqueue->code[i]);
+					if(node->sent == 0) {
+						logprintf(LOG_DEBUG, "**** RAW CODE ****");
+						if(log_level_get() >= LOG_DEBUG) {
+							for(i=0;i<node->length;i++) {
+								printf("%d ", node->code[i]);
+							}
+							printf("\n");
 						}
-						printf("\n");
+						logprintf(LOG_DEBUG, "**** RAW CODE ****");
 					}
-					logprintf(LOG_DEBUG, "**** RAW CODE ****");
 
 					/*
 					 * Rewrite start
@@ -759,28 +1973,30 @@ void *send_code(void *param) {
 					data->origin = ORIGIN_SENDER;
 					memset(&data->message, 0, 255);
 					// snprintf(data->message, 1024, "{\"message\":%s}", message);
-					data->rawlen = sendqueue->length;
-					memcpy(data->pulses, sendqueue->code, data->rawlen*sizeof(int));
-					data->txrpt = protocol->txrpt;
+					data->rawlen = node->length;
+					data->pulses = pulsepool_alloc(sizeof(int)*(size_t)(data->rawlen+1));
+					memcpy(data->pulses, node->code, data->rawlen*sizeof(int));
+					data->txrpt = repeats;
 					strncpy(data->protocol, protocol->id, 255);
 					data->hwtype = hw->hwtype;
 
 					memset(data->uuid, 0, UUID_LENGTH+1);
+					sender->done = 0;
 					eventpool_trigger(REASON_SEND_CODE, reason_send_code_free, data);
 					/*
 					 * Rewrite end
 					 */
 
 #ifdef PILIGHT_DEVELOPMENT
-					if(hw->sendOOK(sendqueue->code, sendqueue->length, protocol->txrpt) == 0) {
+					if(hw->sendOOK(node->code, node->length, repeats) == 0) {
 						logprintf(LOG_DEBUG, "successfully send %s code", protocol->id);
 					} else {
 						logprintf(LOG_ERR, "failed to send code");
 					}
 #endif
-					if(strcmp(protocol->id, "raw") == 0) {
-						int plslen = sendqueue->code[sendqueue->length-1]/PULSE_DIV;
-						receive_queue(sendqueue->code, sendqueue->length, plslen, -1);
+					if(node->sent == 0 && strcmp(protocol->id, "raw") == 0) {
+						int plslen = node->code[node->length-1]/PULSE_DIV;
+						receive_queue(node->code, node->length, plslen, -1, NULL);
 					}
 #ifdef PILIGHT_DEVELOPMENT
 					if(hw->receiveOOK != NULL || hw->receivePulseTrain != NULL) {
@@ -790,6 +2006,7 @@ void *send_code(void *param) {
 					}
 #endif
 				} else if(hw->comtype == COMAPI && hw->sendAPI != NULL) {
+					repeats = node->repeats;
 					if(message != NULL) {
 						if(hw->sendAPI(message) == 0) {
 							logprintf(LOG_DEBUG, "successfully send %s command", protocol->id);
@@ -799,69 +2016,68 @@ void *send_code(void *param) {
 					}
 				}
 			} else {
+				repeats = node->repeats;
 				if(strcmp(protocol->id, "raw") == 0) {
-					int plslen = sendqueue->code[sendqueue->length-1]/PULSE_DIV;
-					receive_queue(sendqueue->code, sendqueue->length, plslen, -1);
+					int plslen = node->code[node->length-1]/PULSE_DIV;
+					receive_queue(node->code, node->length, plslen, -1, NULL);
 				}
 			}
 			if(message != NULL) {
-				broadcast_queue(sendqueue->protoname, message, sendqueue->origin);
+				broadcast_queue_trace(node->protopt->id, message, node->origin, NULL, node->batch, BATCH_UPDATE);
 				json_delete(message);
 				message = NULL;
+			} else if(node->sent == 0 && node->batch != 0) {
+				batch_mark(node->batch, BATCH_SKIP);
 			}
 
-			struct sendqueue_t *tmp = sendqueue;
-			if(tmp->message != NULL) {
-				FREE(tmp->message);
+			if(hw != NULL && (hw->comtype == COMOOK || hw->comtype == COMPLSTRAIN)) {
+				send_code_wait(sender, node, repeats);
 			}
-			if(tmp->settings != NULL) {
-				FREE(tmp->settings);
+
+			node->sent = 1;
+			node->repeats -= repeats;
+			if(node->repeats > 0 && main_loop == 1) {
+				sendqueue_append(sender, node);
+			} else {
+				sendqueue_free(node);
 			}
-			FREE(tmp->protoname);
-			sendqueue = sendqueue->next;
-			FREE(tmp);
-			sendqueue_number--;
-			sending = 0;
-			pthread_mutex_unlock(&sendqueue_lock);
+			sender->sending = 0;
 		} else {
-			pthread_cond_wait(&sendqueue_signal, &sendqueue_lock);
+			pthread_cond_wait(&sender->signal, &sendqueue_lock);
 		}
 	}
+	pthread_mutex_unlock(&sendqueue_lock);
 	return (void *)NULL;
 }
 
-/* Send a specific code */
-static int send_queue(struct JsonNode *json, enum origin_t origin) {
+/* Send a specific code, as part of a batch if it isn't zero */
+static int send_queue_batch(struct JsonNode *json, enum origin_t origin, unsigned int batch) {
 	pthread_mutex_lock(&sendqueue_lock);
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	int match = 0, raw[MAXPULSESTREAMLENGTH-1];
 	struct timeval tcurrent;
 	struct clients_t *tmp_clients = NULL;
+	struct sender_t *sender = NULL;
 	char *uuid = NULL, *buffer = NULL;
+	size_t buflen = 0;
 	/* Hold the final protocol struct */
 	struct protocol_t *protocol = NULL;
 
-#ifdef _WIN32
-	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
-#else
 	/* Make sure the pilight sender gets
 	   the highest priority available */
-	struct sched_param sched;
-	memset(&sched, 0, sizeof(sched));
-	sched.sched_priority = 80;
-	pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
-#endif
+	threads_realtime(THREAD_RT_SEND, SCHED_FIFO, 80);
 
 	struct JsonNode *jcode = NULL;
 	struct JsonNode *jprotocols = NULL;
 	struct JsonNode *jprotocol = NULL;
 
 	buffer = json_stringify(json, NULL);
+	buflen = strlen(buffer);
 	tmp_clients = clients;
 	while(tmp_clients) {
 		if(tmp_clients->forward == 1) {
-			socket_write(tmp_clients->id, buffer);
+			socket_write_buf(tmp_clients->id, buffer, buflen);
 		}
 		tmp_clients = tmp_clients->next;
 	}
@@ -884,27 +2100,20 @@ static int send_queue(struct JsonNode *json, enum origin_t origin) {
 			jprotocol = json_first_child(jprotocols);
 			while(jprotocol && match == 0) {
 				match = 0;
-				if(jprotocol->tag == JSON_STRING) {
-					struct protocols_t *pnode = protocols;
-					/* Retrieve the used protocol */
-					while(pnode) {
-						protocol = pnode->listener;
-						/* Check if the protocol exists */
-						if(protocol_device_exists(protocol, jprotocol->string_) == 0 && match == 0) {
-							match = 1;
-							break;
-						}
-						pnode = pnode->next;
-					}
+				/* Retrieve the used protocol */
+				if(jprotocol->tag == JSON_STRING &&
+				   (protocol = protocol_device_get(jprotocol->string_)) != NULL) {
+					match = 1;
 				}
 				jprotocol = jprotocol->next;
 			}
 			memset(raw, 0, sizeof(raw));
-			protocol->raw = raw;
 			if(match == 1 && protocol->createCode != NULL) {
+				protocol->raw = raw;
 				/* Let the protocol create his code */
-				if(protocol->createCode(jcode) == 0 && main_loop == 1) {
-					if(sendqueue_number <= 1024) {
+				if(protocol_create_code(protocol, jcode) == 0 && main_loop == 1) {
+					sender = sender_get(protocol->hwtype);
+					if(sender->number <= 1024) {
 						struct sendqueue_t *mnode = MALLOC(sizeof(struct sendqueue_t));
 						if(mnode == NULL) {
 							fprintf(stderr, "out of memory\n");
@@ -912,12 +2121,18 @@ static int send_queue(struct JsonNode *json, enum origin_t origin) {
 						}
 						gettimeofday(&tcurrent, NULL);
 						mnode->origin = origin;
+						mnode->priority = send_priority(origin);
+						mnode->repeats = protocol->txrpt;
+						mnode->sent = 0;
+						mnode->batch = batch;
+						mnode->next = NULL;
 						mnode->id = 1000000 * (unsigned int)tcurrent.tv_sec + (unsigned int)tcurrent.tv_usec;
 						mnode->message = NULL;
 						if(protocol->message != NULL) {
 							char *jsonstr = json_stringify(protocol->message, NULL);
 							json_delete(protocol->message);
-							if(json_validate(jsonstr) == true) {
+							/* Stringified by us, so always valid */
+							if(jsonstr != NULL) {
 								if((mnode->message = MALLOC(strlen(jsonstr)+1)) == NULL) {
 									fprintf(stderr, "out of memory\n");
 									exit(EXIT_FAILURE);
@@ -929,13 +2144,9 @@ static int send_queue(struct JsonNode *json, enum origin_t origin) {
 						}
 
 						mnode->length = protocol->rawlen;
+						mnode->code = pulsepool_alloc(sizeof(int)*(size_t)protocol->rawlen);
 						memcpy(mnode->code, protocol->raw, sizeof(int)*protocol->rawlen);
 
-						if((mnode->protoname = MALLOC(strlen(protocol->id)+1)) == NULL) {
-							fprintf(stderr, "out of memory\n");
-							exit(EXIT_FAILURE);
-						}
-						strcpy(mnode->protoname, protocol->id);
 						mnode->protopt = protocol;
 
 						struct options_t *tmp_options = protocol->options;
@@ -963,26 +2174,78 @@ static int send_queue(struct JsonNode *json, enum origin_t origin) {
 						json_free(strsett);
 						json_delete(jsettings);
 
+						/* The device ids tell which pending code this one replaces */
+						struct JsonNode *jids = json_mkobject();
+						tmp_options = protocol->options;
+						while(tmp_options) {
+							if(tmp_options->conftype == DEVICES_ID &&
+							  (jtmp = json_find_member(jcode, tmp_options->name)) != NULL) {
+								if(jtmp->tag == JSON_NUMBER) {
+									json_append_member(jids, tmp_options->name, json_mknumber(jtmp->number_, jtmp->decimals_));
+								} else if(jtmp->tag == JSON_STRING) {
+									json_append_member(jids, tmp_options->name, json_mkstring(jtmp->string_));
+								}
+							}
+							tmp_options = tmp_options->next;
+						}
+						mnode->key = NULL;
+						if(json_first_child(jids) != NULL) {
+							char *strids = json_stringify(jids, NULL);
+							if((mnode->key = STRDUP(strids)) == NULL) {
+								OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+							}
+							json_free(strids);
+						}
+						json_delete(jids);
+
 						if(uuid != NULL) {
 							strcpy(mnode->uuid, uuid);
 						} else {
 							memset(mnode->uuid, '\0', UUID_LENGTH);
 						}
-						if(sendqueue_number == 0) {
-							sendqueue = mnode;
-							sendqueue_head = mnode;
+
+						struct sendqueue_t *tmp = sender->first;
+						while(tmp) {
+							if(mnode->key != NULL && tmp->key != NULL &&
+								 tmp->protopt == mnode->protopt &&
+								 strcmp(tmp->key, mnode->key) == 0) {
+								break;
+							}
+							tmp = tmp->next;
+						}
+						if(batch != 0) {
+							batch_count(batch);
+						}
+						if(tmp != NULL) {
+							/* Take the place of the superseded code */
+							struct sendqueue_t *next = tmp->next;
+							if(tmp->sent == 0 && tmp->batch != 0) {
+								batch_mark(tmp->batch, BATCH_SKIP);
+							}
+							if(tmp->priority < mnode->priority) {
+								mnode->priority = tmp->priority;
+							}
+							if(tmp->message != NULL) {
+								FREE(tmp->message);
+							}
+							if(tmp->settings != NULL) {
+								FREE(tmp->settings);
+							}
+							FREE(tmp->key);
+							pulsepool_free(tmp->code);
+							memcpy(tmp, mnode, sizeof(struct sendqueue_t));
+							tmp->next = next;
+							FREE(mnode);
 						} else {
-							sendqueue_head->next = mnode;
-							sendqueue_head = mnode;
+							sendqueue_append(sender, mnode);
 						}
-						sendqueue_number++;
 					} else {
 						logprintf(LOG_ERR, "send queue full");
 						pthread_mutex_unlock(&sendqueue_lock);
 						return -1;
 					}
 					pthread_mutex_unlock(&sendqueue_lock);
-					pthread_cond_signal(&sendqueue_signal);
+					pthread_cond_signal(&sender->signal);
 					return 0;
 				} else {
 					pthread_mutex_unlock(&sendqueue_lock);
@@ -998,6 +2261,10 @@ static int send_queue(struct JsonNode *json, enum origin_t origin) {
 	return -1;
 }
 
+static int send_queue(struct JsonNode *json, enum origin_t origin) {
+	return send_queue_batch(json, origin, 0);
+}
+
 #ifdef WEBSERVER
 static void client_webserver_parse_code(int i, char buffer[BUFFER_SIZE]) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
@@ -1078,7 +2345,7 @@ static void client_webserver_parse_code(int i, char buffer[BUFFER_SIZE]) {
 }
 #endif
 
-static int control_device(struct devices_t *dev, char *state, struct JsonNode *values, enum origin_t origin) {
+static int control_device_batch(struct devices_t *dev, char *state, struct JsonNode *values, enum origin_t origin, unsigned int batch) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	struct devices_settings_t *sett = NULL;
@@ -1171,16 +2438,135 @@ static int control_device(struct devices_t *dev, char *state, struct JsonNode *v
 	   // || dev->protocols->listener->hwtype == HWRELAY)) {
 		json_append_member(code, "uuid", json_mkstring(dev->dev_uuid));
 	}
-	json_append_member(json, "code", code);
-	json_append_member(json, "action", json_mkstring("send"));
+	json_append_member(json, "code", code);
+	json_append_member(json, "action", json_mkstring("send"));
+
+	if(send_queue_batch(json, origin, batch) == 0) {
+		json_delete(json);
+		return 0;
+	}
+
+	json_delete(json);
+	return -1;
+}
+
+static int control_device(struct devices_t *dev, char *state, struct JsonNode *values, enum origin_t origin) {
+	return control_device_batch(dev, state, values, origin, 0);
+}
+
+/*
+ * Checks a single control code against the config, so clients
+ * don't need the whole config to control a device. The reason
+ * a code is rejected is written to error.
+ */
+static int control_validate(struct JsonNode *jcode, char *error, size_t len) {
+	struct JsonNode *jvalues = NULL, *jvalue = NULL;
+	struct devices_t *dev = NULL;
+	char *device = NULL, *state = NULL, number[255];
+	int r = 0;
+
+	if(jcode == NULL || jcode->tag != JSON_OBJECT || json_find_string(jcode, "device", &device) != 0) {
+		snprintf(error, len, "client did not send a device");
+		return -1;
+	}
+	if(devices_get(device, &dev) != 0) {
+		snprintf(error, len, "the device \"%s\" does not exist", device);
+		return -1;
+	}
+	if(json_find_string(jcode, "state", &state) == 0 && devices_valid_state(device, state) != 0) {
+		snprintf(error, len, "the device \"%s\" can't be set to \"%s\"", device, state);
+		return -1;
+	}
+	if((jvalues = json_find_member(jcode, "values")) != NULL) {
+		jvalue = json_first_child(jvalues);
+		while(jvalue) {
+			if(jvalue->tag == JSON_NUMBER) {
+				snprintf(number, sizeof(number), "%.*f", jvalue->decimals_, jvalue->number_);
+				r = devices_valid_value(device, jvalue->key, number);
+			} else if(jvalue->tag == JSON_STRING) {
+				r = devices_valid_value(device, jvalue->key, jvalue->string_);
+			} else {
+				r = 1;
+			}
+			if(r != 0) {
+				snprintf(error, len, "the device \"%s\" has no valid \"%s\" value", device, jvalue->key);
+				return -1;
+			}
+			jvalue = jvalue->next;
+		}
+	}
+	return 0;
+}
+
+/*
+ * The reply to a validated control that was rejected. The
+ * caller frees it with json_free.
+ */
+static char *control_rejected(const char *error) {
+	struct JsonNode *jreply = json_mkobject();
+	char *out = NULL;
+
+	json_append_member(jreply, "status", json_mkstring("failed"));
+	json_append_member(jreply, "error", json_mkstring((char *)error));
+	out = json_stringify(jreply, NULL);
+	json_delete(jreply);
+
+	return out;
+}
+
+/*
+ * Control several devices at once, like a scene does. All of
+ * them are checked before anything is sent, so a scene is sent
+ * as a whole or not at all. The codes are queued as one batch.
+ */
+static int control_devices_checked(struct JsonNode *jcodes, enum origin_t origin, char *error, size_t len) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct JsonNode *jcode = NULL, *jvalues = NULL;
+	struct devices_t *dev = NULL;
+	char *device = NULL, *state = NULL;
+	unsigned int batch = 0;
+	int r = 0;
+
+	if(jcodes == NULL || jcodes->tag != JSON_ARRAY || json_first_child(jcodes) == NULL) {
+		snprintf(error, len, "client did not send any codes");
+		logprintf(LOG_ERR, "%s", error);
+		return -1;
+	}
+
+	jcode = json_first_child(jcodes);
+	while(jcode) {
+		if(control_validate(jcode, error, len) != 0) {
+			logprintf(LOG_ERR, "%s", error);
+			return -1;
+		}
+		jcode = jcode->next;
+	}
 
-	if(send_queue(json, origin) == 0) {
-		json_delete(json);
-		return 0;
+	batch = batch_open();
+	r = 0;
+	jcode = json_first_child(jcodes);
+	while(jcode) {
+		state = NULL;
+		json_find_string(jcode, "device", &device);
+		json_find_string(jcode, "state", &state);
+		if((jvalues = json_find_member(jcode, "values")) != NULL) {
+			jvalues = json_first_child(jvalues);
+		}
+		if(devices_get(device, &dev) != 0 || control_device_batch(dev, state, jvalues, origin, batch) != 0) {
+			r = -1;
+		}
+		jcode = jcode->next;
 	}
+	batch_mark(batch, BATCH_CLOSE);
 
-	json_delete(json);
-	return -1;
+	return r;
+}
+
+static int control_devices(struct JsonNode *jcodes, enum origin_t origin) {
+	char error[512];
+
+	return control_devices_checked(jcodes, origin, error, sizeof(error));
 }
 
 static void *control_device1(int reason, void *param) {
@@ -1194,18 +2580,119 @@ static void *control_device1(int reason, void *param) {
 }
 
 /* Parse the incoming buffer from the client */
+/*
+ * Codes decoded by several nodes are only handled for the
+ * node that forwarded them first. The same code of another
+ * node within the repeat window is dropped, but counted for
+ * that node, so it shows which nodes hear a remote best.
+ */
+#define UPDATEDUP_SIZE	16
+
+typedef struct updatedup_t {
+	unsigned int hash;
+	int node;
+	unsigned long stamp;
+} updatedup_t;
+
+static struct updatedup_t updatedups[UPDATEDUP_SIZE];
+static int updatedups_pos = 0;
+
+static unsigned int update_hash(unsigned int hash, const char *str) {
+	while(*str != '\0') {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static int update_duplicate(struct clients_t *client, int sd, char *pname, struct JsonNode *json) {
+	struct JsonNode *jmessage = NULL;
+	unsigned long stamp = 0;
+	unsigned int hash = 0;
+	char *origin = NULL, *out = NULL;
+	int x = 0;
+
+	if(recvcache_window <= 0 ||
+	   json_find_string(json, "origin", &origin) != 0 || strcmp(origin, "receiver") != 0 ||
+	   (jmessage = json_find_member(json, "message")) == NULL) {
+		return 0;
+	}
+
+	if(client != NULL && client->metric_heard == NULL) {
+		client->metric_heard = metrics_get(METRIC_COUNTER, "pilight_node_codes_total", "Received codes forwarded by a node", "node", client->uuid);
+		client->metric_first = metrics_get(METRIC_COUNTER, "pilight_node_codes_first_total", "Received codes a node forwarded before any other node", "node", client->uuid);
+	}
+	if(client != NULL) {
+		metrics_inc(client->metric_heard, 1);
+	}
+
+	out = json_stringify(jmessage, NULL);
+	hash = update_hash(update_hash(2166136261U, pname), out);
+	json_free(out);
+
+	stamp = pilight_monotonic_ms();
+
+	for(x=0;x<UPDATEDUP_SIZE;x++) {
+		if(updatedups[x].hash == hash && updatedups[x].stamp > 0 &&
+		   stamp - updatedups[x].stamp <= (unsigned long)recvcache_window) {
+			if(updatedups[x].node != sd) {
+				return 1;
+			}
+			updatedups[x].stamp = stamp;
+			return 0;
+		}
+	}
+
+	updatedups[updatedups_pos].hash = hash;
+	updatedups[updatedups_pos].node = sd;
+	updatedups[updatedups_pos].stamp = stamp;
+	updatedups_pos = (updatedups_pos + 1) % UPDATEDUP_SIZE;
+
+	if(client != NULL) {
+		metrics_inc(client->metric_first, 1);
+	}
+	return 0;
+}
+
+static void socket_parse_update(int sd, struct JsonNode *json) {
+	struct JsonNode *jvalues = NULL;
+	struct clients_t *tmp_clients = clients;
+	char *pname = NULL;
+
+	while(tmp_clients) {
+		if(tmp_clients->id == sd) {
+			break;
+		}
+		tmp_clients = tmp_clients->next;
+	}
+
+	if((jvalues = json_find_member(json, "values")) != NULL && tmp_clients != NULL) {
+		json_find_number(jvalues, "ram", &tmp_clients->ram);
+		json_find_number(jvalues, "cpu", &tmp_clients->cpu);
+	}
+	if(json_find_string(json, "protocol", &pname) == 0) {
+		if(update_duplicate(tmp_clients, sd, pname, json) == 1) {
+			logprintf(LOG_DEBUG, "dropped %s code already forwarded by another node", pname);
+		} else {
+			broadcast_queue(pname, json, MASTER);
+		}
+	}
+}
+
 static void socket_parse_data(int i, char *buffer) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	struct sockaddr_in address;
 	struct JsonNode *json = NULL;
 	struct JsonNode *options = NULL;
+	struct JsonNode *jfilter = NULL;
 	struct clients_t *tmp_clients = NULL;
 	struct clients_t *client = NULL;
 	int sd = -1;
 	int addrlen = sizeof(address);
 	char *action = NULL, *media = NULL, *status = NULL;
 	int error = 0, exists = 0;
+	size_t errpos = 0;
 
 	if(pilight.runmode == ADHOC) {
 		sd = sockfd;
@@ -1226,11 +2713,10 @@ static void socket_parse_data(int i, char *buffer) {
 		if(strstr(buffer, " HTTP/")) {
 			client_webserver_parse_code(i, buffer);
 			socket_close(sd);
-		} else if(json_validate(buffer) == true) {
+		} else if((json = json_decode_checked(buffer, &errpos)) != NULL) {
 #else
-		if(json_validate(buffer) == true) {
+		if((json = json_decode_checked(buffer, &errpos)) != NULL) {
 #endif
-			json = json_decode(buffer);
 			if((json_find_string(json, "action", &action)) == 0) {
 				tmp_clients = clients;
 				while(tmp_clients) {
@@ -1253,8 +2739,18 @@ static void socket_parse_data(int i, char *buffer) {
 						client->receiver = 0;
 						client->forward = 0;
 						client->stats = 0;
+						client->delta = 0;
+						client->seconds = 0;
+						client->clock = 1;
+						client->filter = NULL;
 						client->cpu = 0;
 						client->ram = 0;
+						client->compact = 0;
+						client->dict = NULL;
+						client->replica = 0;
+						client->origin = NULL;
+						client->metric_heard = NULL;
+						client->metric_first = NULL;
 						strcpy(client->media, "all");
 						client->next = NULL;
 						client->id = sd;
@@ -1272,6 +2768,13 @@ static void socket_parse_data(int i, char *buffer) {
 					if(json_find_string(json, "uuid", &t) == 0) {
 						strcpy(client->uuid, t);
 					}
+					if((jfilter = json_find_member(json, "filter")) != NULL) {
+						if(gui_filter_parse(jfilter, &client->filter) != 0) {
+							error = 1;
+						}
+					} else {
+						gui_filter_free(&client->filter);
+					}
 					if((options = json_find_member(json, "options")) != NULL) {
 						struct JsonNode *childs = json_first_child(options);
 						while(childs) {
@@ -1310,6 +2813,44 @@ static void socket_parse_data(int i, char *buffer) {
 								} else {
 									client->forward = 0;
 								}
+							} else if(strcmp(childs->key, "delta") == 0 &&
+							   childs->tag == JSON_NUMBER) {
+								if((int)childs->number_ == 1) {
+									client->delta = 1;
+								} else {
+									client->delta = 0;
+								}
+							} else if(strcmp(childs->key, "seconds") == 0 &&
+							   childs->tag == JSON_NUMBER) {
+								if((int)childs->number_ == 1) {
+									client->seconds = 1;
+								} else {
+									client->seconds = 0;
+								}
+							} else if(strcmp(childs->key, "clock") == 0 &&
+							   childs->tag == JSON_NUMBER) {
+								if((int)childs->number_ == 1) {
+									client->clock = 1;
+								} else {
+									client->clock = 0;
+								}
+							} else if(strcmp(childs->key, "compact") == 0 &&
+							   childs->tag == JSON_NUMBER) {
+								if((int)childs->number_ == 1) {
+									client->compact = 1;
+								} else {
+									client->compact = 0;
+								}
+							} else if(strcmp(childs->key, "replica") == 0 &&
+							   childs->tag == JSON_NUMBER) {
+								/* Replicated changes are sent in compact frames */
+								if((int)childs->number_ == 1 && strlen(client->uuid) > 0) {
+									client->replica = 1;
+									client->compact = 1;
+									client->origin = replica_origin(client->uuid);
+								} else {
+									client->replica = 0;
+								}
 							} else {
 							   error = 1;
 							   break;
@@ -1319,6 +2860,7 @@ static void socket_parse_data(int i, char *buffer) {
 					}
 					if(exists == 0) {
 						if(error == 1) {
+							gui_filter_free(&client->filter);
 							FREE(client);
 						} else {
 							tmp_clients = clients;
@@ -1333,7 +2875,30 @@ static void socket_parse_data(int i, char *buffer) {
 							}
 						}
 					}
-					socket_write(sd, "{\"status\":\"success\"}");
+					if(error == 0 && client->compact == 1) {
+						/* The reply is the last message that isn't framed */
+						if(client->dict == NULL) {
+							if((client->dict = MALLOC(sizeof(struct compact_dict_t))) == NULL) {
+								OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+							}
+							memset(client->dict, 0, sizeof(struct compact_dict_t));
+						}
+						compact_dict_clear(client->dict);
+						socket_compact_input(sd);
+						if(client->replica == 1) {
+							char reply[128];
+							snprintf(reply, sizeof(reply), "{\"status\":\"success\",\"compact\":1,\"replica\":{\"epoch\":%lu,\"seq\":%lu,\"since\":%lu}}",
+								client->origin->epoch, client->origin->seq, client->origin->timestamp);
+							socket_write(sd, reply);
+						} else {
+							socket_write(sd, "{\"status\":\"success\",\"compact\":1}");
+						}
+					} else {
+						socket_write(sd, "{\"status\":\"success\"}");
+					}
+					if(error == 0 && client->delta == 1) {
+						client_send_delta_ids(sd);
+					}
 				} else if(strcmp(action, "send") == 0) {
 					if(send_queue(json, SENDER) == 0) {
 						socket_write(sd, "{\"status\":\"success\"}");
@@ -1343,8 +2908,26 @@ static void socket_parse_data(int i, char *buffer) {
 				} else if(strcmp(action, "control") == 0) {
 					struct JsonNode *code = NULL;
 					struct devices_t *dev = NULL;
-					char *device = NULL;
-					if((code = json_find_member(json, "code")) == NULL || code->tag != JSON_OBJECT) {
+					char *device = NULL, *reply = NULL, error[512];
+					double validate = 0;
+
+					/* A validated control is answered with the reason it was rejected */
+					json_find_number(json, "validate", &validate);
+					if((code = json_find_member(json, "code")) != NULL && code->tag == JSON_ARRAY) {
+						if(control_devices_checked(code, SENDER, error, sizeof(error)) == 0) {
+							socket_write(sd, "{\"status\":\"success\"}");
+						} else if((int)validate == 1) {
+							reply = control_rejected(error);
+							socket_write(sd, reply);
+							json_free(reply);
+						} else {
+							socket_write(sd, "{\"status\":\"failed\"}");
+						}
+					} else if((int)validate == 1 && control_validate(code, error, sizeof(error)) != 0) {
+						reply = control_rejected(error);
+						socket_write(sd, reply);
+						json_free(reply);
+					} else if(code == NULL || code->tag != JSON_OBJECT) {
 						logprintf(LOG_ERR, "client did not send any codes");
 					} else {
 						/* Check if a location and device are given */
@@ -1452,27 +3035,39 @@ static void socket_parse_data(int i, char *buffer) {
 				} else if(strcmp(action, "request config") == 0) {
 					struct JsonNode *jsend = json_mkobject();
 					struct JsonNode *jconfig = NULL;
-					if(client->forward == 1) {
-						jconfig = config_print(CONFIG_FORWARD, client->media);
+					unsigned int hash = devices_config_hash(client->media);
+					double known = 0;
+					/* A reconnecting node can keep the devices it has */
+					if(client->forward == 1 && json_find_number(json, "hash", &known) == 0 &&
+					   (unsigned int)known == hash) {
+						json_append_member(jsend, "message", json_mkstring("config"));
+						json_append_member(jsend, "hash", json_mknumber(hash, 0));
+						json_append_member(jsend, "unchanged", json_mknumber(1, 0));
 					} else {
-						jconfig = config_print(CONFIG_INTERNAL, client->media);
+						if(client->forward == 1) {
+							jconfig = config_print(CONFIG_FORWARD, client->media);
+						} else {
+							jconfig = config_print(CONFIG_INTERNAL, client->media);
+						}
+						json_append_member(jsend, "message", json_mkstring("config"));
+						json_append_member(jsend, "config", jconfig);
+						json_append_member(jsend, "hash", json_mknumber(hash, 0));
 					}
-					json_append_member(jsend, "message", json_mkstring("config"));
-					json_append_member(jsend, "config", jconfig);
 					char *output = json_stringify(jsend, NULL);
 					str_replace("%", "%%", &output);
 					socket_write(sd, output);
 					json_free(output);
 					json_delete(jsend);
 				} else if(strcmp(action, "request values") == 0) {
-					struct JsonNode *jsend = json_mkobject();
-					struct JsonNode *jvalues = devices_values(client->media);
-					json_append_member(jsend, "message", json_mkstring("values"));
-					json_append_member(jsend, "values", jvalues);
-					char *output = json_stringify(jsend, NULL);
+					char *jvalues = devices_values_json(client->media);
+					char *output = MALLOC(strlen(jvalues)+strlen("{\"message\":\"values\",\"values\":}")+1);
+					if(output == NULL) {
+						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+					}
+					sprintf(output, "{\"message\":\"values\",\"values\":%s}", jvalues);
 					socket_write(sd, output);
-					json_free(output);
-					json_delete(jsend);
+					FREE(output);
+					FREE(jvalues);
 					/* send version packet */
 					struct JsonNode *jsend_version = json_mkobject();
 					json_append_member(jsend_version, "version", json_mkstring(PILIGHT_VERSION));
@@ -1481,31 +3076,22 @@ static void socket_parse_data(int i, char *buffer) {
 					json_free(output_version);
 					json_delete(jsend_version);
 
+				} else if(strcmp(action, "request history") == 0) {
+					struct JsonNode *jsend = history_request(json);
+					if(jsend != NULL) {
+						char *output = json_stringify(jsend, NULL);
+						socket_write(sd, output);
+						json_free(output);
+						json_delete(jsend);
+					} else {
+						socket_write(sd, "{\"status\":\"failed\"}");
+					}
+
 				/*
 				 * Parse received codes from nodes
 				 */
 				} else if(strcmp(action, "update") == 0) {
-					struct JsonNode *jvalues = NULL;
-					char *pname = NULL;
-					if((jvalues = json_find_member(json, "values")) != NULL) {
-						exists = 0;
-						tmp_clients = clients;
-						while(tmp_clients) {
-							if(tmp_clients->id == sd) {
-								exists = 1;
-								client = tmp_clients;
-								break;
-							}
-							tmp_clients = tmp_clients->next;
-						}
-						if(exists) {
-							json_find_number(jvalues, "ram", &client->ram);
-							json_find_number(jvalues, "cpu", &client->cpu);
-						}
-					}
-					if(json_find_string(json, "protocol", &pname) == 0) {
-						broadcast_queue(pname, json, MASTER);
-					}
+					socket_parse_update(sd, json);
 				} else {
 					error = 1;
 				}
@@ -1528,6 +3114,8 @@ static void socket_parse_data(int i, char *buffer) {
 				error = 1;
 			}
 			json_delete(json);
+		} else {
+			logprintf(LOG_DEBUG, "socket client sent invalid json at byte %zu", errpos);
 		}
 	}
 	if(error == 1) {
@@ -1536,11 +3124,217 @@ static void socket_parse_data(int i, char *buffer) {
 	}
 }
 
-/* Rewrite code start */
+/*
+ * Several nodes can hear the same remote. The trains they
+ * forward are remembered for the repeat window, so the
+ * same train of another node is only decoded once. The
+ * repeats of the node that was first are still decoded.
+ * Local receivers, like the instances of 433gpio, are
+ * nodes as well, numbered below zero.
+ */
+#define RECVDUP_SIZE	8
+
+typedef struct recvdup_t {
+	int node;
+	int hwtype;
+	int length;
+	unsigned long stamp;
+	int pulses[MAXPULSESTREAMLENGTH];
+} recvdup_t;
+
+static struct recvdup_t recvdups[RECVDUP_SIZE];
+static int recvdups_pos = 0;
+static pthread_mutex_t recvdups_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int receive_duplicate(int node, int *pulses, int length, int hwtype) {
+	struct recvdup_t *dup = NULL;
+	unsigned long stamp = 0;
+	int i = 0, x = 0, diff = 0;
+
+	if(recvcache_window <= 0) {
+		return 0;
+	}
+
+	stamp = pilight_monotonic_ms();
+
+	pthread_mutex_lock(&recvdups_lock);
+	for(x=0;x<RECVDUP_SIZE;x++) {
+		dup = &recvdups[x];
+		if(dup->length != length || dup->hwtype != hwtype ||
+		   stamp - dup->stamp > (unsigned long)recvcache_window) {
+			continue;
+		}
+		for(i=0;i<length;i++) {
+			diff = abs(dup->pulses[i] - pulses[i]);
+			if(diff > dup->pulses[i]/4+PULSE_DIV) {
+				break;
+			}
+		}
+		if(i == length) {
+			if(dup->node != node) {
+				pthread_mutex_unlock(&recvdups_lock);
+				metrics_inc(metric_receive_duplicates, 1);
+				return 1;
+			}
+			dup->stamp = stamp;
+			pthread_mutex_unlock(&recvdups_lock);
+			return 0;
+		}
+	}
+
+	dup = &recvdups[recvdups_pos];
+	recvdups_pos = (recvdups_pos + 1) % RECVDUP_SIZE;
+	dup->node = node;
+	dup->hwtype = hwtype;
+	dup->length = length;
+	dup->stamp = stamp;
+	memcpy(dup->pulses, pulses, sizeof(int)*(size_t)length);
+	pthread_mutex_unlock(&recvdups_lock);
+
+	return 0;
+}
+
+/*
+ * A change replicated by another master. Within an epoch the
+ * frames are numbered without gaps, so a missing frame makes
+ * us drop the connection. The master then reconnects and
+ * replays what we missed. Returns -1 when the frame was
+ * invalid.
+ */
+static int socket_parse_replica(struct clients_t *client, const unsigned char *buf, size_t len) {
+	struct replica_origin_t *origin = client->origin;
+	struct JsonNode *jupdate = NULL, *jmessage = NULL;
+	unsigned long epoch = 0, seq = 0, timestamp = 0;
+	char pname[1] = "";
+	int flags = 0;
+
+	if(client->replica == 0 || origin == NULL || client->dict == NULL ||
+	   compact_decode_replica(client->dict, buf, len, &flags, &epoch, &seq, &timestamp, &jupdate) != 0) {
+		return -1;
+	}
+	if(jupdate != NULL && (json_find_member(jupdate, "devices") == NULL || json_find_member(jupdate, "values") == NULL)) {
+		json_delete(jupdate);
+		return -1;
+	}
+
+	if((flags & COMPACT_REPLICA_CATCHUP) == COMPACT_REPLICA_CATCHUP) {
+		if(jupdate == NULL) {
+			/* All was replayed, the stream continues from here */
+			origin->epoch = epoch;
+			origin->seq = seq;
+			if(origin->catchup > origin->timestamp) {
+				origin->timestamp = origin->catchup;
+			}
+			origin->catchup = 0;
+		} else if(timestamp > origin->catchup) {
+			origin->catchup = timestamp;
+		}
+	} else if(epoch == origin->epoch && seq <= origin->seq) {
+		/* Already replayed */
+		json_delete(jupdate);
+		return 0;
+	} else if(epoch != origin->epoch || seq != origin->seq+1) {
+		logprintf(LOG_NOTICE, "missed replicated changes of \"%s\", catching up", client->uuid);
+		json_delete(jupdate);
+		client_remove(client->id);
+		socket_close(client->id);
+		return 0;
+	} else {
+		origin->seq = seq;
+		if(timestamp > origin->timestamp) {
+			origin->timestamp = timestamp;
+		}
+	}
+
+	if(jupdate != NULL) {
+		/* Applied in order with the other updates by the broadcast thread */
+		jmessage = json_mkobject();
+		json_append_member(jmessage, "origin", json_mkstring("replica"));
+		json_append_member(jmessage, "uuid", json_mkstring(client->uuid));
+		json_append_member(jmessage, "timestamp", json_mknumber((double)timestamp, 0));
+		json_append_member(jmessage, "devices", json_clone(json_find_member(jupdate, "devices")));
+		json_append_member(jmessage, "values", json_clone(json_find_member(jupdate, "values")));
+		broadcast_queue(pname, jmessage, MASTER);
+		json_delete(jmessage);
+		json_delete(jupdate);
+	}
+	return 0;
+}
+
+/*
+ * Frames of nodes that switched to the compact protocol.
+ * Plain messages are parsed as if they weren't framed.
+ */
+static void socket_parse_compact(int i, int type, const unsigned char *buf, size_t len) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-static int socket_parse_responses(char *buffer, char *media, char **respons) {
+	struct clients_t *tmp_clients = clients;
 	struct JsonNode *json = NULL;
+	int pulses[MAXPULSESTREAMLENGTH];
+	int sd = socket_get_clients(i), error = 0;
+	int hwtype = -1, length = 0;
+	char *buffer = NULL;
+
+	while(tmp_clients) {
+		if(tmp_clients->id == sd) {
+			break;
+		}
+		tmp_clients = tmp_clients->next;
+	}
+
+	switch(type) {
+		case COMPACT_JSON:
+			if((buffer = MALLOC(len+1)) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			memcpy(buffer, buf, len);
+			buffer[len] = '\0';
+			socket_parse_data(i, buffer);
+			FREE(buffer);
+		break;
+		case COMPACT_UPDATE:
+			if(tmp_clients == NULL || tmp_clients->dict == NULL ||
+			   (json = compact_decode(tmp_clients->dict, buf, len)) == NULL) {
+				error = 1;
+			} else {
+				socket_parse_update(sd, json);
+				json_delete(json);
+			}
+		break;
+		case COMPACT_REPLICA:
+			if(tmp_clients == NULL || socket_parse_replica(tmp_clients, buf, len) != 0) {
+				error = 1;
+			}
+		break;
+		case COMPACT_PULSES:
+			if(compact_decode_pulses(buf, len, &hwtype, pulses, &length) != 0 || length <= 0) {
+				error = 1;
+			} else if(receive_duplicate(sd, pulses, length, hwtype) == 0) {
+				receive_queue(pulses, length, pulses[length-1]/PULSE_DIV, hwtype, NULL);
+			}
+		break;
+		default:
+			error = 1;
+		break;
+	}
+
+	if(error == 1) {
+		logprintf(LOG_NOTICE, "client \"%s\" sent an invalid compact frame", (tmp_clients != NULL) ? tmp_clients->uuid : "");
+		client_remove(sd);
+		socket_close(sd);
+	}
+}
+
+/* Rewrite code start */
+
+/*
+ * Uses json when the caller already decoded the buffer, the
+ * caller keeps it. Otherwise the buffer is decoded into json
+ * of its own, which socket_parse_responses frees.
+ */
+static int socket_parse_request(char *buffer, struct JsonNode *json, char *media, char **respons, struct JsonNode **decoded) {
 	char *action = NULL, *status = NULL;
+	size_t errpos = 0;
 
 	if(strcmp(buffer, "HEART") == 0) {
 		if((*respons = MALLOC(strlen("BEAT")+1)) == NULL) {
@@ -1553,15 +3347,13 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 			logprintf(LOG_DEBUG, "socket recv: %s", buffer);
 		}
 
-		if(json_validate(buffer) == true) {
-			json = json_decode(buffer);
+		if(json != NULL || (json = *decoded = json_decode_checked(buffer, &errpos)) != NULL) {
 			if((json_find_string(json, "status", &status)) == 0) {
 				if(strcmp(status, "success") == 0) {
 					if((*respons = MALLOC(strlen("{\"status\":\"success\"}")+1)) == NULL) {
 						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 					}
 					strcpy(*respons, "{\"status\":\"success\"}");
-					json_delete(json);
 					return 0;
 				}
 			}
@@ -1572,29 +3364,57 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 							OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 						}
 						strcpy(*respons, "{\"status\":\"success\"}");
-						json_delete(json);
 						return 0;
 					} else {
 						if((*respons = MALLOC(strlen("{\"status\":\"failed\"}")+1)) == NULL) {
 							OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 						}
 						strcpy(*respons, "{\"status\":\"failed\"}");
-						json_delete(json);
 						return 0;
 					}
 				} else if(strcmp(action, "control") == 0) {
 					struct JsonNode *code = NULL;
-					char *device = NULL;
+					char *device = NULL, *reply = NULL, error[512];
 					struct devices_t *dev = NULL;
-					if((code = json_find_member(json, "code")) == NULL || code->tag != JSON_OBJECT) {
+					double validate = 0;
+
+					/* A validated control is answered with the reason it was rejected */
+					json_find_number(json, "validate", &validate);
+					if((code = json_find_member(json, "code")) != NULL && code->tag == JSON_ARRAY) {
+						if(control_devices_checked(code, ORIGIN_SENDER, error, sizeof(error)) == 0) {
+							if((*respons = MALLOC(strlen("{\"status\":\"success\"}")+1)) == NULL) {
+								OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+							}
+							strcpy(*respons, "{\"status\":\"success\"}");
+						} else if((int)validate == 1) {
+							reply = control_rejected(error);
+							if((*respons = MALLOC(strlen(reply)+1)) == NULL) {
+								OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+							}
+							strcpy(*respons, reply);
+							json_free(reply);
+						} else {
+							if((*respons = MALLOC(strlen("{\"status\":\"failed\"}")+1)) == NULL) {
+								OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+							}
+							strcpy(*respons, "{\"status\":\"failed\"}");
+						}
+						return 0;
+					} else if((int)validate == 1 && control_validate(code, error, sizeof(error)) != 0) {
+						reply = control_rejected(error);
+						if((*respons = MALLOC(strlen(reply)+1)) == NULL) {
+							OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+						}
+						strcpy(*respons, reply);
+						json_free(reply);
+						return 0;
+					} else if(code == NULL || code->tag != JSON_OBJECT) {
 						logprintf(LOG_ERR, "client did not send any codes");
-						json_delete(json);
 						return -1;
 					} else {
 						/* Check if a location and device are given */
 						if(json_find_string(code, "device", &device) != 0) {
 							logprintf(LOG_ERR, "client did not send a device");
-							json_delete(json);
 							return -1;
 						/* Check if the device and location exists in the config file */
 						} else if(devices_get(device, &dev) == 0) {
@@ -1611,19 +3431,16 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 									OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 								}
 								strcpy(*respons, "{\"status\":\"success\"}");
-								json_delete(json);
 								return 0;
 							} else {
 								if((*respons = MALLOC(strlen("{\"status\":\"failed\"}")+1)) == NULL) {
 									OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 								}
 								strcpy(*respons, "{\"status\":\"failed\"}");
-								json_delete(json);
 								return 0;
 							}
 						} else {
 							logprintf(LOG_ERR, "the device \"%s\" does not exist", device);
-							json_delete(json);
 							return -1;
 						}
 					}
@@ -1636,7 +3453,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 					int dec = 0;
 					if(json_find_string(json, "type", &type) != 0) {
 						logprintf(LOG_ERR, "client did not send a type of action");
-						json_delete(json);
 						return -1;
 					} else {
 						if(strcmp(type, "set") == 0) {
@@ -1646,7 +3462,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 									OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 								}
 								strcpy(*respons, "{\"status\":\"failed\"}");
-								json_delete(json);
 								return 0;
 							} else if((value = json_find_member(json, "value")) == NULL) {
 								logprintf(LOG_ERR, "client did not send a registry value");
@@ -1654,7 +3469,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 									OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 								}
 								strcpy(*respons, "{\"status\":\"failed\"}");
-								json_delete(json);
 								return 0;
 							} else {
 								if(value->tag == JSON_NUMBER) {
@@ -1663,14 +3477,12 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 											OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 										}
 										strcpy(*respons, "{\"status\":\"success\"}");
-										json_delete(json);
 										return 0;
 									} else {
 										if((*respons = MALLOC(strlen("{\"status\":\"failed\"}")+1)) == NULL) {
 											OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 										}
 										strcpy(*respons, "{\"status\":\"failed\"}");
-										json_delete(json);
 										return 0;
 									}
 								} else if(value->tag == JSON_STRING) {
@@ -1679,14 +3491,12 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 											OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 										}
 										strcpy(*respons, "{\"status\":\"success\"}");
-										json_delete(json);
 										return 0;
 									} else {
 										if((*respons = MALLOC(strlen("{\"status\":\"failed\"}")+1)) == NULL) {
 											OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 										}
 										strcpy(*respons, "{\"status\":\"failed\"}");
-										json_delete(json);
 										return 0;
 									}
 								} else {
@@ -1695,7 +3505,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 										OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 									}
 									strcpy(*respons, "{\"status\":\"failed\"}");
-									json_delete(json);
 									return 0;
 								}
 							}
@@ -1706,7 +3515,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 									OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 								}
 								strcpy(*respons, "{\"status\":\"failed\"}");
-								json_delete(json);
 								return 0;
 							} else {
 								if(config_registry_set_null(key) == 0) {
@@ -1714,7 +3522,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 										OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 									}
 									strcpy(*respons, "{\"status\":\"success\"}");
-									json_delete(json);
 									return 0;
 								} else {
 									logprintf(LOG_ERR, "registry value can only be a string or number");
@@ -1722,7 +3529,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 										OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 									}
 									strcpy(*respons, "{\"status\":\"failed\"}");
-									json_delete(json);
 									return 0;
 								}
 							}
@@ -1733,7 +3539,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 									OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 								}
 								strcpy(*respons, "{\"status\":\"failed\"}");
-								json_delete(json);
 								return 0;
 							} else {
 								struct varcont_t out;
@@ -1751,7 +3556,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 										strcpy(*respons, output);
 										json_free(output);
 										json_delete(jsend);
-										json_delete(json);
 										return 0;
 									} else if(out.type_ == JSON_STRING) {
 										struct JsonNode *jsend = json_mkobject();
@@ -1765,7 +3569,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 										strcpy(*respons, output);
 										json_free(output);
 										json_delete(jsend);
-										json_delete(json);
 										return 0;
 									} else {
 										logprintf(LOG_ERR, "registry key '%s' does not exist", key);
@@ -1773,7 +3576,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 											OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 										}
 										strcpy(*respons, "{\"status\":\"failed\"}");
-										json_delete(json);
 										return 0;
 									}
 								} else {
@@ -1782,7 +3584,6 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 										OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 									}
 									strcpy(*respons, "{\"status\":\"failed\"}");
-									json_delete(json);
 									return 0;
 								}
 							}
@@ -1802,15 +3603,11 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 					strcpy(*respons, output);
 					json_free(output);
 					json_delete(jsend);
-					json_delete(json);
 					return 0;
 				} else if(strcmp(action, "request values") == 0) {
-					struct JsonNode *jsend = json_mkobject();
 #ifdef PILIGHT_REWRITE
+					struct JsonNode *jsend = json_mkobject();
 					struct JsonNode *jvalues = values_print(media);
-#else
-					JsonNode *jvalues = devices_values(media);
-#endif
 					json_append_member(jsend, "message", json_mkstring("values"));
 					json_append_member(jsend, "values", jvalues);
 					char *output = json_stringify(jsend, NULL);
@@ -1820,18 +3617,49 @@ static int socket_parse_responses(char *buffer, char *media, char **respons) {
 					strcpy(*respons, output);
 					json_free(output);
 					json_delete(jsend);
-					json_delete(json);
+#else
+					char *jvalues = devices_values_json(media);
+					if((*respons = MALLOC(strlen(jvalues)+strlen("{\"message\":\"values\",\"values\":}")+1)) == NULL) {
+						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+					}
+					sprintf(*respons, "{\"message\":\"values\",\"values\":%s}", jvalues);
+					FREE(jvalues);
+#endif
+					return 0;
+				} else if(strcmp(action, "request history") == 0) {
+					struct JsonNode *jsend = history_request(json);
+					if(jsend == NULL) {
+						return -1;
+					}
+					char *output = json_stringify(jsend, NULL);
+					if((*respons = MALLOC(strlen(output)+1)) == NULL) {
+						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+					}
+					strcpy(*respons, output);
+					json_free(output);
+					json_delete(jsend);
 					return 0;
 				}
 			} else {
-				json_delete(json);
 				return -1;
 			}
+		} else {
+			logprintf(LOG_DEBUG, "socket client sent invalid json at byte %zu", errpos);
 		}
 	}
 	return -1;
 }
 
+static int socket_parse_responses(char *buffer, struct JsonNode *json, char *media, char **respons) {
+	struct JsonNode *decoded = NULL;
+	int ret = socket_parse_request(buffer, json, media, respons, &decoded);
+
+	if(decoded != NULL) {
+		json_delete(decoded);
+	}
+	return ret;
+}
+
 static void *socket_parse_data1(int reason, void *param) {
 	struct reason_socket_received_t *data = param;
 
@@ -1840,11 +3668,13 @@ static void *socket_parse_data1(int reason, void *param) {
 
 	struct JsonNode *json = NULL;
 	struct JsonNode *options = NULL;
+	struct JsonNode *jfilter = NULL;
 	struct clients_t *tmp_clients = NULL;
 	struct clients_t *client = NULL;
 	char *action = NULL, *media = NULL, *status = NULL, *respons = NULL;
 	char all[] = "all";
 	int error = 0, exists = 0, sd = -1;
+	size_t errpos = 0;
 
 	if(strlen(data->type) == 0) {
 		logprintf(LOG_ERR, "socket data misses a socket type");
@@ -1873,8 +3703,7 @@ static void *socket_parse_data1(int reason, void *param) {
 		media = client->media;
 	}
 
-	if(json_validate(data->buffer) == true) {
-		json = json_decode(data->buffer);
+	if((json = json_decode_arena_checked(data->buffer, &errpos)) != NULL) {
 		if((json_find_string(json, "action", &action)) == 0) {
 			if(strcmp(action, "identify") == 0) {
 				/* Check if client doesn't already exist */
@@ -1887,6 +3716,10 @@ static void *socket_parse_data1(int reason, void *param) {
 					client->receiver = 0;
 					client->forward = 0;
 					client->stats = 0;
+					client->delta = 0;
+					client->seconds = 0;
+					client->clock = 1;
+					client->filter = NULL;
 					client->cpu = 0;
 					strcpy(client->media, "all");
 					client->next = NULL;
@@ -1905,6 +3738,13 @@ static void *socket_parse_data1(int reason, void *param) {
 				if(json_find_string(json, "uuid", &t) == 0) {
 					strcpy(client->uuid, t);
 				}
+				if((jfilter = json_find_member(json, "filter")) != NULL) {
+					if(gui_filter_parse(jfilter, &client->filter) != 0) {
+						error = 1;
+					}
+				} else {
+					gui_filter_free(&client->filter);
+				}
 				if((options = json_find_member(json, "options")) != NULL) {
 					struct JsonNode *childs = json_first_child(options);
 					while(childs) {
@@ -1943,6 +3783,27 @@ static void *socket_parse_data1(int reason, void *param) {
 							} else {
 								client->forward = 0;
 							}
+						} else if(strcmp(childs->key, "delta") == 0 &&
+							 childs->tag == JSON_NUMBER) {
+							if((int)childs->number_ == 1) {
+								client->delta = 1;
+							} else {
+								client->delta = 0;
+							}
+						} else if(strcmp(childs->key, "seconds") == 0 &&
+							 childs->tag == JSON_NUMBER) {
+							if((int)childs->number_ == 1) {
+								client->seconds = 1;
+							} else {
+								client->seconds = 0;
+							}
+						} else if(strcmp(childs->key, "clock") == 0 &&
+							 childs->tag == JSON_NUMBER) {
+							if((int)childs->number_ == 1) {
+								client->clock = 1;
+							} else {
+								client->clock = 0;
+							}
 						} else {
 						 error = 1;
 						 break;
@@ -1952,6 +3813,7 @@ static void *socket_parse_data1(int reason, void *param) {
 				}
 				if(exists == 0) {
 					if(error == -1) {
+						gui_filter_free(&client->filter);
 						FREE(client);
 					} else {
 						tmp_clients = clients;
@@ -1965,6 +3827,9 @@ static void *socket_parse_data1(int reason, void *param) {
 							clients = client;
 						}
 						socket_write(sd, "{\"status\":\"success\"}");
+						if(client->delta == 1) {
+							client_send_delta_ids(sd);
+						}
 						json_delete(json);
 						return NULL;
 					}
@@ -2032,7 +3897,8 @@ static void *socket_parse_data1(int reason, void *param) {
 		}
 	}
 
-	if(socket_parse_responses(data->buffer, media, &respons) == 0) {
+	/* The decoded message is passed on, so it's parsed only once */
+	if(socket_parse_responses(data->buffer, json, media, &respons) == 0) {
 		struct reason_socket_send_t *data1 = MALLOC(sizeof(struct reason_socket_send_t));
 		if(data1 == NULL) {
 			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
@@ -2072,17 +3938,10 @@ void *receivePulseTrain(void *param) {
 
 	struct rawcode_t r;
 	r.length = 0;
-	int plslen = 0;
-#ifdef _WIN32
-	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
-#else
+	int plslen = 0;
 	/* Make sure the pilight receiving gets
 	   the highest priority available */
-	struct sched_param sched;
-	memset(&sched, 0, sizeof(sched));
-	sched.sched_priority = 70;
-	pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
-#endif
+	threads_realtime(THREAD_RT_RECEIVE, SCHED_FIFO, 70);
 
 	struct hardware_t *hw = (hardware_t *)param;
 	pthread_mutex_lock(&hw->lock);
@@ -2096,9 +3955,11 @@ void *receivePulseTrain(void *param) {
 			hw->receivePulseTrain(&r);
 			plslen = r.pulses[r.length-1]/PULSE_DIV;
 			if(r.length > 0) {
-				receive_queue(r.pulses, r.length, plslen, hw->hwtype);
+				if(node_send_pulses(r.pulses, r.length, hw->hwtype) == -1) {
+					receive_queue(r.pulses, r.length, plslen, hw->hwtype, NULL);
+				}
 			} else if(r.length == -1) {
-				hw->init();
+				hw->init(hw);
 				sleep(1);
 			}
 
@@ -2182,11 +4043,17 @@ static void *receivePulseTrain1(int reason, void *param) {
 
 	if(data->hardware != NULL && data->pulses != NULL && data->length > 0) {
 #ifndef PILIGHT_REWRITE
-		int hwtype = 0;
+		int hwtype = 0, node = 0, nrhw = 0, multiple = 0;
 		struct conf_hardware_t *tmp_confhw = conf_hardware;
+		struct protocol_index_t *candidates = NULL;
 		while(tmp_confhw) {
+			nrhw++;
 			if(strcmp(tmp_confhw->hardware->id, data->hardware) == 0) {
 				hwtype = tmp_confhw->hardware->hwtype;
+				node = -nrhw;
+			}
+			if(tmp_confhw->hardware->module != NULL) {
+				multiple = 1;
 			}
 			tmp_confhw = tmp_confhw->next;
 		}
@@ -2196,11 +4063,23 @@ static void *receivePulseTrain1(int reason, void *param) {
 		if(hardware_select_struct(ORIGIN_MASTER, data->hardware, &hw) == 0) {
 #endif
 			plslen = data->pulses[data->length-1]/PULSE_DIV;
+			rawtap_publish(data->hardware, data->pulses, data->length);
 			if(data->length > 0) {
 #ifdef PILIGHT_REWRITE
 				receive_parse_code(data->pulses, data->length, plslen, hw->hwtype);
 #else
-				receive_queue(data->pulses, data->length, plslen, hwtype);
+				capture_write(hwtype, data->pulses, data->length);
+				if(shed_level >= SHED_QUIET && protocol_index_get(data->length, &candidates) == 0) {
+					metrics_inc(metric_shed_noise, 1);
+					return (void *)NULL;
+				}
+				/* The same code picked up by another receiver instance */
+				if(multiple == 1 && receive_duplicate(node, data->pulses, data->length, hwtype) == 1) {
+					return (void *)NULL;
+				}
+				if(node_send_pulses(data->pulses, data->length, hwtype) == -1) {
+					receive_queue(data->pulses, data->length, plslen, hwtype, &data->trace);
+				}
 #endif
 			}
 #ifdef PILIGHT_REWRITE
@@ -2221,33 +4100,64 @@ void *clientize(void *param) {
   char *recvBuff = NULL, *output = NULL;
 	char *message = NULL, *action = NULL;
 	char *origin = NULL, *protocol = NULL;
-	int client_loop = 0, config_synced = 0;
+	char master_ip[17];
+	unsigned short master_cached = 0;
+	unsigned int config_hash = 0;
+	int client_loop = 0, config_synced = 0, compact = 1;
+	int config_known = 0, backoff = NODE_BACKOFF_MIN, wait = 0;
+	double hash = 0;
+
+	config_setting_get_number("adhoc-compact", 0, &compact);
+	config_setting_get_number("adhoc-raw", 0, &adhoc_raw);
 
 	while(main_loop) {
 
 		if(client_loop == 1) {
 			logprintf(LOG_NOTICE, "connection to main pilight daemon lost");
 			logprintf(LOG_NOTICE, "trying to reconnect...");
-			sleep(1);
+			/* Spread the nodes that lost the same master */
+			wait = backoff/2 + rand() % (backoff/2+1);
+			while(main_loop && wait > 0) {
+				usleep(((wait > 100) ? 100 : wait) * 1000);
+				wait -= 100;
+			}
+			backoff = (backoff*2 > NODE_BACKOFF_MAX) ? NODE_BACKOFF_MAX : backoff*2;
+			if(main_loop == 0) {
+				break;
+			}
 		}
 
 		client_loop = 1;
 		config_synced = 0;
 
+		pthread_mutex_lock(&node_lock);
+		node_compact = 0;
+		socket_compact_output(0);
+		compact_dict_clear(&node_dict);
+		pthread_mutex_unlock(&node_lock);
+
 		ssdp_list = NULL;
 		if(master_server != NULL && master_port > 0) {
 			if((sockfd = socket_connect(master_server, master_port)) == -1) {
 				logprintf(LOG_ERR, "could not connect to pilight-daemon");
 				continue;
 			}
+		/* The master we had is tried before searching again */
+		} else if(master_cached > 0 && (sockfd = socket_connect(master_ip, master_cached)) > 0) {
+			logprintf(LOG_DEBUG, "reconnected to pilight-daemon @%s", master_ip);
 		} else if(ssdp_seek(&ssdp_list) == -1) {
 			logprintf(LOG_NOTICE, "no pilight ssdp connections found");
+			master_cached = 0;
 			continue;
 		} else {
 			if((sockfd = socket_connect(ssdp_list->ip, ssdp_list->port)) == -1) {
 				logprintf(LOG_ERR, "could not connect to pilight-daemon");
+				master_cached = 0;
+				ssdp_free(ssdp_list);
 				continue;
 			}
+			strcpy(master_ip, ssdp_list->ip);
+			master_cached = ssdp_list->port;
 		}
 		if(ssdp_list) {
 			ssdp_free(ssdp_list);
@@ -2259,6 +4169,9 @@ void *clientize(void *param) {
 		json_append_member(joptions, "receiver", json_mknumber(1, 0));
 		json_append_member(joptions, "forward", json_mknumber(1, 0));
 		json_append_member(joptions, "config", json_mknumber(1, 0));
+		if(compact == 1 && compact_refused == 0) {
+			json_append_member(joptions, "compact", json_mknumber(1, 0));
+		}
 		json_append_member(json, "uuid", json_mkstring(pilight_uuid));
 		json_append_member(json, "options", joptions);
 		output = json_stringify(json, NULL);
@@ -2270,14 +4183,31 @@ void *clientize(void *param) {
 		json_free(output);
 		json_delete(json);
 
-		if(socket_read(sockfd, &recvBuff, 1) != 0
-		   || strcmp(recvBuff, "{\"status\":\"success\"}") != 0) {
+		if(socket_read(sockfd, &recvBuff, 1) != 0) {
+			continue;
+		}
+		if(strcmp(recvBuff, "{\"status\":\"success\",\"compact\":1}") == 0) {
+			pthread_mutex_lock(&node_lock);
+			node_compact = 1;
+			socket_compact_output(sockfd);
+			pthread_mutex_unlock(&node_lock);
+		} else if(strcmp(recvBuff, "{\"status\":\"success\"}") != 0) {
+			continue;
+		} else if(compact == 1 && compact_refused == 0) {
+			/* Older masters drop us for the unknown option */
+			logprintf(LOG_NOTICE, "pilight daemon does not support compact frames");
+			compact_refused = 1;
+			socket_close(sockfd);
+			sockfd = 0;
 			continue;
 		}
 		logprintf(LOG_DEBUG, "socket recv: %s", recvBuff);
 
 		json = json_mkobject();
 		json_append_member(json, "action", json_mkstring("request config"));
+		if(config_known == 1) {
+			json_append_member(json, "hash", json_mknumber(config_hash, 0));
+		}
 		output = json_stringify(json, NULL);
 		if(socket_write(sockfd, output) != (strlen(output)+strlen(EOSS))) {
 			json_free(output);
@@ -2289,25 +4219,29 @@ void *clientize(void *param) {
 
 		if(socket_read(sockfd, &recvBuff, 0) == 0) {
 			logprintf(LOG_DEBUG, "socket recv: %s", recvBuff);
-			if(json_validate(recvBuff) == true) {
-				json = json_decode(recvBuff);
+			if((json = json_decode(recvBuff)) != NULL) {
 				if(json_find_string(json, "message", &message) == 0) {
 					if(strcmp(message, "config") == 0) {
 						struct JsonNode *jconfig = NULL;
-						if((jconfig = json_find_member(json, "config")) != NULL) {
+						double unchanged = 0;
+						if(config_known == 1 && json_find_number(json, "unchanged", &unchanged) == 0 &&
+						   (int)unchanged == 1) {
+							logprintf(LOG_DEBUG, "master configuration is unchanged");
+							config_synced = 1;
+						} else if((jconfig = json_find_member(json, "config")) != NULL) {
+							config_known = 0;
 
 							pthread_mutex_lock(&config_lock);
-							gui_gc();
-							devices_gc();
-#ifdef EVENTS
-							rules_gc();
-#endif
-							pthread_mutex_unlock(&config_lock);
-
-							if(config_parse(jconfig, CONFIG_DEVICES) == 0) {
+							if(config_reload(jconfig, CONFIG_DEVICES) == 0) {
+								pthread_mutex_unlock(&config_lock);
 								logprintf(LOG_DEBUG, "loaded master configuration");
 								config_synced = 1;
+								if(json_find_number(json, "hash", &hash) == 0) {
+									config_hash = (unsigned int)hash;
+									config_known = 1;
+								}
 							} else {
+								pthread_mutex_unlock(&config_lock);
 								logprintf(LOG_WARNING, "failed to load master configuration");
 							}
 						}
@@ -2317,6 +4251,10 @@ void *clientize(void *param) {
 			}
 		}
 
+		if(config_synced == 1) {
+			backoff = NODE_BACKOFF_MIN;
+		}
+
 		while(client_loop && config_synced) {
 			if(sockfd <= 0) {
 				break;
@@ -2338,8 +4276,7 @@ void *clientize(void *param) {
 			char **array = NULL;
 			unsigned int z = explode(recvBuff, "\n", &array), q = 0;
 			for(q=0;q<z;q++) {
-				if(json_validate(array[q]) == true) {
-					json = json_decode(array[q]);
+				if((json = json_decode(array[q])) != NULL) {
 					if(json_find_string(json, "action", &action) == 0) {
 						if(strcmp(action, "send") == 0 ||
 						   strcmp(action, "control") == 0) {
@@ -2363,10 +4300,154 @@ void *clientize(void *param) {
 		FREE(recvBuff);
 	}
 
+	pthread_mutex_lock(&node_lock);
+	node_compact = 0;
+	socket_compact_output(0);
+	compact_dict_clear(&node_dict);
+	compact_buf_free(&node_buf);
+	pthread_mutex_unlock(&node_lock);
+
 	adhoc_pending = 0;
 	return NULL;
 }
 
+/*
+ * Keeps the connection to the replication peer. Once the peer
+ * told how far it got, the changes it missed are replayed and
+ * new changes are pushed by the broadcast thread.
+ */
+void *replica_client(void *param) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct JsonNode *json = NULL, *joptions = NULL, *jreplica = NULL;
+	char *recvBuff = NULL, *output = NULL, *status = NULL;
+	double epoch = 0, seq = 0, since = 0;
+	int fd = 0, backoff = NODE_BACKOFF_MIN, wait = 0, n = 0, connected = 0;
+
+	while(main_loop) {
+		if(connected == 1) {
+			logprintf(LOG_NOTICE, "connection to replication peer %s:%d lost", replica_peer, replica_port);
+		}
+		if(fd > 0) {
+			pthread_mutex_lock(&replica_lock);
+			if(replica_fd == fd) {
+				replica_fd = 0;
+			}
+			pthread_mutex_unlock(&replica_lock);
+			socket_close(fd);
+			fd = 0;
+
+			wait = backoff;
+			while(main_loop && wait > 0) {
+				usleep(((wait > 100) ? 100 : wait) * 1000);
+				wait -= 100;
+			}
+			backoff = (backoff*2 > NODE_BACKOFF_MAX) ? NODE_BACKOFF_MAX : backoff*2;
+			if(main_loop == 0) {
+				break;
+			}
+		}
+		connected = 0;
+
+		if((fd = socket_connect(replica_peer, replica_port)) == -1) {
+			fd = 0;
+			wait = backoff;
+			while(main_loop && wait > 0) {
+				usleep(((wait > 100) ? 100 : wait) * 1000);
+				wait -= 100;
+			}
+			backoff = (backoff*2 > NODE_BACKOFF_MAX) ? NODE_BACKOFF_MAX : backoff*2;
+			continue;
+		}
+
+		json = json_mkobject();
+		joptions = json_mkobject();
+		json_append_member(json, "action", json_mkstring("identify"));
+		json_append_member(joptions, "replica", json_mknumber(1, 0));
+		json_append_member(json, "uuid", json_mkstring(pilight_uuid));
+		json_append_member(json, "options", joptions);
+		output = json_stringify(json, NULL);
+		n = socket_write(fd, output);
+		json_delete(json);
+		if(n != (int)(strlen(output)+strlen(EOSS))) {
+			json_free(output);
+			continue;
+		}
+		json_free(output);
+
+		if(socket_read(fd, &recvBuff, 1) != 0 || (json = json_decode(recvBuff)) == NULL) {
+			continue;
+		}
+		epoch = 0;
+		seq = 0;
+		since = 0;
+		if(json_find_string(json, "status", &status) != 0 || strcmp(status, "success") != 0 ||
+		   (jreplica = json_find_member(json, "replica")) == NULL) {
+			logprintf(LOG_ERR, "replication peer %s:%d refused to replicate", replica_peer, replica_port);
+			json_delete(json);
+			continue;
+		}
+		json_find_number(jreplica, "epoch", &epoch);
+		json_find_number(jreplica, "seq", &seq);
+		json_find_number(jreplica, "since", &since);
+		json_delete(json);
+
+		pthread_mutex_lock(&replica_lock);
+		compact_dict_clear(&replica_dict);
+		if((unsigned long)epoch == replica_epoch && (unsigned long)seq == replica_seq) {
+			n = replica_send(fd, COMPACT_REPLICA_CATCHUP, 0, NULL);
+		} else if((n = replica_catchup(fd, (unsigned long)since)) >= 0) {
+			logprintf(LOG_INFO, "replayed %d changes to replication peer %s:%d", n, replica_peer, replica_port);
+		}
+		if(n >= 0) {
+			replica_fd = fd;
+		}
+		pthread_mutex_unlock(&replica_lock);
+		if(n < 0) {
+			continue;
+		}
+
+		logprintf(LOG_INFO, "replicating to %s:%d", replica_peer, replica_port);
+		connected = 1;
+		backoff = NODE_BACKOFF_MIN;
+
+		/* Nothing is expected from the peer, reading notices when it went away */
+		while(main_loop && replica_fd == fd) {
+			if((n = socket_read(fd, &recvBuff, 1)) == -1) {
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&replica_lock);
+	replica_fd = 0;
+	pthread_mutex_unlock(&replica_lock);
+	if(fd > 0) {
+		socket_close(fd);
+	}
+	if(recvBuff != NULL) {
+		FREE(recvBuff);
+	}
+	return NULL;
+}
+
+static void replica_gc(void) {
+	struct replica_origin_t *tmp = NULL;
+
+	while(replica_origins) {
+		tmp = replica_origins;
+		replica_origins = replica_origins->next;
+		FREE(tmp);
+	}
+	pthread_mutex_lock(&replica_lock);
+	compact_dict_clear(&replica_dict);
+	compact_buf_free(&replica_buf);
+	pthread_mutex_unlock(&replica_lock);
+	if(replica_peer != NULL) {
+		FREE(replica_peer);
+	}
+}
+
 #ifndef _WIN32
 static void save_pid(pid_t npid) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
@@ -2423,6 +4504,8 @@ static void walk_cb(uv_handle_t *handle, void *arg) {
 int main_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
+	int i = 0;
+
 	pilight.running = 0;
 	main_loop = 0;
 
@@ -2443,7 +4526,7 @@ int main_gc(void) {
 
 	pilight.runmode = STANDALONE;
 
-	while(sending) {
+	while(sender_busy() == 1) {
 		usleep(1000);
 	}
 
@@ -2452,31 +4535,42 @@ int main_gc(void) {
 #endif
 
 	if(recvqueue_init == 1) {
-		pthread_mutex_unlock(&recvqueue_lock);
-		pthread_cond_signal(&recvqueue_signal);
+		stage_stop(&recvstage);
 		usleep(1000);
 	}
 
 	if(sendqueue_init == 1) {
 		pthread_mutex_unlock(&sendqueue_lock);
-		pthread_cond_signal(&sendqueue_signal);
+		for(i=0;i<NRSENDERS;i++) {
+			pthread_cond_signal(&senders[i].signal);
+		}
 	}
 
 	if(bcqueue_init == 1) {
-		pthread_mutex_unlock(&bcqueue_lock);
-		pthread_cond_signal(&bcqueue_signal);
+		stage_stop(&bcstage);
 	}
 
 	struct clients_t *tmp_clients;
 	while(clients) {
 		tmp_clients = clients;
 		clients = clients->next;
+		gui_filter_free(&tmp_clients->filter);
 		FREE(tmp_clients);
 	}
 	if(clients != NULL) {
 		FREE(clients);
 	}
 
+	struct batch_t *tmp_batch = NULL;
+	pthread_mutex_lock(&batch_lock);
+	while(batches) {
+		tmp_batch = batches;
+		batches = batches->next;
+		json_delete(tmp_batch->jupdates);
+		FREE(tmp_batch);
+	}
+	pthread_mutex_unlock(&batch_lock);
+
 #ifndef _WIN32
 	if(running == 0) {
 		/* Remove the stale pid file */
@@ -2513,10 +4607,36 @@ int main_gc(void) {
 	pthread_mutex_unlock(&config_lock);
 
 	protocol_gc();
+	trace_gc();
+	profile_gc();
+	rawtap_gc();
+	devtable_gc();
+	capture_stop();
+	metrics_gc();
 	ntp_gc();
+#ifndef _WIN32
+	proc_cache_gc();
+#endif
 	whitelist_free();
 	threads_gc();
+	replica_gc();
+	if(recvqueue_init == 1) {
+		recvqueue_init = 0;
+		stage_gc(&recvstage, recvqueue_free);
+	}
+	if(bcqueue_init == 1) {
+		bcqueue_init = 0;
+		stage_gc(&bcstage, bcqueue_free);
+	}
+	if(recvcaches != NULL) {
+		FREE(recvcaches);
+	}
+	if(receive_protocols != NULL) {
+		array_free(&receive_protocols, nrreceive_protocols);
+		nrreceive_protocols = 0;
+	}
 #ifndef _WIN32
+	gpiomem_gc();
 	wiringXGC();
 #endif
 	dso_gc();
@@ -2616,6 +4736,101 @@ static void pilight_abort(uv_timer_t *timer_req) {
 	exit(EXIT_FAILURE);
 }
 
+/*
+ * Called right before /metrics is printed, so the queue
+ * depths are current and the stats broadcast every few
+ * seconds are exported as gauges as well.
+ */
+static void pilight_metrics(void) {
+	struct JsonNode *jstats = NULL;
+	int i = 0, number = 0;
+
+	if(recvqueue_init == 1) {
+		stage_collect(&recvstage);
+	}
+	if(bcqueue_init == 1) {
+		stage_collect(&bcstage);
+	}
+
+	if(sendqueue_init == 1) {
+		pthread_mutex_lock(&sendqueue_lock);
+		for(i=0;i<NRSENDERS;i++) {
+			number += senders[i].number;
+		}
+		pthread_mutex_unlock(&sendqueue_lock);
+		metrics_set(metric_sendqueue_depth, (double)number);
+	}
+
+	jstats = json_mkobject();
+	plua_pool_stats(jstats);
+	memprofile_stats(jstats);
+	socket_stats(jstats);
+	eventpool_stats(jstats);
+	ping_stats(jstats);
+	threads_stats(jstats);
+#ifdef WEBSERVER
+	webserver_stats(jstats);
+#endif
+	metrics_json(jstats, "pilight");
+	json_delete(jstats);
+}
+
+static unsigned int shed_depth(struct stage_t *stage, unsigned short init) {
+	if(init == 0 || stage->nrslots == 0) {
+		return 0;
+	}
+	return (stage_depth(stage)*100)/stage->nrslots;
+}
+
+static void pilight_shed(double cpu, int watchdog) {
+	unsigned int depth = shed_depth(&recvstage, recvqueue_init);
+	int level = shed_level;
+
+	if(shed_depth(&bcstage, bcqueue_init) > depth) {
+		depth = shed_depth(&bcstage, bcqueue_init);
+	}
+
+	if(cpu > 90 || depth > 50) {
+		if(level < SHED_ABORT) {
+			level++;
+		}
+	} else if(cpu < 70 && depth < 25) {
+		if(level > SHED_NONE) {
+			level--;
+		}
+	}
+	if(watchdog == 0 && level == SHED_ABORT) {
+		level = SHED_SAMPLE;
+	}
+	if(level == shed_level) {
+		return;
+	}
+
+	if(level > shed_level) {
+		logprintf(LOG_CRIT, "cpu usage %f%%, stages %u%% full, shedding load at level %d", cpu, depth, level);
+	} else {
+		logprintf(LOG_NOTICE, "load decreased, shedding at level %d", level);
+	}
+
+	if(level >= SHED_QUIET && shed_level < SHED_QUIET && verbosity > LOG_INFO) {
+		log_level_set(LOG_INFO);
+	} else if(level < SHED_QUIET && shed_level >= SHED_QUIET) {
+		log_level_set(verbosity);
+	}
+
+	if(timer_abort_req != NULL) {
+		if(level == SHED_ABORT) {
+			logprintf(LOG_CRIT, "will abort when this persists");
+			uv_timer_start(timer_abort_req, pilight_abort, 9000, 0);
+		} else if(shed_level == SHED_ABORT) {
+			uv_timer_stop(timer_abort_req);
+		}
+	}
+
+	shed_level = level;
+	metrics_set(metric_shed_level, (double)level);
+}
+
 static void pilight_stats(uv_timer_t *timer_req) {
 	int watchdog = 1, stats = 1;
 	// double itmp = 0.0;
@@ -2629,17 +4844,22 @@ static void pilight_stats(uv_timer_t *timer_req) {
 	if(stats == 1) {
 		double cpu = 0.0;
 		cpu = getCPUUsage();
-		if(watchdog == 1 && (cpu > 90)) {
-			logprintf(LOG_CRIT, "cpu usage too high %f%%, will abort when this persists", cpu);
-		} else {
-			if(watchdog == 1 && stats == 1 && timer_abort_req != NULL) {
-				uv_timer_stop(timer_abort_req);
-				uv_timer_start(timer_abort_req, pilight_abort, 9000, -1);
-			}
-
+		threads_cpu_usage(0);
+		pilight_shed(cpu, watchdog);
+		if(cpu <= 90) {
 			procProtocol->message = json_mkobject();
 			struct JsonNode *code = json_mkobject();
 			json_append_member(code, "cpu", json_mknumber(cpu, 16));
+			json_append_member(code, "receiver-overflow", json_mknumber(recvqueue_overflow, 0));
+			plua_pool_stats(code);
+			memprofile_stats(code);
+			socket_stats(code);
+			eventpool_stats(code);
+			ping_stats(code);
+			threads_stats(code);
+#ifdef WEBSERVER
+			webserver_stats(code);
+#endif
 			logprintf(LOG_DEBUG, "cpu: %f%%", cpu);
 			json_append_member(procProtocol->message, "values", code);
 			json_append_member(procProtocol->message, "origin", json_mkstring("core"));
@@ -2678,6 +4898,73 @@ static void generate_uuid(uv_timer_t *timer_req) {
 	array_free(&devs, nrdevs);
 }
 
+#ifndef _WIN32
+/*
+ * With protocol-configured only the external protocol modules
+ * of the configured devices and the receive-protocols are
+ * loaded. The protocols are initialized before the config is
+ * parsed, so the setting is taken from the config file itself.
+ */
+static void protocol_init_configured(void) {
+	struct JsonNode *jconfig = NULL, *jsettings = NULL, *jchild = NULL, *jprotocol = NULL;
+	char *content = NULL, **ids = NULL;
+	double configured = 0;
+	int nr = 0;
+
+	if(config_get_file() == NULL || file_get_contents(config_get_file(), &content) != 0) {
+		return;
+	}
+	if((jconfig = json_decode(content)) == NULL) {
+		FREE(content);
+		return;
+	}
+	FREE(content);
+
+	if((jsettings = json_find_member(jconfig, "settings")) == NULL ||
+	   json_find_number(jsettings, "protocol-configured", &configured) != 0 || (int)configured != 1) {
+		json_delete(jconfig);
+		return;
+	}
+
+	if((jchild = json_find_member(jsettings, "receive-protocols")) != NULL && jchild->tag == JSON_ARRAY) {
+		jprotocol = json_first_child(jchild);
+		while(jprotocol) {
+			if(jprotocol->tag == JSON_STRING) {
+				if((ids = REALLOC(ids, sizeof(char *)*(size_t)(nr+1))) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+				ids[nr++] = jprotocol->string_;
+			}
+			jprotocol = jprotocol->next;
+		}
+	}
+	if((jchild = json_find_member(jconfig, "devices")) != NULL) {
+		jchild = json_first_child(jchild);
+		while(jchild) {
+			if((jprotocol = json_find_member(jchild, "protocol")) != NULL && jprotocol->tag == JSON_ARRAY) {
+				jprotocol = json_first_child(jprotocol);
+				while(jprotocol) {
+					if(jprotocol->tag == JSON_STRING) {
+						if((ids = REALLOC(ids, sizeof(char *)*(size_t)(nr+1))) == NULL) {
+							OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+						}
+						ids[nr++] = jprotocol->string_;
+					}
+					jprotocol = jprotocol->next;
+				}
+			}
+			jchild = jchild->next;
+		}
+	}
+
+	protocol_init_filter(ids, nr);
+	if(ids != NULL) {
+		FREE(ids);
+	}
+	json_delete(jconfig);
+}
+#endif
+
 static void signal_cb(uv_signal_t *handle, int signum) {
 	logprintf(LOG_INFO, "Interrupt signal received. Please wait while pilight is shutting down");
 
@@ -2983,6 +5270,9 @@ int start_pilight(int argc, char **argv) {
 	}
 
 	eventpool_init(EVENTPOOL_THREADED);
+#ifndef _WIN32
+	protocol_init_configured();
+#endif
 	protocol_init();
 	config_init();
 
@@ -2990,12 +5280,18 @@ int start_pilight(int argc, char **argv) {
 	pilight.broadcast = &broadcast_queue;
 	pilight.send = &send_queue;
 	pilight.control = &control_device;
+	pilight.bulk = &control_devices;
 	pilight.receive = &receive_parse_api;
 
 	/* Rewrite */
 	eventpool_callback(REASON_CONTROL_DEVICE, control_device1);
+#ifdef EVENTS
+	event_transition_init();
+#endif
 	eventpool_callback(REASON_SOCKET_RECEIVED, socket_parse_data1);
 	eventpool_callback(REASON_RECEIVED_PULSETRAIN, receivePulseTrain1);
+	eventpool_callback(REASON_CODE_SEND_SUCCESS, send_code_done);
+	eventpool_callback(REASON_CODE_SEND_FAIL, send_code_done);
 
 	if(config_read(CONFIG_ALL) != 0) {
 		logprintf(LOG_ERR, "failed to read config");
@@ -3019,6 +5315,16 @@ int start_pilight(int argc, char **argv) {
 		FREE(stmp);
 	}
 
+	if(config_setting_get_string("log-binary-file", 0, &stmp) == 0) {
+		int level = LOG_DEBUG;
+		config_setting_get_number("log-binary-level", 0, &level);
+		if(log_binary_set(stmp, level) == EXIT_FAILURE) {
+			FREE(stmp);
+			goto clear;
+		}
+		FREE(stmp);
+	}
+
 #ifdef WEBSERVER
 	#ifdef WEBSERVER_HTTPS
 	char *pemfile = NULL;
@@ -3181,6 +5487,13 @@ int start_pilight(int argc, char **argv) {
 	ssl_init();
 	if(pilight.runmode == STANDALONE) {
 		socket_start((unsigned short)port);
+#ifndef _WIN32
+		int local = 1;
+		config_setting_get_number("local-socket", 0, &local);
+		if(local == 1) {
+			socket_start_local(SOCKET_LOCAL);
+		}
+#endif
 		if(standalone == 0) {
 			ssdp_start();
 		}
@@ -3205,29 +5518,128 @@ int start_pilight(int argc, char **argv) {
 	pthread_mutexattr_init(&sendqueue_attr);
 	pthread_mutexattr_settype(&sendqueue_attr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&sendqueue_lock, &sendqueue_attr);
-	pthread_cond_init(&sendqueue_signal, NULL);
+	for(i=0;i<NRSENDERS;i++) {
+		memset(&senders[i], 0, sizeof(struct sender_t));
+		pthread_cond_init(&senders[i].signal, NULL);
+	}
+	senders[NONE].active = 1;
 	sendqueue_init = 1;
 
 	pthread_mutexattr_init(&config_attr);
 	pthread_mutexattr_settype(&config_attr, PTHREAD_MUTEX_RECURSIVE);
 	pthread_mutex_init(&config_lock, &config_attr);
 
-	pthread_mutexattr_init(&recvqueue_attr);
-	pthread_mutexattr_settype(&recvqueue_attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&recvqueue_lock, &recvqueue_attr);
-	pthread_cond_init(&recvqueue_signal, NULL);
+	stage_init(&recvstage, "receive", RECVQUEUE_SIZE, sizeof(struct recvqueue_t));
 	recvqueue_init = 1;
 
-	pthread_mutexattr_init(&bcqueue_attr);
-	pthread_mutexattr_settype(&bcqueue_attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&bcqueue_lock, &bcqueue_attr);
-	pthread_cond_init(&bcqueue_signal, NULL);
+	stage_init(&bcstage, "broadcast", BCQUEUE_SIZE, sizeof(struct bcqueue_t));
 	bcqueue_init = 1;
 
+	config_setting_get_number("broadcast-coalesce", 0, &bcqueue_coalesce);
+	metric_bcqueue_coalesced = metrics_get(METRIC_COUNTER, "pilight_broadcast_coalesced_total", "Updates that replaced an older update of the same device in the broadcast stage", NULL, NULL);
+
 	/* Run certain daemon functions from the socket library */
 	socket_callback.client_disconnected_callback = &socket_client_disconnected;
 	socket_callback.client_connected_callback = NULL;
 	socket_callback.client_data_callback = &socket_parse_data;
+	socket_callback.client_compact_callback = &socket_parse_compact;
+
+	/* In kilobytes, 0 keeps the default stack size */
+	{
+		int stacksize = 0;
+		if(config_setting_get_number("thread-stack-size", 0, &stacksize) == 0 && stacksize > 0) {
+			threads_stack_size((size_t)stacksize*1024);
+		}
+	}
+
+	/* Keep the timing of the receivers and senders free of page faults */
+	{
+		int core = -1, lock = 0;
+		if(config_setting_get_number("realtime-receive-core", 0, &core) == 0) {
+			threads_realtime_core(THREAD_RT_RECEIVE, core);
+		}
+		if(config_setting_get_number("realtime-send-core", 0, &core) == 0) {
+			threads_realtime_core(THREAD_RT_SEND, core);
+		}
+#ifndef _WIN32
+		if(config_setting_get_number("realtime-lock", 0, &lock) == 0 && lock == 1) {
+			if(mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+				logprintf(LOG_WARNING, "unable to lock the memory of pilight: %s", strerror(errno));
+			}
+		}
+#endif
+	}
+
+	/* The most memory each lua state may use, in kilobytes */
+	{
+		int luamemory = 0;
+		if(config_setting_get_number("lua-memory-limit", 0, &luamemory) == 0 && luamemory > 0) {
+			plua_memory_limit((size_t)luamemory*1024);
+		}
+	}
+
+	/* Collect the idle lua states while the loop has nothing to do */
+	plua_gc_start();
+
+	/* The number of receive stages kept for tracing, 0 disables it */
+	{
+		int tracesize = 0;
+		if(config_setting_get_number("trace-size", 0, &tracesize) == 0 && tracesize > 0) {
+			trace_init(tracesize);
+		}
+	}
+
+	/* The cpu profiler samples per second, 0 disables it */
+	{
+		int rate = 0;
+		if(config_setting_get_number("cpu-profile", 0, &rate) == 0 && rate > 0) {
+			profile_start((unsigned int)rate);
+		}
+	}
+
+	/* The number of points kept of each tier of the value history, 0 disables it */
+	{
+		int historysize = 0;
+		if(config_setting_get_number("history-size", 0, &historysize) == 0 && historysize > 0) {
+			history_init(historysize);
+		}
+	}
+
+#ifdef EVENTS
+	/* Hold back rules that keep firing, in action runs per minute, 0 disables it */
+	{
+		int limit = 120, edge = 60, damping = 30;
+		config_setting_get_number("rule-storm-limit", 0, &limit);
+		config_setting_get_number("rule-storm-edge-limit", 0, &edge);
+		config_setting_get_number("rule-storm-damping", 0, &damping);
+		event_storm_init(limit, edge, damping);
+	}
+#endif
+
+	/* Let pilight-raw and pilight-debug follow the received trains */
+	{
+		int tap = 0;
+		if(config_setting_get_number("raw-tap", 0, &tap) == 0 && tap == 1) {
+			rawtap_init();
+		}
+	}
+
+	/* Let local programs read the device values from shared memory */
+	{
+		int table = 0;
+		if(config_setting_get_number("device-table", 0, &table) == 0 && table == 1 && devtable_init() == 0) {
+			devices_table_sync();
+		}
+	}
+
+	/* Record the received trains for a later replay */
+	{
+		char *file = NULL;
+		if(config_setting_get_string("capture-file", 0, &file) == 0) {
+			capture_start(file);
+			FREE(file);
+		}
+	}
 
 	/* Start threads library that keeps track of all threads used */
 	threads_start();
@@ -3237,19 +5649,46 @@ int start_pilight(int argc, char **argv) {
 	if(pilight.runmode == ADHOC) {
 		threads_register("node", &clientize, (void *)NULL, 0);
 	} else {
-		/* Register a seperate thread for the socket server */
-		threads_register("socket", &socket_wait, (void *)&socket_callback, 0);
+		/* The socket server runs in the main loop, like the webserver */
+		socket_serve(&socket_callback);
 		if(standalone == 0) {
 			threads_register("ssdp", &ssdp_wait, (void *)NULL, 0);
 		}
+		/* Push our changes to the other master */
+		char *peer = NULL, *port = NULL;
+		if(config_setting_get_string("replication-peer", 0, &peer) == 0) {
+			if((port = strrchr(peer, ':')) != NULL && atoi(&port[1]) > 0) {
+				*port = '\0';
+				replica_port = (unsigned short)atoi(&port[1]);
+				if((replica_peer = MALLOC(strlen(peer)+1)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+				strcpy(replica_peer, peer);
+				replica_epoch = (unsigned long)time(NULL);
+				threads_register("replica", &replica_client, (void *)NULL, 0);
+			} else {
+				logprintf(LOG_ERR, "replication-peer must be in the format of \"ip:port\"");
+			}
+			FREE(peer);
+		}
+	}
+	/* One sender for every type of sending hardware */
+	tmp_confhw = conf_hardware;
+	while(tmp_confhw) {
+		i = tmp_confhw->hardware->hwtype;
+		if(i > NONE && i < NRSENDERS && senders[i].active == 0) {
+			senders[i].active = 1;
+			threads_register("sender", &send_code, (void *)&senders[i], 0);
+		}
+		tmp_confhw = tmp_confhw->next;
 	}
-	threads_register("sender", &send_code, (void *)NULL, 0);
+	threads_register("sender", &send_code, (void *)&senders[NONE], 0);
 	threads_register("broadcaster", &broadcast, (void *)NULL, 0);
 
 	tmp_confhw = conf_hardware;
 	while(tmp_confhw && main_loop) {
 		if(tmp_confhw->hardware->init) {
-			if(tmp_confhw->hardware->init() == EXIT_FAILURE) {
+			if(tmp_confhw->hardware->init(tmp_confhw->hardware) == EXIT_FAILURE) {
 				if(main_loop == 1) {
 					logprintf(LOG_ERR, "could not initialize %s hardware module", tmp_confhw->hardware->id);
 					goto clear;
@@ -3282,7 +5721,40 @@ int start_pilight(int argc, char **argv) {
 		goto clear;
 	}
 
-	threads_register("receive parser", &receive_parse_code, (void *)NULL, 0);
+	/* Leave the protocols no device uses out of receiving */
+	{
+		int configured = 0;
+		char *name = NULL;
+		config_setting_get_number("receive-configured", 0, &configured);
+		if(configured == 1) {
+			while(config_setting_get_string("receive-protocols", nrreceive_protocols, &name) == 0) {
+				if((receive_protocols = REALLOC(receive_protocols, sizeof(char *)*(nrreceive_protocols+1))) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+				receive_protocols[nrreceive_protocols++] = name;
+			}
+			protocol_index_filter(receive_select);
+		}
+	}
+
+	/* In milliseconds, 0 disables the coalescing of repeats */
+	config_setting_get_number("receive-repeat-window", 0, &recvcache_window);
+	config_setting_get_number("receive-threads", 0, &nrparsers);
+	if(nrparsers < 1) {
+		nrparsers = 1;
+	}
+	/* Sample one in every n allocations, 0 disables the profiler */
+	{
+		int rate = 0;
+		config_setting_get_number("memory-profile", 0, &rate);
+		memprofile((unsigned int)rate);
+	}
+	if((recvcaches = CALLOC(nrparsers, sizeof(struct recvcache_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	for(i=0;i<nrparsers;i++) {
+		threads_register("receive parser", &receive_parse_code, (void *)&recvcaches[i], 0);
+	}
 
 #ifdef EVENTS
 	if(pilight.runmode == STANDALONE) {
@@ -3332,12 +5804,31 @@ int start_pilight(int argc, char **argv) {
 	// threads_register("stats", &pilight_stats, NULL, 0);
 // #endif
 
+	metric_receive_duplicates = metrics_get(METRIC_COUNTER, "pilight_receive_duplicates_total", "Pulse trains of nodes dropped because another node sent them first", NULL, NULL);
+	metric_sendqueue_depth = metrics_get(METRIC_GAUGE, "pilight_send_queue_depth", "Codes waiting to be sent", NULL, NULL);
+	metric_shed_level = metrics_get(METRIC_GAUGE, "pilight_shed_level", "How much work the daemon sheds, from 0 to 4 where it aborts", NULL, NULL);
+	metric_shed_noise = metrics_get(METRIC_COUNTER, "pilight_shed_dropped_total", "Work dropped while shedding load", "work", "noise");
+	metric_shed_sampled = metrics_get(METRIC_COUNTER, "pilight_shed_dropped_total", "Work dropped while shedding load", "work", "gui");
+	metrics_collector(pilight_metrics);
+
+	if((timer_abort_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	uv_timer_init(uv_default_loop(), timer_abort_req);
+
 	timer_stats_req = MALLOC(sizeof(uv_timer_t));
 	if(timer_stats_req == NULL) {
 		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 	}
 	uv_timer_init(uv_default_loop(), timer_stats_req);
 	uv_timer_start(timer_stats_req, pilight_stats, 1000, 3000);
+
+	if(pilight.runmode == STANDALONE) {
+		int delay = 0;
+		if(config_setting_get_number("config-write-delay", 0, &delay) == 0 && delay > 0) {
+			config_write_delay(delay);
+		}
+	}
 	return EXIT_SUCCESS;
 
 clear:
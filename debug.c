@@ -41,6 +41,7 @@
 #include "libs/pilight/core/ssdp.h"
 #include "libs/pilight/core/socket.h"
 #include "libs/pilight/core/gc.h"
+#include "libs/pilight/core/rawtap.h"
 #include "libs/pilight/core/dso.h"
 #include "libs/pilight/config/config.h"
 #include "libs/pilight/config/hardware.h"
@@ -54,6 +55,8 @@ static unsigned short inner_loop = 1;
 #ifndef PILIGHT_DEVELOPMENT
 static uv_signal_t *signal_req = NULL;
 static int doSkip = 0;
+static int tap = 0;
+static unsigned int tap_tail = 0;
 #endif
 
 static char *lua_root = LUA_ROOT;
@@ -83,6 +86,7 @@ int main_gc(void) {
 #endif
 	config_gc();
 	protocol_gc();
+	rawtap_gc();
 	whitelist_free();
 	threads_gc();
 
@@ -120,7 +124,7 @@ static void *receivePulseTrain(int reason, void *param) {
 
 	if(data->hardware != NULL && data->pulses != NULL && data->length > 0) {
 #ifndef PILIGHT_REWRITE
-		char *id = NULL;
+		char *id = data->hardware;
 		struct conf_hardware_t *tmp_confhw = conf_hardware;
 		while(tmp_confhw) {
 			if(strcmp(tmp_confhw->hardware->id, data->hardware) == 0) {
@@ -336,6 +340,23 @@ void *receiveOOK(void *param) {
 }
 
 #ifndef PILIGHT_DEVELOPMENT
+/* Follow the trains a running daemon publishes */
+static void tap_cb(uv_timer_t *req) {
+	struct reason_received_pulsetrain_t data;
+	char hardware[RAWTAP_HWLEN];
+	int pulses[MAXPULSESTREAMLENGTH+1];
+	int r = 0;
+
+	memset(&data, 0, sizeof(data));
+	data.pulses = pulses;
+	while(main_loop && (r = rawtap_read(&tap_tail, hardware, sizeof(hardware), data.pulses, &data.length)) != 0) {
+		if(r == 1) {
+			data.hardware = hardware;
+			receivePulseTrain(REASON_RECEIVED_PULSETRAIN, &data);
+		}
+	}
+}
+
 static void signal_cb(uv_signal_t *handle, int signum) {
 	uv_stop(uv_default_loop());
 	main_gc();
@@ -496,9 +517,14 @@ int main(int argc, char **argv) {
 	}
 
 	if((n = isrunning("pilight-daemon", &ret)) > 0) {
-		logprintf(LOG_NOTICE, "pilight-daemon instance found (%d)", ret[0]);
+		if(rawtap_open(&tap_tail) != 0) {
+			logprintf(LOG_NOTICE, "pilight-daemon instance found (%d), enable its raw-tap setting to follow it", ret[0]);
+			FREE(ret);
+			goto clear;
+		}
+		logprintf(LOG_NOTICE, "following the pulse trains of pilight-daemon (%d)", ret[0]);
 		FREE(ret);
-		goto clear;
+		tap = 1;
 	}
 
 	if((n = isrunning("pilight-raw", &ret)) > 0) {
@@ -529,6 +555,18 @@ int main(int argc, char **argv) {
 
 	int has_hardware = 0;
 	struct conf_hardware_t *tmp_confhw = conf_hardware;
+#ifndef PILIGHT_DEVELOPMENT
+	if(tap == 1) {
+		uv_timer_t *timer_req = NULL;
+		if((timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		uv_timer_init(uv_default_loop(), timer_req);
+		uv_timer_start(timer_req, tap_cb, 10, 10);
+		has_hardware = 1;
+		tmp_confhw = NULL;
+	}
+#endif
 	while(tmp_confhw) {
 		if(tmp_confhw->hardware->init) {
 			if(tmp_confhw->hardware->comtype == COMOOK) {
@@ -537,7 +575,7 @@ int main(int argc, char **argv) {
 				tmp_confhw->hardware->maxgaplen = 34000;
 				tmp_confhw->hardware->mingaplen = 5100;
 			}
-			if(tmp_confhw->hardware->init() == EXIT_FAILURE) {
+			if(tmp_confhw->hardware->init(tmp_confhw->hardware) == EXIT_FAILURE) {
 				logprintf(LOG_ERR, "could not initialize %s hardware mode", tmp_confhw->hardware->id);
 				goto clear;
 			} else {
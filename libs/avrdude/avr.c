@@ -36,6 +36,9 @@
 
 FP_UpdateProgress avr_update_progress;
 
+/* Whether the flash is still blank since the last chip erase */
+static int erased = 0;
+
 void avr_set_update_progress(FP_UpdateProgress callback) {
 	avr_update_progress = callback;
 }
@@ -598,6 +601,7 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size)
   int              rc;
   int              wsize;
   long             i;
+  long             blank;
   unsigned char    data;
   AVRMEM         * m = NULL;
 
@@ -681,6 +685,22 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size)
     data = m->buf[i];
     report_progress(i, wsize, NULL);
 
+    /*
+     * an erased page already reads as 0xff, so a page of the
+     * image that only holds 0xff doesn't need to be loaded and
+     * written at all
+     */
+    if (erased && m->paged && (i % m->page_size) == 0) {
+      for (blank = i; blank < wsize && blank < i + m->page_size; blank++) {
+        if (m->buf[blank] != 0xff)
+          break;
+      }
+      if (blank == wsize || blank == i + m->page_size) {
+        i = blank - 1;
+        continue;
+      }
+    }
+
     rc = avr_write_byte(pgm, p, m, i, data);
     if (rc) {
       logprintf(LOG_ERR, "***failed");
@@ -703,6 +723,9 @@ int avr_write(PROGRAMMER * pgm, AVRPART * p, char * memtype, int size)
     }
   }
 
+  if (m->paged)
+    erased = 0;
+
   return i;
 }
 
@@ -859,6 +882,8 @@ int avr_chip_erase(PROGRAMMER * pgm, AVRPART * p)
   int rc;
 
   rc = pgm->chip_erase(pgm, p);
+  if (rc == 0)
+    erased = 1;
 
   return rc;
 }
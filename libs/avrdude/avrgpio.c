@@ -59,16 +59,17 @@ static int gpio_setpin(PROGRAMMER * pgm, int pin, int value) {
 		return -1;
 	}
 
-	/* Small delay for too fast computers */
-	delayMicroseconds(1);
-
   if(value == 1) {
 		digitalWrite(pin, HIGH);
   } else {
 		digitalWrite(pin, LOW);
 	}
 
-  if(pgm->ispdelay > 1) {
+	/*
+	 * Keep every half of the clock long enough for the
+	 * target, using the calibrated delay loop.
+	 */
+  if(pgm->ispdelay > 0) {
     bitbang_delay(pgm->ispdelay);
 	}
 
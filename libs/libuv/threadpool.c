@@ -23,12 +23,17 @@
 
 #include "../libs/pilight/core/pilight.h"
 #include "../libs/pilight/core/proc.h"
+#include "../libs/pilight/core/threads.h"
+#include "../libs/pilight/core/profile.h"
 
 #if !defined(_WIN32)
 # include "unix/internal.h"
 #endif
 
 #include <stdlib.h>
+#if defined(__linux__)
+# include <sys/prctl.h>
+#endif
 
 #define MAX_THREADPOOL_SIZE 128
 
@@ -40,9 +45,15 @@ static unsigned int nthreads;
 static uv_thread_t* threads;
 static uv_thread_t default_threads[4];
 static QUEUE exit_message;
-static QUEUE wq;
+static QUEUE wq[UV_PRIORITY_MAX];
 static volatile int initialized;
 
+static struct {
+  unsigned int depth;
+  uint64_t taken;
+  uint64_t waited;
+} stats[UV_PRIORITY_MAX];
+
 typedef struct data_t {
   int nr;
 
@@ -59,27 +70,44 @@ static void uv__cancelled(struct uv__work* w) {
 }
 
 
+/* The first queue with work in it, or -1 when all are empty */
+static int next_queue(void) {
+  int i;
+
+  for (i = 0; i < UV_PRIORITY_MAX; i++)
+    if (!QUEUE_EMPTY(&wq[i]))
+      return i;
+  return -1;
+}
+
+
 /* To avoid deadlock with uv_cancel() it's crucial that the worker
  * never holds the global mutex and the loop-local mutex at the same time.
  */
 static void worker(void* arg) {
   struct uv__work* w;
   QUEUE* q;
+  int i;
 
 #ifndef _WIN32
   struct data_t *data = arg;
+  struct timespec start, stop;
+#endif
+#ifdef __linux__
+  /* All workers go by one name in /proc/self/task */
+  prctl(PR_SET_NAME, "uv-worker", 0, 0, 0);
 #endif
 
   for (;;) {
     uv_mutex_lock(&mutex);
 
-    while (QUEUE_EMPTY(&wq)) {
+    while ((i = next_queue()) == -1) {
       idle_threads += 1;
       uv_cond_wait(&cond, &mutex);
       idle_threads -= 1;
     }
 
-    q = QUEUE_HEAD(&wq);
+    q = QUEUE_HEAD(&wq[i]);
 
     if (q == &exit_message)
       uv_cond_signal(&cond);
@@ -87,6 +115,10 @@ static void worker(void* arg) {
       QUEUE_REMOVE(q);
       QUEUE_INIT(q);  /* Signal uv_cancel() that the work req is
                              executing. */
+      w = QUEUE_DATA(q, struct uv__work, wq);
+      stats[i].depth--;
+      stats[i].taken++;
+      stats[i].waited += uv_hrtime() - w->queued;
     }
 
     uv_mutex_unlock(&mutex);
@@ -100,8 +132,16 @@ static void worker(void* arg) {
       getThreadCPUUsage(pthread_self(), &data->cpu_usage);
       clock_gettime(CLOCK_MONOTONIC, &data->timestamp.first);
     }
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
 #endif
+    profile_task((w->name != NULL) ? w->name : "uv work");
     w->work(w);
+    profile_task(NULL);
+#ifndef _WIN32
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &stop);
+    threads_task_cpu((w->name != NULL) ? w->name : "uv work",
+      (double)(stop.tv_sec - start.tv_sec) + (double)(stop.tv_nsec - start.tv_nsec)/1000000000);
+#endif
 
 #ifndef _WIN32
     if(pilight.debuglevel >= 2) {
@@ -109,7 +149,7 @@ static void worker(void* arg) {
       getThreadCPUUsage(pthread_self(), &data->cpu_usage);
       fprintf(stderr, "worker %d, executed %s in %.6f sec using %f%% CPU\n",
         data->nr,
-        w->name,
+        (w->name != NULL) ? w->name : "uv work",
         ((double)data->timestamp.second.tv_sec + 1.0e-9*data->timestamp.second.tv_nsec) -
         ((double)data->timestamp.first.tv_sec + 1.0e-9*data->timestamp.first.tv_nsec),
         data->cpu_usage.cpu_per
@@ -131,15 +171,36 @@ static void worker(void* arg) {
 }
 
 
-static void post(QUEUE* q) {
+static void post(QUEUE* q, int priority) {
   uv_mutex_lock(&mutex);
-  QUEUE_INSERT_TAIL(&wq, q);
+  QUEUE_INSERT_TAIL(&wq[priority], q);
+  if (q != &exit_message)
+    stats[priority].depth++;
   if (idle_threads > 0)
     uv_cond_signal(&cond);
   uv_mutex_unlock(&mutex);
 }
 
 
+void uv_threadpool_stats(int priority,
+                         unsigned int* depth,
+                         uint64_t* taken,
+                         uint64_t* waited) {
+  *depth = 0;
+  *taken = 0;
+  *waited = 0;
+
+  if (priority < 0 || priority >= UV_PRIORITY_MAX || initialized == 0)
+    return;
+
+  uv_mutex_lock(&mutex);
+  *depth = stats[priority].depth;
+  *taken = stats[priority].taken;
+  *waited = stats[priority].waited;
+  uv_mutex_unlock(&mutex);
+}
+
+
 #ifndef _WIN32
 UV_DESTRUCTOR(static void cleanup(void)) {
   unsigned int i;
@@ -147,7 +208,8 @@ UV_DESTRUCTOR(static void cleanup(void)) {
   if (initialized == 0)
     return;
 
-  post(&exit_message);
+  /* Ahead of any work still queued */
+  post(&exit_message, UV_PRIORITY_HIGH);
 
   for (i = 0; i < nthreads; i++)
     if (uv_thread_join(threads + i))
@@ -194,7 +256,9 @@ static void init_threads(void) {
   if (uv_mutex_init(&mutex))
     abort();
 
-  QUEUE_INIT(&wq);
+  for (i = 0; i < UV_PRIORITY_MAX; i++)
+    QUEUE_INIT(&wq[i]);
+  memset(stats, 0, sizeof(stats));
 
   for (i = 0; i < nthreads; i++) {
 #ifndef _WIN32
@@ -234,15 +298,28 @@ static void init_once(void) {
 }
 
 
-void uv__work_submit(uv_loop_t* loop,
-                     struct uv__work* w,
-                     void (*work)(struct uv__work* w),
-                     void (*done)(struct uv__work* w, int status)) {
+static void work_submit(uv_loop_t* loop,
+                        struct uv__work* w,
+                        int priority,
+                        void (*work)(struct uv__work* w),
+                        void (*done)(struct uv__work* w, int status)) {
   uv_once(&once, init_once);
   w->loop = loop;
   w->work = work;
   w->done = done;
-  post(&w->wq);
+  w->priority = priority;
+  w->queued = uv_hrtime();
+  post(&w->wq, priority);
+}
+
+
+/* File system and dns requests */
+void uv__work_submit(uv_loop_t* loop,
+                     struct uv__work* w,
+                     void (*work)(struct uv__work* w),
+                     void (*done)(struct uv__work* w, int status)) {
+  w->name = NULL;
+  work_submit(loop, w, UV_PRIORITY_LOW, work, done);
 }
 
 
@@ -253,8 +330,10 @@ static int uv__work_cancel(uv_loop_t* loop, uv_req_t* req, struct uv__work* w) {
   uv_mutex_lock(&w->loop->wq_mutex);
 
   cancelled = !QUEUE_EMPTY(&w->wq) && w->work != NULL;
-  if (cancelled)
+  if (cancelled) {
     QUEUE_REMOVE(&w->wq);
+    stats[w->priority].depth--;
+  }
 
   uv_mutex_unlock(&w->loop->wq_mutex);
   uv_mutex_unlock(&mutex);
@@ -319,24 +398,36 @@ static void uv__queue_done(struct uv__work* w, int err) {
 }
 
 
-int uv_queue_work(uv_loop_t* loop,
-                  uv_work_t* req,
-                  char *name,
-                  uv_work_cb work_cb,
-                  uv_after_work_cb after_work_cb) {
+int uv_queue_work_priority(uv_loop_t* loop,
+                           uv_work_t* req,
+                           char *name,
+                           int priority,
+                           uv_work_cb work_cb,
+                           uv_after_work_cb after_work_cb) {
   if (work_cb == NULL)
     return UV_EINVAL;
+  if (priority < 0 || priority >= UV_PRIORITY_MAX)
+    return UV_EINVAL;
 
   uv__req_init(loop, req, UV_WORK);
   req->loop = loop;
   req->work_cb = work_cb;
   req->after_work_cb = after_work_cb;
   req->work_req.name = strdup(name);
-  uv__work_submit(loop, &req->work_req, uv__queue_work, uv__queue_done);
+  work_submit(loop, &req->work_req, priority, uv__queue_work, uv__queue_done);
   return 0;
 }
 
 
+int uv_queue_work(uv_loop_t* loop,
+                  uv_work_t* req,
+                  char *name,
+                  uv_work_cb work_cb,
+                  uv_after_work_cb after_work_cb) {
+  return uv_queue_work_priority(loop, req, name, UV_PRIORITY_NORMAL, work_cb, after_work_cb);
+}
+
+
 int uv_cancel(uv_req_t* req) {
   struct uv__work* wreq;
   uv_loop_t* loop;
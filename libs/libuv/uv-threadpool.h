@@ -29,6 +29,8 @@
 
 struct uv__work {
   char *name;
+  int priority;
+  uint64_t queued;
   void (*work)(struct uv__work *w);
   void (*done)(struct uv__work *w, int status);
   struct uv_loop_s* loop;
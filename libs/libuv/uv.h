@@ -978,6 +978,32 @@ UV_EXTERN int uv_queue_work(uv_loop_t* loop,
                             uv_work_cb work_cb,
                             uv_after_work_cb after_work_cb);
 
+/*
+ * Work is taken from the highest priority queue that isn't
+ * empty. uv_queue_work queues as UV_PRIORITY_NORMAL, file
+ * system and dns requests as UV_PRIORITY_LOW.
+ */
+#define UV_PRIORITY_HIGH    0
+#define UV_PRIORITY_NORMAL  1
+#define UV_PRIORITY_LOW     2
+#define UV_PRIORITY_MAX     3
+
+UV_EXTERN int uv_queue_work_priority(uv_loop_t* loop,
+                                     uv_work_t* req,
+                                     char *name,
+                                     int priority,
+                                     uv_work_cb work_cb,
+                                     uv_after_work_cb after_work_cb);
+
+/*
+ * The work waiting in a queue and the number of requests
+ * taken from it so far, with the nanoseconds they waited.
+ */
+UV_EXTERN void uv_threadpool_stats(int priority,
+                                   unsigned int* depth,
+                                   uint64_t* taken,
+                                   uint64_t* waited);
+
 UV_EXTERN int uv_cancel(uv_req_t* req);
 
 
@@ -21,6 +21,8 @@
 	#include <libgen.h>
 	#include <dirent.h>
 	#include <unistd.h>
+#else
+	#include <io.h>
 #endif
 
 #include "../core/pilight.h"
@@ -35,12 +37,20 @@
 #include "hardware.h"
 #include "rules.h"
 #include "gui.h"
+#include "journal.h"
+#include "snapshot.h"
+#include "history.h"
 
 static int init = 0;
 static char *string = NULL;
 static struct plua_metatable_t *table = NULL;
 static char root[PATH_MAX] = { 0 };
 static char type[255] = "json";
+static unsigned long revision = 0;
+
+/* Coalesces the device changes between two writes */
+static uv_timer_t *timer_write_req = NULL;
+static unsigned int dirty = 0;
 
 int config_root(char *path) {
 	if(strlen(path) > PATH_MAX) {
@@ -286,6 +296,57 @@ int config_parse(struct JsonNode *root, unsigned short objects) {
 	return 0;
 }
 
+/*
+ * Like config_parse, but applied to the live config. Only
+ * the devices and rules that changed are set up again, see
+ * devices_reload and rules_reload. The gui elements point
+ * to the devices, so those are always parsed again. The
+ * hardware isn't part of a reload.
+ */
+int config_reload(struct JsonNode *root, unsigned short objects) {
+	struct JsonNode *jnode = NULL;
+
+	revision++;
+
+	if(((objects & CONFIG_DEVICES) == CONFIG_DEVICES) || ((objects & CONFIG_ALL) == CONFIG_ALL)) {
+		if((jnode = json_find_member(root, "devices")) == NULL) {
+			return -1;
+		}
+		gui_gc();
+		if(devices_reload(jnode) != 0) {
+			return -1;
+		}
+#ifdef EVENTS
+		if(((objects & CONFIG_RULES) != CONFIG_RULES) && ((objects & CONFIG_ALL) != CONFIG_ALL)) {
+			rules_gc();
+		}
+#endif
+	}
+
+	if(((objects & CONFIG_GUI) == CONFIG_GUI) || ((objects & CONFIG_ALL) == CONFIG_ALL)) {
+		if((jnode = json_find_member(root, "gui")) == NULL) {
+			return -1;
+		}
+		gui_gc();
+		if(config_gui_parse(jnode) != 0) {
+			return -1;
+		}
+	}
+
+#ifdef EVENTS
+	if(((objects & CONFIG_RULES) == CONFIG_RULES) || ((objects & CONFIG_ALL) == CONFIG_ALL)) {
+		if((jnode = json_find_member(root, "rules")) == NULL) {
+			return -1;
+		}
+		if(rules_reload(jnode) != 0) {
+			return -1;
+		}
+	}
+#endif
+
+	return 0;
+}
+
 int config_read(unsigned short objects) {
 	if(string != NULL) {
 		if(((objects & CONFIG_SETTINGS) == CONFIG_SETTINGS) || ((objects & CONFIG_ALL) == CONFIG_ALL)) {
@@ -295,6 +356,7 @@ int config_read(unsigned short objects) {
 		}
 
 		if(((objects & CONFIG_REGISTRY) == CONFIG_REGISTRY) || ((objects & CONFIG_ALL) == CONFIG_ALL)) {
+			config_registry_clear();
 			if(config_callback_read("registry", string) != 1) {
 				return -1;
 			}
@@ -313,11 +375,16 @@ int config_read(unsigned short objects) {
 
 		struct JsonNode *root = json_decode(content);
 
+		journal_open(string, root);
+		snapshot_open(string, content);
+
 		if(config_parse(root, objects) == -1) {
+			snapshot_close();
 			json_delete(root);
 			FREE(content);
 			return -1;
 		}
+		snapshot_close();
 
 		json_delete(root);
 		config_write(1, "all");
@@ -422,6 +489,7 @@ struct JsonNode *config_print(int level, const char *media) {
 			json_delete(jchild4);
 		}
 
+		config_registry_sync();
 		char *registry = config_callback_write("registry");
 		if(registry != NULL) {
 			struct JsonNode *jchild = json_find_member(root, "registry");
@@ -442,31 +510,147 @@ struct plua_metatable_t *config_get_metatable(void) {
 	return table;
 }
 
+/*
+ * The config is written to a temporary file that replaces the
+ * old one, so a crash halfway leaves the old config intact.
+ */
 int config_write(int level, char *media) {
 	FILE *fp = NULL;
+	char tmp[strlen(string)+5], *content = NULL;
+	size_t len = 0;
+	int error = 0;
+#ifndef _WIN32
+	struct stat st;
+#endif
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", string);
+
+	journal_checkpoint_begin();
 
 	struct JsonNode *root = config_print(level, media);
-	/* Overwrite config file with proper format */
-	if((fp = fopen(string, "w+")) == NULL) {
-		logprintf(LOG_ERR, "cannot write config file: %s", string);
+	if((fp = fopen(tmp, "w")) == NULL) {
+		logprintf(LOG_ERR, "cannot write config file: %s", tmp);
 		json_delete(root);
+		journal_checkpoint_end(0);
 		return EXIT_FAILURE;
 	}
-	fseek(fp, 0L, SEEK_SET);
-	char *content = NULL;
 	if((content = json_stringify(root, "\t")) != NULL) {
-		fwrite(content, sizeof(char), strlen(content), fp);
-		json_free(content);
+		len = strlen(content);
+		if(fwrite(content, sizeof(char), len, fp) != len) {
+			error = 1;
+		}
 	}
 	json_delete(root);
+	if(fflush(fp) != 0) {
+		error = 1;
+	}
+#ifdef _WIN32
+	if(_commit(_fileno(fp)) != 0) {
+#else
+	if(fsync(fileno(fp)) != 0) {
+#endif
+		error = 1;
+	}
 	fclose(fp);
 
+	if(error == 1) {
+		logprintf(LOG_ERR, "cannot write config file: %s", tmp);
+		remove(tmp);
+		journal_checkpoint_end(0);
+		if(content != NULL) {
+			json_free(content);
+		}
+		return EXIT_FAILURE;
+	}
+
+#ifdef _WIN32
+	/* Windows can not rename over an existing file */
+	remove(string);
+#else
+	if(stat(string, &st) == 0) {
+		chmod(tmp, st.st_mode & 07777);
+	}
+#endif
+	if(rename(tmp, string) != 0) {
+		logprintf(LOG_ERR, "cannot replace config file: %s", string);
+		remove(tmp);
+		journal_checkpoint_end(0);
+		if(content != NULL) {
+			json_free(content);
+		}
+		return EXIT_FAILURE;
+	}
+	journal_checkpoint_end(1);
+	revision++;
+
+	/* Only the full config is read back at startup */
+	if(content != NULL) {
+		if(level == 1 && strcmp(media, "all") == 0) {
+			snapshot_write(string, content);
+		}
+		json_free(content);
+	}
+
 	return 0;
 }
 
+/*
+ * Raised when the config is reloaded or written, so a copy of
+ * config_print is valid for as long as this does not change.
+ */
+unsigned long config_revision(void) {
+	return revision;
+}
+
+static void config_write_cb(uv_timer_t *req) {
+	if(__sync_lock_test_and_set(&dirty, 0) == 1) {
+		config_write(1, "all");
+	}
+}
+
+static void config_write_close(uv_handle_t *handle) {
+	FREE(handle);
+}
+
+/*
+ * Write the config at most once every number of seconds while
+ * devices change.
+ */
+int config_write_delay(int seconds) {
+	if(timer_write_req != NULL || seconds <= 0) {
+		return -1;
+	}
+	if((timer_write_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	uv_timer_init(uv_default_loop(), timer_write_req);
+	uv_timer_start(timer_write_req, config_write_cb, seconds*1000, seconds*1000);
+	return 0;
+}
+
+/*
+ * Tell the delayed writer the devices changed. This can be
+ * called from any thread.
+ */
+void config_write_mark(void) {
+	if(timer_write_req != NULL) {
+		__sync_lock_test_and_set(&dirty, 1);
+	}
+}
+
 int config_gc(void) {
 	init = 0;
 
+	if(timer_write_req != NULL) {
+		uv_timer_stop(timer_write_req);
+		uv_close((uv_handle_t *)timer_write_req, config_write_close);
+		timer_write_req = NULL;
+	}
+	dirty = 0;
+	journal_gc();
+	history_gc();
+	config_registry_clear();
+
 	if(string != NULL) {
 		FREE(string);
 		string = NULL;
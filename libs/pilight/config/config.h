@@ -32,8 +32,12 @@ void plua_pause_coverage(int status);
 void config_init(void);
 struct JsonNode *config_print(int level, const char *media);
 int config_parse(struct JsonNode *root, unsigned short objects);
+int config_reload(struct JsonNode *root, unsigned short objects);
 int config_read(unsigned short objects);
 int config_write(int level, char *media);
+unsigned long config_revision(void);
+int config_write_delay(int seconds);
+void config_write_mark(void);
 struct plua_metatable_t *config_get_metatable(void);
 int config_exists(char *module);
 int config_set_file(char *settfile);
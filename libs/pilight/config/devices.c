@@ -22,9 +22,6 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <unistd.h>
-#ifndef _WIN32
-	#include <regex.h>
-#endif
 #include <sys/stat.h>
 #include <ctype.h>
 #include <math.h>
@@ -36,12 +33,15 @@
 #include "../core/ssdp.h"
 #include "../core/firmware.h"
 #include "../core/datetime.h"
+#include "../core/devtable.h"
 #include "../config/config.h"
 
 #include "../protocols/protocol.h"
 
 #include "defines.h"
 #include "devices.h"
+#include "history.h"
+#include "snapshot.h"
 #include "gui.h"
 
 static pthread_mutex_t mutex_lock;
@@ -52,11 +52,368 @@ struct config_t *config_devices;
 /* Struct to store the locations */
 static struct devices_t *devices = NULL;
 
+/*
+ * Readers of the device values don't take the mutex. They see
+ * the view last published: the serialized values of every
+ * device, each a version that doesn't change once published.
+ * Writers build new versions of the devices they changed and
+ * swap in a new view. The old view, and the versions only it
+ * used, are retired and freed once no reader that could have
+ * loaded them is left.
+ */
+struct devices_version_t {
+	char *id;
+	char *json;
+	size_t len;
+	unsigned long seq;
+	struct devices_version_t *next;
+};
+
+typedef struct devices_view_t {
+	/* The sequence the view was published at */
+	unsigned long seq;
+	int nr;
+	struct devices_version_t **versions;
+	struct devices_view_t *next;
+} devices_view_t;
+
+static struct devices_view_t *devices_view = NULL;
+static struct devices_view_t *devices_retired_views = NULL;
+static struct devices_version_t *devices_retired = NULL;
+static int devices_readers = 0;
+
+static void devices_publish(void);
+
+/*
+ * The devices are indexed by their id, and per protocol
+ * by the devices using it. Both are filled while parsing
+ * the config, in the same order as the devices list.
+ */
+#define DEVICES_HASH_SIZE	256
+
+typedef struct devices_list_t {
+	struct devices_t *device;
+	struct devices_list_t *next;
+} devices_list_t;
+
+typedef struct devices_index_t {
+	struct protocol_t *protocol;
+	struct devices_list_t *devices;
+	struct devices_list_t *tail;
+	struct devices_index_t *next;
+} devices_index_t;
+
+static struct devices_t *devices_hash[DEVICES_HASH_SIZE];
+static struct devices_index_t *devices_index[DEVICES_HASH_SIZE];
+static int nrdevices = 0;
+/* Bumped whenever device and setting pointers are freed */
+static unsigned long generation = 0;
+/* Raised with every change of the values of a device */
+static unsigned long sequence = 0;
+/* The protocols are started by devices_reload itself */
+static int reloading = 0;
+/* The shared device table needs new entries, see devtable.c */
+static int devices_table_layout = 1;
+
+/*
+ * Setting names are interned to small numbers so
+ * a setting of a device can be looked up through
+ * its slots array instead of a strcmp walk.
+ */
+typedef struct devices_atom_t {
+	char *name;
+	int atom;
+	struct devices_atom_t *next;
+} devices_atom_t;
+
+static struct devices_atom_t *devices_atoms[DEVICES_HASH_SIZE];
+static int nratoms = 0;
+
+/* Returns the atom of a name, or -1 when it's unknown and add is 0 */
+static int devices_atom(const char *name, int add) {
+	unsigned int hash = strhash(name) % DEVICES_HASH_SIZE;
+	struct devices_atom_t *node = devices_atoms[hash];
+
+	while(node) {
+		if(strcmp(node->name, name) == 0) {
+			return node->atom;
+		}
+		node = node->next;
+	}
+	if(add == 0) {
+		return -1;
+	}
+
+	if((node = MALLOC(sizeof(struct devices_atom_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((node->name = STRDUP(name)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->atom = nratoms++;
+	node->next = devices_atoms[hash];
+	devices_atoms[hash] = node;
+
+	return node->atom;
+}
+
+static void devices_setting_slot(struct devices_t *device, struct devices_settings_t *snode) {
+	int i = 0;
+
+	snode->table = -1;
+	snode->atom = devices_atom(snode->name, 1);
+	if(snode->atom >= device->nrslots) {
+		if((device->slots = REALLOC(device->slots, sizeof(struct devices_settings_t *)*nratoms)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		for(i=device->nrslots;i<nratoms;i++) {
+			device->slots[i] = NULL;
+		}
+		device->nrslots = nratoms;
+	}
+	if(device->slots[snode->atom] == NULL) {
+		device->slots[snode->atom] = snode;
+	}
+}
+
+/* The first setting of a device with this name */
+struct devices_settings_t *devices_get_setting(struct devices_t *device, const char *name) {
+	int atom = devices_atom(name, 0);
+	if(atom < 0 || atom >= device->nrslots) {
+		return NULL;
+	}
+	return device->slots[atom];
+}
+
+/*
+ * Pointers to devices and their settings stay valid for
+ * as long as the generation does not change.
+ */
+unsigned long devices_generation(void) {
+	return generation;
+}
+
+/*
+ * Every device remembers the sequence of its last change, so
+ * within a generation the devices changed after a sequence
+ * are known without keeping the changes themselves.
+ */
+/* Of the published view, so it matches what readers get */
+unsigned long devices_sequence(void) {
+	struct devices_view_t *view = NULL;
+	unsigned long seq = 0;
+
+	__sync_add_and_fetch(&devices_readers, 1);
+	if((view = __sync_add_and_fetch(&devices_view, 0)) != NULL) {
+		seq = view->seq;
+	}
+	__sync_sub_and_fetch(&devices_readers, 1);
+
+	return seq;
+}
+
+static struct devices_t *devices_hash_get(const char *id) {
+	struct devices_t *dptr = devices_hash[strhash(id) % DEVICES_HASH_SIZE];
+	while(dptr) {
+		if(strcmp(dptr->id, id) == 0) {
+			return dptr;
+		}
+		dptr = dptr->hnext;
+	}
+	return NULL;
+}
+
+static struct devices_list_t *devices_index_get(struct protocol_t *protocol) {
+	struct devices_index_t *node = NULL;
+
+	if(protocol == NULL) {
+		return NULL;
+	}
+
+	node = devices_index[strhash(protocol->id) % DEVICES_HASH_SIZE];
+	while(node) {
+		if(node->protocol == protocol) {
+			return node->devices;
+		}
+		node = node->next;
+	}
+	return NULL;
+}
+
+static void devices_index_add(struct devices_t *dnode) {
+	struct protocols_t *tmp_protocols = NULL, *dprotocols = NULL;
+	struct devices_index_t *node = NULL;
+	struct devices_list_t *lnode = NULL;
+	unsigned int hash = strhash(dnode->id) % DEVICES_HASH_SIZE;
+
+	dnode->hnext = devices_hash[hash];
+	devices_hash[hash] = dnode;
+	dnode->nr = nrdevices++;
+
+	/* A received code of a protocol updates the devices having
+	   one of its device names in their protocol list */
+	tmp_protocols = protocols;
+	while(tmp_protocols) {
+		dprotocols = dnode->protocols;
+		while(dprotocols) {
+			if(protocol_device_exists(tmp_protocols->listener, dprotocols->name) == 0) {
+				break;
+			}
+			dprotocols = dprotocols->next;
+		}
+		if(dprotocols != NULL) {
+			hash = strhash(tmp_protocols->listener->id) % DEVICES_HASH_SIZE;
+			node = devices_index[hash];
+			while(node) {
+				if(node->protocol == tmp_protocols->listener) {
+					break;
+				}
+				node = node->next;
+			}
+			if(node == NULL) {
+				if((node = MALLOC(sizeof(struct devices_index_t))) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+				node->protocol = tmp_protocols->listener;
+				node->devices = NULL;
+				node->tail = NULL;
+				node->next = devices_index[hash];
+				devices_index[hash] = node;
+			}
+			if((lnode = MALLOC(sizeof(struct devices_list_t))) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			lnode->device = dnode;
+			lnode->next = NULL;
+			if(node->tail != NULL) {
+				node->tail->next = lnode;
+			} else {
+				node->devices = lnode;
+			}
+			node->tail = lnode;
+		}
+		tmp_protocols = tmp_protocols->next;
+	}
+}
+
+static void devices_index_gc(void) {
+	struct devices_index_t *node = NULL;
+	struct devices_list_t *lnode = NULL;
+	int i = 0;
+
+	for(i=0;i<DEVICES_HASH_SIZE;i++) {
+		while(devices_index[i]) {
+			node = devices_index[i];
+			while(node->devices) {
+				lnode = node->devices;
+				node->devices = node->devices->next;
+				FREE(lnode);
+			}
+			devices_index[i] = devices_index[i]->next;
+			FREE(node);
+		}
+		devices_hash[i] = NULL;
+	}
+	nrdevices = 0;
+}
+
+static void devices_atoms_gc(void) {
+	int i = 0;
+
+	for(i=0;i<DEVICES_HASH_SIZE;i++) {
+		while(devices_atoms[i]) {
+			struct devices_atom_t *atom = devices_atoms[i];
+			devices_atoms[i] = devices_atoms[i]->next;
+			FREE(atom->name);
+			FREE(atom);
+		}
+	}
+	nratoms = 0;
+}
+
+static int devices_report_value(struct devices_settings_t *sptr, struct options_t *opt) {
+	return (strcmp(sptr->name, opt->name) == 0
+		&& (opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_OPTIONAL)
+		&& opt->argtype == OPTION_HAS_VALUE);
+}
+
+/*
+ * Whether a reading of a device with a deadband or a minimal
+ * interval is worth broadcasting. The values are stored either
+ * way, so the latest reading can still be read on demand. A
+ * number is compared to the one last broadcasted, so a slow
+ * drift is broadcasted once it crossed the deadband.
+ */
+static int devices_report(struct devices_t *dptr, struct protocol_t *protocol, JsonNode *message, time_t now) {
+	struct devices_settings_t *sptr = NULL;
+	struct options_t *opt = NULL;
+	JsonNode *jtmp = NULL;
+	int changed = 0;
+
+	if(dptr->deadband <= 0 && dptr->min_interval <= 0) {
+		return 1;
+	}
+	if(dptr->reported > 0 && now-dptr->reported < dptr->min_interval) {
+		return 0;
+	}
+
+	for(sptr=dptr->settings;sptr!=NULL && changed==0;sptr=sptr->next) {
+		for(opt=protocol->options;opt!=NULL;opt=opt->next) {
+			if(devices_report_value(sptr, opt) == 0 || (jtmp = json_find_member(message, opt->name)) == NULL) {
+				continue;
+			}
+			if(jtmp->tag == JSON_NUMBER && sptr->values->type == JSON_NUMBER) {
+				if(dptr->reported == 0 || fabs(sptr->values->reported-jtmp->number_) >= dptr->deadband) {
+					changed = 1;
+				}
+			} else if(jtmp->tag == JSON_STRING && sptr->values->type == JSON_STRING) {
+				if(strcmp(sptr->values->string_, jtmp->string_) != 0) {
+					changed = 1;
+				}
+			}
+		}
+	}
+	if(changed == 0) {
+		return 0;
+	}
+
+	for(sptr=dptr->settings;sptr!=NULL;sptr=sptr->next) {
+		for(opt=protocol->options;opt!=NULL;opt=opt->next) {
+			if(devices_report_value(sptr, opt) == 1 && sptr->values->type == JSON_NUMBER &&
+			   (jtmp = json_find_member(message, opt->name)) != NULL && jtmp->tag == JSON_NUMBER) {
+				sptr->values->reported = jtmp->number_;
+			}
+		}
+	}
+	dptr->reported = now;
+
+	return 1;
+}
+
+/*
+ * Remember a setting whose value differs from the one the
+ * previous update broadcasted, so the rules only reading other
+ * settings of the device don't have to run.
+ */
+static void devices_changed_add(JsonNode *jchanged, const char *name) {
+	JsonNode *jchild = json_first_child(jchanged);
+
+	while(jchild) {
+		if(jchild->tag == JSON_STRING && strcmp(jchild->string_, name) == 0) {
+			return;
+		}
+		jchild = jchild->next;
+	}
+	json_append_element(jchanged, json_mkstring(name));
+}
+
 int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNode **out) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	/* The pointer to the devices devices */
-	struct devices_t *dptr = devices;
+	struct devices_t *dptr = NULL;
+	/* The devices using the received protocol */
+	struct devices_list_t *candidates = NULL;
 	/* The pointer to the device settings */
 	struct devices_settings_t *sptr = NULL;
 	/* The pointer to the device settings */
@@ -73,6 +430,8 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 	JsonNode *rroot = json_mkobject();
 	JsonNode *rdev = json_mkarray();
 	JsonNode *rval = json_mkobject();
+	/* The settings that got a new value */
+	JsonNode *rchg = json_mkarray();
 
 	/* Temporarily char pointer */
 	char *stmp = NULL;
@@ -101,6 +460,8 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 
 	/* Is is a valid new state / value */
 	int is_valid = 1;
+	/* Every change moves the sequence, see devices_publish */
+	unsigned long before = sequence;
 
 	/* Retrieve the used protocol */
 	struct protocols_t *pnode = protocols;
@@ -128,9 +489,10 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 	json_find_string(json, "uuid", &uuid);
 
 	if((opt = protocol->options)) {
-		/* Loop through all devices */
-
-		while(dptr) {
+		/* Loop through all devices using this protocol */
+		candidates = devices_index_get(protocol);
+		while(candidates) {
+			dptr = candidates->device;
 			/*
 			 * uuid 				= The UUID of the pilight instance that received the specific information.
 			 * pilight_uuid	= The UUID of the currently running pilight instance this function was called on.
@@ -243,6 +605,8 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 
 					/* If we matched a device, update it's state */
 					if(match1 > 0 && match2 > 0 && match1 == match2) {
+						int report = devices_report(dptr, protocol, message, utct);
+
 						if(protocol->checkValues) {
 							is_valid = 0;
 							JsonNode *jcode = json_mkobject();
@@ -308,6 +672,8 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 								   && (opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_OPTIONAL)
 								   && opt->argtype == OPTION_HAS_VALUE) {
 									int upd_value = 1;
+									/* A held back reading may have been stored already */
+									int chg_value = (dptr->deadband > 0 || dptr->min_interval > 0);
 									memset(vstring_, '\0', sizeof(vstring_));
 									vnumber_ = -1;
 									vdecimals_ = 0;
@@ -325,6 +691,9 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 									}
 
 									if(is_valid == 1 && upd_value == 1) {
+										if(valueType == JSON_NUMBER) {
+											history_add(dptr->id, sptr->name, vnumber_, vdecimals_, (unsigned long)utct);
+										}
 										if(valueType == JSON_STRING &&
 										   strlen(vstring_) > 0 &&
 										   sptr->values->type == JSON_STRING &&
@@ -335,14 +704,21 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 											}
 											strcpy(sptr->values->string_, vstring_);
 											sptr->values->type = JSON_STRING;
+											chg_value = 1;
 										} else if(valueType == JSON_NUMBER &&
 												  sptr->values->type == JSON_NUMBER &&
 												  fabs(sptr->values->number_-vnumber_) >= EPSILON) {
 											sptr->values->number_ = vnumber_;
 											sptr->values->decimals = vdecimals_;
 											sptr->values->type = JSON_NUMBER;
+											chg_value = 1;
+										}
+										if(report != 0 && chg_value == 1) {
+											devices_changed_add(rchg, sptr->name);
 										}
-										if(sptr->values->type == JSON_STRING && json_find_string(rval, sptr->name, &stmp) != 0) {
+										if(report == 0) {
+											/* Held back, see devices_report */
+										} else if(sptr->values->type == JSON_STRING && json_find_string(rval, sptr->name, &stmp) != 0) {
 											json_append_member(rval, sptr->name, json_mkstring(sptr->values->string_));
 											update = 1;
 										} else if(sptr->values->type == JSON_NUMBER && json_find_number(rval, sptr->name, &itmp) != 0) {
@@ -350,6 +726,8 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 											update = 1;
 										}
 										dptr->timestamp = utct;
+										dptr->values_dirty = 1;
+										dptr->seq = ++sequence;
 									}
 									//break;
 								}
@@ -368,7 +746,11 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 									strcpy(sptr->values->string_, sstring_);
 									sptr->values->type = JSON_STRING;
 									dptr->timestamp = utct;
+									dptr->values_dirty = 1;
+									dptr->seq = ++sequence;
 									update = 1;
+									report = 1;
+									devices_changed_add(rchg, sptr->name);
 								} else if((stateType == JSON_NUMBER &&
 										   sptr->values->type == JSON_NUMBER &&
 										   fabs(sptr->values->number_-snumber_) < EPSILON)) {
@@ -376,7 +758,11 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 									sptr->values->decimals = sdecimals_;
 									sptr->values->type = JSON_NUMBER;
 									dptr->timestamp = utct;
+									dptr->values_dirty = 1;
+									dptr->seq = ++sequence;
 									update = 1;
+									report = 1;
+									devices_changed_add(rchg, sptr->name);
 								}
 								if(sptr->values->type == JSON_STRING && json_find_string(rval, sptr->name, &stmp) != 0) {
 									json_append_member(rval, sptr->name, json_mkstring(sptr->values->string_));
@@ -385,7 +771,8 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 								}
 								//break;
 							}
-							if(update == 1) {
+							/* Only states or values that are broadcasted */
+							if(update == 1 && report == 1) {
 								match = 0;
 								struct JsonNode *jchild = json_first_child(rdev);
 								while(jchild) {
@@ -429,7 +816,7 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 					}
 				}
 			}
-			dptr = dptr->next;
+			candidates = candidates->next;
 		}
 	}
 
@@ -441,34 +828,177 @@ int devices_update(char *protoname, JsonNode *json, enum origin_t origin, JsonNo
 		// }
 		json_append_member(rroot, "devices", rdev);
 		json_append_member(rroot, "values", rval);
+		json_append_member(rroot, "changed", rchg);
 
 		*out = rroot;
 	} else {
 		json_delete(rdev);
 		json_delete(rval);
+		json_delete(rchg);
 		json_delete(rroot);
 	}
 
+	if(sequence != before) {
+		devices_publish();
+	}
+
 	return (update == 1) ? 0 : -1;
 }
 
+/* Only the state and the values a protocol updates are replicated */
+static int devices_replicated(struct devices_t *dptr, const char *name) {
+	struct protocols_t *tmp_protocols = dptr->protocols;
+	struct options_t *opt = NULL;
+
+	if(strcmp(name, "state") == 0) {
+		return 1;
+	}
+	while(tmp_protocols) {
+		for(opt=tmp_protocols->listener->options;opt!=NULL;opt=opt->next) {
+			if(strcmp(opt->name, name) == 0 && opt->argtype == OPTION_HAS_VALUE &&
+			   (opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_OPTIONAL)) {
+				return 1;
+			}
+		}
+		tmp_protocols = tmp_protocols->next;
+	}
+	return 0;
+}
+
+/*
+ * Apply the values another master replicated. The change is
+ * taken when it was made after the last change of a device.
+ * When both were made at the same time, the master with the
+ * lowest uuid wins, so both masters end up with the same
+ * values. Returns 0 and the update to broadcast when one of
+ * the values changed.
+ */
+int devices_replicate(JsonNode *json, unsigned long timestamp, const char *uuid, JsonNode **out) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct devices_t *dptr = NULL;
+	struct devices_settings_t *sptr = NULL;
+	struct devices_values_t *vptr = NULL;
+	JsonNode *jdevices = json_find_member(json, "devices");
+	JsonNode *jvalues = json_find_member(json, "values");
+	JsonNode *jdevice = NULL, *jvalue = NULL;
+	JsonNode *rroot = NULL, *rdev = NULL, *rval = NULL, *rchg = NULL;
+	int changed = 0, devtype = -1;
+
+	if(jdevices == NULL || jdevices->tag != JSON_ARRAY || jvalues == NULL || jvalues->tag != JSON_OBJECT) {
+		return -1;
+	}
+
+	rdev = json_mkarray();
+	rval = json_mkobject();
+	rchg = json_mkarray();
+	json_append_member(rval, "timestamp", json_mknumber((double)timestamp, 0));
+
+	for(jdevice=json_first_child(jdevices);jdevice!=NULL;jdevice=jdevice->next) {
+		if(jdevice->tag != JSON_STRING || (dptr = devices_hash_get(jdevice->string_)) == NULL) {
+			continue;
+		}
+		if((time_t)timestamp < dptr->timestamp ||
+		   ((time_t)timestamp == dptr->timestamp && (uuid == NULL || strcmp(uuid, pilight_uuid) >= 0))) {
+			continue;
+		}
+		changed = 0;
+		for(jvalue=json_first_child(jvalues);jvalue!=NULL;jvalue=jvalue->next) {
+			if(jvalue->key == NULL || devices_replicated(dptr, jvalue->key) == 0 ||
+			   (sptr = devices_get_setting(dptr, jvalue->key)) == NULL || (vptr = sptr->values) == NULL) {
+				continue;
+			}
+			if(jvalue->tag == JSON_STRING && vptr->type == JSON_STRING) {
+				if(strcmp(vptr->string_, jvalue->string_) == 0) {
+					continue;
+				}
+				if((vptr->string_ = REALLOC(vptr->string_, strlen(jvalue->string_)+1)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+				strcpy(vptr->string_, jvalue->string_);
+			} else if(jvalue->tag == JSON_NUMBER && vptr->type == JSON_NUMBER) {
+				if(fabs(vptr->number_-jvalue->number_) < EPSILON) {
+					continue;
+				}
+				vptr->number_ = jvalue->number_;
+				vptr->decimals = jvalue->decimals_;
+			} else {
+				continue;
+			}
+			if(json_find_member(rval, jvalue->key) == NULL) {
+				if(jvalue->tag == JSON_STRING) {
+					json_append_member(rval, jvalue->key, json_mkstring(jvalue->string_));
+				} else {
+					json_append_member(rval, jvalue->key, json_mknumber(jvalue->number_, jvalue->decimals_));
+				}
+			}
+			devices_changed_add(rchg, jvalue->key);
+			changed = 1;
+		}
+		if(changed == 1) {
+			dptr->timestamp = (time_t)timestamp;
+			dptr->values_dirty = 1;
+			dptr->seq = ++sequence;
+			if(devtype == -1) {
+				devtype = dptr->protocols->listener->devtype;
+			}
+			json_append_element(rdev, json_mkstring(dptr->id));
+		}
+	}
+
+	if(json_first_child(rdev) == NULL) {
+		json_delete(rdev);
+		json_delete(rval);
+		json_delete(rchg);
+		return -1;
+	}
+	devices_publish();
+
+	rroot = json_mkobject();
+	json_append_member(rroot, "origin", json_mkstring("update"));
+	json_append_member(rroot, "type", json_mknumber(devtype, 0));
+	json_append_member(rroot, "uuid", json_mkstring((uuid != NULL) ? uuid : pilight_uuid));
+	json_append_member(rroot, "devices", rdev);
+	json_append_member(rroot, "values", rval);
+	json_append_member(rroot, "changed", rchg);
+	*out = rroot;
+
+	return 0;
+}
+
 int devices_get(char *sid, struct devices_t **dev) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	struct devices_t *dptr = NULL;
 
-	dptr = devices;
+	if((dptr = devices_hash_get(sid)) != NULL) {
+		if(dev != NULL) {
+			*dev = dptr;
+		}
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Check whether any configured device uses the protocol
+ */
+int devices_uses_protocol(struct protocol_t *proto) {
+	struct devices_t *dptr = devices;
+	struct protocols_t *tmp_protocol = NULL;
+
 	while(dptr) {
-		if(strcmp(dptr->id, sid) == 0) {
-			if(dev != NULL) {
-				*dev = dptr;
+		tmp_protocol = dptr->protocols;
+		while(tmp_protocol) {
+			if(tmp_protocol->listener == proto) {
+				return 1;
 			}
-			return 0;
+			tmp_protocol = tmp_protocol->next;
 		}
 		dptr = dptr->next;
 	}
-
-	return 1;
+	return 0;
 }
 
 int devices_valid_state(char *sid, char *state) {
@@ -506,9 +1036,7 @@ int devices_valid_value(char *sid, char *name, char *value) {
 	struct options_t *opt = NULL;
 	struct protocols_t *tmp_protocol = NULL;
 #if !defined(__FreeBSD__) && !defined(_WIN32)
-	regex_t regex;
 	int reti = 0;
-	memset(&regex, '\0', sizeof(regex));
 #endif
 
 	if(devices_get(sid, &dptr) == 0) {
@@ -519,17 +1047,14 @@ int devices_valid_value(char *sid, char *name, char *value) {
 				if((opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_OPTIONAL) && strcmp(name, opt->name) == 0) {
 #if !defined(__FreeBSD__) && !defined(_WIN32)
 					if(opt->mask != NULL) {
-						reti = regcomp(&regex, opt->mask, REG_EXTENDED);
-						if(reti) {
+						reti = options_match(opt, value);
+						if(reti == -1) {
 							logprintf(LOG_ERR, "%s: could not compile %s regex", tmp_protocol->listener->id, opt->name);
 							exit(EXIT_FAILURE);
 						}
-						reti = regexec(&regex, value, 0, NULL, 0);
-						if(reti == REG_NOMATCH || reti != 0) {
-							regfree(&regex);
+						if(reti != 0) {
 							return 1;
 						}
-						regfree(&regex);
 					}
 #endif
 					return 0;
@@ -542,96 +1067,459 @@ int devices_valid_value(char *sid, char *name, char *value) {
 	return 1;
 }
 
-struct JsonNode *devices_values(const char *media) {
-	/* Temporary pointer to the different structure */
-	struct devices_t *tmp_devices = NULL;
+static struct JsonNode *devices_values_element(struct devices_t *tmp_devices) {
 	struct devices_settings_t *tmp_settings = NULL;
 	struct devices_values_t *tmp_values = NULL;
-	struct gui_values_t *gui_values = NULL;
+	struct options_t *opt = NULL;
 
-	/* Pointers to the newly created JSON object */
-	struct JsonNode *jroot = json_mkarray();
+	struct JsonNode *jelement = json_mkobject();
+	struct JsonNode *jdevices = json_mkarray();
+	struct JsonNode *jvalues = json_mkobject();
+
+	struct protocols_t *tmp_protocols = tmp_devices->protocols;
+	json_append_member(jelement, "type", json_mknumber(tmp_protocols->listener->devtype, 0));
+	json_append_element(jdevices, json_mkstring(tmp_devices->id));
+	json_append_member(jelement, "devices", jdevices);
+
+	json_append_member(jvalues, "timestamp", json_mknumber(tmp_devices->timestamp, 0));
+
+	tmp_settings = tmp_devices->settings;
+	while(tmp_settings) {
+		if(strcmp(tmp_settings->name, "state") == 0) {
+			tmp_values = tmp_settings->values;
+			if(tmp_values->type == JSON_NUMBER) {
+				json_append_member(jvalues, tmp_settings->name, json_mknumber(tmp_values->number_, tmp_values->decimals));
+			} else if(tmp_values->type == JSON_STRING) {
+				json_append_member(jvalues, tmp_settings->name, json_mkstring(tmp_values->string_));
+			}
+		}
+		tmp_settings = tmp_settings->next;
+	}
+
+	while(tmp_protocols) {
+		opt = tmp_protocols->listener->options;
+		while(opt) {
+			if(opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_OPTIONAL) {
+				tmp_settings = tmp_devices->settings;
+				while(tmp_settings) {
+					if(strcmp(tmp_settings->name, opt->name) == 0) {
+						tmp_values = tmp_settings->values;
+						if(tmp_values->type == JSON_NUMBER) {
+							json_append_member(jvalues, tmp_settings->name, json_mknumber(tmp_values->number_, tmp_values->decimals));
+						} else if(tmp_values->type == JSON_STRING) {
+							json_append_member(jvalues, tmp_settings->name, json_mkstring(tmp_values->string_));
+						}
+					}
+					tmp_settings = tmp_settings->next;
+				}
+			}
+			opt = opt->next;
+		}
+		tmp_protocols = tmp_protocols->next;
+	}
+	json_append_member(jelement, "values", jvalues);
+
+	return jelement;
+}
+
+/* Frees what was retired, once no reader is left or by waiting for them */
+static void devices_reclaim(int wait) {
+	struct devices_view_t *view = NULL;
+	struct devices_version_t *version = NULL;
+
+	__sync_synchronize();
+	while(__sync_add_and_fetch(&devices_readers, 0) != 0) {
+		if(wait == 0) {
+			return;
+		}
+		usleep(1000);
+	}
+
+	while(devices_retired_views) {
+		view = devices_retired_views;
+		devices_retired_views = devices_retired_views->next;
+		if(view->versions != NULL) {
+			FREE(view->versions);
+		}
+		FREE(view);
+	}
+	while(devices_retired) {
+		version = devices_retired;
+		devices_retired = devices_retired->next;
+		json_free(version->json);
+		FREE(version->id);
+		FREE(version);
+	}
+}
+
+static void devices_retire(struct devices_version_t *version) {
+	if(version != NULL) {
+		version->next = devices_retired;
+		devices_retired = version;
+	}
+}
+
+static void devices_retire_view(struct devices_view_t *view) {
+	if(view != NULL) {
+		view->next = devices_retired_views;
+		devices_retired_views = view;
+	}
+}
+
+/* The values readers get, the state and the values of the protocols */
+static int devices_table_value(struct devices_t *dptr, struct devices_settings_t *sptr) {
+	struct protocols_t *tmp_protocols = NULL;
+	struct options_t *opt = NULL;
+
+	if(strcmp(sptr->name, "state") == 0) {
+		return 1;
+	}
+	for(tmp_protocols=dptr->protocols;tmp_protocols!=NULL;tmp_protocols=tmp_protocols->next) {
+		for(opt=tmp_protocols->listener->options;opt!=NULL;opt=opt->next) {
+			if((opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_OPTIONAL) && strcmp(sptr->name, opt->name) == 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+static void devices_table_write(struct devices_t *dptr) {
+	struct devices_settings_t *sptr = NULL;
+	struct devices_values_t *vptr = NULL;
+
+	for(sptr=dptr->settings;sptr!=NULL;sptr=sptr->next) {
+		if(sptr->table < 0 || (vptr = sptr->values) == NULL) {
+			continue;
+		}
+		if(vptr->type == JSON_NUMBER) {
+			devtable_set(sptr->table, DEVTABLE_NUMBER, vptr->number_, NULL, vptr->decimals, (unsigned long)dptr->timestamp);
+		} else if(vptr->type == JSON_STRING) {
+			devtable_set(sptr->table, DEVTABLE_STRING, 0, vptr->string_, 0, (unsigned long)dptr->timestamp);
+		}
+	}
+}
+
+/*
+ * Gives every value of the devices as they are now an entry,
+ * without a table this is left for the next publish.
+ */
+static void devices_table_build(void) {
+	struct devices_t *tmp_devices = NULL;
+	struct devices_settings_t *sptr = NULL;
+
+	if(devtable_begin() != 0) {
+		return;
+	}
+	for(tmp_devices=devices;tmp_devices!=NULL;tmp_devices=tmp_devices->next) {
+		for(sptr=tmp_devices->settings;sptr!=NULL;sptr=sptr->next) {
+			sptr->table = -1;
+			if(devices_table_value(tmp_devices, sptr) == 1) {
+				sptr->table = devtable_add(tmp_devices->id, sptr->name);
+			}
+		}
+		devices_table_write(tmp_devices);
+	}
+	devtable_end();
+	devices_table_layout = 0;
+}
+
+/* Fills a shared device table that was created after the devices were parsed */
+void devices_table_sync(void) {
+	pthread_mutex_lock(&mutex_lock);
+	devices_table_layout = 1;
+	devices_table_build();
+	pthread_mutex_unlock(&mutex_lock);
+}
+
+/* Publishes the devices as they are now, called after changing them */
+static void devices_publish(void) {
+	struct devices_t *tmp_devices = NULL;
+	struct devices_view_t *view = NULL;
+	struct devices_version_t *version = NULL;
 	struct JsonNode *jelement = NULL;
-	struct JsonNode *jvalues = NULL;
-	struct JsonNode *jdevices = NULL;
+	int nr = 0, rebuild = 0;
+
+	pthread_mutex_lock(&mutex_lock);
+
+	if((rebuild = devices_table_layout) == 1) {
+		devices_table_build();
+	}
+
+	for(tmp_devices=devices;tmp_devices!=NULL;tmp_devices=tmp_devices->next) {
+		nr++;
+	}
+	if((view = MALLOC(sizeof(struct devices_view_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	view->versions = NULL;
+	if(nr > 0 && (view->versions = MALLOC(sizeof(struct devices_version_t *)*(size_t)nr)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	view->next = NULL;
+	view->nr = 0;
+
+	for(tmp_devices=devices;tmp_devices!=NULL;tmp_devices=tmp_devices->next) {
+		if(tmp_devices->version == NULL || tmp_devices->values_dirty == 1) {
+			if((version = MALLOC(sizeof(struct devices_version_t))) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			if((version->id = STRDUP(tmp_devices->id)) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			jelement = devices_values_element(tmp_devices);
+			version->json = json_stringify(jelement, NULL);
+			version->len = strlen(version->json);
+			version->seq = tmp_devices->seq;
+			version->next = NULL;
+			json_delete(jelement);
+
+			devices_retire(tmp_devices->version);
+			tmp_devices->version = version;
+			tmp_devices->values_dirty = 0;
+			if(rebuild == 0) {
+				devices_table_write(tmp_devices);
+			}
+		}
+		view->versions[view->nr++] = tmp_devices->version;
+	}
+	view->seq = sequence;
+
+	devices_retire_view(__sync_lock_test_and_set(&devices_view, view));
+	devices_reclaim(0);
+
+	pthread_mutex_unlock(&mutex_lock);
+}
+
+struct JsonNode *devices_values(const char *media) {
+	struct JsonNode *jroot = NULL;
+	char *out = devices_values_since(media, 0, NULL);
+
+	if((jroot = json_decode(out)) == NULL) {
+		jroot = json_mkarray();
+	}
+	FREE(out);
+
+	return jroot;
+}
+
+/*
+ * The same array as devices_values, but serialized. Every
+ * device keeps its serialized element until devices_update
+ * changes it, so a snapshot only concatenates those.
+ */
+char *devices_values_json(const char *media) {
+	return devices_values_since(media, 0, NULL);
+}
+
+/*
+ * Only the elements of the devices changed after the since
+ * sequence. The sequence the snapshot was taken at is stored
+ * in seq, when given. Taken from the published view, so it
+ * doesn't wait for the writers.
+ */
+char *devices_values_since(const char *media, unsigned long since, unsigned long *seq) {
+	struct devices_view_t *view = NULL;
+	struct devices_version_t *version = NULL;
+	unsigned int mask = gui_media_mask(media);
+	char *out = NULL;
+	size_t len = 2, pos = 0;
+	int i = 0, nr = 0;
+
+	__sync_add_and_fetch(&devices_readers, 1);
+	if((view = __sync_add_and_fetch(&devices_view, 0)) != NULL) {
+		nr = view->nr;
+	}
+
+	if(seq != NULL) {
+		*seq = (view != NULL) ? view->seq : 0;
+	}
+
+	for(i=0;i<nr;i++) {
+		version = view->versions[i];
+		/* The versions are in the order of the config */
+		if(gui_media_device(i, mask) == 1 && (since == 0 || version->seq > since)) {
+			len += version->len+1;
+		}
+	}
+
+	if((out = MALLOC(len+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	out[pos++] = '[';
+
+	for(i=0;i<nr;i++) {
+		version = view->versions[i];
+		/* The versions are in the order of the config */
+		if(gui_media_device(i, mask) == 1 && (since == 0 || version->seq > since)) {
+			if(pos > 1) {
+				out[pos++] = ',';
+			}
+			memcpy(&out[pos], version->json, version->len);
+			pos += version->len;
+		}
+	}
+	out[pos++] = ']';
+	out[pos] = '\0';
+
+	__sync_sub_and_fetch(&devices_readers, 1);
+
+	return out;
+}
+
+static unsigned int devices_fnv(unsigned int hash, const char *str) {
+	while(*str != '\0') {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619U;
+	}
+	/* Keep "ab","c" apart from "a","bc" */
+	hash ^= 0xff;
+	hash *= 16777619U;
+	return hash;
+}
+
+/*
+ * Hashes the devices as they are configured, leaving out
+ * the state and values that change while running. Nodes
+ * compare it to skip loading a configuration they have.
+ */
+unsigned int devices_config_hash(const char *media) {
+	struct devices_t *tmp_devices = NULL;
+	struct devices_settings_t *tmp_settings = NULL;
+	struct devices_values_t *tmp_values = NULL;
+	struct protocols_t *tmp_protocols = NULL;
 	struct options_t *opt = NULL;
+	unsigned int hash = 2166136261U, mask = gui_media_mask(media);
+	char number[64];
+	int skip = 0;
+
+	pthread_mutex_lock(&mutex_lock);
+
+	tmp_devices = devices;
+	while(tmp_devices) {
+		if(gui_media_device(tmp_devices->nr, mask) == 1) {
+			hash = devices_fnv(hash, tmp_devices->id);
+			if(tmp_devices->cst_uuid == 1) {
+				hash = devices_fnv(hash, tmp_devices->dev_uuid);
+			}
+			tmp_protocols = tmp_devices->protocols;
+			while(tmp_protocols) {
+				hash = devices_fnv(hash, tmp_protocols->listener->id);
+				tmp_protocols = tmp_protocols->next;
+			}
+			tmp_settings = tmp_devices->settings;
+			while(tmp_settings) {
+				skip = (strcmp(tmp_settings->name, "state") == 0);
+				tmp_protocols = tmp_devices->protocols;
+				while(tmp_protocols && skip == 0) {
+					opt = tmp_protocols->listener->options;
+					while(opt) {
+						if(strcmp(opt->name, tmp_settings->name) == 0 &&
+						   (opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_OPTIONAL)) {
+							skip = 1;
+							break;
+						}
+						opt = opt->next;
+					}
+					tmp_protocols = tmp_protocols->next;
+				}
+				if(skip == 0) {
+					hash = devices_fnv(hash, tmp_settings->name);
+					tmp_values = tmp_settings->values;
+					while(tmp_values) {
+						if(tmp_values->name != NULL) {
+							hash = devices_fnv(hash, tmp_values->name);
+						}
+						if(tmp_values->type == JSON_STRING) {
+							hash = devices_fnv(hash, tmp_values->string_);
+						} else {
+							snprintf(number, sizeof(number), "%.*f", tmp_values->decimals, tmp_values->number_);
+							hash = devices_fnv(hash, number);
+						}
+						tmp_values = tmp_values->next;
+					}
+				}
+				tmp_settings = tmp_settings->next;
+			}
+		}
+		tmp_devices = tmp_devices->next;
+	}
+
+	pthread_mutex_unlock(&mutex_lock);
+
+	return hash;
+}
 
-	int match = 0;
+/*
+ * Clients identified with the delta option get updates
+ * with numeric device and setting ids. These are the
+ * device numbers and setting atoms, announced once.
+ */
+void devices_delta_ids(struct JsonNode *jsend) {
+	struct devices_t *tmp_devices = NULL;
+	struct devices_atom_t *atom = NULL;
+	struct JsonNode *jdevices = json_mkobject();
+	struct JsonNode *jsettings = json_mkobject();
+	int i = 0;
 
+	pthread_mutex_lock(&mutex_lock);
 	tmp_devices = devices;
-
 	while(tmp_devices) {
-		match = 0;
-		if((gui_values = gui_media(tmp_devices->id)) != NULL) {
-			while(gui_values) {
-				if(gui_values->type == JSON_STRING) {
-					if(strcmp(gui_values->string_, media) == 0 ||
-						 strcmp(gui_values->string_, "all") == 0 ||
-						 strcmp(media, "all") == 0) {
-							match = 1;
-					}
-				}
-				gui_values = gui_values->next;
-			}
-		} else {
-			match = 1;
-		}
-		if(strcmp(media, "all") == 0) {
-			match = 1;
+		json_append_member(jdevices, tmp_devices->id, json_mknumber(tmp_devices->nr, 0));
+		tmp_devices = tmp_devices->next;
+	}
+	for(i=0;i<DEVICES_HASH_SIZE;i++) {
+		atom = devices_atoms[i];
+		while(atom) {
+			json_append_member(jsettings, atom->name, json_mknumber(atom->atom, 0));
+			atom = atom->next;
 		}
-		if(match == 1) {
-			jelement = json_mkobject();
-			jdevices = json_mkarray();
-			jvalues = json_mkobject();
-
-			struct protocols_t *tmp_protocols = tmp_devices->protocols;
-			json_append_member(jelement, "type", json_mknumber(tmp_protocols->listener->devtype, 0));
-			json_append_element(jdevices, json_mkstring(tmp_devices->id));
-			json_append_member(jelement, "devices", jdevices);
+	}
+	pthread_mutex_unlock(&mutex_lock);
 
-			json_append_member(jvalues, "timestamp", json_mknumber(tmp_devices->timestamp, 0));
+	json_append_member(jsend, "devices", jdevices);
+	json_append_member(jsend, "settings", jsettings);
+}
 
-			tmp_settings = tmp_devices->settings;
-			while(tmp_settings) {
-				if(strcmp(tmp_settings->name, "state") == 0) {
-					tmp_values = tmp_settings->values;
-					if(tmp_values->type == JSON_NUMBER) {
-						json_append_member(jvalues, tmp_settings->name, json_mknumber(tmp_values->number_, tmp_values->decimals));
-					} else if(tmp_values->type == JSON_STRING) {
-						json_append_member(jvalues, tmp_settings->name, json_mkstring(tmp_values->string_));
-					}
-				}
-				tmp_settings = tmp_settings->next;
+/* The compact form of an update made by devices_update */
+struct JsonNode *devices_delta(struct JsonNode *jupdate, unsigned long seq) {
+	struct JsonNode *jdelta = json_mkobject();
+	struct JsonNode *jdevices = json_mkarray();
+	struct JsonNode *jvalues = json_mkobject();
+	struct JsonNode *jchild = NULL;
+	struct devices_t *dev = NULL;
+	char key[16];
+	int atom = 0;
+
+	if((jchild = json_find_member(jupdate, "devices")) != NULL) {
+		jchild = json_first_child(jchild);
+		while(jchild) {
+			if(jchild->tag == JSON_STRING && devices_get(jchild->string_, &dev) == 0) {
+				json_append_element(jdevices, json_mknumber(dev->nr, 0));
 			}
-
-			while(tmp_protocols) {
-				opt = tmp_protocols->listener->options;
-				while(opt) {
-					if(opt->conftype == DEVICES_VALUE || opt->conftype == DEVICES_OPTIONAL) {
-						tmp_settings = tmp_devices->settings;
-						while(tmp_settings) {
-							if(strcmp(tmp_settings->name, opt->name) == 0) {
-								tmp_values = tmp_settings->values;
-								if(tmp_values->type == JSON_NUMBER) {
-									json_append_member(jvalues, tmp_settings->name, json_mknumber(tmp_values->number_, tmp_values->decimals));
-								} else if(tmp_values->type == JSON_STRING) {
-									json_append_member(jvalues, tmp_settings->name, json_mkstring(tmp_values->string_));
-								}
-							}
-							tmp_settings = tmp_settings->next;
-						}
-					}
-					opt = opt->next;
-				}
-				tmp_protocols = tmp_protocols->next;
+			jchild = jchild->next;
+		}
+	}
+	if((jchild = json_find_member(jupdate, "values")) != NULL) {
+		jchild = json_first_child(jchild);
+		while(jchild) {
+			if(strcmp(jchild->key, "timestamp") == 0) {
+				json_append_member(jvalues, "t", json_clone(jchild));
+			} else if((atom = devices_atom(jchild->key, 0)) >= 0) {
+				snprintf(key, sizeof(key), "%d", atom);
+				json_append_member(jvalues, key, json_clone(jchild));
+			} else {
+				json_append_member(jvalues, jchild->key, json_clone(jchild));
 			}
-			json_append_member(jelement, "values", jvalues);
-			json_append_element(jroot, jelement);
+			jchild = jchild->next;
 		}
-		tmp_devices = tmp_devices->next;
 	}
 
-	return jroot;
+	json_append_member(jdelta, "seq", json_mknumber((double)seq, 0));
+	json_append_member(jdelta, "d", jdevices);
+	json_append_member(jdelta, "v", jvalues);
+
+	return jdelta;
 }
 
 struct JsonNode *config_devices_sync(int level, const char *media) {
@@ -639,8 +1527,7 @@ struct JsonNode *config_devices_sync(int level, const char *media) {
 	struct devices_t *tmp_devices = NULL;
 	struct devices_settings_t *tmp_settings = NULL;
 	struct devices_values_t *tmp_values = NULL;
-	struct gui_values_t *gui_values = NULL;
-	int match = 0;
+	unsigned int mask = gui_media_mask(media);
 
 	/* Pointers to the newly created JSON object */
 	struct JsonNode *jroot = json_mkobject();
@@ -652,25 +1539,7 @@ struct JsonNode *config_devices_sync(int level, const char *media) {
 	tmp_devices = devices;
 
 	while(tmp_devices) {
-		match = 0;
-		if((gui_values = gui_media(tmp_devices->id)) != NULL) {
-			while(gui_values) {
-				if(gui_values->type == JSON_STRING) {
-					if(strcmp(gui_values->string_, media) == 0 ||
-						 strcmp(gui_values->string_, "all") == 0 ||
-						 strcmp(media, "all") == 0) {
-							match = 1;
-					}
-				}
-				gui_values = gui_values->next;
-			}
-		} else {
-			match = 1;
-		}
-		if(strcmp(media, "all") == 0) {
-			match = 1;
-		}
-		if(match == 1) {
+		if(gui_media_device(tmp_devices->nr, mask) == 1) {
 			jdevice = json_mkobject();
 
 			struct protocols_t *tmp_protocols = tmp_devices->protocols;
@@ -838,6 +1707,7 @@ static void devices_save_setting(int i, struct JsonNode *jsetting, struct device
 					snode->next = device->settings;
 					device->settings = snode;
 				}
+				devices_setting_slot(device, snode);
 			}
 		}
 	} else if(jsetting->tag == JSON_OBJECT) {
@@ -912,6 +1782,7 @@ static void devices_save_setting(int i, struct JsonNode *jsetting, struct device
 			snode->next = device->settings;
 			device->settings = snode;
 		}
+		devices_setting_slot(device, snode);
 
 	} else {
 		/* New device settings node */
@@ -947,6 +1818,7 @@ static void devices_save_setting(int i, struct JsonNode *jsetting, struct device
 				 jtmp->tag == JSON_NUMBER) {
 			vnode->name = NULL;
 			vnode->number_ = jtmp->number_;
+			vnode->reported = jtmp->number_;
 			vnode->decimals = jtmp->decimals_;
 			vnode->type = JSON_NUMBER;
 			valid = 1;
@@ -974,6 +1846,7 @@ static void devices_save_setting(int i, struct JsonNode *jsetting, struct device
 			snode->next = device->settings;
 			device->settings = snode;
 		}
+		devices_setting_slot(device, snode);
 	}
 }
 
@@ -1036,17 +1909,11 @@ static int devices_check_id(int i, JsonNode *jsetting, struct devices_t *device)
 
 									if(tmp_options->mask != NULL && strlen(tmp_options->mask) > 0) {
 #if !defined(__FreeBSD__) && !defined(_WIN32)
-										regex_t regex;
-										memset(&regex, '\0', sizeof(regex));
-										int reti = regcomp(&regex, tmp_options->mask, REG_EXTENDED);
-										if(reti) {
+										int reti = options_match(tmp_options, ctmp);
+										if(reti == -1) {
 											logprintf(LOG_ERR, "%s: could not compile %s regex", tmp_protocols->listener->id, tmp_options->name);
-										} else {
-											reti = regexec(&regex, ctmp, 0, NULL, 0);
-											if(reti == REG_NOMATCH || reti != 0) {
-												match2--;
-											}
-											regfree(&regex);
+										} else if(reti != 0) {
+											match2--;
 										}
 #endif
 									}
@@ -1186,10 +2053,7 @@ static int devices_check_state(int i, JsonNode *jsetting, struct devices_t *devi
 	char *stmp = NULL;
 
 #if !defined(__FreeBSD__) && !defined(_WIN32)
-	/* Regex variables */
-	regex_t regex;
 	int reti = 0;
-	memset(&regex, '\0', sizeof(regex));
 #endif
 
 	/* Cast the different values */
@@ -1215,21 +2079,17 @@ static int devices_check_state(int i, JsonNode *jsetting, struct devices_t *devi
 					if(tmp_options->argtype == OPTION_HAS_VALUE) {
 						if(tmp_options->mask != NULL && strlen(tmp_options->mask) > 0) {
 #if !defined(__FreeBSD__) && !defined(_WIN32)
-							reti = regcomp(&regex, tmp_options->mask, REG_EXTENDED);
-							if(reti) {
+							reti = options_match(tmp_options, ctmp);
+							if(reti == -1) {
 								logprintf(LOG_ERR, "%s: could not compile %s regex", tmp_protocols->listener->id, tmp_options->name);
 								have_error = 1;
 								goto clear;
 							}
-							reti = regexec(&regex, ctmp, 0, NULL, 0);
-
-							if(reti == REG_NOMATCH || reti != 0) {
+							if(reti != 0) {
 								logprintf(LOG_ERR, "config device setting #%d \"%s\" of \"%s\", invalid", i, jsetting->key, device->id);
 								have_error = 1;
-								regfree(&regex);
 								goto clear;
 							}
-							regfree(&regex);
 #endif
 						}
 					} else {
@@ -1258,6 +2118,75 @@ clear:
 	return have_error;
 }
 
+static void devices_init_protocols(struct devices_t *device, JsonNode *jdevice) {
+	struct protocols_t *tmp_protocols = NULL;
+
+	if(strlen(pilight_uuid) > 0 && strcmp(device->dev_uuid, pilight_uuid) == 0) {
+		tmp_protocols = device->protocols;
+		while(tmp_protocols) {
+			if(tmp_protocols->listener->initDev && (tmp_protocols->listener->masterOnly == 0 || pilight.runmode == STANDALONE)) {
+				struct threadqueue_t *tmp = tmp_protocols->listener->initDev(jdevice);
+				if(tmp != NULL) {
+					device->protocol_threads = REALLOC(device->protocol_threads, (sizeof(struct threadqueue_t *)*(size_t)(device->nrthreads+1)));
+					device->protocol_threads[device->nrthreads] = tmp;
+					device->nrthreads++;
+				}
+			}
+			tmp_protocols = tmp_protocols->next;
+		}
+	}
+}
+
+/*
+ * The configuration of a device without its state and
+ * values, so a reload can tell whether it really changed.
+ */
+static char *devices_fingerprint(JsonNode *jdevice, struct devices_t *device) {
+	struct protocols_t *tmp_protocols = NULL;
+	struct options_t *tmp_options = NULL;
+	JsonNode *jsettings = NULL;
+	char *out = NULL, *value = NULL;
+	size_t len = 0, n = 0;
+	int skip = 0;
+
+	if((out = MALLOC(1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	out[0] = '\0';
+
+	jsettings = json_first_child(jdevice);
+	while(jsettings) {
+		skip = (strcmp(jsettings->key, "state") == 0 || strcmp(jsettings->key, "uuid") == 0 ||
+			strcmp(jsettings->key, "origin") == 0 || strcmp(jsettings->key, "timestamp") == 0);
+
+		tmp_protocols = device->protocols;
+		while(tmp_protocols && skip == 0) {
+			tmp_options = tmp_protocols->listener->options;
+			while(tmp_options) {
+				if(tmp_options->conftype == DEVICES_VALUE && strcmp(jsettings->key, tmp_options->name) == 0) {
+					skip = 1;
+					break;
+				}
+				tmp_options = tmp_options->next;
+			}
+			tmp_protocols = tmp_protocols->next;
+		}
+
+		if(skip == 0) {
+			value = json_stringify(jsettings, NULL);
+			n = strlen(jsettings->key)+strlen(value)+2;
+			if((out = REALLOC(out, len+n+1)) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			len += (size_t)snprintf(&out[len], n+1, "%s=%s;", jsettings->key, value);
+			json_free(value);
+		}
+		jsettings = jsettings->next;
+	}
+
+	return out;
+}
+
 static int devices_parse_elements(JsonNode *jdevices, struct devices_t *device) {
 	/* Temporary settings holder */
 	struct devices_settings_t *tmp_settings = NULL;
@@ -1303,7 +2232,7 @@ static int devices_parse_elements(JsonNode *jdevices, struct devices_t *device)
 		/* Parse the state setting separately from the other settings. */
 		if(strcmp(jsettings->key, "state") == 0) {
 			if(jsettings->tag == JSON_STRING || jsettings->tag == JSON_NUMBER) {
-				if(devices_check_state(i, jsettings, device) != 0) {
+				if(snapshot_validated() == 0 && devices_check_state(i, jsettings, device) != 0) {
 					have_error = 1;
 					goto clear;
 				}
@@ -1315,7 +2244,7 @@ static int devices_parse_elements(JsonNode *jdevices, struct devices_t *device)
 			}
 		} else if(strcmp(jsettings->key, "id") == 0) {
 			if(jsettings->tag == JSON_ARRAY) {
-				if(devices_check_id(i, jsettings, device) == EXIT_FAILURE) {
+				if(snapshot_validated() == 0 && devices_check_id(i, jsettings, device) == EXIT_FAILURE) {
 					have_error = 1;
 					goto clear;
 				}
@@ -1350,6 +2279,19 @@ static int devices_parse_elements(JsonNode *jdevices, struct devices_t *device)
 				have_error = 1;
 				goto clear;
 			}
+		} else if(strcmp(jsettings->key, "deadband") == 0 || strcmp(jsettings->key, "min-interval") == 0) {
+			if(jsettings->tag == JSON_NUMBER && jsettings->number_ >= 0) {
+				if(strcmp(jsettings->key, "deadband") == 0) {
+					device->deadband = jsettings->number_;
+				} else {
+					device->min_interval = (int)jsettings->number_;
+				}
+				devices_save_setting(i, jsettings, device);
+			} else {
+				logprintf(LOG_ERR, "config device setting #%d \"%s\" of \"%s\", invalid", i, jsettings->key, device->id);
+				have_error = 1;
+				goto clear;
+			}
 		/* The protocol and name settings are already saved in the device struct */
 		} else if(!((strcmp(jsettings->key, "protocol") == 0 && jsettings->tag == JSON_ARRAY)
 			|| (strcmp(jsettings->key, "uuid") == 0 && jsettings->tag == JSON_STRING)
@@ -1468,19 +2410,10 @@ static int devices_parse_elements(JsonNode *jdevices, struct devices_t *device)
 		}
 	}
 
-	if(strlen(pilight_uuid) > 0 && strcmp(device->dev_uuid, pilight_uuid) == 0) {
-		tmp_protocols = device->protocols;
-		while(tmp_protocols) {
-			if(tmp_protocols->listener->initDev && (tmp_protocols->listener->masterOnly == 0 || pilight.runmode == STANDALONE)) {
-				struct threadqueue_t *tmp = tmp_protocols->listener->initDev(jdevices);
-				if(tmp != NULL) {
-					device->protocol_threads = REALLOC(device->protocol_threads, (sizeof(struct threadqueue_t *)*(size_t)(device->nrthreads+1)));
-					device->protocol_threads[device->nrthreads] = tmp;
-					device->nrthreads++;
-				}
-			}
-			tmp_protocols = tmp_protocols->next;
-		}
+	device->fingerprint = devices_fingerprint(jdevices, device);
+
+	if(reloading == 0) {
+		devices_init_protocols(device, jdevices);
 	}
 
 clear:
@@ -1532,13 +2465,9 @@ static int devices_parse(JsonNode *root) {
 					}
 				}
 				/* Check for duplicate fields */
-				tmp_devices = devices;
-				while(tmp_devices) {
-					if(strcmp(tmp_devices->id, jdevices->key) == 0) {
-						logprintf(LOG_ERR, "config device #%d \"%s\", duplicate", i, jdevices->key);
-						have_error = 1;
-					}
-					tmp_devices = tmp_devices->next;
+				if(devices_hash_get(jdevices->key) != NULL) {
+					logprintf(LOG_ERR, "config device #%d \"%s\", duplicate", i, jdevices->key);
+					have_error = 1;
 				}
 
 				if((dnode = MALLOC(sizeof(struct devices_t))) == NULL) {
@@ -1557,8 +2486,20 @@ static int devices_parse(JsonNode *root) {
 				strcpy(dnode->id, jdevices->key);
 				dnode->nrthreads = 0;
 				dnode->timestamp = 0;
+				dnode->deadband = 0;
+				dnode->min_interval = 0;
+				dnode->reported = 0;
 				dnode->protocol_threads = NULL;
 				dnode->settings = NULL;
+				dnode->version = NULL;
+				dnode->values_dirty = 1;
+				dnode->seq = 0;
+				dnode->slots = NULL;
+				dnode->nrslots = 0;
+				dnode->execution_id = 0;
+				dnode->fingerprint = NULL;
+				dnode->changed = 1;
+				dnode->hnext = NULL;
 				dnode->next = NULL;
 				dnode->protocols = NULL;
 
@@ -1642,6 +2583,7 @@ static int devices_parse(JsonNode *root) {
 					dnode->next = devices;
 					devices = dnode;
 				}
+				devices_index_add(dnode);
 
 				if(have_error) {
 					goto clear;
@@ -1656,82 +2598,102 @@ clear:
 	return have_error;
 }
 
-int devices_gc(void) {
-	int i = 0;
-	struct devices_t *dtmp = NULL;
+/*
+ * When stop is 0 the protocols of the device are left
+ * running, as they're still used after a reload.
+ */
+static void devices_free(struct devices_t *dtmp, int stop) {
 	struct devices_settings_t *stmp = NULL;
 	struct devices_values_t *vtmp = NULL;
 	struct protocols_t *ptmp = NULL;
-
-	pthread_mutex_lock(&mutex_lock);
-	/* Free devices structure */
-	while(devices) {
-		dtmp = devices;
+	int i = 0;
 
 #if defined(EVENTS) && defined(PILIGHT_STAGING)
-		event_action_thread_free(dtmp);
+	event_action_thread_free(dtmp);
 #endif
 
-		while(dtmp->settings) {
-			stmp = dtmp->settings;
-			while(stmp->values) {
-				vtmp = stmp->values;
-				if(vtmp->type == JSON_STRING && vtmp->string_ != NULL) {
-					FREE(vtmp->string_);
-				}
-				if(vtmp->name) {
-					FREE(vtmp->name);
-				}
-				stmp->values = stmp->values->next;
-				FREE(vtmp);
-			}
-			if(stmp->values != NULL) {
-				FREE(stmp->values);
+	while(dtmp->settings) {
+		stmp = dtmp->settings;
+		while(stmp->values) {
+			vtmp = stmp->values;
+			if(vtmp->type == JSON_STRING && vtmp->string_ != NULL) {
+				FREE(vtmp->string_);
 			}
-			if(stmp->name) {
-				FREE(stmp->name);
+			if(vtmp->name) {
+				FREE(vtmp->name);
 			}
-			dtmp->settings = dtmp->settings->next;
-			FREE(stmp);
+			stmp->values = stmp->values->next;
+			FREE(vtmp);
 		}
-		while(dtmp->protocols) {
-			ptmp = dtmp->protocols;
-			if(ptmp->listener != NULL && ptmp->listener->threadGC != NULL) {
-				ptmp->listener->threadGC();
-			}
-			if(ptmp->name != NULL) {
-				FREE(ptmp->name);
-			}
-			if(ptmp->listener != NULL) {
-				FREE(ptmp->listener);
-			}
-			dtmp->protocols = dtmp->protocols->next;
-			FREE(ptmp);
+		if(stmp->values != NULL) {
+			FREE(stmp->values);
 		}
-		if(dtmp->nrthreads > 0) {
-			for(i=0;i<dtmp->nrthreads;i++) {
-				thread_stop(dtmp->protocol_threads[i]->id);
-			}
+		if(stmp->name) {
+			FREE(stmp->name);
 		}
-		if(dtmp->protocols != NULL) {
-			FREE(dtmp->protocols);
+		dtmp->settings = dtmp->settings->next;
+		FREE(stmp);
+	}
+	while(dtmp->protocols) {
+		ptmp = dtmp->protocols;
+		if(stop == 1 && ptmp->listener != NULL && ptmp->listener->threadGC != NULL) {
+			ptmp->listener->threadGC();
 		}
-		if(dtmp->settings != NULL) {
-			FREE(dtmp->settings);
+		if(ptmp->name != NULL) {
+			FREE(ptmp->name);
 		}
-		if(dtmp->id != NULL) {
-			FREE(dtmp->id);
+		if(ptmp->listener != NULL) {
+			FREE(ptmp->listener);
 		}
-		if(dtmp->protocol_threads != NULL) {
-			FREE(dtmp->protocol_threads);
+		dtmp->protocols = dtmp->protocols->next;
+		FREE(ptmp);
+	}
+	if(stop == 1 && dtmp->nrthreads > 0) {
+		for(i=0;i<dtmp->nrthreads;i++) {
+			thread_stop(dtmp->protocol_threads[i]->id);
 		}
-		devices = devices->next;
-		FREE(dtmp);
 	}
-	if(devices != NULL) {
-		FREE(devices);
+	if(dtmp->protocols != NULL) {
+		FREE(dtmp->protocols);
+	}
+	if(dtmp->settings != NULL) {
+		FREE(dtmp->settings);
+	}
+	if(dtmp->id != NULL) {
+		FREE(dtmp->id);
+	}
+	if(dtmp->protocol_threads != NULL) {
+		FREE(dtmp->protocol_threads);
+	}
+	if(dtmp->slots != NULL) {
+		FREE(dtmp->slots);
+	}
+	/* Readers may still be looking at it */
+	devices_retire(dtmp->version);
+	if(dtmp->fingerprint != NULL) {
+		FREE(dtmp->fingerprint);
+	}
+	FREE(dtmp);
+}
+
+int devices_gc(void) {
+	struct devices_t *dtmp = NULL;
+
+	pthread_mutex_lock(&mutex_lock);
+	generation++;
+	devices_index_gc();
+	devices_atoms_gc();
+	/* Free devices structure */
+	while(devices) {
+		dtmp = devices;
+		devices = devices->next;
+		devices_free(dtmp, 1);
 	}
 	devices = NULL;
+	devices_table_build();
+	devices_table_layout = 1;
+	devices_retire_view(__sync_lock_test_and_set(&devices_view, NULL));
+	devices_reclaim(1);
 
 	pthread_mutex_unlock(&mutex_lock);
 	logprintf(LOG_DEBUG, "garbage collected config devices library");
@@ -1740,13 +2702,243 @@ int devices_gc(void) {
 }
 
 int config_devices_parse(struct JsonNode *root) {
-	if(devices_parse(root) == 0 && devices_validate_settings() == 0) {
+	if(devices_parse(root) == 0 && (snapshot_validated() == 1 || devices_validate_settings() == 0)) {
+		/* A reload publishes once it merged the old devices */
+		if(reloading == 0) {
+			devices_publish();
+		}
 		return 0;
 	} else {
 		return 1;
 	}
 }
 
+/* Takes the device out of a list of devices */
+static struct devices_t *devices_list_take(struct devices_t **list, const char *id) {
+	struct devices_t *dtmp = *list, *prev = NULL;
+
+	while(dtmp) {
+		if(strcmp(dtmp->id, id) == 0) {
+			if(prev == NULL) {
+				*list = dtmp->next;
+			} else {
+				prev->next = dtmp->next;
+			}
+			dtmp->next = NULL;
+			return dtmp;
+		}
+		prev = dtmp;
+		dtmp = dtmp->next;
+	}
+	return NULL;
+}
+
+static int devices_list_has(struct devices_t *list, const char *id, struct devices_t **out) {
+	while(list) {
+		if(strcmp(list->id, id) == 0) {
+			*out = list;
+			return 0;
+		}
+		list = list->next;
+	}
+	return -1;
+}
+
+static int devices_affected(struct devices_t *device, char **affected, int nraffected) {
+	struct protocols_t *ptmp = device->protocols;
+	int i = 0;
+
+	while(ptmp) {
+		for(i=0;i<nraffected;i++) {
+			if(strcmp(affected[i], ptmp->listener->id) == 0) {
+				return 1;
+			}
+		}
+		ptmp = ptmp->next;
+	}
+	return 0;
+}
+
+/* Returns the number of protocols that were added */
+static int devices_affect(struct devices_t *device, char ***affected, int *nraffected) {
+	struct protocols_t *ptmp = device->protocols;
+	int i = 0, added = 0;
+
+	while(ptmp) {
+		for(i=0;i<*nraffected;i++) {
+			if(strcmp((*affected)[i], ptmp->listener->id) == 0) {
+				break;
+			}
+		}
+		if(i == *nraffected) {
+			if((*affected = REALLOC(*affected, sizeof(char *)*(size_t)(*nraffected+1))) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			(*affected)[(*nraffected)++] = ptmp->listener->id;
+			added++;
+		}
+		ptmp = ptmp->next;
+	}
+	return added;
+}
+
+static void devices_stop_threads(struct devices_t *device) {
+	int i = 0;
+
+	for(i=0;i<device->nrthreads;i++) {
+		thread_stop(device->protocol_threads[i]->id);
+	}
+	if(device->protocol_threads != NULL) {
+		FREE(device->protocol_threads);
+	}
+	device->nrthreads = 0;
+}
+
+/*
+ * Apply a new devices config to the live one. Devices of which
+ * only the state or values differ are kept as they are. The
+ * protocols free the data of all their devices at once, so a
+ * protocol with an added, removed or changed device is stopped
+ * and started again for all devices using it, the others keep
+ * running.
+ */
+int devices_reload(struct JsonNode *root) {
+	struct devices_t *old = NULL, *dtmp = NULL, *match = NULL, *prev = NULL;
+	struct protocols_t *tmp_protocols = NULL;
+	struct JsonNode *jdevice = NULL;
+	char **affected = NULL;
+	int nraffected = 0, nrchanged = 0, nrremoved = 0, i = 0, added = 0;
+
+	pthread_mutex_lock(&mutex_lock);
+	old = devices;
+	devices = NULL;
+	devices_index_gc();
+
+	reloading = 1;
+	if(config_devices_parse(root) != 0) {
+		reloading = 0;
+		while(devices) {
+			dtmp = devices;
+			devices = devices->next;
+			devices_free(dtmp, 0);
+		}
+		devices_index_gc();
+		devices = old;
+		dtmp = devices;
+		while(dtmp) {
+			devices_index_add(dtmp);
+			dtmp = dtmp->next;
+		}
+		pthread_mutex_unlock(&mutex_lock);
+		return -1;
+	}
+	reloading = 0;
+
+	dtmp = devices;
+	while(dtmp) {
+		if(devices_list_has(old, dtmp->id, &match) != 0 || match->fingerprint == NULL ||
+		   dtmp->fingerprint == NULL || strcmp(match->fingerprint, dtmp->fingerprint) != 0) {
+			dtmp->changed = 1;
+			devices_affect(dtmp, &affected, &nraffected);
+			nrchanged++;
+		} else {
+			dtmp->changed = 0;
+		}
+		dtmp = dtmp->next;
+	}
+	dtmp = old;
+	while(dtmp) {
+		if(devices_hash_get(dtmp->id) == NULL) {
+			devices_affect(dtmp, &affected, &nraffected);
+			nrremoved++;
+		}
+		dtmp = dtmp->next;
+	}
+	/* Devices sharing a protocol with a changed one are restarted as a whole */
+	do {
+		added = 0;
+		dtmp = devices;
+		while(dtmp) {
+			if(devices_affected(dtmp, affected, nraffected) == 1) {
+				added += devices_affect(dtmp, &affected, &nraffected);
+			}
+			dtmp = dtmp->next;
+		}
+	} while(added > 0);
+
+	tmp_protocols = protocols;
+	while(tmp_protocols) {
+		for(i=0;i<nraffected;i++) {
+			if(strcmp(affected[i], tmp_protocols->listener->id) == 0 && tmp_protocols->listener->threadGC != NULL) {
+				tmp_protocols->listener->threadGC();
+			}
+		}
+		tmp_protocols = tmp_protocols->next;
+	}
+
+	/* Keep the live node of every unchanged device */
+	prev = NULL;
+	dtmp = devices;
+	while(dtmp) {
+		if(dtmp->changed == 0 && (match = devices_list_take(&old, dtmp->id)) != NULL) {
+			match->next = dtmp->next;
+			if(prev == NULL) {
+				devices = match;
+			} else {
+				prev->next = match;
+			}
+			devices_free(dtmp, 0);
+			match->changed = 0;
+			match->values_dirty = 1;
+			dtmp = match;
+		}
+		if(devices_affected(dtmp, affected, nraffected) == 1) {
+			devices_stop_threads(dtmp);
+			if((jdevice = json_find_member(root, dtmp->id)) != NULL) {
+				devices_init_protocols(dtmp, jdevice);
+			}
+		}
+		prev = dtmp;
+		dtmp = dtmp->next;
+	}
+
+	devices_table_layout = 1;
+	devices_publish();
+	while(old) {
+		dtmp = old;
+		old = old->next;
+		devices_stop_threads(dtmp);
+		devices_free(dtmp, 0);
+	}
+
+	devices_index_gc();
+	dtmp = devices;
+	while(dtmp) {
+		devices_index_add(dtmp);
+		dtmp = dtmp->next;
+	}
+	generation++;
+
+	pthread_mutex_unlock(&mutex_lock);
+
+	if(affected != NULL) {
+		FREE(affected);
+	}
+
+	logprintf(LOG_DEBUG, "reloaded config devices library, %d changed, %d removed", nrchanged, nrremoved);
+
+	return 0;
+}
+
+int devices_changed(const char *id) {
+	struct devices_t *dptr = NULL;
+
+	if((dptr = devices_hash_get(id)) == NULL) {
+		return 1;
+	}
+	return dptr->changed;
+}
+
 void devices_init(void) {
 	pthread_mutexattr_init(&mutex_attr);
 	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
@@ -1782,7 +2974,7 @@ int devices_select_protocol(enum origin_t origin, char *id, int element, struct
 int devices_select_number_setting(enum origin_t origin, char *id, char *setting, double *out, int *decimals) {
 	struct devices_t *dev = NULL;
 	if(devices_get(id, &dev) == 0) {
-		struct devices_settings_t *tmp_settings = dev->settings;
+		struct devices_settings_t *tmp_settings = devices_get_setting(dev, setting);
 		while(tmp_settings) {
 			if(strcmp(tmp_settings->name, setting) == 0) {
 				struct devices_values_t *tmp_values = tmp_settings->values;
@@ -1806,7 +2998,7 @@ int devices_select_number_setting(enum origin_t origin, char *id, char *setting,
 int devices_select_string_setting(enum origin_t origin, char *id, char *setting, char **out) {
 	struct devices_t *dev = NULL;
 	if(devices_get(id, &dev) == 0) {
-		struct devices_settings_t *tmp_settings = dev->settings;
+		struct devices_settings_t *tmp_settings = devices_get_setting(dev, setting);
 		while(tmp_settings) {
 			if(strcmp(tmp_settings->name, setting) == 0) {
 				struct devices_values_t *tmp_values = tmp_settings->values;
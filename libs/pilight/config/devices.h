@@ -64,15 +64,23 @@ struct devices_values_t {
 	int decimals;
 	char *name;
 	int type;
+	/* The number last broadcasted, see deadband */
+	double reported;
 	struct devices_values_t *next;
 };
 
 struct devices_settings_t {
 	char *name;
+	/* Interned name, see devices_atom */
+	int atom;
+	/* Entry in the shared device table, -1 if it has none */
+	int table;
 	struct devices_values_t *values;
 	struct devices_settings_t *next;
 };
 
+struct devices_version_t;
+
 struct devices_t {
 	char *id;
 	char dev_uuid[22];
@@ -80,25 +88,60 @@ struct devices_t {
 	int cst_uuid;
 	int nrthreads;
 	time_t timestamp;
+	/* Readings that differ less, or come sooner, aren't broadcasted */
+	double deadband;
+	int min_interval;
+	time_t reported;
 #ifdef EVENTS
 	int lastrule;
 	int prevrule;
 	struct event_action_thread_t *action_thread;
 #endif
+	/* Id of the last action started for this device, 0 for none */
+	unsigned long execution_id;
 	struct protocols_t *protocols;
 	struct devices_settings_t *settings;
 	struct threadqueue_t **protocol_threads;
+	/* The serialized values readers see, and if they're outdated */
+	struct devices_version_t *version;
+	unsigned short values_dirty;
+	/* Of the last change of the values, see devices_sequence */
+	unsigned long seq;
+	/* First setting of each atom, indexed by atom */
+	struct devices_settings_t **slots;
+	int nrslots;
+	/* Position in the config, used as compact id in delta updates */
+	int nr;
+	/* The config apart from the values, see devices_reload */
+	char *fingerprint;
+	/* Added or changed by the last reload */
+	unsigned short changed;
+	/* Next device in the same devices_hash bucket */
+	struct devices_t *hnext;
 	struct devices_t *next;
 };
 
 extern struct config_t *config_devices;
 
 int devices_update(char *protoname, JsonNode *message, enum origin_t origin, JsonNode **out);
+int devices_replicate(JsonNode *json, unsigned long timestamp, const char *uuid, JsonNode **out);
 int devices_get(char *sid, struct devices_t **dev);
+int devices_uses_protocol(struct protocol_t *proto);
+struct devices_settings_t *devices_get_setting(struct devices_t *device, const char *name);
+unsigned long devices_generation(void);
+unsigned long devices_sequence(void);
 int devices_valid_state(char *sid, char *state);
 int devices_valid_value(char *sid, char *name, char *value);
 struct JsonNode *devices_values(const char *media);
+char *devices_values_json(const char *media);
+char *devices_values_since(const char *media, unsigned long since, unsigned long *seq);
+unsigned int devices_config_hash(const char *media);
+void devices_delta_ids(struct JsonNode *jsend);
+void devices_table_sync(void);
+struct JsonNode *devices_delta(struct JsonNode *jupdate, unsigned long seq);
 int config_devices_parse(struct JsonNode *root);
+int devices_reload(struct JsonNode *root);
+int devices_changed(const char *id);
 void devices_init(void);
 int devices_gc(void);
 struct JsonNode *config_devices_sync(int level, const char *media);
@@ -40,6 +40,23 @@ static pthread_mutexattr_t mutex_attr;
 
 static struct gui_elements_t *gui_elements = NULL;
 
+/*
+ * The elements shown on each media, in the order of the
+ * config, and the media of each device by its position in
+ * the config. Both are built once the gui is parsed, so a
+ * request only walks what it shows.
+ */
+#define GUI_VIEWS		5
+
+typedef struct gui_view_t {
+	struct gui_elements_t **elements;
+	int nr;
+} gui_view_t;
+
+static struct gui_view_t gui_views[GUI_VIEWS];
+static unsigned int *gui_devices_media = NULL;
+static int gui_devices_nr = 0;
+
 struct gui_values_t *gui_media(char *name) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -66,12 +83,373 @@ struct gui_values_t *gui_media(char *name) {
 	return NULL;
 }
 
+struct gui_values_t *gui_group(char *name) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct gui_elements_t *tmp_gui = NULL;
+	struct gui_settings_t *tmp_settings = NULL;
+	tmp_gui = gui_elements;
+
+	while(tmp_gui) {
+		if(strcmp(tmp_gui->id, name) == 0) {
+			tmp_settings = tmp_gui->settings;
+			while(tmp_settings) {
+				if(strcmp(tmp_settings->name, "group") == 0) {
+					return tmp_settings->values;
+				}
+				tmp_settings = tmp_settings->next;
+			}
+			break;
+		}
+
+		tmp_gui = tmp_gui->next;
+	}
+	return NULL;
+}
+
+static int gui_filter_strings(struct JsonNode *jarray, char ***out, int *nr) {
+	struct JsonNode *jchild = NULL;
+
+	if(jarray->tag != JSON_ARRAY) {
+		return -1;
+	}
+	jchild = json_first_child(jarray);
+	while(jchild) {
+		if(jchild->tag != JSON_STRING) {
+			return -1;
+		}
+		if((*out = REALLOC(*out, sizeof(char *)*(size_t)(*nr+1))) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		if(((*out)[*nr] = MALLOC(strlen(jchild->string_)+1)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		strcpy((*out)[*nr], jchild->string_);
+		(*nr)++;
+		jchild = jchild->next;
+	}
+	return 0;
+}
+
+/*
+ * Parse a subscription like:
+ * { "devices": [ "lamp" ], "types": [ 1, 2 ], "groups": [ "Hallway" ] }
+ * A device matches when it passes every list that is given.
+ */
+int gui_filter_parse(struct JsonNode *jfilter, struct gui_filter_t **filter) {
+	struct JsonNode *jchild = NULL, *jtype = NULL;
+	int error = 0;
+
+	gui_filter_free(filter);
+
+	if(jfilter == NULL || jfilter->tag != JSON_OBJECT) {
+		return -1;
+	}
+	if((*filter = MALLOC(sizeof(struct gui_filter_t))) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(*filter, 0, sizeof(struct gui_filter_t));
+
+	jchild = json_first_child(jfilter);
+	while(jchild && error == 0) {
+		if(strcmp(jchild->key, "devices") == 0) {
+			error = gui_filter_strings(jchild, &(*filter)->devices, &(*filter)->nrdevices);
+		} else if(strcmp(jchild->key, "groups") == 0) {
+			error = gui_filter_strings(jchild, &(*filter)->groups, &(*filter)->nrgroups);
+		} else if(strcmp(jchild->key, "protocols") == 0) {
+			error = gui_filter_strings(jchild, &(*filter)->protocols, &(*filter)->nrprotocols);
+		} else if(strcmp(jchild->key, "hardware") == 0 && jchild->tag == JSON_ARRAY) {
+			jtype = json_first_child(jchild);
+			while(jtype) {
+				if(jtype->tag != JSON_NUMBER || (int)jtype->number_ < 0 ||
+				   (int)jtype->number_ >= (int)(sizeof(unsigned long)*8)) {
+					error = -1;
+					break;
+				}
+				(*filter)->hardware |= (1UL << (int)jtype->number_);
+				jtype = jtype->next;
+			}
+		} else if(strcmp(jchild->key, "pulse") == 0 && jchild->tag == JSON_ARRAY) {
+			struct JsonNode *jmin = json_first_child(jchild);
+			struct JsonNode *jmax = (jmin != NULL) ? jmin->next : NULL;
+			if(jmin == NULL || jmax == NULL || jmax->next != NULL ||
+			   jmin->tag != JSON_NUMBER || jmax->tag != JSON_NUMBER ||
+			   (int)jmin->number_ < 0 || (int)jmax->number_ < (int)jmin->number_) {
+				error = -1;
+			} else {
+				(*filter)->minpulse = (int)jmin->number_;
+				(*filter)->maxpulse = (int)jmax->number_;
+			}
+		} else if(strcmp(jchild->key, "types") == 0 && jchild->tag == JSON_ARRAY) {
+			jtype = json_first_child(jchild);
+			while(jtype) {
+				if(jtype->tag != JSON_NUMBER || (int)jtype->number_ < 0 ||
+				   (int)jtype->number_ >= (int)(sizeof(unsigned long)*8)) {
+					error = -1;
+					break;
+				}
+				(*filter)->types |= (1UL << (int)jtype->number_);
+				jtype = jtype->next;
+			}
+		} else {
+			error = -1;
+		}
+		jchild = jchild->next;
+	}
+	if(error != 0) {
+		gui_filter_free(filter);
+		return -1;
+	}
+	return 0;
+}
+
+int gui_filter_type(struct gui_filter_t *filter, int type) {
+	if(filter == NULL || filter->types == 0) {
+		return 1;
+	}
+	if(type < 0 || type >= (int)(sizeof(unsigned long)*8)) {
+		return 0;
+	}
+	return ((filter->types & (1UL << type)) != 0);
+}
+
+int gui_filter_device(struct gui_filter_t *filter, char *name) {
+	struct gui_values_t *tmp_values = NULL;
+	int i = 0, match = 0;
+
+	if(filter == NULL) {
+		return 1;
+	}
+	if(filter->nrdevices > 0) {
+		for(i=0;i<filter->nrdevices;i++) {
+			if(strcmp(filter->devices[i], name) == 0) {
+				match = 1;
+				break;
+			}
+		}
+		if(match == 0) {
+			return 0;
+		}
+	}
+	if(filter->nrgroups > 0) {
+		match = 0;
+		tmp_values = gui_group(name);
+		while(tmp_values && match == 0) {
+			if(tmp_values->type == JSON_STRING) {
+				for(i=0;i<filter->nrgroups;i++) {
+					if(strcmp(filter->groups[i], tmp_values->string_) == 0) {
+						match = 1;
+						break;
+					}
+				}
+			}
+			tmp_values = tmp_values->next;
+		}
+		if(match == 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * Receivers can subscribe to the codes of some protocols,
+ * hardware types and pulse lengths, like:
+ * { "protocols": [ "kaku_switch" ], "hardware": [ 1 ], "pulse": [ 280, 320 ] }
+ * Codes without a pulse length, like those of the API, don't
+ * match a pulse range.
+ */
+int gui_filter_code(struct gui_filter_t *filter, const char *protocol, int hwtype, int plslen) {
+	int i = 0, match = 0;
+
+	if(filter == NULL) {
+		return 1;
+	}
+	if(filter->nrprotocols > 0) {
+		for(i=0;i<filter->nrprotocols;i++) {
+			if(strcmp(filter->protocols[i], protocol) == 0) {
+				match = 1;
+				break;
+			}
+		}
+		if(match == 0) {
+			return 0;
+		}
+	}
+	if(filter->hardware != 0 &&
+	   (hwtype < 0 || hwtype >= (int)(sizeof(unsigned long)*8) || (filter->hardware & (1UL << hwtype)) == 0)) {
+		return 0;
+	}
+	if(filter->maxpulse > 0 && (plslen < filter->minpulse || plslen > filter->maxpulse)) {
+		return 0;
+	}
+	return 1;
+}
+
+void gui_filter_free(struct gui_filter_t **filter) {
+	int i = 0;
+
+	if(*filter == NULL) {
+		return;
+	}
+	for(i=0;i<(*filter)->nrdevices;i++) {
+		FREE((*filter)->devices[i]);
+	}
+	if((*filter)->devices != NULL) {
+		FREE((*filter)->devices);
+	}
+	for(i=0;i<(*filter)->nrgroups;i++) {
+		FREE((*filter)->groups[i]);
+	}
+	if((*filter)->groups != NULL) {
+		FREE((*filter)->groups);
+	}
+	for(i=0;i<(*filter)->nrprotocols;i++) {
+		FREE((*filter)->protocols[i]);
+	}
+	if((*filter)->protocols != NULL) {
+		FREE((*filter)->protocols);
+	}
+	FREE(*filter);
+	*filter = NULL;
+}
+
+/* The clients of other media only see the elements shown on all */
+static int gui_view_index(unsigned int mask) {
+	switch(mask) {
+		case GUI_MEDIA_ANY:
+			return 0;
+		case GUI_MEDIA_WEB:
+			return 1;
+		case GUI_MEDIA_MOBILE:
+			return 2;
+		case GUI_MEDIA_DESKTOP:
+			return 3;
+		default:
+			return 4;
+	}
+}
+
+unsigned int gui_media_mask(const char *media) {
+	if(strcmp(media, "all") == 0) {
+		return GUI_MEDIA_ANY;
+	} else if(strcmp(media, "web") == 0) {
+		return GUI_MEDIA_WEB;
+	} else if(strcmp(media, "mobile") == 0) {
+		return GUI_MEDIA_MOBILE;
+	} else if(strcmp(media, "desktop") == 0) {
+		return GUI_MEDIA_DESKTOP;
+	}
+	return 0;
+}
+
+/*
+ * Whether a client of the media in mask is shown the device
+ * at this position in the config. Devices without a gui
+ * element are shown on all media.
+ */
+int gui_media_device(int nr, unsigned int mask) {
+	unsigned int *media = gui_devices_media;
+
+	if(mask == GUI_MEDIA_ANY || media == NULL || nr < 0 || nr >= gui_devices_nr) {
+		return 1;
+	}
+	return ((media[nr] & (mask | GUI_MEDIA_ALL)) != 0);
+}
+
+static unsigned int gui_element_media(struct gui_elements_t *element) {
+	struct gui_settings_t *tmp_settings = element->settings;
+	struct gui_values_t *tmp_values = NULL;
+	unsigned int media = 0;
+
+	while(tmp_settings) {
+		if(strcmp(tmp_settings->name, "media") == 0) {
+			tmp_values = tmp_settings->values;
+			while(tmp_values) {
+				if(tmp_values->type == JSON_STRING) {
+					if(strcmp(tmp_values->string_, "all") == 0) {
+						media |= GUI_MEDIA_ALL;
+					} else {
+						media |= gui_media_mask(tmp_values->string_);
+					}
+				}
+				tmp_values = tmp_values->next;
+			}
+			return media;
+		}
+		tmp_settings = tmp_settings->next;
+	}
+	return GUI_MEDIA_ALL;
+}
+
+static void gui_views_gc(void) {
+	int i = 0;
+
+	for(i=0;i<GUI_VIEWS;i++) {
+		if(gui_views[i].elements != NULL) {
+			FREE(gui_views[i].elements);
+		}
+		gui_views[i].nr = 0;
+	}
+	gui_devices_nr = 0;
+	if(gui_devices_media != NULL) {
+		FREE(gui_devices_media);
+	}
+}
+
+static void gui_views_build(void) {
+	struct gui_elements_t *tmp_gui = NULL;
+	unsigned int masks[GUI_VIEWS] = { GUI_MEDIA_ANY, GUI_MEDIA_WEB, GUI_MEDIA_MOBILE, GUI_MEDIA_DESKTOP, 0 };
+	int i = 0, nr = 0, order = 0;
+
+	gui_views_gc();
+
+	for(tmp_gui=gui_elements;tmp_gui!=NULL;tmp_gui=tmp_gui->next) {
+		tmp_gui->order = ++order;
+		tmp_gui->media = gui_element_media(tmp_gui);
+		if(tmp_gui->device != NULL && tmp_gui->device->nr >= nr) {
+			nr = tmp_gui->device->nr+1;
+		}
+	}
+
+	if(nr > 0) {
+		if((gui_devices_media = MALLOC(sizeof(unsigned int)*(size_t)nr)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		for(i=0;i<nr;i++) {
+			gui_devices_media[i] = GUI_MEDIA_ALL;
+		}
+	}
+
+	for(i=0;i<GUI_VIEWS;i++) {
+		if(order > 0 && (gui_views[i].elements = MALLOC(sizeof(struct gui_elements_t *)*(size_t)order)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+
+	for(tmp_gui=gui_elements;tmp_gui!=NULL;tmp_gui=tmp_gui->next) {
+		if(tmp_gui->device != NULL) {
+			gui_devices_media[tmp_gui->device->nr] = tmp_gui->media;
+		}
+		for(i=0;i<GUI_VIEWS;i++) {
+			if((tmp_gui->media & (masks[i] | GUI_MEDIA_ALL)) != 0) {
+				gui_views[i].elements[gui_views[i].nr++] = tmp_gui;
+			}
+		}
+	}
+	gui_devices_nr = nr;
+}
+
 int gui_gc(void) {
 	struct gui_elements_t *dtmp;
 	struct gui_settings_t *stmp;
 	struct gui_values_t *vtmp;
 
 	pthread_mutex_lock(&mutex_lock);
+	gui_views_gc();
 	/* Free devices structure */
 	while(gui_elements) {
 		dtmp = gui_elements;
@@ -117,11 +495,12 @@ int gui_gc(void) {
 
 struct JsonNode *config_gui_sync(int level, const char *media) {
 	/* Temporary pointer to the different structure */
+	struct gui_view_t *view = &gui_views[gui_view_index(gui_media_mask(media))];
 	struct gui_elements_t *tmp_gui = NULL;
 	struct gui_settings_t *tmp_settings = NULL;
 	struct gui_values_t *tmp_values = NULL;
 	struct options_t *tmp_options = NULL;
-	int i = 0, match = 0;
+	int i = 0;
 
 	/* Pointers to the newly created JSON object */
 	struct JsonNode *jroot = json_mkobject();
@@ -129,18 +508,15 @@ struct JsonNode *config_gui_sync(int level, const char *media) {
 	struct JsonNode *joptions = NULL;
 	struct JsonNode *jarray = NULL;
 
-	tmp_gui = gui_elements;
-
-	while(tmp_gui) {
-		i++;
+	for(i=0;i<view->nr;i++) {
+		tmp_gui = view->elements[i];
 		jelements = json_mkobject();
 		if(level == 0) {
 			json_append_member(jelements, "type", json_mknumber(tmp_gui->device->protocols->listener->devtype, 0));
-			json_append_member(jelements, "order", json_mknumber(i, 0));
+			json_append_member(jelements, "order", json_mknumber(tmp_gui->order, 0));
 		}
 
 		tmp_settings = tmp_gui->settings;
-		match = 0;
 		while(tmp_settings) {
 			tmp_values = tmp_settings->values;
 			if(strcmp(tmp_settings->name, "group") == 0 || strcmp(tmp_settings->name, "media") == 0) {
@@ -152,13 +528,6 @@ struct JsonNode *config_gui_sync(int level, const char *media) {
 					if(tmp_values->type == JSON_NUMBER) {
 						json_append_element(jarray, json_mknumber(tmp_values->number_, tmp_values->decimals));
 					} else if(tmp_values->type == JSON_STRING) {
-						if(strcmp(tmp_settings->name, "media") == 0) {
-							if(strcmp(tmp_values->string_, media) == 0 ||
-								 strcmp(tmp_values->string_, "all") == 0 ||
-							   strcmp(media, "all") == 0) {
-								match = 1;
-							}
-						}
 						json_append_element(jarray, json_mkstring(tmp_values->string_));
 					}
 					tmp_values = tmp_values->next;
@@ -190,7 +559,6 @@ struct JsonNode *config_gui_sync(int level, const char *media) {
 				json_append_element(jarray, json_mkstring("all"));
 				json_append_member(jelements, "media", jarray);
 			}
-			match = 1;
 		}
 
 		struct protocols_t *tmp_protocols = tmp_gui->device->protocols;
@@ -211,12 +579,7 @@ struct JsonNode *config_gui_sync(int level, const char *media) {
 			}
 			tmp_protocols = tmp_protocols->next;
 		}
-		if(match == 0) {
-			json_delete(jelements);
-		} else {
-			json_append_member(jroot, tmp_gui->id, jelements);
-		}
-		tmp_gui = tmp_gui->next;
+		json_append_member(jroot, tmp_gui->id, jelements);
 	}
 
 	return jroot;
@@ -588,6 +951,8 @@ int config_gui_parse(struct JsonNode *root) {
 			dnode->settings = NULL;
 			dnode->next = NULL;
 			dnode->device = NULL;
+			dnode->order = 0;
+			dnode->media = GUI_MEDIA_ALL;
 
 			if(devices_get(jelements->key, &dnode->device) != 0) {
 				logprintf(LOG_ERR, "config gui element #%d \"%s\", device not configured", i, jelements->key);
@@ -623,6 +988,8 @@ int config_gui_parse(struct JsonNode *root) {
 		jelements = jelements->next;
 	}
 clear:
+	gui_views_build();
+
 	return have_error;
 }
 
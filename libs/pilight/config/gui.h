@@ -39,16 +39,52 @@ struct gui_settings_t {
 	struct gui_settings_t *next;
 };
 
+/* The media a gui element is shown on */
+#define GUI_MEDIA_WEB			1
+#define GUI_MEDIA_MOBILE	2
+#define GUI_MEDIA_DESKTOP	4
+#define GUI_MEDIA_ALL			8
+/* The client mask of the "all" media, matching every element */
+#define GUI_MEDIA_ANY			15
+
 struct gui_elements_t {
 	char *id;
 	struct devices_t *device;
 	struct gui_settings_t *settings;
+	/* Position in the config and bitmask of GUI_MEDIA values */
+	int order;
+	unsigned int media;
 	struct gui_elements_t *next;
 };
 
+/* The device updates a client subscribed to, NULL for all */
+struct gui_filter_t {
+	char **devices;
+	int nrdevices;
+	char **groups;
+	int nrgroups;
+	/* Bitmask of devtype_t values, 0 for all */
+	unsigned long types;
+	/* The received codes a receiver subscribed to */
+	char **protocols;
+	int nrprotocols;
+	/* Bitmask of hwtype_t values, 0 for all */
+	unsigned long hardware;
+	int minpulse;
+	int maxpulse;
+};
+
 struct config_t *config_gui;
 
 struct gui_values_t *gui_media(char *name);
+struct gui_values_t *gui_group(char *name);
+unsigned int gui_media_mask(const char *media);
+int gui_media_device(int nr, unsigned int mask);
+int gui_filter_parse(struct JsonNode *jfilter, struct gui_filter_t **filter);
+int gui_filter_type(struct gui_filter_t *filter, int type);
+int gui_filter_device(struct gui_filter_t *filter, char *name);
+int gui_filter_code(struct gui_filter_t *filter, const char *protocol, int hwtype, int plslen);
+void gui_filter_free(struct gui_filter_t **filter);
 void gui_init(void);
 struct JsonNode *config_gui_sync(int level, const char *media);
 int config_gui_parse(struct JsonNode *root);
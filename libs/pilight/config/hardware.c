@@ -25,7 +25,6 @@
 #include <unistd.h>
 #ifndef _WIN32
 	#include <wiringx.h>
-	#include <regex.h>
 	#include <sys/ioctl.h>
 	#include <dlfcn.h>
 	#ifdef __mips__
@@ -67,6 +66,9 @@ void hardware_register(struct hardware_t **hw) {
 	(*hw)->maxrawlen = 0;
 	(*hw)->mingaplen = 0;
 	(*hw)->maxgaplen = 0;
+	(*hw)->multiple = 0;
+	(*hw)->module = NULL;
+	(*hw)->instance = NULL;
 
 	(*hw)->init = NULL;
 	(*hw)->deinit = NULL;
@@ -95,6 +97,40 @@ void hardware_set_id(hardware_t *hw, const char *id) {
 	strcpy(hw->id, id);
 }
 
+/*
+ * Another instance of a module that can run more than once.
+ * It gets the callbacks and a copy of the options of the
+ * module, the module keeps its state in the instance member.
+ */
+static struct hardware_t *hardware_instance(struct hardware_t *module, const char *id) {
+	struct hardware_t *hw = NULL;
+	struct options_t *options = module->options;
+
+	hardware_register(&hw);
+	hardware_set_id(hw, id);
+
+	while(options) {
+		options_add(&hw->options, options->id, options->name, options->argtype, options->conftype, options->vartype, options->def, options->mask);
+		options = options->next;
+	}
+
+	hw->module = module;
+	hw->hwtype = module->hwtype;
+	hw->comtype = module->comtype;
+	hw->minrawlen = module->minrawlen;
+	hw->maxrawlen = module->maxrawlen;
+	hw->mingaplen = module->mingaplen;
+	hw->maxgaplen = module->maxgaplen;
+	hw->init = module->init;
+	hw->deinit = module->deinit;
+	hw->receiveOOK = module->receiveOOK;
+	hw->sendOOK = module->sendOOK;
+	hw->gc = module->gc;
+	hw->settings = module->settings;
+
+	return hw;
+}
+
 int hardware_gc(void) {
 	struct hardware_t *htmp = hardware;
 	struct conf_hardware_t *ctmp = NULL;
@@ -109,10 +145,10 @@ int hardware_gc(void) {
 		}
 		thread_stop(htmp->id);
 		if(htmp->deinit != NULL) {
-			htmp->deinit();
+			htmp->deinit(htmp);
 		}
 		if(htmp->gc != NULL) {
-			htmp->gc();
+			htmp->gc(htmp);
 		}
 		FREE(htmp->id);
 		options_delete(htmp->options);
@@ -168,6 +204,7 @@ int config_hardware_parse(struct JsonNode *root) {
 	JsonNode *jvalues = NULL;
 	JsonNode *jchilds = json_first_child(root);
 
+	char name[255], *p = NULL;
 	int i = 0, have_error = 0, match = 0;
 
 	while(jchilds) {
@@ -189,6 +226,22 @@ int config_hardware_parse(struct JsonNode *root) {
 				}
 				tmp_hardware = tmp_hardware->next;
 			}
+			/* Instances like 433gpio#upstairs of modules that can run more than once */
+			if(match == 0 && (p = strchr(jchilds->key, '#')) != NULL && p[1] != '\0' &&
+			   (size_t)(p-jchilds->key) < sizeof(name)) {
+				memcpy(name, jchilds->key, (size_t)(p-jchilds->key));
+				name[p-jchilds->key] = '\0';
+				tmp_hardware = hardware;
+				while(tmp_hardware) {
+					if(tmp_hardware->module == NULL && tmp_hardware->multiple == 1 &&
+					   strcmp(tmp_hardware->id, name) == 0) {
+						hw = hardware_instance(tmp_hardware, jchilds->key);
+						match = 1;
+						break;
+					}
+					tmp_hardware = tmp_hardware->next;
+				}
+			}
 			if(match == 0) {
 				logprintf(LOG_ERR, "config hardware module #%d \"%s\" does not exist", i, jchilds->key);
 				have_error = 1;
@@ -204,8 +257,11 @@ int config_hardware_parse(struct JsonNode *root) {
 					have_error = 1;
 					goto clear;
 				}
-				/* And only allow one module covering the same frequency */
-				if(tmp_confhw->hardware->hwtype == hw->hwtype) {
+				/* And only allow one module covering the same frequency,
+				   but as many instances of that module as configured */
+				if(tmp_confhw->hardware->hwtype == hw->hwtype &&
+				   (tmp_confhw->hardware->module != NULL ? tmp_confhw->hardware->module : tmp_confhw->hardware) !=
+				   (hw->module != NULL ? hw->module : hw)) {
 					logprintf(LOG_ERR, "config hardware module #%d \"%s\", duplicate freq.", i, jchilds->key);
 					have_error = 1;
 					goto clear;
@@ -213,20 +269,25 @@ int config_hardware_parse(struct JsonNode *root) {
 				tmp_confhw = tmp_confhw->next;
 			}
 
-			/* Check if all options required by the hardware module are present */
+			/* Check if all options required by the hardware module are present,
+			   the optional ones can be left out */
 			hw_options = hw->options;
 			while(hw_options) {
 				match = 0;
 				jvalues = json_first_child(jchilds);
 				while(jvalues) {
 					if(jvalues->tag == JSON_NUMBER || jvalues->tag == JSON_STRING) {
-						if(strcmp(jvalues->key, hw_options->name) == 0 && hw_options->argtype == OPTION_HAS_VALUE) {
+						if(strcmp(jvalues->key, hw_options->name) == 0) {
 							match = 1;
 							break;
 						}
 					}
 					jvalues = jvalues->next;
 				}
+				if(match == 0 && hw_options->argtype == OPTION_OPT_VALUE) {
+					hw_options = hw_options->next;
+					continue;
+				}
 				if(match == 0) {
 					logprintf(LOG_ERR, "config hardware module #%d \"%s\", setting \"%s\" missing", i, jchilds->key, hw_options->name);
 					have_error = 1;
@@ -234,7 +295,6 @@ int config_hardware_parse(struct JsonNode *root) {
 				} else {
 					/* Check if setting contains a valid value */
 #if !defined(__FreeBSD__) && !defined(_WIN32)
-					regex_t regex;
 					int reti;
 					char *stmp = NULL;
 
@@ -252,19 +312,17 @@ int config_hardware_parse(struct JsonNode *root) {
 						strcpy(stmp, jvalues->string_);
 					}
 					if(hw_options->mask != NULL) {
-						reti = regcomp(&regex, hw_options->mask, REG_EXTENDED);
-						if(reti) {
+						reti = options_match(hw_options, stmp);
+						if(reti == -1) {
 							logprintf(LOG_ERR, "could not compile regex");
 							exit(EXIT_FAILURE);
 						}
-						reti = regexec(&regex, stmp, 0, NULL, 0);
-						if(reti == REG_NOMATCH || reti != 0) {
+						if(reti != 0) {
 							logprintf(LOG_ERR, "config hardware module #%d \"%s\", setting \"%s\" invalid", i, jchilds->key, hw_options->name);
 							have_error = 1;
-							regfree(&regex);
+							FREE(stmp);
 							goto clear;
 						}
-						regfree(&regex);
 					}
 					FREE(stmp);
 #endif
@@ -303,7 +361,7 @@ int config_hardware_parse(struct JsonNode *root) {
 				/* Sync all settings with the hardware module */
 				jvalues = json_first_child(jchilds);
 				while(jvalues) {
-					if(hw->settings(jvalues) == EXIT_FAILURE) {
+					if(hw->settings(hw, jvalues) == EXIT_FAILURE) {
 						logprintf(LOG_ERR, "config hardware module #%d \"%s\", setting \"%s\" invalid", i, jchilds->key, jvalues->key);
 						have_error = 1;
 						goto clear;
@@ -67,8 +67,15 @@ typedef struct hardware_t {
 	int mingaplen;
 	int maxgaplen;
 
-	unsigned short (*init)(void);
-	unsigned short (*deinit)(void);
+	/* The module can run more than once, as <id>#<name> */
+	unsigned short multiple;
+	/* The module an instance was created of */
+	struct hardware_t *module;
+	/* The state the module keeps for this instance */
+	void *instance;
+
+	unsigned short (*init)(struct hardware_t *hw);
+	unsigned short (*deinit)(struct hardware_t *hw);
 	union {
 		int (*receiveOOK)(void);
 		void *(*receiveAPI)(void *param);
@@ -78,8 +85,8 @@ typedef struct hardware_t {
 		int (*sendOOK)(int *code, int rawlen, int repeats);
 		int (*sendAPI)(struct JsonNode *code);
 	};
-	int (*gc)(void);
-	unsigned short (*settings)(JsonNode *json);
+	int (*gc)(struct hardware_t *hw);
+	unsigned short (*settings)(struct hardware_t *hw, JsonNode *json);
 	struct hardware_t *next;
 } hardware_t;
 
@@ -0,0 +1,357 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * The recent history of the numeric values of the devices.
+ * Every device setting gets its own fixed rings, one for the
+ * raw readings and one for each downsampled tier. A point of a
+ * downsampled tier keeps the minimum, maximum and average of
+ * the readings within its minute or hour, so a graph of a long
+ * period is served from a few hundred points. The rings are
+ * only allocated for the settings that are actually updated,
+ * and the oldest points are overwritten once a ring is full.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../core/pilight.h"
+#include "../core/common.h"
+#include "../core/mem.h"
+#include "../core/log.h"
+#include "../core/json.h"
+
+#include "history.h"
+
+#define HISTORY_HASH		64
+
+typedef struct history_point_t {
+	unsigned long timestamp;
+	double min;
+	double max;
+	double sum;
+	unsigned int count;
+} history_point_t;
+
+typedef struct history_ring_t {
+	struct history_point_t *points;
+	/* The next point to write */
+	int head;
+	int count;
+} history_ring_t;
+
+typedef struct history_t {
+	char *device;
+	char *setting;
+	int decimals;
+	struct history_ring_t tiers[HISTORY_TIERS];
+	struct history_t *next;
+} history_t;
+
+static char *history_names[HISTORY_TIERS] = { "raw", "minute", "hour" };
+static int history_resolution[HISTORY_TIERS] = { 0, 60, 3600 };
+
+static struct history_t *history[HISTORY_HASH];
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+static int history_size = 0;
+
+static unsigned int history_hash(const char *device, const char *setting) {
+	return (strhash(device)*31+strhash(setting)) & (HISTORY_HASH-1);
+}
+
+/* Call with the lock held */
+static struct history_t *history_find(const char *device, const char *setting) {
+	struct history_t *node = history[history_hash(device, setting)];
+
+	while(node != NULL) {
+		if(strcmp(node->device, device) == 0 && strcmp(node->setting, setting) == 0) {
+			return node;
+		}
+		node = node->next;
+	}
+	return NULL;
+}
+
+void history_init(int size) {
+	pthread_mutex_lock(&history_lock);
+	history_size = size;
+	pthread_mutex_unlock(&history_lock);
+}
+
+int history_enabled(void) {
+	return (history_size > 0);
+}
+
+int history_tier(const char *name) {
+	int i = 0;
+
+	if(name == NULL) {
+		return HISTORY_RAW;
+	}
+	for(i=0;i<HISTORY_TIERS;i++) {
+		if(strcmp(history_names[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void history_ring_add(struct history_ring_t *ring, int resolution, double value, unsigned long timestamp) {
+	struct history_point_t *point = NULL;
+	unsigned long start = timestamp;
+
+	if(resolution > 0) {
+		start -= timestamp % (unsigned long)resolution;
+		if(ring->count > 0) {
+			point = &ring->points[(ring->head+history_size-1) % history_size];
+			if(point->timestamp == start) {
+				if(value < point->min) {
+					point->min = value;
+				}
+				if(value > point->max) {
+					point->max = value;
+				}
+				point->sum += value;
+				point->count++;
+				return;
+			}
+		}
+	}
+
+	point = &ring->points[ring->head];
+	ring->head = (ring->head+1) % history_size;
+	if(ring->count < history_size) {
+		ring->count++;
+	}
+	point->timestamp = start;
+	point->min = value;
+	point->max = value;
+	point->sum = value;
+	point->count = 1;
+}
+
+/*
+ * Called by devices_update with every numeric reading, also
+ * those that are held back from the clients.
+ */
+void history_add(const char *device, const char *setting, double value, int decimals, unsigned long timestamp) {
+	struct history_t *node = NULL;
+	unsigned int hash = 0;
+	int i = 0;
+
+	if(history_size <= 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&history_lock);
+	if((node = history_find(device, setting)) == NULL) {
+		if((node = MALLOC(sizeof(struct history_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(node, 0, sizeof(struct history_t));
+		if((node->device = STRDUP((char *)device)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		if((node->setting = STRDUP((char *)setting)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		for(i=0;i<HISTORY_TIERS;i++) {
+			if((node->tiers[i].points = MALLOC(sizeof(struct history_point_t)*(size_t)history_size)) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+		}
+		hash = history_hash(device, setting);
+		node->next = history[hash];
+		history[hash] = node;
+	}
+	node->decimals = decimals;
+	for(i=0;i<HISTORY_TIERS;i++) {
+		history_ring_add(&node->tiers[i], history_resolution[i], value, timestamp);
+	}
+	pthread_mutex_unlock(&history_lock);
+}
+
+/*
+ * Walks the points of a ring within a period, oldest first.
+ * Returns the number of points handed to func, or -1 when the
+ * setting has no history.
+ */
+static int history_walk(const char *device, const char *setting, int tier, unsigned long from, unsigned long to, void (*func)(struct history_point_t *, int, void *), void *userdata) {
+	struct history_t *node = NULL;
+	struct history_ring_t *ring = NULL;
+	struct history_point_t *point = NULL;
+	int i = 0, n = 0;
+
+	if(tier < 0 || tier >= HISTORY_TIERS) {
+		return -1;
+	}
+
+	pthread_mutex_lock(&history_lock);
+	if(history_size <= 0 || (node = history_find(device, setting)) == NULL) {
+		pthread_mutex_unlock(&history_lock);
+		return -1;
+	}
+	ring = &node->tiers[tier];
+	for(i=0;i<ring->count;i++) {
+		point = &ring->points[(ring->head-ring->count+i+history_size) % history_size];
+		if(point->timestamp < from || (to > 0 && point->timestamp > to)) {
+			continue;
+		}
+		func(point, node->decimals, userdata);
+		n++;
+	}
+	pthread_mutex_unlock(&history_lock);
+
+	return n;
+}
+
+static void history_json_cb(struct history_point_t *point, int decimals, void *userdata) {
+	struct JsonNode *jvalues = userdata;
+	struct JsonNode *jpoint = json_mkarray();
+
+	json_append_element(jpoint, json_mknumber((double)point->timestamp, 0));
+	json_append_element(jpoint, json_mknumber(point->sum/point->count, decimals));
+	json_append_element(jpoint, json_mknumber(point->min, decimals));
+	json_append_element(jpoint, json_mknumber(point->max, decimals));
+	json_append_element(jvalues, jpoint);
+}
+
+static int history_json(struct JsonNode *jroot, const char *device, const char *setting, int tier, unsigned long from, unsigned long to) {
+	struct JsonNode *jvalues = json_mkarray();
+
+	if(history_walk(device, setting, tier, from, to, history_json_cb, jvalues) == -1) {
+		json_delete(jvalues);
+		return -1;
+	}
+
+	json_append_member(jroot, "device", json_mkstring((char *)device));
+	json_append_member(jroot, "setting", json_mkstring((char *)setting));
+	json_append_member(jroot, "tier", json_mkstring(history_names[tier]));
+	json_append_member(jroot, "resolution", json_mknumber(history_resolution[tier], 0));
+	json_append_member(jroot, "values", jvalues);
+
+	return 0;
+}
+
+/*
+ * Every point is an array of its timestamp, the average, the
+ * minimum and the maximum. Raw points are single readings.
+ */
+struct JsonNode *history_get(const char *device, const char *setting, int tier, unsigned long from, unsigned long to) {
+	struct JsonNode *jroot = json_mkobject();
+
+	if(history_json(jroot, device, setting, tier, from, to) == -1) {
+		json_delete(jroot);
+		return NULL;
+	}
+	return jroot;
+}
+
+typedef struct history_csv_t {
+	char *buf;
+	size_t len;
+	size_t size;
+} history_csv_t;
+
+static void history_csv_cb(struct history_point_t *point, int decimals, void *userdata) {
+	struct history_csv_t *csv = userdata;
+	int n = 0;
+
+	while(1) {
+		n = snprintf(&csv->buf[csv->len], csv->size-csv->len, "%lu,%.*f,%.*f,%.*f\n",
+			point->timestamp, decimals, point->sum/point->count, decimals, point->min, decimals, point->max);
+		if(n >= 0 && (size_t)n < csv->size-csv->len) {
+			break;
+		}
+		csv->size *= 2;
+		if((csv->buf = REALLOC(csv->buf, csv->size)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+	csv->len += (size_t)n;
+}
+
+/*
+ * The same points as history_get, one line each. The caller
+ * frees the buffer.
+ */
+char *history_csv(const char *device, const char *setting, int tier, unsigned long from, unsigned long to, size_t *len) {
+	struct history_csv_t csv;
+	char *header = "timestamp,average,minimum,maximum\n";
+
+	csv.size = 1024;
+	if((csv.buf = MALLOC(csv.size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	strcpy(csv.buf, header);
+	csv.len = strlen(header);
+
+	if(history_walk(device, setting, tier, from, to, history_csv_cb, &csv) == -1) {
+		FREE(csv.buf);
+		return NULL;
+	}
+	*len = csv.len;
+	return csv.buf;
+}
+
+/*
+ * Answers a "request history" of a socket client:
+ *
+ * {"action":"request history","device":"...","setting":"...","tier":"minute","from":...,"to":...}
+ */
+struct JsonNode *history_request(struct JsonNode *json) {
+	struct JsonNode *jsend = NULL;
+	char *device = NULL, *setting = NULL, *name = NULL;
+	double from = 0, to = 0;
+	int tier = HISTORY_RAW;
+
+	if(json_find_string(json, "device", &device) != 0 ||
+	   json_find_string(json, "setting", &setting) != 0) {
+		return NULL;
+	}
+	if(json_find_string(json, "tier", &name) == 0 && (tier = history_tier(name)) == -1) {
+		return NULL;
+	}
+	json_find_number(json, "from", &from);
+	json_find_number(json, "to", &to);
+
+	jsend = json_mkobject();
+	json_append_member(jsend, "message", json_mkstring("history"));
+	if(history_json(jsend, device, setting, tier, (unsigned long)from, (unsigned long)to) == -1) {
+		json_delete(jsend);
+		return NULL;
+	}
+
+	return jsend;
+}
+
+int history_gc(void) {
+	struct history_t *node = NULL;
+	int i = 0, x = 0;
+
+	pthread_mutex_lock(&history_lock);
+	for(i=0;i<HISTORY_HASH;i++) {
+		while(history[i] != NULL) {
+			node = history[i];
+			history[i] = node->next;
+			for(x=0;x<HISTORY_TIERS;x++) {
+				FREE(node->tiers[x].points);
+			}
+			FREE(node->device);
+			FREE(node->setting);
+			FREE(node);
+		}
+	}
+	history_size = 0;
+	pthread_mutex_unlock(&history_lock);
+
+	logprintf(LOG_DEBUG, "garbage collected history library");
+	return 0;
+}
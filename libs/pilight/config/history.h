@@ -0,0 +1,28 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _HISTORY_H_
+#define _HISTORY_H_
+
+#include "../core/json.h"
+
+#define HISTORY_RAW			0
+#define HISTORY_MINUTE	1
+#define HISTORY_HOUR		2
+#define HISTORY_TIERS		3
+
+void history_init(int size);
+int history_enabled(void);
+void history_add(const char *device, const char *setting, double value, int decimals, unsigned long timestamp);
+int history_tier(const char *name);
+struct JsonNode *history_get(const char *device, const char *setting, int tier, unsigned long from, unsigned long to);
+char *history_csv(const char *device, const char *setting, int tier, unsigned long from, unsigned long to, size_t *len);
+struct JsonNode *history_request(struct JsonNode *json);
+int history_gc(void);
+
+#endif
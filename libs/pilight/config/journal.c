@@ -0,0 +1,647 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * The journal keeps the device values that changed since the
+ * config was last written. Every change is appended as a small
+ * binary record:
+ *
+ * | type | decimals | devlen | setlen | vallen (2) | timestamp (4) | checksum (4) |
+ * | device | setting | value |
+ *
+ * Numbers are stored as their IEEE 754 bits, all integers are
+ * little endian. A record with a wrong checksum is the torn
+ * tail of an interrupted write, and ends the journal. At startup
+ * the records are replayed into the config before it is parsed.
+ * Writing the config folds the journal into it, after that the
+ * journal is cleared. Journals growing too large in between are
+ * compacted to the latest value of each device setting.
+ *
+ * Everything changed since the journal was last cleared is
+ * in it, so it also tells another master that lost contact
+ * for a while what it missed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef _WIN32
+	#include <unistd.h>
+#else
+	#include <io.h>
+#endif
+
+#include "../core/pilight.h"
+#include "../core/common.h"
+#include "../core/log.h"
+#include "../core/json.h"
+
+#include "journal.h"
+
+#ifndef O_BINARY
+	#define O_BINARY 0
+#endif
+
+#define JOURNAL_MAGIC					"PLJ1"
+#define JOURNAL_MAGIC_SIZE		4
+#define JOURNAL_HEADER_SIZE		14
+#define JOURNAL_COMPACT_SIZE	65536
+
+typedef struct journal_record_t {
+	char device[256];
+	char setting[256];
+	int type;
+	int decimals;
+	double number_;
+	char *string_;
+	size_t len;
+	unsigned long timestamp;
+
+	struct journal_record_t *next;
+} journal_record_t;
+
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *journal_file = NULL;
+static int journal_fd = -1;
+static off_t journal_size = 0;
+/* Changes made since are all in the journal */
+static unsigned long journal_base = 0;
+
+static uint32_t journal_checksum(const unsigned char *buf, size_t len, uint32_t hash) {
+	size_t i = 0;
+
+	/* FNV-1a */
+	for(i=0;i<len;i++) {
+		hash ^= buf[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static void journal_put32(unsigned char *buf, uint32_t val) {
+	buf[0] = (unsigned char)(val & 0xFF);
+	buf[1] = (unsigned char)((val >> 8) & 0xFF);
+	buf[2] = (unsigned char)((val >> 16) & 0xFF);
+	buf[3] = (unsigned char)((val >> 24) & 0xFF);
+}
+
+static uint32_t journal_get32(const unsigned char *buf) {
+	return (uint32_t)buf[0] | ((uint32_t)buf[1] << 8) | ((uint32_t)buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+/*
+ * Returns the size of the encoded record, or 0 if it does
+ * not fit a record. The buffer is large enough when it holds
+ * JOURNAL_HEADER_SIZE plus the three lengths.
+ */
+static size_t journal_encode(unsigned char *buf, const char *device, const char *setting, int type, int decimals, double number_, const char *string_, unsigned long timestamp) {
+	size_t devlen = strlen(device), setlen = strlen(setting), vallen = 8, pos = JOURNAL_HEADER_SIZE;
+	uint64_t bits = 0;
+	int i = 0;
+
+	if(type == JSON_STRING) {
+		vallen = strlen(string_);
+	}
+	if(devlen > 255 || setlen > 255 || vallen > 65535) {
+		return 0;
+	}
+
+	buf[0] = (unsigned char)type;
+	buf[1] = (unsigned char)decimals;
+	buf[2] = (unsigned char)devlen;
+	buf[3] = (unsigned char)setlen;
+	buf[4] = (unsigned char)(vallen & 0xFF);
+	buf[5] = (unsigned char)((vallen >> 8) & 0xFF);
+	journal_put32(&buf[6], (uint32_t)timestamp);
+
+	memcpy(&buf[pos], device, devlen);
+	pos += devlen;
+	memcpy(&buf[pos], setting, setlen);
+	pos += setlen;
+	if(type == JSON_STRING) {
+		memcpy(&buf[pos], string_, vallen);
+	} else {
+		memcpy(&bits, &number_, sizeof(bits));
+		for(i=0;i<8;i++) {
+			buf[pos+i] = (unsigned char)((bits >> (i*8)) & 0xFF);
+		}
+	}
+	pos += vallen;
+
+	journal_put32(&buf[10], journal_checksum(&buf[JOURNAL_HEADER_SIZE], pos-JOURNAL_HEADER_SIZE,
+		journal_checksum(buf, 10, 2166136261U)));
+	return pos;
+}
+
+/*
+ * Returns the size of the decoded record, or 0 when the
+ * record is incomplete or corrupt. String values point into
+ * the buffer and are not terminated.
+ */
+static size_t journal_decode(const unsigned char *buf, size_t len, struct journal_record_t *rec) {
+	size_t devlen = 0, setlen = 0, vallen = 0, total = 0;
+	uint64_t bits = 0;
+	int i = 0;
+
+	if(len < JOURNAL_HEADER_SIZE) {
+		return 0;
+	}
+	devlen = buf[2];
+	setlen = buf[3];
+	vallen = (size_t)buf[4] | ((size_t)buf[5] << 8);
+	total = JOURNAL_HEADER_SIZE+devlen+setlen+vallen;
+	if(len < total || devlen == 0 || setlen == 0) {
+		return 0;
+	}
+	if(journal_get32(&buf[10]) != journal_checksum(&buf[JOURNAL_HEADER_SIZE], total-JOURNAL_HEADER_SIZE,
+		journal_checksum(buf, 10, 2166136261U))) {
+		return 0;
+	}
+
+	rec->type = buf[0];
+	rec->decimals = buf[1];
+	rec->timestamp = journal_get32(&buf[6]);
+	memcpy(rec->device, &buf[JOURNAL_HEADER_SIZE], devlen);
+	rec->device[devlen] = '\0';
+	memcpy(rec->setting, &buf[JOURNAL_HEADER_SIZE+devlen], setlen);
+	rec->setting[setlen] = '\0';
+	if(rec->type == JSON_STRING) {
+		rec->string_ = (char *)&buf[JOURNAL_HEADER_SIZE+devlen+setlen];
+		rec->len = vallen;
+	} else if(rec->type == JSON_NUMBER && vallen == 8) {
+		for(i=0;i<8;i++) {
+			bits |= (uint64_t)buf[JOURNAL_HEADER_SIZE+devlen+setlen+i] << (i*8);
+		}
+		memcpy(&rec->number_, &bits, sizeof(bits));
+	} else {
+		return 0;
+	}
+	return total;
+}
+
+static int journal_read(const char *file, unsigned char **out, size_t *len) {
+	struct stat st;
+	ssize_t n = 0;
+	size_t pos = 0;
+	int fd = -1;
+
+	*out = NULL;
+	*len = 0;
+	if((fd = open(file, O_RDONLY | O_BINARY)) == -1) {
+		return -1;
+	}
+	if(fstat(fd, &st) != 0) {
+		close(fd);
+		return -1;
+	}
+	if((*out = MALLOC((size_t)st.st_size+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	while(pos < (size_t)st.st_size) {
+		if((n = read(fd, &(*out)[pos], (size_t)st.st_size-pos)) <= 0) {
+			if(n == -1 && errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		pos += (size_t)n;
+	}
+	close(fd);
+	*len = pos;
+	return 0;
+}
+
+static int journal_sync(int fd) {
+#ifdef _WIN32
+	return _commit(fd);
+#elif defined(__linux__)
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+static int journal_write(int fd, const unsigned char *buf, size_t len) {
+	ssize_t n = 0;
+	size_t pos = 0;
+
+	while(pos < len) {
+		if((n = write(fd, &buf[pos], len-pos)) <= 0) {
+			if(n == -1 && errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		pos += (size_t)n;
+	}
+	return 0;
+}
+
+static void journal_apply(struct JsonNode *root, struct journal_record_t *rec) {
+	struct JsonNode *jdevices = NULL, *jdevice = NULL, *jsetting = NULL;
+	char *value = NULL;
+
+	if((jdevices = json_find_member(root, "devices")) == NULL ||
+	   (jdevice = json_find_member(jdevices, rec->device)) == NULL ||
+	   (jsetting = json_find_member(jdevice, rec->setting)) == NULL) {
+		return;
+	}
+	/* Only values already in the config are restored, as they were */
+	if(jsetting->tag != (JsonTag)rec->type) {
+		return;
+	}
+
+	json_remove_from_parent(jsetting);
+	json_delete(jsetting);
+	if(rec->type == JSON_NUMBER) {
+		json_append_member(jdevice, rec->setting, json_mknumber(rec->number_, rec->decimals));
+	} else {
+		if((value = MALLOC(rec->len+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(value, rec->string_, rec->len);
+		value[rec->len] = '\0';
+		json_append_member(jdevice, rec->setting, json_mkstring(value));
+		FREE(value);
+	}
+}
+
+/*
+ * Open the journal next to the config file when the config
+ * enabled it, and replay its records into the config root.
+ * Returns the number of replayed records.
+ */
+int journal_open(char *file, struct JsonNode *root) {
+	struct JsonNode *jsettings = NULL;
+	struct journal_record_t rec;
+	unsigned char *content = NULL;
+	size_t len = 0, pos = 0, n = 0;
+	double enable = 0;
+	int nr = 0;
+
+	if((jsettings = json_find_member(root, "settings")) == NULL ||
+	   json_find_number(jsettings, "config-journal", &enable) != 0 || (int)enable != 1) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	if(journal_fd != -1) {
+		pthread_mutex_unlock(&journal_lock);
+		return 0;
+	}
+	if((journal_file = REALLOC(journal_file, strlen(file)+9)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	sprintf(journal_file, "%s.journal", file);
+
+	journal_base = (unsigned long)time(NULL);
+	if(journal_read(journal_file, &content, &len) == 0 &&
+	   len >= JOURNAL_MAGIC_SIZE && memcmp(content, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) == 0) {
+		pos = JOURNAL_MAGIC_SIZE;
+		while((n = journal_decode(&content[pos], len-pos, &rec)) > 0) {
+			journal_apply(root, &rec);
+			if(rec.timestamp < journal_base) {
+				journal_base = rec.timestamp;
+			}
+			pos += n;
+			nr++;
+		}
+		if(pos < len) {
+			logprintf(LOG_NOTICE, "ignoring %zu bytes of an interrupted journal write", len-pos);
+		}
+	}
+	if(content != NULL) {
+		FREE(content);
+	}
+
+	if((journal_fd = open(journal_file, O_WRONLY | O_CREAT | O_BINARY, 0644)) == -1) {
+		logprintf(LOG_ERR, "cannot open config journal %s: %s", journal_file, strerror(errno));
+		pthread_mutex_unlock(&journal_lock);
+		return nr;
+	}
+	if(pos == 0) {
+		if(ftruncate(journal_fd, 0) != 0 || journal_write(journal_fd, (unsigned char *)JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0) {
+			logprintf(LOG_ERR, "cannot write config journal %s", journal_file);
+		}
+		pos = JOURNAL_MAGIC_SIZE;
+	} else if(ftruncate(journal_fd, (off_t)pos) != 0) {
+		logprintf(LOG_ERR, "cannot truncate config journal %s", journal_file);
+	}
+	lseek(journal_fd, (off_t)pos, SEEK_SET);
+	journal_size = (off_t)pos;
+
+	if(nr > 0) {
+		logprintf(LOG_INFO, "restored %d device values from the config journal", nr);
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return nr;
+}
+
+static int journal_compact_locked(void) {
+	struct journal_record_t rec, *records = NULL, *tmp = NULL, *last = NULL;
+	unsigned char *content = NULL, *buf = NULL;
+	size_t len = 0, pos = JOURNAL_MAGIC_SIZE, n = 0;
+	char tmpfile[strlen(journal_file)+5];
+	int fd = -1, error = 0;
+
+	if(journal_read(journal_file, &content, &len) != 0) {
+		return -1;
+	}
+
+	/* Keep the latest record of each device setting, in order of their first change */
+	while(len > pos && (n = journal_decode(&content[pos], len-pos, &rec)) > 0) {
+		tmp = records;
+		last = NULL;
+		while(tmp) {
+			if(strcmp(tmp->device, rec.device) == 0 && strcmp(tmp->setting, rec.setting) == 0) {
+				break;
+			}
+			last = tmp;
+			tmp = tmp->next;
+		}
+		if(tmp == NULL) {
+			if((tmp = MALLOC(sizeof(struct journal_record_t))) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			rec.next = NULL;
+			if(last == NULL) {
+				records = tmp;
+			} else {
+				last->next = tmp;
+			}
+		} else {
+			rec.next = tmp->next;
+		}
+		memcpy(tmp, &rec, sizeof(struct journal_record_t));
+		pos += n;
+	}
+
+	/* The compacted journal is never larger than the current one */
+	if((buf = MALLOC(len+JOURNAL_MAGIC_SIZE)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(buf, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE);
+	pos = JOURNAL_MAGIC_SIZE;
+	while(records) {
+		tmp = records;
+		if(tmp->type == JSON_STRING) {
+			char value[tmp->len+1];
+			memcpy(value, tmp->string_, tmp->len);
+			value[tmp->len] = '\0';
+			pos += journal_encode(&buf[pos], tmp->device, tmp->setting, tmp->type, tmp->decimals, 0, value, tmp->timestamp);
+		} else {
+			pos += journal_encode(&buf[pos], tmp->device, tmp->setting, tmp->type, tmp->decimals, tmp->number_, NULL, tmp->timestamp);
+		}
+		records = records->next;
+		FREE(tmp);
+	}
+	FREE(content);
+
+	sprintf(tmpfile, "%s.tmp", journal_file);
+	if((fd = open(tmpfile, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644)) == -1) {
+		FREE(buf);
+		return -1;
+	}
+	if(journal_write(fd, buf, pos) != 0 || journal_sync(fd) != 0) {
+		error = 1;
+	}
+	close(fd);
+	FREE(buf);
+
+#ifdef _WIN32
+	/* Windows can not rename over an open or existing file */
+	close(journal_fd);
+	journal_fd = -1;
+	if(error == 0) {
+		remove(journal_file);
+	}
+#endif
+	if(error == 1 || rename(tmpfile, journal_file) != 0) {
+		remove(tmpfile);
+		error = 1;
+	}
+
+	if(journal_fd != -1) {
+		close(journal_fd);
+	}
+	if((journal_fd = open(journal_file, O_WRONLY | O_CREAT | O_BINARY, 0644)) == -1) {
+		logprintf(LOG_ERR, "cannot open config journal %s: %s", journal_file, strerror(errno));
+		return -1;
+	}
+	journal_size = lseek(journal_fd, 0, SEEK_END);
+	return (error == 1) ? -1 : 0;
+}
+
+int journal_compact(void) {
+	int r = 0;
+
+	pthread_mutex_lock(&journal_lock);
+	if(journal_fd != -1) {
+		r = journal_compact_locked();
+	}
+	pthread_mutex_unlock(&journal_lock);
+	return r;
+}
+
+/*
+ * Append the values of a config update for each of its
+ * devices in a single write.
+ */
+int journal_append(struct JsonNode *jupdate) {
+	struct JsonNode *jdevices = NULL, *jvalues = NULL, *jdevice = NULL, *jvalue = NULL;
+	unsigned char *buf = NULL;
+	size_t size = 0, pos = 0;
+	double timestamp = 0;
+	int r = 0;
+
+	if(journal_fd == -1) {
+		return 0;
+	}
+	if((jdevices = json_find_member(jupdate, "devices")) == NULL || jdevices->tag != JSON_ARRAY ||
+	   (jvalues = json_find_member(jupdate, "values")) == NULL || jvalues->tag != JSON_OBJECT) {
+		return -1;
+	}
+	if(json_find_number(jvalues, "timestamp", &timestamp) != 0) {
+		timestamp = (double)time(NULL);
+	}
+
+	jdevice = json_first_child(jdevices);
+	while(jdevice) {
+		if(jdevice->tag == JSON_STRING) {
+			jvalue = json_first_child(jvalues);
+			while(jvalue) {
+				if(strcmp(jvalue->key, "timestamp") != 0 && (jvalue->tag == JSON_NUMBER || jvalue->tag == JSON_STRING)) {
+					size += JOURNAL_HEADER_SIZE+strlen(jdevice->string_)+strlen(jvalue->key)+
+						((jvalue->tag == JSON_STRING) ? strlen(jvalue->string_) : 8);
+				}
+				jvalue = jvalue->next;
+			}
+		}
+		jdevice = jdevice->next;
+	}
+	if(size == 0) {
+		return 0;
+	}
+	if((buf = MALLOC(size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+
+	jdevice = json_first_child(jdevices);
+	while(jdevice) {
+		if(jdevice->tag == JSON_STRING) {
+			jvalue = json_first_child(jvalues);
+			while(jvalue) {
+				if(strcmp(jvalue->key, "timestamp") == 0) {
+				} else if(jvalue->tag == JSON_NUMBER) {
+					pos += journal_encode(&buf[pos], jdevice->string_, jvalue->key, JSON_NUMBER, jvalue->decimals_, jvalue->number_, NULL, (unsigned long)timestamp);
+				} else if(jvalue->tag == JSON_STRING) {
+					pos += journal_encode(&buf[pos], jdevice->string_, jvalue->key, JSON_STRING, 0, 0, jvalue->string_, (unsigned long)timestamp);
+				}
+				jvalue = jvalue->next;
+			}
+		}
+		jdevice = jdevice->next;
+	}
+
+	pthread_mutex_lock(&journal_lock);
+	if(journal_fd != -1 && pos > 0) {
+		if(journal_write(journal_fd, buf, pos) != 0 || journal_sync(journal_fd) != 0) {
+			logprintf(LOG_ERR, "cannot write config journal %s", journal_file);
+			r = -1;
+		} else {
+			journal_size += (off_t)pos;
+			if(journal_size > JOURNAL_COMPACT_SIZE) {
+				journal_compact_locked();
+			}
+		}
+	}
+	pthread_mutex_unlock(&journal_lock);
+
+	FREE(buf);
+	return r;
+}
+
+/* A later record of the same setting replaces the value */
+static void journal_value(struct JsonNode *jvalues, struct journal_record_t *rec) {
+	struct JsonNode *jvalue = NULL;
+	char *value = NULL;
+
+	if((jvalue = json_find_member(jvalues, rec->setting)) != NULL) {
+		json_remove_from_parent(jvalue);
+		json_delete(jvalue);
+	}
+	if(rec->type == JSON_NUMBER) {
+		json_append_member(jvalues, rec->setting, json_mknumber(rec->number_, rec->decimals));
+	} else {
+		if((value = MALLOC(rec->len+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(value, rec->string_, rec->len);
+		value[rec->len] = '\0';
+		json_append_member(jvalues, rec->setting, json_mkstring(value));
+		FREE(value);
+	}
+}
+
+/*
+ * Hand the changes made at or after since to the callback,
+ * as updates of a single device each. The values a device
+ * got at the same time are given in one update. Returns the
+ * number of updates, or -1 when the journal doesn't go back
+ * that far and the changes are unknown.
+ */
+int journal_since(unsigned long since, void (*callback)(struct JsonNode *jupdate, unsigned long timestamp, void *userdata), void *userdata) {
+	struct JsonNode *jupdate = NULL, *jvalues = NULL;
+	struct journal_record_t rec, last;
+	unsigned char *content = NULL;
+	size_t len = 0, pos = JOURNAL_MAGIC_SIZE, n = 0;
+	int nr = 0;
+
+	pthread_mutex_lock(&journal_lock);
+	if(journal_fd == -1 || since < journal_base ||
+	   journal_read(journal_file, &content, &len) != 0) {
+		pthread_mutex_unlock(&journal_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&journal_lock);
+
+	memset(&last, 0, sizeof(struct journal_record_t));
+	while(len > pos && (n = journal_decode(&content[pos], len-pos, &rec)) > 0) {
+		pos += n;
+		if(rec.timestamp < since) {
+			continue;
+		}
+		if(jupdate != NULL && (rec.timestamp != last.timestamp || strcmp(rec.device, last.device) != 0)) {
+			callback(jupdate, last.timestamp, userdata);
+			json_delete(jupdate);
+			jupdate = NULL;
+		}
+		if(jupdate == NULL) {
+			jupdate = json_mkobject();
+			jvalues = json_mkobject();
+			json_append_member(jupdate, "devices", json_mkarray());
+			json_append_element(json_find_member(jupdate, "devices"), json_mkstring(rec.device));
+			json_append_member(jupdate, "values", jvalues);
+			nr++;
+		}
+		journal_value(jvalues, &rec);
+		memcpy(&last, &rec, sizeof(struct journal_record_t));
+	}
+	if(jupdate != NULL) {
+		callback(jupdate, last.timestamp, userdata);
+		json_delete(jupdate);
+	}
+	if(content != NULL) {
+		FREE(content);
+	}
+	return nr;
+}
+
+/*
+ * Changes are held back while the config is written. Once it
+ * was written successfully, the journal is part of it.
+ */
+void journal_checkpoint_begin(void) {
+	pthread_mutex_lock(&journal_lock);
+}
+
+void journal_checkpoint_end(int success) {
+	if(success == 1 && journal_fd != -1) {
+		if(ftruncate(journal_fd, JOURNAL_MAGIC_SIZE) == 0) {
+			lseek(journal_fd, JOURNAL_MAGIC_SIZE, SEEK_SET);
+			journal_size = JOURNAL_MAGIC_SIZE;
+			journal_base = (unsigned long)time(NULL);
+			journal_sync(journal_fd);
+		}
+	}
+	pthread_mutex_unlock(&journal_lock);
+}
+
+int journal_gc(void) {
+	pthread_mutex_lock(&journal_lock);
+	if(journal_fd != -1) {
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	if(journal_file != NULL) {
+		FREE(journal_file);
+	}
+	journal_size = 0;
+	pthread_mutex_unlock(&journal_lock);
+
+	logprintf(LOG_DEBUG, "garbage collected config journal library");
+	return 0;
+}
@@ -0,0 +1,22 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _JOURNAL_H_
+#define _JOURNAL_H_
+
+#include "../core/json.h"
+
+int journal_open(char *file, struct JsonNode *root);
+int journal_append(struct JsonNode *jupdate);
+int journal_compact(void);
+int journal_since(unsigned long since, void (*callback)(struct JsonNode *jupdate, unsigned long timestamp, void *userdata), void *userdata);
+void journal_checkpoint_begin(void);
+void journal_checkpoint_end(int success);
+int journal_gc(void);
+
+#endif
@@ -43,7 +43,7 @@ function M.read(f)
 	local keys = {
 		'port', 'loopback',
 
-		'name', 'adhoc-master', 'adhoc-mode', 'standalone',
+		'name', 'adhoc-master', 'adhoc-mode', 'adhoc-compact', 'adhoc-raw', 'standalone', 'replication-peer',
 
 		'storage-root', 'protocol-root', 'hardware-root',
 		'actions-root', 'functions-root', 'operators-root',
@@ -51,18 +51,20 @@ function M.read(f)
 		'smtp-port', 'smtp-user', 'smtp-password', 'smtp-host',
 		'smtp-sender', 'smtp-ssl',
 
-		'gpio-platform',
+		'gpio-platform', 'gpio-backend',
 
 		'firmware-gpio-sck', 'firmware-gpio-mosi', 'firmware-gpio-miso',
 		'firmware-gpio-reset',
 
 		'webserver-authentication', 'webserver-http-port', 'webserver-https-port',
-		'webserver-enable', 'webserver-cache', 'watchdog-enable', 'webgui-websockets',
-		'webserver-root',
+		'webserver-enable', 'webserver-cache', 'webserver-cache-size', 'watchdog-enable', 'webgui-websockets',
+		'webgui-websockets-deflate', 'webgui-websockets-deflate-min', 'webgui-websockets-deflate-takeover',
+		'webserver-root', 'webserver-ssl-session-cache', 'webserver-ssl-session-timeout',
+		'webserver-ssl-session-tickets', 'webserver-ssl-fast-ciphers', 'ssl-offload',
 
-		'pid-file', 'pem-file', 'log-file',
+		'pid-file', 'pem-file', 'log-file', 'local-socket', 'config-write-delay', 'config-journal',
 
-		'log-level',
+		'log-level', 'log-binary-file', 'log-binary-level',
 
 		'arp-timeout', 'arp-interval',
 
@@ -70,6 +72,14 @@ function M.read(f)
 
 		'stats-enable',
 
+		'receive-repeat-window', 'receive-threads', 'receive-configured', 'receive-protocols',
+		'protocol-configured',
+
+		'broadcast-coalesce',
+
+		'config-snapshot', 'memory-profile', 'thread-stack-size', 'realtime-lock', 'realtime-receive-core', 'realtime-send-core', 'trace-size', 'cpu-profile', 'raw-tap', 'device-table', 'capture-file', 'lua-memory-limit', 'history-size',
+		'rule-storm-limit', 'rule-storm-edge-limit', 'rule-storm-damping',
+
 		'whitelist'
 	};
 
@@ -93,7 +103,7 @@ function M.read(f)
 	local keys = {
 		'storage-root', 'protocol-root', 'hardware-root',
 		'actions-root', 'functions-root', 'operators-root',
-		'webserver-root', 'log-file', 'pid-file', 'pem-file' }
+		'webserver-root', 'log-file', 'log-binary-file', 'pid-file', 'pem-file', 'capture-file' }
 	for k, v in pairs(keys) do
 		if settings[v] ~= nil then
 			s = settings[v];
@@ -111,7 +121,8 @@ function M.read(f)
 	--
 	-- These settings should be a valid positive number
 	--
-	keys = { 'port', 'arp-timeout', 'arp-interval', 'smtp-port' }
+	keys = { 'port', 'arp-timeout', 'arp-interval', 'smtp-port', 'receive-repeat-window', 'receive-threads', 'webserver-cache-size', 'memory-profile', 'webgui-websockets-deflate-min',
+		'config-write-delay', 'thread-stack-size', 'realtime-receive-core', 'realtime-send-core', 'trace-size', 'cpu-profile', 'lua-memory-limit', 'history-size', 'rule-storm-limit', 'rule-storm-edge-limit', 'rule-storm-damping', 'webserver-ssl-session-cache', 'webserver-ssl-session-timeout' }
 	for k, v in pairs(keys) do
 		if settings[v] ~= nil then
 			s = settings[v];
@@ -124,7 +135,7 @@ function M.read(f)
 	--
 	-- These settings should be a valid string
 	--
-	keys = { 'smtp-user', 'smtp-password', 'smtp-host', 'name', 'adhoc-master' }
+	keys = { 'smtp-user', 'smtp-password', 'smtp-host', 'name', 'adhoc-master', 'capture-file', 'replication-peer' }
 	for k, v in pairs(keys) do
 		if settings[v] ~= nil then
 			s = settings[v];
@@ -154,7 +165,11 @@ function M.read(f)
 	--
 	keys = {
 		'standalone', 'watchdog-enable', 'stats-enable', 'loopback',
-		'webserver-enable', 'webserver-cache', 'webgui-websockets', 'smtp-ssl' }
+		'webserver-enable', 'webserver-cache', 'webgui-websockets', 'webgui-websockets-deflate',
+		'webgui-websockets-deflate-takeover', 'smtp-ssl', 'config-journal', 'receive-configured',
+		'adhoc-compact', 'adhoc-raw', 'local-socket', 'webserver-ssl-session-tickets', 'webserver-ssl-fast-ciphers',
+		'raw-tap', 'device-table', 'broadcast-coalesce', 'realtime-lock', 'config-snapshot', 'protocol-configured',
+		'ssl-offload' }
 	for k, v in pairs(keys) do
 		if settings[v] ~= nil then
 			s = settings[v];
@@ -172,6 +187,14 @@ function M.read(f)
 		end
 	end
 
+	v = 'log-binary-level';
+	if settings[v] ~= nil then
+		s = settings[v];
+		if type(tonumber(s)) ~= 'number' or tonumber(s) < 0 or tonumber(s) > 7 then
+			error('config setting "' .. v .. '" must be from 0 till 7');
+		end
+	end
+
 	v = 'webserver-authentication';
 	if settings[v] ~= nil then
 		if type(settings[v]) ~= 'table' or settings[v].__len() ~= 2 then
@@ -203,6 +226,18 @@ function M.read(f)
 		end
 	end
 
+	v = 'receive-protocols';
+	if settings[v] ~= nil then
+		if type(settings[v]) ~= 'table' or settings[v].__len() == 0 then
+			error('config setting "' .. v .. '" must be in the format of [ \"arctech_switch\", ... ]');
+		end
+		for k, x in pairs(settings[v]) do
+			if type(x) ~= 'string' then
+				error('config setting "' .. v .. '" must be in the format of [ \"arctech_switch\", ... ]');
+			end
+		end
+	end
+
 	v = 'smtp-host'
 	if settings[v] ~= nil then
 		s = settings[v];
@@ -327,6 +362,14 @@ function M.read(f)
 		end
 	end
 
+	v = 'gpio-backend';
+	if settings[v] ~= nil then
+		s = settings[v];
+		if type(s) ~= 'string' or (s ~= 'wiringx' and s ~= 'gpiomem') then
+			error('config setting "' .. v .. '" must be either "wiringx" or "gpiomem"');
+		end
+	end
+
 	--
 	-- These settings should hold a valid gpio
 	--
@@ -17,6 +17,8 @@
 #include <limits.h>
 #include <assert.h>
 
+#include <pthread.h>
+
 #ifndef _WIN32
 	#include <libgen.h>
 	#include <dirent.h>
@@ -32,6 +34,36 @@
 #include "config.h"
 #include "registry.h"
 
+/*
+ * The registry values are kept in memory, so reading and
+ * writing a key doesn't need a lua state. Values are looked up
+ * in the lua storage module once and changes are handed to it
+ * later, in order. The pending changes are applied before
+ * anything reads from lua itself: a key that isn't known yet
+ * and the config being printed.
+ *
+ * Keys are hashed on their first part. The storage module
+ * replaces all of pilight.* when pilight.version is set, so
+ * keys that share a first part must go together.
+ */
+#define REGISTRY_HASH_SIZE	64
+
+typedef struct registry_t {
+	char *key;
+	struct varcont_t value;
+	struct registry_t *next;
+} registry_t;
+
+static struct registry_t *registry[REGISTRY_HASH_SIZE];
+static struct registry_t *pending = NULL;
+static struct registry_t *pending_tail = NULL;
+/* Raised on every change, so a copy of the registry can be checked */
+static unsigned long revision = 0;
+/* Guards the values and the pending list */
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+/* Keeps the pending changes in order while they are applied */
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static int config_callback_get(char *module, char *key, struct varcont_t *ret) {
 	struct lua_state_t *state = plua_get_module("storage", module);
 	int x = 0;
@@ -185,22 +217,255 @@ static int config_callback_set_boolean(char *module, char *key, int val) {
 	return x;
 }
 
+static unsigned int registry_hash(const char *key) {
+	unsigned int hash = 5381;
+
+	while(*key != '\0' && *key != '.') {
+		hash = ((hash << 5) + hash) + (unsigned char)*key++;
+	}
+	return hash % REGISTRY_HASH_SIZE;
+}
+
+static int registry_same_group(const char *a, const char *b) {
+	while(*a != '\0' && *a != '.' && *a == *b) {
+		a++, b++;
+	}
+	return (*a == '\0' || *a == '.') && (*b == '\0' || *b == '.');
+}
+
+static struct registry_t *registry_node(const char *key, struct varcont_t *value) {
+	struct registry_t *node = NULL;
+
+	if((node = MALLOC(sizeof(struct registry_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((node->key = STRDUP((char *)key)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(&node->value, value, sizeof(struct varcont_t));
+	if(value->type_ == LUA_TSTRING) {
+		if((node->value.string_ = STRDUP(value->string_)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+	node->next = NULL;
+
+	return node;
+}
+
+static void registry_free(struct registry_t *node) {
+	if(node->value.type_ == LUA_TSTRING) {
+		FREE(node->value.string_);
+	}
+	FREE(node->key);
+	FREE(node);
+}
+
+static struct registry_t *registry_find(const char *key) {
+	struct registry_t *node = registry[registry_hash(key)];
+
+	while(node) {
+		if(strcmp(node->key, key) == 0) {
+			return node;
+		}
+		node = node->next;
+	}
+	return NULL;
+}
+
+static void registry_flush(void) {
+	struct registry_t *node = NULL, *tmp = NULL;
+
+	pthread_mutex_lock(&flush_lock);
+	pthread_mutex_lock(&registry_lock);
+	node = pending;
+	pending = pending_tail = NULL;
+	pthread_mutex_unlock(&registry_lock);
+
+	while(node) {
+		switch(node->value.type_) {
+			case LUA_TNUMBER:
+				config_callback_set_number("registry", node->key, node->value.number_);
+			break;
+			case LUA_TBOOLEAN:
+				config_callback_set_boolean("registry", node->key, node->value.bool_);
+			break;
+			case LUA_TSTRING:
+				config_callback_set_string("registry", node->key, node->value.string_);
+			break;
+			default:
+				config_callback_set_string("registry", node->key, NULL);
+			break;
+		}
+		tmp = node;
+		node = node->next;
+		registry_free(tmp);
+	}
+	pthread_mutex_unlock(&flush_lock);
+}
+
+static int registry_set(char *key, struct varcont_t *value) {
+	struct registry_t **node = NULL, *tmp = NULL;
+	unsigned int hash = 0;
+
+	if(key == NULL) {
+		return -1;
+	}
+
+	hash = registry_hash(key);
+
+	pthread_mutex_lock(&registry_lock);
+	/* Setting a key replaces the whole group in the storage module */
+	node = &registry[hash];
+	while(*node) {
+		if(registry_same_group((*node)->key, key) == 1) {
+			tmp = *node;
+			*node = tmp->next;
+			registry_free(tmp);
+		} else {
+			node = &(*node)->next;
+		}
+	}
+	tmp = registry_node(key, value);
+	tmp->next = registry[hash];
+	registry[hash] = tmp;
+
+	tmp = registry_node(key, value);
+	if(pending_tail == NULL) {
+		pending = tmp;
+	} else {
+		pending_tail->next = tmp;
+	}
+	pending_tail = tmp;
+	__sync_add_and_fetch(&revision, 1);
+	pthread_mutex_unlock(&registry_lock);
+
+	return 0;
+}
+
+static int registry_copy(struct registry_t *node, struct varcont_t *ret) {
+	/* Keys set to null are remembered as such */
+	if(node->value.type_ == LUA_TNIL) {
+		return 1;
+	}
+	memcpy(ret, &node->value, sizeof(struct varcont_t));
+	if(node->value.type_ == LUA_TSTRING) {
+		if((ret->string_ = STRDUP(node->value.string_)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+	return 0;
+}
+
 int config_registry_get(char *key, struct varcont_t *ret) {
-	return config_callback_get("registry", key, ret);
+	struct registry_t *node = NULL;
+	unsigned int hash = 0;
+	int x = 0;
+
+	if(key == NULL || ret == NULL) {
+		return config_callback_get("registry", key, ret);
+	}
+
+	pthread_mutex_lock(&registry_lock);
+	if((node = registry_find(key)) != NULL) {
+		x = registry_copy(node, ret);
+		pthread_mutex_unlock(&registry_lock);
+		return x;
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	registry_flush();
+	if((x = config_callback_get("registry", key, ret)) != 0) {
+		return x;
+	}
+
+	/* Unless it was set in the meantime */
+	pthread_mutex_lock(&registry_lock);
+	if(registry_find(key) == NULL) {
+		hash = registry_hash(key);
+		node = registry_node(key, ret);
+		node->next = registry[hash];
+		registry[hash] = node;
+	}
+	pthread_mutex_unlock(&registry_lock);
+
+	return x;
 }
 
 int config_registry_set_number(char *key, double val) {
-	return config_callback_set_number("registry", key, val);
+	struct varcont_t value;
+
+	memset(&value, 0, sizeof(struct varcont_t));
+	value.number_ = val;
+	value.type_ = LUA_TNUMBER;
+
+	return registry_set(key, &value);
 }
 
 int config_registry_set_boolean(char *key, int val) {
-	return config_callback_set_boolean("registry", key, val);
+	struct varcont_t value;
+
+	memset(&value, 0, sizeof(struct varcont_t));
+	value.bool_ = val;
+	value.type_ = LUA_TBOOLEAN;
+
+	return registry_set(key, &value);
 }
 
 int config_registry_set_string(char *key, char *val) {
-	return config_callback_set_string("registry", key, val);
+	struct varcont_t value;
+
+	if(val == NULL) {
+		return config_registry_set_null(key);
+	}
+
+	memset(&value, 0, sizeof(struct varcont_t));
+	value.string_ = val;
+	value.type_ = LUA_TSTRING;
+
+	return registry_set(key, &value);
 }
 
 int config_registry_set_null(char *key) {
-	return config_callback_set_string("registry", key, NULL);
+	struct varcont_t value;
+
+	memset(&value, 0, sizeof(struct varcont_t));
+	value.type_ = LUA_TNIL;
+
+	return registry_set(key, &value);
+}
+
+/* Hand the pending changes to the storage module */
+void config_registry_sync(void) {
+	registry_flush();
+}
+
+/*
+ * Forget the remembered values, because the storage module
+ * read them anew.
+ */
+void config_registry_clear(void) {
+	struct registry_t *tmp = NULL;
+	int i = 0;
+
+	pthread_mutex_lock(&registry_lock);
+	for(i=0;i<REGISTRY_HASH_SIZE;i++) {
+		while(registry[i]) {
+			tmp = registry[i];
+			registry[i] = tmp->next;
+			registry_free(tmp);
+		}
+	}
+	while(pending) {
+		tmp = pending;
+		pending = tmp->next;
+		registry_free(tmp);
+	}
+	pending_tail = NULL;
+	__sync_add_and_fetch(&revision, 1);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+unsigned long config_registry_revision(void) {
+	return __sync_add_and_fetch(&revision, 0);
 }
\ No newline at end of file
@@ -18,5 +18,8 @@ int config_registry_set_number(char *key, double val);
 int config_registry_set_string(char *key, char *val);
 int config_registry_set_boolean(char *key, int val);
 int config_registry_set_null(char *key);
+void config_registry_sync(void);
+void config_registry_clear(void);
+unsigned long config_registry_revision(void);
 
 #endif
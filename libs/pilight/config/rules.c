@@ -35,14 +35,57 @@
 #include "../events/operator.h"
 #include "../events/action.h"
 #include "../events/function.h"
+#include "../events/timer.h"
+#include "devices.h"
 #include "rules.h"
 #include "gui.h"
 
 static struct rules_t *rules = NULL;
 
+/*
+ * Reverse index from device or protocol name
+ * to all rules depending on it.
+ */
+#define RULES_INDEX_SIZE	256
+static struct rules_index_t *rules_index[RULES_INDEX_SIZE];
+
 static pthread_mutex_t mutex_lock;
 static pthread_mutexattr_t mutex_attr;
 
+/* The live rules during a reload, see rules_reload */
+static struct rules_t *rules_reuse = NULL;
+
+/*
+ * A rule is compiled again when its text changed, or when
+ * one of the devices it uses was added or changed.
+ */
+static struct rules_t *rules_reuse_take(const char *name, const char *rule) {
+	struct rules_t *tmp = rules_reuse, *prev = NULL;
+	int i = 0;
+
+	while(tmp) {
+		if(strcmp(tmp->name, name) == 0) {
+			if(strcmp(tmp->rule, rule) != 0) {
+				return NULL;
+			}
+			for(i=0;i<tmp->nrdevices;i++) {
+				if(devices_changed(tmp->devices[i]) == 1) {
+					return NULL;
+				}
+			}
+			if(prev == NULL) {
+				rules_reuse = tmp->next;
+			} else {
+				prev->next = tmp->next;
+			}
+			return tmp;
+		}
+		prev = tmp;
+		tmp = tmp->next;
+	}
+	return NULL;
+}
+
 int config_rules_parse(struct JsonNode *root) {
 	int have_error = 0, match = 0, x = 0;
 	unsigned int i = 0;
@@ -50,9 +93,15 @@ int config_rules_parse(struct JsonNode *root) {
 	char *rule = NULL;
 	double active = 1.0;
 
-	event_function_init();
-	event_operator_init();
-	event_action_init();
+	/*
+	 * The event modules are only needed by rules, so a config
+	 * without them starts without loading any of them.
+	 */
+	if(root->tag == JSON_OBJECT && json_first_child(root) != NULL) {
+		event_function_init();
+		event_operator_init();
+		event_action_init();
+	}
 
 	if(root->tag == JSON_OBJECT) {
 		jrules = json_first_child(root);
@@ -89,39 +138,54 @@ int config_rules_parse(struct JsonNode *root) {
 						}
 					}
 
-					struct rules_t *node = MALLOC(sizeof(struct rules_t));
-					if(node == NULL) {
-						fprintf(stderr, "out of memory\n");
-						exit(EXIT_FAILURE);
-					}
-					node->next = NULL;
-					node->values = NULL;
-					node->jtrigger = NULL;
-					node->nrdevices = 0;
-					node->status = 0;
-					node->devices = NULL;
-					node->actions = NULL;
-					node->nr = i;
-					if((node->name = MALLOC(strlen(jrules->key)+1)) == NULL) {
-						fprintf(stderr, "out of memory\n");
-						exit(EXIT_FAILURE);
-					}
-					strcpy(node->name, jrules->key);
-					clock_gettime(CLOCK_MONOTONIC, &node->timestamp.first);
-					if(event_parse_rule(rule, node, 0, 1) == -1) {
-						have_error = 1;
-					}
-					clock_gettime(CLOCK_MONOTONIC, &node->timestamp.second);
-					logprintf(LOG_INFO, "rule #%d %s was parsed in %.6f seconds", node->nr, node->name,
-						((double)node->timestamp.second.tv_sec + 1.0e-9*node->timestamp.second.tv_nsec) -
-						((double)node->timestamp.first.tv_sec + 1.0e-9*node->timestamp.first.tv_nsec));
-
-					node->status = 0;
-					if((node->rule = MALLOC(strlen(rule)+1)) == NULL) {
-						fprintf(stderr, "out of memory\n");
-						exit(EXIT_FAILURE);
+					/* A reload keeps the rules that didn't change */
+					struct rules_t *node = rules_reuse_take(jrules->key, rule);
+					if(node != NULL) {
+						node->next = NULL;
+						node->nr = i;
+					} else {
+						node = MALLOC(sizeof(struct rules_t));
+						if(node == NULL) {
+							fprintf(stderr, "out of memory\n");
+							exit(EXIT_FAILURE);
+						}
+						node->next = NULL;
+						node->values = NULL;
+						node->jtrigger = NULL;
+						node->matched = 0;
+						node->nrdevices = 0;
+						node->status = 0;
+						node->devices = NULL;
+						node->targets = NULL;
+						node->nrtargets = 0;
+						node->edges = NULL;
+						memset(&node->storm, 0, sizeof(struct event_storm_t));
+						node->actions = NULL;
+						node->tree = NULL;
+						node->timer = NULL;
+						node->metric = NULL;
+						node->nr = i;
+						if((node->name = MALLOC(strlen(jrules->key)+1)) == NULL) {
+							fprintf(stderr, "out of memory\n");
+							exit(EXIT_FAILURE);
+						}
+						strcpy(node->name, jrules->key);
+						clock_gettime(CLOCK_MONOTONIC, &node->timestamp.first);
+						if(event_parse_rule(rule, node, 0, 1) == -1) {
+							have_error = 1;
+						}
+						clock_gettime(CLOCK_MONOTONIC, &node->timestamp.second);
+						logprintf(LOG_INFO, "rule #%d %s was parsed in %.6f seconds", node->nr, node->name,
+							((double)node->timestamp.second.tv_sec + 1.0e-9*node->timestamp.second.tv_nsec) -
+							((double)node->timestamp.first.tv_sec + 1.0e-9*node->timestamp.first.tv_nsec));
+
+						node->status = 0;
+						if((node->rule = MALLOC(strlen(rule)+1)) == NULL) {
+							fprintf(stderr, "out of memory\n");
+							exit(EXIT_FAILURE);
+						}
+						strcpy(node->rule, rule);
 					}
-					strcpy(node->rule, rule);
 					node->active = (unsigned short)active;
 
 					tmp = rules;
@@ -199,55 +263,169 @@ struct rules_t *rules_get(void) {
 	return rules;
 }
 
-int rules_gc(void) {
-	struct rules_t *tmp_rules = NULL;
-	struct rules_values_t *tmp_values = NULL;
-	struct rules_actions_t *tmp_actions = NULL;
-	int i = 0;
+void rules_index_add(const char *name, struct rules_t *rule) {
+	unsigned int hash = strhash(name) % RULES_INDEX_SIZE;
+	struct rules_index_t *tmp = rules_index[hash];
+	struct rules_list_t *list = NULL;
 
-	pthread_mutex_lock(&mutex_lock);
-	while(rules) {
-		tmp_rules = rules;
-		FREE(tmp_rules->name);
-		FREE(tmp_rules->rule);
-		events_tree_gc(tmp_rules->tree);
-		for(i=0;i<tmp_rules->nrdevices;i++) {
-			FREE(tmp_rules->devices[i]);
+	while(tmp) {
+		if(strcmp(tmp->name, name) == 0) {
+			break;
 		}
-		while(tmp_rules->values) {
-			tmp_values = tmp_rules->values;
-			FREE(tmp_values->name);
-			FREE(tmp_values->device);
-			tmp_rules->values = tmp_rules->values->next;
-			FREE(tmp_values);
+		tmp = tmp->next;
+	}
+	if(tmp == NULL) {
+		if((tmp = MALLOC(sizeof(struct rules_index_t))) == NULL) {
+			OUT_OF_MEMORY
 		}
-		if(tmp_rules->values != NULL) {
-			FREE(tmp_rules->values);
+		if((tmp->name = STRDUP(name)) == NULL) {
+			OUT_OF_MEMORY
 		}
-		while(tmp_rules->actions) {
-			tmp_actions = tmp_rules->actions;
-			if(tmp_actions->arguments != NULL) {
-				json_delete(tmp_actions->arguments);
+		tmp->rules = NULL;
+		tmp->next = rules_index[hash];
+		rules_index[hash] = tmp;
+	}
+
+	list = tmp->rules;
+	while(list) {
+		if(list->rule == rule) {
+			return;
+		}
+		list = list->next;
+	}
+
+	if((list = MALLOC(sizeof(struct rules_list_t))) == NULL) {
+		OUT_OF_MEMORY
+	}
+	list->rule = rule;
+	list->next = tmp->rules;
+	tmp->rules = list;
+}
+
+struct rules_list_t *rules_index_get(const char *name) {
+	struct rules_index_t *tmp = rules_index[strhash(name) % RULES_INDEX_SIZE];
+
+	while(tmp) {
+		if(strcmp(tmp->name, name) == 0) {
+			return tmp->rules;
+		}
+		tmp = tmp->next;
+	}
+	return NULL;
+}
+
+static void rules_index_gc(void) {
+	struct rules_index_t *tmp = NULL;
+	struct rules_list_t *list = NULL;
+	int i = 0;
+
+	for(i=0;i<RULES_INDEX_SIZE;i++) {
+		while(rules_index[i]) {
+			tmp = rules_index[i];
+			while(tmp->rules) {
+				list = tmp->rules;
+				tmp->rules = tmp->rules->next;
+				FREE(list);
 			}
-			tmp_rules->actions = tmp_rules->actions->next;
-			if(tmp_actions != NULL) {
-				FREE(tmp_actions);
+			FREE(tmp->name);
+			rules_index[i] = rules_index[i]->next;
+			FREE(tmp);
+		}
+	}
+}
+
+static void rules_index_remove(struct rules_t *rule) {
+	struct rules_index_t *tmp = NULL;
+	struct rules_list_t *list = NULL, *prev = NULL;
+	int i = 0;
+
+	for(i=0;i<RULES_INDEX_SIZE;i++) {
+		tmp = rules_index[i];
+		while(tmp) {
+			prev = NULL;
+			list = tmp->rules;
+			while(list) {
+				if(list->rule == rule) {
+					if(prev == NULL) {
+						tmp->rules = list->next;
+					} else {
+						prev->next = list->next;
+					}
+					FREE(list);
+					break;
+				}
+				prev = list;
+				list = list->next;
 			}
+			tmp = tmp->next;
 		}
-		if(tmp_rules->actions != NULL) {
-			FREE(tmp_rules->actions);
+	}
+}
+
+static void rules_free(struct rules_t *tmp_rules) {
+	struct rules_values_t *tmp_values = NULL;
+	struct rules_actions_t *tmp_actions = NULL;
+	int i = 0;
+
+	FREE(tmp_rules->name);
+	FREE(tmp_rules->rule);
+	events_tree_gc(tmp_rules->tree);
+	for(i=0;i<tmp_rules->nrdevices;i++) {
+		FREE(tmp_rules->devices[i]);
+	}
+	while(tmp_rules->values) {
+		tmp_values = tmp_rules->values;
+		if(tmp_values->name != NULL) {
+			FREE(tmp_values->name);
 		}
-		if(tmp_rules->jtrigger != NULL) {
-			json_delete(tmp_rules->jtrigger);
+		FREE(tmp_values->device);
+		tmp_rules->values = tmp_rules->values->next;
+		FREE(tmp_values);
+	}
+	if(tmp_rules->values != NULL) {
+		FREE(tmp_rules->values);
+	}
+	while(tmp_rules->actions) {
+		tmp_actions = tmp_rules->actions;
+		if(tmp_actions->arguments != NULL) {
+			json_delete(tmp_actions->arguments);
 		}
-		if(tmp_rules->devices != NULL) {
-			FREE(tmp_rules->devices);
+		tmp_rules->actions = tmp_rules->actions->next;
+		if(tmp_actions != NULL) {
+			FREE(tmp_actions);
 		}
-		rules = rules->next;
-		FREE(tmp_rules);
 	}
-	if(rules != NULL) {
-		FREE(rules);
+	if(tmp_rules->actions != NULL) {
+		FREE(tmp_rules->actions);
+	}
+	if(tmp_rules->jtrigger != NULL) {
+		json_delete(tmp_rules->jtrigger);
+	}
+	if(tmp_rules->devices != NULL) {
+		FREE(tmp_rules->devices);
+	}
+	for(i=0;i<tmp_rules->nrtargets;i++) {
+		FREE(tmp_rules->targets[i]);
+	}
+	if(tmp_rules->targets != NULL) {
+		FREE(tmp_rules->targets);
+	}
+	if(tmp_rules->edges != NULL) {
+		FREE(tmp_rules->edges);
+	}
+	FREE(tmp_rules);
+}
+
+int rules_gc(void) {
+	struct rules_t *tmp_rules = NULL;
+
+	pthread_mutex_lock(&mutex_lock);
+	rules_index_gc();
+	event_timer_gc();
+	while(rules) {
+		tmp_rules = rules;
+		rules = rules->next;
+		rules_free(tmp_rules);
 	}
 	rules = NULL;
 	pthread_mutex_unlock(&mutex_lock);
@@ -256,6 +434,37 @@ int rules_gc(void) {
 	return 1;
 }
 
+/*
+ * Apply a new rules config to the live one, only the new
+ * and changed rules are compiled. Should be called after
+ * the devices were reloaded.
+ */
+int rules_reload(struct JsonNode *root) {
+	struct rules_t *tmp_rules = NULL;
+	int ret = 0, nrremoved = 0;
+
+	pthread_mutex_lock(&mutex_lock);
+	rules_reuse = rules;
+	rules = NULL;
+
+	ret = config_rules_parse(root);
+
+	while(rules_reuse) {
+		tmp_rules = rules_reuse;
+		rules_reuse = rules_reuse->next;
+		rules_index_remove(tmp_rules);
+		if(tmp_rules->timer != NULL) {
+			event_timer_remove(tmp_rules->timer);
+		}
+		rules_free(tmp_rules);
+		nrremoved++;
+	}
+	pthread_mutex_unlock(&mutex_lock);
+
+	logprintf(LOG_DEBUG, "reloaded config rules library, %d rules removed or recompiled", nrremoved);
+	return ret;
+}
+
 void rules_init(void) {
 	pthread_mutexattr_init(&mutex_attr);
 	pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
@@ -20,10 +20,13 @@
 #define _RULES_H_
 
 #include "../core/json.h"
+#include "../core/metrics.h"
 #include "../events/action.h"
+#include "../events/storm.h"
 #include "../datatypes/stack.h"
 #include "config.h"
 
+/* A setting read by the conditions, without a name all of them */
 typedef struct rules_values_t {
 	char *device;
 	char *name;
@@ -45,6 +48,12 @@ typedef struct rules_t {
 	char *name;
 	char **devices;
 	int nrdevices;
+	/* Devices controlled by the actions of the rule */
+	char **targets;
+	int nrtargets;
+	/* How often the rule and its targets were run, see event_storm_run */
+	struct event_storm_t storm;
+	struct event_storm_t *edges;
 	int nr;
 	int status;
 	struct {
@@ -52,20 +61,40 @@ typedef struct rules_t {
 		struct timespec second;
 	}	timestamp;
 	unsigned short active;
+	unsigned short matched;
 	struct JsonNode *jtrigger;
 	/* Arguments to be send to the action */
 	struct rules_actions_t *actions;
+	/* The device settings read by the conditions, see events_match_values */
 	struct rules_values_t *values;
 	struct tree_t *tree;
+	/* Set when only some moments can make the rule true */
+	struct event_timer_t *timer;
+	/* Time spent evaluating the rule */
+	struct metric_t *metric;
 	struct rules_t *next;
 } rules_t;
 
+typedef struct rules_list_t {
+	struct rules_t *rule;
+	struct rules_list_t *next;
+} rules_list_t;
+
+typedef struct rules_index_t {
+	char *name;
+	struct rules_list_t *rules;
+	struct rules_index_t *next;
+} rules_index_t;
+
 struct config_t *config_rules;
 
 void rules_init(void);
 int rules_gc(void);
 int config_rules_parse(struct JsonNode *root);
+int rules_reload(struct JsonNode *root);
 struct JsonNode *config_rules_sync(int level, const char *media);
 struct rules_t *rules_get(void);
+void rules_index_add(const char *name, struct rules_t *rule);
+struct rules_list_t *rules_index_get(const char *name);
 
 #endif
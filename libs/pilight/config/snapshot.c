@@ -0,0 +1,195 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * The snapshot remembers that a config was already validated.
+ * Every time pilight writes the config, the fingerprint of the
+ * written content is stored next to it:
+ *
+ * | magic (4) | fingerprint (8) |
+ *
+ * The fingerprint covers the content, the version of pilight
+ * and the options of all protocols, little endian. When the
+ * config read at startup still has the same fingerprint, the
+ * checks that only reject invalid configs are skipped while it
+ * is parsed. Everything that builds the state of the devices,
+ * rules and gui still runs as before. A config edited by hand,
+ * or a pilight with other protocols, is validated in full.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#ifndef _WIN32
+	#include <unistd.h>
+#else
+	#include <io.h>
+#endif
+
+#include "../core/pilight.h"
+#include "../core/common.h"
+#include "../core/mem.h"
+#include "../core/log.h"
+#include "../core/options.h"
+#include "../protocols/protocol.h"
+
+#include "settings.h"
+#include "snapshot.h"
+
+#ifndef O_BINARY
+	#define O_BINARY 0
+#endif
+
+#define SNAPSHOT_MAGIC				"PLS1"
+#define SNAPSHOT_MAGIC_SIZE		4
+#define SNAPSHOT_SIZE					12
+
+static int snapshot_valid = 0;
+
+static uint64_t snapshot_hash(const char *str, size_t len, uint64_t hash) {
+	size_t i = 0;
+
+	/* FNV-1a */
+	for(i=0;i<len;i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static uint64_t snapshot_fingerprint(const char *content) {
+	struct protocols_t *tmp = protocols;
+	struct options_t *opt = NULL;
+	uint64_t hash = 14695981039346656037ULL;
+
+	hash = snapshot_hash(HASH, strlen(HASH), hash);
+	hash = snapshot_hash(content, strlen(content), hash);
+	while(tmp) {
+		hash = snapshot_hash(tmp->listener->id, strlen(tmp->listener->id)+1, hash);
+		opt = tmp->listener->options;
+		while(opt) {
+			if(opt->name != NULL) {
+				hash = snapshot_hash(opt->name, strlen(opt->name)+1, hash);
+			}
+			if(opt->mask != NULL) {
+				hash = snapshot_hash(opt->mask, strlen(opt->mask)+1, hash);
+			}
+			hash = snapshot_hash((char *)&opt->conftype, sizeof(opt->conftype), hash);
+			hash = snapshot_hash((char *)&opt->vartype, sizeof(opt->vartype), hash);
+			opt = opt->next;
+		}
+		tmp = tmp->next;
+	}
+	return hash;
+}
+
+static int snapshot_enabled(void) {
+	int enable = 0;
+
+	return (config_setting_get_number("config-snapshot", 0, &enable) == 0 && enable == 1);
+}
+
+/*
+ * Compares the config content read at startup with the
+ * snapshot. Until snapshot_close the config counts as
+ * validated when they match.
+ */
+int snapshot_open(char *file, const char *content) {
+	char path[strlen(file)+10];
+	unsigned char buf[SNAPSHOT_SIZE];
+	uint64_t fingerprint = 0;
+	int fd = -1, i = 0;
+	ssize_t n = 0;
+
+	snapshot_valid = 0;
+	if(snapshot_enabled() == 0) {
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s.snapshot", file);
+	if((fd = open(path, O_RDONLY | O_BINARY)) == -1) {
+		return -1;
+	}
+	n = read(fd, buf, SNAPSHOT_SIZE);
+	close(fd);
+
+	if(n != SNAPSHOT_SIZE || memcmp(buf, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE) != 0) {
+		logprintf(LOG_NOTICE, "ignoring an invalid config snapshot %s", path);
+		return -1;
+	}
+	for(i=7;i>=0;i--) {
+		fingerprint = (fingerprint << 8) | buf[SNAPSHOT_MAGIC_SIZE+i];
+	}
+	if(fingerprint != snapshot_fingerprint(content)) {
+		logprintf(LOG_DEBUG, "config changed since the snapshot, validating it in full");
+		return -1;
+	}
+
+	logprintf(LOG_DEBUG, "config matches the snapshot, skipping its validation");
+	snapshot_valid = 1;
+	return 0;
+}
+
+int snapshot_validated(void) {
+	return snapshot_valid;
+}
+
+void snapshot_close(void) {
+	snapshot_valid = 0;
+}
+
+/*
+ * Called with the content of every config that was written
+ * successfully. The snapshot is replaced like the config, so
+ * an interrupted write leaves the old one.
+ */
+int snapshot_write(char *file, const char *content) {
+	char path[strlen(file)+10], tmp[strlen(file)+14];
+	unsigned char buf[SNAPSHOT_SIZE];
+	uint64_t fingerprint = 0;
+	int fd = -1, i = 0, error = 0;
+
+	if(snapshot_enabled() == 0) {
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s.snapshot", file);
+	snprintf(tmp, sizeof(tmp), "%s.snapshot.tmp", file);
+
+	fingerprint = snapshot_fingerprint(content);
+	memcpy(buf, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_SIZE);
+	for(i=0;i<8;i++) {
+		buf[SNAPSHOT_MAGIC_SIZE+i] = (unsigned char)(fingerprint >> (i*8));
+	}
+
+	if((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644)) == -1) {
+		logprintf(LOG_ERR, "cannot write config snapshot %s: %s", tmp, strerror(errno));
+		return -1;
+	}
+	if(write(fd, buf, SNAPSHOT_SIZE) != SNAPSHOT_SIZE) {
+		error = 1;
+	}
+	close(fd);
+
+#ifdef _WIN32
+	remove(path);
+#endif
+	if(error == 1 || rename(tmp, path) != 0) {
+		logprintf(LOG_ERR, "cannot write config snapshot %s", path);
+		remove(tmp);
+		return -1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,17 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _SNAPSHOT_H_
+#define _SNAPSHOT_H_
+
+int snapshot_open(char *file, const char *content);
+int snapshot_validated(void);
+void snapshot_close(void);
+int snapshot_write(char *file, const char *content);
+
+#endif
@@ -47,6 +47,15 @@ int arp_resolv(char *if_name, char *srcmac, char *dstmac, char **ip) {
 	logprintf(LOG_ERR, "the ARP library is not supported on aarch64");
 	return -1;
 }
+
+int arp_scan(char *if_name, char *srcmac, int srcip[4], int maxage) {
+	logprintf(LOG_ERR, "the ARP library is not supported on aarch64");
+	return -1;
+}
+
+int arp_lease_ip(char *mac, char **ip, int maxage) {
+	return -1;
+}
 #else
 
 #include <stdio.h>
@@ -54,6 +63,7 @@ int arp_resolv(char *if_name, char *srcmac, char *dstmac, char **ip) {
 #include <sys/types.h>
 #include <sys/time.h>
 #include <time.h>
+#include <pthread.h>
 #ifdef _WIN32
 	#define WPCAP
 	#define WIN32_LEAN_AND_MEAN
@@ -93,6 +103,7 @@ int arp_resolv(char *if_name, char *srcmac, char *dstmac, char **ip) {
 
 #include "network.h"
 #include "mem.h"
+#include "eventpool.h"
 #include "arp.h"
 
 #define MAXLINE 						255
@@ -133,6 +144,29 @@ typedef struct arp_ether_ipv4 {
 	uint32_t ar_tip;
 } arp_ether_ipv4;
 
+/*
+ * Presence of hosts seen by the shared scanner. One sweep
+ * probes a whole /24 in a single burst and every user reads
+ * the results from this table. A lease is present as long
+ * as its host answered within the age given by the user.
+ */
+#define ARP_LEASES					256
+#define ARP_SCAN_INTERVAL		5
+#define ARP_SCAN_ROUNDS			2
+#define ARP_SCAN_WAIT				500000
+
+typedef struct arp_lease_t {
+	uint8_t mac[ETH_ALEN];
+	struct in_addr addr;
+	time_t seen;
+	int present;
+} arp_lease_t;
+
+static struct arp_lease_t arp_leases[ARP_LEASES];
+static int arp_nrleases = 0;
+static time_t arp_last_scan = 0;
+static pthread_mutex_t arp_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct host_entry **helist;
 static struct host_entry **cursor;
 static unsigned num_hosts = 0;
@@ -394,7 +428,7 @@ static void callback(u_char *args, const struct pcap_pkthdr *header, const u_cha
 	}
 }
 
-static int recvfrom_wto(long unsigned int tmo, pcap_t *pcap_handle) {
+static int recvfrom_wto(long unsigned int tmo, pcap_t *pcap_handle, pcap_handler handler) {
 #ifdef _WIN32
 	WaitForSingleObject(pcap_getevent(pcap_handle), (DWORD)tmo);
 #else
@@ -419,7 +453,7 @@ static int recvfrom_wto(long unsigned int tmo, pcap_t *pcap_handle) {
 	}
 #endif
 	if(pcap_handle != NULL) {
-		if((pcap_dispatch(pcap_handle, -1, callback, NULL)) == -1) {
+		if((pcap_dispatch(pcap_handle, -1, handler, NULL)) == -1) {
 			logprintf(LOG_ERR, "pcap_dispatch: %s", pcap_geterr(pcap_handle));
 			return -1;
 		}
@@ -428,16 +462,9 @@ static int recvfrom_wto(long unsigned int tmo, pcap_t *pcap_handle) {
 	return -1;
 }
 
-int arp_resolv(char *if_name, char *srcmac, char *dstmac, char **ip) {
-	struct timeval now, diff, last_packet_time;
+static pcap_t *arp_open(char *if_name) {
 	pcap_t *pcap_handle = NULL;
-	unsigned long int loop_timediff = 0, host_timediff = 0;
-	unsigned long int req_interval = 0, select_timeout = 0;
-	unsigned long int cum_err = 0, interval = 0;
 	char *if_cpy = NULL, error[PCAP_ERRBUF_SIZE], *e = error;
-	int found = -1;
-	int reset_cum_err = 0, first_timeout = 1;
-	int i = 0;
 
 	if((if_cpy = MALLOC(strlen(if_name)+1)) == NULL) {
 		fprintf(stderr, "out of memory\n");
@@ -486,6 +513,31 @@ int arp_resolv(char *if_name, char *srcmac, char *dstmac, char **ip) {
 		goto close;
 	}
 
+	FREE(if_cpy);
+	return pcap_handle;
+
+close:
+	if(pcap_handle != NULL) {
+		pcap_close(pcap_handle);
+	}
+	FREE(if_cpy);
+	return NULL;
+}
+
+int arp_resolv(char *if_name, char *srcmac, char *dstmac, char **ip) {
+	struct timeval now, diff, last_packet_time;
+	pcap_t *pcap_handle = NULL;
+	unsigned long int loop_timediff = 0, host_timediff = 0;
+	unsigned long int req_interval = 0, select_timeout = 0;
+	unsigned long int cum_err = 0, interval = 0;
+	int found = -1;
+	int reset_cum_err = 0, first_timeout = 1;
+	int i = 0;
+
+	if((pcap_handle = arp_open(if_name)) == NULL) {
+		goto close;
+	}
+
 	live_count = num_hosts;
 	cursor = helist;
 	last_packet_time.tv_sec=0;
@@ -549,7 +601,7 @@ int arp_resolv(char *if_name, char *srcmac, char *dstmac, char **ip) {
 		} else {
 			select_timeout = req_interval - loop_timediff;
 		}
-		if(recvfrom_wto(select_timeout, pcap_handle) == -1) {
+		if(recvfrom_wto(select_timeout, pcap_handle, callback) == -1) {
 			goto close;
 		}
 	}
@@ -575,9 +627,6 @@ close:
 	if(pcap_handle != NULL) {
 		pcap_close(pcap_handle);
 	}
-	if(if_cpy != NULL) {
-		FREE(if_cpy);
-	}
   for(i=0;i<num_hosts;i++) {
 		FREE(helist[i]);
 	}
@@ -592,4 +641,177 @@ close:
 	}
 }
 
+static void *reason_arp_device_free(void *param) {
+	struct reason_arp_device_t *data = param;
+	FREE(data);
+	return NULL;
+}
+
+static void arp_mac2str(uint8_t *mac, char *out) {
+	sprintf(out, "%.2x:%.2x:%.2x:%.2x:%.2x:%.2x",
+		mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+}
+
+static void arp_trigger(int reason, struct arp_lease_t *lease) {
+	struct reason_arp_device_t *data = NULL;
+
+	if((data = MALLOC(sizeof(struct reason_arp_device_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(data, '\0', sizeof(struct reason_arp_device_t));
+	arp_mac2str(lease->mac, data->mac);
+	inet_ntop(AF_INET, (void *)&lease->addr, data->ip, INET_ADDRSTRLEN);
+	eventpool_trigger(reason, reason_arp_device_free, data);
+}
+
+static void scan_callback(u_char *args, const struct pcap_pkthdr *header, const u_char *packet_in) {
+	struct arp_ether_ipv4 arpei;
+	struct ether_hdr frame_hdr;
+	struct arp_lease_t *lease = NULL;
+	size_t n = header->caplen;
+	int i = 0;
+
+	if(n < ETHER_HDR_SIZE + ARP_PKT_SIZE) {
+		return;
+	}
+
+	unmarshal_arp_pkt(packet_in, n, &frame_hdr, &arpei, NULL, NULL);
+	if(frame_hdr.frame_type != htons(0x0806) || arpei.ar_op != htons(2)) {
+		return;
+	}
+
+	for(i=0;i<arp_nrleases;i++) {
+		if(memcmp(arp_leases[i].mac, arpei.ar_sha, ETH_ALEN) == 0) {
+			lease = &arp_leases[i];
+			break;
+		}
+	}
+	if(lease == NULL) {
+		if(arp_nrleases == ARP_LEASES) {
+			return;
+		}
+		lease = &arp_leases[arp_nrleases++];
+		memset(lease, 0, sizeof(struct arp_lease_t));
+		memcpy(lease->mac, arpei.ar_sha, ETH_ALEN);
+	}
+	if(lease->present == 1 && lease->addr.s_addr != arpei.ar_sip) {
+		lease->present = 2;
+	}
+	lease->addr.s_addr = arpei.ar_sip;
+	lease->seen = time(NULL);
+}
+
+/*
+ * Probe every address of the /24 the interface is in and
+ * update the lease table. Leases that appear, change address
+ * or have not been seen for maxage seconds are announced
+ * with the REASON_ARP_* events. Sweeps are shared, so a call
+ * shortly after another one only serves the table.
+ */
+int arp_scan(char *if_name, char *srcmac, int srcip[4], int maxage) {
+	struct host_entry he;
+	struct timeval last_packet_time, now_tv, diff;
+	pcap_t *pcap_handle = NULL;
+	unsigned long int elapsed = 0;
+	char ip[INET_ADDRSTRLEN+1];
+	time_t now = 0;
+	int i = 0, x = 0, r = 0;
+	int reasons[ARP_LEASES];
+
+	pthread_mutex_lock(&arp_lock);
+	now = time(NULL);
+	if(now-arp_last_scan < ARP_SCAN_INTERVAL) {
+		pthread_mutex_unlock(&arp_lock);
+		return 0;
+	}
+	arp_last_scan = now;
+
+	if((pcap_handle = arp_open(if_name)) == NULL) {
+		pthread_mutex_unlock(&arp_lock);
+		return -1;
+	}
+
+	for(x=0;x<ARP_SCAN_ROUNDS;x++) {
+		for(i=1;i<255;i++) {
+			if(i == srcip[3]) {
+				continue;
+			}
+			memset(&he, 0, sizeof(struct host_entry));
+			snprintf(ip, sizeof(ip), "%d.%d.%d.%d", srcip[0], srcip[1], srcip[2], i);
+			he.addr.s_addr = inet_addr(ip);
+			he.live = 1;
+			if(send_packet(pcap_handle, &he, &last_packet_time, srcmac) == -1) {
+				r = -1;
+				break;
+			}
+		}
+		if(r == -1) {
+			break;
+		}
+		/* Collect the replies for ARP_SCAN_WAIT after the burst */
+		while(1) {
+			gettimeofday(&now_tv, NULL);
+			timeval_diff(&now_tv, &last_packet_time, &diff);
+			elapsed = (unsigned long int)(1000000*diff.tv_sec + diff.tv_usec);
+			if(elapsed >= ARP_SCAN_WAIT) {
+				break;
+			}
+			if((r = recvfrom_wto(ARP_SCAN_WAIT-elapsed, pcap_handle, scan_callback)) == -1) {
+				break;
+			}
+		}
+		if(r == -1) {
+			break;
+		}
+	}
+	pcap_close(pcap_handle);
+
+	now = time(NULL);
+	for(i=0;i<arp_nrleases;i++) {
+		reasons[i] = 0;
+		if(now-arp_leases[i].seen <= maxage) {
+			if(arp_leases[i].present == 0) {
+				reasons[i] = REASON_ARP_FOUND_DEVICE;
+			} else if(arp_leases[i].present == 2) {
+				reasons[i] = REASON_ARP_CHANGED_DEVICE;
+			}
+			arp_leases[i].present = 1;
+		} else if(arp_leases[i].present > 0) {
+			arp_leases[i].present = 0;
+			reasons[i] = REASON_ARP_LOST_DEVICE;
+		}
+		if(reasons[i] > 0) {
+			arp_trigger(reasons[i], &arp_leases[i]);
+		}
+	}
+	pthread_mutex_unlock(&arp_lock);
+
+	return (r == -1) ? -1 : 0;
+}
+
+/*
+ * The address of a host seen within maxage seconds.
+ */
+int arp_lease_ip(char *mac, char **ip, int maxage) {
+	char fmac[18];
+	time_t now = time(NULL);
+	int i = 0, r = -1;
+
+	pthread_mutex_lock(&arp_lock);
+	for(i=0;i<arp_nrleases;i++) {
+		arp_mac2str(arp_leases[i].mac, fmac);
+		if(strcmp(fmac, mac) == 0) {
+			if(now-arp_leases[i].seen <= maxage) {
+				memset(*ip, '\0', INET_ADDRSTRLEN+1);
+				inet_ntop(AF_INET, (void *)&arp_leases[i].addr, *ip, INET_ADDRSTRLEN+1);
+				r = 0;
+			}
+			break;
+		}
+	}
+	pthread_mutex_unlock(&arp_lock);
+
+	return r;
+}
+
 #endif
@@ -27,3 +27,5 @@
 
 void arp_add_host(const char *host_name);
 int arp_resolv(char *if_name, char *srcmac, char *dstmac, char **ip);
+int arp_scan(char *if_name, char *srcmac, int srcip[4], int maxage);
+int arp_lease_ip(char *mac, char **ip, int maxage);
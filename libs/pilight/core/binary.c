@@ -8,6 +8,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+	#include <arm_neon.h>
+#endif
 
 #include "binary.h"
 
@@ -116,4 +122,102 @@ int binToSigned(const int *binary, int s, int e) { //  0<=s<=e, binary[s(lsb) ..
 		result -= 1<<(e-s+1);
 	}
 	return result;
-}
\ No newline at end of file
+}
+
+void pulsesClassify(const int *pulses, int len, int threshold, unsigned int *bits) {
+	int i = 0;
+
+	memset(bits, 0, sizeof(unsigned int)*(size_t)((len+31)/32));
+
+	/* Blocks start at a multiple of their size, so they never cross a word */
+#if defined(__SSE2__)
+	__m128i t = _mm_set1_epi32(threshold);
+	for(;i+16<=len;i+=16) {
+		__m128i a = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)&pulses[i]), t);
+		__m128i b = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)&pulses[i+4]), t);
+		__m128i c = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)&pulses[i+8]), t);
+		__m128i d = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)&pulses[i+12]), t);
+		__m128i m = _mm_packs_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d));
+		bits[i/32] |= (unsigned int)_mm_movemask_epi8(m) << (i%32);
+	}
+	for(;i+4<=len;i+=4) {
+		__m128i a = _mm_cmpgt_epi32(_mm_loadu_si128((const __m128i *)&pulses[i]), t);
+		bits[i/32] |= (unsigned int)_mm_movemask_ps(_mm_castsi128_ps(a)) << (i%32);
+	}
+#elif defined(__ARM_NEON)
+	static const uint32_t weights[4] = { 1, 2, 4, 8 };
+	int32x4_t t = vdupq_n_s32(threshold);
+	uint32x4_t w = vld1q_u32(weights);
+	for(;i+4<=len;i+=4) {
+		uint32x4_t m = vandq_u32(vcgtq_s32(vld1q_s32(&pulses[i]), t), w);
+		uint32x2_t s = vpadd_u32(vget_low_u32(m), vget_high_u32(m));
+		s = vpadd_u32(s, s);
+		bits[i/32] |= vget_lane_u32(s, 0) << (i%32);
+	}
+#endif
+	for(;i<len;i++) {
+		bits[i/32] |= (unsigned int)(pulses[i] > threshold) << (i%32);
+	}
+}
+
+unsigned long long pulsesToBits(const int *pulses, int start, int step, int nrbits, int threshold) {
+	unsigned long long bits = 0;
+	unsigned int classified[16];
+	int i = 0, x = 0, len = 0;
+
+	if(nrbits > 64) {
+		nrbits = 64;
+	}
+	if(nrbits <= 0) {
+		return 0;
+	}
+
+	len = ((nrbits-1)*step)+1;
+	if(step <= 0 || len > (int)(sizeof(classified)*8)) {
+		for(i=0;i<nrbits;i++) {
+			bits = (bits << 1) | (unsigned long long)(pulses[start+(i*step)] > threshold);
+		}
+		return bits;
+	}
+
+	pulsesClassify(&pulses[start], len, threshold, classified);
+	for(i=0,x=0;i<nrbits;i++,x+=step) {
+		bits = (bits << 1) | ((classified[x/32] >> (x%32)) & 1);
+	}
+	return bits;
+}
+
+unsigned long long bitsToDecRev(unsigned long long bits, int nrbits, int s, int e) { // bits[s(msb) .. e(lsb)]
+	int width = e-s+1;
+
+	bits >>= (nrbits-1-e);
+	if(width < 64) {
+		bits &= (1ULL << width)-1;
+	}
+	return bits;
+}
+
+unsigned long long bitsToDec(unsigned long long bits, int nrbits, int s, int e) { // bits[s(lsb) .. e(msb)]
+	unsigned long long value = bitsToDecRev(bits, nrbits, s, e), result = 0;
+	int i = 0;
+
+	for(i=s;i<=e;i++) {
+		result = (result << 1) | (value & 1);
+		value >>= 1;
+	}
+	return result;
+}
+
+int bitAt(unsigned long long bits, int nrbits, int i) {
+	return (int)((bits >> (nrbits-1-i)) & 1);
+}
+
+int bitsParity(unsigned long long value) {
+	value ^= value >> 32;
+	value ^= value >> 16;
+	value ^= value >> 8;
+	value ^= value >> 4;
+	value ^= value >> 2;
+	value ^= value >> 1;
+	return (int)(value & 1);
+}
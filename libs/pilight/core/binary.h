@@ -88,4 +88,47 @@ int decToBinRevUl(unsigned long long n, int *binary);
 int binToSignedRev(const int *binary, int s, int e);    // 0<=s<=e, binary[s(msb) .. e(lsb)]
 int binToSigned(const int *binary, int s, int e);       // 0<=s<=e, binary[s(lsb) .. e(msb)]
 
+/*
+ * Bit-packed decoding. Instead of an int per bit, the bits of a
+ * pulse train are kept in one unsigned long long, the first bit
+ * received being the most significant. Bit indexes count from the
+ * first bit received, just like the index in an int buffer, so
+ * the field positions of a protocol stay the same.
+ */
+
+/*
+ * Compare every pulse against a threshold in one pass, using SSE2 or
+ * NEON when available. Bit i%32 of bits[i/32] is set when pulse i is
+ * longer than the threshold.
+ * @param pulses The raw pulse train.
+ * @param len The number of pulses.
+ * @param threshold Pulses longer than this are a "1".
+ * @param bits Room for (len+31)/32 words.
+ */
+void pulsesClassify(const int *pulses, int len, int threshold, unsigned int *bits);
+
+/*
+ * Classify a pulse train into bits by the width of one pulse per bit.
+ * @param pulses The raw pulse train.
+ * @param start Index of the pulse that decides the first bit.
+ * @param step Number of pulses per bit.
+ * @param nrbits Number of bits to decode, at most 64.
+ * @param threshold Pulses longer than this are a "1".
+ * @return unsigned long long The packed bits.
+ */
+unsigned long long pulsesToBits(const int *pulses, int start, int step, int nrbits, int threshold);
+
+/*
+ * Extract the bits s .. e of a packed value of nrbits bits, the same as
+ * binToDecRevUl() and binToDecUl() do on an int buffer. e-s < 64
+ */
+unsigned long long bitsToDecRev(unsigned long long bits, int nrbits, int s, int e);	// bits[s(msb) .. e(lsb)]
+unsigned long long bitsToDec(unsigned long long bits, int nrbits, int s, int e);		// bits[s(lsb) .. e(msb)]
+int bitAt(unsigned long long bits, int nrbits, int i);
+
+/*
+ * Returns 1 if an odd number of bits is set.
+ */
+int bitsParity(unsigned long long value);
+
 #endif
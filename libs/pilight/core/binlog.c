@@ -0,0 +1,582 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * The binary log stores the arguments of a log message instead
+ * of the formatted line, so logging costs a walk over the format
+ * and a copy of the arguments. The format strings are written
+ * once per file and referred to by their id. A file starts with
+ * the magic and the byte order, followed by records:
+ *
+ * | type (1) | length (2) | payload |
+ *
+ * H | realtime in usec (8) | monotonic in nsec (8) | name
+ * F | id (4) | format
+ * E | monotonic in nsec (8) | priority (1) | id (4) | arguments
+ *
+ * Each time the daemon opens the file a header is written with
+ * all formats known so far, the ids are only valid until the
+ * next header. Every argument is a tag followed by 8 bytes, or
+ * for a string by its length (2) and characters. All numbers
+ * are in the byte order of the writer. pilight-log renders the
+ * records as the lines of the normal log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <ctype.h>
+#include <sys/time.h>
+
+#include "../../libuv/uv.h"
+#include "pilight.h"
+#include "mem.h"
+#include "binlog.h"
+
+#define BINLOG_FORMATS		4096
+#define BINLOG_STRING_MAX	512
+#define BINLOG_SPEC_MAX		24
+
+#define BINLOG_LEN_NONE		0
+#define BINLOG_LEN_HH			1
+#define BINLOG_LEN_H			2
+#define BINLOG_LEN_L			3
+#define BINLOG_LEN_LL			4
+#define BINLOG_LEN_J			5
+#define BINLOG_LEN_Z			6
+#define BINLOG_LEN_T			7
+#define BINLOG_LEN_LD			8
+
+#define BINLOG_FREE				0
+#define BINLOG_CLAIMED		1
+#define BINLOG_READY			2
+
+typedef struct binlog_format_t {
+	unsigned int state;
+	/* Written to the current file */
+	unsigned int published;
+	uint32_t hash;
+	char *format;
+} binlog_format_t;
+
+typedef struct binlog_spec_t {
+	/* Length of the conversion including the % */
+	size_t len;
+	/* Where the length modifier starts */
+	size_t modifier;
+	int stars;
+	int length;
+	char conv;
+} binlog_spec_t;
+
+static struct binlog_format_t formats[BINLOG_FORMATS];
+
+static int binlog_spec(const char *format, struct binlog_spec_t *spec) {
+	size_t i = 1;
+
+	memset(spec, 0, sizeof(struct binlog_spec_t));
+	while(format[i] != '\0' && strchr("-+ #0'", format[i]) != NULL) {
+		i++;
+	}
+	if(format[i] == '*') {
+		spec->stars++;
+		i++;
+	}
+	while(isdigit((unsigned char)format[i])) {
+		i++;
+	}
+	if(format[i] == '.') {
+		i++;
+		if(format[i] == '*') {
+			spec->stars++;
+			i++;
+		}
+		while(isdigit((unsigned char)format[i])) {
+			i++;
+		}
+	}
+
+	spec->modifier = i;
+	switch(format[i]) {
+		case 'h':
+			spec->length = BINLOG_LEN_H;
+			if(format[++i] == 'h') {
+				spec->length = BINLOG_LEN_HH;
+				i++;
+			}
+		break;
+		case 'l':
+			spec->length = BINLOG_LEN_L;
+			if(format[++i] == 'l') {
+				spec->length = BINLOG_LEN_LL;
+				i++;
+			}
+		break;
+		case 'q':
+			spec->length = BINLOG_LEN_LL;
+			i++;
+		break;
+		case 'j':
+			spec->length = BINLOG_LEN_J;
+			i++;
+		break;
+		case 'z':
+			spec->length = BINLOG_LEN_Z;
+			i++;
+		break;
+		case 't':
+			spec->length = BINLOG_LEN_T;
+			i++;
+		break;
+		case 'L':
+			spec->length = BINLOG_LEN_LD;
+			i++;
+		break;
+		default:
+		break;
+	}
+
+	/* %n and wide strings can not be stored */
+	if(format[i] == '\0' || strchr("diouxXcsfFeEgGaAp%", format[i]) == NULL) {
+		return -1;
+	}
+	if(format[i] == 's' && spec->length != BINLOG_LEN_NONE) {
+		return -1;
+	}
+	spec->conv = format[i];
+	spec->len = i+1;
+	return 0;
+}
+
+static int binlog_put(char *buf, size_t size, size_t *pos, char tag, const void *value) {
+	if(*pos+9 > size) {
+		return -1;
+	}
+	buf[(*pos)++] = tag;
+	memcpy(&buf[*pos], value, 8);
+	*pos += 8;
+	return 0;
+}
+
+static int binlog_put_string(char *buf, size_t size, size_t *pos, const char *str) {
+	uint16_t len = 0;
+	size_t n = 0;
+
+	if(str == NULL) {
+		str = "(null)";
+	}
+	if(*pos+3 > size) {
+		return -1;
+	}
+	/* Long strings are cut off rather than dropping the message */
+	n = strlen(str);
+	if(n > BINLOG_STRING_MAX) {
+		n = BINLOG_STRING_MAX;
+	}
+	if(n > size-*pos-3) {
+		n = size-*pos-3;
+	}
+	len = (uint16_t)n;
+	buf[(*pos)++] = BINLOG_STRING;
+	memcpy(&buf[*pos], &len, 2);
+	memcpy(&buf[*pos+2], str, n);
+	*pos += 2+n;
+	return 0;
+}
+
+static int binlog_put_arg(char *buf, size_t size, size_t *pos, struct binlog_spec_t *spec, va_list *ap) {
+	int64_t i = 0;
+	uint64_t u = 0;
+	double d = 0.0;
+
+	switch(spec->conv) {
+		case 'd':
+		case 'i':
+			switch(spec->length) {
+				case BINLOG_LEN_HH: i = (signed char)va_arg(*ap, int); break;
+				case BINLOG_LEN_H: i = (short)va_arg(*ap, int); break;
+				case BINLOG_LEN_L: i = va_arg(*ap, long); break;
+				case BINLOG_LEN_LL: i = va_arg(*ap, long long); break;
+				case BINLOG_LEN_J: i = va_arg(*ap, intmax_t); break;
+				case BINLOG_LEN_Z: i = (int64_t)va_arg(*ap, size_t); break;
+				case BINLOG_LEN_T: i = va_arg(*ap, ptrdiff_t); break;
+				default: i = va_arg(*ap, int); break;
+			}
+			return binlog_put(buf, size, pos, BINLOG_INT, &i);
+		case 'c':
+			i = va_arg(*ap, int);
+			return binlog_put(buf, size, pos, BINLOG_INT, &i);
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			switch(spec->length) {
+				case BINLOG_LEN_HH: u = (unsigned char)va_arg(*ap, unsigned int); break;
+				case BINLOG_LEN_H: u = (unsigned short)va_arg(*ap, unsigned int); break;
+				case BINLOG_LEN_L: u = va_arg(*ap, unsigned long); break;
+				case BINLOG_LEN_LL: u = va_arg(*ap, unsigned long long); break;
+				case BINLOG_LEN_J: u = va_arg(*ap, uintmax_t); break;
+				case BINLOG_LEN_Z: u = va_arg(*ap, size_t); break;
+				case BINLOG_LEN_T: u = (uint64_t)va_arg(*ap, ptrdiff_t); break;
+				default: u = va_arg(*ap, unsigned int); break;
+			}
+			return binlog_put(buf, size, pos, BINLOG_UINT, &u);
+		case 'p':
+			u = (uint64_t)(uintptr_t)va_arg(*ap, void *);
+			return binlog_put(buf, size, pos, BINLOG_POINTER, &u);
+		case 's':
+			return binlog_put_string(buf, size, pos, va_arg(*ap, char *));
+		case '%':
+			return 0;
+		default:
+			if(spec->length == BINLOG_LEN_LD) {
+				d = (double)va_arg(*ap, long double);
+			} else {
+				d = va_arg(*ap, double);
+			}
+			return binlog_put(buf, size, pos, BINLOG_DOUBLE, &d);
+	}
+}
+
+/*
+ * Returns the id of a format, 0 when the table is full. New
+ * formats, and those not yet written to the current file, have
+ * to be defined in front of the entry.
+ */
+static uint32_t binlog_lookup(const char *format, int *define) {
+	struct binlog_format_t *node = NULL;
+	uint32_t hash = 2166136261U;
+	unsigned int i = 0, n = 0, state = 0;
+	size_t x = 0;
+
+	for(x=0;format[x] != '\0';x++) {
+		hash = (hash ^ (unsigned char)format[x]) * 16777619U;
+	}
+
+	i = hash % BINLOG_FORMATS;
+	for(n=0;n<BINLOG_FORMATS;n++,i=(i+1) % BINLOG_FORMATS) {
+		node = &formats[i];
+		state = __sync_add_and_fetch(&node->state, 0);
+		if(state == BINLOG_FREE && __sync_bool_compare_and_swap(&node->state, BINLOG_FREE, BINLOG_CLAIMED)) {
+			if((node->format = MALLOC(x+1)) == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+			memcpy(node->format, format, x+1);
+			node->hash = hash;
+			__sync_synchronize();
+			node->state = BINLOG_READY;
+			*define = 1;
+			return i+1;
+		}
+		/* A format claimed by another thread at the same time ends up twice */
+		if(state == BINLOG_READY && node->hash == hash && strcmp(node->format, format) == 0) {
+			*define = (__sync_add_and_fetch(&node->published, 0) == 0);
+			return i+1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Encodes an entry record, preceded by the definition of its
+ * format when needed. Returns the length of the records, or -1
+ * when the message can not be stored in the buffer, after which
+ * the caller logs the formatted line as a single string.
+ */
+int binlog_encode(char *buf, size_t size, int prio, const char *format, va_list ap) {
+	struct binlog_spec_t spec;
+	va_list cpy;
+	uint64_t ts = uv_hrtime();
+	uint32_t id = 0;
+	uint16_t len = 0;
+	size_t pos = BINLOG_RECORD+13, i = 0, flen = 0;
+	int define = 0, n = 0;
+
+	if(size < pos || size > 0xFFFF) {
+		return -1;
+	}
+
+	va_copy(cpy, ap);
+	for(i=0;format[i] != '\0';i++) {
+		if(format[i] != '%') {
+			continue;
+		}
+		if(binlog_spec(&format[i], &spec) == -1) {
+			va_end(cpy);
+			return -1;
+		}
+		for(n=0;n<spec.stars;n++) {
+			int64_t value = va_arg(cpy, int);
+			if(binlog_put(buf, size, &pos, BINLOG_INT, &value) == -1) {
+				va_end(cpy);
+				return -1;
+			}
+		}
+		if(binlog_put_arg(buf, size, &pos, &spec, &cpy) == -1) {
+			va_end(cpy);
+			return -1;
+		}
+		i += spec.len-1;
+	}
+	va_end(cpy);
+
+	if((id = binlog_lookup(format, &define)) == 0) {
+		return -1;
+	}
+
+	buf[0] = BINLOG_ENTRY;
+	len = (uint16_t)(pos-BINLOG_RECORD);
+	memcpy(&buf[1], &len, 2);
+	memcpy(&buf[3], &ts, 8);
+	buf[11] = (char)prio;
+	memcpy(&buf[12], &id, 4);
+
+	if(define == 1) {
+		flen = BINLOG_RECORD+4+i;
+		if(pos+flen > size) {
+			return -1;
+		}
+		memmove(&buf[flen], buf, pos);
+		buf[0] = BINLOG_FORMAT;
+		len = (uint16_t)(flen-BINLOG_RECORD);
+		memcpy(&buf[1], &len, 2);
+		memcpy(&buf[3], &id, 4);
+		memcpy(&buf[7], format, i);
+		pos += flen;
+	}
+
+	return (int)pos;
+}
+
+/*
+ * Called for every record that was queued, so others stop
+ * defining that format.
+ */
+void binlog_published(const char *buf) {
+	uint32_t id = 0;
+
+	if(buf[0] == BINLOG_FORMAT) {
+		memcpy(&id, &buf[3], 4);
+		if(id > 0 && id <= BINLOG_FORMATS) {
+			__sync_lock_test_and_set(&formats[id-1].published, 1);
+		}
+	}
+}
+
+/*
+ * The header and all known formats, written at the start of
+ * every file the daemon opens. The caller frees the buffer.
+ */
+int binlog_preamble(char **buf, size_t *len, const char *name) {
+	struct timeval tv;
+	uint64_t realtime = 0, ts = uv_hrtime();
+	uint32_t id = 0;
+	uint16_t n = 0;
+	size_t size = BINLOG_RECORD+16+strlen(name), pos = 0, x = 0;
+	unsigned int i = 0;
+
+	gettimeofday(&tv, NULL);
+	realtime = (uint64_t)tv.tv_sec*1000000+(uint64_t)tv.tv_usec;
+
+	for(i=0;i<BINLOG_FORMATS;i++) {
+		if(__sync_add_and_fetch(&formats[i].state, 0) == BINLOG_READY) {
+			size += BINLOG_RECORD+4+strlen(formats[i].format);
+		}
+	}
+	if((*buf = MALLOC(size)) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	(*buf)[pos] = BINLOG_HEADER;
+	n = (uint16_t)(16+strlen(name));
+	memcpy(&(*buf)[pos+1], &n, 2);
+	memcpy(&(*buf)[pos+3], &realtime, 8);
+	memcpy(&(*buf)[pos+11], &ts, 8);
+	memcpy(&(*buf)[pos+19], name, strlen(name));
+	pos += BINLOG_RECORD+n;
+
+	/* Formats added meanwhile are defined by their first entry */
+	for(i=0;i<BINLOG_FORMATS && pos < size;i++) {
+		if(__sync_add_and_fetch(&formats[i].state, 0) != BINLOG_READY) {
+			continue;
+		}
+		x = strlen(formats[i].format);
+		if(pos+BINLOG_RECORD+4+x > size) {
+			break;
+		}
+		id = i+1;
+		n = (uint16_t)(4+x);
+		(*buf)[pos] = BINLOG_FORMAT;
+		memcpy(&(*buf)[pos+1], &n, 2);
+		memcpy(&(*buf)[pos+3], &id, 4);
+		memcpy(&(*buf)[pos+7], formats[i].format, x);
+		pos += BINLOG_RECORD+n;
+		__sync_lock_test_and_set(&formats[i].published, 1);
+	}
+
+	*len = pos;
+	return 0;
+}
+
+static int binlog_get(const char *args, size_t len, size_t *pos, char *tag, uint64_t *value, const char **str) {
+	uint16_t n = 0;
+
+	if(*pos+1 > len) {
+		return -1;
+	}
+	*tag = args[(*pos)++];
+	if(*tag == BINLOG_STRING) {
+		if(*pos+2 > len) {
+			return -1;
+		}
+		memcpy(&n, &args[*pos], 2);
+		if(*pos+2+n > len) {
+			return -1;
+		}
+		*str = &args[*pos+2];
+		*value = n;
+		*pos += 2+n;
+		return 0;
+	}
+	if(*pos+8 > len) {
+		return -1;
+	}
+	memcpy(value, &args[*pos], 8);
+	*pos += 8;
+	return 0;
+}
+
+#define BINLOG_PRINT(fmt, value) \
+	((spec.stars == 0) ? snprintf(&out[o], size-o, fmt, value) : \
+	 (spec.stars == 1) ? snprintf(&out[o], size-o, fmt, stars[0], value) : \
+	 snprintf(&out[o], size-o, fmt, stars[0], stars[1], value))
+
+/*
+ * Renders the arguments of an entry with its format the same
+ * way printf would have. Returns the length of the line, or -1
+ * when the arguments do not match the format.
+ */
+int binlog_render(const char *format, const char *args, size_t len, char *out, size_t size) {
+	struct binlog_spec_t spec;
+	const char *str = NULL;
+	char fmt[BINLOG_SPEC_MAX+4], tmp[BINLOG_STRING_MAX+1];
+	uint64_t value = 0;
+	double d = 0.0;
+	size_t i = 0, o = 0, pos = 0;
+	int stars[2], n = 0, x = 0;
+	char tag = 0;
+
+	if(size == 0) {
+		return -1;
+	}
+
+	while(format[i] != '\0' && o+1 < size) {
+		if(format[i] != '%') {
+			out[o++] = format[i++];
+			continue;
+		}
+		if(binlog_spec(&format[i], &spec) == -1 || spec.modifier > BINLOG_SPEC_MAX) {
+			return -1;
+		}
+		if(spec.conv == '%') {
+			out[o++] = '%';
+			i += spec.len;
+			continue;
+		}
+		for(x=0;x<spec.stars;x++) {
+			if(binlog_get(args, len, &pos, &tag, &value, &str) == -1 || tag != BINLOG_INT) {
+				return -1;
+			}
+			stars[x] = (int)(int64_t)value;
+		}
+		if(binlog_get(args, len, &pos, &tag, &value, &str) == -1) {
+			return -1;
+		}
+
+		memcpy(fmt, &format[i], spec.modifier);
+		fmt[spec.modifier] = '\0';
+		switch(spec.conv) {
+			case 'd':
+			case 'i':
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				if(tag != BINLOG_INT && tag != BINLOG_UINT) {
+					return -1;
+				}
+				strcat(fmt, "ll");
+				strncat(fmt, &spec.conv, 1);
+				if(tag == BINLOG_INT) {
+					n = BINLOG_PRINT(fmt, (long long)(int64_t)value);
+				} else {
+					n = BINLOG_PRINT(fmt, (unsigned long long)value);
+				}
+			break;
+			case 'c':
+				if(tag != BINLOG_INT) {
+					return -1;
+				}
+				strcat(fmt, "c");
+				n = BINLOG_PRINT(fmt, (int)(int64_t)value);
+			break;
+			case 's':
+				if(tag != BINLOG_STRING) {
+					return -1;
+				}
+				memcpy(tmp, str, (size_t)value);
+				tmp[value] = '\0';
+				strcat(fmt, "s");
+				n = BINLOG_PRINT(fmt, tmp);
+			break;
+			case 'p':
+				if(tag != BINLOG_POINTER) {
+					return -1;
+				}
+				strcat(fmt, "p");
+				n = BINLOG_PRINT(fmt, (void *)(uintptr_t)value);
+			break;
+			default:
+				if(tag != BINLOG_DOUBLE) {
+					return -1;
+				}
+				memcpy(&d, &value, 8);
+				strncat(fmt, &spec.conv, 1);
+				n = BINLOG_PRINT(fmt, d);
+			break;
+		}
+		if(n < 0) {
+			return -1;
+		}
+		o += (size_t)n;
+		if(o >= size) {
+			o = size-1;
+			break;
+		}
+		i += spec.len;
+	}
+	out[o] = '\0';
+
+	return (int)o;
+}
+
+void binlog_gc(void) {
+	int i = 0;
+
+	for(i=0;i<BINLOG_FORMATS;i++) {
+		if(formats[i].format != NULL) {
+			FREE(formats[i].format);
+		}
+		formats[i].format = NULL;
+		formats[i].state = BINLOG_FREE;
+		formats[i].published = 0;
+	}
+}
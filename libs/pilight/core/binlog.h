@@ -0,0 +1,38 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _BINLOG_H_
+#define _BINLOG_H_
+
+#include <stdarg.h>
+#include <stdint.h>
+
+#define BINLOG_MAGIC			"PLB1"
+#define BINLOG_MAGIC_SIZE	4
+/* Written after the magic to recognize the byte order */
+#define BINLOG_ORDER			0x01020304
+
+#define BINLOG_HEADER			'H'
+#define BINLOG_FORMAT			'F'
+#define BINLOG_ENTRY			'E'
+/* Type and length of every record */
+#define BINLOG_RECORD			3
+
+#define BINLOG_INT				'i'
+#define BINLOG_UINT				'u'
+#define BINLOG_DOUBLE			'd'
+#define BINLOG_STRING			's'
+#define BINLOG_POINTER		'p'
+
+int binlog_encode(char *buf, size_t size, int prio, const char *format, va_list ap);
+void binlog_published(const char *buf);
+int binlog_preamble(char **buf, size_t *len, const char *name);
+int binlog_render(const char *format, const char *args, size_t len, char *out, size_t size);
+void binlog_gc(void);
+
+#endif
@@ -0,0 +1,295 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * A compact file of received pulse trains. After a header with
+ * the time of the first train, every train is written as:
+ *
+ * - the milliseconds since the previous train
+ * - the hardware type
+ * - the number of pulses
+ * - each pulse as the difference with the one before it
+ *
+ * All as varints, the signed ones zigzag encoded. A train of
+ * fifty pulses mostly takes less than a hundred bytes this way.
+ * A capture is mapped in memory for replay, so even long ones
+ * aren't read into a buffer first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "mem.h"
+#include "log.h"
+#include "capture.h"
+
+/* A varint of a 64 bits value takes at most ten bytes */
+#define CAPTURE_VARINT	10
+
+static FILE *capture_fp = NULL;
+static uint64_t capture_last = 0;
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t capture_now(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec*1000 + (uint64_t)tv.tv_usec/1000;
+}
+
+static size_t varint_put(unsigned char *buf, uint64_t value) {
+	size_t n = 0;
+
+	while(value >= 0x80) {
+		buf[n++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	buf[n++] = (unsigned char)value;
+	return n;
+}
+
+static uint64_t zigzag(int64_t value) {
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static int64_t unzigzag(uint64_t value) {
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+/*
+ * Start writing the received trains to a new capture file,
+ * any file of the same name is replaced.
+ */
+int capture_start(const char *file) {
+	unsigned char header[CAPTURE_HEADER];
+	int i = 0;
+
+	pthread_mutex_lock(&capture_lock);
+	if(capture_fp != NULL) {
+		pthread_mutex_unlock(&capture_lock);
+		return 0;
+	}
+	if((capture_fp = fopen(file, "wb")) == NULL) {
+		pthread_mutex_unlock(&capture_lock);
+		logprintf(LOG_ERR, "cannot write capture %s: %s", file, strerror(errno));
+		return -1;
+	}
+
+	capture_last = capture_now();
+	memset(header, 0, sizeof(header));
+	memcpy(header, CAPTURE_MAGIC, 4);
+	header[4] = CAPTURE_VERSION;
+	for(i=0;i<8;i++) {
+		header[8+i] = (unsigned char)(capture_last >> (i*8));
+	}
+	fwrite(header, 1, sizeof(header), capture_fp);
+	pthread_mutex_unlock(&capture_lock);
+
+	logprintf(LOG_INFO, "capturing received pulse trains to %s", file);
+	return 0;
+}
+
+void capture_write(int hwtype, const int *pulses, int length) {
+	unsigned char buf[CAPTURE_VARINT*(MAXPULSESTREAMLENGTH+3)];
+	uint64_t now = 0;
+	size_t n = 0;
+	int i = 0, prev = 0;
+
+	if(capture_fp == NULL || length <= 0) {
+		return;
+	}
+	if(length > MAXPULSESTREAMLENGTH) {
+		length = MAXPULSESTREAMLENGTH;
+	}
+
+	pthread_mutex_lock(&capture_lock);
+	if(capture_fp == NULL) {
+		pthread_mutex_unlock(&capture_lock);
+		return;
+	}
+	now = capture_now();
+	/* The clock can be set back in between */
+	n += varint_put(&buf[n], (now > capture_last) ? now-capture_last : 0);
+	if(now > capture_last) {
+		capture_last = now;
+	}
+	n += varint_put(&buf[n], zigzag(hwtype));
+	n += varint_put(&buf[n], (uint64_t)length);
+	for(i=0;i<length;i++) {
+		n += varint_put(&buf[n], zigzag((int64_t)pulses[i]-prev));
+		prev = pulses[i];
+	}
+	fwrite(buf, 1, n, capture_fp);
+	pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_stop(void) {
+	pthread_mutex_lock(&capture_lock);
+	if(capture_fp != NULL) {
+		fclose(capture_fp);
+		capture_fp = NULL;
+	}
+	pthread_mutex_unlock(&capture_lock);
+}
+
+int capture_running(void) {
+	return (capture_fp != NULL);
+}
+
+int capture_open(struct capture_t *capture, const char *file) {
+	unsigned char *data = NULL;
+	size_t size = 0;
+	int i = 0;
+
+	memset(capture, 0, sizeof(struct capture_t));
+
+#ifdef _WIN32
+	FILE *fp = NULL;
+	long len = 0;
+
+	if((fp = fopen(file, "rb")) == NULL) {
+		logprintf(LOG_ERR, "cannot read capture %s: %s", file, strerror(errno));
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	if(len < CAPTURE_HEADER) {
+		fclose(fp);
+		logprintf(LOG_ERR, "%s is not a pilight capture", file);
+		return -1;
+	}
+	size = (size_t)len;
+	if((data = MALLOC(size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if(fread(data, 1, size, fp) != size) {
+		fclose(fp);
+		FREE(data);
+		logprintf(LOG_ERR, "cannot read capture %s", file);
+		return -1;
+	}
+	fclose(fp);
+#else
+	struct stat st;
+	int fd = -1;
+
+	if((fd = open(file, O_RDONLY)) < 0) {
+		logprintf(LOG_ERR, "cannot read capture %s: %s", file, strerror(errno));
+		return -1;
+	}
+	if(fstat(fd, &st) != 0 || st.st_size < CAPTURE_HEADER) {
+		close(fd);
+		logprintf(LOG_ERR, "%s is not a pilight capture", file);
+		return -1;
+	}
+	size = (size_t)st.st_size;
+	data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(data == MAP_FAILED) {
+		logprintf(LOG_ERR, "cannot map capture %s: %s", file, strerror(errno));
+		return -1;
+	}
+	capture->mapped = 1;
+#endif
+
+	capture->data = data;
+	capture->size = size;
+
+	if(memcmp(data, CAPTURE_MAGIC, 4) != 0 || data[4] != CAPTURE_VERSION) {
+		logprintf(LOG_ERR, "%s is not a pilight capture", file);
+		capture_close(capture);
+		return -1;
+	}
+	for(i=0;i<8;i++) {
+		capture->stamp |= (uint64_t)data[8+i] << (i*8);
+	}
+	capture->pos = CAPTURE_HEADER;
+
+	return 0;
+}
+
+static int varint_get(struct capture_t *capture, uint64_t *value) {
+	unsigned int shift = 0;
+	unsigned char c = 0;
+
+	*value = 0;
+	do {
+		if(capture->pos >= capture->size || shift >= 64) {
+			return -1;
+		}
+		c = capture->data[capture->pos++];
+		*value |= (uint64_t)(c & 0x7f) << shift;
+		shift += 7;
+	} while(c & 0x80);
+
+	return 0;
+}
+
+/*
+ * Returns 1 with the next train, 0 at the end of the capture
+ * and -1 when the rest of the capture is damaged. A capture
+ * cut short by a crash ends in a partly written train, that is
+ * taken as the end.
+ */
+int capture_next(struct capture_t *capture, struct capture_train_t *train) {
+	uint64_t delta = 0, hwtype = 0, length = 0, pulse = 0;
+	int i = 0, prev = 0;
+
+	if(capture->pos >= capture->size) {
+		return 0;
+	}
+	if(varint_get(capture, &delta) != 0 || varint_get(capture, &hwtype) != 0 ||
+	   varint_get(capture, &length) != 0) {
+		capture->pos = capture->size;
+		return 0;
+	}
+	if(length == 0 || length > MAXPULSESTREAMLENGTH) {
+		capture->pos = capture->size;
+		return -1;
+	}
+
+	capture->stamp += delta;
+	train->stamp = capture->stamp;
+	train->hwtype = (int)unzigzag(hwtype);
+	train->length = (int)length;
+	for(i=0;i<train->length;i++) {
+		if(varint_get(capture, &pulse) != 0) {
+			capture->pos = capture->size;
+			return 0;
+		}
+		prev += (int)unzigzag(pulse);
+		train->pulses[i] = prev;
+	}
+
+	return 1;
+}
+
+void capture_close(struct capture_t *capture) {
+	if(capture->data != NULL) {
+#ifdef _WIN32
+		unsigned char *data = (unsigned char *)capture->data;
+		FREE(data);
+#else
+		if(capture->mapped == 1) {
+			munmap((void *)capture->data, capture->size);
+		}
+#endif
+	}
+	memset(capture, 0, sizeof(struct capture_t));
+}
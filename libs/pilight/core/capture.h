@@ -0,0 +1,47 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "defines.h"
+
+#define CAPTURE_MAGIC		"PLCP"
+#define CAPTURE_VERSION	1
+/* Magic, version, three reserved bytes and the timestamp base */
+#define CAPTURE_HEADER	16
+
+typedef struct capture_t {
+	const unsigned char *data;
+	size_t size;
+	size_t pos;
+	uint64_t stamp;
+	int mapped;
+} capture_t;
+
+typedef struct capture_train_t {
+	/* Milliseconds since the epoch */
+	uint64_t stamp;
+	int hwtype;
+	int length;
+	int pulses[MAXPULSESTREAMLENGTH];
+} capture_train_t;
+
+int capture_start(const char *file);
+void capture_write(int hwtype, const int *pulses, int length);
+void capture_stop(void);
+int capture_running(void);
+
+int capture_open(struct capture_t *capture, const char *file);
+int capture_next(struct capture_t *capture, struct capture_train_t *train);
+void capture_close(struct capture_t *capture);
+
+#endif
@@ -153,6 +153,83 @@ unsigned int explode(const char *str, const char *delimiter, char ***output) {
 	return n;
 }
 
+/*
+ * Splits like explode, but the parts are spans of the original
+ * string, so nothing is allocated or copied. Start with span_init
+ * on the string and call span_next until it returns 0. Empty
+ * parts are skipped, just as explode does.
+ */
+void span_init(struct span_t *rest, const char *str) {
+	rest->ptr = str;
+	rest->len = (str != NULL) ? strlen(str) : 0;
+}
+
+int span_next(struct span_t *rest, const char *delimiter, struct span_t *out) {
+	size_t p = strlen(delimiter), i = 0;
+
+	while(rest->len > 0) {
+		if(p > 0 && rest->len >= p && strncmp(rest->ptr, delimiter, p) == 0) {
+			rest->ptr += p;
+			rest->len -= p;
+			continue;
+		}
+		for(i=0;i<rest->len;i++) {
+			if(p > 0 && rest->len-i >= p && strncmp(&rest->ptr[i], delimiter, p) == 0) {
+				break;
+			}
+		}
+		out->ptr = rest->ptr;
+		out->len = i;
+		/* The delimiter is consumed as well, see span_terminate */
+		if(i < rest->len) {
+			i += p;
+		}
+		rest->ptr += i;
+		rest->len -= i;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Splits a span in exactly two parts, like a key=value pair.
+ * Returns -1 when it has fewer or more parts.
+ */
+int span_pair(const struct span_t *span, const char *delimiter, struct span_t *first, struct span_t *second) {
+	struct span_t rest = *span, extra;
+
+	if(span_next(&rest, delimiter, first) == 1 &&
+	   span_next(&rest, delimiter, second) == 1 &&
+	   span_next(&rest, delimiter, &extra) == 0) {
+		return 0;
+	}
+	return -1;
+}
+
+/* The number of parts explode would return */
+unsigned int span_count(const char *str, const char *delimiter) {
+	struct span_t rest, part;
+	unsigned int n = 0;
+
+	span_init(&rest, str);
+	while(span_next(&rest, delimiter, &part) == 1) {
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Terminates the span in place, so only for spans of a
+ * writable string. This overwrites the delimiter span_next
+ * consumed after it, or the end of the string.
+ */
+char *span_terminate(struct span_t *span) {
+	char *str = (char *)span->ptr;
+
+	str[span->len] = '\0';
+	return str;
+}
+
 #ifdef _WIN32
 int check_instances(const wchar_t *prog) {
 	HANDLE m_hStartEvent = CreateEventW(NULL, FALSE, FALSE, prog);
@@ -256,123 +333,233 @@ int isrunning(const char *program, int **ret) {
 }
 #endif
 
-#ifdef __FreeBSD__
-int findproc(char *cmd, char *args, int loosely, int **ret) {
-#else
-pid_t findproc(char *cmd, char *args, int loosely, int **ret) {
-#endif
-
 #ifndef _WIN32
+/*
+ * A snapshot of the command lines in /proc, shared by all
+ * callers of findproc. It is read again when it is older than
+ * PROC_CACHE_INTERVAL ms, so several devices that poll for their
+ * program in the same second share a single scan.
+ */
+#define PROC_CACHE_INTERVAL	1000
+#define PROC_CACHE_HASH			64
+
+typedef struct proc_entry_t {
+	pid_t pid;
+	char *cmd;
+	/* The arguments joined by spaces, NULL if there are none */
+	char *args;
+	int next;
+} proc_entry_t;
+
+static struct {
+	struct proc_entry_t *entries;
+	int nr;
+	int size;
+	int hash[PROC_CACHE_HASH];
+	uint64_t stamp;
+	int valid;
+} proc_cache;
+
+static pthread_mutex_t proc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t proc_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000 + (uint64_t)ts.tv_nsec/1000000;
+}
+
+static void proc_cache_free(void) {
+	int i = 0;
+
+	for(i=0;i<proc_cache.nr;i++) {
+		FREE(proc_cache.entries[i].cmd);
+		if(proc_cache.entries[i].args != NULL) {
+			FREE(proc_cache.entries[i].args);
+		}
+	}
+	proc_cache.nr = 0;
+	for(i=0;i<PROC_CACHE_HASH;i++) {
+		proc_cache.hash[i] = -1;
+	}
+}
+
+static int proc_mounted(void) {
 	DIR* dir;
 	struct dirent* ent;
-	char fname[512], cmdline[1024];
-	int fd = 0, ptr = 0, match = 0, i = 0, y = '\n', x = 0, nr = 0;
+	int i = 0;
 
-	if(procmounted == 0) {
-		if((dir = opendir("/proc"))) {
-			i = 0;
-			while((ent = readdir(dir)) != NULL) {
-				i++;
-			}
-			closedir(dir);
-			if(i == 2) {
+	if(procmounted == 1) {
+		return 0;
+	}
+	if((dir = opendir("/proc"))) {
+		i = 0;
+		while((ent = readdir(dir)) != NULL) {
+			i++;
+		}
+		closedir(dir);
+		if(i == 2) {
 #ifdef __FreeBSD__
-				mount("procfs", "/proc", 0, "");
+			mount("procfs", "/proc", 0, "");
 #else
-				mount("proc", "/proc", "procfs", 0, "");
+			mount("proc", "/proc", "procfs", 0, "");
 #endif
-				if((dir = opendir("/proc"))) {
-					i = 0;
-					while((ent = readdir(dir)) != NULL) {
-						i++;
-					}
-					closedir(dir);
-					if(i == 2) {
-						logprintf(LOG_ERR, "/proc filesystem not properly mounted");
-						return -1;
-					}
+			if((dir = opendir("/proc"))) {
+				i = 0;
+				while((ent = readdir(dir)) != NULL) {
+					i++;
+				}
+				closedir(dir);
+				if(i == 2) {
+					logprintf(LOG_ERR, "/proc filesystem not properly mounted");
+					return -1;
 				}
 			}
-		} else {
-			logprintf(LOG_ERR, "/proc filesystem not properly mounted");
-			return -1;
 		}
-		procmounted = 1;
+	} else {
+		logprintf(LOG_ERR, "/proc filesystem not properly mounted");
+		return -1;
 	}
+	procmounted = 1;
+	return 0;
+}
+
+static void proc_cache_refresh(void) {
+	struct proc_entry_t *entry = NULL;
+	struct dirent* ent;
+	DIR* dir;
+	char fname[512], cmdline[1024];
+	unsigned int bucket = 0;
+	int fd = 0, ptr = 0, i = 0, len = 0;
+
+	proc_cache_free();
+
 	if((dir = opendir("/proc"))) {
 		while((ent = readdir(dir)) != NULL) {
-			if(isNumeric(ent->d_name) == 0) {
-				snprintf(fname, 512, "/proc/%s/cmdline", ent->d_name);
-				if((fd = open(fname, O_RDONLY, 0)) > -1) {
-					memset(cmdline, '\0', sizeof(cmdline));
-					if((ptr = (int)read(fd, cmdline, sizeof(cmdline)-1)) > -1) {
-						i = 0, match = 0, y = '\n';
-						/* Replace all NULL terminators for newlines */
-						for(i=0;i<ptr-1;i++) {
-							if(i < ptr && cmdline[i] == '\0') {
-								cmdline[i] = (char)y;
-								y = ' ';
-							}
-						}
-
-						match = 0;
-						/* Check if program matches */
-						char **array = NULL;
-						unsigned int n = explode(cmdline, "\n", &array);
-
-						if(n == 0) {
-							close(fd);
-							continue;
-						}
-						if((strcmp(array[0], cmd) == 0 && loosely == 0)
-							 || (strstr(array[0], cmd) != NULL && loosely == 1)) {
-							match++;
-						}
-
-						if(args != NULL && match == 1) {
-							if(n <= 1) {
-								close(fd);
-								for(x=0;x<n;x++) {
-									FREE(array[x]);
-								}
-								if(n > 0) {
-									FREE(array);
-								}
-								continue;
-							}
-							if(strcmp(array[1], args) == 0) {
-								match++;
-							}
-
-							if(match == 2) {
-								pid_t pid = (pid_t)atol(ent->d_name);
-								if(((*ret) = REALLOC((*ret), (nr+1)*sizeof(int *))) == NULL) {
-									OUT_OF_MEMORY
-								}
-								(*ret)[nr] = (int)pid;
-								nr++;
-							}
-						} else if(match > 0) {
-							pid_t pid = (pid_t)atol(ent->d_name);
-							if(((*ret) = REALLOC((*ret), (nr+1)*sizeof(int *))) == NULL) {
-								OUT_OF_MEMORY
-							}
-							(*ret)[nr] = (int)pid;
-							nr++;
-						}
-						for(x=0;x<n;x++) {
-							FREE(array[x]);
-						}
-						if(n > 0) {
-							FREE(array);
-						}
-					}
-					close(fd);
+			if(isNumeric(ent->d_name) != 0) {
+				continue;
+			}
+			snprintf(fname, 512, "/proc/%s/cmdline", ent->d_name);
+			if((fd = open(fname, O_RDONLY, 0)) < 0) {
+				continue;
+			}
+			memset(cmdline, '\0', sizeof(cmdline));
+			ptr = (int)read(fd, cmdline, sizeof(cmdline)-1);
+			close(fd);
+			if(ptr <= 0 || cmdline[0] == '\0') {
+				continue;
+			}
+
+			/* Everything after the command itself are the arguments */
+			len = (int)strlen(cmdline);
+			for(i=len+1;i<ptr-1;i++) {
+				if(cmdline[i] == '\0') {
+					cmdline[i] = ' ';
+				}
+			}
+
+			if(proc_cache.nr == proc_cache.size) {
+				proc_cache.size = (proc_cache.size == 0) ? 128 : proc_cache.size*2;
+				if((proc_cache.entries = REALLOC(proc_cache.entries, sizeof(struct proc_entry_t)*(size_t)proc_cache.size)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 				}
 			}
+			entry = &proc_cache.entries[proc_cache.nr];
+			entry->pid = (pid_t)atol(ent->d_name);
+			if((entry->cmd = STRDUP(cmdline)) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			entry->args = NULL;
+			if(len+1 < ptr && cmdline[len+1] != '\0') {
+				if((entry->args = STRDUP(&cmdline[len+1])) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+			}
+			bucket = strhash(entry->cmd) % PROC_CACHE_HASH;
+			entry->next = proc_cache.hash[bucket];
+			proc_cache.hash[bucket] = proc_cache.nr;
+			proc_cache.nr++;
 		}
 		closedir(dir);
 	}
+
+	proc_cache.stamp = proc_now();
+	proc_cache.valid = 1;
+}
+
+static int proc_match(struct proc_entry_t *entry, char *args, int **ret, int nr) {
+	if(args != NULL && (entry->args == NULL || strcmp(entry->args, args) != 0)) {
+		return nr;
+	}
+	if(((*ret) = REALLOC((*ret), (nr+1)*sizeof(int *))) == NULL) {
+		OUT_OF_MEMORY
+	}
+	(*ret)[nr] = (int)entry->pid;
+	return nr+1;
+}
+
+/*
+ * Makes the next findproc read /proc again, for when a caller
+ * knows a process was just started or stopped.
+ */
+void proc_cache_clear(void) {
+	pthread_mutex_lock(&proc_lock);
+	proc_cache.valid = 0;
+	pthread_mutex_unlock(&proc_lock);
+}
+
+void proc_cache_gc(void) {
+	pthread_mutex_lock(&proc_lock);
+	proc_cache_free();
+	if(proc_cache.entries != NULL) {
+		FREE(proc_cache.entries);
+	}
+	proc_cache.size = 0;
+	proc_cache.valid = 0;
+	pthread_mutex_unlock(&proc_lock);
+}
+#endif
+
+#ifdef __FreeBSD__
+int findproc(char *cmd, char *args, int loosely, int **ret) {
+#else
+pid_t findproc(char *cmd, char *args, int loosely, int **ret) {
+#endif
+	int nr = 0;
+
+#ifndef _WIN32
+	int i = 0;
+
+	pthread_mutex_lock(&proc_lock);
+	if(proc_mounted() != 0) {
+		pthread_mutex_unlock(&proc_lock);
+		return -1;
+	}
+	if(proc_cache.valid == 0 || proc_now()-proc_cache.stamp >= PROC_CACHE_INTERVAL) {
+		if(proc_cache.size == 0) {
+			for(i=0;i<PROC_CACHE_HASH;i++) {
+				proc_cache.hash[i] = -1;
+			}
+		}
+		proc_cache_refresh();
+	}
+
+	if(loosely == 0) {
+		i = proc_cache.hash[strhash(cmd) % PROC_CACHE_HASH];
+		while(i > -1) {
+			if(strcmp(proc_cache.entries[i].cmd, cmd) == 0) {
+				nr = proc_match(&proc_cache.entries[i], args, ret, nr);
+			}
+			i = proc_cache.entries[i].next;
+		}
+	} else {
+		for(i=0;i<proc_cache.nr;i++) {
+			if(strstr(proc_cache.entries[i].cmd, cmd) != NULL) {
+				nr = proc_match(&proc_cache.entries[i], args, ret, nr);
+			}
+		}
+	}
+	pthread_mutex_unlock(&proc_lock);
 #endif
 	return nr;
 }
@@ -485,6 +672,11 @@ void alpha_random(char *s, const int len) {
 	s[len] = 0;
 }
 
+/*
+ * Decoding never grows the string, so dec may be s itself.
+ * Returns the decoded length including the terminator, only
+ * that length when dec is NULL.
+ */
 int urldecode(const char *s, char *dec) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -500,7 +692,7 @@ int urldecode(const char *s, char *dec) {
 			return -1;
 		}
 		if(dec) {
-			sprintf(o, "%c", c);
+			*o = (char)c;
 		}
 	}
 
@@ -1145,3 +1337,17 @@ int check_email_addr(const char *address, int allow_lists, int check_domain_can_
 
 	#undef ALPHANUMERICS
 }
+
+/*
+ * Simple djb2 string hash used by the
+ * various lookup indexes.
+ */
+unsigned int strhash(const char *str) {
+	unsigned int hash = 5381;
+	int c = 0;
+
+	while((c = *str++) != '\0') {
+		hash = ((hash << 5) + hash) + (unsigned int)c;
+	}
+	return hash;
+}
@@ -39,6 +39,12 @@ typedef struct varcont_t {
 	int free_;
 } varcont_t;
 
+/* A part of a string, see span_next */
+typedef struct span_t {
+	const char *ptr;
+	size_t len;
+} span_t;
+
 #include "pilight.h"
 
 extern char *progname;
@@ -58,6 +64,11 @@ void atomicinit(void);
 void atomiclock(void);
 void atomicunlock(void);
 unsigned int explode(const char *str, const char *delimiter, char ***output);
+void span_init(struct span_t *rest, const char *str);
+int span_next(struct span_t *rest, const char *delimiter, struct span_t *out);
+int span_pair(const struct span_t *span, const char *delimiter, struct span_t *first, struct span_t *second);
+unsigned int span_count(const char *str, const char *delimiter);
+char *span_terminate(struct span_t *span);
 int isNumeric(char *str);
 int nrDecimals(char *str);
 int name2uid(char const *name);
@@ -76,12 +87,17 @@ char *genuuid(char *ifname);
 int file_exists(char *fil);
 int path_exists(char *fil);
 char *uniq_space(char *str);
+unsigned int strhash(const char *str);
 
 #ifdef __FreeBSD__
 int findproc(char *name, char *args, int loosely, int **ret);
 #else
 pid_t findproc(char *name, char *args, int loosely, int **ret);
 #endif
+#ifndef _WIN32
+void proc_cache_clear(void);
+void proc_cache_gc(void);
+#endif
 
 int vercmp(char *val, char *ref);
 int str_replace(char *search, char *replace, char **str);
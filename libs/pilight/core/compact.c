@@ -0,0 +1,665 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Compact framing of the traffic from a node to its master,
+ * and of the changes masters replicate to each other.
+ * Every frame starts with its type and the length of what
+ * follows, so the master neither has to look for delimiters
+ * nor parse any json. Updates are encoded as a tree of tagged
+ * values, in which numbers are varints and strings are only
+ * sent in full the first time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+
+#include "pilight.h"
+#include "mem.h"
+#include "json.h"
+#include "compact.h"
+
+#define TAG_NULL		0
+#define TAG_FALSE		1
+#define TAG_TRUE		2
+#define TAG_NUMBER	3
+#define TAG_DOUBLE	4
+#define TAG_STRING	5
+#define TAG_ARRAY		6
+#define TAG_OBJECT	7
+
+/* Json from pilight is never nested this deep */
+#define COMPACT_DEPTH	32
+
+typedef struct compact_reader_t {
+	const unsigned char *p;
+	const unsigned char *end;
+	int error;
+} compact_reader_t;
+
+static const double powers[10] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static unsigned int compact_hash(const char *str, size_t len) {
+	unsigned int hash = 2166136261U;
+	size_t i = 0;
+
+	for(i=0;i<len;i++) {
+		hash ^= (unsigned char)str[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+void compact_dict_clear(struct compact_dict_t *dict) {
+	unsigned int i = 0;
+
+	for(i=0;i<dict->nr;i++) {
+		FREE(dict->strings[i]);
+	}
+	memset(dict, 0, sizeof(struct compact_dict_t));
+}
+
+static int compact_dict_find(struct compact_dict_t *dict, const char *str, size_t len) {
+	unsigned int size = COMPACT_DICT_SIZE*2;
+	unsigned int x = compact_hash(str, len) % size;
+	int i = 0;
+
+	while(dict->hash[x] != 0) {
+		i = dict->hash[x]-1;
+		if(strlen(dict->strings[i]) == len && memcmp(dict->strings[i], str, len) == 0) {
+			return i;
+		}
+		x = (x + 1) % size;
+	}
+	return -1;
+}
+
+/*
+ * Both ends call this for every string sent in full, so
+ * their dictionaries stay the same.
+ */
+static void compact_dict_add(struct compact_dict_t *dict, const char *str, size_t len) {
+	unsigned int size = COMPACT_DICT_SIZE*2;
+	unsigned int x = 0;
+
+	if(len > COMPACT_DICT_STRLEN || dict->nr >= COMPACT_DICT_SIZE) {
+		return;
+	}
+	if((dict->strings[dict->nr] = MALLOC(len+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(dict->strings[dict->nr], str, len);
+	dict->strings[dict->nr][len] = '\0';
+
+	x = compact_hash(str, len) % size;
+	while(dict->hash[x] != 0) {
+		x = (x + 1) % size;
+	}
+	dict->hash[x] = (unsigned short)(dict->nr+1);
+	dict->nr++;
+}
+
+static void compact_reserve(struct compact_buf_t *buf, size_t len) {
+	if(buf->len+len <= buf->size) {
+		return;
+	}
+	while(buf->size < buf->len+len) {
+		buf->size = (buf->size == 0) ? 256 : buf->size*2;
+	}
+	if((buf->data = REALLOC(buf->data, buf->size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+}
+
+static void compact_put(struct compact_buf_t *buf, const void *data, size_t len) {
+	compact_reserve(buf, len);
+	memcpy(&buf->data[buf->len], data, len);
+	buf->len += len;
+}
+
+static void compact_byte(struct compact_buf_t *buf, unsigned char c) {
+	compact_reserve(buf, 1);
+	buf->data[buf->len++] = c;
+}
+
+static void compact_varint(struct compact_buf_t *buf, uint64_t n) {
+	compact_reserve(buf, 10);
+	while(n >= 0x80) {
+		buf->data[buf->len++] = (unsigned char)(n | 0x80);
+		n >>= 7;
+	}
+	buf->data[buf->len++] = (unsigned char)n;
+}
+
+static uint64_t compact_read_varint(struct compact_reader_t *r) {
+	uint64_t n = 0;
+	int shift = 0;
+
+	while(r->p < r->end && shift < 64) {
+		n |= (uint64_t)(*r->p & 0x7f) << shift;
+		if((*r->p++ & 0x80) == 0) {
+			return n;
+		}
+		shift += 7;
+	}
+	r->error = 1;
+	return 0;
+}
+
+static int compact_read_byte(struct compact_reader_t *r) {
+	if(r->p >= r->end) {
+		r->error = 1;
+		return 0;
+	}
+	return *r->p++;
+}
+
+/*
+ * Leave room for the header, which is only known once the
+ * payload has been added.
+ */
+void compact_frame_init(struct compact_buf_t *buf) {
+	buf->len = 0;
+	compact_reserve(buf, COMPACT_HEADER);
+	buf->len = COMPACT_HEADER;
+}
+
+/*
+ * Write the header of a frame with a payload of len bytes
+ * and return its length.
+ */
+size_t compact_header(unsigned char *hdr, int type, size_t len) {
+	size_t n = 1;
+
+	hdr[0] = (unsigned char)type;
+	while(len >= 0x80) {
+		hdr[n++] = (unsigned char)(len | 0x80);
+		len >>= 7;
+	}
+	hdr[n++] = (unsigned char)len;
+
+	return n;
+}
+
+/*
+ * Put the header right in front of the payload and return
+ * where the frame starts.
+ */
+const unsigned char *compact_frame(struct compact_buf_t *buf, int type, size_t *len) {
+	unsigned char hdr[COMPACT_HEADER];
+	size_t n = compact_header(hdr, type, buf->len - COMPACT_HEADER);
+
+	memcpy(&buf->data[COMPACT_HEADER-n], hdr, n);
+	*len = buf->len - (COMPACT_HEADER-n);
+	return &buf->data[COMPACT_HEADER-n];
+}
+
+/*
+ * Returns the length of the header when buf holds a full
+ * frame, 0 when more has to be received first and -1 when
+ * it isn't a valid frame.
+ */
+int compact_frame_parse(const unsigned char *buf, size_t len, int *type, size_t *plen) {
+	size_t n = 1;
+	int shift = 0;
+
+	if(len < 2) {
+		return 0;
+	}
+	*type = buf[0];
+	*plen = 0;
+	while(n < len) {
+		*plen |= (size_t)(buf[n] & 0x7f) << shift;
+		if((buf[n++] & 0x80) == 0) {
+			if(*plen > COMPACT_MAXLEN) {
+				return -1;
+			}
+			return (len-n >= *plen) ? (int)n : 0;
+		}
+		shift += 7;
+		if(n >= COMPACT_HEADER) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void compact_encode_string(struct compact_dict_t *dict, const char *str, struct compact_buf_t *buf) {
+	size_t len = strlen(str);
+	int i = compact_dict_find(dict, str, len);
+
+	if(i > -1) {
+		compact_varint(buf, (uint64_t)i+1);
+	} else {
+		compact_varint(buf, 0);
+		compact_varint(buf, len);
+		compact_put(buf, str, len);
+		compact_dict_add(dict, str, len);
+	}
+}
+
+static void compact_encode_number(struct JsonNode *jnode, struct compact_buf_t *buf) {
+	int decimals = jnode->decimals_;
+	double n = 0.0;
+	int64_t i = 0;
+	uint64_t u = 0;
+
+	/* Most values are integers or have a few decimals */
+	if(decimals >= 0 && decimals < 10) {
+		n = round(jnode->number_ * powers[decimals]);
+		if(fabs(n) < 9007199254740992.0 && n / powers[decimals] == jnode->number_) {
+			i = (int64_t)n;
+			compact_byte(buf, TAG_NUMBER);
+			compact_byte(buf, (unsigned char)decimals);
+			compact_varint(buf, ((uint64_t)i << 1) ^ (uint64_t)(i >> 63));
+			return;
+		}
+	}
+
+	memcpy(&u, &jnode->number_, sizeof(u));
+	compact_byte(buf, TAG_DOUBLE);
+	compact_byte(buf, (unsigned char)((decimals >= 0 && decimals < 256) ? decimals : 0));
+	compact_varint(buf, u);
+}
+
+static void compact_encode_value(struct compact_dict_t *dict, struct JsonNode *jnode, struct compact_buf_t *buf) {
+	struct JsonNode *jchild = NULL;
+	uint64_t count = 0;
+
+	switch(jnode->tag) {
+		case JSON_BOOL:
+			compact_byte(buf, (jnode->bool_ == true) ? TAG_TRUE : TAG_FALSE);
+		break;
+		case JSON_STRING:
+			compact_byte(buf, TAG_STRING);
+			compact_encode_string(dict, jnode->string_, buf);
+		break;
+		case JSON_NUMBER:
+			compact_encode_number(jnode, buf);
+		break;
+		case JSON_ARRAY:
+		case JSON_OBJECT:
+			compact_byte(buf, (jnode->tag == JSON_ARRAY) ? TAG_ARRAY : TAG_OBJECT);
+			count = 0;
+			jchild = json_first_child(jnode);
+			while(jchild) {
+				count++;
+				jchild = jchild->next;
+			}
+			compact_varint(buf, count);
+			jchild = json_first_child(jnode);
+			while(jchild) {
+				if(jnode->tag == JSON_OBJECT) {
+					compact_encode_string(dict, jchild->key, buf);
+				}
+				compact_encode_value(dict, jchild, buf);
+				jchild = jchild->next;
+			}
+		break;
+		default:
+			compact_byte(buf, TAG_NULL);
+		break;
+	}
+}
+
+/*
+ * Append the encoded json to buf, adding the strings that
+ * were sent in full to the dictionary.
+ */
+void compact_encode(struct compact_dict_t *dict, struct JsonNode *jnode, struct compact_buf_t *buf) {
+	compact_encode_value(dict, jnode, buf);
+}
+
+/*
+ * Returns the string in a buffer the caller has to free, or
+ * NULL when the input is invalid.
+ */
+static char *compact_decode_string(struct compact_dict_t *dict, struct compact_reader_t *r) {
+	uint64_t i = compact_read_varint(r), len = 0;
+	char *out = NULL;
+
+	if(r->error == 1) {
+		return NULL;
+	}
+	if(i > 0) {
+		if(i > dict->nr) {
+			r->error = 1;
+			return NULL;
+		}
+		len = strlen(dict->strings[i-1]);
+		if((out = MALLOC((size_t)len+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(out, dict->strings[i-1], (size_t)len+1);
+		return out;
+	}
+
+	len = compact_read_varint(r);
+	if(r->error == 1 || len > (uint64_t)(r->end - r->p) || memchr(r->p, '\0', (size_t)len) != NULL) {
+		r->error = 1;
+		return NULL;
+	}
+	if((out = MALLOC((size_t)len+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(out, r->p, (size_t)len);
+	out[len] = '\0';
+	compact_dict_add(dict, (const char *)r->p, (size_t)len);
+	r->p += len;
+
+	return out;
+}
+
+static struct JsonNode *compact_decode_value(struct compact_dict_t *dict, struct compact_reader_t *r, int depth) {
+	struct JsonNode *jnode = NULL, *jchild = NULL;
+	uint64_t count = 0, u = 0, i = 0;
+	int64_t n = 0;
+	int decimals = 0, tag = 0;
+	double d = 0.0;
+	char *str = NULL, *key = NULL;
+
+	if(depth > COMPACT_DEPTH) {
+		r->error = 1;
+		return NULL;
+	}
+
+	tag = compact_read_byte(r);
+	if(r->error == 1) {
+		return NULL;
+	}
+	switch(tag) {
+		case TAG_NULL:
+			return json_mknull();
+		case TAG_FALSE:
+			return json_mkbool(false);
+		case TAG_TRUE:
+			return json_mkbool(true);
+		case TAG_NUMBER:
+			decimals = compact_read_byte(r);
+			u = compact_read_varint(r);
+			if(r->error == 1 || decimals >= 10) {
+				r->error = 1;
+				return NULL;
+			}
+			n = (int64_t)(u >> 1) ^ -(int64_t)(u & 1);
+			return json_mknumber((double)n / powers[decimals], decimals);
+		case TAG_DOUBLE:
+			decimals = compact_read_byte(r);
+			u = compact_read_varint(r);
+			if(r->error == 1) {
+				return NULL;
+			}
+			memcpy(&d, &u, sizeof(d));
+			return json_mknumber(d, decimals);
+		case TAG_STRING:
+			if((str = compact_decode_string(dict, r)) == NULL) {
+				return NULL;
+			}
+			jnode = json_mkstring(str);
+			FREE(str);
+			return jnode;
+		case TAG_ARRAY:
+		case TAG_OBJECT:
+			jnode = (tag == TAG_ARRAY) ? json_mkarray() : json_mkobject();
+			count = compact_read_varint(r);
+			/* Every value takes at least a byte */
+			if(r->error == 1 || count > (uint64_t)(r->end - r->p)) {
+				r->error = 1;
+				json_delete(jnode);
+				return NULL;
+			}
+			for(i=0;i<count;i++) {
+				key = NULL;
+				if(jnode->tag == JSON_OBJECT && (key = compact_decode_string(dict, r)) == NULL) {
+					json_delete(jnode);
+					return NULL;
+				}
+				if((jchild = compact_decode_value(dict, r, depth+1)) == NULL) {
+					if(key != NULL) {
+						FREE(key);
+					}
+					json_delete(jnode);
+					return NULL;
+				}
+				if(key != NULL) {
+					json_append_member(jnode, key, jchild);
+					FREE(key);
+				} else {
+					json_append_element(jnode, jchild);
+				}
+			}
+			return jnode;
+		default:
+			r->error = 1;
+		break;
+	}
+	return NULL;
+}
+
+/*
+ * Returns NULL when buf isn't a single valid value. The
+ * dictionary can't be trusted anymore in that case.
+ */
+struct JsonNode *compact_decode(struct compact_dict_t *dict, const unsigned char *buf, size_t len) {
+	struct compact_reader_t r;
+	struct JsonNode *jnode = NULL;
+
+	r.p = buf;
+	r.end = buf + len;
+	r.error = 0;
+
+	jnode = compact_decode_value(dict, &r, 0);
+	if(jnode != NULL && (r.error == 1 || r.p != r.end)) {
+		json_delete(jnode);
+		return NULL;
+	}
+	return jnode;
+}
+
+/*
+ * Pulses are sent in units of PULSE_DIV. Remotes only use a
+ * few different pulse lengths, so pulses that are within a
+ * quarter of each other share one length, and the train is
+ * sent as those lengths and a nibble per pulse. Trains with
+ * too many different lengths are sent as varints instead.
+ */
+static int compact_cluster(int *pulses, int length, unsigned int *centers, unsigned char *index) {
+	unsigned long sums[COMPACT_CLUSTERS];
+	unsigned int counts[COMPACT_CLUSTERS], q = 0, c = 0;
+	int nr = 0, i = 0, x = 0;
+
+	for(i=0;i<length;i++) {
+		q = (unsigned int)(((pulses[i] > 0) ? pulses[i] : 0) + PULSE_DIV/2) / PULSE_DIV;
+		for(x=0;x<nr;x++) {
+			c = (unsigned int)(sums[x] / counts[x]);
+			if((q > c ? q - c : c - q) <= c/4+1) {
+				break;
+			}
+		}
+		if(x == nr) {
+			if(nr == COMPACT_CLUSTERS) {
+				return -1;
+			}
+			sums[nr] = 0;
+			counts[nr] = 0;
+			nr++;
+		}
+		sums[x] += q;
+		counts[x]++;
+		index[i] = (unsigned char)x;
+	}
+	for(x=0;x<nr;x++) {
+		centers[x] = (unsigned int)((sums[x] + counts[x]/2) / counts[x]);
+	}
+	return nr;
+}
+
+/*
+ * A pulse train is the hardware type, shifted by one so
+ * the unknown type fits, the number of pulses and the
+ * number of lengths, followed by the pulses.
+ */
+void compact_encode_pulses(int hwtype, int *pulses, int length, struct compact_buf_t *buf) {
+	unsigned int centers[COMPACT_CLUSTERS];
+	unsigned char index[MAXPULSESTREAMLENGTH];
+	int nr = 0, i = 0;
+
+	if(length > MAXPULSESTREAMLENGTH) {
+		length = MAXPULSESTREAMLENGTH;
+	}
+
+	compact_varint(buf, (uint64_t)(hwtype+1));
+	compact_varint(buf, (uint64_t)length);
+
+	if((nr = compact_cluster(pulses, length, centers, index)) == -1) {
+		compact_byte(buf, 0);
+		for(i=0;i<length;i++) {
+			compact_varint(buf, (uint64_t)((((pulses[i] > 0) ? pulses[i] : 0) + PULSE_DIV/2) / PULSE_DIV));
+		}
+		return;
+	}
+
+	compact_byte(buf, (unsigned char)nr);
+	for(i=0;i<nr;i++) {
+		compact_varint(buf, (uint64_t)centers[i]);
+	}
+	for(i=0;i<length;i+=2) {
+		compact_byte(buf, (unsigned char)(index[i] | ((i+1 < length) ? index[i+1] << 4 : 0)));
+	}
+}
+
+/*
+ * Pulses has to fit MAXPULSESTREAMLENGTH pulses.
+ */
+int compact_decode_pulses(const unsigned char *buf, size_t len, int *hwtype, int *pulses, int *length) {
+	struct compact_reader_t r;
+	unsigned int centers[COMPACT_CLUSTERS];
+	uint64_t n = 0, pulse = 0, i = 0;
+	int nr = 0, x = 0, c = 0;
+
+	r.p = buf;
+	r.end = buf + len;
+	r.error = 0;
+
+	n = compact_read_varint(&r);
+	if(r.error == 1 || n > INT32_MAX) {
+		return -1;
+	}
+	*hwtype = (int)n-1;
+	n = compact_read_varint(&r);
+	if(r.error == 1 || n == 0 || n > MAXPULSESTREAMLENGTH) {
+		return -1;
+	}
+	nr = compact_read_byte(&r);
+	if(r.error == 1 || nr > COMPACT_CLUSTERS) {
+		return -1;
+	}
+	if(nr == 0) {
+		for(i=0;i<n;i++) {
+			pulse = compact_read_varint(&r);
+			if(r.error == 1 || pulse > INT32_MAX/PULSE_DIV) {
+				return -1;
+			}
+			pulses[i] = (int)pulse*PULSE_DIV;
+		}
+	} else {
+		for(x=0;x<nr;x++) {
+			pulse = compact_read_varint(&r);
+			if(r.error == 1 || pulse > INT32_MAX/PULSE_DIV) {
+				return -1;
+			}
+			centers[x] = (unsigned int)pulse;
+		}
+		for(i=0;i<n;i++) {
+			if((i % 2) == 0) {
+				c = compact_read_byte(&r);
+				if(r.error == 1) {
+					return -1;
+				}
+			}
+			x = ((i % 2) == 0) ? (c & 0x0f) : (c >> 4);
+			if(x >= nr) {
+				return -1;
+			}
+			pulses[i] = (int)centers[x]*PULSE_DIV;
+		}
+	}
+	if(r.p != r.end) {
+		return -1;
+	}
+	*length = (int)n;
+	return 0;
+}
+
+/*
+ * A replicated change is its flags, the epoch of the stream,
+ * its sequence in that stream and the time the change was
+ * made at its origin, followed by the update itself. A frame
+ * without an update only tells where the stream continues.
+ */
+void compact_encode_replica(struct compact_dict_t *dict, int flags, unsigned long epoch, unsigned long seq, unsigned long timestamp, struct JsonNode *jnode, struct compact_buf_t *buf) {
+	if(jnode != NULL) {
+		flags |= COMPACT_REPLICA_VALUES;
+	} else {
+		flags &= ~COMPACT_REPLICA_VALUES;
+	}
+	compact_byte(buf, (unsigned char)flags);
+	compact_varint(buf, (uint64_t)epoch);
+	compact_varint(buf, (uint64_t)seq);
+	compact_varint(buf, (uint64_t)timestamp);
+	if(jnode != NULL) {
+		compact_encode_value(dict, jnode, buf);
+	}
+}
+
+/*
+ * The update is stored in jnode, or NULL when the frame did
+ * not have one.
+ */
+int compact_decode_replica(struct compact_dict_t *dict, const unsigned char *buf, size_t len, int *flags, unsigned long *epoch, unsigned long *seq, unsigned long *timestamp, struct JsonNode **jnode) {
+	struct compact_reader_t r;
+
+	r.p = buf;
+	r.end = buf + len;
+	r.error = 0;
+
+	*jnode = NULL;
+	*flags = compact_read_byte(&r);
+	*epoch = (unsigned long)compact_read_varint(&r);
+	*seq = (unsigned long)compact_read_varint(&r);
+	*timestamp = (unsigned long)compact_read_varint(&r);
+	if(r.error == 1) {
+		return -1;
+	}
+	if((*flags & COMPACT_REPLICA_VALUES) == COMPACT_REPLICA_VALUES) {
+		if((*jnode = compact_decode_value(dict, &r, 0)) == NULL) {
+			return -1;
+		}
+	}
+	if(r.error == 1 || r.p != r.end) {
+		if(*jnode != NULL) {
+			json_delete(*jnode);
+			*jnode = NULL;
+		}
+		return -1;
+	}
+	return 0;
+}
+
+void compact_buf_free(struct compact_buf_t *buf) {
+	if(buf->data != NULL) {
+		FREE(buf->data);
+	}
+	buf->len = 0;
+	buf->size = 0;
+}
@@ -0,0 +1,77 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _COMPACT_H_
+#define _COMPACT_H_
+
+#include <stddef.h>
+
+#include "json.h"
+
+/* A json string, as it would have been sent without framing */
+#define COMPACT_JSON		0
+/* An encoded update of a node, the action is implied */
+#define COMPACT_UPDATE	1
+/* A raw pulse train for the master to decode */
+#define COMPACT_PULSES	2
+/* A device state change replicated to another master */
+#define COMPACT_REPLICA	3
+
+/* The replica frame was replayed after a reconnect */
+#define COMPACT_REPLICA_CATCHUP	0x01
+/* An update follows the header of the replica frame */
+#define COMPACT_REPLICA_VALUES	0x02
+
+/* The type and a length of at most five bytes */
+#define COMPACT_HEADER	6
+#define COMPACT_MAXLEN	1048576
+
+#define COMPACT_DICT_SIZE		1024
+/* Longer strings are sent as they are every time */
+#define COMPACT_DICT_STRLEN	32
+
+/* Different pulse lengths a train can be sent with */
+#define COMPACT_CLUSTERS		16
+
+/*
+ * The strings both ends of a connection have seen so far, in
+ * the order they were sent. Sender and receiver each build
+ * their own, so a string is sent once and referred to by its
+ * number afterwards.
+ */
+typedef struct compact_dict_t {
+	char *strings[COMPACT_DICT_SIZE];
+	unsigned short hash[COMPACT_DICT_SIZE*2];
+	unsigned int nr;
+} compact_dict_t;
+
+typedef struct compact_buf_t {
+	unsigned char *data;
+	size_t len;
+	size_t size;
+} compact_buf_t;
+
+void compact_dict_clear(struct compact_dict_t *dict);
+
+size_t compact_header(unsigned char *hdr, int type, size_t len);
+void compact_frame_init(struct compact_buf_t *buf);
+const unsigned char *compact_frame(struct compact_buf_t *buf, int type, size_t *len);
+int compact_frame_parse(const unsigned char *buf, size_t len, int *type, size_t *plen);
+
+void compact_encode(struct compact_dict_t *dict, struct JsonNode *jnode, struct compact_buf_t *buf);
+struct JsonNode *compact_decode(struct compact_dict_t *dict, const unsigned char *buf, size_t len);
+
+void compact_encode_pulses(int hwtype, int *pulses, int length, struct compact_buf_t *buf);
+int compact_decode_pulses(const unsigned char *buf, size_t len, int *hwtype, int *pulses, int *length);
+
+void compact_encode_replica(struct compact_dict_t *dict, int flags, unsigned long epoch, unsigned long seq, unsigned long timestamp, struct JsonNode *jnode, struct compact_buf_t *buf);
+int compact_decode_replica(struct compact_dict_t *dict, const unsigned char *buf, size_t len, int *flags, unsigned long *epoch, unsigned long *seq, unsigned long *timestamp, struct JsonNode **jnode);
+
+void compact_buf_free(struct compact_buf_t *buf);
+
+#endif
@@ -18,6 +18,7 @@
 #include <sys/stat.h>
 #include <ctype.h>
 #include <assert.h>
+#include <pthread.h>
 #ifndef _WIN32
 	#ifdef __mips__
 		#define __USE_UNIX98
@@ -29,6 +30,7 @@
 #include "common.h"
 #include "log.h"
 #include "mem.h"
+#include "strptime.h"
 
 #define NRCOUNTRIES 	408
 #define PRECISION 		1
@@ -1144,12 +1146,102 @@ struct tzoffsets_t {
 	{ "Zulu", 0, 0 },
 };
 
+/*
+	A polygon can only match when one of its points lies
+	within the search margin of the coordinate. The world is
+	divided in a grid of cells that list the polygons whose
+	bounding box, grown by the largest margin, overlaps it.
+	Like the coordinates, the sizes are in tenths of a degree.
+*/
+#define TZGRID_CELL		100
+#define TZGRID_COLS		(3600/TZGRID_CELL)
+#define TZGRID_ROWS		(1800/TZGRID_CELL)
+#define TZGRID_MARGIN	50
+
+static int *tzgrid_items = NULL;
+static int tzgrid_start[(TZGRID_COLS*TZGRID_ROWS)+1];
+static int tzgrid_init = 0;
+
+static int tzgrid_col(int x) {
+	int c = (x+1800)/TZGRID_CELL;
+	return (c < 0) ? 0 : ((c >= TZGRID_COLS) ? TZGRID_COLS-1 : c);
+}
+
+static int tzgrid_row(int y) {
+	int r = (y+900)/TZGRID_CELL;
+	return (r < 0) ? 0 : ((r >= TZGRID_ROWS) ? TZGRID_ROWS-1 : r);
+}
+
+static void tzgrid_bounds(int i, int *c1, int *c2, int *r1, int *r2) {
+	int a = 0, minx = 0, maxx = 0, miny = 0, maxy = 0;
+
+	minx = maxx = tzdata[i].coords[0][0];
+	miny = maxy = tzdata[i].coords[0][1];
+	for(a=1;a<tzdata[i].nrcoords;a++) {
+		minx = min(minx, tzdata[i].coords[a][0]);
+		maxx = max(maxx, tzdata[i].coords[a][0]);
+		miny = min(miny, tzdata[i].coords[a][1]);
+		maxy = max(maxy, tzdata[i].coords[a][1]);
+	}
+	*c1 = tzgrid_col(minx-TZGRID_MARGIN);
+	*c2 = tzgrid_col(maxx+TZGRID_MARGIN);
+	*r1 = tzgrid_row(miny-TZGRID_MARGIN);
+	*r2 = tzgrid_row(maxy+TZGRID_MARGIN);
+}
+
+/*
+	Two passes, first count the polygons per cell, then
+	fill them in. Cells keep the polygons in table order,
+	so lookups find the same match as a full scan.
+*/
+static void tzgrid_build(void) {
+	int nrtz = sizeof(tzdata)/sizeof(tzdata[0]);
+	int count[TZGRID_COLS*TZGRID_ROWS];
+	int i = 0, c = 0, r = 0, c1 = 0, c2 = 0, r1 = 0, r2 = 0;
+
+	memset(count, 0, sizeof(count));
+	for(i=0;i<nrtz;i++) {
+		if(tzdata[i].nrcoords <= 0) {
+			continue;
+		}
+		tzgrid_bounds(i, &c1, &c2, &r1, &r2);
+		for(r=r1;r<=r2;r++) {
+			for(c=c1;c<=c2;c++) {
+				count[(r*TZGRID_COLS)+c]++;
+			}
+		}
+	}
+
+	tzgrid_start[0] = 0;
+	for(i=0;i<TZGRID_COLS*TZGRID_ROWS;i++) {
+		tzgrid_start[i+1] = tzgrid_start[i]+count[i];
+		count[i] = tzgrid_start[i];
+	}
+
+	if((tzgrid_items = MALLOC(sizeof(int)*(size_t)(tzgrid_start[TZGRID_COLS*TZGRID_ROWS]+1))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	for(i=0;i<nrtz;i++) {
+		if(tzdata[i].nrcoords <= 0) {
+			continue;
+		}
+		tzgrid_bounds(i, &c1, &c2, &r1, &r2);
+		for(r=r1;r<=r2;r++) {
+			for(c=c1;c<=c2;c++) {
+				tzgrid_items[count[(r*TZGRID_COLS)+c]++] = i;
+			}
+		}
+	}
+	tzgrid_init = 1;
+}
+
 /*
 	Extra checks for gracefull (early)
   stopping of pilight
 */
 static int searchingtz = 0;
 static uv_mutex_t mutex_lock;
+static uv_mutex_t tzcache_lock;
 // static pthread_mutexattr_t mutex_attr;
 static unsigned short mutex_init = 0;
 
@@ -1158,7 +1250,11 @@ void datetime_init(void) {
 	// pthread_mutexattr_settype(&mutex_attr, PTHREAD_MUTEX_RECURSIVE);
 	// pthread_mutex_init(&mutex_lock, &mutex_attr);
 	uv_mutex_init(&mutex_lock);
+	uv_mutex_init(&tzcache_lock);
 	mutex_init = 1;
+	if(tzgrid_init == 0) {
+		tzgrid_build();
+	}
 }
 
 int datetime_gc(void) {
@@ -1169,6 +1265,11 @@ int datetime_gc(void) {
   usleep(10);
 #endif
 	}
+	if(tzgrid_items != NULL) {
+		FREE(tzgrid_items);
+		tzgrid_items = NULL;
+	}
+	tzgrid_init = 0;
 	logprintf(LOG_DEBUG, "garbage collected datetime library");
 	return EXIT_SUCCESS;
 }
@@ -1182,16 +1283,21 @@ char *coord2tz(double longitude, double latitude) {
 		uv_mutex_lock(&mutex_lock);
 	}
 	searchingtz++;
-	int i = 0, a = 0, margin = 1, inside = 0;
-	int nrtz = sizeof(tzdata)/sizeof(tzdata[0]);
+	int i = 0, a = 0, c = 0, margin = 1, inside = 0;
 	char *tz = NULL;
 
+	if(tzgrid_init == 0) {
+		tzgrid_build();
+	}
+
 	margin *= (int)pow(10, PRECISION);
 	int y = (int)round(latitude*(int)pow(10, PRECISION));
 	int x = (int)round(longitude*(int)pow(10, PRECISION));
+	int cell = (tzgrid_row(y)*TZGRID_COLS)+tzgrid_col(x);
 
 	while(!inside && margin < (5*(int)pow(10, PRECISION))) {
-		for(i=0;i<nrtz;i++) {
+		for(c=tzgrid_start[cell];c<tzgrid_start[cell+1];c++) {
+			i = tzgrid_items[c];
 			unsigned int n = tzdata[i].nrcoords;
 			if(n > 0) {
 				int p1x = 0;
@@ -1621,17 +1727,10 @@ int __localtime_utc(time_t timer, struct tm *tm) {
 	}
 }
 
-int localtime_l(time_t t, struct tm *result, char *timezone) {
-	size_t i = 0;
+static int timezone_index(char *timezone) {
+	const char *timezone_name = timezone_names;
 	int x = 0;
-	/*
-	 * Require tv_nsec to be in bounds, like other functions that accept
-	 */
-	if(t < 0) {
-		return EINVAL;
-	}
 
-	const char *timezone_name = timezone_names;
 	do {
 		if(strcmp(timezone, timezone_name) == 0) {
 			break;
@@ -1640,6 +1739,16 @@ int localtime_l(time_t t, struct tm *result, char *timezone) {
 		timezone_name += strlen(timezone_name) + 1;
 	} while(*timezone_name != '\0');
 
+	return x;
+}
+
+/*
+ * Derive the UTC offset of a timezone at some instant from
+ * its eras and daylight saving time rules.
+ */
+static void timezone_offset(int x, time_t t, int *gmtoff, int *isdst) {
+	size_t i = 0;
+
 	/*
 	 * Obtain the last era from the timezone that does not end before the
 	 * provided timestamp.
@@ -1655,7 +1764,6 @@ int localtime_l(time_t t, struct tm *result, char *timezone) {
 		era = &tz->eras[i];
 	}
 
-	int error = 0;
   if(era->rules_count > 0) {
 		/*
 		 * Timezone has daylight saving time rules. First compute the
@@ -1671,31 +1779,157 @@ int localtime_l(time_t t, struct tm *result, char *timezone) {
 		__localtime_utc(timer_std > era_start ? timer_std : era_start, &std);
 
 		/*
-		 * Obtain applicable daylight saving time rule and recompute.
+		 * Obtain applicable daylight saving time rule.
 		 */
 		const struct lc_timezone_rule *rule = determine_applicable_rule(era->rules, era->rules_count, &std, era->gmtoff);
-		int gmtoff = era->gmtoff + rule->save * 600;
-
-		error = __localtime_utc(t + gmtoff, result);
-
-		result->tm_isdst = rule->save > 0;
-
-#ifndef _WIN32
-		result->tm_gmtoff = gmtoff;
-		// result->tm_zone = compute_zone_abbreviation(era, rule);
-#endif
+		*gmtoff = era->gmtoff + rule->save * 600;
+		*isdst = rule->save > 0;
   } else {
 		/*
-		 * Timezone has no daylight saving time rules. Compute local time
-		 * with timezone offset directly.
+		 * Timezone has no daylight saving time rules.
 		 */
-		error = __localtime_utc(t + era->gmtoff, result);
+		*gmtoff = era->gmtoff;
+		*isdst = 0;
+	}
+}
+
+/*
+ * The offsets of the timezones in use, as a list of the
+ * instants they change at, for a few years around the time
+ * they were last asked for. The list is made by sampling the
+ * rules every hour and narrowing each change down to the
+ * second, after that a conversion is a binary search.
+ */
+#define TZCACHE_SIZE		8
+#define TZCACHE_TRANS		64
+#define TZCACHE_BEFORE	(366*86400)
+#define TZCACHE_AFTER		(2*366*86400)
+
+typedef struct tzcache_t {
+	int x;
+	int nrtrans;
+	time_t from;
+	time_t to;
+	struct {
+		time_t start;
+		int gmtoff;
+		int isdst;
+	} trans[TZCACHE_TRANS];
+} tzcache_t;
+
+static struct tzcache_t tzcache[TZCACHE_SIZE];
+static int tzcache_nr = 0;
+static int tzcache_next = 0;
+
+static int tzcache_build(struct tzcache_t *node, int x, time_t t) {
+	time_t a = 0, lo = 0, hi = 0, mid = 0;
+	int gmtoff = 0, isdst = 0, ngmtoff = 0, nisdst = 0;
+	int mgmtoff = 0, misdst = 0;
+
+	node->x = x;
+	node->nrtrans = 0;
+	node->from = (t > TZCACHE_BEFORE) ? t - TZCACHE_BEFORE : 0;
+	node->from -= node->from % 3600;
+	node->to = node->from + TZCACHE_BEFORE + TZCACHE_AFTER;
+
+	timezone_offset(x, node->from, &gmtoff, &isdst);
+	node->trans[0].start = node->from;
+	node->trans[0].gmtoff = gmtoff;
+	node->trans[0].isdst = isdst;
+	node->nrtrans = 1;
+
+	for(a=node->from+3600;a<node->to;a+=3600) {
+		timezone_offset(x, a, &ngmtoff, &nisdst);
+		if(ngmtoff == gmtoff && nisdst == isdst) {
+			continue;
+		}
+		if(node->nrtrans == TZCACHE_TRANS) {
+			return -1;
+		}
+		lo = a-3600;
+		hi = a;
+		while(hi-lo > 1) {
+			mid = lo+((hi-lo)/2);
+			timezone_offset(x, mid, &mgmtoff, &misdst);
+			if(mgmtoff == gmtoff && misdst == isdst) {
+				lo = mid;
+			} else {
+				hi = mid;
+			}
+		}
+		node->trans[node->nrtrans].start = hi;
+		node->trans[node->nrtrans].gmtoff = ngmtoff;
+		node->trans[node->nrtrans].isdst = nisdst;
+		node->nrtrans++;
+		gmtoff = ngmtoff;
+		isdst = nisdst;
+	}
+	return 0;
+}
+
+static int tzcache_offset(int x, time_t t, int *gmtoff, int *isdst) {
+	struct tzcache_t *node = NULL;
+	int i = 0, lo = 0, hi = 0, mid = 0;
+
+	uv_mutex_lock(&tzcache_lock);
+	for(i=0;i<tzcache_nr;i++) {
+		if(tzcache[i].x == x) {
+			node = &tzcache[i];
+			break;
+		}
+	}
+	if(node == NULL || t < node->from || t >= node->to) {
+		if(node == NULL) {
+			if(tzcache_nr < TZCACHE_SIZE) {
+				node = &tzcache[tzcache_nr++];
+			} else {
+				node = &tzcache[tzcache_next++ % TZCACHE_SIZE];
+			}
+		}
+		if(tzcache_build(node, x, t) != 0) {
+			node->x = -1;
+			uv_mutex_unlock(&tzcache_lock);
+			return -1;
+		}
+	}
+
+	lo = 0;
+	hi = node->nrtrans-1;
+	while(lo < hi) {
+		mid = (lo+hi+1)/2;
+		if(node->trans[mid].start <= t) {
+			lo = mid;
+		} else {
+			hi = mid-1;
+		}
+	}
+	*gmtoff = node->trans[lo].gmtoff;
+	*isdst = node->trans[lo].isdst;
+	uv_mutex_unlock(&tzcache_lock);
+
+	return 0;
+}
+
+int localtime_l(time_t t, struct tm *result, char *timezone) {
+	int x = 0, gmtoff = 0, isdst = 0, error = 0;
+	/*
+	 * Require tv_nsec to be in bounds, like other functions that accept
+	 */
+	if(t < 0) {
+		return EINVAL;
+	}
+
+	x = timezone_index(timezone);
+
+	if(mutex_init == 0 || tzcache_offset(x, t, &gmtoff, &isdst) != 0) {
+		timezone_offset(x, t, &gmtoff, &isdst);
+	}
+
+	error = __localtime_utc(t + gmtoff, result);
+	result->tm_isdst = isdst;
 #ifndef _WIN32
-		result->tm_gmtoff = era->gmtoff;
-		// static const struct lc_timezone_rule rule = {};
-		// result->tm_zone = compute_zone_abbreviation(era, &rule);
+	result->tm_gmtoff = gmtoff;
 #endif
-	}
 
 	return error;
 }
@@ -1842,3 +2076,149 @@ time_t datetime2ts(int year, int month, int day, int hour, int minutes, int seco
 
 	return t;
 }
+
+/*
+ * Rules format the same few dates every second, so the format
+ * strings are compiled once to the fields and separators they
+ * are made of. Formats with only numeric fields are parsed here
+ * directly, the others are left to strptime.
+ */
+#define DTFORMAT_SIZE		8
+#define DTFORMAT_LEN		32
+
+typedef struct dtformat_t {
+	char format[DTFORMAT_LEN];
+	/* The fields, a space for any whitespace, and literals */
+	char ops[DTFORMAT_LEN];
+	int nrops;
+	int native;
+} dtformat_t;
+
+static struct dtformat_t dtformats[DTFORMAT_SIZE];
+static int dtformat_nr = 0;
+static int dtformat_next = 0;
+static pthread_mutex_t dtformat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dtformat_compile(struct dtformat_t *node, const char *format) {
+	const char *p = format;
+
+	strcpy(node->format, format);
+	node->nrops = 0;
+	node->native = 1;
+
+	while(*p != '\0') {
+		if(*p == '%') {
+			p++;
+			if(*p == 'Y' || *p == 'm' || *p == 'd' || *p == 'H' || *p == 'M' || *p == 'S') {
+				node->ops[node->nrops++] = *p;
+			} else if(*p == '%') {
+				node->ops[node->nrops++] = '%';
+			} else {
+				node->native = 0;
+				return;
+			}
+		} else if(isspace((unsigned char)*p)) {
+			node->ops[node->nrops++] = ' ';
+		} else {
+			node->ops[node->nrops++] = *p;
+		}
+		p++;
+	}
+}
+
+/* The same bounds and digits as conv_num of strptime */
+static const char *dtformat_number(const char *p, int *out, int lower, int upper) {
+	int result = 0, limit = upper;
+
+	if(*p < '0' || *p > '9') {
+		return NULL;
+	}
+	do {
+		result = (result*10)+(*p++ - '0');
+		limit /= 10;
+	} while((result*10) <= upper && limit > 0 && *p >= '0' && *p <= '9');
+
+	if(result < lower || result > upper) {
+		return NULL;
+	}
+	*out = result;
+	return p;
+}
+
+static const char *dtformat_parse(struct dtformat_t *node, const char *s, struct tm *tm) {
+	int i = 0, value = 0;
+
+	for(i=0;i<node->nrops && s != NULL;i++) {
+		switch(node->ops[i]) {
+			case 'Y':
+				if((s = dtformat_number(s, &value, 0, 9999)) != NULL) {
+					tm->tm_year = value-1900;
+				}
+			break;
+			case 'm':
+				if((s = dtformat_number(s, &value, 1, 12)) != NULL) {
+					tm->tm_mon = value-1;
+				}
+			break;
+			case 'd':
+				s = dtformat_number(s, &tm->tm_mday, 1, 31);
+			break;
+			case 'H':
+				s = dtformat_number(s, &tm->tm_hour, 0, 23);
+			break;
+			case 'M':
+				s = dtformat_number(s, &tm->tm_min, 0, 59);
+			break;
+			case 'S':
+				s = dtformat_number(s, &tm->tm_sec, 0, 61);
+			break;
+			case ' ':
+				while(isspace((unsigned char)*s)) {
+					s++;
+				}
+			break;
+			default:
+				if(*s++ != node->ops[i]) {
+					return NULL;
+				}
+			break;
+		}
+	}
+	return s;
+}
+
+/*
+ * A strptime that parses the numeric formats, like the ISO
+ * dates, without walking the format again.
+ */
+char *datetime_strptime(const char *s, const char *format, struct tm *tm) {
+	struct dtformat_t node;
+	int i = 0, match = 0;
+
+	if(strlen(format) >= DTFORMAT_LEN) {
+		return strptime(s, format, tm);
+	}
+
+	pthread_mutex_lock(&dtformat_lock);
+	for(i=0;i<dtformat_nr;i++) {
+		if(strcmp(dtformats[i].format, format) == 0) {
+			memcpy(&node, &dtformats[i], sizeof(struct dtformat_t));
+			match = 1;
+			break;
+		}
+	}
+	if(match == 0) {
+		dtformat_compile(&dtformats[dtformat_next], format);
+		memcpy(&node, &dtformats[dtformat_next], sizeof(struct dtformat_t));
+		if(dtformat_nr < DTFORMAT_SIZE) {
+			dtformat_nr++;
+		}
+		dtformat_next = (dtformat_next+1) % DTFORMAT_SIZE;
+	}
+	pthread_mutex_unlock(&dtformat_lock);
+
+	if(node.native == 0) {
+		return strptime(s, format, tm);
+	}
+	return (char *)dtformat_parse(&node, s, tm);
+}
@@ -17,5 +17,6 @@ int isdst(time_t, char *);
 void datefix(int *, int *, int *, int *, int *, int *, int *);
 void datetime_init(void);
 int localtime_l(time_t, struct tm *, char *);
+char *datetime_strptime(const char *, const char *, struct tm *);
 
 #endif
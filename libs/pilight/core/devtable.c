@@ -0,0 +1,283 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * The current values of the devices in shared memory. The
+ * daemon keeps one entry per device value, and local programs
+ * map the table read-only to read the values without a socket
+ * connection or any parsing. Only the daemon writes, every
+ * entry and the layout carry a sequence that is odd while it
+ * is written, so a reader retries or finds its entry again
+ * instead of using a half written value.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "pilight.h"
+#include "log.h"
+#include "devtable.h"
+
+/* Times a reader retries an entry that is being written */
+#define DEVTABLE_RETRIES	64
+
+static struct devtable_t *devtable = NULL;
+static int devtable_owner = 0;
+static int devtable_full = 0;
+
+#ifndef _WIN32
+static struct devtable_t *devtable_map(int flags, int prot) {
+	struct devtable_t *map = NULL;
+	struct stat st;
+	int fd = -1;
+
+	if((fd = shm_open(DEVTABLE_NAME, flags, 0644)) < 0) {
+		return NULL;
+	}
+	if((flags & O_CREAT) != 0 && ftruncate(fd, sizeof(struct devtable_t)) != 0) {
+		close(fd);
+		return NULL;
+	}
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct devtable_t)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, sizeof(struct devtable_t), prot, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return (map == MAP_FAILED) ? NULL : map;
+}
+#endif
+
+int devtable_init(void) {
+#ifdef _WIN32
+	return -1;
+#else
+	if(devtable != NULL) {
+		return 0;
+	}
+	if((devtable = devtable_map(O_CREAT | O_RDWR, PROT_READ | PROT_WRITE)) == NULL) {
+		logprintf(LOG_ERR, "unable to create the device table %s", DEVTABLE_NAME);
+		return -1;
+	}
+	memset(devtable, 0, sizeof(struct devtable_t));
+	devtable->size = sizeof(struct devtable_t);
+	devtable->entry_size = sizeof(struct devtable_entry_t);
+	__sync_synchronize();
+	devtable->magic = DEVTABLE_MAGIC;
+	devtable_owner = 1;
+
+	return 0;
+#endif
+}
+
+/*
+ * Replaces all entries, readers find their entries again
+ * once devtable_end is called. Returns -1 when there is no
+ * table to write to.
+ */
+int devtable_begin(void) {
+	if(devtable == NULL || devtable_owner == 0) {
+		return -1;
+	}
+	devtable->layout++;
+	__sync_synchronize();
+	devtable->count = 0;
+	devtable_full = 0;
+
+	return 0;
+}
+
+/*
+ * Returns the number of the new entry, or -1 when there is
+ * no table or it is full.
+ */
+int devtable_add(const char *device, const char *setting) {
+	struct devtable_entry_t *entry = NULL;
+	int nr = 0;
+
+	if(devtable == NULL || devtable_owner == 0) {
+		return -1;
+	}
+	if(devtable->count >= DEVTABLE_ENTRIES) {
+		if(devtable_full == 0) {
+			logprintf(LOG_NOTICE, "the device table is full, values after %d are left out", DEVTABLE_ENTRIES);
+			devtable_full = 1;
+		}
+		return -1;
+	}
+
+	nr = (int)devtable->count;
+	entry = &devtable->entries[nr];
+
+	entry->seq++;
+	__sync_synchronize();
+	entry->type = 0;
+	entry->decimals = 0;
+	entry->timestamp = 0;
+	entry->number = 0;
+	entry->string[0] = '\0';
+	strncpy(entry->device, device, DEVTABLE_IDLEN-1);
+	entry->device[DEVTABLE_IDLEN-1] = '\0';
+	strncpy(entry->setting, setting, DEVTABLE_NAMELEN-1);
+	entry->setting[DEVTABLE_NAMELEN-1] = '\0';
+	__sync_synchronize();
+	entry->seq++;
+
+	devtable->count = (uint32_t)nr+1;
+
+	return nr;
+}
+
+void devtable_set(int nr, int type, double number, const char *string, int decimals, unsigned long timestamp) {
+	struct devtable_entry_t *entry = NULL;
+
+	if(devtable == NULL || devtable_owner == 0 || nr < 0 || nr >= DEVTABLE_ENTRIES) {
+		return;
+	}
+	entry = &devtable->entries[nr];
+
+	entry->seq++;
+	__sync_synchronize();
+	entry->type = type;
+	entry->decimals = decimals;
+	entry->timestamp = (int64_t)timestamp;
+	if(type == DEVTABLE_STRING) {
+		entry->number = 0;
+		strncpy(entry->string, (string != NULL) ? string : "", DEVTABLE_STRLEN-1);
+		entry->string[DEVTABLE_STRLEN-1] = '\0';
+	} else {
+		entry->number = number;
+		entry->string[0] = '\0';
+	}
+	__sync_synchronize();
+	entry->seq++;
+}
+
+void devtable_end(void) {
+	if(devtable == NULL || devtable_owner == 0) {
+		return;
+	}
+	__sync_synchronize();
+	devtable->layout++;
+}
+
+/* Map the table of a running daemon */
+int devtable_open(void) {
+#ifdef _WIN32
+	return -1;
+#else
+	if(devtable == NULL) {
+		if((devtable = devtable_map(O_RDONLY, PROT_READ)) == NULL) {
+			return -1;
+		}
+		if(devtable->magic != DEVTABLE_MAGIC || devtable->size != sizeof(struct devtable_t) ||
+			devtable->entry_size != sizeof(struct devtable_entry_t)) {
+			munmap(devtable, sizeof(struct devtable_t));
+			devtable = NULL;
+			return -1;
+		}
+	}
+	return 0;
+#endif
+}
+
+/*
+ * The number of the entry of a device value, or -1 when the
+ * daemon doesn't have it or is replacing the entries.
+ */
+int devtable_find(const char *device, const char *setting) {
+	struct devtable_entry_t *entry = NULL;
+	uint32_t layout = 0, count = 0, i = 0;
+	int nr = -1;
+
+	if(devtable == NULL) {
+		return -1;
+	}
+
+	layout = devtable->layout;
+	if((layout % 2) == 1) {
+		return -1;
+	}
+	__sync_synchronize();
+	count = devtable->count;
+	if(count > DEVTABLE_ENTRIES) {
+		count = DEVTABLE_ENTRIES;
+	}
+	for(i=0;i<count;i++) {
+		entry = &devtable->entries[i];
+		if(strncmp(entry->device, device, DEVTABLE_IDLEN) == 0 &&
+			strncmp(entry->setting, setting, DEVTABLE_NAMELEN) == 0) {
+			nr = (int)i;
+			break;
+		}
+	}
+	__sync_synchronize();
+
+	return (devtable->layout == layout) ? nr : -1;
+}
+
+/*
+ * Copies an entry, returns -1 when the entries were replaced
+ * since it was found, or when it was written for too long.
+ */
+int devtable_get(int nr, struct devtable_entry_t *out) {
+	struct devtable_entry_t *entry = NULL;
+	uint32_t layout = 0, seq = 0;
+	int i = 0;
+
+	if(devtable == NULL || nr < 0 || nr >= DEVTABLE_ENTRIES) {
+		return -1;
+	}
+	entry = &devtable->entries[nr];
+
+	layout = devtable->layout;
+	if((layout % 2) == 1) {
+		return -1;
+	}
+	for(i=0;i<DEVTABLE_RETRIES;i++) {
+		seq = entry->seq;
+		__sync_synchronize();
+		if((seq % 2) == 0) {
+			memcpy(out, entry, sizeof(struct devtable_entry_t));
+			__sync_synchronize();
+			if(entry->seq == seq) {
+				break;
+			}
+		}
+	}
+	if(i == DEVTABLE_RETRIES || devtable->layout != layout) {
+		return -1;
+	}
+	out->device[DEVTABLE_IDLEN-1] = '\0';
+	out->setting[DEVTABLE_NAMELEN-1] = '\0';
+	out->string[DEVTABLE_STRLEN-1] = '\0';
+
+	return 0;
+}
+
+void devtable_gc(void) {
+#ifndef _WIN32
+	if(devtable != NULL) {
+		munmap(devtable, sizeof(struct devtable_t));
+		if(devtable_owner == 1) {
+			shm_unlink(DEVTABLE_NAME);
+		}
+	}
+#endif
+	devtable = NULL;
+	devtable_owner = 0;
+	devtable_full = 0;
+}
@@ -0,0 +1,67 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _DEVTABLE_H_
+#define _DEVTABLE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DEVTABLE_NAME			"/pilight-devices"
+#define DEVTABLE_MAGIC		0x70646576
+#define DEVTABLE_ENTRIES	1024
+#define DEVTABLE_IDLEN		64
+#define DEVTABLE_NAMELEN	32
+#define DEVTABLE_STRLEN		64
+
+#define DEVTABLE_NUMBER		1
+#define DEVTABLE_STRING		2
+
+/*
+ * The layout is fixed so other languages can map it as well,
+ * all fields are in the byte order of the host. An entry holds
+ * one value of one device. Its seq is odd while the daemon
+ * writes it, a reader copies an entry and checks that the seq
+ * was even and did not change. The layout of the header works
+ * the same way for replacing all entries after a reload.
+ */
+typedef struct devtable_entry_t {
+	volatile uint32_t seq;
+	int32_t type;
+	int32_t decimals;
+	int32_t reserved;
+	int64_t timestamp;
+	double number;
+	char device[DEVTABLE_IDLEN];
+	char setting[DEVTABLE_NAMELEN];
+	char string[DEVTABLE_STRLEN];
+} devtable_entry_t;
+
+typedef struct devtable_t {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t entry_size;
+	volatile uint32_t layout;
+	volatile uint32_t count;
+	uint32_t reserved;
+	struct devtable_entry_t entries[DEVTABLE_ENTRIES];
+} devtable_t;
+
+int devtable_init(void);
+int devtable_begin(void);
+int devtable_add(const char *device, const char *setting);
+void devtable_set(int nr, int type, double number, const char *string, int decimals, unsigned long timestamp);
+void devtable_end(void);
+
+int devtable_open(void);
+int devtable_find(const char *device, const char *setting);
+int devtable_get(int nr, struct devtable_entry_t *out);
+
+void devtable_gc(void);
+
+#endif
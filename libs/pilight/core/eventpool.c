@@ -44,7 +44,10 @@
 #include "log.h"
 #include "../../libuv/uv.h"
 #include "mem.h"
+#include "json.h"
+#include "pulsepool.h"
 #include "network.h"
+#include "ssl.h"
 
 static uv_async_t *async_req = NULL;
 
@@ -61,6 +64,21 @@ static volatile long nrlisteners[REASON_END] = {0};
 static int nrlisteners[REASON_END] = {0};
 #endif
 static struct eventqueue_t *eventqueue = NULL;
+static struct eventqueue_t *eventqueue_tail = NULL;
+
+/*
+ * Events handled per wakeup of the main loop, the remainder
+ * is picked up by the next wakeup. The task array is kept
+ * between calls so eventpool_execute doesn't allocate it
+ * on every wakeup.
+ */
+#define EVENTPOOL_BATCH	64
+
+/* The first allocation of an iobuf, and above which an emptied one is freed */
+#define IOBUF_MIN		1024
+#define IOBUF_IDLE	65536
+static struct threadpool_tasks_t *tasks = NULL;
+static int nrtasks = 0;
 
 static int threads = EVENTPOOL_NO_THREADS;
 static uv_mutex_t listeners_lock;
@@ -70,77 +88,144 @@ static int eventpoolinit = 0;
 static ssize_t zero = 0;
 static ssize_t one = 1;
 
-static struct eventpool_listener_t *eventpool_listeners = NULL;
+/*
+ * The listeners of each reason have a list of their own, so
+ * an event only visits those that subscribed to it.
+ */
+static struct eventpool_listener_t *eventpool_listeners[REASON_END] = { NULL };
 
 static struct reasons_t {
 	int number;
 	char *reason;
 	int priority;
 } reasons[REASON_END+1] = {
-	{	REASON_SEND_CODE, 						"REASON_SEND_CODE",							0 },
-	{	REASON_CONTROL_DEVICE, 				"REASON_CONTROL_DEVICE",				0 },
-	{	REASON_CODE_SENT, 						"REASON_CODE_SENT",							0 },
-	{	REASON_SOCKET_SEND,						"REASON_CODE_SEND_FAIL",				0 },
-	{	REASON_SOCKET_SEND,						"REASON_CODE_SEND_SUCCESS",			0 },
-	{	REASON_CODE_RECEIVED, 				"REASON_CODE_RECEIVED",					0 },
-	{	REASON_RECEIVED_PULSETRAIN, 	"REASON_RECEIVED_PULSETRAIN",		0 },
-	{	REASON_BROADCAST, 						"REASON_BROADCAST",							0 },
-	{	REASON_BROADCAST_CORE, 				"REASON_BROADCAST_CORE",				0 },
-	{	REASON_FORWARD, 							"REASON_FORWARD",								0 },
-	{	REASON_CONFIG_UPDATE, 				"REASON_CONFIG_UPDATE",					0 },
-	{	REASON_CONFIG_UPDATED, 				"REASON_CONFIG_UPDATED",				0 },
-	{	REASON_SOCKET_RECEIVED, 			"REASON_SOCKET_RECEIVED",				0 },
-	{	REASON_SOCKET_DISCONNECTED,	 	"REASON_SOCKET_DISCONNECTED",		0 },
-	{	REASON_SOCKET_CONNECTED,			"REASON_SOCKET_CONNECTED",			0 },
-	{	REASON_SOCKET_SEND,						"REASON_SOCKET_SEND",						0 },
-	{	REASON_SSDP_RECEIVED, 				"REASON_SSDP_RECEIVED",					0 },
-	{	REASON_SSDP_RECEIVED_FREE,		"REASON_SSDP_RECEIVED_FREE",		0 },
-	{	REASON_SSDP_DISCONNECTED,			"REASON_SSDP_DISCONNECTED",			0 },
-	{	REASON_SSDP_CONNECTED,				"REASON_SSDP_CONNECTED",				0 },
-	{	REASON_WEBSERVER_CONNECTED,		"REASON_WEBSERVER_CONNECTED",		0 },
-	{	REASON_DEVICE_ADDED,					"REASON_DEVICE_ADDED",					0 },
-	{	REASON_DEVICE_ADAPT,					"REASON_DEVICE_ADAPT",					0 },
-	{	REASON_ADHOC_MODE,						"REASON_ADHOC_MODE",						0 },
-	{	REASON_ADHOC_CONNECTED,				"REASON_ADHOC_CONNECTED",				0 },
-	{	REASON_ADHOC_CONFIG_RECEIVED,	"REASON_ADHOC_CONFIG_RECEIVED",	0 },
-	{	REASON_ADHOC_DATA_RECEIVED,		"REASON_ADHOC_DATA_RECEIVED",		0 },
-	{	REASON_ADHOC_UPDATE_RECEIVED,	"REASON_ADHOC_UPDATE_RECEIVED",	0 },
-	{	REASON_ADHOC_DISCONNECTED,		"REASON_ADHOC_DISCONNECTED",		0 },
-	{	REASON_SEND_BEGIN,						"REASON_SEND_BEGIN",						0 },
-	{	REASON_SEND_END,							"REASON_SEND_END",							0 },
-	{	REASON_ARP_FOUND_DEVICE,			"REASON_ARP_FOUND_DEVICE",			0 },
-	{	REASON_ARP_LOST_DEVICE,				"REASON_ARP_LOST_DEVICE", 			0 },
-	{	REASON_ARP_CHANGED_DEVICE,		"REASON_ARP_CHANGED_DEVICE",		0	},
-	{	REASON_LOG,										"REASON_LOG",										0 },
-	{	REASON_END,										"REASON_END",										0 }
+	{	REASON_SEND_CODE, 						"REASON_SEND_CODE",							UV_PRIORITY_HIGH },
+	{	REASON_CONTROL_DEVICE, 				"REASON_CONTROL_DEVICE",				UV_PRIORITY_HIGH },
+	{	REASON_CODE_SENT, 						"REASON_CODE_SENT",							UV_PRIORITY_HIGH },
+	{	REASON_SOCKET_SEND,						"REASON_CODE_SEND_FAIL",				UV_PRIORITY_HIGH },
+	{	REASON_SOCKET_SEND,						"REASON_CODE_SEND_SUCCESS",			UV_PRIORITY_HIGH },
+	{	REASON_CODE_RECEIVED, 				"REASON_CODE_RECEIVED",					UV_PRIORITY_HIGH },
+	{	REASON_RECEIVED_PULSETRAIN, 	"REASON_RECEIVED_PULSETRAIN",		UV_PRIORITY_HIGH },
+	{	REASON_BROADCAST, 						"REASON_BROADCAST",							UV_PRIORITY_HIGH },
+	{	REASON_BROADCAST_CORE, 				"REASON_BROADCAST_CORE",				UV_PRIORITY_HIGH },
+	{	REASON_FORWARD, 							"REASON_FORWARD",								UV_PRIORITY_NORMAL },
+	{	REASON_CONFIG_UPDATE, 				"REASON_CONFIG_UPDATE",					UV_PRIORITY_NORMAL },
+	{	REASON_CONFIG_UPDATED, 				"REASON_CONFIG_UPDATED",				UV_PRIORITY_NORMAL },
+	{	REASON_SOCKET_RECEIVED, 			"REASON_SOCKET_RECEIVED",				UV_PRIORITY_NORMAL },
+	{	REASON_SOCKET_DISCONNECTED,	 	"REASON_SOCKET_DISCONNECTED",		UV_PRIORITY_NORMAL },
+	{	REASON_SOCKET_CONNECTED,			"REASON_SOCKET_CONNECTED",			UV_PRIORITY_NORMAL },
+	{	REASON_SOCKET_SEND,						"REASON_SOCKET_SEND",						UV_PRIORITY_HIGH },
+	{	REASON_SSDP_RECEIVED, 				"REASON_SSDP_RECEIVED",					UV_PRIORITY_NORMAL },
+	{	REASON_SSDP_RECEIVED_FREE,		"REASON_SSDP_RECEIVED_FREE",		UV_PRIORITY_NORMAL },
+	{	REASON_SSDP_DISCONNECTED,			"REASON_SSDP_DISCONNECTED",			UV_PRIORITY_NORMAL },
+	{	REASON_SSDP_CONNECTED,				"REASON_SSDP_CONNECTED",				UV_PRIORITY_NORMAL },
+	{	REASON_WEBSERVER_CONNECTED,		"REASON_WEBSERVER_CONNECTED",		UV_PRIORITY_NORMAL },
+	{	REASON_DEVICE_ADDED,					"REASON_DEVICE_ADDED",					UV_PRIORITY_NORMAL },
+	{	REASON_DEVICE_ADAPT,					"REASON_DEVICE_ADAPT",					UV_PRIORITY_NORMAL },
+	{	REASON_ADHOC_MODE,						"REASON_ADHOC_MODE",						UV_PRIORITY_NORMAL },
+	{	REASON_ADHOC_CONNECTED,				"REASON_ADHOC_CONNECTED",				UV_PRIORITY_NORMAL },
+	{	REASON_ADHOC_CONFIG_RECEIVED,	"REASON_ADHOC_CONFIG_RECEIVED",	UV_PRIORITY_NORMAL },
+	{	REASON_ADHOC_DATA_RECEIVED,		"REASON_ADHOC_DATA_RECEIVED",		UV_PRIORITY_NORMAL },
+	{	REASON_ADHOC_UPDATE_RECEIVED,	"REASON_ADHOC_UPDATE_RECEIVED",	UV_PRIORITY_NORMAL },
+	{	REASON_ADHOC_DISCONNECTED,		"REASON_ADHOC_DISCONNECTED",		UV_PRIORITY_NORMAL },
+	{	REASON_SEND_BEGIN,						"REASON_SEND_BEGIN",						UV_PRIORITY_HIGH },
+	{	REASON_SEND_END,							"REASON_SEND_END",							UV_PRIORITY_HIGH },
+	{	REASON_ARP_FOUND_DEVICE,			"REASON_ARP_FOUND_DEVICE",			UV_PRIORITY_NORMAL },
+	{	REASON_ARP_LOST_DEVICE,				"REASON_ARP_LOST_DEVICE", 			UV_PRIORITY_NORMAL },
+	{	REASON_ARP_CHANGED_DEVICE,		"REASON_ARP_CHANGED_DEVICE",		UV_PRIORITY_NORMAL	},
+	{	REASON_LOG,										"REASON_LOG",										UV_PRIORITY_NORMAL },
+	{	REASON_END,										"REASON_END",										UV_PRIORITY_NORMAL }
 };
 
-static void fib_free(uv_work_t *req, int status) {
-	FREE(req->data);
+/*
+ * All listeners of an event are handed to the threadpool as a
+ * single job, so the worker that takes it runs them one after
+ * the other on the same payload. When an event has more
+ * listeners, a second request is queued for the same job. An
+ * idle worker that takes it steals the listeners the first one
+ * didn't get to yet, and otherwise finds nothing left to do.
+ */
+typedef struct eventpool_job_t {
+	int reason;
+	void *userdata;
+	void *(*done)(void *);
+#ifdef _WIN32
+	volatile long next;
+	volatile long refs;
+#else
+	int next;
+	int refs;
+#endif
+	int nr;
+	void *(*funcs[])(int, void *);
+} eventpool_job_t;
+
+static void eventpool_job_release(struct eventpool_job_t *job) {
+#ifdef _WIN32
+	if(InterlockedDecrement(&job->refs) == 0) {
+#else
+	if(__sync_sub_and_fetch(&job->refs, 1) == 0) {
+#endif
+		if(job->done != NULL && job->reason != REASON_END) {
+			job->done(job->userdata);
+		}
+		FREE(job);
+	}
+}
+
+static void eventpool_job_free(uv_work_t *req, int status) {
 	FREE(req);
 }
 
-static void fib(uv_work_t *req) {
-	struct threadpool_data_t *data = req->data;
+static void eventpool_job_work(uv_work_t *req) {
+	struct eventpool_job_t *job = req->data;
+	int i = 0;
+
+#ifdef _WIN32
+	while((i = InterlockedExchangeAdd(&job->next, 1)) < job->nr) {
+#else
+	while((i = __sync_fetch_and_add(&job->next, 1)) < job->nr) {
+#endif
+		job->funcs[i](job->reason, job->userdata);
+	}
+	eventpool_job_release(job);
+}
 
-	data->func(data->reason, data->userdata);
+static void eventpool_job(struct threadpool_tasks_t *tasks, int nr) {
+	struct eventpool_job_t *job = NULL;
+	uv_work_t *req = NULL;
+	int i = 0, nrreqs = (nr > 1) ? 2 : 1;
 
-	int x = 0;
-	if(data->ref != NULL) {
-		x = uv_sem_trywait(data->ref);
+	if((job = MALLOC(sizeof(struct eventpool_job_t)+sizeof(job->funcs[0])*(size_t)nr)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	job->reason = tasks[0].reason;
+	job->userdata = tasks[0].userdata;
+	job->done = tasks[0].done;
+	job->next = 0;
+	job->refs = nrreqs;
+	job->nr = nr;
+	for(i=0;i<nr;i++) {
+		job->funcs[i] = tasks[i].func;
 	}
-	if((data->ref == NULL) || (x == UV__EAGAIN)) {
-		if(data->done != NULL && data->reason != REASON_END) {
-			data->done(data->userdata);
+
+	for(i=0;i<nrreqs;i++) {
+		if((req = MALLOC(sizeof(uv_work_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		if(data->ref != NULL) {
-			FREE(data->ref);
+		req->data = job;
+		if(uv_queue_work_priority(uv_default_loop(), req, reasons[job->reason].reason, reasons[job->reason].priority, eventpool_job_work, eventpool_job_free) < 0) {
+			FREE(req);
+			/* The listeners this request would have run are skipped */
+			eventpool_job_release(job);
 		}
 	}
-	// FREE(req->data);
 }
 
 void eventpool_callback(int reason, void *(*func)(int, void *)) {
+	if(reason < 0 || reason >= REASON_END) {
+		return;
+	}
 	if(lockinit == 1) {
 		uv_mutex_lock(&listeners_lock);
 	}
@@ -152,8 +237,8 @@ void eventpool_callback(int reason, void *(*func)(int, void *)) {
 	node->reason = reason;
 	node->next = NULL;
 
-	node->next = eventpool_listeners;
-	eventpool_listeners = node;
+	node->next = eventpool_listeners[reason];
+	eventpool_listeners[reason] = node;
 
 #ifdef _WIN32
 	InterlockedIncrement(&nrlisteners[reason]);
@@ -174,12 +259,16 @@ void eventpool_trigger(int reason, void *(*done)(void *), void *data) {
 #ifdef _WIN32
 	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
 #else
-	struct sched_param sched;
-	memset(&sched, 0, sizeof(sched));
-	sched.sched_priority = 80;
-	pthread_setschedparam(pthread_self(), SCHED_RR, &sched);
+	/* Only raise the priority once per triggering thread */
+	static __thread unsigned short prioritized = 0;
+	if(prioritized == 0) {
+		struct sched_param sched;
+		memset(&sched, 0, sizeof(sched));
+		sched.sched_priority = 80;
+		pthread_setschedparam(pthread_self(), SCHED_RR, &sched);
+		prioritized = 1;
+	}
 #endif
-	int eventqueue_size = 0;
 
 	struct eventqueue_t *node = MALLOC(sizeof(struct eventqueue_t));
 	if(node == NULL) {
@@ -191,26 +280,12 @@ void eventpool_trigger(int reason, void *(*done)(void *), void *data) {
 	node->data = data;
 
 	uv_mutex_lock(&listeners_lock);
-	struct eventqueue_t *tmp = eventqueue;
-	if(tmp != NULL) {
-		while(tmp->next != NULL) {
-			eventqueue_size++;
-			tmp = tmp->next;
-		}
-		tmp->next = node;
-		node = tmp;
+	if(eventqueue_tail != NULL) {
+		eventqueue_tail->next = node;
 	} else {
-		node->next = eventqueue;
 		eventqueue = node;
 	}
-
-	/*
-	 * If the eventqueue size is above
-	 * 50 entries then there must be a bug
-	 * at the trigger side.
-	 */
-	assert(eventqueue_size < 50);
-
+	eventqueue_tail = node;
 	uv_mutex_unlock(&listeners_lock);
 
 	uv_async_send(async_req);
@@ -223,20 +298,15 @@ static void eventpool_execute(uv_async_t *handle) {
 	const uv_thread_t pth_cur_id = uv_thread_self();
 	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
 
-	struct threadpool_tasks_t **node = NULL;
+	struct threadpool_tasks_t *node = NULL;
 	int nrlisteners1[REASON_END] = {0};
-	int nr1 = 0, nrnodes = 16, nrnodes1 = 0, i = 0;
-
-	if((node = MALLOC(sizeof(struct threadpool_tasks_t *)*nrnodes)) == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
+	int nr1 = 0, nrnodes1 = 0, i = 0, x = 0, batch = 0;
 
 	uv_mutex_lock(&listeners_lock);
 
 	struct eventqueue_t *queue = NULL;
-	while(eventqueue) {
+	while(eventqueue && batch++ < EVENTPOOL_BATCH) {
 		queue = eventqueue;
-		uv_sem_t *ref = NULL;
 
 #ifdef _WIN32
 		if((nr1 = InterlockedExchangeAdd(&nrlisteners[queue->reason], 0)) == 0) {
@@ -247,14 +317,7 @@ static void eventpool_execute(uv_async_t *handle) {
 				queue->done((void *)queue->data);
 			}
 		} else {
-			if(threads == EVENTPOOL_THREADED) {
-				if((ref = MALLOC(sizeof(uv_sem_t))) == NULL) {
-					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-				}
-				uv_sem_init(ref, nr1-1);
-			}
-
-			struct eventpool_listener_t *listeners = eventpool_listeners;
+			struct eventpool_listener_t *listeners = eventpool_listeners[queue->reason];
 			if(listeners == NULL) {
 				if(queue->done != NULL) {
 					queue->done((void *)queue->data);
@@ -262,27 +325,24 @@ static void eventpool_execute(uv_async_t *handle) {
 			}
 
 			while(listeners) {
-				if(listeners->reason == queue->reason) {
-					if(nrnodes1 == nrnodes) {
-						nrnodes *= 2;
-						/*LCOV_EXCL_START*/
-						if((node = REALLOC(node, sizeof(struct threadpool_tasks_t *)*nrnodes)) == NULL) {
-							OUT_OF_MEMORY
-						}
-						/*LCOV_EXCL_STOP*/
-					}
-					if((node[nrnodes1] = MALLOC(sizeof(struct threadpool_tasks_t))) == NULL) {
-						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-					}
-					node[nrnodes1]->func = listeners->func;
-					node[nrnodes1]->userdata = queue->data;
-					node[nrnodes1]->done = queue->done;
-					node[nrnodes1]->ref = ref;
-					node[nrnodes1]->reason = listeners->reason;
-					nrnodes1++;
-					if(threads == EVENTPOOL_THREADED) {
-						nrlisteners1[queue->reason]++;
+				if(nrnodes1 == nrtasks) {
+					nrtasks = (nrtasks == 0) ? 16 : nrtasks*2;
+					/*LCOV_EXCL_START*/
+					if((tasks = REALLOC(tasks, sizeof(struct threadpool_tasks_t)*nrtasks)) == NULL) {
+						OUT_OF_MEMORY
 					}
+					/*LCOV_EXCL_STOP*/
+				}
+				tasks[nrnodes1].func = listeners->func;
+				tasks[nrnodes1].userdata = queue->data;
+				tasks[nrnodes1].done = queue->done;
+				tasks[nrnodes1].ref = NULL;
+				/* Tells the listeners of one event apart from the next */
+				tasks[nrnodes1].id = (unsigned long)batch;
+				tasks[nrnodes1].reason = listeners->reason;
+				nrnodes1++;
+				if(threads == EVENTPOOL_THREADED) {
+					nrlisteners1[queue->reason]++;
 				}
 				listeners = listeners->next;
 			}
@@ -290,57 +350,39 @@ static void eventpool_execute(uv_async_t *handle) {
 		eventqueue = eventqueue->next;
 		FREE(queue);
 	}
+	if(eventqueue == NULL) {
+		eventqueue_tail = NULL;
+	}
 	uv_mutex_unlock(&listeners_lock);
 
 	if(nrnodes1 > 0) {
 		for(i=0;i<nrnodes1;i++) {
+			node = &tasks[i];
 			if(threads == EVENTPOOL_NO_THREADS) {
-				nrlisteners1[node[i]->reason]++;
-				node[i]->func(node[i]->reason, node[i]->userdata);
+				nrlisteners1[node->reason]++;
+				node->func(node->reason, node->userdata);
 
 #ifdef _WIN32
-				if(nrlisteners1[node[i]->reason] == InterlockedExchangeAdd(&nrlisteners[node[i]->reason], 0)) {
+				if(nrlisteners1[node->reason] == InterlockedExchangeAdd(&nrlisteners[node->reason], 0)) {
 #else
-				if(nrlisteners1[node[i]->reason] == __sync_add_and_fetch(&nrlisteners[node[i]->reason], 0)) {
+				if(nrlisteners1[node->reason] == __sync_add_and_fetch(&nrlisteners[node->reason], 0)) {
 #endif
-					if(node[i]->done != NULL) {
-						node[i]->done((void *)node[i]->userdata);
+					if(node->done != NULL) {
+						node->done((void *)node->userdata);
 					}
-					nrlisteners1[node[i]->reason] = 0;
+					nrlisteners1[node->reason] = 0;
 				}
 			} else {
-				struct threadpool_data_t *tpdata = NULL;
-				tpdata = MALLOC(sizeof(struct threadpool_data_t));
-				if(tpdata == NULL) {
-					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-				}
-				tpdata->userdata = node[i]->userdata;
-				tpdata->func = node[i]->func;
-				tpdata->done = node[i]->done;
-				tpdata->ref = node[i]->ref;
-				tpdata->reason = node[i]->reason;
-				tpdata->priority = reasons[node[i]->reason].priority;
-
-				uv_work_t *tp_work_req = MALLOC(sizeof(uv_work_t));
-				if(tp_work_req == NULL) {
-					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-				}
-				tp_work_req->data = tpdata;
-				if(uv_queue_work(uv_default_loop(), tp_work_req, reasons[node[i]->reason].reason, fib, fib_free) < 0) {
-					if(node[i]->done != NULL) {
-						node[i]->done((void *)node[i]->userdata);
-					}
-					FREE(tpdata);
-					FREE(node[i]->ref);
-				}
+				/* The listeners of an event follow each other */
+				for(x=i+1;x<nrnodes1 && tasks[x].id == node->id;x++);
+				eventpool_job(node, x-i);
+				i = x-1;
 			}
-			FREE(node[i]);
 		}
 	}
 	for(i=0;i<REASON_END;i++) {
 		nrlisteners1[i] = 0;
 	}
-	FREE(node);
 	uv_mutex_lock(&listeners_lock);
 	if(eventqueue != NULL) {
 		uv_async_send(async_req);
@@ -348,6 +390,86 @@ static void eventpool_execute(uv_async_t *handle) {
 	uv_mutex_unlock(&listeners_lock);
 }
 
+/*
+ * Decoding, sending and broadcasting run from the high priority
+ * queue, so they don't wait for slow lua actions or file access
+ * that share the same threadpool.
+ */
+void eventpool_stats(struct JsonNode *jstats) {
+	char *queues[UV_PRIORITY_MAX] = { "high", "normal", "low" };
+	char name[64];
+	unsigned int depth = 0;
+	uint64_t taken = 0, waited = 0;
+	int i = 0;
+
+	for(i=0;i<UV_PRIORITY_MAX;i++) {
+		uv_threadpool_stats(i, &depth, &taken, &waited);
+		snprintf(name, sizeof(name), "threadpool-%s-depth", queues[i]);
+		json_append_member(jstats, name, json_mknumber(depth, 0));
+		/* Average wait in milliseconds */
+		snprintf(name, sizeof(name), "threadpool-%s-wait", queues[i]);
+		json_append_member(jstats, name, json_mknumber((taken > 0) ? ((double)waited/(double)taken)/1000000 : 0, 3));
+	}
+}
+
+/*
+ * Take a free record from the slab of a hardware module. When
+ * all records are still in use a new one is allocated instead.
+ * The record gets room for size pulses from the pulse pool.
+ */
+struct reason_received_pulsetrain_t *eventpool_pulsetrain_get(struct pulsetrain_slab_t *slab, int size) {
+	struct reason_received_pulsetrain_t *train = NULL;
+	unsigned long used = 0, bit = 0;
+	int i = 0;
+
+	if(slab != NULL) {
+		for(i=0;i<PULSETRAIN_SLAB_SIZE;i++) {
+			bit = 1UL << i;
+			used = slab->used;
+			if((used & bit) == 0) {
+#ifdef _WIN32
+				if((unsigned long)InterlockedCompareExchange((volatile LONG *)&slab->used, (LONG)(used | bit), (LONG)used) == used) {
+#else
+				if(__sync_bool_compare_and_swap(&slab->used, used, used | bit)) {
+#endif
+					train = &slab->trains[i];
+					train->slab = slab;
+					train->trace.id = 0;
+					train->pulses = pulsepool_alloc(sizeof(int)*(size_t)(size+1));
+					return train;
+				}
+			}
+		}
+	}
+
+	if((train = MALLOC(sizeof(struct reason_received_pulsetrain_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	train->slab = NULL;
+	train->trace.id = 0;
+	train->pulses = pulsepool_alloc(sizeof(int)*(size_t)(size+1));
+	return train;
+}
+
+/* Done callback of REASON_RECEIVED_PULSETRAIN */
+void *eventpool_pulsetrain_free(void *param) {
+	struct reason_received_pulsetrain_t *train = param;
+	struct pulsetrain_slab_t *slab = train->slab;
+
+	pulsepool_free(train->pulses);
+	train->pulses = NULL;
+	if(slab == NULL) {
+		FREE(train);
+	} else {
+#ifdef _WIN32
+		InterlockedAnd((volatile LONG *)&slab->used, (LONG)~(1UL << (train - slab->trains)));
+#else
+		__sync_fetch_and_and(&slab->used, ~(1UL << (train - slab->trains)));
+#endif
+	}
+	return NULL;
+}
+
 int eventpool_gc(void) {
 	if(lockinit == 1) {
 		uv_mutex_lock(&listeners_lock);
@@ -361,21 +483,22 @@ int eventpool_gc(void) {
 		eventqueue = eventqueue->next;
 		FREE(queue);
 	}
-	struct eventpool_listener_t *listeners = NULL;
-	while(eventpool_listeners) {
-		listeners = eventpool_listeners;
-		eventpool_listeners = eventpool_listeners->next;
-		FREE(listeners);
-	}
-	if(eventpool_listeners != NULL) {
-		FREE(eventpool_listeners);
+	eventqueue_tail = NULL;
+	if(tasks != NULL) {
+		FREE(tasks);
 	}
-	threads = EVENTPOOL_NO_THREADS;
-
+	nrtasks = 0;
+	struct eventpool_listener_t *listeners = NULL;
 	int i = 0;
 	for(i=0;i<REASON_END;i++) {
+		while(eventpool_listeners[i]) {
+			listeners = eventpool_listeners[i];
+			eventpool_listeners[i] = eventpool_listeners[i]->next;
+			FREE(listeners);
+		}
 		nrlisteners[i] = 0;
 	}
+	threads = EVENTPOOL_NO_THREADS;
 
 	if(lockinit == 1) {
 		uv_mutex_unlock(&listeners_lock);
@@ -384,19 +507,70 @@ int eventpool_gc(void) {
 	return 0;
 }
 
+/*
+ * Removing only moves the start of the data, so a slow
+ * client taking a large buffer in small parts doesn't make
+ * us move the rest over and over again. An emptied buffer
+ * starts at the front again, and a large one is given back.
+ */
 void iobuf_remove(struct iobuf_t *io, size_t n) {
 	uv_mutex_lock(&io->lock);
   if(n > 0 && n <= io->len) {
-    memmove(io->buf, io->buf + n, io->len - n);
     io->len -= n;
-		io->buf[io->len] = 0;
+    if(io->len == 0) {
+      if(io->cap > IOBUF_IDLE) {
+        FREE(io->base);
+        io->buf = NULL;
+        io->cap = 0;
+      } else {
+        io->buf = io->base;
+      }
+      io->size = io->cap;
+    } else {
+      io->buf += n;
+      io->size -= n;
+    }
+    if(io->buf != NULL) {
+      io->buf[io->len] = 0;
+    }
   }
 	uv_mutex_unlock(&io->lock);
 }
 
+static void iobuf_free(struct iobuf_t *iobuf) {
+  if(iobuf != NULL) {
+		uv_mutex_lock(&iobuf->lock);
+    if(iobuf->base != NULL) {
+			FREE(iobuf->base);
+		}
+		iobuf->buf = NULL;
+		iobuf->len = iobuf->size = iobuf->cap = 0;
+  }
+	uv_mutex_unlock(&iobuf->lock);
+}
+
+static void iobuf_init(struct iobuf_t *iobuf, size_t initial_size) {
+  iobuf->len = iobuf->size = iobuf->cap = 0;
+  iobuf->buf = iobuf->base = NULL;
+	uv_mutex_init(&iobuf->lock);
+}
+
+/*
+ * What still has to go out before a connection can be closed.
+ * An offloaded connection also waits for its running job and
+ * the ciphertext it made.
+ */
+static size_t uv_custom_pending(struct uv_custom_poll_t *custom_poll_data) {
+	size_t len = (size_t)custom_poll_data->send_iobuf.len;
+
+	if(custom_poll_data->ssl.offload == 1) {
+		len += (size_t)custom_poll_data->ssl.busy + (size_t)custom_poll_data->ssl.cipher_out.len;
+	}
+	return len;
+}
+
 static void eventpool_update_poll(uv_poll_t *req) {
 	struct uv_custom_poll_t *custom_poll_data = NULL;
-	struct iobuf_t *send_io = NULL;
 	int action = 0, r = 0;
 
 	custom_poll_data = req->data;
@@ -404,7 +578,10 @@ static void eventpool_update_poll(uv_poll_t *req) {
 		return;
 	}
 
-	send_io = &custom_poll_data->send_iobuf;
+	/* The job of an offloaded connection polls again when it's done */
+	if(custom_poll_data->ssl.busy == 1) {
+		return;
+	}
 
 	if(custom_poll_data->doread == 1) {
 		action |= UV_READABLE;
@@ -414,7 +591,7 @@ static void eventpool_update_poll(uv_poll_t *req) {
 		action |= UV_WRITABLE;
 	}
 
-	if(custom_poll_data->doclose == 1 && send_io->len == 0) {
+	if(custom_poll_data->doclose == 1 && uv_custom_pending(custom_poll_data) == 0) {
 		custom_poll_data->doclose = 2;
 		if(custom_poll_data->close_cb != NULL) {
 			custom_poll_data->close_cb(req);
@@ -434,7 +611,14 @@ static void eventpool_update_poll(uv_poll_t *req) {
 	}
 }
 
+/*
+ * When the room after the data runs out, the data is moved
+ * to the front if more than its own length was removed in
+ * front of it. Otherwise the allocation at least doubles,
+ * so appending stays linear.
+ */
 size_t iobuf_append(struct iobuf_t *io, const void *buf, int len) {
+  ssize_t cap = 0;
   char *p = NULL;
 
 	uv_mutex_lock(&io->lock);
@@ -445,13 +629,31 @@ size_t iobuf_append(struct iobuf_t *io, const void *buf, int len) {
   } else if(io->len + len <= io->size) {
     memcpy(io->buf + io->len, buf, len);
     io->len += len;
-  } else if((p = REALLOC(io->buf, io->len + len + 1)) != NULL) {
-    io->buf = p;
+    io->buf[io->len] = 0;
+  } else {
+    if(io->buf != io->base && (io->buf - io->base) >= io->len) {
+      memmove(io->base, io->buf, io->len);
+      io->buf = io->base;
+      io->size = io->cap;
+    }
+    if(io->len + len > io->size) {
+      if(io->buf != io->base) {
+        memmove(io->base, io->buf, io->len);
+        io->buf = io->base;
+      }
+      cap = (io->cap < IOBUF_MIN) ? IOBUF_MIN : io->cap;
+      while(cap < io->len + len) {
+        cap *= 2;
+      }
+      if((p = REALLOC(io->base, cap + 1)) == NULL) {
+        OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+      }
+      io->base = io->buf = p;
+      io->cap = io->size = cap;
+    }
     memcpy(io->buf + io->len, buf, len);
     io->len += len;
-    io->size = io->len;
-  } else {
-    len = 0;
+    io->buf[io->len] = 0;
   }
 	uv_mutex_unlock(&io->lock);
 
@@ -464,6 +666,245 @@ static void my_debug(void *ctx, int level, const char *file, int line, const cha
 }
 /*LCOV_EXCL_STOP*/
 
+/*
+ * With ssl-offload the handshake and the records of a secure
+ * connection are handled on the threadpool. The main loop only
+ * moves the ciphertext between the socket and the buffers of the
+ * connection. While a job runs the connection is not polled, so
+ * the job has the mbed TLS context and the cipher buffers to
+ * itself. The plaintext to send is handed over as a copy, so the
+ * send buffer can still grow meanwhile.
+ */
+static int ssl_offload_send(void *ctx, const unsigned char *buf, size_t len) {
+	struct uv_custom_poll_t *custom_poll_data = ctx;
+
+	iobuf_append(&custom_poll_data->ssl.cipher_out, buf, (int)len);
+	return (int)len;
+}
+
+static int ssl_offload_recv(void *ctx, unsigned char *buf, size_t len) {
+	struct uv_custom_poll_t *custom_poll_data = ctx;
+	struct iobuf_t *io = &custom_poll_data->ssl.cipher_in;
+
+	if(io->len == 0) {
+		return MBEDTLS_ERR_SSL_WANT_READ;
+	}
+	if((size_t)io->len < len) {
+		len = (size_t)io->len;
+	}
+	memcpy(buf, io->buf, len);
+	iobuf_remove(io, len);
+	return (int)len;
+}
+
+static void ssl_offload_work(uv_work_t *work) {
+	struct uv_custom_poll_t *custom_poll_data = work->data;
+	struct iobuf_t *plain_out = &custom_poll_data->ssl.plain_out;
+	unsigned char buffer[BUFFER_SIZE];
+	size_t pos = 0;
+	int n = 0;
+
+	custom_poll_data->ssl.written = 0;
+
+	if(custom_poll_data->ssl.handshake == 0) {
+		n = mbedtls_ssl_handshake(&custom_poll_data->ssl.ctx);
+		if(n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE) {
+			return;
+		} else if(n < 0) {
+			custom_poll_data->ssl.error = n;
+			return;
+		}
+		/* Just done, so the session can be stored for the next time */
+		custom_poll_data->ssl.handshake = 2;
+	}
+
+	while(pos < (size_t)plain_out->len) {
+		n = mbedtls_ssl_write(&custom_poll_data->ssl.ctx, (unsigned char *)plain_out->buf+pos, (size_t)plain_out->len-pos);
+		if(n == MBEDTLS_ERR_SSL_WANT_READ || n == MBEDTLS_ERR_SSL_WANT_WRITE) {
+			break;
+		} else if(n < 0) {
+			custom_poll_data->ssl.error = n;
+			return;
+		}
+		pos += (size_t)n;
+	}
+	custom_poll_data->ssl.written = pos;
+
+	while((n = mbedtls_ssl_read(&custom_poll_data->ssl.ctx, buffer, BUFFER_SIZE)) > 0) {
+		iobuf_append(&custom_poll_data->ssl.plain_in, buffer, n);
+	}
+	if(n == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) {
+		custom_poll_data->ssl.notify = 1;
+	} else if(n < 0 && n != MBEDTLS_ERR_SSL_WANT_READ && n != MBEDTLS_ERR_SSL_WANT_WRITE) {
+		custom_poll_data->ssl.error = n;
+	}
+}
+
+static void ssl_offload_done(uv_work_t *work, int status);
+
+/*
+ * Returns 0 when a job was queued. Without new ciphertext
+ * a job can only send, and only once the handshake is done.
+ */
+static int ssl_offload_queue(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct iobuf_t *send_io = &custom_poll_data->send_iobuf;
+
+	if(custom_poll_data->ssl.busy == 1 || custom_poll_data->ssl.error < 0) {
+		return -1;
+	}
+	if(custom_poll_data->ssl.cipher_in.len == 0 &&
+	   (custom_poll_data->ssl.wait == 1 || (custom_poll_data->ssl.handshake == 1 && send_io->len == 0))) {
+		return -1;
+	}
+	if(send_io->len > 0) {
+		iobuf_append(&custom_poll_data->ssl.plain_out, send_io->buf, (int)send_io->len);
+	}
+
+	custom_poll_data->ssl.busy = 1;
+	custom_poll_data->ssl.req = req;
+	custom_poll_data->ssl.work_req.data = custom_poll_data;
+	uv_poll_stop(req);
+	custom_poll_data->action = 0;
+
+	if(uv_queue_work_priority(uv_default_loop(), &custom_poll_data->ssl.work_req, "ssl", UV_PRIORITY_NORMAL, ssl_offload_work, ssl_offload_done) < 0) {
+		/*LCOV_EXCL_START*/
+		custom_poll_data->ssl.busy = 0;
+		iobuf_remove(&custom_poll_data->ssl.plain_out, (size_t)custom_poll_data->ssl.plain_out.len);
+		return -1;
+		/*LCOV_EXCL_STOP*/
+	}
+	return 0;
+}
+
+/*
+ * Queue the next job, or poll for what the connection waits
+ * for. Once all plaintext went out the write_cb is called.
+ */
+static void ssl_offload_next(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+
+	if(ssl_offload_queue(req) == 0) {
+		return;
+	}
+
+	custom_poll_data->dowrite = (custom_poll_data->ssl.cipher_out.len > 0);
+	if(custom_poll_data->ssl.cipher_out.len == 0 && custom_poll_data->send_iobuf.len == 0 &&
+	   custom_poll_data->ssl.flush == 1) {
+		custom_poll_data->ssl.flush = 0;
+		if(custom_poll_data->doclose == 0 && custom_poll_data->write_cb != NULL) {
+			custom_poll_data->write_cb(req);
+		}
+	}
+	eventpool_update_poll(req);
+}
+
+static void ssl_offload_done(uv_work_t *work, int status) {
+	struct uv_custom_poll_t *custom_poll_data = work->data;
+	struct iobuf_t *plain_in = &custom_poll_data->ssl.plain_in;
+	uv_poll_t *req = custom_poll_data->ssl.req;
+	char buffer[BUFFER_SIZE];
+
+	custom_poll_data->ssl.busy = 0;
+	if(custom_poll_data->ssl.freed == 1) {
+		uv_custom_poll_free(custom_poll_data);
+		return;
+	}
+
+	if(custom_poll_data->ssl.written > 0) {
+		iobuf_remove(&custom_poll_data->send_iobuf, custom_poll_data->ssl.written);
+		custom_poll_data->ssl.flush = 1;
+	}
+	/* A partly sent copy waits for the peer as well */
+	custom_poll_data->ssl.wait = (custom_poll_data->ssl.handshake == 0 ||
+		custom_poll_data->ssl.written < (size_t)custom_poll_data->ssl.plain_out.len);
+	iobuf_remove(&custom_poll_data->ssl.plain_out, (size_t)custom_poll_data->ssl.plain_out.len);
+
+	if(uv_is_closing((uv_handle_t *)req)) {
+		return;
+	}
+
+	if(custom_poll_data->ssl.error < 0) {
+		mbedtls_strerror(custom_poll_data->ssl.error, (char *)&buffer, BUFFER_SIZE);
+		logprintf(LOG_NOTICE, "mbedtls_ssl_handshake: %s", buffer);
+		uv_poll_stop(req);
+		return;
+	}
+
+	if(custom_poll_data->ssl.handshake == 2) {
+		custom_poll_data->ssl.handshake = 1;
+		if(custom_poll_data->is_server == 0 && custom_poll_data->host != NULL) {
+			ssl_session_store(custom_poll_data->host, &custom_poll_data->ssl.ctx);
+		}
+	}
+	if(custom_poll_data->ssl.handshake == 0) {
+		custom_poll_data->doread = 1;
+	}
+
+	if(plain_in->len > 0) {
+		iobuf_append(&custom_poll_data->recv_iobuf, plain_in->buf, (int)plain_in->len);
+		iobuf_remove(plain_in, (size_t)plain_in->len);
+		custom_poll_data->doread = 0;
+		if(custom_poll_data->read_cb != NULL) {
+			custom_poll_data->read_cb(req, &custom_poll_data->recv_iobuf.len, custom_poll_data->recv_iobuf.buf);
+		}
+		/* The connection may have been closed by the callback */
+		if((custom_poll_data = req->data) == NULL || uv_is_closing((uv_handle_t *)req)) {
+			return;
+		}
+	}
+	if(custom_poll_data->ssl.notify == 1) {
+		custom_poll_data->ssl.notify = 0;
+		custom_poll_data->doread = 0;
+		if(custom_poll_data->read_cb != NULL) {
+			custom_poll_data->read_cb(req, &custom_poll_data->recv_iobuf.len, custom_poll_data->recv_iobuf.buf);
+		}
+		if((custom_poll_data = req->data) == NULL || uv_is_closing((uv_handle_t *)req)) {
+			return;
+		}
+	}
+
+	ssl_offload_next(req);
+}
+
+static void ssl_offload_poll(uv_poll_t *req, uv_os_fd_t fd, int events) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct iobuf_t *cipher_out = &custom_poll_data->ssl.cipher_out;
+	char buffer[BUFFER_SIZE];
+	int n = 0;
+
+	if(custom_poll_data->ssl.busy == 1) {
+		uv_poll_stop(req);
+		custom_poll_data->action = 0;
+		return;
+	}
+
+	if((events & UV_WRITABLE) && cipher_out->len > 0) {
+		n = (int)send((unsigned int)fd, cipher_out->buf, cipher_out->len, 0);
+		if(n > 0) {
+			iobuf_remove(cipher_out, n);
+		} else if(n < 0 && errno != EAGAIN && errno != EINTR) {
+			uv_poll_stop(req);
+			return;
+		}
+	}
+
+	if(events & UV_READABLE) {
+		n = (int)recv((unsigned int)fd, buffer, BUFFER_SIZE, 0);
+		if(n > 0) {
+			iobuf_append(&custom_poll_data->ssl.cipher_in, buffer, n);
+		/*
+		 * Client was disconnected
+		 */
+		} else if(n == 0) {
+			custom_poll_data->doclose = 1;
+			custom_poll_data->doread = 0;
+		}
+	}
+
+	ssl_offload_next(req);
+}
+
 void uv_custom_poll_cb(uv_poll_t *req, int status, int events) {
 	/*
 	 * Make sure we execute in the main thread
@@ -544,13 +985,29 @@ void uv_custom_poll_cb(uv_poll_t *req, int status, int events) {
 			return;
 		}
 		// mbedtls_debug_set_threshold(2);
-		mbedtls_ssl_set_bio(&custom_poll_data->ssl.ctx, &fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+		if((custom_poll_data->ssl.offload = ssl_offload()) == 1) {
+			iobuf_init(&custom_poll_data->ssl.cipher_in, 0);
+			iobuf_init(&custom_poll_data->ssl.cipher_out, 0);
+			iobuf_init(&custom_poll_data->ssl.plain_in, 0);
+			iobuf_init(&custom_poll_data->ssl.plain_out, 0);
+			mbedtls_ssl_set_bio(&custom_poll_data->ssl.ctx, custom_poll_data, ssl_offload_send, ssl_offload_recv, NULL);
+		} else {
+			mbedtls_ssl_set_bio(&custom_poll_data->ssl.ctx, &fd, mbedtls_net_send, mbedtls_net_recv, NULL);
+		}
 		mbedtls_ssl_conf_dbg(ssl_conf, my_debug, stdout);
 		if(custom_poll_data->host != NULL) {
 			mbedtls_ssl_set_hostname(&custom_poll_data->ssl.ctx, custom_poll_data->host);
+			if(custom_poll_data->is_server == 0) {
+				ssl_session_resume(custom_poll_data->host, &custom_poll_data->ssl.ctx);
+			}
 		}
 	}
 
+	if(custom_poll_data->ssl.offload == 1) {
+		ssl_offload_poll(req, fd, events);
+		return;
+	}
+
 	if(custom_poll_data->is_ssl == 1 && custom_poll_data->ssl.handshake == 0) {
 		n = mbedtls_ssl_handshake(&custom_poll_data->ssl.ctx);
 		if(n == MBEDTLS_ERR_SSL_WANT_READ) {
@@ -574,6 +1031,9 @@ void uv_custom_poll_cb(uv_poll_t *req, int status, int events) {
 			/*LCOV_EXCL_STOP*/
 		} else {
 			custom_poll_data->ssl.handshake = 1;
+			if(custom_poll_data->is_server == 0 && custom_poll_data->host != NULL) {
+				ssl_session_store(custom_poll_data->host, &custom_poll_data->ssl.ctx);
+			}
 		}
 		custom_poll_data->dowrite = 1;
 		goto end;
@@ -760,40 +1220,34 @@ end:
 	eventpool_update_poll(req);
 }
 
-static void iobuf_free(struct iobuf_t *iobuf) {
-  if(iobuf != NULL) {
-		uv_mutex_lock(&iobuf->lock);
-    if(iobuf->buf != NULL) {
-			FREE(iobuf->buf);
-		}
-		iobuf->len = iobuf->size = 0;
-  }
-	uv_mutex_unlock(&iobuf->lock);
-}
-
 void uv_custom_poll_free(struct uv_custom_poll_t *data) {
+	/* The running job still uses it, see ssl_offload_done */
+	if(data->ssl.busy == 1) {
+		data->ssl.freed = 1;
+		return;
+	}
 	if(data->is_ssl == 1) {
 		mbedtls_ssl_free(&data->ssl.ctx);
 	}
+	if(data->ssl.offload == 1) {
+		iobuf_free(&data->ssl.cipher_in);
+		iobuf_free(&data->ssl.cipher_out);
+		iobuf_free(&data->ssl.plain_in);
+		iobuf_free(&data->ssl.plain_out);
+	}
 	if(data->host != NULL) {
 		FREE(data->host);
 	}
-	if(data->send_iobuf.size > 0) {
+	if(data->send_iobuf.cap > 0) {
 		iobuf_free(&data->send_iobuf);
 	}
-	if(data->recv_iobuf.size > 0) {
+	if(data->recv_iobuf.cap > 0) {
 		iobuf_free(&data->recv_iobuf);
 	}
 
 	FREE(data);
 }
 
-static void iobuf_init(struct iobuf_t *iobuf, size_t initial_size) {
-  iobuf->len = iobuf->size = 0;
-  iobuf->buf = NULL;
-	uv_mutex_init(&iobuf->lock);
-}
-
 void uv_custom_poll_init(struct uv_custom_poll_t **custom_poll, uv_poll_t *poll, void *data) {
 	if((*custom_poll = MALLOC(sizeof(struct uv_custom_poll_t))) == NULL) {
 		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
@@ -820,7 +1274,7 @@ int uv_custom_close(uv_poll_t *req) {
 
 	send_io = &custom_poll_data->send_iobuf;
 
-	if(custom_poll_data->doclose == 1 && send_io->len == 0) {
+	if(custom_poll_data->doclose == 1 && uv_custom_pending(custom_poll_data) == 0) {
 		custom_poll_data->doclose = 2;
 		if(custom_poll_data->close_cb != NULL) {
 			custom_poll_data->close_cb(req);
@@ -828,7 +1282,7 @@ int uv_custom_close(uv_poll_t *req) {
 		if(!uv_is_closing((uv_handle_t *)req)) {
 			uv_poll_stop(req);
 		}
-	} else if(send_io->len > 0) {
+	} else if(send_io->len > 0 || custom_poll_data->ssl.offload == 1) {
 		uv_custom_write(req);
 	}
 
@@ -869,6 +1323,34 @@ int uv_custom_write(uv_poll_t *req) {
 	return 0;
 }
 
+/*
+ * Write a buffer that is shared with other connections. When
+ * nothing else is pending on a plain connection the buffer is
+ * sent from directly, so only the part the socket did not take
+ * is copied to the send buffer.
+ */
+int uv_custom_write_shared(uv_poll_t *req, const char *buf, size_t len) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	uv_os_fd_t fd = 0;
+	ssize_t n = 0;
+
+	if(uv_is_closing((uv_handle_t *)req) || custom_poll_data == NULL) {
+		return -1;
+	}
+
+	if(custom_poll_data->is_ssl == 0 && custom_poll_data->doclose == 0 &&
+	   custom_poll_data->send_iobuf.len == 0 && uv_fileno((uv_handle_t *)req, &fd) == 0) {
+		if((n = send((unsigned int)fd, buf, len, 0)) < 0) {
+			n = 0;
+		}
+	}
+	if((size_t)n < len) {
+		iobuf_append(&custom_poll_data->send_iobuf, buf+n, (int)(len-n));
+	}
+
+	return uv_custom_write(req);
+}
+
 void eventpool_init(enum eventpool_threads_t t) {
 	/*
 	 * Make sure we execute in the main thread
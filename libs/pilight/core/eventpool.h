@@ -140,10 +140,18 @@ typedef struct eventpool_listener_t {
 	struct eventpool_listener_t *next;
 } eventpool_listener_t;
 
+/*
+ * The data starts at buf, which moves forward into the
+ * allocation at base as data is removed. The size is the
+ * room left from buf onwards, the cap that of the whole
+ * allocation.
+ */
 typedef struct iobuf_t {
   char *buf;
   ssize_t len;
   ssize_t size;
+  char *base;
+  ssize_t cap;
 	uv_mutex_t lock;
 } iobuf_t;
 
@@ -173,6 +181,26 @@ struct uv_custom_poll_t {
 		int init;
 		int handshake;
 		mbedtls_ssl_context ctx;
+
+		/* Set when the records are handled on the threadpool */
+		int offload;
+		/* A job of this connection is running, see ssl_offload_work */
+		int busy;
+		/* Free the connection once the running job is done */
+		int freed;
+		/* Nothing is to be done until more ciphertext arrived */
+		int wait;
+		/* The plaintext sent by the last job, to call write_cb */
+		int flush;
+		int error;
+		int notify;
+		size_t written;
+		uv_poll_t *req;
+		uv_work_t work_req;
+		struct iobuf_t cipher_in;
+		struct iobuf_t cipher_out;
+		struct iobuf_t plain_in;
+		struct iobuf_t plain_out;
 	} ssl;
 
   struct iobuf_t recv_iobuf;
@@ -183,6 +211,10 @@ void eventpool_callback(int, void *(*)(int, void *));
 void eventpool_trigger(int, void *(*)(void *), void *);
 void eventpool_init(enum eventpool_threads_t);
 int eventpool_gc(void);
+void eventpool_stats(struct JsonNode *);
+
+struct reason_received_pulsetrain_t *eventpool_pulsetrain_get(struct pulsetrain_slab_t *, int);
+void *eventpool_pulsetrain_free(void *);
 
 void iobuf_remove(struct iobuf_t *, size_t);
 size_t iobuf_append(struct iobuf_t *, const void *, int);
@@ -192,6 +224,7 @@ void uv_custom_poll_free(struct uv_custom_poll_t *);
 void uv_custom_poll_cb(uv_poll_t *, int, int);
 int uv_custom_read(uv_poll_t *);
 int uv_custom_write(uv_poll_t *);
+int uv_custom_write_shared(uv_poll_t *, const char *, size_t);
 int uv_custom_close(uv_poll_t *);
 
 #endif
@@ -10,6 +10,7 @@
 #define _EVENTPOOL_STRUCTS_H_
 
 #include "defines.h"
+#include "trace.h"
 #include "eventpool_structs.h"
 
 typedef struct reason_log_t {
@@ -23,12 +24,31 @@ typedef struct reason_ssdp_received_t {
 	int port;
 } reason_ssdp_received_t;
 
+struct pulsetrain_slab_t;
+
 typedef struct reason_received_pulsetrain_t {
 	int length;
-	int pulses[MAXPULSESTREAMLENGTH+1];
+	/* Room for the pulses asked for, from the pulse pool */
+	int *pulses;
 	char *hardware;
+	/* Started by the hardware module when tracing is enabled */
+	struct trace_t trace;
+	/* NULL when the record was allocated outside a slab */
+	struct pulsetrain_slab_t *slab;
 } reason_received_pulsetrain_t;
 
+/*
+ * Preallocated pulse trains of a hardware module. A set bit
+ * marks a record that was handed to the eventpool and is not
+ * released yet.
+ */
+#define PULSETRAIN_SLAB_SIZE	32
+
+typedef struct pulsetrain_slab_t {
+	struct reason_received_pulsetrain_t trains[PULSETRAIN_SLAB_SIZE];
+	volatile unsigned long used;
+} pulsetrain_slab_t;
+
 typedef struct reason_code_received_t {
 	char message[1025];
 	char origin[256];
@@ -51,11 +71,13 @@ typedef struct reason_code_sent_t {
 typedef struct reason_code_sent_fail_t {
 	char message[1025];
 	char uuid[UUID_LENGTH+1];
+	int hwtype;
 } reason_code_sent_failed_t;
 
 typedef struct reason_code_sent_success_t {
 	char message[1025];
 	char uuid[UUID_LENGTH+1];
+	int hwtype;
 } reason_code_sent_success_t;
 
 typedef struct reason_socket_disconnected_t {
@@ -92,7 +114,8 @@ typedef struct reason_send_code_t {
 	char message[1025];
 	int rawlen;
 	int txrpt;
-	int pulses[MAXPULSESTREAMLENGTH+1];
+	/* Of the pulse pool, freed with the record */
+	int *pulses;
 	char protocol[256];
 	int hwtype;
 	char uuid[UUID_LENGTH+1];
@@ -22,6 +22,9 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+	#include <sys/mman.h>
+#endif
 
 #include "fcache.h"
 #include "common.h"
@@ -29,54 +32,107 @@
 #include "log.h"
 #include "gc.h"
 
-int fcache_gc(void) {
-	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+/*
+ * The cache is only used from the main thread. Entries are
+ * found through a hash of their name and kept in an LRU list,
+ * the least recently used ones are dropped once the memory
+ * budget is exceeded.
+ */
+static struct fcache_t *fcache_hash[FCACHE_HASH_SIZE];
+static struct fcache_t *fcache_head = NULL;
+static struct fcache_t *fcache_tail = NULL;
+static unsigned long fcache_used = 0;
+static unsigned long fcache_size = FCACHE_SIZE;
 
-	struct fcache_t *tmp = fcache;
-	while(fcache) {
-		tmp = fcache;
-		FREE(tmp->name);
-		FREE(tmp->bytes);
-		fcache = fcache->next;
-		FREE(tmp);
-	}
-	if(fcache != NULL) {
-		FREE(fcache);
+static void fcache_unlink(struct fcache_t *node) {
+	struct fcache_t **tmp = &fcache_hash[node->hash % FCACHE_HASH_SIZE];
+	while(*tmp != NULL) {
+		if(*tmp == node) {
+			*tmp = node->hnext;
+			break;
+		}
+		tmp = &(*tmp)->hnext;
 	}
 
-	logprintf(LOG_DEBUG, "garbage collected fcache library");
-	return 1;
+	if(node->prev != NULL) {
+		node->prev->next = node->next;
+	} else {
+		fcache_head = node->next;
+	}
+	if(node->next != NULL) {
+		node->next->prev = node->prev;
+	} else {
+		fcache_tail = node->prev;
+	}
+	node->prev = node->next = NULL;
 }
 
-void fcache_remove_node(struct fcache_t **cache, char *name) {
-	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+static void fcache_push(struct fcache_t *node) {
+	node->prev = NULL;
+	node->next = fcache_head;
+	if(fcache_head != NULL) {
+		fcache_head->prev = node;
+	}
+	fcache_head = node;
+	if(fcache_tail == NULL) {
+		fcache_tail = node;
+	}
+}
 
-	struct fcache_t *currP, *prevP;
+static void fcache_free(struct fcache_t *node) {
+	fcache_unlink(node);
+	fcache_used -= node->size;
+#ifndef _WIN32
+	if(node->mapped == 1) {
+		munmap(node->bytes, node->size);
+	} else {
+		FREE(node->bytes);
+	}
+#else
+	FREE(node->bytes);
+#endif
+	FREE(node->name);
+	FREE(node);
+}
 
-	prevP = NULL;
+static struct fcache_t *fcache_find(char *filename) {
+	unsigned int hash = strhash(filename);
+	struct fcache_t *tmp = fcache_hash[hash % FCACHE_HASH_SIZE];
+	while(tmp) {
+		if(tmp->hash == hash && strcmp(tmp->name, filename) == 0) {
+			return tmp;
+		}
+		tmp = tmp->hnext;
+	}
+	return NULL;
+}
 
-	for(currP = *cache; currP != NULL; prevP = currP, currP = currP->next) {
+int fcache_gc(void) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-		if(strcmp(currP->name, name) == 0) {
-			if(prevP == NULL) {
-				*cache = currP->next;
-			} else {
-				prevP->next = currP->next;
-			}
+	while(fcache_head) {
+		fcache_free(fcache_head);
+	}
+	fcache_used = 0;
 
-			FREE(currP->name);
-			FREE(currP->bytes);
-			FREE(currP);
+	logprintf(LOG_DEBUG, "garbage collected fcache library");
+	return 1;
+}
 
-			break;
-		}
+void fcache_set_size(unsigned long size) {
+	fcache_size = size;
+	while(fcache_tail != NULL && fcache_used > fcache_size) {
+		fcache_free(fcache_tail);
 	}
 }
 
 int fcache_rm(char *filename) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	fcache_remove_node(&fcache, filename);
+	struct fcache_t *node = fcache_find(filename);
+	if(node != NULL) {
+		fcache_free(node);
+	}
 	logprintf(LOG_DEBUG, "removed %s from cache", filename);
 	return 1;
 }
@@ -84,6 +140,7 @@ int fcache_rm(char *filename) {
 int fcache_add(char *filename) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
+	struct stat st;
 	size_t filesize = 0;
 	FILE *fp = NULL;
 
@@ -99,55 +156,118 @@ int fcache_add(char *filename) {
 	}
 #endif
 
+	if(stat(filename, &st) != 0 || (st.st_mode & S_IFMT) != S_IFREG) {
+		logprintf(LOG_NOTICE, "failed to open %s", filename);
+		return -1;
+	}
+	filesize = (size_t)st.st_size;
+	if(filesize == 0 || filesize > fcache_size) {
+		return -1;
+	}
+
+	if(fcache_find(filename) != NULL) {
+		fcache_rm(filename);
+	}
+	while(fcache_tail != NULL && fcache_used + filesize > fcache_size) {
+		fcache_free(fcache_tail);
+	}
+
 	if((fp = fopen(filename, "rb")) == NULL) {
 		logprintf(LOG_NOTICE, "failed to open %s", filename);
 		return -1;
 	} else {
 		struct fcache_t *node = MALLOC(sizeof(struct fcache_t));
 		if(node == NULL) {
-			fprintf(stderr, "out of memory\n");
-			exit(EXIT_FAILURE);
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		fseek(fp, 0, SEEK_END);
-		filesize = (size_t)ftell(fp);
-		fseek(fp, 0, SEEK_SET);
-		if((node->bytes = MALLOC(filesize + 1)) == NULL) {
-			fprintf(stderr, "out of memory\n");
-			exit(EXIT_FAILURE);
+		memset(node, 0, sizeof(struct fcache_t));
+#ifndef _WIN32
+		if(filesize >= FCACHE_MMAP_SIZE) {
+			void *p = mmap(NULL, filesize, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+			if(p != MAP_FAILED) {
+				node->bytes = p;
+				node->mapped = 1;
+			}
 		}
-		memset(node->bytes, '\0', filesize + 1);
-		if(fread(node->bytes, 1, filesize, fp) != filesize) {
-			logprintf(LOG_NOTICE, "error reading %s", filename);
-			FREE(node->bytes);
-			FREE(node);
-			fclose(fp);
-			return -1;
+#endif
+		if(node->mapped == 0) {
+			if((node->bytes = MALLOC(filesize + 1)) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			memset(node->bytes, '\0', filesize + 1);
+			if(fread(node->bytes, 1, filesize, fp) != filesize) {
+				logprintf(LOG_NOTICE, "error reading %s", filename);
+				FREE(node->bytes);
+				FREE(node);
+				fclose(fp);
+				return -1;
+			}
 		}
 		node->size = (int)filesize;
+		node->mtime = st.st_mtime;
 		if((node->name = MALLOC(strlen(filename)+1)) == NULL) {
-			fprintf(stderr, "out of memory\n");
-			exit(EXIT_FAILURE);
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
 		strcpy(node->name, filename);
-		node->next = fcache;
-		fcache = node;
+		node->hash = strhash(filename);
+		node->hnext = fcache_hash[node->hash % FCACHE_HASH_SIZE];
+		fcache_hash[node->hash % FCACHE_HASH_SIZE] = node;
+		fcache_push(node);
+		fcache_used += filesize;
 		fclose(fp);
 		return 0;
 	}
-	fclose(fp);
 	return -1;
 }
 
-short fcache_get_size(char *filename, int *out) {
+/*
+ * Look up a file and load it when it is not cached yet. An
+ * entry is reloaded when the file changed on disk since.
+ */
+struct fcache_t *fcache_get(char *filename) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	struct fcache_t *ftmp = fcache;
-	while(ftmp) {
-		if(strcmp(ftmp->name, filename) == 0) {
-			*out = ftmp->size;
-			return 0;
+	struct fcache_t *node = fcache_find(filename);
+	struct stat st;
+
+	if(stat(filename, &st) != 0) {
+		if(node != NULL) {
+			fcache_free(node);
+		}
+		return NULL;
+	}
+	if(node != NULL && (node->mtime != st.st_mtime || node->size != (int)st.st_size)) {
+		fcache_free(node);
+		node = NULL;
+	}
+	if(node == NULL) {
+		if(fcache_add(filename) != 0) {
+			return NULL;
+		}
+		return fcache_head;
+	}
+
+	if(node != fcache_head) {
+		if(node->prev != NULL) {
+			node->prev->next = node->next;
+		}
+		if(node->next != NULL) {
+			node->next->prev = node->prev;
+		} else {
+			fcache_tail = node->prev;
 		}
-		ftmp = ftmp->next;
+		fcache_push(node);
+	}
+	return node;
+}
+
+short fcache_get_size(char *filename, int *out) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct fcache_t *ftmp = fcache_find(filename);
+	if(ftmp != NULL) {
+		*out = ftmp->size;
+		return 0;
 	}
 	return -1;
 }
@@ -155,12 +275,9 @@ short fcache_get_size(char *filename, int *out) {
 unsigned char *fcache_get_bytes(char *filename) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	struct fcache_t *ftmp = fcache;
-	while(ftmp) {
-		if(strcmp(ftmp->name, filename) == 0) {
-			return ftmp->bytes;
-		}
-		ftmp = ftmp->next;
+	struct fcache_t *ftmp = fcache_find(filename);
+	if(ftmp != NULL) {
+		return ftmp->bytes;
 	}
 	return NULL;
 }
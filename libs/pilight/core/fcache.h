@@ -20,18 +20,35 @@ with Splash. If not, see <http://www.gnu.org/licenses/>
 #ifndef _FCACHE_H_
 #define _FCACHE_H_
 
+#include <sys/types.h>
+#include <time.h>
+
+/* Default memory budget of the cache in bytes */
+#define FCACHE_SIZE				8388608
+/* Files from this size on are mapped instead of copied */
+#define FCACHE_MMAP_SIZE	65536
+#define FCACHE_HASH_SIZE	64
+
 typedef struct fcache_t {
 	char *name;
+	unsigned int hash;
 	int size;
 	unsigned char *bytes;
+	time_t mtime;
+	unsigned short mapped;
+
+	/* Next entry in the same hash bucket */
+	struct fcache_t *hnext;
+	/* Most recently used entries first */
+	struct fcache_t *prev;
 	struct fcache_t *next;
 } fcaches_t;
 
-struct fcache_t *fcache;
-
 int fcache_gc(void);
+void fcache_set_size(unsigned long size);
 int fcache_add(char *filename);
 int fcache_rm(char *filename);
+struct fcache_t *fcache_get(char *filename);
 short fcache_get_size(char *filename, int *out);
 unsigned char *fcache_get_bytes(char *filename);
 
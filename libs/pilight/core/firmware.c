@@ -76,6 +76,9 @@ writepage_bits:	memory flash - writepage
 ...
 */
 
+/* In microseconds, safe for a target running at 1MHz */
+#define FIRMWARE_ISPDELAY	2
+
 #ifdef _WIN32
 	static int baudrate = 57600;
 #else
@@ -559,6 +562,35 @@ static void firmware_attiny85(struct avrpart **p) {
 	parse_cmdbits((*p)->hfusemem->op[AVR_OP_WRITE], hfusewrite_bits);
 }
 
+/*
+ * The SPI clock has to stay below a quarter of the clock of the
+ * target. A blank chip runs at 1MHz, so that is where we start.
+ * Once the current low fuse shows a faster clock, the delays
+ * between the pin changes can be shortened or left out.
+ */
+static int firmware_ispdelay(unsigned char lfuse) {
+	/* CKDIV8 programmed */
+	if((lfuse & 0x80) == 0) {
+		return FIRMWARE_ISPDELAY;
+	}
+	switch(lfuse & 0x0f) {
+		/* 16MHz PLL on the attiny */
+		case 0x01:
+			if(mptype == FW_MP_ATMEL328P) {
+				return FIRMWARE_ISPDELAY;
+			}
+			return 0;
+		/* Internal 8MHz oscillator */
+		case 0x02:
+			return 1;
+		/* 8MHz - 16MHz crystal */
+		case 0x0e:
+		case 0x0f:
+			return 0;
+	}
+	return FIRMWARE_ISPDELAY;
+}
+
 static void firmware_init_pgm(PROGRAMMER **pgm) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -571,7 +603,7 @@ static void firmware_init_pgm(PROGRAMMER **pgm) {
 		(*pgm)->pinno[4] = FIRMWARE_GPIO_SCK;
 		(*pgm)->pinno[5] = FIRMWARE_GPIO_MOSI;
 		(*pgm)->pinno[6] = FIRMWARE_GPIO_MISO;
-		// (*pgm)->ispdelay = 50;
+		(*pgm)->ispdelay = FIRMWARE_ISPDELAY;
 
 		if(config_setting_get_number("firmware-gpio-reset", 0, &itmp) == 0) { (*pgm)->pinno[3] = itmp; }
 		if(config_setting_get_number("firmware-gpio-sck", 0, &itmp) == 0) { (*pgm)->pinno[4] = itmp; }
@@ -899,6 +931,11 @@ static int firmware_write(char *filename, struct avrpart **p) {
 			}
 		} else {
 			safemode_memfuses(1, &safemode_lfuse, &safemode_hfuse, &safemode_efuse, &safemode_fuse);
+			/* New fuses only take effect after a reset */
+			if(strlen(comport) == 0) {
+				pgm->ispdelay = firmware_ispdelay(safemode_lfuse);
+				logprintf(LOG_DEBUG, "AVR clock delay set to %dus", pgm->ispdelay);
+			}
 		}
 	}
 
@@ -0,0 +1,171 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Switching outputs through the gpio registers of the SoC in
+ * place of wiringX. The registers are mapped once from
+ * /dev/gpiomem, which needs no root, after that a pin is set,
+ * cleared or read with a single store or load and no syscall.
+ * This backend is used when the gpio-backend setting is
+ * gpiomem and the platform has a known register layout, all
+ * other pins and platforms keep going through wiringX.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <wiringx.h>
+#endif
+
+#include "../config/settings.h"
+#include "mem.h"
+#include "log.h"
+#include "gpiomem.h"
+
+#define GPIOMEM_SIZE	4096
+
+/* Word offsets of the Broadcom gpio registers */
+#define GPFSEL	0
+#define GPSET		7
+#define GPCLR		10
+#define GPLEV		13
+
+/* The wiringX numbering of the Raspberry Pi, to the lines of the SoC */
+static int bcm_pins[32] = {
+	17, 18, 27, 22, 23, 24, 25, 4, 2, 3, 8, 7, 10, 9, 11, 14,
+	15, 28, 29, 30, 31, 5, 6, 13, 19, 26, 12, 16, 20, 21, 0, 1
+};
+
+/* The first revision of the model B has three other lines */
+static int bcm_rev1_pins[32] = {
+	17, 18, 21, 22, 23, 24, 25, 4, 0, 1, 8, 7, 10, 9, 11, 14,
+	15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+static volatile uint32_t *regs = NULL;
+static int *pins = NULL;
+
+int gpiomem_setup(const char *platform) {
+#if defined(__linux__)
+	char *backend = NULL;
+	void *map = MAP_FAILED;
+	int fd = -1;
+
+	if(regs != NULL) {
+		return 0;
+	}
+	if(config_setting_get_string("gpio-backend", 0, &backend) != 0) {
+		return -1;
+	}
+	if(strcmp(backend, "gpiomem") != 0) {
+		FREE(backend);
+		return -1;
+	}
+	FREE(backend);
+
+	if(strcmp(platform, "raspberrypi1b1") == 0) {
+		pins = bcm_rev1_pins;
+	} else if(strncmp(platform, "raspberrypi", 11) == 0) {
+		pins = bcm_pins;
+	} else {
+		logprintf(LOG_NOTICE, "no gpio registers known for %s, using wiringX", platform);
+		return -1;
+	}
+
+	if((fd = open("/dev/gpiomem", O_RDWR | O_SYNC)) < 0) {
+		logprintf(LOG_NOTICE, "could not open /dev/gpiomem, using wiringX");
+		pins = NULL;
+		return -1;
+	}
+	map = mmap(NULL, GPIOMEM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) {
+		logprintf(LOG_NOTICE, "could not map /dev/gpiomem, using wiringX");
+		pins = NULL;
+		return -1;
+	}
+	regs = (volatile uint32_t *)map;
+	logprintf(LOG_DEBUG, "switching gpio through the registers of the %s", platform);
+
+	return 0;
+#else
+	return -1;
+#endif
+}
+
+static int gpiomem_line(int gpio) {
+	if(regs == NULL || gpio < 0 || gpio >= 32) {
+		return -1;
+	}
+	return pins[gpio];
+}
+
+int gpiomem_active(int gpio) {
+	return (gpiomem_line(gpio) >= 0);
+}
+
+void gpio_mode(int gpio, int mode) {
+#ifndef _WIN32
+	int line = gpiomem_line(gpio), shift = 0;
+
+	if(line < 0) {
+		pinMode(gpio, mode);
+		return;
+	}
+	shift = (line % 10)*3;
+	if(mode == PINMODE_OUTPUT) {
+		regs[GPFSEL+line/10] = (regs[GPFSEL+line/10] & ~(7u << shift)) | (1u << shift);
+	} else {
+		regs[GPFSEL+line/10] = regs[GPFSEL+line/10] & ~(7u << shift);
+	}
+#endif
+}
+
+void gpio_write(int gpio, int value) {
+#ifndef _WIN32
+	int line = gpiomem_line(gpio);
+
+	if(line < 0) {
+		digitalWrite(gpio, value);
+		return;
+	}
+	if(value == 0) {
+		regs[GPCLR] = 1u << line;
+	} else {
+		regs[GPSET] = 1u << line;
+	}
+#endif
+}
+
+int gpio_read(int gpio) {
+#ifndef _WIN32
+	int line = gpiomem_line(gpio);
+
+	if(line < 0) {
+		return digitalRead(gpio);
+	}
+	return (int)((regs[GPLEV] >> line) & 1);
+#else
+	return -1;
+#endif
+}
+
+void gpiomem_gc(void) {
+#if defined(__linux__)
+	if(regs != NULL) {
+		munmap((void *)regs, GPIOMEM_SIZE);
+		regs = NULL;
+		pins = NULL;
+	}
+#endif
+}
@@ -0,0 +1,19 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _GPIOMEM_H_
+#define _GPIOMEM_H_
+
+int gpiomem_setup(const char *platform);
+int gpiomem_active(int gpio);
+void gpio_mode(int gpio, int mode);
+void gpio_write(int gpio, int value);
+int gpio_read(int gpio);
+void gpiomem_gc(void);
+
+#endif
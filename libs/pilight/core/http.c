@@ -54,6 +54,10 @@
 #define STEP_WRITE					0
 #define STEP_READ						1
 
+#define HTTP_CACHE_SIZE			32
+#define HTTP_IDLE_MAX				8
+#define HTTP_IDLE_TIMEOUT		30
+
 typedef struct http_clients_t {
 	uv_poll_t *req;
 	int fd;
@@ -71,8 +75,58 @@ typedef struct http_clients_t {
 struct http_clients_t *http_clients = NULL;
 static int http_lock_init = 0;
 
+/*
+ * GET responses shared by all callers of the same url. While
+ * a request is running, others for the same url wait for its
+ * response instead of sending their own. An expired response
+ * is revalidated with the ETag or Last-Modified it came with.
+ */
+typedef struct http_waiter_t {
+	void (*callback)(int, char *, int, char *, void *);
+	void *userdata;
+	struct http_waiter_t *next;
+} http_waiter_t;
+
+typedef struct http_cache_t {
+	char *url;
+	char *content;
+	int size;
+	int code;
+	char mimetype[255];
+	char *etag;
+	char *modified;
+	time_t expires;
+	int ttl;
+	int inflight;
+	struct http_waiter_t *waiters;
+	struct http_cache_t *next;
+} http_cache_t;
+
+static struct http_cache_t *http_cache = NULL;
+static int http_cache_nr = 0;
+
+/*
+ * Connections kept open after a complete response, so the
+ * next request to the same host skips connecting and the
+ * TLS handshake. A connection is closed when it has been
+ * idle for HTTP_IDLE_TIMEOUT seconds or the server closes it.
+ */
+typedef struct http_idle_t {
+	char *host;
+	int port;
+	int is_ssl;
+	int fd;
+	uv_poll_t *poll_req;
+	uv_timer_t *timer_req;
+	struct http_idle_t *next;
+} http_idle_t;
+
+static struct http_idle_t *http_idle = NULL;
+static int http_idle_nr = 0;
+
 typedef struct request_t {
 	int fd;
+	char *url;
 	char *host;
   char *uri;
   char *query_string;
@@ -91,6 +145,8 @@ typedef struct request_t {
 	int request_method;
 	int has_length;
 	int has_chunked;
+	int keepalive;
+	int reused;
 
   char *content;
 	char mimetype[255];
@@ -101,14 +157,31 @@ typedef struct request_t {
   size_t content_len;
 	size_t bytes_read;
 
+	struct http_cache_t *cache;
+
+	/*
+	 * A streamed response is handed to the chunk callback
+	 * as it arrives instead of being collected first.
+	 */
+	size_t maxsize;
+	int capped;
+	void (*chunk)(char *data, int size, void *userdata);
+
 	void (*callback)(int code, char *data, int size, char *type, void *userdata);
 } request_t;
 
 
 static void timeout(uv_timer_t *req);
 static void http_client_close(uv_poll_t *req);
+static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf);
+static void write_cb(uv_poll_t *req);
+static void poll_close_cb(uv_poll_t *req);
+static char *http_request(int type, char *url, const char *conttype, char *post, struct http_cache_t *cache, int reuse, size_t maxsize, void (*chunk)(char *, int, void *), void (*callback)(int, char *, int, char *, void *), void *userdata);
 
 static void free_request(struct request_t *request) {
+	if(request->url != NULL) {
+		FREE(request->url);
+	}
 	if(request->host != NULL) {
 		FREE(request->host);
 	}
@@ -124,8 +197,31 @@ static void free_request(struct request_t *request) {
 	FREE(request);
 }
 
+static void http_cache_free(struct http_cache_t *cache) {
+	struct http_waiter_t *waiter = NULL;
+
+	while(cache->waiters) {
+		waiter = cache->waiters;
+		cache->waiters = waiter->next;
+		FREE(waiter);
+	}
+	if(cache->content != NULL) {
+		FREE(cache->content);
+	}
+	if(cache->etag != NULL) {
+		FREE(cache->etag);
+	}
+	if(cache->modified != NULL) {
+		FREE(cache->modified);
+	}
+	FREE(cache->url);
+	FREE(cache);
+}
+
 int http_gc(void) {
 	struct http_clients_t *node = NULL;
+	struct http_cache_t *cache = NULL;
+	struct http_idle_t *idle = NULL;
 
 #ifdef _WIN32
 	uv_mutex_lock(&http_lock);
@@ -159,6 +255,21 @@ int http_gc(void) {
 		FREE(node);
 	}
 
+	while(http_idle) {
+		idle = http_idle;
+		http_idle = http_idle->next;
+		FREE(idle->host);
+		FREE(idle);
+	}
+	http_idle_nr = 0;
+
+	while(http_cache) {
+		cache = http_cache;
+		http_cache = http_cache->next;
+		http_cache_free(cache);
+	}
+	http_cache_nr = 0;
+
 #ifdef _WIN32
 	uv_mutex_unlock(&http_lock);
 #else
@@ -383,6 +494,50 @@ static void append_to_header(char **header, char *data, ...) {
 	}
 }
 
+/*
+ * Pass a piece of the response body to the chunk callback
+ * or append it to the content. Everything beyond the maximum
+ * size is refused.
+ */
+static int http_client_body(struct request_t *request, char *data, int size) {
+	if(request->maxsize > 0 && request->bytes_read+size > request->maxsize) {
+		request->capped = 1;
+		return -1;
+	}
+
+	if(request->chunk != NULL) {
+		request->chunk(data, size, request->userdata);
+	} else {
+		if((request->content = REALLOC(request->content, request->bytes_read+size+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+
+		/*
+		 * Prevent uninitialised values in valgrind
+		 */
+		memset(&request->content[request->bytes_read], 0, size+1);
+		memcpy(&request->content[request->bytes_read], data, size);
+	}
+	request->bytes_read += size;
+
+	return 0;
+}
+
+/*
+ * A response that outgrew its maximum size is aborted and
+ * the connection isn't reused, because the rest of the body
+ * is still underway.
+ */
+static void http_client_capped(struct request_t *request) {
+	uv_timer_stop(request->timer_req);
+	request->reading = 0;
+	request->keepalive = 0;
+	if(request->callback != NULL && request->called == 0) {
+		request->called = 1;
+		request->callback(413, NULL, 0, NULL, request->userdata);
+	}
+}
+
 static void process_chunk(char **buf, ssize_t *size, struct request_t *request) {
 	char *p = NULL;
 	int pos = 0,  toread = 0;
@@ -417,16 +572,10 @@ static void process_chunk(char **buf, ssize_t *size, struct request_t *request)
 			toread = request->chunksize-request->chunkread;
 		}
 
-		if((request->content = REALLOC(request->content, request->bytes_read+toread+1)) == NULL) {
-			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		if(http_client_body(request, *buf, toread) == -1) {
+			request->reading = 0;
+			break;
 		}
-
-		/*
-		 * Prevent uninitialised values in valgrind
-		 */
-		memset(&request->content[request->bytes_read], 0, toread+1);
-		memcpy(&request->content[request->bytes_read], *buf, toread);
-		request->bytes_read += toread;
 		request->chunkread += toread;
 
 		memmove(&(*buf)[0], &(*buf)[toread], *size-toread);
@@ -478,11 +627,25 @@ static void http_client_close(uv_poll_t *req) {
 	struct request_t *request = custom_poll_data->data;
 	uv_timer_stop(request->timer_req);
 
+	/*
+	 * The server closed a kept-alive connection before
+	 * we used it again, so retry on a new connection.
+	 */
+	if(request->reused == 1 && request->gotheader == 0 && request->called == 0) {
+		request->called = 1;
+		http_request(request->request_method, request->url, request->mimetype, request->content,
+			request->cache, 0, request->maxsize, request->chunk, request->callback, request->userdata);
+	}
+
 	if(request->reading == 1) {
 		if(request->has_length == 0 && request->has_chunked == 0) {
 			if(request->callback != NULL && request->called == 0) {
 				request->called = 1;
-				request->callback(request->status_code, request->content, strlen(request->content), request->mimetype, request->userdata);
+				if(request->chunk != NULL) {
+					request->callback(request->status_code, "", request->bytes_read, request->mimetype, request->userdata);
+				} else {
+					request->callback(request->status_code, request->content, strlen(request->content), request->mimetype, request->userdata);
+				}
 			}
 		} else {
 		/*
@@ -547,6 +710,239 @@ static void timeout(uv_timer_t *req) {
 	}
 }
 
+static void http_idle_close(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct http_idle_t *tmp = NULL, *prev = NULL;
+
+#ifdef _WIN32
+	uv_mutex_lock(&http_lock);
+#else
+	pthread_mutex_lock(&http_lock);
+#endif
+	tmp = http_idle;
+	while(tmp) {
+		if(tmp->poll_req == req) {
+			if(prev == NULL) {
+				http_idle = tmp->next;
+			} else {
+				prev->next = tmp->next;
+			}
+			http_idle_nr--;
+			break;
+		}
+		prev = tmp;
+		tmp = tmp->next;
+	}
+#ifdef _WIN32
+	uv_mutex_unlock(&http_lock);
+#else
+	pthread_mutex_unlock(&http_lock);
+#endif
+
+	if(tmp != NULL) {
+		uv_timer_stop(tmp->timer_req);
+		uv_close((uv_handle_t *)tmp->timer_req, close_cb);
+		if(tmp->fd > -1) {
+#ifdef _WIN32
+			shutdown(tmp->fd, SD_BOTH);
+			closesocket(tmp->fd);
+#else
+			shutdown(tmp->fd, SHUT_RDWR);
+			close(tmp->fd);
+#endif
+		}
+		FREE(tmp->host);
+		FREE(tmp);
+	}
+
+	http_client_remove(req);
+
+	if(!uv_is_closing((uv_handle_t *)req)) {
+		uv_poll_stop(req);
+		uv_close((uv_handle_t *)req, close_cb);
+	}
+
+	if(custom_poll_data != NULL) {
+		uv_custom_poll_free(custom_poll_data);
+		req->data = NULL;
+	}
+}
+
+/*
+ * An idle connection should stay silent, anything it
+ * reads means it is closed or unusable.
+ */
+static void http_idle_read(uv_poll_t *req, ssize_t *nread, char *buf) {
+	uv_custom_close(req);
+}
+
+static void http_idle_timeout(uv_timer_t *req) {
+	uv_poll_t *poll_req = req->data;
+	uv_custom_close(poll_req);
+}
+
+static void http_client_park(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct request_t *request = custom_poll_data->data;
+	struct http_idle_t *node = NULL;
+	uv_poll_t *oldest = NULL;
+
+	if((node = MALLOC(sizeof(struct http_idle_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((node->host = STRDUP(request->host)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->port = request->port;
+	node->is_ssl = request->is_ssl;
+	node->fd = request->fd;
+	node->poll_req = req;
+	if((node->timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->timer_req->data = req;
+
+	uv_timer_stop(request->timer_req);
+	uv_close((uv_handle_t *)request->timer_req, close_cb);
+	free_request(request);
+
+	custom_poll_data->data = NULL;
+	custom_poll_data->read_cb = http_idle_read;
+	custom_poll_data->write_cb = NULL;
+	custom_poll_data->close_cb = http_idle_close;
+	custom_poll_data->dowrite = 0;
+	iobuf_remove(&custom_poll_data->recv_iobuf, custom_poll_data->recv_iobuf.len);
+
+	uv_timer_init(uv_default_loop(), node->timer_req);
+	uv_timer_start(node->timer_req, http_idle_timeout, HTTP_IDLE_TIMEOUT*1000, 0);
+
+#ifdef _WIN32
+	uv_mutex_lock(&http_lock);
+#else
+	pthread_mutex_lock(&http_lock);
+#endif
+	node->next = http_idle;
+	http_idle = node;
+	http_idle_nr++;
+	if(http_idle_nr > HTTP_IDLE_MAX) {
+		struct http_idle_t *tmp = http_idle;
+		while(tmp->next != NULL) {
+			tmp = tmp->next;
+		}
+		oldest = tmp->poll_req;
+	}
+#ifdef _WIN32
+	uv_mutex_unlock(&http_lock);
+#else
+	pthread_mutex_unlock(&http_lock);
+#endif
+
+	uv_custom_read(req);
+
+	if(oldest != NULL) {
+		uv_custom_close(oldest);
+	}
+}
+
+/*
+ * Hand an idle connection to the same host to a new request.
+ */
+static int http_client_reuse(struct request_t *request) {
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	struct http_idle_t *tmp = NULL, *prev = NULL;
+
+#ifdef _WIN32
+	uv_mutex_lock(&http_lock);
+#else
+	pthread_mutex_lock(&http_lock);
+#endif
+	tmp = http_idle;
+	while(tmp) {
+		if(tmp->port == request->port && tmp->is_ssl == request->is_ssl &&
+			strcmp(tmp->host, request->host) == 0) {
+			if(prev == NULL) {
+				http_idle = tmp->next;
+			} else {
+				prev->next = tmp->next;
+			}
+			http_idle_nr--;
+			break;
+		}
+		prev = tmp;
+		tmp = tmp->next;
+	}
+#ifdef _WIN32
+	uv_mutex_unlock(&http_lock);
+#else
+	pthread_mutex_unlock(&http_lock);
+#endif
+
+	if(tmp == NULL) {
+		return -1;
+	}
+
+	uv_timer_stop(tmp->timer_req);
+	uv_close((uv_handle_t *)tmp->timer_req, close_cb);
+
+	request->fd = tmp->fd;
+	request->poll_req = tmp->poll_req;
+	request->reused = 1;
+
+	custom_poll_data = request->poll_req->data;
+	custom_poll_data->data = request;
+	custom_poll_data->write_cb = write_cb;
+	custom_poll_data->read_cb = read_cb;
+	custom_poll_data->close_cb = poll_close_cb;
+	custom_poll_data->doclose = 0;
+
+	FREE(tmp->host);
+	FREE(tmp);
+
+	if((request->timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	request->timer_req->data = request;
+	uv_timer_init(uv_default_loop(), request->timer_req);
+	uv_timer_start(request->timer_req, (void (*)(uv_timer_t *))timeout, 3000, 0);
+
+	request->steps = STEP_WRITE;
+	uv_custom_write(request->poll_req);
+
+	return 0;
+}
+
+static void http_cache_validators(struct http_cache_t *cache, struct connection_t *c) {
+	const char *etag = NULL, *modified = NULL;
+
+	if((etag = http_get_header(c, "ETag")) == NULL) {
+		etag = http_get_header(c, "Etag");
+	}
+	modified = http_get_header(c, "Last-Modified");
+
+#ifdef _WIN32
+	uv_mutex_lock(&http_lock);
+#else
+	pthread_mutex_lock(&http_lock);
+#endif
+	if(cache->etag != NULL) {
+		FREE(cache->etag);
+	}
+	if(cache->modified != NULL) {
+		FREE(cache->modified);
+	}
+	if(etag != NULL && (cache->etag = STRDUP((char *)etag)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if(modified != NULL && (cache->modified = STRDUP((char *)modified)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+#ifdef _WIN32
+	uv_mutex_unlock(&http_lock);
+#else
+	pthread_mutex_unlock(&http_lock);
+#endif
+}
+
 static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 	/*
 	 * Make sure we execute in the main thread
@@ -593,6 +989,16 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 				return;
 			}
 			request->status_code = c.status_code;
+			if(strncmp(header, "HTTP/1.1", 8) == 0) {
+				const char *conn = NULL;
+				if((conn = http_get_header(&c, "Connection")) == NULL) {
+					conn = http_get_header(&c, "connection");
+				}
+				request->keepalive = (conn == NULL || strcmp(conn, "close") != 0);
+			}
+			if(request->cache != NULL && c.status_code == 200) {
+				http_cache_validators(request->cache, &c);
+			}
 			if((a = http_get_header(&c, "Content-Type")) != NULL || (b = http_get_header(&c, "Content-type")) != NULL) {
 				int len = 0, i = 0;
 				if(a != NULL) {
@@ -623,6 +1029,10 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 				}
 			}
 			FREE(header);
+			if(request->maxsize > 0 && request->has_length == 1 && request->content_len > request->maxsize) {
+				http_client_capped(request);
+				goto close;
+			}
 			if(*nread == 0) {
 				uv_timer_stop(request->timer_req);
 				if(request->callback != NULL && request->called == 0) {
@@ -635,27 +1045,34 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 		if(request->chunked == 1) {
 			process_chunk(&buf, &(*nread), request);
 		} else if(*nread > 0) {
-			if((request->content = REALLOC(request->content, request->bytes_read+(*nread)+1)) == NULL) {
-				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-			}
-			/*
-			 * Prevent uninitialised values in valgrind
-			 */
-			memset(&request->content[request->bytes_read], 0, *nread+1);
-			memcpy(&request->content[request->bytes_read], buf, *nread);
-			request->bytes_read += *nread;
+			http_client_body(request, buf, *nread);
 			*nread = 0;
 		}
 
+		if(request->capped == 1) {
+			http_client_capped(request);
+			goto close;
+		}
+
 		if(strcmp(buf, "0\r\n\r\n") == 0) {
 			request->reading = 0;
 			request->chunked = 0;
-			request->content[request->bytes_read] = '\0';
+			if(request->content != NULL) {
+				request->content[request->bytes_read] = '\0';
+			}
 			request->content_len = request->bytes_read;
 		}
 
 		if(request->chunked == 1 || (request->has_length == 0 && request->has_chunked == 0) || request->bytes_read < request->content_len) {
 			request->reading = 1;
+		} else if(request->chunk != NULL) {
+			request->reading = 0;
+			uv_timer_stop(request->timer_req);
+			if(request->callback != NULL && request->called == 0) {
+				request->called = 1;
+				request->callback(request->status_code, "", request->bytes_read, request->mimetype, request->userdata);
+				goto close;
+			}
 		} else if(request->content != NULL) {
 			request->reading = 0;
 			request->content[request->content_len] = '\0';
@@ -675,6 +1092,13 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 	}
 
 close:
+	/* Only a response of a known length leaves the connection usable */
+	if(request->keepalive == 1 && request->called == 1 &&
+		((request->has_length == 1 && request->bytes_read >= request->content_len) ||
+		(request->has_chunked == 1 && request->chunked == 0))) {
+		http_client_park(req);
+		return;
+	}
 	uv_custom_close(req);
 }
 
@@ -692,12 +1116,13 @@ static void write_cb(uv_poll_t *req) {
 	switch(request->steps) {
 		case STEP_WRITE: {
 			if(request->request_method == HTTP_POST) {
-				append_to_header(&header, "POST %s HTTP/1.0\r\n", request->uri);
+				append_to_header(&header, "POST %s HTTP/1.1\r\n", request->uri);
 				append_to_header(&header, "Host: %s\r\n", request->host);
 				if(request->auth64 != NULL) {
 					append_to_header(&header, "Authorization: Basic %s\r\n", request->auth64);
 				}
 				append_to_header(&header, "User-Agent: %s\r\n", USERAGENT);
+				append_to_header(&header, "Connection: keep-alive\r\n");
 				append_to_header(&header, "Content-Type: %s\r\n", request->mimetype);
 				append_to_header(&header, "Content-Length: %lu\r\n\r\n", request->content_len);
 				append_to_header(&header, "%s", request->content);
@@ -708,7 +1133,27 @@ static void write_cb(uv_poll_t *req) {
 					append_to_header(&header, "Authorization: Basic %s\r\n", request->auth64);
 				}
 				append_to_header(&header, "User-Agent: %s\r\n", USERAGENT);
-				append_to_header(&header, "Connection: close\r\n\r\n");
+				if(request->cache != NULL) {
+#ifdef _WIN32
+					uv_mutex_lock(&http_lock);
+#else
+					pthread_mutex_lock(&http_lock);
+#endif
+					if(request->cache->content != NULL) {
+						if(request->cache->etag != NULL) {
+							append_to_header(&header, "If-None-Match: %s\r\n", request->cache->etag);
+						}
+						if(request->cache->modified != NULL) {
+							append_to_header(&header, "If-Modified-Since: %s\r\n", request->cache->modified);
+						}
+					}
+#ifdef _WIN32
+					uv_mutex_unlock(&http_lock);
+#else
+					pthread_mutex_unlock(&http_lock);
+#endif
+				}
+				append_to_header(&header, "Connection: keep-alive\r\n\r\n");
 			}
 			iobuf_append(&custom_poll_data->send_iobuf, (void *)header, strlen(header));
 
@@ -724,14 +1169,7 @@ static void write_cb(uv_poll_t *req) {
 	}
 }
 
-char *http_process(int type, char *url, const char *conttype, char *post, void (*callback)(int, char *, int, char *, void *), void *userdata) {
-	struct request_t *request = NULL;
-	struct uv_custom_poll_t *custom_poll_data = NULL;
-	struct sockaddr_in addr4;
-	struct sockaddr_in6 addr6;
-	char *ip = NULL;
-	int r = 0;
-
+static void http_init_lock(void) {
 	if(http_lock_init == 0) {
 		http_lock_init = 1;
 #ifdef _WIN32
@@ -742,6 +1180,17 @@ char *http_process(int type, char *url, const char *conttype, char *post, void (
 		pthread_mutex_init(&http_lock, &http_attr);
 #endif
 	}
+}
+
+static char *http_request(int type, char *url, const char *conttype, char *post, struct http_cache_t *cache, int reuse, size_t maxsize, void (*chunk)(char *, int, void *), void (*callback)(int, char *, int, char *, void *), void *userdata) {
+	struct request_t *request = NULL;
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	struct sockaddr_in addr4;
+	struct sockaddr_in6 addr6;
+	char *ip = NULL;
+	int r = 0;
+
+	http_init_lock();
 
 #ifdef _WIN32
 	WSADATA wsa;
@@ -755,6 +1204,15 @@ char *http_process(int type, char *url, const char *conttype, char *post, void (
 	memset(&addr4, 0, sizeof(addr4));
 	memset(&addr6, 0, sizeof(addr6));
 	if(prepare_request(&request, type, url, conttype, post, callback, userdata) == 0) {
+		request->cache = cache;
+		request->maxsize = maxsize;
+		request->chunk = chunk;
+		if((request->url = STRDUP(url)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		if(reuse == 1 && http_client_reuse(request) == 0) {
+			return NULL;
+		}
 		int inet = host2ip(request->host, &ip);
 		switch(inet) {
 			case AF_INET: {
@@ -861,6 +1319,12 @@ char *http_process(int type, char *url, const char *conttype, char *post, void (
 		http_client_add(request->poll_req, custom_poll_data);
 		request->steps = STEP_WRITE;
 		uv_custom_write(request->poll_req);
+	} else if(cache != NULL && callback != NULL) {
+		/*
+		 * The waiters of a shared request only hear back through
+		 * the callback, so it has to end the request here as well.
+		 */
+		callback(404, NULL, 0, NULL, userdata);
 	}
 
 	return NULL;
@@ -873,6 +1337,9 @@ freeuv:
 		request->called = 1;
 		request->callback(404, NULL, 0, 0, request->userdata);
 	}
+	if(request->url != NULL) {
+		FREE(request->url);
+	}
 	FREE(request->uri);
 	FREE(request->host);
 
@@ -887,10 +1354,204 @@ freeuv:
 	return NULL;
 }
 
+char *http_process(int type, char *url, const char *conttype, char *post, void (*callback)(int, char *, int, char *, void *), void *userdata) {
+	return http_request(type, url, conttype, post, NULL, 1, 0, NULL, callback, userdata);
+}
+
 char *http_get_content(char *url, void (*callback)(int, char *, int, char *, void *), void *userdata) {
 	return http_process(HTTP_GET, url, NULL, NULL, callback, userdata);
 }
 
+/*
+ * The body is passed to the chunk callback piece by piece, so
+ * the response is never held in memory as a whole. The callback
+ * is called once the response is complete, without the content.
+ * A response larger than maxsize bytes is aborted with a 413.
+ */
+char *http_get_stream(char *url, size_t maxsize, void (*chunk)(char *, int, void *), void (*callback)(int, char *, int, char *, void *), void *userdata) {
+	return http_request(HTTP_GET, url, NULL, NULL, NULL, 1, maxsize, chunk, callback, userdata);
+}
+
+/*
+ * Hand the response of a shared request to everyone that
+ * waited for it. A 304 means the cached response is still
+ * valid, errors are passed on without touching the cache.
+ */
+static void http_cache_done(int code, char *data, int size, char *type, void *userdata) {
+	struct http_cache_t *cache = userdata;
+	struct http_waiter_t *waiters = NULL, *waiter = NULL;
+	char *content = NULL, mimetype[255];
+
+	memset(mimetype, '\0', sizeof(mimetype));
+
+#ifdef _WIN32
+	uv_mutex_lock(&http_lock);
+#else
+	pthread_mutex_lock(&http_lock);
+#endif
+	if(code == 200 && data != NULL) {
+		if((cache->content = REALLOC(cache->content, size+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(cache->content, data, size);
+		cache->content[size] = '\0';
+		cache->size = size;
+		cache->code = code;
+		memset(cache->mimetype, '\0', sizeof(cache->mimetype));
+		if(type != NULL) {
+			strncpy(cache->mimetype, type, sizeof(cache->mimetype)-1);
+		}
+		cache->expires = time(NULL)+cache->ttl;
+	} else if(code == 304 && cache->content != NULL) {
+		cache->expires = time(NULL)+cache->ttl;
+	}
+	if((code == 200 || code == 304) && cache->content != NULL) {
+		if((content = MALLOC(cache->size+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(content, cache->content, cache->size+1);
+		strcpy(mimetype, cache->mimetype);
+		code = cache->code;
+		size = cache->size;
+		data = content;
+		type = mimetype;
+	}
+	waiters = cache->waiters;
+	cache->waiters = NULL;
+	cache->inflight = 0;
+#ifdef _WIN32
+	uv_mutex_unlock(&http_lock);
+#else
+	pthread_mutex_unlock(&http_lock);
+#endif
+
+	while(waiters) {
+		waiter = waiters;
+		waiters = waiters->next;
+		if(waiter->callback != NULL) {
+			waiter->callback(code, data, size, type, waiter->userdata);
+		}
+		FREE(waiter);
+	}
+	if(content != NULL) {
+		FREE(content);
+	}
+}
+
+/*
+ * Make room by dropping the entry that expired first and has
+ * no request running.
+ */
+static void http_cache_evict(void) {
+	struct http_cache_t *tmp = http_cache, *prev = NULL;
+	struct http_cache_t *match = NULL, *mprev = NULL;
+
+	while(tmp) {
+		if(tmp->inflight == 0 && (match == NULL || tmp->expires < match->expires)) {
+			match = tmp;
+			mprev = prev;
+		}
+		prev = tmp;
+		tmp = tmp->next;
+	}
+	if(match != NULL) {
+		if(mprev == NULL) {
+			http_cache = match->next;
+		} else {
+			mprev->next = match->next;
+		}
+		http_cache_free(match);
+		http_cache_nr--;
+	}
+}
+
+/*
+ * Like http_get_content, but a response is reused by all
+ * callers of the same url for ttl seconds.
+ */
+char *http_get_content_cached(char *url, int ttl, void (*callback)(int, char *, int, char *, void *), void *userdata) {
+	struct http_cache_t *cache = NULL;
+	struct http_waiter_t *waiter = NULL;
+	char *content = NULL, mimetype[255];
+	int code = 0, size = 0;
+
+	http_init_lock();
+
+#ifdef _WIN32
+	uv_mutex_lock(&http_lock);
+#else
+	pthread_mutex_lock(&http_lock);
+#endif
+	cache = http_cache;
+	while(cache) {
+		if(strcmp(cache->url, url) == 0) {
+			break;
+		}
+		cache = cache->next;
+	}
+	if(cache == NULL) {
+		if(http_cache_nr >= HTTP_CACHE_SIZE) {
+			http_cache_evict();
+		}
+		if((cache = MALLOC(sizeof(struct http_cache_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(cache, 0, sizeof(struct http_cache_t));
+		if((cache->url = STRDUP(url)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		cache->next = http_cache;
+		http_cache = cache;
+		http_cache_nr++;
+	}
+
+	if(cache->content != NULL && time(NULL) < cache->expires) {
+		if((content = MALLOC(cache->size+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(content, cache->content, cache->size+1);
+		strcpy(mimetype, cache->mimetype);
+		code = cache->code;
+		size = cache->size;
+#ifdef _WIN32
+		uv_mutex_unlock(&http_lock);
+#else
+		pthread_mutex_unlock(&http_lock);
+#endif
+		if(callback != NULL) {
+			callback(code, content, size, mimetype, userdata);
+		}
+		FREE(content);
+		return NULL;
+	}
+
+	if((waiter = MALLOC(sizeof(struct http_waiter_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	waiter->callback = callback;
+	waiter->userdata = userdata;
+	waiter->next = cache->waiters;
+	cache->waiters = waiter;
+
+	if(cache->inflight == 1) {
+#ifdef _WIN32
+		uv_mutex_unlock(&http_lock);
+#else
+		pthread_mutex_unlock(&http_lock);
+#endif
+		return NULL;
+	}
+	cache->inflight = 1;
+	cache->ttl = ttl;
+#ifdef _WIN32
+	uv_mutex_unlock(&http_lock);
+#else
+	pthread_mutex_unlock(&http_lock);
+#endif
+
+	return http_request(HTTP_GET, url, NULL, NULL, cache, 1, 0, NULL, http_cache_done, cache);
+}
+
 char *http_post_content(char *url, const char *conttype, char *post, void (*callback)(int, char *, int, char *, void *), void *userdata) {
 	return http_process(HTTP_POST, url, conttype, post, callback, userdata);
 }
@@ -11,6 +11,8 @@
 
 char *http_post_content(char *url, const char *contype, char *post, void (*callback)(int, char *, int, char *, void *), void *userdata);
 char *http_get_content(char *url, void (*callback)(int, char *, int, char *, void *), void *userdata);
+char *http_get_stream(char *url, size_t maxsize, void (*chunk)(char *, int, void *), void (*callback)(int, char *, int, char *, void *), void *userdata);
+char *http_get_content_cached(char *url, int ttl, void (*callback)(int, char *, int, char *, void *), void *userdata);
 int http_gc(void);
 
 #endif
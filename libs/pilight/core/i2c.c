@@ -0,0 +1,198 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * The i2c buses shared by the sensor protocols. Every bus is
+ * opened once, however many sensors are configured on it, and
+ * stays open while one of them uses it. The slave address is
+ * part of each transfer, so sensors of different protocols can
+ * take turns on a bus without switching the address of the
+ * handle. A register is read by writing its address and reading
+ * the answer in one combined transfer, so no other transfer can
+ * get in between, and consecutive registers are read in a single
+ * burst.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __linux__
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include "i2c-dev.h"
+#endif
+
+#include "mem.h"
+#include "log.h"
+#include "i2c.h"
+
+typedef struct i2c_bus_t {
+	char *path;
+	int fd;
+	int users;
+	pthread_mutex_t lock;
+	struct i2c_bus_t *next;
+} i2c_bus_t;
+
+static struct i2c_bus_t *buses = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+struct i2c_bus_t *i2c_open(const char *path) {
+#ifdef __linux__
+	struct i2c_bus_t *bus = NULL;
+	int fd = -1;
+
+	pthread_mutex_lock(&lock);
+	bus = buses;
+	while(bus != NULL) {
+		if(strcmp(bus->path, path) == 0) {
+			bus->users++;
+			pthread_mutex_unlock(&lock);
+			return bus;
+		}
+		bus = bus->next;
+	}
+
+	if((fd = open(path, O_RDWR)) < 0) {
+		pthread_mutex_unlock(&lock);
+		logprintf(LOG_NOTICE, "could not open i2c bus %s", path);
+		return NULL;
+	}
+
+	if((bus = MALLOC(sizeof(struct i2c_bus_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(bus, 0, sizeof(struct i2c_bus_t));
+	if((bus->path = STRDUP((char *)path)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	bus->fd = fd;
+	bus->users = 1;
+	pthread_mutex_init(&bus->lock, NULL);
+	bus->next = buses;
+	buses = bus;
+	pthread_mutex_unlock(&lock);
+
+	return bus;
+#else
+	return NULL;
+#endif
+}
+
+void i2c_close(struct i2c_bus_t *bus) {
+#ifdef __linux__
+	struct i2c_bus_t **tmp = &buses;
+
+	if(bus == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	if(--bus->users > 0) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	while(*tmp != NULL) {
+		if(*tmp == bus) {
+			*tmp = bus->next;
+			break;
+		}
+		tmp = &(*tmp)->next;
+	}
+	pthread_mutex_unlock(&lock);
+
+	close(bus->fd);
+	pthread_mutex_destroy(&bus->lock);
+	FREE(bus->path);
+	FREE(bus);
+#endif
+}
+
+/*
+ * Writes wlen bytes to a slave and reads rlen bytes back, with
+ * a repeated start in between. Either length can be zero.
+ */
+int i2c_transfer(struct i2c_bus_t *bus, int addr, unsigned char *wbuf, int wlen, unsigned char *rbuf, int rlen) {
+#ifdef __linux__
+	struct i2c_rdwr_ioctl_data data;
+	struct i2c_msg msgs[2];
+	int n = 0, r = 0;
+
+	if(bus == NULL) {
+		return -1;
+	}
+
+	if(wlen > 0) {
+		msgs[n].addr = (__u16)addr;
+		msgs[n].flags = 0;
+		msgs[n].len = (short)wlen;
+		msgs[n].buf = (char *)wbuf;
+		n++;
+	}
+	if(rlen > 0) {
+		msgs[n].addr = (__u16)addr;
+		msgs[n].flags = I2C_M_RD;
+		msgs[n].len = (short)rlen;
+		msgs[n].buf = (char *)rbuf;
+		n++;
+	}
+	if(n == 0) {
+		return 0;
+	}
+	data.msgs = msgs;
+	data.nmsgs = n;
+
+	pthread_mutex_lock(&bus->lock);
+	r = ioctl(bus->fd, I2C_RDWR, &data);
+	pthread_mutex_unlock(&bus->lock);
+
+	return (r == n) ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Reads len consecutive registers, starting at reg.
+ */
+int i2c_read_block(struct i2c_bus_t *bus, int addr, int reg, unsigned char *buf, int len) {
+	unsigned char r = (unsigned char)reg;
+
+	return i2c_transfer(bus, addr, &r, 1, buf, len);
+}
+
+int i2c_read_reg8(struct i2c_bus_t *bus, int addr, int reg) {
+	unsigned char buf[1];
+
+	if(i2c_read_block(bus, addr, reg, buf, 1) != 0) {
+		return -1;
+	}
+	return buf[0];
+}
+
+/*
+ * The first byte in the low half, as a smbus word read.
+ */
+int i2c_read_reg16(struct i2c_bus_t *bus, int addr, int reg) {
+	unsigned char buf[2];
+
+	if(i2c_read_block(bus, addr, reg, buf, 2) != 0) {
+		return -1;
+	}
+	return buf[0] | (buf[1] << 8);
+}
+
+int i2c_write_reg8(struct i2c_bus_t *bus, int addr, int reg, int value) {
+	unsigned char buf[2];
+
+	buf[0] = (unsigned char)reg;
+	buf[1] = (unsigned char)value;
+
+	return i2c_transfer(bus, addr, buf, 2, NULL, 0);
+}
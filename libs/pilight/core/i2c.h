@@ -0,0 +1,22 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _I2C_H_
+#define _I2C_H_
+
+typedef struct i2c_bus_t i2c_bus_t;
+
+struct i2c_bus_t *i2c_open(const char *path);
+void i2c_close(struct i2c_bus_t *bus);
+int i2c_transfer(struct i2c_bus_t *bus, int addr, unsigned char *wbuf, int wlen, unsigned char *rbuf, int rlen);
+int i2c_read_block(struct i2c_bus_t *bus, int addr, int reg, unsigned char *buf, int len);
+int i2c_read_reg8(struct i2c_bus_t *bus, int addr, int reg);
+int i2c_read_reg16(struct i2c_bus_t *bus, int addr, int reg);
+int i2c_write_reg8(struct i2c_bus_t *bus, int addr, int reg, int value);
+
+#endif
@@ -22,6 +22,7 @@
 */
 
 #include <assert.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,10 +36,23 @@
 		exit(EXIT_FAILURE);                     \
 	} while (0)
 
+/*
+ * Allocations are only counted while a benchmark asks
+ * for it, so the daemon doesn't pay for the atomic add.
+ */
+static int count_allocs = 0;
+static volatile unsigned long nrallocs = 0;
+
+#define counted() do {                          \
+		if (count_allocs)                       \
+			__sync_fetch_and_add(&nrallocs, 1); \
+	} while (0)
+
 /* Sadly, strdup is not portable. */
 static char *json_strdup(const char *str)
 {
 	char *ret = (char*) malloc(strlen(str) + 1);
+	counted();
 	if (ret == NULL)
 		out_of_memory();
 	memset(ret, 0, strlen(str) + 1);
@@ -46,6 +60,137 @@ static char *json_strdup(const char *str)
 	return ret;
 }
 
+/*
+ * Arena for json_decode_arena. A decoded tree is bump
+ * allocated from a list of chunks, owned by the root.
+ */
+
+#define ARENA_ALIGN	8
+#define ARENA_CHUNK	1024
+#define ARENA_HEADER	((sizeof(JsonArena) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+struct JsonArena
+{
+	struct JsonArena *next;
+	size_t size;
+	size_t used;
+};
+
+static JsonArena *arena_new(size_t size, JsonArena *next)
+{
+	JsonArena *ret = (JsonArena*) malloc(ARENA_HEADER + size);
+	counted();
+	if (ret == NULL)
+		out_of_memory();
+	ret->next = next;
+	ret->size = size;
+	ret->used = 0;
+	return ret;
+}
+
+static void *arena_alloc(JsonArena **arena, size_t size)
+{
+	JsonArena *a = *arena;
+	void *ret;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (a->size - a->used < size) {
+		size_t grow = a->size * 2;
+		if (grow < size)
+			grow = size;
+		/* The newest chunk is the head, the first one stays the tail */
+		a = arena_new(grow, a);
+		*arena = a;
+	}
+	ret = (char *)a + ARENA_HEADER + a->used;
+	a->used += size;
+	return ret;
+}
+
+static void arena_free(JsonArena *arena)
+{
+	JsonArena *next;
+	while (arena != NULL) {
+		next = arena->next;
+		free(arena);
+		arena = next;
+	}
+}
+
+/*
+ * Objects with at least JSON_INDEX_MIN members get a hash
+ * index on their first lookup. Appending a member keeps it
+ * up to date, any other change to the members drops it.
+ */
+
+#define JSON_INDEX_MIN	16
+
+typedef struct
+{
+	unsigned int hash;
+	JsonNode *node;
+} JsonSlot;
+
+struct JsonIndex
+{
+	unsigned int size;
+	unsigned int used;
+	JsonSlot slots[];
+};
+
+static unsigned int index_hash(const char *key)
+{
+	unsigned int hash = 5381;
+	while (*key != 0)
+		hash = ((hash << 5) + hash) + (unsigned char)*key++;
+	return hash;
+}
+
+/* Only the first member with a key is indexed, like a linear scan finds */
+static void index_insert(JsonIndex *index, JsonNode *node)
+{
+	unsigned int hash = index_hash(node->key);
+	unsigned int i = hash & (index->size - 1);
+
+	while (index->slots[i].node != NULL) {
+		if (index->slots[i].hash == hash && strcmp(index->slots[i].node->key, node->key) == 0)
+			return;
+		i = (i + 1) & (index->size - 1);
+	}
+	index->slots[i].hash = hash;
+	index->slots[i].node = node;
+	index->used++;
+}
+
+static JsonIndex *index_build(const JsonNode *object)
+{
+	JsonIndex *index;
+	JsonNode *member;
+	unsigned int size = JSON_INDEX_MIN * 2;
+
+	while (size < (unsigned int)object->children.count * 2)
+		size *= 2;
+
+	index = (JsonIndex*) calloc(1, sizeof(JsonIndex) + size * sizeof(JsonSlot));
+	counted();
+	if (index == NULL)
+		out_of_memory();
+	index->size = size;
+
+	for (member = object->children.head; member != NULL; member = member->next)
+		index_insert(index, member);
+
+	return index;
+}
+
+static void index_drop(JsonNode *object)
+{
+	if (object->children.index != NULL) {
+		free(object->children.index);
+		object->children.index = NULL;
+	}
+}
+
 /* String buffer */
 
 typedef struct
@@ -53,16 +198,23 @@ typedef struct
 	char *cur;
 	char *end;
 	char *start;
+
+	/* When set, a full buffer is handed over instead of grown */
+	json_write_cb flush;
+	void *userdata;
 } SB;
 
 static void sb_init(SB *sb)
 {
 	sb->start = (char*) malloc(17);
+	counted();
 	memset(sb->start, 0, 17);
 	if (sb->start == NULL)
 		out_of_memory();
 	sb->cur = sb->start;
 	sb->end = sb->start + 16;
+	sb->flush = NULL;
+	sb->userdata = NULL;
 }
 
 /* sb and need may be evaluated multiple times. */
@@ -76,11 +228,21 @@ static void sb_grow(SB *sb, int need)
 	size_t length = sb->cur - sb->start;
 	size_t alloc = sb->end - sb->start;
 
+	if (sb->flush != NULL) {
+		if (length > 0)
+			sb->flush(sb->userdata, sb->start, length);
+		sb->cur = sb->start;
+		length = 0;
+		if (alloc >= (size_t)need)
+			return;
+	}
+
 	do {
 		alloc *= 2;
 	} while (alloc < length + need);
 
 	sb->start = (char*) realloc(sb->start, alloc + 1);
+	counted();
 	if (sb->start == NULL)
 		out_of_memory();
 	sb->cur = sb->start + length;
@@ -205,12 +367,56 @@ static int utf8_validate_cz(const char *s)
 	}
 }
 
+/* Printable ASCII that is copied as is by parse_string and emit_string */
+#define is_plain(c) ((unsigned char)(c) >= 0x20 && (unsigned char)(c) < 0x80 && (c) != '"' && (c) != '\\')
+
+/*
+ * Return the number of plain bytes at @s, so the callers
+ * only handle escapes and UTF-8 sequences one at a time.
+ *
+ * Whole machine words are checked at once for a byte below
+ * 0x20 or above 0x7F, a quotation mark or a backslash. The
+ * words are aligned, so reading past the terminator never
+ * crosses into the next page.
+ */
+static size_t plain_length(const char *s)
+{
+	const uintptr_t ones = (uintptr_t)-1 / 0xFF;
+	const uintptr_t highs = ones * 0x80;
+	const char *p = s;
+	uintptr_t w, q, bs;
+
+	while (((uintptr_t)p & (sizeof(uintptr_t) - 1)) != 0) {
+		if (!is_plain(*p))
+			return (size_t)(p - s);
+		p++;
+	}
+
+	for (;;) {
+		memcpy(&w, p, sizeof(w));
+		q = w ^ (ones * '"');
+		bs = w ^ (ones * '\\');
+		if ((((w - ones * 0x20) & ~w) | w |
+		     ((q - ones) & ~q) | ((bs - ones) & ~bs)) & highs)
+			break;
+		p += sizeof(w);
+	}
+
+	while (is_plain(*p))
+		p++;
+
+	return (size_t)(p - s);
+}
+
 /* Validate a null-terminated UTF-8 string. */
 static bool utf8_validate(const char *s)
 {
 	int len;
 
 	for (; *s != 0; s += len) {
+		s += plain_length(s);
+		if (*s == 0)
+			break;
 		len = utf8_validate_cz(s);
 		if (len == 0)
 			return false;
@@ -331,11 +537,16 @@ static void to_surrogate_pair(uchar_t unicode, uint16_t *uc, uint16_t *lc)
 #define is_space(c) ((c) == '\t' || (c) == '\n' || (c) == '\r' || (c) == ' ')
 #define is_digit(c) ((c) >= '0' && (c) <= '9')
 
-static bool parse_value     (const char **sp, JsonNode        **out);
-static bool parse_string    (const char **sp, char            **out);
+static const double pow10_table[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7,
+	1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+};
+
+static bool parse_value     (const char **sp, JsonNode        **out, JsonArena **arena);
+static bool parse_string    (const char **sp, char            **out, JsonArena **arena);
 static bool parse_number    (const char **sp, double           *out, int *decimals);
-static bool parse_array     (const char **sp, JsonNode        **out);
-static bool parse_object    (const char **sp, JsonNode        **out);
+static bool parse_array     (const char **sp, JsonNode        **out, JsonArena **arena);
+static bool parse_object    (const char **sp, JsonNode        **out, JsonArena **arena);
 static bool parse_hex16     (const char **sp, uint16_t         *out);
 
 static bool expect_literal  (const char **sp, const char *str);
@@ -353,6 +564,7 @@ static void emit_object_indented    (SB *out, const JsonNode *object, const char
 static int write_hex16(char *out, uint16_t val);
 
 static JsonNode *mknode(JsonTag tag);
+static JsonNode *arena_mknode(JsonArena **arena, JsonTag tag);
 static void append_node(JsonNode *parent, JsonNode *child);
 static void prepend_node(JsonNode *parent, JsonNode *child);
 static void append_member(JsonNode *object, char *key, JsonNode *value);
@@ -361,22 +573,88 @@ static void append_member(JsonNode *object, char *key, JsonNode *value);
 static bool tag_is_valid(unsigned int tag);
 static bool number_is_valid(const char *num);
 
-JsonNode *json_decode(const char *json)
+/*
+ * The furthest point a parse failed at. The outer parsers fail
+ * as well, but at an earlier point within the same value.
+ */
+static __thread const char *parse_failed = NULL;
+
+static void parse_fail(const char *s)
+{
+	if (parse_failed == NULL || s > parse_failed)
+		parse_failed = s;
+}
+
+static JsonNode *decode(const char *json, bool use_arena, size_t *errpos)
 {
 	const char *s = json;
+	JsonArena *arena = NULL;
 	JsonNode *ret;
 
+	if (use_arena)
+		arena = arena_new(ARENA_CHUNK + strlen(json) * 4, NULL);
+	parse_failed = NULL;
+
 	skip_space(&s);
-	if (!parse_value(&s, &ret))
-		return NULL;
+	if (!parse_value(&s, &ret, use_arena ? &arena : NULL))
+		goto failure;
 
 	skip_space(&s);
 	if (*s != 0) {
-		json_delete(ret);
-		return NULL;
+		parse_fail(s);
+		if (use_arena)
+			arena_free(arena);
+		else
+			json_delete(ret);
+		goto position;
 	}
 
+	if (use_arena)
+		ret->arena = arena;
 	return ret;
+
+failure:
+	if (use_arena)
+		arena_free(arena);
+position:
+	if (errpos != NULL)
+		*errpos = (parse_failed != NULL) ? (size_t)(parse_failed - json) : 0;
+	return NULL;
+}
+
+JsonNode *json_decode(const char *json)
+{
+	return decode(json, false, NULL);
+}
+
+/*
+ * Validate and decode in the same pass, instead of calling
+ * json_validate before json_decode. Strings are checked for
+ * valid UTF-8 while they are copied. On invalid input NULL is
+ * returned and errpos, if given, is set to the offset of the
+ * byte the parse failed at.
+ */
+JsonNode *json_decode_checked(const char *json, size_t *errpos)
+{
+	return decode(json, false, errpos);
+}
+
+/*
+ * Decode into a single arena instead of allocating
+ * every node, key and string on its own. The tree is
+ * released at once by calling json_delete on the root.
+ * Nodes taken from it must not outlive that root, nodes
+ * added to it are still freed on their own.
+ */
+JsonNode *json_decode_arena(const char *json)
+{
+	return decode(json, true, NULL);
+}
+
+/* json_decode_checked into an arena */
+JsonNode *json_decode_arena_checked(const char *json, size_t *errpos)
+{
+	return decode(json, true, errpos);
 }
 
 char *json_encode(const JsonNode *node)
@@ -394,6 +672,31 @@ char *json_encode_string(const char *str)
 	return sb_finish(&sb);
 }
 
+/*
+ * Serialize like json_stringify(node, NULL), but hand the
+ * output to write in blocks of at most JSON_STREAM_CHUNK
+ * bytes instead of building one string for the whole tree.
+ */
+void json_stream(const JsonNode *node, json_write_cb write, void *userdata)
+{
+	SB sb;
+
+	sb.start = (char*) malloc(JSON_STREAM_CHUNK + 1);
+	counted();
+	if (sb.start == NULL)
+		out_of_memory();
+	sb.cur = sb.start;
+	sb.end = sb.start + JSON_STREAM_CHUNK;
+	sb.flush = write;
+	sb.userdata = userdata;
+
+	emit_value(&sb, node);
+
+	if (sb.cur > sb.start)
+		write(userdata, sb.start, sb.cur - sb.start);
+	sb_free(&sb);
+}
+
 char *json_stringify(const JsonNode *node, const char *space)
 {
 	SB sb;
@@ -407,14 +710,32 @@ char *json_stringify(const JsonNode *node, const char *space)
 	return sb_finish(&sb);
 }
 
+/*
+ * Register an extra owner of a (root) node. Every
+ * owner releases its share with json_delete, the
+ * node is only freed when the last owner does so.
+ */
+JsonNode *json_ref(JsonNode *node)
+{
+	if (node != NULL)
+		node->refs++;
+	return node;
+}
+
 void json_delete(JsonNode *node)
 {
 	if (node != NULL) {
+		if (node->refs > 0) {
+			node->refs--;
+			return;
+		}
+
 		json_remove_from_parent(node);
 
 		switch (node->tag) {
 			case JSON_STRING:
-				free(node->string_);
+				if (!(node->arena_ & JSON_ARENA_STRING))
+					free(node->string_);
 				break;
 			case JSON_ARRAY:
 			case JSON_OBJECT:
@@ -424,12 +745,16 @@ void json_delete(JsonNode *node)
 					next = child->next;
 					json_delete(child);
 				}
+				index_drop(node);
 				break;
 			}
 			default:;
 		}
 
-		free(node);
+		if (node->arena != NULL)
+			arena_free(node->arena);
+		else if (!(node->arena_ & JSON_ARENA_NODE))
+			free(node);
 	}
 }
 
@@ -438,7 +763,7 @@ bool json_validate(const char *json)
 	const char *s = json;
 
 	skip_space(&s);
-	if (!parse_value(&s, NULL))
+	if (!parse_value(&s, NULL, NULL))
 		return false;
 
 	skip_space(&s);
@@ -468,10 +793,31 @@ JsonNode *json_find_element(JsonNode *array, int index)
 JsonNode *json_find_member(JsonNode *object, const char *name)
 {
 	JsonNode *member;
+	JsonIndex *index;
 
 	if (object == NULL || object->tag != JSON_OBJECT)
 		return NULL;
 
+	if (object->children.count >= JSON_INDEX_MIN) {
+		if ((index = object->children.index) == NULL) {
+			/* Concurrent readers may race here, only one index is kept */
+			index = index_build(object);
+			if (!__sync_bool_compare_and_swap(&object->children.index, NULL, index)) {
+				free(index);
+				index = object->children.index;
+			}
+		}
+
+		unsigned int hash = index_hash(name);
+		unsigned int i = hash & (index->size - 1);
+		while ((member = index->slots[i].node) != NULL) {
+			if (index->slots[i].hash == hash && strcmp(member->key, name) == 0)
+				return member;
+			i = (i + 1) & (index->size - 1);
+		}
+		return NULL;
+	}
+
 	json_foreach(member, object)
 		if (strcmp(member->key, name) == 0)
 			return member;
@@ -489,12 +835,27 @@ JsonNode *json_first_child(const JsonNode *node)
 static JsonNode *mknode(JsonTag tag)
 {
 	JsonNode *ret = (JsonNode*) calloc(1, sizeof(JsonNode));
+	counted();
 	if (ret == NULL)
 		out_of_memory();
 	ret->tag = tag;
 	return ret;
 }
 
+static JsonNode *arena_mknode(JsonArena **arena, JsonTag tag)
+{
+	JsonNode *ret;
+
+	if (arena == NULL)
+		return mknode(tag);
+
+	ret = (JsonNode*) arena_alloc(arena, sizeof(JsonNode));
+	memset(ret, 0, sizeof(JsonNode));
+	ret->tag = tag;
+	ret->arena_ = JSON_ARENA_NODE;
+	return ret;
+}
+
 JsonNode *json_mknull(void)
 {
 	return mknode(JSON_NULL);
@@ -537,6 +898,54 @@ JsonNode *json_mkobject(void)
 	return mknode(JSON_OBJECT);
 }
 
+/*
+ * Numbers are cloned as they would be after a
+ * json_stringify / json_decode round trip, so
+ * they are rounded to their number of decimals.
+ */
+static JsonNode *clone_number(const JsonNode *node)
+{
+	char buf[64];
+	const char *s = buf;
+	double num = 0;
+	int decimals = 0;
+
+	snprintf(buf, sizeof(buf), "%.*f", node->decimals_, node->number_);
+	if (parse_number(&s, &num, &decimals) && *s == '\0')
+		return json_mknumber(num, decimals);
+	return json_mknull();
+}
+
+/* Deep copy a node without its key and parent. */
+JsonNode *json_clone(const JsonNode *node)
+{
+	JsonNode *ret = NULL, *child = NULL;
+
+	if (node == NULL)
+		return NULL;
+
+	switch (node->tag) {
+		case JSON_BOOL:
+			return json_mkbool(node->bool_);
+		case JSON_STRING:
+			return json_mkstring(node->string_);
+		case JSON_NUMBER:
+			return clone_number(node);
+		case JSON_ARRAY:
+			ret = json_mkarray();
+			json_foreach(child, node)
+				append_node(ret, json_clone(child));
+			return ret;
+		case JSON_OBJECT:
+			ret = json_mkobject();
+			json_foreach(child, node)
+				append_member(ret, json_strdup(child->key), json_clone(child));
+			return ret;
+		default:
+			return json_mknull();
+	}
+}
+
 static void append_node(JsonNode *parent, JsonNode *child)
 {
 	child->parent = parent;
@@ -548,6 +957,14 @@ static void append_node(JsonNode *parent, JsonNode *child)
 	else
 		parent->children.head = child;
 	parent->children.tail = child;
+	parent->children.count++;
+
+	if (parent->children.index != NULL && child->key != NULL) {
+		if (parent->children.index->used * 2 >= parent->children.index->size)
+			index_drop(parent);
+		else
+			index_insert(parent->children.index, child);
+	}
 }
 
 static void prepend_node(JsonNode *parent, JsonNode *child)
@@ -561,6 +978,8 @@ static void prepend_node(JsonNode *parent, JsonNode *child)
 	else
 		parent->children.tail = child;
 	parent->children.head = child;
+	parent->children.count++;
+	index_drop(parent);
 }
 
 static void append_member(JsonNode *object, char *key, JsonNode *value)
@@ -615,8 +1034,12 @@ void json_remove_from_parent(JsonNode *node)
 			node->next->prev = node->prev;
 		else
 			parent->children.tail = node->prev;
+		parent->children.count--;
+		index_drop(parent);
 
-		free(node->key);
+		if (!(node->arena_ & JSON_ARENA_KEY))
+			free(node->key);
+		node->arena_ &= ~(JSON_ARENA_KEY);
 
 		node->parent = NULL;
 		node->prev = node->next = NULL;
@@ -624,7 +1047,7 @@ void json_remove_from_parent(JsonNode *node)
 	}
 }
 
-static bool parse_value(const char **sp, JsonNode **out)
+static bool parse_value(const char **sp, JsonNode **out, JsonArena **arena)
 {
 	const char *s = *sp;
 
@@ -632,35 +1055,44 @@ static bool parse_value(const char **sp, JsonNode **out)
 		case 'n':
 			if (expect_literal(&s, "null")) {
 				if (out)
-					*out = json_mknull();
+					*out = arena_mknode(arena, JSON_NULL);
 				*sp = s;
 				return true;
 			}
+			parse_fail(s);
 			return false;
 
 		case 'f':
 			if (expect_literal(&s, "false")) {
 				if (out)
-					*out = json_mkbool(false);
+					*out = arena_mknode(arena, JSON_BOOL);
 				*sp = s;
 				return true;
 			}
+			parse_fail(s);
 			return false;
 
 		case 't':
 			if (expect_literal(&s, "true")) {
-				if (out)
-					*out = json_mkbool(true);
+				if (out) {
+					*out = arena_mknode(arena, JSON_BOOL);
+					(*out)->bool_ = true;
+				}
 				*sp = s;
 				return true;
 			}
+			parse_fail(s);
 			return false;
 
 		case '"': {
 			char *str;
-			if (parse_string(&s, out ? &str : NULL)) {
-				if (out)
-					*out = mkstring(str);
+			if (parse_string(&s, out ? &str : NULL, arena)) {
+				if (out) {
+					*out = arena_mknode(arena, JSON_STRING);
+					(*out)->string_ = str;
+					if (arena != NULL)
+						(*out)->arena_ |= JSON_ARENA_STRING;
+				}
 				*sp = s;
 				return true;
 			}
@@ -668,14 +1100,14 @@ static bool parse_value(const char **sp, JsonNode **out)
 		}
 
 		case '[':
-			if (parse_array(&s, out)) {
+			if (parse_array(&s, out, arena)) {
 				*sp = s;
 				return true;
 			}
 			return false;
 
 		case '{':
-			if (parse_object(&s, out)) {
+			if (parse_object(&s, out, arena)) {
 				*sp = s;
 				return true;
 			}
@@ -685,8 +1117,11 @@ static bool parse_value(const char **sp, JsonNode **out)
 			double num;
 			int decimals = 0;
 			if (parse_number(&s, out ? &num : NULL, &decimals)) {
-				if (out)
-					*out = json_mknumber(num, decimals);
+				if (out) {
+					*out = arena_mknode(arena, JSON_NUMBER);
+					(*out)->number_ = num;
+					(*out)->decimals_ = decimals;
+				}
 				*sp = s;
 				return true;
 			}
@@ -695,14 +1130,15 @@ static bool parse_value(const char **sp, JsonNode **out)
 	}
 }
 
-static bool parse_array(const char **sp, JsonNode **out)
+static bool parse_array(const char **sp, JsonNode **out, JsonArena **arena)
 {
 	const char *s = *sp;
-	JsonNode *ret = out ? json_mkarray() : NULL;
+	JsonNode *ret = out ? arena_mknode(arena, JSON_ARRAY) : NULL;
 	JsonNode *element;
 
-	if (*s++ != '[')
+	if (*s != '[')
 		goto failure;
+	s++;
 	skip_space(&s);
 
 	if (*s == ']') {
@@ -711,7 +1147,7 @@ static bool parse_array(const char **sp, JsonNode **out)
 	}
 
 	for (;;) {
-		if (!parse_value(&s, out ? &element : NULL))
+		if (!parse_value(&s, out ? &element : NULL, arena))
 			goto failure;
 		skip_space(&s);
 
@@ -723,8 +1159,9 @@ static bool parse_array(const char **sp, JsonNode **out)
 			goto success;
 		}
 
-		if (*s++ != ',')
+		if (*s != ',')
 			goto failure;
+		s++;
 		skip_space(&s);
 	}
 
@@ -735,19 +1172,21 @@ success:
 	return true;
 
 failure:
+	parse_fail(s);
 	json_delete(ret);
 	return false;
 }
 
-static bool parse_object(const char **sp, JsonNode **out)
+static bool parse_object(const char **sp, JsonNode **out, JsonArena **arena)
 {
 	const char *s = *sp;
-	JsonNode *ret = out ? json_mkobject() : NULL;
+	JsonNode *ret = out ? arena_mknode(arena, JSON_OBJECT) : NULL;
 	char *key;
 	JsonNode *value;
 
-	if (*s++ != '{')
+	if (*s != '{')
 		goto failure;
+	s++;
 	skip_space(&s);
 
 	if (*s == '}') {
@@ -756,28 +1195,33 @@ static bool parse_object(const char **sp, JsonNode **out)
 	}
 
 	for (;;) {
-		if (!parse_string(&s, out ? &key : NULL))
+		if (!parse_string(&s, out ? &key : NULL, arena))
 			goto failure;
 		skip_space(&s);
 
-		if (*s++ != ':')
+		if (*s != ':')
 			goto failure_free_key;
+		s++;
 		skip_space(&s);
 
-		if (!parse_value(&s, out ? &value : NULL))
+		if (!parse_value(&s, out ? &value : NULL, arena))
 			goto failure_free_key;
 		skip_space(&s);
 
-		if (out)
+		if (out) {
 			append_member(ret, key, value);
+			if (arena != NULL)
+				value->arena_ |= JSON_ARENA_KEY;
+		}
 
 		if (*s == '}') {
 			s++;
 			goto success;
 		}
 
-		if (*s++ != ',')
+		if (*s != ',')
 			goto failure;
+		s++;
 		skip_space(&s);
 	}
 
@@ -788,25 +1232,41 @@ success:
 	return true;
 
 failure_free_key:
-	if (out)
+	if (out && arena == NULL)
 		free(key);
 failure:
+	parse_fail(s);
 	json_delete(ret);
 	return false;
 }
 
-bool parse_string(const char **sp, char **out)
+bool parse_string(const char **sp, char **out, JsonArena **arena)
 {
 	const char *s = *sp;
 	SB sb;
 	char throwaway_buffer[4];
 		/* enough space for a UTF-8 character */
-	char *b;
+	char *b, *start = NULL;
 
-	if (*s++ != '"')
+	if (*s != '"') {
+		parse_fail(s);
 		return false;
+	}
+	s++;
 
-	if (out) {
+	if (out && arena != NULL) {
+		/* Unescaping never makes a string longer than its literal */
+		const char *e = s;
+		while (*e != '"' && *e != 0) {
+			e += plain_length(e);
+			if (*e == '"' || *e == 0)
+				break;
+			if (*e == '\\' && e[1] != 0)
+				e++;
+			e++;
+		}
+		start = b = (char*) arena_alloc(arena, (size_t)(e - s) + 1);
+	} else if (out) {
 		sb_init(&sb);
 		sb_need(&sb, 4);
 		b = sb.cur;
@@ -815,7 +1275,27 @@ bool parse_string(const char **sp, char **out)
 	}
 
 	while (*s != '"') {
-		unsigned char c = *s++;
+		size_t run = plain_length(s);
+		unsigned char c;
+
+		/* Copy a run of plain characters at once */
+		if (run > 0) {
+			if (out && arena == NULL) {
+				sb.cur = b;
+				sb_need(&sb, (int)run + 4);
+				b = sb.cur;
+			}
+			if (out) {
+				memcpy(b, s, run);
+				b += run;
+			}
+			if (out && arena == NULL)
+				sb.cur = b;
+			s += run;
+			continue;
+		}
+
+		c = *s++;
 
 		/* Parse next character, and write it to b. */
 		if (c == '\\') {
@@ -878,8 +1358,10 @@ bool parse_string(const char **sp, char **out)
 
 			s--;
 			len = utf8_validate_cz(s);
-			if (len == 0)
+			if (len == 0) {
+				parse_fail(s);
 				goto failed; /* Invalid UTF-8 character. */
+			}
 
 			while (len--)
 				*b++ = *s++;
@@ -889,23 +1371,28 @@ bool parse_string(const char **sp, char **out)
 		 * Update sb to know about the new bytes,
 		 * and set up b to write another character.
 		 */
-		if (out) {
+		if (out && arena == NULL) {
 			sb.cur = b;
 			sb_need(&sb, 4);
 			b = sb.cur;
-		} else {
+		} else if (out == NULL) {
 			b = throwaway_buffer;
 		}
 	}
 	s++;
 
-	if (out)
+	if (out && arena != NULL) {
+		*b = 0;
+		*out = start;
+	} else if (out) {
 		*out = sb_finish(&sb);
+	}
 	*sp = s;
 	return true;
 
 failed:
-	if (out)
+	parse_fail(s - 1);
+	if (out && arena == NULL)
 		sb_free(&sb);
 	return false;
 }
@@ -923,21 +1410,29 @@ failed:
 bool parse_number(const char **sp, double *out, int *decimals)
 {
 	const char *s = *sp;
+	unsigned long long mantissa = 0;
+	int digits = 0, scale = 0, exact = 1, negative = 0;
 	if(decimals != NULL) {
 		(*decimals) = 0;
 	}
 
 	/* '-'? */
-	if (*s == '-')
+	if (*s == '-') {
+		negative = 1;
 		s++;
+	}
 
 	/* (0 | [1-9][0-9]*) */
 	if (*s == '0') {
 		s++;
 	} else {
-		if (!is_digit(*s))
+		if (!is_digit(*s)) {
+			parse_fail(s);
 			return false;
+		}
 		do {
+			mantissa = mantissa * 10 + (*s - '0');
+			digits++;
 			s++;
 		} while (is_digit(*s));
 	}
@@ -945,9 +1440,14 @@ bool parse_number(const char **sp, double *out, int *decimals)
 	/* ('.' [0-9]+)? */
 	if (*s == '.') {
 		s++;
-		if (!is_digit(*s))
+		if (!is_digit(*s)) {
+			parse_fail(s);
 			return false;
+		}
 		do {
+			mantissa = mantissa * 10 + (*s - '0');
+			digits++;
+			scale++;
 			s++;
 			if(decimals != NULL) {
 				(*decimals)++;
@@ -957,18 +1457,33 @@ bool parse_number(const char **sp, double *out, int *decimals)
 
 	/* ([Ee] [+-]? [0-9]+)? */
 	if (*s == 'E' || *s == 'e') {
+		exact = 0;
 		s++;
 		if (*s == '+' || *s == '-')
 			s++;
-		if (!is_digit(*s))
+		if (!is_digit(*s)) {
+			parse_fail(s);
 			return false;
+		}
 		do {
 			s++;
 		} while (is_digit(*s));
 	}
 
-	if (out)
-		*out = strtod(*sp, NULL);
+	if (out) {
+		/*
+		 * Up to 15 digits the mantissa and the power of ten are
+		 * both exact doubles, so one correctly rounded division
+		 * gives the same result as strtod.
+		 */
+		if (exact && digits <= 15) {
+			*out = (double)mantissa / pow10_table[scale];
+			if (negative)
+				*out = -*out;
+		} else {
+			*out = strtod(*sp, NULL);
+		}
+	}
 
 	*sp = s;
 	return true;
@@ -1155,7 +1670,21 @@ void emit_string(SB *out, const char *str)
 
 	*b++ = '"';
 	while (*s != 0) {
-		unsigned char c = *s++;
+		size_t run = plain_length(s);
+		unsigned char c;
+
+		/* Copy a run of plain characters at once */
+		if (run > 0) {
+			out->cur = b;
+			sb_need(out, (int)run + 14);
+			b = out->cur;
+			memcpy(b, s, run);
+			b += run;
+			s += run;
+			continue;
+		}
+
+		c = *s++;
 
 		/* Encode the next character, and write it to b. */
 		switch (c) {
@@ -1257,6 +1786,50 @@ void emit_string(SB *out, const char *str)
 	out->cur = b;
 }
 
+/*
+ * Format the common small fixed decimal numbers without
+ * sprintf. Returns 0 when the result could differ from
+ * sprintf's "%.*f", so the caller falls back to that.
+ */
+static int emit_fixed(char *buf, double num, int decimals)
+{
+	char digits[32];
+	unsigned long long value;
+	double scaled, fraction;
+	int n = 0, i = 0;
+
+	if (decimals < 0 || decimals > 8 || !(num > -4.0e12 && num < 4.0e12))
+		return 0;
+
+	scaled = fabs(num) * pow10_table[decimals];
+	if (scaled >= 4.0e12)
+		return 0;
+	value = (unsigned long long)scaled;
+	fraction = scaled - (double)value;
+	/* Too close to a tie to tell how the exact value rounds */
+	if (fraction > 0.49 && fraction < 0.51)
+		return 0;
+	if (fraction >= 0.51)
+		value++;
+
+	do {
+		digits[n++] = '0' + (value % 10);
+		value /= 10;
+	} while (value > 0 || n <= decimals);
+
+	if (signbit(num))
+		buf[i++] = '-';
+	while (n > decimals)
+		buf[i++] = digits[--n];
+	if (decimals > 0) {
+		buf[i++] = '.';
+		while (n > 0)
+			buf[i++] = digits[--n];
+	}
+	buf[i] = 0;
+	return 1;
+}
+
 static void emit_number(SB *out, double num, int decimals)
 {
 	/*
@@ -1266,6 +1839,10 @@ static void emit_number(SB *out, double num, int decimals)
 	 * like 0.3 -> 0.299999999999999988898 .
 	 */
 	char buf[64];
+	if (emit_fixed(buf, num, decimals)) {
+		sb_puts(out, buf);
+		return;
+	}
 	sprintf(buf, "%.*f", decimals, num);
 
 	if (number_is_valid(buf))
@@ -1436,3 +2013,11 @@ int json_find_string(JsonNode *object, const char *name, char **out) {
 void json_free(void *a) {
 	free(a);
 }
+
+void json_count_allocs(int enable) {
+	count_allocs = enable;
+}
+
+unsigned long json_allocs(void) {
+	return nrallocs;
+}
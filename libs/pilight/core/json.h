@@ -38,6 +38,13 @@
 #define JsonTag			int
 
 typedef struct JsonNode JsonNode;
+typedef struct JsonArena JsonArena;
+typedef struct JsonIndex JsonIndex;
+
+/* Parts of a node that live in an arena (see json_decode_arena) */
+#define JSON_ARENA_NODE		0x01
+#define JSON_ARENA_KEY		0x01 << 1
+#define JSON_ARENA_STRING	0x01 << 2
 
 struct JsonNode
 {
@@ -63,18 +70,38 @@ struct JsonNode
 		/* JSON_OBJECT */
 		struct {
 			JsonNode *head, *tail;
+			int count;
+			/* Member lookup index, see json_find_member */
+			JsonIndex *index;
 		} children;
 	};
 	int decimals_;
+
+	/* Extra owners of this node, see json_ref */
+	int refs;
+
+	/* JSON_ARENA_* flags, the arena itself is only set on the root */
+	unsigned char arena_;
+	JsonArena *arena;
 };
 
 /*** Encoding, decoding, and validation ***/
 
+#define JSON_STREAM_CHUNK	4096
+
+typedef void (*json_write_cb)(void *userdata, const char *buf, size_t len);
+
 JsonNode   *json_decode         (const char *json);
+JsonNode   *json_decode_arena   (const char *json);
+JsonNode   *json_decode_checked (const char *json, size_t *errpos);
+JsonNode   *json_decode_arena_checked(const char *json, size_t *errpos);
 char       *json_encode         (const JsonNode *node);
 char       *json_encode_string  (const char *str);
 char       *json_stringify      (const JsonNode *node, const char *space);
+void        json_stream         (const JsonNode *node, json_write_cb write, void *userdata);
 void        json_delete         (JsonNode *node);
+JsonNode   *json_clone          (const JsonNode *node);
+JsonNode   *json_ref            (JsonNode *node);
 
 bool        json_validate       (const char *json);
 
@@ -108,6 +135,10 @@ void json_remove_from_parent(JsonNode *node);
 
 void json_free(void *a);
 
+/* The number of allocations since counting was enabled */
+void json_count_allocs(int enable);
+unsigned long json_allocs(void);
+
 /*** Debugging ***/
 
 /*
@@ -25,7 +25,11 @@
 #include <string.h>
 #include <unistd.h>
 #include <libgen.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+	#include <sys/uio.h>
+#endif
 #ifndef _WIN32
 	#ifdef __mips__
 		#define __USE_UNIX98
@@ -37,19 +41,40 @@
 #include "common.h"
 #include "gc.h"
 #include "log.h"
+#include "binlog.h"
 
-struct logqueue_t {
+/*
+ * Log lines are queued in a fixed ring that is filled
+ * without taking a lock. Producers claim a slot by moving
+ * the head, the log thread is the only consumer. Each slot
+ * carries a sequence number telling whether it is free, or
+ * filled for the current lap. The number is stored relative
+ * to the slot index so the static, zeroed ring needs no
+ * initialization. Lines that do not fit a slot are copied
+ * to the heap.
+ */
+#define LOG_RING_SIZE		1024
+#define LOG_SLOT_SIZE		192
+#define LOG_LINE_SIZE		1024
+#define LOG_IOV_MAX			64
+
+typedef struct logslot_t {
+	unsigned long seq;
+	size_t len;
+	int binary;
 	char *line;
-	struct logqueue_t *next;
-} logqueue_t;
+	char buf[LOG_SLOT_SIZE];
+} logslot_t;
+
+static struct logslot_t logring[LOG_RING_SIZE];
+static unsigned long logring_head = 0;
+static unsigned long logring_tail = 0;
+static unsigned int logring_sleeping = 0;
 
 static pthread_mutex_t logqueue_lock;
 static pthread_cond_t logqueue_signal;
 static pthread_mutexattr_t logqueue_attr;
 
-static struct logqueue_t *logqueue;
-static struct logqueue_t *logqueue_head;
-static unsigned int logqueue_number = 0;
 static unsigned int loop = 1;
 static unsigned int stop = 0;
 static unsigned int pthinitialized = 0;
@@ -58,37 +83,248 @@ static unsigned int pthfree = 0;
 static pthread_t pth;
 
 static char *logfile = NULL;
+static char *binfile = NULL;
 static int filelog = 1;
 static int shelllog = 0;
-static int loglevel = LOG_DEBUG;
+int loglevel = LOG_DEBUG;
+/* The levels of the text log and the binary log */
+static int textlevel = LOG_DEBUG;
+static int binlevel = -1;
+
+typedef struct logsink_t {
+	int fd;
+	off_t size;
+	unsigned int reopen;
+} logsink_t;
+
+/* Only used by the consumer of the ring */
+static struct logsink_t textsink = { -1, 0, 0 };
+static struct logsink_t binsink = { -1, 0, 0 };
+
+static unsigned long logslot_seq(unsigned long pos) {
+	return __sync_add_and_fetch(&logring[pos % LOG_RING_SIZE].seq, 0) + (pos % LOG_RING_SIZE);
+}
 
-void logwrite(char *line) {
-	struct stat sb;
-	FILE *lf = NULL;
-	if(logfile != NULL) {
-		if((stat(logfile, &sb)) == 0) {
-			if(sb.st_nlink != 0 && sb.st_size > LOG_MAX_SIZE) {
-				if(lf != NULL) {
-					fclose(lf);
-				}
-				char tmp[strlen(logfile)+5];
-				strcpy(tmp, logfile);
-				strcat(tmp, ".old");
-				rename(logfile, tmp);
+static void logslot_set_seq(unsigned long pos, unsigned long seq) {
+	__sync_synchronize();
+	logring[pos % LOG_RING_SIZE].seq = seq - (pos % LOG_RING_SIZE);
+	__sync_synchronize();
+}
+
+static int logring_push(char *line, size_t len, int binary) {
+	struct logslot_t *slot = NULL;
+	unsigned long pos = 0, seq = 0;
+
+	while(1) {
+		pos = __sync_add_and_fetch(&logring_head, 0);
+		seq = logslot_seq(pos);
+		if(seq == pos) {
+			if(__sync_bool_compare_and_swap(&logring_head, pos, pos+1)) {
+				break;
 			}
+		} else if((long)(seq - pos) < 0) {
+			return -1;
 		}
-		if((lf = fopen(logfile, "a")) == NULL) {
+	}
+
+	slot = &logring[pos % LOG_RING_SIZE];
+	if(len < LOG_SLOT_SIZE) {
+		slot->line = slot->buf;
+	} else if((slot->line = MALLOC(len+1)) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(slot->line, line, len+1);
+	slot->len = len;
+	slot->binary = binary;
+
+	logslot_set_seq(pos, pos+1);
+
+	if(pthinitialized == 1 && __sync_add_and_fetch(&logring_sleeping, 0) == 1) {
+		pthread_mutex_lock(&logqueue_lock);
+		pthread_cond_signal(&logqueue_signal);
+		pthread_mutex_unlock(&logqueue_lock);
+	}
+	return 0;
+}
+
+static struct logslot_t *logring_peek(unsigned long pos) {
+	if(logslot_seq(pos) == pos+1) {
+		return &logring[pos % LOG_RING_SIZE];
+	}
+	return NULL;
+}
+
+static void logring_release(void) {
+	struct logslot_t *slot = &logring[logring_tail % LOG_RING_SIZE];
+
+	if(slot->line != slot->buf) {
+		FREE(slot->line);
+	}
+	slot->line = NULL;
+	slot->len = 0;
+	logslot_set_seq(logring_tail, logring_tail+LOG_RING_SIZE);
+	logring_tail++;
+}
+
+static void logfile_close(struct logsink_t *sink) {
+	if(sink->fd != -1) {
+		close(sink->fd);
+	}
+	sink->fd = -1;
+	sink->size = 0;
+}
+
+static void logfile_write(struct logsink_t *sink, struct iovec *iov, int nr) {
+	ssize_t n = 0;
+	int i = 0;
+
+	while(i < nr) {
+#ifdef _WIN32
+		n = write(sink->fd, iov[i].iov_base, iov[i].iov_len);
+#else
+		n = writev(sink->fd, &iov[i], nr-i);
+#endif
+		if(n <= 0) {
+			if(n == -1 && errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		sink->size += n;
+		while(i < nr && (size_t)n >= iov[i].iov_len) {
+			n -= iov[i].iov_len;
+			i++;
+		}
+		if(i < nr) {
+			iov[i].iov_base = (char *)iov[i].iov_base + n;
+			iov[i].iov_len -= n;
+		}
+	}
+}
+
+/*
+ * Every time the binary log is opened it gets a header with
+ * all formats, so the new entries can be decoded on their own.
+ */
+static void logfile_start(struct logsink_t *sink) {
+	struct iovec iov[2];
+	char magic[BINLOG_MAGIC_SIZE+4], *buf = NULL;
+	uint32_t order = BINLOG_ORDER;
+	size_t len = 0;
+	int nr = 0;
+
+	if(sink->size == 0) {
+		memcpy(magic, BINLOG_MAGIC, BINLOG_MAGIC_SIZE);
+		memcpy(&magic[BINLOG_MAGIC_SIZE], &order, 4);
+		iov[nr].iov_base = magic;
+		iov[nr].iov_len = sizeof(magic);
+		nr++;
+	}
+	binlog_preamble(&buf, &len, progname);
+	iov[nr].iov_base = buf;
+	iov[nr].iov_len = len;
+	nr++;
+
+	logfile_write(sink, iov, nr);
+	FREE(buf);
+}
+
+static int logfile_open(struct logsink_t *sink, char *file) {
+	struct stat sb;
+
+	if(file == NULL) {
+		return -1;
+	}
+	if((sink->fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1) {
+		if(sink == &textsink) {
 			filelog = 0;
 		} else {
-			fwrite(line, sizeof(char), strlen(line), lf);
-			fflush(lf);
-			fclose(lf);
-			lf = NULL;
+			binlevel = -1;
+			loglevel = textlevel;
+		}
+		return -1;
+	}
+	if(fstat(sink->fd, &sb) == 0) {
+		sink->size = sb.st_size;
+	}
+	if(sink == &binsink) {
+		logfile_start(sink);
+	}
+	return 0;
+}
+
+/*
+ * The file stays open. Its size is tracked in memory so
+ * the file is only rotated, or reopened after it has been
+ * moved away, once per batch of lines.
+ */
+static int logfile_prepare(struct logsink_t *sink, char *file) {
+	struct stat sb;
+
+	if(sink->reopen == 1) {
+		sink->reopen = 0;
+		logfile_close(sink);
+	}
+	if(sink->fd != -1) {
+		if(fstat(sink->fd, &sb) == 0 && sb.st_nlink == 0) {
+			logfile_close(sink);
+		} else if(sink->size > LOG_MAX_SIZE) {
+			char tmp[strlen(file)+5];
+			strcpy(tmp, file);
+			strcat(tmp, ".old");
+			logfile_close(sink);
+			rename(file, tmp);
 		}
 	}
+	if(sink->fd == -1) {
+		return logfile_open(sink, file);
+	}
+	return 0;
+}
+
+/*
+ * Write all queued lines and binary records to their files
+ * in batches of LOG_IOV_MAX. Returns the number of slots
+ * flushed.
+ */
+static int logring_flush(void) {
+	struct iovec iov[LOG_IOV_MAX], biov[LOG_IOV_MAX];
+	struct logslot_t *slot = NULL;
+	int nr = 0, text = 0, binary = 0, total = 0, i = 0;
+
+	while(1) {
+		nr = 0, text = 0, binary = 0;
+		while(nr < LOG_IOV_MAX && (slot = logring_peek(logring_tail+nr)) != NULL) {
+			if(slot->binary == 1) {
+				biov[binary].iov_base = slot->line;
+				biov[binary++].iov_len = slot->len;
+			} else {
+				iov[text].iov_base = slot->line;
+				iov[text++].iov_len = slot->len;
+			}
+			nr++;
+		}
+		if(nr == 0) {
+			break;
+		}
+		if(text > 0 && filelog == 1 && logfile_prepare(&textsink, logfile) == 0) {
+			logfile_write(&textsink, iov, text);
+		}
+		if(binary > 0 && binfile != NULL && logfile_prepare(&binsink, binfile) == 0) {
+			logfile_write(&binsink, biov, binary);
+		}
+		for(i=0;i<nr;i++) {
+			logring_release();
+		}
+		total += nr;
+	}
+	return total;
 }
 
 int log_gc(void) {
+	struct logslot_t *slot = NULL;
+
 	if(shelllog == 1) {
 		fprintf(stderr, "DEBUG: garbage collected log library\n");
 	}
@@ -97,53 +333,56 @@ int log_gc(void) {
 	loop = 0;
 
 	if(pthinitialized == 1) {
-		pthread_mutex_unlock(&logqueue_lock);
+		pthread_mutex_lock(&logqueue_lock);
 		pthread_cond_signal(&logqueue_signal);
+		pthread_mutex_unlock(&logqueue_lock);
 	}
 
 	/* Flush log queue to pilight.err file */
 	if(pthactive == 0) {
-		struct logqueue_t *tmp;
-		while(logqueue) {
-			tmp = logqueue;
-			if(tmp->line != NULL) {
-				if(filelog == 1 && logfile != NULL) {
-					logwrite(tmp->line);
-				} else {
-					/* [ Datetime ] Progname: */
-					/*  24 + 14 + 2 */
-					size_t pos = 24+strlen(progname)+3;
-					size_t len = strlen(tmp->line);
-					memmove(&tmp->line[0], &tmp->line[pos], len-pos);
+		if(filelog == 1 && logfile != NULL) {
+			logring_flush();
+		} else {
+			while((slot = logring_peek(logring_tail)) != NULL) {
+				if(slot->binary == 1) {
+					struct iovec iov = { slot->line, slot->len };
+					if(binfile != NULL && logfile_prepare(&binsink, binfile) == 0) {
+						logfile_write(&binsink, &iov, 1);
+					}
+					logring_release();
+					continue;
+				}
+				/* [ Datetime ] Progname: */
+				/*  24 + 14 + 2 */
+				size_t pos = 24+strlen(progname)+3;
+				if(slot->len > pos) {
+					memmove(&slot->line[0], &slot->line[pos], slot->len-pos);
 					/* Remove newline */
-					tmp->line[(len-pos)-1] = '\0';
-					logerror(tmp->line);
+					slot->line[(slot->len-pos)-1] = '\0';
+					logerror(slot->line);
 				}
-				FREE(tmp->line);
+				logring_release();
 			}
-			logqueue = logqueue->next;
-			FREE(tmp);
-			logqueue_number--;
-		}
-		if(logqueue != NULL) {
-			FREE(logqueue);
 		}
 		if(pthfree == 1) {
 			pthread_join(pth, NULL);
 		}
 	} else {
 		/* Flush log queue by log thread */
-		while(logqueue_number > 0) {
-			usleep(10);
-		}
 		while(pthactive > 0) {
 			usleep(10);
 		}
 		pthread_join(pth, NULL);
 	}
+	logfile_close(&textsink);
+	logfile_close(&binsink);
 	if(logfile != NULL) {
 		FREE(logfile);
 	}
+	if(binfile != NULL) {
+		FREE(binfile);
+	}
+	binlog_gc();
 	return 1;
 }
 
@@ -173,161 +412,186 @@ void logprintf1(int prio, char *file, int line, const char *format_str, ...) {
 		va_start(ap, format_str);
 		vsprintf(a, format_str, ap);
 		va_end(ap);
-		logprintf(prio, a);
+		logprintf(prio, "%s", a);
 	}
 	FREE(a);
 }
 
-void logprintf(int prio, const char *format_str, ...) {
+static int logbinary_text(char *buf, size_t size, int prio, const char *format_str, ...) {
+	va_list ap;
+	int bytes = 0;
+
+	va_start(ap, format_str);
+	bytes = binlog_encode(buf, size, prio, format_str, ap);
+	va_end(ap);
+
+	return bytes;
+}
+
+/*
+ * Queues a message for the binary log. Messages that can
+ * not be stored by their arguments are stored formatted.
+ */
+static void logbinary(int prio, const char *format_str, va_list ap) {
+	char buf[LOG_LINE_SIZE], text[LOG_LINE_SIZE];
+	va_list cpy;
+	int bytes = 0;
+
+	/* The ring copies the terminating byte as well */
+	va_copy(cpy, ap);
+	bytes = binlog_encode(buf, sizeof(buf)-1, prio, format_str, cpy);
+	va_end(cpy);
+	if(bytes == -1) {
+		vsnprintf(text, sizeof(text), format_str, ap);
+		bytes = logbinary_text(buf, sizeof(buf)-1, prio, "%s", text);
+	}
+	if(bytes > 0) {
+		if(logring_push(buf, (size_t)bytes, 1) == -1) {
+			fprintf(stderr, "log queue full\n");
+		} else {
+			binlog_published(buf);
+		}
+	}
+}
+
+void (logprintf)(int prio, const char *format_str, ...) {
 	struct timeval tv;
 	struct tm tm;
-	va_list ap, apcpy;
-	char fmt[64], buf[64], *line = MALLOC(128);
+	va_list ap;
+	char fmt[64], buf[64], stack[LOG_LINE_SIZE], *line = stack;
 	int save_errno = -1, pos = 0, bytes = 0;
 
-	memset(&tm, '\0', sizeof(struct tm));
-
-	if(line == NULL) {
-		fprintf(stderr, "out of memory\n");
-		exit(EXIT_FAILURE);
+	/* Filtered messages are not even formatted */
+	if(loglevel < prio) {
+		return;
 	}
+
 	save_errno = errno;
 
-	memset(line, '\0', 128);
+	if(stop == 0 && prio <= binlevel) {
+		va_start(ap, format_str);
+		logbinary(prio, format_str, ap);
+		va_end(ap);
+	}
+	/* Only kept in the binary log */
+	if(prio > textlevel) {
+		errno = save_errno;
+		return;
+	}
+
+	memset(&tm, '\0', sizeof(struct tm));
 	memset(buf, '\0',  64);
 
-	if(loglevel >= prio) {
-		gettimeofday(&tv, NULL);
+	gettimeofday(&tv, NULL);
 #ifdef _WIN32
-		struct tm *tm1;
-		if((tm1 = gmtime(&tv.tv_sec)) != 0) {
-			memcpy(&tm, tm1, sizeof(struct tm));
+	struct tm *tm1;
+	if((tm1 = gmtime(&tv.tv_sec)) != 0) {
+		memcpy(&tm, tm1, sizeof(struct tm));
 #else
-		if((gmtime_r(&tv.tv_sec, &tm)) != 0) {
+	if((gmtime_r(&tv.tv_sec, &tm)) != 0) {
 #endif
-			strftime(fmt, sizeof(fmt), "%b %d %H:%M:%S", &tm);
-			snprintf(buf, sizeof(buf), "%s:%03u", fmt, (unsigned int)tv.tv_usec);
-		}
-		pos += sprintf(line, "[%22.22s] %s: ", buf, progname);
+		strftime(fmt, sizeof(fmt), "%b %d %H:%M:%S", &tm);
+		snprintf(buf, sizeof(buf), "%s:%03u", fmt, (unsigned int)tv.tv_usec);
+	}
+	pos += snprintf(line, LOG_LINE_SIZE, "[%22.22s] %s: ", buf, progname);
+
+	switch(prio) {
+		case LOG_WARNING:
+			pos += sprintf(&line[pos], "WARNING: ");
+		break;
+		case LOG_ERR:
+			pos += sprintf(&line[pos], "ERROR: ");
+		break;
+		case LOG_INFO:
+			pos += sprintf(&line[pos], "INFO: ");
+		break;
+		case LOG_NOTICE:
+			pos += sprintf(&line[pos], "NOTICE: ");
+		break;
+		case LOG_DEBUG:
+			pos += sprintf(&line[pos], "DEBUG: ");
+		break;
+		case LOG_STACK:
+			pos += sprintf(&line[pos], "STACK: ");
+		break;
+		default:
+		break;
+	}
 
-		switch(prio) {
-			case LOG_WARNING:
-				pos += sprintf(&line[pos], "WARNING: ");
-			break;
-			case LOG_ERR:
-				pos += sprintf(&line[pos], "ERROR: ");
-			break;
-			case LOG_INFO:
-				pos += sprintf(&line[pos], "INFO: ");
-			break;
-			case LOG_NOTICE:
-				pos += sprintf(&line[pos], "NOTICE: ");
-			break;
-			case LOG_DEBUG:
-				pos += sprintf(&line[pos], "DEBUG: ");
-			break;
-			case LOG_STACK:
-				pos += sprintf(&line[pos], "STACK: ");
-			break;
-			default:
-			break;
-		}
+	/* Most lines fit the stack buffer and are formatted once */
+	va_start(ap, format_str);
+	bytes = vsnprintf(&line[pos], LOG_LINE_SIZE-pos-1, format_str, ap);
+	va_end(ap);
 
-		va_copy(apcpy, ap);
-		va_start(apcpy, format_str);
-#ifdef _WIN32
-		bytes = _vscprintf(format_str, apcpy);
-#else
-		bytes = vsnprintf(NULL, 0, format_str, apcpy);
-#endif
-		if(bytes == -1) {
-			fprintf(stderr, "ERROR: unproperly formatted logprintf message %s\n", format_str);
-		} else {
-			va_end(apcpy);
-			if((line = REALLOC(line, (size_t)bytes+(size_t)pos+3)) == NULL) {
-				fprintf(stderr, "out of memory\n");
-				exit(EXIT_FAILURE);
-			}
-			va_start(ap, format_str);
-			pos += vsprintf(&line[pos], format_str, ap);
-			va_end(ap);
+	if(bytes < 0) {
+		fprintf(stderr, "ERROR: unproperly formatted logprintf message %s\n", format_str);
+		line[pos] = '\0';
+	} else if(bytes >= LOG_LINE_SIZE-pos-1) {
+		if((line = MALLOC((size_t)bytes+(size_t)pos+2)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
 		}
-		line[pos++]='\n';
-		line[pos++]='\0';
+		memcpy(line, stack, pos);
+		va_start(ap, format_str);
+		pos += vsnprintf(&line[pos], (size_t)bytes+1, format_str, ap);
+		va_end(ap);
+	} else {
+		pos += bytes;
 	}
+	line[pos++]='\n';
+	line[pos]='\0';
+
 	if(shelllog == 1) {
-		fprintf(stderr, "%s", line);
+		fwrite(line, sizeof(char), pos, stderr);
 	}
 #ifdef _WIN32
 	if(prio == LOG_ERR && strstr(progname, "daemon") != NULL && pilight.running == 0) {
 		MessageBox(NULL, line, "pilight :: error", MB_OK);
 	}
 #endif
-	if(stop == 0 && pos > 0) {
-		if(prio < LOG_DEBUG) {
-			if(pthinitialized == 1) {
-				pthread_mutex_lock(&logqueue_lock);
-			}
-			if(logqueue_number < 1024) {
-				struct logqueue_t *node = MALLOC(sizeof(logqueue_t));
-				if(node == NULL) {
-					fprintf(stderr, "out of memory\n");
-					exit(EXIT_FAILURE);
-				}
-				if((node->line = MALLOC((size_t)pos+1)) == NULL) {
-					fprintf(stderr, "out of memory\n");
-					exit(EXIT_FAILURE);
-				}
-				memset(node->line, '\0', (size_t)pos+1);
-				strcpy(node->line, line);
-				node->next = NULL;
-
-				if(logqueue_number == 0) {
-					logqueue = node;
-					logqueue_head = node;
-				} else {
-					logqueue_head->next = node;
-					logqueue_head = node;
-				}
-
-				logqueue_number++;
-			} else {
-				fprintf(stderr, "log queue full\n");
-			}
-			if(pthinitialized == 1) {
-				pthread_mutex_unlock(&logqueue_lock);
-				pthread_cond_signal(&logqueue_signal);
-			}
+	if(stop == 0 && prio < LOG_DEBUG) {
+		if(logring_push(line, pos, 0) == -1) {
+			fprintf(stderr, "log queue full\n");
 		}
 	}
-	FREE(line);
+	if(line != stack) {
+		FREE(line);
+	}
 	errno = save_errno;
 }
 
 void *logloop(void *param) {
+	struct timespec ts;
+	struct timeval tv;
+
 	pth = pthread_self();
 
 	pthactive = 1;
 	pthfree = 1;
 
-	pthread_mutex_lock(&logqueue_lock);
-	while(loop) {
-		if(logqueue_number > 0) {
-			pthread_mutex_lock(&logqueue_lock);
-
-			logwrite(logqueue->line);
+	while(1) {
+		if(logring_flush() > 0) {
+			continue;
+		}
+		if(loop == 0) {
+			break;
+		}
 
-			struct logqueue_t *tmp = logqueue;
-			FREE(tmp->line);
-			logqueue = logqueue->next;
-			FREE(tmp);
-			logqueue_number--;
-			pthread_mutex_unlock(&logqueue_lock);
-		} else {
-			pthread_cond_wait(&logqueue_signal, &logqueue_lock);
+		pthread_mutex_lock(&logqueue_lock);
+		__sync_lock_test_and_set(&logring_sleeping, 1);
+		if(loop == 1 && logring_peek(logring_tail) == NULL) {
+			/* Also wake up now and then in case a signal was missed */
+			gettimeofday(&tv, NULL);
+			ts.tv_sec = tv.tv_sec + 1;
+			ts.tv_nsec = tv.tv_usec * 1000;
+			pthread_cond_timedwait(&logqueue_signal, &logqueue_lock, &ts);
 		}
+		__sync_lock_release(&logring_sleeping);
+		pthread_mutex_unlock(&logqueue_lock);
 	}
 
+	logfile_close(&textsink);
+	logfile_close(&binsink);
 	pthactive = 0;
 	return (void *)NULL;
 }
@@ -428,6 +692,7 @@ int log_file_set(char *log) {
 		}
 		strcpy(logfile, log);
 	}
+	textsink.reopen = 1;
 
 	char tmp[strlen(logfile)+5];
 	strcpy(tmp, logfile);
@@ -462,12 +727,46 @@ int log_file_set(char *log) {
 	return EXIT_SUCCESS;
 }
 
+/*
+ * Messages pass the macro when either log wants them, that
+ * is the highest of both levels.
+ */
+static void log_level_update(void) {
+	loglevel = (binlevel > textlevel) ? binlevel : textlevel;
+}
+
 void log_level_set(int level) {
-	loglevel = level;
+	textlevel = level;
+	log_level_update();
 }
 
 int log_level_get(void) {
-	return loglevel;
+	return textlevel;
+}
+
+/*
+ * Messages up to the level are also written to a binary
+ * log, independent of the level of the text log.
+ */
+int log_binary_set(char *file, int level) {
+	int fd = -1;
+
+	if((fd = open(file, O_WRONLY | O_APPEND | O_CREAT, 0644)) == -1) {
+		logprintf(LOG_ERR, "could not open binary log %s: %s", file, strerror(errno));
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	if((binfile = REALLOC(binfile, strlen(file)+1)) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	strcpy(binfile, file);
+	binsink.reopen = 1;
+	binlevel = level;
+	log_level_update();
+
+	return EXIT_SUCCESS;
 }
 
 /*
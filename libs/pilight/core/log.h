@@ -34,8 +34,24 @@
 
 #define LOG_STACK		255
 
+extern int loglevel;
+
+/*
+ * Filtered messages are skipped before their arguments
+ * are evaluated. Stack messages can be left out of the
+ * build entirely with LOG_STACK_DISABLE.
+ */
+#ifdef LOG_STACK_DISABLE
+	#define log_level_enabled(prio) ((prio) != LOG_STACK && (prio) <= loglevel)
+#else
+	#define log_level_enabled(prio) ((prio) <= loglevel)
+#endif
+
 void logprintf1(int prio, char *file, int line, const char *format_str, ...);
 void logprintf(int prio, const char *format_str, ...);
+
+#define logprintf(prio, ...) \
+	(log_level_enabled(prio) ? logprintf(prio, __VA_ARGS__) : (void)0)
 void logperror(int prio, const char *s);
 void *logloop(void *param);
 void log_file_enable(void);
@@ -43,6 +59,7 @@ void log_file_disable(void);
 void log_shell_enable(void);
 void log_shell_disable(void);
 int log_file_set(char *file);
+int log_binary_set(char *file, int level);
 void log_level_set(int level);
 int log_level_get(void);
 int log_gc(void);
@@ -17,6 +17,9 @@
 #include <string.h>
 #include <assert.h>
 #include <sys/types.h>
+#ifndef _WIN32
+	#include <pthread.h>
+#endif
 #ifdef _WIN32
 	#if _WIN32_WINNT < 0x0501
 		#undef _WIN32_WINNT
@@ -51,6 +54,12 @@
 #define AUTHPLAIN			1
 #define STARTTLS			2
 
+/*
+ * How long an authenticated connection is kept open
+ * for the next mail to the same server.
+ */
+#define SMTP_IDLE_TIMEOUT		10
+
 #define SMTP_STEP_RECV_WELCOME	0
 #define SMTP_STEP_SEND_HELLO		1
 #define SMTP_STEP_RECV_HELLO		2
@@ -70,28 +79,135 @@
 #define SMTP_STEP_RECV_RESET		16
 #define SMTP_STEP_SEND_QUIT			17
 #define SMTP_STEP_RECV_QUIT			18
+#define SMTP_STEP_SEND_ENVELOPE	19
+#define SMTP_STEP_RECV_ENVELOPE	20
+#define SMTP_STEP_IDLE					21
 #define SMTP_STEP_END						99
 
+typedef struct smtp_queue_t {
+	struct mail_t *mail;
+	void (*callback)(int, struct mail_t *);
+	struct smtp_queue_t *next;
+} smtp_queue_t;
+
+/*
+ * A connection to a mail server. It isn't closed after
+ * the first mail, but sends all mails that were queued for
+ * the same server and account in the meantime.
+ */
 typedef struct request_t {
-	const char *host;
-  const char *login;
-	const char *pass;
+	char *host;
+	char *login;
+	char *pass;
 	unsigned short port;
+	int is_ssl;
 
 	char *content;
 	int content_len;
 	int step;
 	int authtype;
+	int pipelining;
 	int reading;
 	int sending;
 	int bytes_read;
+	/* The number of replies the last command group waits for */
+	int replies;
+	int idle;
+	int reused;
 	void (*callback)(int, struct mail_t *);
 
 	struct mail_t *mail;
+	/* The next mail of which the envelope went along with the body */
+	struct smtp_queue_t *pipelined;
+	struct smtp_queue_t *queue;
+
+	uv_poll_t *poll_req;
+	uv_timer_t *timer_req;
 
 	mbedtls_ssl_context ssl;
+
+	struct request_t *next;
 } request_t;
 
+#ifdef _WIN32
+	static uv_mutex_t smtp_lock;
+#else
+	static pthread_mutex_t smtp_lock;
+	static pthread_mutexattr_t smtp_attr;
+#endif
+
+static struct request_t *smtp_sessions = NULL;
+static int smtp_lock_init = 0;
+
+static int smtp_connect(struct request_t *request);
+
+static void smtp_init_lock(void) {
+	if(smtp_lock_init == 0) {
+		smtp_lock_init = 1;
+#ifdef _WIN32
+		uv_mutex_init(&smtp_lock);
+#else
+		pthread_mutexattr_init(&smtp_attr);
+		pthread_mutexattr_settype(&smtp_attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&smtp_lock, &smtp_attr);
+#endif
+	}
+}
+
+static void smtp_lock_acquire(void) {
+#ifdef _WIN32
+	uv_mutex_lock(&smtp_lock);
+#else
+	pthread_mutex_lock(&smtp_lock);
+#endif
+}
+
+static void smtp_lock_release(void) {
+#ifdef _WIN32
+	uv_mutex_unlock(&smtp_lock);
+#else
+	pthread_mutex_unlock(&smtp_lock);
+#endif
+}
+
+static struct request_t *smtp_session(const char *host, const char *login, const char *pass, unsigned short port, int is_ssl) {
+	struct request_t *request = NULL;
+
+	if((request = MALLOC(sizeof(struct request_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(request, 0, sizeof(struct request_t));
+	if((request->host = STRDUP((char *)host)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((request->login = STRDUP((char *)login)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((request->pass = STRDUP((char *)pass)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	request->port = port;
+	request->is_ssl = is_ssl;
+	request->authtype = UNSUPPORTED;
+
+	return request;
+}
+
+static void smtp_session_remove(struct request_t *request) {
+	struct request_t *tmp = NULL, *prev = NULL;
+
+	for(tmp = smtp_sessions; tmp != NULL; prev = tmp, tmp = tmp->next) {
+		if(tmp == request) {
+			if(prev == NULL) {
+				smtp_sessions = tmp->next;
+			} else {
+				prev->next = tmp->next;
+			}
+			break;
+		}
+	}
+}
+
 static void close_cb(uv_handle_t *handle) {
 	/*
 	 * Make sure we execute in the main thread
@@ -102,6 +218,72 @@ static void close_cb(uv_handle_t *handle) {
 	FREE(handle);
 }
 
+/*
+ * Fails the mail being sent and all mails waiting for this
+ * connection. A connection that was picked up again after
+ * being idle can have been closed by the server in the
+ * meantime, in that case the mails are retried on a new one.
+ */
+static void smtp_fail(struct request_t *request) {
+	struct request_t *retry = NULL;
+	struct smtp_queue_t *queue = NULL, *node = NULL;
+
+	smtp_lock_acquire();
+	smtp_session_remove(request);
+	queue = request->queue;
+	request->queue = NULL;
+	smtp_lock_release();
+
+	if(request->pipelined != NULL) {
+		request->pipelined->next = queue;
+		queue = request->pipelined;
+		request->pipelined = NULL;
+	}
+
+	if(request->reused == 1 && request->mail != NULL) {
+		retry = smtp_session(request->host, request->login, request->pass, request->port, request->is_ssl);
+		retry->mail = request->mail;
+		retry->callback = request->callback;
+		retry->queue = queue;
+		request->mail = NULL;
+		request->callback = NULL;
+		queue = NULL;
+
+		smtp_lock_acquire();
+		retry->next = smtp_sessions;
+		smtp_sessions = retry;
+		smtp_lock_release();
+	}
+
+	if(request->callback != NULL) {
+		request->callback(-1, request->mail);
+	}
+	while(queue) {
+		node = queue;
+		queue = queue->next;
+		if(node->callback != NULL) {
+			node->callback(-1, node->mail);
+		}
+		FREE(node);
+	}
+
+	if(request->timer_req != NULL) {
+		uv_timer_stop(request->timer_req);
+		uv_close((uv_handle_t *)request->timer_req, close_cb);
+	}
+	if(request->content != NULL) {
+		FREE(request->content);
+	}
+	FREE(request->host);
+	FREE(request->login);
+	FREE(request->pass);
+	FREE(request);
+
+	if(retry != NULL) {
+		smtp_connect(retry);
+	}
+}
+
 static void abort_cb(uv_poll_t *req) {
 	/*
 	 * Make sure we execute in the main thread
@@ -117,10 +299,6 @@ static void abort_cb(uv_poll_t *req) {
 		logprintf(LOG_ERR, "uv_fileno: %s", uv_strerror(r)); /*LCOV_EXCL_LINE*/
 	}
 
-	if(request != NULL && request->callback != NULL) {
-		request->callback(-1, request->mail);
-	}
-
 	if(fd > -1) {
 #ifdef _WIN32
 		shutdown(fd, SD_BOTH);
@@ -141,7 +319,7 @@ static void abort_cb(uv_poll_t *req) {
 	}
 
 	if(request != NULL) {
-		FREE(request);
+		smtp_fail(request);
 	}
 }
 
@@ -155,6 +333,98 @@ static void custom_close_cb(uv_poll_t *req) {
 	abort_cb(req);
 }
 
+/*
+ * The mail commands go in one write when the server
+ * supports pipelining.
+ */
+static int smtp_mail_step(struct request_t *request) {
+	return (request->pipelining == 1) ? SMTP_STEP_SEND_ENVELOPE : SMTP_STEP_SEND_FROM;
+}
+
+/*
+ * Counts the complete replies in the buffer, a reply
+ * can span several lines of which only the last one has
+ * a space after the code.
+ */
+static int smtp_replies(char *buf, int *codes, int max) {
+	char *line = buf, *end = NULL;
+	int nr = 0;
+
+	if(buf == NULL) {
+		return 0;
+	}
+	while(nr < max && (end = strstr(line, "\r\n")) != NULL) {
+		if(end-line >= 3 && (end-line == 3 || line[3] == ' ')) {
+			codes[nr++] = atoi(line);
+		}
+		line = end+2;
+	}
+
+	return nr;
+}
+
+static void smtp_idle_timeout(uv_timer_t *handle) {
+	uv_poll_t *req = handle->data;
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct request_t *request = custom_poll_data->data;
+
+	smtp_lock_acquire();
+	/* Just picked up for a new mail */
+	if(request->idle == 0) {
+		smtp_lock_release();
+		return;
+	}
+	request->idle = 0;
+	smtp_session_remove(request);
+	smtp_lock_release();
+
+	request->step = SMTP_STEP_SEND_QUIT;
+	uv_custom_write(req);
+}
+
+/*
+ * Continue with the next mail for this server, or wait a
+ * while for one to come in. The timer is started before the
+ * connection is marked idle, because from then on sendmail
+ * can pick it up from another thread.
+ */
+static void smtp_next(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct request_t *request = custom_poll_data->data;
+	struct smtp_queue_t *node = NULL;
+
+	if(request->timer_req == NULL) {
+		if((request->timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		request->timer_req->data = req;
+		uv_timer_init(uv_default_loop(), request->timer_req);
+	}
+	request->step = SMTP_STEP_IDLE;
+	uv_timer_start(request->timer_req, smtp_idle_timeout, SMTP_IDLE_TIMEOUT*1000, 0);
+
+	smtp_lock_acquire();
+	if((node = request->queue) != NULL) {
+		request->queue = node->next;
+	} else {
+		request->idle = 1;
+	}
+	smtp_lock_release();
+
+	if(node == NULL) {
+		uv_custom_read(req);
+		return;
+	}
+
+	uv_timer_stop(request->timer_req);
+	request->mail = node->mail;
+	request->callback = node->callback;
+	FREE(node);
+
+	request->step = smtp_mail_step(request);
+	uv_custom_write(req);
+}
+
 static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 	/*
 	 * Make sure we execute in the main thread
@@ -165,7 +435,7 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 	struct uv_custom_poll_t *custom_poll_data = req->data;
 	struct request_t *request = custom_poll_data->data;
 	char buffer[BUFFER_SIZE], testme[256], ch = 0;
-	int val = 0, n = 0;
+	int val = 0, n = 0, codes[4];
 	memset(&buffer, '\0', BUFFER_SIZE);
 
 	if(*nread == -1) {
@@ -208,6 +478,9 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 					if(strncmp(testme, "STARTTLS", 8) == 0) {
 						request->authtype = STARTTLS;
 					}
+					if(strncmp(testme, "PIPELINING", 10) == 0) {
+						request->pipelining = 1;
+					}
 				}
 
 				if(val == 501 && ch == 32) {
@@ -243,7 +516,7 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 		} break;
 		case SMTP_STEP_RECV_AUTH: {
 			if(strncmp(buf, "235", 3) == 0) {
-				request->step = SMTP_STEP_SEND_FROM;
+				request->step = smtp_mail_step(request);
 			}
 			if(strncmp(buf, "451", 3) == 0) {
 				logprintf(LOG_NOTICE, "SMTP: protocol violation while authenticating");
@@ -261,7 +534,7 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 				return;
 			}
 			*nread = 0;
-			request->step = SMTP_STEP_SEND_FROM;
+			request->step = smtp_mail_step(request);
 			uv_custom_write(req);
 		} break;
 		case SMTP_STEP_RECV_FROM: {
@@ -294,38 +567,69 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 			request->step = SMTP_STEP_SEND_BODY;
 			uv_custom_write(req);
 		} break;
-		case SMTP_STEP_RECV_BODY: {
-			if(strncmp(buf, "250", 3) != 0) {
+		case SMTP_STEP_RECV_ENVELOPE: {
+			/* Wait for the replies to MAIL, RCPT and DATA */
+			if(smtp_replies(buf, codes, 3) < 3) {
+				uv_custom_read(req);
+				return;
+			}
+			if(codes[0] != 250 || codes[1] != 250 || codes[2] != 354) {
 				uv_custom_close(req);
 				return;
 			}
 			request->bytes_read = 0;
 			*nread = 0;
-			request->step = SMTP_STEP_SEND_RESET;
+			request->step = SMTP_STEP_SEND_BODY;
 			uv_custom_write(req);
 		} break;
+		case SMTP_STEP_RECV_BODY: {
+			if(smtp_replies(buf, codes, request->replies) < request->replies) {
+				uv_custom_read(req);
+				return;
+			}
+			if(codes[0] != 250) {
+				uv_custom_close(req);
+				return;
+			}
+			logprintf(LOG_INFO, "SMTP: successfully send mail");
+			if(request->callback != NULL) {
+				request->callback(0, request->mail);
+			}
+			request->callback = NULL;
+			request->mail = NULL;
+			request->bytes_read = 0;
+			*nread = 0;
+
+			if(request->pipelined != NULL) {
+				struct smtp_queue_t *node = request->pipelined;
+				request->pipelined = NULL;
+				request->mail = node->mail;
+				request->callback = node->callback;
+				FREE(node);
+
+				if(codes[1] != 250 || codes[2] != 250 || codes[3] != 354) {
+					uv_custom_close(req);
+					return;
+				}
+				request->step = SMTP_STEP_SEND_BODY;
+				uv_custom_write(req);
+			} else {
+				smtp_next(req);
+			}
+		} break;
 		case SMTP_STEP_RECV_RESET: {
 			if(strncmp(buf, "250", 3) != 0) {
 				uv_custom_close(req);
 				return;
 			}
+			request->reused = 0;
 			request->bytes_read = 0;
 			*nread = 0;
-			request->step = SMTP_STEP_SEND_QUIT;
+			request->step = smtp_mail_step(request);
 			uv_custom_write(req);
 		} break;
 		case SMTP_STEP_RECV_QUIT: {
-			logprintf(LOG_INFO, "SMTP: successfully send mail");
-			if(request->callback != NULL) {
-				request->callback(0, request->mail);
-			}
-			request->callback = NULL;
 			uv_custom_close(req);
-			// if(!uv_is_closing((uv_handle_t *)req)) {
-				// uv_close((uv_handle_t *)req, close_cb);
-			// }
-			// uv_custom_poll_free(custom_poll_data);
-			// FREE(request);
 			return;
 		} break;
 		case SMTP_STEP_RECV_STARTTLS: {
@@ -338,6 +642,22 @@ static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 				uv_custom_write(req);
 			}
 		} break;
+		/*
+		 * An idle connection should stay silent, anything
+		 * it reads means it is closed or unusable.
+		 */
+		case SMTP_STEP_IDLE: {
+			smtp_lock_acquire();
+			if(request->idle == 0) {
+				smtp_lock_release();
+				return;
+			}
+			request->idle = 0;
+			smtp_session_remove(request);
+			smtp_lock_release();
+			uv_custom_close(req);
+			return;
+		} break;
 	}
 }
 
@@ -364,6 +684,20 @@ static void push_data(uv_poll_t *req, int step) {
 	uv_custom_read(req);
 }
 
+/*
+ * Appends the MAIL, RCPT and DATA commands of a mail to
+ * the content that will be sent.
+ */
+static void smtp_envelope(struct request_t *request, struct mail_t *mail) {
+	size_t len = strlen("MAIL FROM: <>\r\nRCPT TO: <>\r\nDATA\r\n")+strlen(mail->from)+strlen(mail->to)+1;
+
+	if((request->content = REALLOC(request->content, request->content_len+len)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	request->content_len += snprintf(&request->content[request->content_len], len,
+		"MAIL FROM: <%s>\r\nRCPT TO: <%s>\r\nDATA\r\n", mail->from, mail->to);
+}
+
 static void write_cb(uv_poll_t *req) {
 	/*
 	 * Make sure we execute in the main thread
@@ -379,6 +713,8 @@ static void write_cb(uv_poll_t *req) {
 			push_data(req, SMTP_STEP_RECV_WELCOME);
 		} break;
 		case SMTP_STEP_SEND_HELLO: {
+			/* What the server supports can change after STARTTLS */
+			request->pipelining = 0;
 			request->content_len = strlen("EHLO \r\n")+strlen(USERAGENT)+1;
 			if((request->content = REALLOC(request->content, request->content_len+1)) == NULL) {
 				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
@@ -444,6 +780,16 @@ static void write_cb(uv_poll_t *req) {
 			/*LCOV_EXCL_STOP*/
 			push_data(req, SMTP_STEP_RECV_TO);
 		} break;
+		case SMTP_STEP_SEND_ENVELOPE: {
+			request->content_len = 0;
+			smtp_envelope(request, request->mail);
+			/*LCOV_EXCL_START*/
+			if(pilight.debuglevel >= 2) {
+				fprintf(stderr, "SMTP: %s\n", request->content);
+			}
+			/*LCOV_EXCL_STOP*/
+			push_data(req, SMTP_STEP_RECV_ENVELOPE);
+		} break;
 		case SMTP_STEP_SEND_DATA: {
 			request->content_len = strlen("DATA\r\n");
 			if((request->content = REALLOC(request->content, request->content_len+1)) == NULL) {
@@ -478,6 +824,24 @@ static void write_cb(uv_poll_t *req) {
 				"%s"
 				"\r\n.\r\n",
 				request->mail->subject, request->mail->from, request->mail->to, request->mail->message);
+
+			/*
+			 * The envelope of the next mail can follow the body
+			 * right away, so both are answered in one go.
+			 */
+			request->replies = 1;
+			if(request->pipelining == 1) {
+				smtp_lock_acquire();
+				if((request->pipelined = request->queue) != NULL) {
+					request->queue = request->pipelined->next;
+					request->pipelined->next = NULL;
+				}
+				smtp_lock_release();
+				if(request->pipelined != NULL) {
+					smtp_envelope(request, request->pipelined->mail);
+					request->replies = 4;
+				}
+			}
 			/*LCOV_EXCL_START*/
 			if(pilight.debuglevel >= 2) {
 				fprintf(stderr, "SMTP: %s\n", request->content);
@@ -527,47 +891,18 @@ static void write_cb(uv_poll_t *req) {
 	}
 }
 
-int sendmail(char *host, char *login, char *pass, unsigned short port, int is_ssl, struct mail_t *mail, void (*callback)(int, struct mail_t *)) {
-	struct request_t *request = NULL;
+/*
+ * Resolves the server and starts the conversation on a new
+ * connection. The session is already listed, so mails to the
+ * same server that come in meanwhile queue up behind it.
+ */
+static int smtp_connect(struct request_t *request) {
 	struct uv_custom_poll_t *custom_poll_data = NULL;
 	struct sockaddr_in addr4;
 	struct sockaddr_in6 addr6;
 	char *ip = NULL;
 	int type = 0, sockfd = 0, r = 0;
 
-	if(mail->from == NULL) {
-		logprintf(LOG_ERR, "SMTP: sender not set");
-		return -1;
-	}
-	if(mail->subject == NULL) {
-		logprintf(LOG_ERR, "SMTP: subject not set");
-		return -1;
-	}
-	if(mail->message == NULL) {
-		logprintf(LOG_ERR, "SMTP: message not set");
-		return -1;
-	}
-	if(mail->to == NULL) {
-		logprintf(LOG_ERR, "SMTP: recipient not set");
-		return -1;
-	}
-	if(strcmp(mail->message, ".") == 0) {
-		logprintf(LOG_ERR, "SMTP: message cannot be a single .");
-		return -1;
-	}
-
-	if((request = MALLOC(sizeof(struct request_t))) == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
-	memset(request, 0, sizeof(struct request_t));
-	request->host = host;
-	request->login = login;
-	request->pass = pass;
-	request->port = port;
-	request->mail = mail;
-	request->authtype = UNSUPPORTED;
-	request->callback = callback;
-
 #ifdef _WIN32
 	WSADATA wsa;
 
@@ -577,11 +912,16 @@ int sendmail(char *host, char *login, char *pass, unsigned short port, int is_ss
 	}
 #endif
 
-	type = host2ip(host, &ip);
+	if(request->is_ssl == 1 && ssl_client_init_status() == -1) {
+		logprintf(LOG_ERR, "secure e-mails require a properly initialized SSL library");
+		goto free;
+	}
+
+	type = host2ip(request->host, &ip);
 	switch(type) {
 		case AF_INET: {
 			memset(&addr4, '\0', sizeof(struct sockaddr_in));
-			r = uv_ip4_addr(ip, port, &addr4);
+			r = uv_ip4_addr(ip, request->port, &addr4);
 			if(r != 0) {
 				/*LCOV_EXCL_START*/
 				logprintf(LOG_ERR, "uv_ip4_addr: %s", uv_strerror(r));
@@ -591,7 +931,7 @@ int sendmail(char *host, char *login, char *pass, unsigned short port, int is_ss
 		} break;
 		case AF_INET6: {
 			memset(&addr6, '\0', sizeof(struct sockaddr_in6));
-			r = uv_ip6_addr(ip, port, &addr6);
+			r = uv_ip6_addr(ip, request->port, &addr6);
 			if(r != 0) {
 				/*LCOV_EXCL_START*/
 				logprintf(LOG_ERR, "uv_ip6_addr: %s", uv_strerror(r));
@@ -651,13 +991,7 @@ int sendmail(char *host, char *login, char *pass, unsigned short port, int is_ss
 
 	uv_custom_poll_init(&custom_poll_data, poll_req, (void *)request);
 
-	custom_poll_data->is_ssl = is_ssl;
-
-	if(custom_poll_data->is_ssl == 1 && ssl_client_init_status() == -1) {
-		logprintf(LOG_ERR, "secure e-mails require a properly initialized SSL library");
-		abort_cb(poll_req);
-		return -1;
-	}
+	custom_poll_data->is_ssl = request->is_ssl;
 	custom_poll_data->write_cb = write_cb;
 	custom_poll_data->read_cb = read_cb;
 	custom_poll_data->close_cb = custom_close_cb;
@@ -671,16 +1005,16 @@ int sendmail(char *host, char *login, char *pass, unsigned short port, int is_ss
 		/*LCOV_EXCL_STOP*/
 	}
 
+	request->poll_req = poll_req;
 	request->step = SMTP_STEP_RECV_WELCOME;
 	uv_custom_write(poll_req);
 
 	return 0;
 
 free:
-	if(request != NULL && request->callback != NULL) {
-		request->callback(-1, request->mail);
+	if(ip != NULL) {
+		FREE(ip);
 	}
-	FREE(request);
 	if(custom_poll_data != NULL) {
 		uv_custom_poll_free(custom_poll_data);
 	}
@@ -691,5 +1025,90 @@ free:
 		close(sockfd);
 #endif
 	}
+	smtp_fail(request);
 	return -1;
 }
+
+int sendmail(char *host, char *login, char *pass, unsigned short port, int is_ssl, struct mail_t *mail, void (*callback)(int, struct mail_t *)) {
+	struct request_t *request = NULL, *tmp = NULL, *busy = NULL;
+	struct smtp_queue_t *node = NULL, *last = NULL;
+
+	if(mail->from == NULL) {
+		logprintf(LOG_ERR, "SMTP: sender not set");
+		return -1;
+	}
+	if(mail->subject == NULL) {
+		logprintf(LOG_ERR, "SMTP: subject not set");
+		return -1;
+	}
+	if(mail->message == NULL) {
+		logprintf(LOG_ERR, "SMTP: message not set");
+		return -1;
+	}
+	if(mail->to == NULL) {
+		logprintf(LOG_ERR, "SMTP: recipient not set");
+		return -1;
+	}
+	if(strcmp(mail->message, ".") == 0) {
+		logprintf(LOG_ERR, "SMTP: message cannot be a single .");
+		return -1;
+	}
+
+	smtp_init_lock();
+
+	/*
+	 * Prefer an idle connection to the same server and
+	 * account, otherwise wait for one that is still busy.
+	 */
+	smtp_lock_acquire();
+	for(tmp = smtp_sessions; tmp != NULL; tmp = tmp->next) {
+		if(tmp->port == port && tmp->is_ssl == is_ssl &&
+			strcmp(tmp->host, host) == 0 && strcmp(tmp->login, login) == 0 &&
+			strcmp(tmp->pass, pass) == 0) {
+			if(tmp->idle == 1) {
+				break;
+			}
+			if(busy == NULL) {
+				busy = tmp;
+			}
+		}
+	}
+	if(tmp != NULL) {
+		tmp->idle = 0;
+		tmp->reused = 1;
+		tmp->mail = mail;
+		tmp->callback = callback;
+		smtp_lock_release();
+
+		logprintf(LOG_DEBUG, "SMTP: reusing connection to %s", host);
+		uv_timer_stop(tmp->timer_req);
+		tmp->step = SMTP_STEP_SEND_RESET;
+		uv_custom_write(tmp->poll_req);
+		return 0;
+	}
+	if(busy != NULL) {
+		if((node = MALLOC(sizeof(struct smtp_queue_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		node->mail = mail;
+		node->callback = callback;
+		node->next = NULL;
+		if(busy->queue == NULL) {
+			busy->queue = node;
+		} else {
+			for(last = busy->queue; last->next != NULL; last = last->next);
+			last->next = node;
+		}
+		smtp_lock_release();
+		return 0;
+	}
+
+	request = smtp_session(host, login, pass, port, is_ssl);
+	request->mail = mail;
+	request->callback = callback;
+	request->next = smtp_sessions;
+	smtp_sessions = request;
+	smtp_lock_release();
+
+	return smtp_connect(request);
+}
@@ -37,6 +37,7 @@
 #endif
 
 #include "mem.h"
+#include "json.h"
 
 static unsigned short memdbg = 0;
 static int lockinit = 0;
@@ -59,6 +60,29 @@ struct mallocs_t {
 
 static struct mallocs_t *mallocs = NULL;
 
+/*
+ * The allocation profiler samples one in every memprof_rate
+ * allocations of each thread. Samples are counted per call
+ * site in a fixed hash table that is filled without taking
+ * a lock, so it can stay enabled in a running daemon.
+ */
+#define MEMPROF_SITES		512
+#define MEMPROF_TOP			5
+
+typedef struct memprof_site_t {
+	unsigned int state;
+	const char *file;
+	int line;
+	unsigned long allocs;
+	unsigned long bytes;
+} memprof_site_t;
+
+static struct memprof_site_t memprof_sites[MEMPROF_SITES];
+static unsigned int memprof_rate = 0;
+static unsigned long memprof_dropped = 0;
+static unsigned long memprof_total = 0;
+static __thread unsigned int memprof_skip = 0;
+
 void memtrack(void) {
 	memdbg = 1;
 
@@ -294,3 +318,142 @@ void __free(void *a, const char *file, int line) {
 		free(a);
 	}
 }
+
+void memprofile(unsigned int rate) {
+	memprof_rate = rate;
+}
+
+static void memprofile_sample(unsigned long size, const char *file, int line) {
+	struct memprof_site_t *site = NULL;
+	unsigned long hash = ((unsigned long)file ^ ((unsigned long)line * 2654435761UL));
+	unsigned int rate = memprof_rate, i = 0, state = 0;
+
+	if(rate == 0) {
+		return;
+	}
+	if(memprof_skip > 0) {
+		memprof_skip--;
+		return;
+	}
+	memprof_skip = rate-1;
+	__sync_add_and_fetch(&memprof_total, rate);
+
+	for(i=0;i<MEMPROF_SITES;i++) {
+		site = &memprof_sites[(hash+i) % MEMPROF_SITES];
+		if((state = __sync_add_and_fetch(&site->state, 0)) == 0) {
+			if(__sync_bool_compare_and_swap(&site->state, 0, 1)) {
+				site->file = file;
+				site->line = line;
+				__sync_lock_test_and_set(&site->state, 2);
+				break;
+			}
+			state = __sync_add_and_fetch(&site->state, 0);
+		}
+		/* Another thread is claiming this slot */
+		while(state == 1) {
+			state = __sync_add_and_fetch(&site->state, 0);
+		}
+		if(site->file == file && site->line == line) {
+			break;
+		}
+	}
+	if(i == MEMPROF_SITES) {
+		__sync_add_and_fetch(&memprof_dropped, rate);
+		return;
+	}
+	__sync_add_and_fetch(&site->allocs, rate);
+	__sync_add_and_fetch(&site->bytes, size*rate);
+}
+
+void *memprofile_malloc(unsigned long a, const char *file, int line) {
+	if(memprof_rate > 0) {
+		memprofile_sample(a, file, line);
+	}
+	return malloc(a);
+}
+
+void *memprofile_realloc(void *a, unsigned long b, const char *file, int line) {
+	if(memprof_rate > 0) {
+		memprofile_sample(b, file, line);
+	}
+	return realloc(a, b);
+}
+
+void *memprofile_calloc(unsigned long a, unsigned long b, const char *file, int line) {
+	if(memprof_rate > 0) {
+		memprofile_sample(a*b, file, line);
+	}
+	return calloc(a, b);
+}
+
+char *memprofile_strdup(const char *a, const char *file, int line) {
+	if(memprof_rate > 0) {
+		memprofile_sample(strlen(a)+1, file, line);
+	}
+	return strdup(a);
+}
+
+/*
+ * The estimated number of allocations since profiling was
+ * enabled, which is exact with a rate of 1.
+ */
+unsigned long memprofile_allocs(void) {
+	return __sync_add_and_fetch(&memprof_total, 0);
+}
+
+/*
+ * Report the call sites that allocated the most bytes
+ * since the previous report. The counters are reset
+ * while reading them.
+ */
+void memprofile_stats(struct JsonNode *jstats) {
+	struct memprof_site_t sites[MEMPROF_SITES];
+	struct JsonNode *jsites = NULL, *jsite = NULL;
+	unsigned long allocs = 0;
+	char site[255], *p = NULL;
+	int i = 0, x = 0, top = 0;
+
+	if(memprof_rate == 0) {
+		return;
+	}
+
+	for(i=0;i<MEMPROF_SITES;i++) {
+		sites[i].state = __sync_add_and_fetch(&memprof_sites[i].state, 0);
+		sites[i].file = memprof_sites[i].file;
+		sites[i].line = memprof_sites[i].line;
+		sites[i].allocs = __sync_fetch_and_and(&memprof_sites[i].allocs, 0);
+		sites[i].bytes = __sync_fetch_and_and(&memprof_sites[i].bytes, 0);
+		allocs += sites[i].allocs;
+	}
+	allocs += __sync_fetch_and_and(&memprof_dropped, 0);
+
+	json_append_member(jstats, "memory-allocs", json_mknumber((double)allocs, 0));
+
+	jsites = json_mkarray();
+	for(x=0;x<MEMPROF_TOP;x++) {
+		top = -1;
+		for(i=0;i<MEMPROF_SITES;i++) {
+			if(sites[i].state == 2 && sites[i].allocs > 0 &&
+				(top == -1 || sites[i].bytes > sites[top].bytes)) {
+				top = i;
+			}
+		}
+		if(top == -1) {
+			break;
+		}
+		if((p = strrchr(sites[top].file, '/')) == NULL) {
+			p = (char *)sites[top].file;
+		} else {
+			p++;
+		}
+		snprintf(site, sizeof(site), "%s:%d", p, sites[top].line);
+
+		jsite = json_mkobject();
+		json_append_member(jsite, "site", json_mkstring(site));
+		json_append_member(jsite, "allocs", json_mknumber((double)sites[top].allocs, 0));
+		json_append_member(jsite, "bytes", json_mknumber((double)sites[top].bytes, 0));
+		json_append_element(jsites, jsite);
+		sites[top].allocs = 0;
+	}
+	json_append_member(jstats, "memory-sites", jsites);
+}
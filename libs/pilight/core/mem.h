@@ -11,8 +11,18 @@
 
 #define OUT_OF_MEMORY fprintf(stderr, "out of memory in %s #%d\n", __FILE__, __LINE__),exit(EXIT_FAILURE);
 
+struct JsonNode;
+
 int xfree(void);
 void memtrack(void);
+void memprofile(unsigned int);
+void memprofile_stats(struct JsonNode *);
+unsigned long memprofile_allocs(void);
+
+void *memprofile_malloc(unsigned long, const char *, int);
+void *memprofile_realloc(void *, unsigned long, const char *, int);
+void *memprofile_calloc(unsigned long, unsigned long, const char *, int);
+char *memprofile_strdup(const char *, const char *, int);
 
 void *__malloc(unsigned long, const char *, int);
 void *__realloc(void *, unsigned long, const char *, int);
@@ -29,10 +39,10 @@ char *___strdup(char *, const char *, int);
 // #define STRDUP(a) ___strdup(a, __FILE__, __LINE__)
 // #define FREE(a) __free((void *)(a), __FILE__, __LINE__),(a)=NULL
 
-#define MALLOC malloc
-#define REALLOC realloc
-#define CALLOC calloc
-#define STRDUP strdup
+#define MALLOC(a) memprofile_malloc(a, __FILE__, __LINE__)
+#define REALLOC(a, b) memprofile_realloc(a, b, __FILE__, __LINE__)
+#define CALLOC(a, b) memprofile_calloc(a, b, __FILE__, __LINE__)
+#define STRDUP(a) memprofile_strdup(a, __FILE__, __LINE__)
 #define FREE(a) free((void *)(a)),(a)=NULL
 
 #define _MALLOC malloc
@@ -0,0 +1,313 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Runtime metrics in the Prometheus text format. A metric is
+ * looked up once and its handle kept by the caller, updating
+ * it is a single atomic add. Gauges that describe the state
+ * of a queue are filled by the collectors right before the
+ * metrics are printed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <pthread.h>
+
+#include "pilight.h"
+#include "mem.h"
+#include "json.h"
+#include "metrics.h"
+
+#define METRICS_COLLECTORS	16
+
+static const double metrics_bounds[METRICS_BUCKETS] = {
+	0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 1
+};
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metric_t *metrics = NULL;
+static struct metric_t *metrics_tail = NULL;
+static void (*collectors[METRICS_COLLECTORS])(void);
+static int nrcollectors = 0;
+
+static char *metrics_strdup(const char *str) {
+	char *out = NULL;
+
+	if((out = MALLOC(strlen(str)+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	strcpy(out, str);
+	return out;
+}
+
+/*
+ * Returns the metric of that name and label, which is created
+ * the first time. The key and value are optional.
+ */
+struct metric_t *metrics_get(int type, const char *name, const char *help, const char *key, const char *value) {
+	struct metric_t *tmp = NULL;
+	char label[512], *p = label;
+	size_t i = 0;
+
+	label[0] = '\0';
+	if(key != NULL && value != NULL) {
+		p += snprintf(label, sizeof(label)-8, "%s=\"", key);
+		for(i=0;value[i] != '\0' && p < &label[sizeof(label)-4];i++) {
+			if(value[i] == '\\' || value[i] == '"') {
+				*p++ = '\\';
+				*p++ = value[i];
+			} else if(value[i] == '\n') {
+				*p++ = '\\';
+				*p++ = 'n';
+			} else {
+				*p++ = value[i];
+			}
+		}
+		*p++ = '"';
+		*p = '\0';
+	}
+
+	pthread_mutex_lock(&metrics_lock);
+	tmp = metrics;
+	while(tmp) {
+		if(strcmp(tmp->name, name) == 0 && strcmp(tmp->label, label) == 0) {
+			pthread_mutex_unlock(&metrics_lock);
+			return tmp;
+		}
+		tmp = tmp->next;
+	}
+
+	if((tmp = MALLOC(sizeof(struct metric_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(tmp, 0, sizeof(struct metric_t));
+	tmp->type = type;
+	tmp->name = metrics_strdup(name);
+	tmp->label = metrics_strdup(label);
+	tmp->help = metrics_strdup(help);
+
+	/* Keep the order of creation, so a family is printed in one go */
+	if(metrics_tail == NULL) {
+		metrics = tmp;
+	} else {
+		metrics_tail->next = tmp;
+	}
+	metrics_tail = tmp;
+	pthread_mutex_unlock(&metrics_lock);
+
+	return tmp;
+}
+
+void metrics_inc(struct metric_t *metric, uint64_t n) {
+	if(metric != NULL) {
+		__sync_fetch_and_add(&metric->value, n);
+	}
+}
+
+void metrics_set(struct metric_t *metric, double value) {
+	if(metric == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&metrics_lock);
+	if(metric->type == METRIC_COUNTER) {
+		metric->value = (uint64_t)value;
+	} else {
+		metric->gauge = value;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+void metrics_observe(struct metric_t *metric, uint64_t ns) {
+	int i = 0;
+
+	if(metric == NULL) {
+		return;
+	}
+	for(i=0;i<METRICS_BUCKETS;i++) {
+		if((double)ns <= metrics_bounds[i]*1000000000.0) {
+			break;
+		}
+	}
+	__sync_fetch_and_add(&metric->buckets[i], 1);
+	__sync_fetch_and_add(&metric->sum, ns);
+	__sync_fetch_and_add(&metric->value, 1);
+}
+
+/*
+ * Turn all numbers of a stats object into gauges, so the
+ * values pilight already broadcasts are available as well.
+ */
+void metrics_json(struct JsonNode *jstats, const char *prefix) {
+	struct JsonNode *jchild = NULL;
+	char name[256];
+	size_t i = 0;
+
+	jchild = json_first_child(jstats);
+	while(jchild) {
+		if(jchild->tag == JSON_NUMBER && jchild->key != NULL) {
+			snprintf(name, sizeof(name), "%s_%s", prefix, jchild->key);
+			for(i=0;name[i] != '\0';i++) {
+				if(name[i] == '-') {
+					name[i] = '_';
+				}
+			}
+			metrics_set(metrics_get(METRIC_GAUGE, name, jchild->key, NULL, NULL), jchild->number_);
+		}
+		jchild = jchild->next;
+	}
+}
+
+void metrics_collector(void (*collect)(void)) {
+	pthread_mutex_lock(&metrics_lock);
+	if(nrcollectors < METRICS_COLLECTORS) {
+		collectors[nrcollectors++] = collect;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+typedef struct metrics_buf_t {
+	char *data;
+	size_t len;
+	size_t size;
+} metrics_buf_t;
+
+static void metrics_printf(struct metrics_buf_t *buf, const char *fmt, ...) {
+	va_list ap;
+	int n = 0;
+
+	while(1) {
+		va_start(ap, fmt);
+		n = vsnprintf(&buf->data[buf->len], buf->size-buf->len, fmt, ap);
+		va_end(ap);
+		if(n >= 0 && (size_t)n < buf->size-buf->len) {
+			buf->len += (size_t)n;
+			return;
+		}
+		buf->size *= 2;
+		if((buf->data = REALLOC(buf->data, buf->size)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+}
+
+static void metrics_print_metric(struct metrics_buf_t *buf, struct metric_t *metric) {
+	const char *sep = (strlen(metric->label) > 0) ? "," : "";
+	uint64_t count = 0;
+	int i = 0;
+
+	switch(metric->type) {
+		case METRIC_COUNTER:
+			if(strlen(metric->label) > 0) {
+				metrics_printf(buf, "%s{%s} %llu\n", metric->name, metric->label, (unsigned long long)metric->value);
+			} else {
+				metrics_printf(buf, "%s %llu\n", metric->name, (unsigned long long)metric->value);
+			}
+		break;
+		case METRIC_GAUGE:
+			if(strlen(metric->label) > 0) {
+				metrics_printf(buf, "%s{%s} %.17g\n", metric->name, metric->label, metric->gauge);
+			} else {
+				metrics_printf(buf, "%s %.17g\n", metric->name, metric->gauge);
+			}
+		break;
+		case METRIC_HISTOGRAM:
+			for(i=0;i<METRICS_BUCKETS;i++) {
+				count += metric->buckets[i];
+				metrics_printf(buf, "%s_bucket{%s%sle=\"%g\"} %llu\n", metric->name, metric->label, sep, metrics_bounds[i], (unsigned long long)count);
+			}
+			count += metric->buckets[METRICS_BUCKETS];
+			metrics_printf(buf, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", metric->name, metric->label, sep, (unsigned long long)count);
+			if(strlen(metric->label) > 0) {
+				metrics_printf(buf, "%s_sum{%s} %.9f\n", metric->name, metric->label, (double)metric->sum / 1000000000.0);
+				metrics_printf(buf, "%s_count{%s} %llu\n", metric->name, metric->label, (unsigned long long)count);
+			} else {
+				metrics_printf(buf, "%s_sum %.9f\n", metric->name, (double)metric->sum / 1000000000.0);
+				metrics_printf(buf, "%s_count %llu\n", metric->name, (unsigned long long)count);
+			}
+		break;
+	}
+}
+
+/*
+ * Returns all metrics in the Prometheus text format, which
+ * the caller has to free.
+ */
+char *metrics_print(size_t *len) {
+	static const char *types[] = { "counter", "gauge", "histogram" };
+	struct metrics_buf_t buf;
+	struct metric_t *tmp = NULL, *tmp1 = NULL;
+	void (*collect[METRICS_COLLECTORS])(void);
+	int i = 0, n = 0, seen = 0;
+
+	pthread_mutex_lock(&metrics_lock);
+	n = nrcollectors;
+	memcpy(collect, collectors, sizeof(collectors));
+	pthread_mutex_unlock(&metrics_lock);
+
+	for(i=0;i<n;i++) {
+		collect[i]();
+	}
+
+	buf.size = 4096;
+	buf.len = 0;
+	if((buf.data = MALLOC(buf.size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	buf.data[0] = '\0';
+
+	pthread_mutex_lock(&metrics_lock);
+	tmp = metrics;
+	while(tmp) {
+		/* Each family is printed with its first metric */
+		seen = 0;
+		tmp1 = metrics;
+		while(tmp1 != tmp) {
+			if(strcmp(tmp1->name, tmp->name) == 0) {
+				seen = 1;
+				break;
+			}
+			tmp1 = tmp1->next;
+		}
+		if(seen == 0) {
+			metrics_printf(&buf, "# HELP %s %s\n# TYPE %s %s\n", tmp->name, tmp->help, tmp->name, types[tmp->type]);
+			tmp1 = tmp;
+			while(tmp1) {
+				if(strcmp(tmp1->name, tmp->name) == 0) {
+					metrics_print_metric(&buf, tmp1);
+				}
+				tmp1 = tmp1->next;
+			}
+		}
+		tmp = tmp->next;
+	}
+	pthread_mutex_unlock(&metrics_lock);
+
+	if(len != NULL) {
+		*len = buf.len;
+	}
+	return buf.data;
+}
+
+void metrics_gc(void) {
+	struct metric_t *tmp = NULL;
+
+	pthread_mutex_lock(&metrics_lock);
+	while(metrics) {
+		tmp = metrics;
+		metrics = metrics->next;
+		FREE(tmp->name);
+		FREE(tmp->label);
+		FREE(tmp->help);
+		FREE(tmp);
+	}
+	metrics_tail = NULL;
+	nrcollectors = 0;
+	pthread_mutex_unlock(&metrics_lock);
+}
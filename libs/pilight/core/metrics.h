@@ -0,0 +1,49 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _METRICS_H_
+#define _METRICS_H_
+
+#include <stdint.h>
+
+#include "json.h"
+
+#define METRIC_COUNTER		0
+#define METRIC_GAUGE			1
+#define METRIC_HISTOGRAM	2
+
+/* Histogram buckets range from 100us to 1s, plus +Inf */
+#define METRICS_BUCKETS		12
+
+typedef struct metric_t {
+	char *name;
+	/* Label pair without braces, e.g. protocol="arctech_switch" */
+	char *label;
+	char *help;
+	int type;
+
+	/* Counters and the number of observations */
+	volatile uint64_t value;
+	double gauge;
+	/* In nanoseconds */
+	volatile uint64_t sum;
+	volatile uint64_t buckets[METRICS_BUCKETS+1];
+
+	struct metric_t *next;
+} metric_t;
+
+struct metric_t *metrics_get(int type, const char *name, const char *help, const char *key, const char *value);
+void metrics_inc(struct metric_t *metric, uint64_t n);
+void metrics_set(struct metric_t *metric, double value);
+void metrics_observe(struct metric_t *metric, uint64_t ns);
+void metrics_json(struct JsonNode *jstats, const char *prefix);
+void metrics_collector(void (*collect)(void));
+char *metrics_print(size_t *len);
+void metrics_gc(void);
+
+#endif
@@ -375,3 +375,38 @@ int getntpdiff(void) {
 int isntpsynced(void) {
 	return synced;
 }
+
+/*
+ * Intervals are measured on a clock that is never stepped,
+ * so setting the date or an ntp sync can't make a repeat look
+ * like a new code. Both wrap, only take differences of them.
+ */
+unsigned long pilight_monotonic_us(void) {
+#ifdef _WIN32
+	return (unsigned long)(uv_hrtime()/1000);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)((uint64_t)ts.tv_sec*1000000 + (uint64_t)ts.tv_nsec/1000);
+#endif
+}
+
+unsigned long pilight_monotonic_ms(void) {
+#ifdef _WIN32
+	return (unsigned long)(uv_hrtime()/1000000);
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long)((uint64_t)ts.tv_sec*1000 + (uint64_t)ts.tv_nsec/1000000);
+#endif
+}
+
+/*
+ * The time of day with the offset of the last ntp sync
+ * applied.
+ */
+time_t pilight_walltime(void) {
+	return time(NULL) - diff;
+}
@@ -27,4 +27,8 @@ void ntp_gc(void);
 int getntpdiff(void);
 int isntpsynced(void);
 
+unsigned long pilight_monotonic_us(void);
+unsigned long pilight_monotonic_ms(void);
+time_t pilight_walltime(void);
+
 #endif
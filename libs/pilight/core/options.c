@@ -12,6 +12,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "log.h"
 #include "common.h"
@@ -19,6 +20,33 @@
 #include "options.h"
 #include "json.h"
 
+/*
+ * Masks are compiled once when an option is added. Most of them
+ * only allow characters of a single bracket expression, or are a
+ * list of words, those are checked without the regex library.
+ */
+#define MASK_NONE			0
+#define MASK_REGEX		1
+/* ^[set]{min,max}$ */
+#define MASK_SET			2
+/* [set], unanchored */
+#define MASK_CONTAINS	3
+/* ^(word|word)$ */
+#define MASK_WORDS		4
+#define MASK_INVALID	5
+
+typedef struct options_mask_t {
+	int type;
+	unsigned char set[32];
+	unsigned int min;
+	unsigned int max;
+	/* The words separated and terminated by a zero byte */
+	char *words;
+#if !defined(__FreeBSD__) && !defined(_WIN32)
+	regex_t regex;
+#endif
+} options_mask_t;
+
 int options_gc(void) {
 	logprintf(LOG_DEBUG, "garbage collected options library");
 	return EXIT_SUCCESS;
@@ -285,8 +313,8 @@ int options_parse(struct options_t *opt, int argc, char **argv) {
 	int len = 0, x = 0, i = 0, is_long = 0, quote = 0, itmp = 0, tmp = 0;
 
 #if !defined(__FreeBSD__) && !defined(_WIN32)
+	struct options_t *node = NULL;
 	char *mask;
-	regex_t regex;
 	int reti;
 #endif
 
@@ -416,8 +444,9 @@ int options_parse(struct options_t *opt, int argc, char **argv) {
 		if(val != NULL) {
 			/* If the argument has a regex mask, check if it passes */
 			if(options_get_mask(opt, key, is_long, &mask) == 0) {
-				reti = regcomp(&regex, mask, REG_EXTENDED);
-				if(reti) {
+				for(node=opt;node != NULL && node->mask != mask;node=node->next);
+				reti = options_match(node, val);
+				if(reti == -1) {
 					logprintf(LOG_ERR, "could not compile regex");
 					FREE(val);
 					FREE(key);
@@ -425,8 +454,7 @@ int options_parse(struct options_t *opt, int argc, char **argv) {
 					return -1;
 				}
 
-				reti = regexec(&regex, val, 0, NULL, 0);
-				if(reti == REG_NOMATCH || reti != 0) {
+				if(reti != 0) {
 					if(is_long == 1) {
 						logprintf(LOG_ERR, "invalid format -- '--%c'", key);
 					} else {
@@ -437,10 +465,8 @@ int options_parse(struct options_t *opt, int argc, char **argv) {
 					FREE(val);
 					FREE(key);
 					FREE(str);
-					regfree(&regex);
 					return -1;
 				}
-				regfree(&regex);
 			}
 		}
 #endif
@@ -477,6 +503,202 @@ int options_parse(struct options_t *opt, int argc, char **argv) {
 	return 0;
 }
 
+static int mask_set(const char *mask, struct options_mask_t *cmask) {
+	const char *p = mask;
+	unsigned int lo = 0, hi = 0, c = 0, n = 0;
+	int anchored = 0, group = 0;
+
+	if(*p == '^') {
+		anchored = 1;
+		p++;
+		if(*p == '(') {
+			group = 1;
+			p++;
+		}
+	}
+	if(*p++ != '[' || *p == '^' || *p == ']') {
+		return -1;
+	}
+	memset(cmask->set, 0, sizeof(cmask->set));
+	while(*p != ']') {
+		if(*p == '\0' || *p == '[' || *p == '\\') {
+			return -1;
+		}
+		lo = hi = (unsigned char)*p;
+		if(p[1] == '-' && p[2] != ']' && p[2] != '\0') {
+			hi = (unsigned char)p[2];
+			p += 3;
+		} else {
+			p++;
+		}
+		if(hi < lo) {
+			return -1;
+		}
+		for(c=lo;c<=hi;c++) {
+			cmask->set[c/8] |= (unsigned char)(1 << (c%8));
+		}
+	}
+	p++;
+
+	if(anchored == 0) {
+		if(*p != '\0') {
+			return -1;
+		}
+		cmask->type = MASK_CONTAINS;
+		return 0;
+	}
+
+	cmask->min = cmask->max = 1;
+	if(*p == '+' || *p == '*' || *p == '?') {
+		cmask->min = (*p == '+') ? 1 : 0;
+		cmask->max = (*p == '?') ? 1 : UINT_MAX;
+		p++;
+	} else if(*p == '{') {
+		for(n=0,p++;*p >= '0' && *p <= '9' && n < 1000;p++) {
+			n = (n*10)+(unsigned int)(*p-'0');
+		}
+		cmask->min = cmask->max = n;
+		if(*p == ',') {
+			cmask->max = UINT_MAX;
+			if(p[1] >= '0' && p[1] <= '9') {
+				for(n=0,p++;*p >= '0' && *p <= '9' && n < 1000;p++) {
+					n = (n*10)+(unsigned int)(*p-'0');
+				}
+				cmask->max = n;
+			} else {
+				p++;
+			}
+		}
+		if(*p++ != '}' || cmask->max < cmask->min) {
+			return -1;
+		}
+	}
+	if(group == 1 && *p++ != ')') {
+		return -1;
+	}
+	if(p[0] != '$' || p[1] != '\0') {
+		return -1;
+	}
+	cmask->type = MASK_SET;
+	return 0;
+}
+
+static int mask_words(const char *mask, struct options_mask_t *cmask) {
+	size_t len = strlen(mask), i = 0;
+
+	if(len < 5 || strncmp(mask, "^(", 2) != 0 || strcmp(&mask[len-2], ")$") != 0) {
+		return -1;
+	}
+	for(i=2;i<len-2;i++) {
+		if(strchr(".[]()*+?{}^$\\", mask[i]) != NULL) {
+			return -1;
+		}
+		/* An empty word would end the list */
+		if(mask[i] == '|' && (i == 2 || i == len-3 || mask[i+1] == '|')) {
+			return -1;
+		}
+	}
+	if((cmask->words = MALLOC(len-2)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	for(i=2;i<len-2;i++) {
+		cmask->words[i-2] = (mask[i] == '|') ? '\0' : mask[i];
+	}
+	cmask->words[len-4] = '\0';
+	cmask->words[len-3] = '\0';
+	cmask->type = MASK_WORDS;
+	return 0;
+}
+
+static void options_mask_compile(struct options_t *opt) {
+	struct options_mask_t *cmask = NULL;
+
+	opt->cmask = NULL;
+	if(opt->mask == NULL || strlen(opt->mask) == 0) {
+		return;
+	}
+	if((cmask = MALLOC(sizeof(struct options_mask_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(cmask, 0, sizeof(struct options_mask_t));
+
+	if(mask_set(opt->mask, cmask) != 0 && mask_words(opt->mask, cmask) != 0) {
+#if !defined(__FreeBSD__) && !defined(_WIN32)
+		if(regcomp(&cmask->regex, opt->mask, REG_EXTENDED) == 0) {
+			cmask->type = MASK_REGEX;
+		} else {
+			cmask->type = MASK_INVALID;
+		}
+#else
+		cmask->type = MASK_NONE;
+#endif
+	}
+	opt->cmask = cmask;
+}
+
+static void options_mask_free(struct options_t *opt) {
+	if(opt->cmask == NULL) {
+		return;
+	}
+#if !defined(__FreeBSD__) && !defined(_WIN32)
+	if(opt->cmask->type == MASK_REGEX) {
+		regfree(&opt->cmask->regex);
+	}
+#endif
+	if(opt->cmask->words != NULL) {
+		FREE(opt->cmask->words);
+	}
+	FREE(opt->cmask);
+}
+
+/*
+ * Check a value against the mask of an option. Returns 0 when it
+ * matches or when there is no mask, 1 when it doesn't match and
+ * -1 when the mask isn't a valid regex.
+ */
+int options_match(struct options_t *opt, const char *value) {
+	struct options_mask_t *cmask = opt->cmask;
+	const unsigned char *p = (const unsigned char *)value;
+	const char *word = NULL;
+	unsigned int len = 0;
+
+	if(cmask == NULL) {
+		return 0;
+	}
+	switch(cmask->type) {
+		case MASK_SET:
+			for(;*p != '\0';p++,len++) {
+				if((cmask->set[*p/8] & (1 << (*p%8))) == 0) {
+					return 1;
+				}
+			}
+			return (len >= cmask->min && len <= cmask->max) ? 0 : 1;
+		case MASK_CONTAINS:
+			for(;*p != '\0';p++) {
+				if((cmask->set[*p/8] & (1 << (*p%8))) != 0) {
+					return 0;
+				}
+			}
+			return 1;
+		case MASK_WORDS:
+			for(word=cmask->words;*word != '\0';word+=strlen(word)+1) {
+				if(strcmp(word, value) == 0) {
+					return 0;
+				}
+			}
+			return 1;
+#if !defined(__FreeBSD__) && !defined(_WIN32)
+		case MASK_REGEX:
+			return (regexec(&cmask->regex, value, 0, NULL, 0) == 0) ? 0 : 1;
+#endif
+		case MASK_INVALID:
+			return -1;
+		default:
+		break;
+	}
+	return 0;
+}
+
 /* Add a new option to the options struct */
 void options_add(struct options_t **opt, char *id, const char *name, int argtype, int conftype, int vartype, void *def, const char *mask) {
 
@@ -539,6 +761,7 @@ void options_add(struct options_t **opt, char *id, const char *name, int argtype
 		} else {
 			optnode->mask = NULL;
 		}
+		options_mask_compile(optnode);
 		optnode->next = *opt;
 		*opt = optnode;
 		FREE(nname);
@@ -584,6 +807,7 @@ void options_merge(struct options_t **a, struct options_t **b) {
 		} else {
 			optnode->mask = NULL;
 		}
+		options_mask_compile(optnode);
 		optnode->argtype = temp->argtype;
 		optnode->conftype = temp->conftype;
 		optnode->vartype = temp->vartype;
@@ -616,6 +840,7 @@ void options_delete(struct options_t *options) {
 		if(tmp->mask) {
 			FREE(tmp->mask);
 		}
+		options_mask_free(tmp);
 		if(tmp->vartype == JSON_STRING && tmp->string_ != NULL) {
 			FREE(tmp->string_);
 		}
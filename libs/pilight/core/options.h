@@ -22,6 +22,8 @@
 #define NROPTIONTYPES				6
 
 
+struct options_mask_t;
+
 typedef struct options_t {
 	char *id;
 	char *name;
@@ -30,6 +32,8 @@ typedef struct options_t {
 		int number_;
 	};
 	char *mask;
+	/* The mask as compiled by options_add, see options_match */
+	struct options_mask_t *cmask;
 	void *def;
 	int argtype;
 	int conftype;
@@ -53,6 +57,7 @@ int options_get_id_by_name(struct options_t *opt, char *name, char **out);
 // int options_get_vartype(struct options_t *opt, char *id, int is_long, int *out);
 int options_parse1(struct options_t **options, int argc, char **argv, int error_check, char **optarg, char **ret);
 int options_parse(struct options_t *options, int argc, char **argv);
+int options_match(struct options_t *options, const char *value);
 void options_add(struct options_t **options, char *id, const char *name, int argtype, int conftype, int vartype, void *def, const char *mask);
 void options_merge(struct options_t **a, struct options_t **b);
 void options_delete(struct options_t *options);
@@ -99,12 +99,14 @@ struct pilight_t {
 #ifdef PILIGHT_REWRITE
 	int (*send)(JsonNode *, enum origin_t);
 	int (*control)(char *, char *, struct JsonNode *, enum origin_t);
+	int (*bulk)(struct JsonNode *, enum origin_t);
 	void (*receive)(struct JsonNode *, int);
 	int (*socket)(char *, char *, char **);
 #else
 	void (*broadcast)(char *name, JsonNode *message, enum origin_t origin);
 	int (*send)(JsonNode *json, enum origin_t origin);
 	int (*control)(struct devices_t *dev, char *state, JsonNode *values, enum origin_t origin);
+	int (*bulk)(JsonNode *codes, enum origin_t origin);
 	void (*receive)(struct JsonNode *code, int hwtype);
 #endif
 
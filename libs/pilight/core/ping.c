@@ -89,11 +89,16 @@
 #include <errno.h>
 #include <string.h>
 #include <signal.h>
+#include <fcntl.h>
+#include <assert.h>
 
 #include "common.h"
 #include "network.h"
 #include "log.h"
 #include "mem.h"
+#include "json.h"
+#include "ping.h"
+#include "../../libuv/uv.h"
 
 #ifdef _WIN32
 	typedef unsigned char u_int8_t;
@@ -329,3 +334,408 @@ int ping(char *addr) {
 	close(sockfd);
 	return 0;
 }
+
+/*
+ * All ping devices share one raw socket on the event loop.
+ * Every echo carries the same identifier and its own sequence
+ * number, so a reply is matched to its request by sequence and
+ * source. Requests that are not answered in time are expired
+ * by a wheel of PING_WHEEL_TICK ms slots, so a silent host
+ * doesn't keep the others waiting.
+ */
+#define PING_HASH				64
+#define PING_WHEEL_TICK	100
+#define PING_WHEEL_SIZE	64
+#define PING_DATALEN		56
+
+typedef struct ping_target_t {
+	char ip[INET_ADDRSTRLEN+1];
+	struct ping_stats_t stats;
+	struct ping_target_t *next;
+} ping_target_t;
+
+typedef struct ping_request_t {
+	unsigned short seq;
+	struct in_addr addr;
+	/* uv_hrtime of the echo, uv_now of the timeout */
+	uint64_t start;
+	uint64_t deadline;
+	struct ping_target_t *target;
+	void (*callback)(char *, int, double, void *);
+	void *userdata;
+	struct ping_request_t *hnext;
+	struct ping_request_t *wnext;
+} ping_request_t;
+
+static int ping_fd = -1;
+static uv_poll_t *ping_poll_req = NULL;
+static uv_timer_t *ping_timer_req = NULL;
+static struct ping_target_t *ping_targets = NULL;
+static struct ping_request_t *ping_hash[PING_HASH];
+static struct ping_request_t *ping_wheel[PING_WHEEL_SIZE];
+static unsigned short ping_id = 0;
+static unsigned short ping_seq = 0;
+static unsigned int ping_pending = 0;
+static uint64_t ping_tick = 0;
+
+static unsigned short ping_cksum(unsigned short *addr, int len) {
+	unsigned int sum = 0;
+
+	while(len > 1) {
+		sum += *addr++;
+		len -= 2;
+	}
+	if(len == 1) {
+		sum += *(unsigned char *)addr;
+	}
+	sum = (sum >> 16) + (sum & 0xffff);
+	sum += (sum >> 16);
+
+	return (unsigned short)~sum;
+}
+
+static struct ping_target_t *ping_target(char *ip) {
+	struct ping_target_t *target = ping_targets;
+
+	while(target) {
+		if(strcmp(target->ip, ip) == 0) {
+			return target;
+		}
+		target = target->next;
+	}
+
+	if((target = MALLOC(sizeof(struct ping_target_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(target, 0, sizeof(struct ping_target_t));
+	strncpy(target->ip, ip, INET_ADDRSTRLEN);
+	target->next = ping_targets;
+	ping_targets = target;
+
+	return target;
+}
+
+static void ping_unlink(struct ping_request_t *request) {
+	struct ping_request_t **tmp = NULL;
+
+	tmp = &ping_hash[request->seq % PING_HASH];
+	while(*tmp != NULL) {
+		if(*tmp == request) {
+			*tmp = request->hnext;
+			break;
+		}
+		tmp = &(*tmp)->hnext;
+	}
+
+	tmp = &ping_wheel[(request->deadline / PING_WHEEL_TICK) % PING_WHEEL_SIZE];
+	while(*tmp != NULL) {
+		if(*tmp == request) {
+			*tmp = request->wnext;
+			break;
+		}
+		tmp = &(*tmp)->wnext;
+	}
+
+	if(--ping_pending == 0) {
+		uv_timer_stop(ping_timer_req);
+	}
+}
+
+static void ping_done(struct ping_request_t *request, int status, double rtt) {
+	struct ping_stats_t *stats = &request->target->stats;
+
+	ping_unlink(request);
+
+	if(status == 0) {
+		stats->received++;
+		stats->rtt = rtt;
+		stats->avg += (rtt - stats->avg) / (double)stats->received;
+		if(stats->received == 1 || rtt < stats->min) {
+			stats->min = rtt;
+		}
+		if(rtt > stats->max) {
+			stats->max = rtt;
+		}
+	}
+
+	if(request->callback != NULL) {
+		request->callback(request->target->ip, status, rtt, request->userdata);
+	}
+	FREE(request);
+}
+
+static void ping_read(uv_poll_t *req, int status, int events) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct ping_request_t *request = NULL;
+	struct sockaddr_in from;
+	struct icmp *icmp = NULL;
+	unsigned char buf[1500];
+	socklen_t fromlen = sizeof(from);
+	unsigned short seq = 0;
+	int n = 0, hlen = 0;
+
+	if(status < 0 || !(events & UV_READABLE)) {
+		return;
+	}
+
+	while((n = recvfrom(ping_fd, (char *)buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromlen)) > 0) {
+		fromlen = sizeof(from);
+
+		/* Raw sockets get the ip header as well */
+		hlen = (buf[0] & 0x0f) << 2;
+		if(n < hlen+ICMP_MINLEN) {
+			continue;
+		}
+		icmp = (struct icmp *)&buf[hlen];
+		if(icmp->icmp_type != ICMP_ECHOREPLY || ntohs(icmp->icmp_id) != ping_id) {
+			continue;
+		}
+		seq = ntohs(icmp->icmp_seq);
+
+		request = ping_hash[seq % PING_HASH];
+		while(request) {
+			if(request->seq == seq && request->addr.s_addr == from.sin_addr.s_addr) {
+				break;
+			}
+			request = request->hnext;
+		}
+		if(request != NULL) {
+			ping_done(request, 0, (double)(uv_hrtime() - request->start) / 1000000.0);
+		}
+	}
+}
+
+/*
+ * Every slot that lies fully in the past is emptied, a
+ * request is at most one tick late to time out.
+ */
+static void ping_timeout(uv_timer_t *req) {
+	struct ping_request_t *request = NULL, *next = NULL;
+	uint64_t now = uv_now(uv_default_loop()) / PING_WHEEL_TICK;
+	int i = 0;
+
+	for(i=0;ping_tick<now && i<PING_WHEEL_SIZE;ping_tick++, i++) {
+		request = ping_wheel[ping_tick % PING_WHEEL_SIZE];
+		while(request) {
+			next = request->wnext;
+			if(request->deadline / PING_WHEEL_TICK <= ping_tick) {
+				request->target->stats.lost++;
+				ping_done(request, -1, 0);
+			}
+			request = next;
+		}
+	}
+	ping_tick = now;
+}
+
+static int ping_open(void) {
+	int r = 0;
+
+#ifdef _WIN32
+	WSADATA wsa;
+
+	if(WSAStartup(0x202, &wsa) != 0) {
+		logprintf(LOG_ERR, "could not initialize new socket");
+		exit(EXIT_FAILURE);
+	}
+#endif
+
+	if((ping_fd = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0) {
+		logperror(LOG_DEBUG, "socket");
+		return -1;
+	}
+
+#ifdef _WIN32
+	unsigned long on = 1;
+	ioctlsocket(ping_fd, FIONBIO, &on);
+#else
+	long arg = fcntl(ping_fd, F_GETFL, NULL);
+	fcntl(ping_fd, F_SETFL, arg | O_NONBLOCK);
+#endif
+
+	if((ping_poll_req = MALLOC(sizeof(uv_poll_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((r = uv_poll_init_socket(uv_default_loop(), ping_poll_req, ping_fd)) != 0) {
+		/*LCOV_EXCL_START*/
+		logprintf(LOG_ERR, "uv_poll_init_socket: %s", uv_strerror(r));
+		FREE(ping_poll_req);
+		close(ping_fd);
+		ping_fd = -1;
+		return -1;
+		/*LCOV_EXCL_STOP*/
+	}
+	uv_poll_start(ping_poll_req, UV_READABLE, ping_read);
+
+	if((ping_timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	uv_timer_init(uv_default_loop(), ping_timer_req);
+
+	ping_id = (unsigned short)(getpid() & 0xffff);
+
+	return 0;
+}
+
+/*
+ * Sends an echo to addr, the callback gets a status of 0
+ * and the round trip time in milliseconds on a reply, or -1
+ * when there was none within timeout milliseconds. Only to be
+ * used from the event loop.
+ */
+int ping_start(char *addr, int timeout, void (*callback)(char *, int, double, void *), void *userdata) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct ping_request_t *request = NULL;
+	struct ping_target_t *target = NULL;
+	struct sockaddr_in dst;
+	struct icmp *icmp = NULL;
+	char buf[ICMP_MINLEN+PING_DATALEN];
+	unsigned int bucket = 0;
+
+	if(ping_fd == -1 && ping_open() != 0) {
+		return -1;
+	}
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin_family = AF_INET;
+	if(inet_pton(AF_INET, addr, &dst.sin_addr) != 1) {
+		return -1;
+	}
+
+	if(timeout < PING_WHEEL_TICK) {
+		timeout = PING_WHEEL_TICK;
+	}
+	if(timeout > PING_WHEEL_TICK*(PING_WHEEL_SIZE-1)) {
+		timeout = PING_WHEEL_TICK*(PING_WHEEL_SIZE-1);
+	}
+
+	target = ping_target(addr);
+
+	memset(buf, 0, sizeof(buf));
+	icmp = (struct icmp *)buf;
+	icmp->icmp_type = ICMP_ECHO;
+	icmp->icmp_code = 0;
+	icmp->icmp_id = htons(ping_id);
+	icmp->icmp_seq = htons(++ping_seq);
+	icmp->icmp_cksum = ping_cksum((unsigned short *)buf, sizeof(buf));
+
+	if(sendto(ping_fd, buf, sizeof(buf), 0, (struct sockaddr *)&dst, sizeof(dst)) < 0) {
+		logperror(LOG_DEBUG, "sendto");
+		return -1;
+	}
+	target->stats.sent++;
+
+	if((request = MALLOC(sizeof(struct ping_request_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(request, 0, sizeof(struct ping_request_t));
+	request->seq = ping_seq;
+	request->addr = dst.sin_addr;
+	request->target = target;
+	request->callback = callback;
+	request->userdata = userdata;
+	request->start = uv_hrtime();
+	request->deadline = uv_now(uv_default_loop()) + (uint64_t)timeout;
+
+	request->hnext = ping_hash[request->seq % PING_HASH];
+	ping_hash[request->seq % PING_HASH] = request;
+
+	bucket = (unsigned int)((request->deadline / PING_WHEEL_TICK) % PING_WHEEL_SIZE);
+	request->wnext = ping_wheel[bucket];
+	ping_wheel[bucket] = request;
+
+	if(ping_pending++ == 0) {
+		ping_tick = uv_now(uv_default_loop()) / PING_WHEEL_TICK;
+		uv_timer_start(ping_timer_req, ping_timeout, PING_WHEEL_TICK, PING_WHEEL_TICK);
+	}
+
+	return 0;
+}
+
+int ping_get_stats(char *addr, struct ping_stats_t *stats) {
+	struct ping_target_t *target = ping_targets;
+
+	while(target) {
+		if(strcmp(target->ip, addr) == 0) {
+			memcpy(stats, &target->stats, sizeof(struct ping_stats_t));
+			return 0;
+		}
+		target = target->next;
+	}
+	return -1;
+}
+
+void ping_stats(struct JsonNode *jstats) {
+	struct ping_target_t *target = ping_targets;
+	char name[INET_ADDRSTRLEN+16];
+
+	while(target) {
+		/* Average round trip in milliseconds */
+		snprintf(name, sizeof(name), "ping-%s-rtt", target->ip);
+		json_append_member(jstats, name, json_mknumber(target->stats.avg, 3));
+		/* Percentage of the echoes without a reply */
+		snprintf(name, sizeof(name), "ping-%s-loss", target->ip);
+		json_append_member(jstats, name, json_mknumber((target->stats.sent > 0) ?
+			((double)target->stats.lost*100.0)/(double)target->stats.sent : 0, 1));
+		target = target->next;
+	}
+}
+
+static void ping_close_cb(uv_handle_t *handle) {
+	FREE(handle);
+}
+
+/*
+ * Outstanding requests are dropped without calling back,
+ * their owners are being freed as well.
+ */
+void ping_gc(void) {
+	struct ping_request_t *request = NULL;
+	struct ping_target_t *target = NULL;
+	int i = 0;
+
+	for(i=0;i<PING_HASH;i++) {
+		while(ping_hash[i]) {
+			request = ping_hash[i];
+			ping_hash[i] = request->hnext;
+			FREE(request);
+		}
+	}
+	memset(ping_wheel, 0, sizeof(ping_wheel));
+	ping_pending = 0;
+
+	while(ping_targets) {
+		target = ping_targets;
+		ping_targets = ping_targets->next;
+		FREE(target);
+	}
+
+	if(ping_timer_req != NULL) {
+		uv_timer_stop(ping_timer_req);
+		uv_close((uv_handle_t *)ping_timer_req, ping_close_cb);
+		ping_timer_req = NULL;
+	}
+	if(ping_poll_req != NULL) {
+		uv_poll_stop(ping_poll_req);
+		uv_close((uv_handle_t *)ping_poll_req, ping_close_cb);
+		ping_poll_req = NULL;
+	}
+	if(ping_fd > -1) {
+#ifdef _WIN32
+		closesocket(ping_fd);
+#else
+		close(ping_fd);
+#endif
+		ping_fd = -1;
+	}
+}
@@ -63,6 +63,24 @@
 #ifndef _LIBPROC_H_
 #define _LIBPROC_H_
 
+struct JsonNode;
+
+typedef struct ping_stats_t {
+	unsigned long sent;
+	unsigned long received;
+	unsigned long lost;
+	/* Round trip times in milliseconds */
+	double rtt;
+	double avg;
+	double min;
+	double max;
+} ping_stats_t;
+
 int ping(char *addr);
 
+int ping_start(char *addr, int timeout, void (*callback)(char *, int, double, void *), void *userdata);
+int ping_get_stats(char *addr, struct ping_stats_t *stats);
+void ping_stats(struct JsonNode *jstats);
+void ping_gc(void);
+
 #endif
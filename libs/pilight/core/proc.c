@@ -37,6 +37,7 @@
 #include <dirent.h>
 
 #include "proc.h"
+#include "json.h"
 #include "log.h"
 #include "mem.h"
 
@@ -46,6 +47,34 @@
 #endif
 static unsigned short initialized = 0;
 
+#ifdef __linux__
+/*
+ * The cpu time of every thread comes from a single walk of
+ * /proc/self/task. Threads are summed by their name, so all
+ * threads of the worker pool show up as one.
+ */
+#define PROC_THREADS	64
+
+typedef struct proc_task_t {
+	pid_t tid;
+	unsigned long long ticks;
+	int seen;
+} proc_task_t;
+
+static struct {
+	struct proc_task_t tasks[PROC_THREADS];
+	int nrtasks;
+	struct {
+		char name[16];
+		double cpu;
+	} threads[PROC_THREADS];
+	int nrthreads;
+	double stamp;
+} proc_sample;
+
+static pthread_mutex_t proc_sample_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 /* Mounting proc subsystem */
 #ifdef __FreeBSD__
 	static unsigned short mountproc = 1;
@@ -84,7 +113,7 @@ double getCPUUsage(void) {
 	}
 	return 0.0;
 #else
-	clock_gettime(CLOCK_REALTIME, &cpu_usage.ts);
+	clock_gettime(CLOCK_MONOTONIC, &cpu_usage.ts);
 	cpu_usage.sec_stop = cpu_usage.ts.tv_sec + cpu_usage.ts.tv_nsec / 1e9;
 
 	cpu_usage.sec_diff = cpu_usage.sec_stop - cpu_usage.sec_start;
@@ -94,7 +123,7 @@ double getCPUUsage(void) {
 	double a = ((cpu_usage.cpu_new-cpu_usage.cpu_old) / cpu_usage.sec_diff * 100.0);
 	cpu_usage.cpu_old = cpu_usage.cpu_new;
 
-	clock_gettime(CLOCK_REALTIME, &cpu_usage.ts);
+	clock_gettime(CLOCK_MONOTONIC, &cpu_usage.ts);
 	cpu_usage.sec_start = cpu_usage.ts.tv_sec + cpu_usage.ts.tv_nsec / 1e9;
 
 	return a;
@@ -124,7 +153,7 @@ void getThreadCPUUsage(pthread_t pth, struct cpu_usage_t *cpu_usage) {
 	clockid_t cid;
 	memset(&cid, '\0', sizeof(cid));
 
-	clock_gettime(CLOCK_REALTIME, &cpu_usage->ts);
+	clock_gettime(CLOCK_MONOTONIC, &cpu_usage->ts);
 	cpu_usage->sec_stop = cpu_usage->ts.tv_sec + cpu_usage->ts.tv_nsec / 1e9;
 
 	cpu_usage->sec_diff = cpu_usage->sec_stop - cpu_usage->sec_start;
@@ -139,7 +168,7 @@ void getThreadCPUUsage(pthread_t pth, struct cpu_usage_t *cpu_usage) {
 	}
 	cpu_usage->cpu_old = cpu_usage->cpu_new;
 
-	clock_gettime(CLOCK_REALTIME, &cpu_usage->ts);
+	clock_gettime(CLOCK_MONOTONIC, &cpu_usage->ts);
 	cpu_usage->sec_start = cpu_usage->ts.tv_sec + cpu_usage->ts.tv_nsec / 1e9;
 #endif
 }
@@ -239,3 +268,134 @@ double getRAMUsage(void) {
 	return 0.0;
 #endif
 }
+
+#ifdef __linux__
+static void proc_thread_add(const char *name, double cpu) {
+	int i = 0;
+
+	for(i=0;i<proc_sample.nrthreads;i++) {
+		if(strcmp(proc_sample.threads[i].name, name) == 0) {
+			proc_sample.threads[i].cpu += cpu;
+			return;
+		}
+	}
+	if(proc_sample.nrthreads < PROC_THREADS) {
+		strncpy(proc_sample.threads[i].name, name, sizeof(proc_sample.threads[i].name)-1);
+		proc_sample.threads[i].name[sizeof(proc_sample.threads[i].name)-1] = '\0';
+		proc_sample.threads[i].cpu = cpu;
+		proc_sample.nrthreads++;
+	}
+}
+#endif
+
+/*
+ * Works out the cpu usage of each named thread since the last
+ * sample, in percentages of a single cpu.
+ */
+void proc_threads_sample(void) {
+#ifdef __linux__
+	struct dirent *ent = NULL;
+	struct timespec ts;
+	DIR *dir = NULL;
+	char fname[64], buf[512], name[16], *p = NULL, *e = NULL;
+	unsigned long long utime = 0, stime = 0, ticks = 0;
+	double now = 0, elapsed = 0, hz = (double)sysconf(_SC_CLK_TCK);
+	int fd = -1, n = 0, i = 0, x = 0;
+	pid_t tid = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+
+	if((dir = opendir("/proc/self/task")) == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&proc_sample_lock);
+	elapsed = now - proc_sample.stamp;
+	proc_sample.nrthreads = 0;
+	for(i=0;i<proc_sample.nrtasks;i++) {
+		proc_sample.tasks[i].seen = 0;
+	}
+
+	while((ent = readdir(dir)) != NULL) {
+		if(ent->d_name[0] < '0' || ent->d_name[0] > '9') {
+			continue;
+		}
+		tid = (pid_t)atol(ent->d_name);
+		snprintf(fname, sizeof(fname), "/proc/self/task/%d/stat", (int)tid);
+		if((fd = open(fname, O_RDONLY)) < 0) {
+			continue;
+		}
+		n = (int)read(fd, buf, sizeof(buf)-1);
+		close(fd);
+		if(n <= 0) {
+			continue;
+		}
+		buf[n] = '\0';
+
+		/* The name is between the first ( and the last ) */
+		if((p = strchr(buf, '(')) == NULL || (e = strrchr(buf, ')')) == NULL || e < p) {
+			continue;
+		}
+		n = (int)(e-p-1);
+		if(n > (int)sizeof(name)-1) {
+			n = (int)sizeof(name)-1;
+		}
+		memcpy(name, p+1, (size_t)n);
+		name[n] = '\0';
+
+		/* utime and stime are the 12th and 13th field after it */
+		if(sscanf(e+2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) {
+			continue;
+		}
+		ticks = utime+stime;
+
+		for(i=0;i<proc_sample.nrtasks;i++) {
+			if(proc_sample.tasks[i].tid == tid) {
+				break;
+			}
+		}
+		if(i == proc_sample.nrtasks) {
+			if(proc_sample.nrtasks == PROC_THREADS) {
+				continue;
+			}
+			proc_sample.tasks[i].tid = tid;
+			proc_sample.tasks[i].ticks = ticks;
+			proc_sample.nrtasks++;
+		}
+		proc_sample.tasks[i].seen = 1;
+
+		if(proc_sample.stamp > 0 && elapsed > 0) {
+			proc_thread_add(name, ((double)(ticks-proc_sample.tasks[i].ticks)/hz)/elapsed*100.0);
+		} else {
+			proc_thread_add(name, 0);
+		}
+		proc_sample.tasks[i].ticks = ticks;
+	}
+	closedir(dir);
+
+	/* Forget the threads that are gone */
+	for(i=0,x=0;i<proc_sample.nrtasks;i++) {
+		if(proc_sample.tasks[i].seen == 1) {
+			proc_sample.tasks[x++] = proc_sample.tasks[i];
+		}
+	}
+	proc_sample.nrtasks = x;
+	proc_sample.stamp = now;
+	pthread_mutex_unlock(&proc_sample_lock);
+#endif
+}
+
+void proc_threads_stats(struct JsonNode *jstats) {
+#ifdef __linux__
+	char key[64];
+	int i = 0;
+
+	pthread_mutex_lock(&proc_sample_lock);
+	for(i=0;i<proc_sample.nrthreads;i++) {
+		snprintf(key, sizeof(key), "cpu-thread-%s", proc_sample.threads[i].name);
+		json_append_member(jstats, key, json_mknumber(proc_sample.threads[i].cpu, 2));
+	}
+	pthread_mutex_unlock(&proc_sample_lock);
+#endif
+}
@@ -37,4 +37,9 @@ double getCPUUsage(void);
 double getRAMUsage(void);
 void getThreadCPUUsage(pthread_t pth, struct cpu_usage_t *cpu_usage);
 
+struct JsonNode;
+
+void proc_threads_sample(void);
+void proc_threads_stats(struct JsonNode *jstats);
+
 #endif
@@ -0,0 +1,323 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Sampling cpu profiler. An interval timer on the cpu time of
+ * the process raises SIGPROF in the thread that is running,
+ * which stores its stack and name in a ring of samples without
+ * taking a lock. Reading the profile drains the ring and folds
+ * equal stacks together in the format of the flame graph tools.
+ * Worker pool threads add the name of the task they are running
+ * as the first frame.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+	#include <signal.h>
+	#include <sys/time.h>
+	#include <execinfo.h>
+#endif
+#ifdef __linux__
+	#include <sys/prctl.h>
+#endif
+
+#include "pilight.h"
+#include "mem.h"
+#include "log.h"
+#include "profile.h"
+
+#define PROFILE_SAMPLES	2048
+#define PROFILE_DEPTH		32
+/* The frames of the signal handler and the kernel trampoline */
+#define PROFILE_SKIP		2
+
+typedef struct profile_sample_t {
+	/* 0 free, 1 being written, 2 written, 3 being read */
+	unsigned int state;
+	int depth;
+	char thread[16];
+	char task[32];
+	void *frames[PROFILE_DEPTH];
+} profile_sample_t;
+
+typedef struct profile_stack_t {
+	char *stack;
+	unsigned long count;
+	struct profile_stack_t *next;
+} profile_stack_t;
+
+static struct profile_sample_t *profile_samples = NULL;
+static unsigned int profile_head = 0;
+static unsigned int profile_hz = 0;
+static unsigned long profile_dropped = 0;
+static int profile_installed = 0;
+static __thread const char *profile_current = NULL;
+
+#ifndef _WIN32
+static void profile_signal(int sig, siginfo_t *info, void *context) {
+	struct profile_sample_t *samples = profile_samples, *sample = NULL;
+	int err = errno;
+
+	if(samples == NULL) {
+		return;
+	}
+
+	sample = &samples[__sync_fetch_and_add(&profile_head, 1) % PROFILE_SAMPLES];
+	/* The ring is full until the profile is read */
+	if(!__sync_bool_compare_and_swap(&sample->state, 0, 1)) {
+		__sync_add_and_fetch(&profile_dropped, 1);
+		errno = err;
+		return;
+	}
+
+	sample->depth = backtrace(sample->frames, PROFILE_DEPTH);
+#ifdef __linux__
+	prctl(PR_GET_NAME, sample->thread, 0, 0, 0);
+	sample->thread[sizeof(sample->thread)-1] = '\0';
+#else
+	strcpy(sample->thread, "thread");
+#endif
+	if(profile_current != NULL) {
+		strncpy(sample->task, profile_current, sizeof(sample->task)-1);
+		sample->task[sizeof(sample->task)-1] = '\0';
+	} else {
+		sample->task[0] = '\0';
+	}
+
+	__sync_lock_test_and_set(&sample->state, 2);
+	errno = err;
+}
+#endif
+
+/*
+ * Start sampling this many times per second of cpu time,
+ * or stop sampling with a rate of 0. The samples that were
+ * not read yet are kept.
+ */
+void profile_start(unsigned int rate) {
+#ifndef _WIN32
+	struct itimerval timer;
+	struct sigaction act;
+	void *frames[2];
+
+	if(rate > PROFILE_MAX_RATE) {
+		rate = PROFILE_MAX_RATE;
+	}
+
+	if(rate > 0 && profile_samples == NULL) {
+		if((profile_samples = MALLOC(sizeof(struct profile_sample_t)*PROFILE_SAMPLES)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(profile_samples, 0, sizeof(struct profile_sample_t)*PROFILE_SAMPLES);
+	}
+
+	if(rate > 0 && profile_installed == 0) {
+		/*
+		 * The first backtrace loads the unwinder, which
+		 * allocates and can't be done from the handler.
+		 */
+		backtrace(frames, 2);
+
+		memset(&act, 0, sizeof(act));
+		act.sa_sigaction = profile_signal;
+		act.sa_flags = SA_SIGINFO | SA_RESTART;
+		sigemptyset(&act.sa_mask);
+		sigaction(SIGPROF, &act, NULL);
+		profile_installed = 1;
+	}
+
+	memset(&timer, 0, sizeof(timer));
+	if(rate > 0) {
+		timer.it_interval.tv_sec = 0;
+		timer.it_interval.tv_usec = 1000000/rate;
+		timer.it_value = timer.it_interval;
+	}
+	if(rate > 0 || profile_installed == 1) {
+		setitimer(ITIMER_PROF, &timer, NULL);
+	}
+
+	if(profile_hz != rate) {
+		if(rate > 0) {
+			logprintf(LOG_INFO, "cpu profiler sampling at %u Hz", rate);
+		} else {
+			logprintf(LOG_INFO, "cpu profiler stopped");
+		}
+	}
+	__sync_lock_test_and_set(&profile_hz, rate);
+#endif
+}
+
+unsigned int profile_rate(void) {
+	return __sync_add_and_fetch(&profile_hz, 0);
+}
+
+/*
+ * Tell the samples of this thread which task it is running,
+ * NULL when it's idle again. The name has to stay valid until
+ * it's replaced.
+ */
+void profile_task(const char *name) {
+	profile_current = name;
+}
+
+#ifndef _WIN32
+/*
+ * The function name of a frame, or the binary and offset
+ * when it has no exported symbol so it can still be looked
+ * up with addr2line.
+ */
+static void profile_frame(char *symbol, char *out, size_t size) {
+	char *binary = NULL, *start = NULL, *end = NULL;
+	size_t len = 0;
+
+	if((start = strchr(symbol, '(')) != NULL && (end = strchr(start, ')')) != NULL) {
+		start++;
+		len = strcspn(start, "+)");
+		if(len > 0) {
+			snprintf(out, size, "%.*s", (int)len, start);
+			return;
+		}
+		if((binary = strrchr(symbol, '/')) == NULL || binary > start) {
+			binary = symbol;
+		} else {
+			binary++;
+		}
+		snprintf(out, size, "%.*s%.*s", (int)(start-1-binary), binary, (int)(end-(start+len)), &start[len]);
+		return;
+	}
+	snprintf(out, size, "%s", symbol);
+}
+
+static void profile_fold(struct profile_stack_t **stacks, struct profile_sample_t *sample) {
+	struct profile_stack_t *tmp = *stacks;
+	char **symbols = NULL, frame[128], *stack = NULL;
+	size_t len = 0, n = 0;
+	int i = 0;
+
+	len = strlen(sample->thread)+strlen(sample->task)+2;
+	if((stack = MALLOC(len+sample->depth*sizeof(frame))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	n = sprintf(stack, "%s", sample->thread);
+	if(sample->task[0] != '\0') {
+		n += sprintf(&stack[n], ";%s", sample->task);
+	}
+
+	if(sample->depth > PROFILE_SKIP) {
+		symbols = backtrace_symbols(sample->frames, sample->depth);
+	}
+	if(symbols != NULL) {
+		/* Folded stacks start at the root */
+		for(i=sample->depth-1;i>=PROFILE_SKIP;i--) {
+			profile_frame(symbols[i], frame, sizeof(frame));
+			n += sprintf(&stack[n], ";%s", frame);
+		}
+		_FREE(symbols);
+	}
+
+	while(tmp) {
+		if(strcmp(tmp->stack, stack) == 0) {
+			tmp->count++;
+			FREE(stack);
+			return;
+		}
+		tmp = tmp->next;
+	}
+
+	if((tmp = MALLOC(sizeof(struct profile_stack_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	tmp->stack = stack;
+	tmp->count = 1;
+	tmp->next = *stacks;
+	*stacks = tmp;
+}
+#endif
+
+/*
+ * The folded stacks sampled since the previous call, one
+ * per line followed by the number of samples. Samples that
+ * didn't fit the ring are counted in a stack of their own.
+ */
+char *profile_print(size_t *len) {
+	struct profile_stack_t *stacks = NULL, *tmp = NULL;
+	char *out = NULL, line[32];
+	unsigned long dropped = 0;
+	size_t n = 0, x = 0;
+	int i = 0;
+
+	*len = 0;
+
+#ifndef _WIN32
+	if(profile_samples != NULL) {
+		for(i=0;i<PROFILE_SAMPLES;i++) {
+			if(__sync_bool_compare_and_swap(&profile_samples[i].state, 2, 3)) {
+				profile_fold(&stacks, &profile_samples[i]);
+				__sync_lock_test_and_set(&profile_samples[i].state, 0);
+			}
+		}
+	}
+#endif
+	dropped = __sync_fetch_and_and(&profile_dropped, 0);
+
+	while(stacks) {
+		tmp = stacks;
+		x = strlen(tmp->stack);
+		n = snprintf(line, sizeof(line), " %lu\n", tmp->count);
+		if((out = REALLOC(out, *len+x+n+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(&out[*len], tmp->stack, x);
+		memcpy(&out[*len+x], line, n+1);
+		*len += x+n;
+
+		stacks = stacks->next;
+		FREE(tmp->stack);
+		FREE(tmp);
+	}
+	if(dropped > 0) {
+		n = snprintf(line, sizeof(line), "[dropped] %lu\n", dropped);
+		if((out = REALLOC(out, *len+n+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(&out[*len], line, n+1);
+		*len += n;
+	}
+	if(out == NULL) {
+		if((out = STRDUP("")) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+
+	return out;
+}
+
+void profile_gc(void) {
+#ifndef _WIN32
+	struct sigaction act;
+
+	if(profile_installed == 1) {
+		profile_start(0);
+
+		memset(&act, 0, sizeof(act));
+		act.sa_handler = SIG_IGN;
+		sigemptyset(&act.sa_mask);
+		sigaction(SIGPROF, &act, NULL);
+		profile_installed = 0;
+	}
+#endif
+	if(profile_samples != NULL) {
+		FREE(profile_samples);
+	}
+	profile_head = 0;
+	profile_dropped = 0;
+}
@@ -0,0 +1,23 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stddef.h>
+
+/* The highest sampling rate in Hz */
+#define PROFILE_MAX_RATE	1000
+
+void profile_start(unsigned int rate);
+unsigned int profile_rate(void);
+void profile_task(const char *name);
+char *profile_print(size_t *len);
+void profile_gc(void);
+
+#endif
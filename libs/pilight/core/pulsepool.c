@@ -0,0 +1,159 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Pulse trains are mostly 50 to 150 pulses, but the records
+ * they travel in were sized for MAXPULSESTREAMLENGTH. Their
+ * pulses are now kept in buffers of a few size classes, so a
+ * train only takes and copies the room it needs. The buffers
+ * live in a static arena and are taken with a single compare
+ * and swap on the bitmap of their class, like the pulse train
+ * slabs, so a receiver at realtime priority doesn't take a lock
+ * or allocate. When a class is used up the buffer is allocated
+ * instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+	#include <windows.h>
+#endif
+
+#include "mem.h"
+#include "pulsepool.h"
+
+#define PULSEPOOL_CLASSES	5
+/* An unsigned long holds at least 32 bits everywhere */
+#define PULSEPOOL_BITS		32
+#define PULSEPOOL_WORDS		(PULSEPOOL_SIZE/PULSEPOOL_BITS)
+
+/* In front of every buffer, the class is -1 when it was allocated */
+typedef struct pulsepool_header_t {
+	int cls;
+	int slot;
+} pulsepool_header_t;
+
+#define PULSEPOOL_ALIGN(a)	(((a)+sizeof(struct pulsepool_header_t)+7) & ~(size_t)7)
+#define PULSEPOOL_LAST		((MAXPULSESTREAMLENGTH+1)*sizeof(int))
+#define PULSEPOOL_ARENA		(PULSEPOOL_SIZE*(PULSEPOOL_ALIGN(128)+PULSEPOOL_ALIGN(256)+ \
+	PULSEPOOL_ALIGN(512)+PULSEPOOL_ALIGN(1024)+PULSEPOOL_ALIGN(PULSEPOOL_LAST)))
+
+static const size_t sizes[PULSEPOOL_CLASSES] = { 128, 256, 512, 1024, PULSEPOOL_LAST };
+
+static unsigned char arena[PULSEPOOL_ARENA];
+static volatile unsigned long used[PULSEPOOL_CLASSES][PULSEPOOL_WORDS];
+
+static unsigned char *pulsepool_buffer(int cls, int slot) {
+	size_t offset = 0;
+	int i = 0;
+
+	for(i=0;i<cls;i++) {
+		offset += PULSEPOOL_SIZE*PULSEPOOL_ALIGN(sizes[i]);
+	}
+	return &arena[offset+(size_t)slot*PULSEPOOL_ALIGN(sizes[cls])];
+}
+
+void *pulsepool_alloc(size_t size) {
+	struct pulsepool_header_t *header = NULL;
+	unsigned long word = 0, bit = 0;
+	int cls = 0, i = 0, x = 0;
+
+	for(cls=0;cls<PULSEPOOL_CLASSES && sizes[cls] < size;cls++);
+
+	if(cls < PULSEPOOL_CLASSES) {
+		for(x=0;x<PULSEPOOL_WORDS;x++) {
+			for(i=0;i<PULSEPOOL_BITS;i++) {
+				bit = 1UL << i;
+				word = used[cls][x];
+				if((word & bit) == 0) {
+#ifdef _WIN32
+					if((unsigned long)InterlockedCompareExchange((volatile LONG *)&used[cls][x], (LONG)(word | bit), (LONG)word) == word) {
+#else
+					if(__sync_bool_compare_and_swap(&used[cls][x], word, word | bit)) {
+#endif
+						header = (struct pulsepool_header_t *)pulsepool_buffer(cls, x*PULSEPOOL_BITS+i);
+						header->cls = cls;
+						header->slot = x*PULSEPOOL_BITS+i;
+						return (unsigned char *)header+sizeof(struct pulsepool_header_t);
+					}
+				}
+			}
+		}
+	}
+
+	if((header = MALLOC(sizeof(struct pulsepool_header_t)+size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	header->cls = -1;
+	header->slot = 0;
+	return (unsigned char *)header+sizeof(struct pulsepool_header_t);
+}
+
+void pulsepool_free(void *buf) {
+	struct pulsepool_header_t *header = NULL;
+
+	if(buf == NULL) {
+		return;
+	}
+	header = (struct pulsepool_header_t *)((unsigned char *)buf-sizeof(struct pulsepool_header_t));
+	if(header->cls == -1) {
+		FREE(header);
+	} else {
+#ifdef _WIN32
+		InterlockedAnd((volatile LONG *)&used[header->cls][header->slot/PULSEPOOL_BITS], (LONG)~(1UL << (header->slot % PULSEPOOL_BITS)));
+#else
+		__sync_fetch_and_and(&used[header->cls][header->slot/PULSEPOOL_BITS], ~(1UL << (header->slot % PULSEPOOL_BITS)));
+#endif
+	}
+}
+
+void pulsepool_store(struct pulsetrain_t *train, const int *pulses, int length) {
+	uint16_t *narrow = NULL;
+	int i = 0;
+
+	train->wide = 0;
+	for(i=0;i<length;i++) {
+		if(pulses[i] < 0 || pulses[i] > UINT16_MAX) {
+			train->wide = 1;
+			break;
+		}
+	}
+
+	if(train->wide == 1) {
+		train->pulses = pulsepool_alloc(sizeof(int)*(size_t)length);
+		memcpy(train->pulses, pulses, sizeof(int)*(size_t)length);
+	} else {
+		narrow = train->pulses = pulsepool_alloc(sizeof(uint16_t)*(size_t)length);
+		for(i=0;i<length;i++) {
+			narrow[i] = (uint16_t)pulses[i];
+		}
+	}
+	train->length = length;
+}
+
+/* Pulses has to fit MAXPULSESTREAMLENGTH pulses */
+int pulsepool_load(struct pulsetrain_t *train, int *pulses) {
+	uint16_t *narrow = train->pulses;
+	int i = 0;
+
+	if(train->wide == 1) {
+		memcpy(pulses, train->pulses, sizeof(int)*(size_t)train->length);
+	} else {
+		for(i=0;i<train->length;i++) {
+			pulses[i] = narrow[i];
+		}
+	}
+	return train->length;
+}
+
+void pulsepool_release(struct pulsetrain_t *train) {
+	pulsepool_free(train->pulses);
+	train->pulses = NULL;
+	train->length = 0;
+}
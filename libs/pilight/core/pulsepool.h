@@ -0,0 +1,37 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _PULSEPOOL_H_
+#define _PULSEPOOL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "defines.h"
+
+/* Buffers of every size class */
+#define PULSEPOOL_SIZE		64
+
+/*
+ * A pulse train in the smallest storage it fits. The pulses
+ * are kept in 16 bits when none of them is longer, which
+ * are nearly all trains, and as ints otherwise.
+ */
+typedef struct pulsetrain_t {
+	int length;
+	int wide;
+	void *pulses;
+} pulsetrain_t;
+
+void *pulsepool_alloc(size_t size);
+void pulsepool_free(void *buf);
+void pulsepool_store(struct pulsetrain_t *train, const int *pulses, int length);
+int pulsepool_load(struct pulsetrain_t *train, int *pulses);
+void pulsepool_release(struct pulsetrain_t *train);
+
+#endif
@@ -0,0 +1,207 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * A ring of the last received pulse trains in shared memory.
+ * The daemon writes every train it receives into it, without
+ * ever waiting for a reader. Tools like pilight-raw and
+ * pilight-debug map it read-only, so they can follow the live
+ * traffic next to a running daemon. Every slot carries the
+ * number of the train it holds, odd while it is written, so a
+ * reader can tell a train that was overwritten while it was
+ * being read and just skips it.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+	#include <unistd.h>
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+#endif
+
+#include "pilight.h"
+#include "log.h"
+#include "rawtap.h"
+
+#define RAWTAP_MAGIC	0x70726177
+
+typedef struct rawtap_slot_t {
+	volatile unsigned int seq;
+	int length;
+	char hardware[RAWTAP_HWLEN];
+	int pulses[MAXPULSESTREAMLENGTH+1];
+} rawtap_slot_t;
+
+typedef struct rawtap_t {
+	unsigned int magic;
+	unsigned int size;
+	volatile unsigned int head;
+	struct rawtap_slot_t slots[RAWTAP_SLOTS];
+} rawtap_t;
+
+static struct rawtap_t *rawtap = NULL;
+static int rawtap_owner = 0;
+
+#ifndef _WIN32
+static struct rawtap_t *rawtap_map(int flags, int prot) {
+	struct rawtap_t *map = NULL;
+	struct stat st;
+	int fd = -1;
+
+	if((fd = shm_open(RAWTAP_NAME, flags, 0644)) < 0) {
+		return NULL;
+	}
+	if((flags & O_CREAT) != 0 && ftruncate(fd, sizeof(struct rawtap_t)) != 0) {
+		close(fd);
+		return NULL;
+	}
+	if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct rawtap_t)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, sizeof(struct rawtap_t), prot, MAP_SHARED, fd, 0);
+	close(fd);
+
+	return (map == MAP_FAILED) ? NULL : map;
+}
+#endif
+
+int rawtap_init(void) {
+#ifdef _WIN32
+	return -1;
+#else
+	if(rawtap != NULL) {
+		return 0;
+	}
+	if((rawtap = rawtap_map(O_CREAT | O_RDWR, PROT_READ | PROT_WRITE)) == NULL) {
+		logprintf(LOG_ERR, "unable to create the raw pulse tap %s", RAWTAP_NAME);
+		return -1;
+	}
+	memset(rawtap, 0, sizeof(struct rawtap_t));
+	rawtap->size = sizeof(struct rawtap_t);
+	__sync_synchronize();
+	rawtap->magic = RAWTAP_MAGIC;
+	rawtap_owner = 1;
+
+	return 0;
+#endif
+}
+
+/*
+ * Several receive threads can publish at once, each claims
+ * its own slot by taking the next number.
+ */
+void rawtap_publish(const char *hardware, const int *pulses, int length) {
+	struct rawtap_slot_t *slot = NULL;
+	unsigned int pos = 0;
+
+	if(rawtap == NULL || rawtap_owner == 0 || length <= 0) {
+		return;
+	}
+	if(length > MAXPULSESTREAMLENGTH) {
+		length = MAXPULSESTREAMLENGTH;
+	}
+
+	pos = __sync_fetch_and_add(&rawtap->head, 1);
+	slot = &rawtap->slots[pos % RAWTAP_SLOTS];
+
+	slot->seq = (pos*2)+1;
+	__sync_synchronize();
+	slot->length = length;
+	strncpy(slot->hardware, (hardware != NULL) ? hardware : "", RAWTAP_HWLEN-1);
+	slot->hardware[RAWTAP_HWLEN-1] = '\0';
+	memcpy(slot->pulses, pulses, sizeof(int)*(size_t)length);
+	__sync_synchronize();
+	slot->seq = (pos*2)+2;
+}
+
+/*
+ * Map the ring of a running daemon, the reader starts with
+ * the trains that come in from now on.
+ */
+int rawtap_open(unsigned int *tail) {
+#ifdef _WIN32
+	return -1;
+#else
+	if(rawtap == NULL) {
+		if((rawtap = rawtap_map(O_RDONLY, PROT_READ)) == NULL) {
+			return -1;
+		}
+		if(rawtap->magic != RAWTAP_MAGIC || rawtap->size != sizeof(struct rawtap_t)) {
+			munmap(rawtap, sizeof(struct rawtap_t));
+			rawtap = NULL;
+			return -1;
+		}
+	}
+	*tail = rawtap->head;
+	return 0;
+#endif
+}
+
+/*
+ * Returns 1 when the next train was copied, 0 when there is
+ * none yet and -1 when a train was lost because the reader
+ * fell behind.
+ */
+int rawtap_read(unsigned int *tail, char *hardware, size_t size, int *pulses, int *length) {
+	struct rawtap_slot_t *slot = NULL;
+	unsigned int head = 0, seq = 0, expect = 0;
+
+	if(rawtap == NULL) {
+		return 0;
+	}
+
+	head = rawtap->head;
+	if(*tail == head) {
+		return 0;
+	}
+	if(head-*tail > RAWTAP_SLOTS) {
+		*tail = head-RAWTAP_SLOTS;
+		return -1;
+	}
+
+	slot = &rawtap->slots[*tail % RAWTAP_SLOTS];
+	expect = (*tail*2)+2;
+	seq = slot->seq;
+	__sync_synchronize();
+	/* Claimed, but not yet written */
+	if((int)(seq-expect) < 0) {
+		return 0;
+	}
+	if(seq == expect) {
+		*length = slot->length;
+		if(*length < 0 || *length > MAXPULSESTREAMLENGTH) {
+			*length = 0;
+		}
+		memcpy(pulses, slot->pulses, sizeof(int)*(size_t)*length);
+		if(size > 0) {
+			strncpy(hardware, slot->hardware, size-1);
+			hardware[size-1] = '\0';
+		}
+		__sync_synchronize();
+	}
+	(*tail)++;
+
+	return (seq == expect && slot->seq == seq) ? 1 : -1;
+}
+
+void rawtap_gc(void) {
+#ifndef _WIN32
+	if(rawtap != NULL) {
+		munmap(rawtap, sizeof(struct rawtap_t));
+		if(rawtap_owner == 1) {
+			shm_unlink(RAWTAP_NAME);
+		}
+	}
+#endif
+	rawtap = NULL;
+	rawtap_owner = 0;
+}
@@ -0,0 +1,26 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _RAWTAP_H_
+#define _RAWTAP_H_
+
+#include <stddef.h>
+
+#define RAWTAP_NAME		"/pilight-rawtap"
+#define RAWTAP_SLOTS		64
+#define RAWTAP_HWLEN		32
+
+int rawtap_init(void);
+void rawtap_publish(const char *hardware, const int *pulses, int length);
+
+int rawtap_open(unsigned int *tail);
+int rawtap_read(unsigned int *tail, char *hardware, size_t size, int *pulses, int *length);
+
+void rawtap_gc(void);
+
+#endif
@@ -6,12 +6,26 @@
   file, You can obtain one at http://mozilla.org/MPL/2.0/.
 */
 
+/*
+ * Hashing a password takes SHA256_ITERATIONS rounds, which is
+ * too slow to redo on every request of an authenticated client.
+ * The results are kept in a small table indexed by a single
+ * round of the password, so neither the passwords themselves
+ * are kept nor does the table grow with every wrong password.
+ * The least recently used hash of a bucket makes room for a
+ * new one. Clients that logged in once get a session token,
+ * so following requests skip the hashing altogether.
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <fcntl.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <mbedtls/sha256.h>
+#include <mbedtls/entropy.h>
+#include <mbedtls/ctr_drbg.h>
 
 #include "sha256cache.h"
 #include "common.h"
@@ -19,46 +33,88 @@
 #include "log.h"
 #include "gc.h"
 
+#define SHA256CACHE_SIZE		32
+/* Number of slots a password can be placed in */
+#define SHA256CACHE_WAYS		4
+
+#define SHA256CACHE_SESSIONS	16
+
+typedef struct sha256cache_t {
+	unsigned int used;
+	unsigned char key[32];
+	char hash[65];
+} sha256cache_t;
+
+typedef struct sha256session_t {
+	time_t stamp;
+	char token[SHA256CACHE_TOKEN+1];
+} sha256session_t;
+
+static struct sha256cache_t sha256cache[SHA256CACHE_SIZE];
+static unsigned int sha256cache_used = 0;
+
+static struct sha256session_t sessions[SHA256CACHE_SESSIONS];
+static mbedtls_entropy_context entropy;
+static mbedtls_ctr_drbg_context ctr_drbg;
+static int random_init = 0;
+
 int sha256cache_gc(void) {
-	struct sha256cache_t *tmp = sha256cache;
-	while(sha256cache) {
-		tmp = sha256cache;
-		FREE(tmp->name);
-		sha256cache = sha256cache->next;
-		FREE(tmp);
-	}
-	if(sha256cache != NULL) {
-		FREE(sha256cache);
+	memset(sha256cache, 0, sizeof(sha256cache));
+	memset(sessions, 0, sizeof(sessions));
+	sha256cache_used = 0;
+
+	if(random_init == 1) {
+		mbedtls_ctr_drbg_free(&ctr_drbg);
+		mbedtls_entropy_free(&entropy);
+		random_init = 0;
 	}
 
 	logprintf(LOG_DEBUG, "garbage collected sha256cache library");
 	return 1;
 }
 
-void sha256cache_remove_node(struct sha256cache_t **cache, char *name) {
-	struct sha256cache_t *currP, *prevP;
-
-	prevP = NULL;
-
-	for(currP = *cache; currP != NULL; prevP = currP, currP = currP->next) {
-
-		if(strcmp(currP->name, name) == 0) {
-			if(prevP == NULL) {
-				*cache = currP->next;
-			} else {
-				prevP->next = currP->next;
-			}
-
-			FREE(currP->name);
-			FREE(currP);
+/*
+ * Compare without returning early, so the time it takes tells
+ * nothing about how much of a hash or token was right.
+ */
+int sha256cache_equal(const char *a, const char *b) {
+	size_t la = strlen(a), lb = strlen(b), i = 0;
+	unsigned char r = (la != lb);
+
+	for(i=0;i<lb;i++) {
+		r |= (unsigned char)((i < la) ? a[i] : 0) ^ (unsigned char)b[i];
+	}
+	return (r == 0) ? 0 : -1;
+}
 
-			break;
+static struct sha256cache_t *sha256cache_find(char *name, unsigned char *key) {
+	mbedtls_sha256_context ctx;
+	unsigned int i = 0, x = 0;
+
+	mbedtls_sha256_init(&ctx);
+	mbedtls_sha256_starts(&ctx, 0);
+	mbedtls_sha256_update(&ctx, (unsigned char *)name, strlen(name));
+	mbedtls_sha256_finish(&ctx, key);
+	mbedtls_sha256_free(&ctx);
+
+	x = ((unsigned int)key[0] | (unsigned int)key[1] << 8) % SHA256CACHE_SIZE;
+	for(i=0;i<SHA256CACHE_WAYS;i++) {
+		struct sha256cache_t *node = &sha256cache[(x+i) % SHA256CACHE_SIZE];
+		if(node->used > 0 && memcmp(node->key, key, 32) == 0) {
+			node->used = ++sha256cache_used;
+			return node;
 		}
 	}
+	return NULL;
 }
 
 int sha256cache_rm(char *name) {
-	sha256cache_remove_node(&sha256cache, name);
+	unsigned char key[32];
+	struct sha256cache_t *node = NULL;
+
+	if((node = sha256cache_find(name, key)) != NULL) {
+		memset(node, 0, sizeof(struct sha256cache_t));
+	}
 
 	logprintf(LOG_DEBUG, "removed %s from cache", name);
 	return 0;
@@ -67,10 +123,23 @@ int sha256cache_rm(char *name) {
 int sha256cache_add(char *name) {
 	logprintf(LOG_INFO, "cached new sha256 hash");
 
-	unsigned char output[33];
+	unsigned char output[33], key[32];
 	char *password = NULL;
 	int i = 0, x = 0, len = 65;
+	unsigned int slot = 0;
 	mbedtls_sha256_context ctx;
+	struct sha256cache_t *node = NULL;
+
+	if((node = sha256cache_find(name, key)) == NULL) {
+		slot = ((unsigned int)key[0] | (unsigned int)key[1] << 8) % SHA256CACHE_SIZE;
+		node = &sha256cache[slot];
+		for(i=1;i<SHA256CACHE_WAYS;i++) {
+			struct sha256cache_t *tmp = &sha256cache[(slot+(unsigned int)i) % SHA256CACHE_SIZE];
+			if(tmp->used < node->used) {
+				node = tmp;
+			}
+		}
+	}
 
 	if(strlen(name) < 64) {
 		len = 65;
@@ -83,15 +152,6 @@ int sha256cache_add(char *name) {
 	}
 	strncpy(password, name, len);
 
-	struct sha256cache_t *node = MALLOC(sizeof(struct sha256cache_t));
-	if(node == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
-	if((node->name = MALLOC(strlen(name)+1)) == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
-	strcpy(node->name, name);
-
 	for(i=0;i<SHA256_ITERATIONS;i++) {
 		mbedtls_sha256_init(&ctx);
 		mbedtls_sha256_starts(&ctx, 0);
@@ -106,20 +166,79 @@ int sha256cache_add(char *name) {
 	for(i=0;i<64;i+=2) {
 		sprintf(&node->hash[i], "%02x", output[i/2]);
 	}
+	memcpy(node->key, key, 32);
+	node->used = ++sha256cache_used;
 
-	node->next = sha256cache;
-	sha256cache = node;
 	FREE(password);
 	return 0;
 }
 
 char *sha256cache_get_hash(char *name) {
-	struct sha256cache_t *ftmp = sha256cache;
-	while(ftmp) {
-		if(strcmp(ftmp->name, name) == 0) {
-			return ftmp->hash;
-		}
-		ftmp = ftmp->next;
+	unsigned char key[32];
+	struct sha256cache_t *node = NULL;
+
+	if((node = sha256cache_find(name, key)) != NULL) {
+		return node->hash;
 	}
 	return NULL;
 }
+
+/*
+ * Start a new session and write its token, the oldest session
+ * is dropped when all are in use.
+ */
+int sha256cache_session_add(char *token) {
+	unsigned char buf[SHA256CACHE_TOKEN/2];
+	struct sha256session_t *node = &sessions[0];
+	time_t now = time(NULL);
+	int i = 0;
+
+	if(random_init == 0) {
+		mbedtls_entropy_init(&entropy);
+		mbedtls_ctr_drbg_init(&ctr_drbg);
+		if(mbedtls_ctr_drbg_seed(&ctr_drbg, mbedtls_entropy_func, &entropy, (const unsigned char *)"pilight-session", strlen("pilight-session")) != 0) {
+			/*LCOV_EXCL_START*/
+			logprintf(LOG_ERR, "could not seed the session tokens");
+			mbedtls_ctr_drbg_free(&ctr_drbg);
+			mbedtls_entropy_free(&entropy);
+			return -1;
+			/*LCOV_EXCL_STOP*/
+		}
+		random_init = 1;
+	}
+	if(mbedtls_ctr_drbg_random(&ctr_drbg, buf, sizeof(buf)) != 0) {
+		return -1; /*LCOV_EXCL_LINE*/
+	}
+
+	for(i=1;i<SHA256CACHE_SESSIONS;i++) {
+		if(sessions[i].stamp < node->stamp) {
+			node = &sessions[i];
+		}
+	}
+	for(i=0;i<SHA256CACHE_TOKEN;i+=2) {
+		sprintf(&node->token[i], "%02x", buf[i/2]);
+	}
+	node->stamp = now;
+	strcpy(token, node->token);
+
+	return 0;
+}
+
+/*
+ * Check a token against all running sessions, so a wrong one
+ * takes as long as a right one.
+ */
+int sha256cache_session_valid(const char *token) {
+	time_t now = time(NULL);
+	int i = 0, r = -1;
+
+	for(i=0;i<SHA256CACHE_SESSIONS;i++) {
+		if(sessions[i].stamp > 0 && now-sessions[i].stamp > SHA256CACHE_TIMEOUT) {
+			memset(&sessions[i], 0, sizeof(struct sha256session_t));
+		}
+		if(sessions[i].stamp > 0 && sha256cache_equal(token, sessions[i].token) == 0) {
+			r = 0;
+		}
+	}
+	return r;
+}
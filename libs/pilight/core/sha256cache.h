@@ -23,16 +23,15 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
-typedef struct sha256cache_t {
-	char *name;
-	char hash[65];
-	struct sha256cache_t *next;
-} sha256cache_t;
-
-struct sha256cache_t *sha256cache;
+/* Hex characters of a session token */
+#define SHA256CACHE_TOKEN		64
+/* Seconds a session stays valid */
+#define SHA256CACHE_TIMEOUT	86400
 
 int sha256cache_gc(void);
-void sha256cache_remove_node(struct sha256cache_t **sha256cache, char *name);
+int sha256cache_equal(const char *a, const char *b);
 int sha256cache_rm(char *name);
 int sha256cache_add(char *name);
 char *sha256cache_get_hash(char *name);
+int sha256cache_session_add(char *token);
+int sha256cache_session_valid(const char *token);
@@ -26,6 +26,8 @@
 #include <time.h>
 #include <math.h>
 #include <string.h>
+#include <assert.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #ifdef _WIN32
@@ -43,6 +45,9 @@
 #else
 	#include <sys/socket.h>
 	#include <sys/time.h>
+	#include <sys/uio.h>
+	#include <sys/un.h>
+	#include <sys/stat.h>
 	#include <netinet/in.h>
 	#include <netinet/tcp.h>
 	#include <netdb.h>
@@ -50,44 +55,193 @@
 #endif
 
 #include "pilight.h"
+#include "eventpool.h"
 #include "network.h"
 #include "log.h"
 #include "gc.h"
 #include "socket.h"
+#include "json.h"
+#include "compact.h"
 #include "../config/settings.h"
 
 static char recvBuff[BUFFER_SIZE];
-static char *waitMessage = NULL;
 static unsigned short socket_loop = 1;
+/* The local socket, only reachable from this machine */
+static int socket_local = 0;
+static char *socket_local_path = NULL;
 static unsigned int socket_port = 0;
-static int socket_loopback = 0;
 static int socket_server = 0;
-static int socket_clients[MAX_CLIENTS];
+
+/*
+ * Output a non-blocking client could not take yet. It is sent
+ * by the main loop once the client is writable again, so a slow
+ * client does not hold up the thread broadcasting to it.
+ *
+ * A client with more than SOCKET_PENDING_HIGH bytes pending is
+ * lagging. Until it is back under SOCKET_PENDING_LOW only the
+ * latest state of each device is kept for it, other messages
+ * are dropped above SOCKET_PENDING_MAX. Clients that lag for
+ * SOCKET_STALL_TIMEOUT seconds are disconnected.
+ */
+#define SOCKET_PENDING_HIGH		262144
+#define SOCKET_PENDING_LOW		65536
+#define SOCKET_PENDING_MAX		1048576
+#define SOCKET_STALL_TIMEOUT	30
+
+typedef struct socket_deferred_t {
+	char *key;
+	char *buf;
+	size_t len;
+
+	struct socket_deferred_t *next;
+} socket_deferred_t;
+
+typedef struct socket_pending_t {
+	char *buf;
+	size_t len;
+	int lagging;
+	time_t lagged;
+	struct socket_deferred_t *deferred;
+} socket_pending_t;
+
+/*
+ * A client of the socket server. The callbacks get the number
+ * of its slot, the slots grow when they are all taken. Only
+ * the main loop adds, reads and removes clients, but any
+ * thread can write to one. So the slots and the pending output
+ * are changed with the socket lock held, and closing a client
+ * from another thread only marks it.
+ */
+typedef struct socket_client_t {
+	int fd;
+	int slot;
+	int compact;
+	int closing;
+	/* Input that was already searched for the delimiter */
+	size_t scanned;
+	uv_poll_t *poll_req;
+	struct socket_pending_t pending;
+} socket_client_t;
+
+static unsigned long socket_coalesced = 0;
+static unsigned long socket_dropped = 0;
+static unsigned long socket_evicted = 0;
+
+static struct socket_client_t **socket_clients = NULL;
+static int socket_nrclients = 0;
+static struct socket_callback_t *socket_callback = NULL;
+static uv_mutex_t socket_lock;
+static int socket_lock_init = 0;
+
+static uv_poll_t *socket_server_req = NULL;
+static uv_poll_t *socket_local_req = NULL;
+static uv_async_t *socket_async_req = NULL;
+static uv_timer_t *socket_timer_req = NULL;
+
+/*
+ * Connections that switched to compact framing. The input of
+ * such a client is kept until a frame is complete. The output
+ * to such a master is framed instead of delimited, under a
+ * lock so frames of different threads don't interleave.
+ */
+static int socket_compact_fd = 0;
+static pthread_mutex_t socket_compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long socket_compact_frames = 0;
+
+static void socket_client_remove(int i, int notify);
+
+static void socket_pending_free(struct socket_pending_t *pending) {
+	struct socket_deferred_t *tmp = NULL;
+
+	if(pending->buf != NULL) {
+		FREE(pending->buf);
+	}
+	pending->len = 0;
+	pending->lagging = 0;
+	while(pending->deferred != NULL) {
+		tmp = pending->deferred;
+		pending->deferred = tmp->next;
+		FREE(tmp->key);
+		FREE(tmp->buf);
+		FREE(tmp);
+	}
+}
+
+static void socket_handle_free(uv_handle_t *handle) {
+	FREE(handle);
+}
+
+static void socket_server_close(uv_poll_t **req) {
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+
+	if(*req == NULL) {
+		return;
+	}
+	custom_poll_data = (*req)->data;
+	uv_poll_stop(*req);
+	if(!uv_is_closing((uv_handle_t *)*req)) {
+		uv_close((uv_handle_t *)*req, socket_handle_free);
+	}
+	if(custom_poll_data != NULL) {
+		uv_custom_poll_free(custom_poll_data);
+		(*req)->data = NULL;
+	}
+	*req = NULL;
+}
 
 int socket_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	int x = 0;
 
+	/* Let the threads waiting in socket_read end gracefully */
 	socket_loop = 0;
-	/* Wakeup all our select statement so the socket_wait and
-		 socket_read functions can actually close and the
-		 all threads using sockets can end gracefully */
 
-	for(x=1;x<MAX_CLIENTS;x++) {
-		if(socket_clients[x] > 0) {
-			send(socket_clients[x], "1", 1, MSG_NOSIGNAL);
+	for(x=0;x<socket_nrclients;x++) {
+		if(socket_clients[x] != NULL) {
+			socket_client_remove(x, 0);
 		}
 	}
+	if(socket_lock_init == 1) {
+		uv_mutex_lock(&socket_lock);
+	}
+	if(socket_clients != NULL) {
+		FREE(socket_clients);
+	}
+	socket_nrclients = 0;
+	if(socket_lock_init == 1) {
+		uv_mutex_unlock(&socket_lock);
+	}
 
-	if(socket_loopback > 0) {
-		send(socket_loopback, "1", 1, MSG_NOSIGNAL);
-		socket_close(socket_loopback);
+	socket_server_close(&socket_server_req);
+	socket_server_close(&socket_local_req);
+	if(socket_async_req != NULL) {
+		uv_close((uv_handle_t *)socket_async_req, socket_handle_free);
+		socket_async_req = NULL;
+	}
+	if(socket_timer_req != NULL) {
+		uv_timer_stop(socket_timer_req);
+		uv_close((uv_handle_t *)socket_timer_req, socket_handle_free);
+		socket_timer_req = NULL;
 	}
 
-	if(waitMessage != NULL) {
-		FREE(waitMessage);
+	if(socket_server > 0) {
+#ifdef _WIN32
+		closesocket(socket_server);
+#else
+		close(socket_server);
+#endif
+		socket_server = 0;
+	}
+	if(socket_local > 0) {
+		close(socket_local);
+		socket_local = 0;
+	}
+	if(socket_local_path != NULL) {
+		unlink(socket_local_path);
+		FREE(socket_local_path);
 	}
+	socket_compact_fd = 0;
 
 	logprintf(LOG_DEBUG, "garbage collected socket library");
 	return EXIT_SUCCESS;
@@ -111,7 +265,11 @@ int socket_start(unsigned short port) {
 #endif
 
 	memset(&address, '\0', sizeof(struct sockaddr_in));
-	memset(socket_clients, 0, sizeof(socket_clients));
+
+	if(socket_lock_init == 0) {
+		uv_mutex_init(&socket_lock);
+		socket_lock_init = 1;
+	}
 
 	//create a master socket
 	if((socket_server = socket(AF_INET, SOCK_STREAM, 0)) == 0)  {
@@ -160,16 +318,105 @@ int socket_start(unsigned short port) {
 	else
 		socket_port = ntohs(address.sin_port);
 
-	/* Make a loopback socket we can close when pilight needs to be stopped
-	   or else the select statement will wait forever for an activity */
-	char localhost[16] = "127.0.0.1";
-	socket_loopback = socket_connect(localhost, (unsigned short)socket_port);
-	socket_clients[0] = socket_loopback;
 	logprintf(LOG_INFO, "daemon listening to port: %d", socket_port);
 
 	return 0;
 }
 
+/*
+ * Listen on a unix socket as well. Clients on the same
+ * machine skip the whitelist, access is up to the
+ * permissions of the socket file.
+ */
+int socket_start_local(const char *path) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+#ifdef _WIN32
+	return -1;
+#else
+	struct sockaddr_un address;
+	struct stat st;
+	mode_t mask = 0;
+
+	if(strlen(path) >= sizeof(address.sun_path)) {
+		logprintf(LOG_ERR, "local socket path %s is too long", path);
+		return -1;
+	}
+
+	/* Only remove what a previous run left behind */
+	if(lstat(path, &st) == 0) {
+		if(S_ISSOCK(st.st_mode) == 0) {
+			logprintf(LOG_ERR, "cannot replace %s by the local socket", path);
+			return -1;
+		}
+		unlink(path);
+	}
+
+	if((socket_local = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		logprintf(LOG_ERR, "could not create local socket");
+		socket_local = 0;
+		return -1;
+	}
+
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	mask = umask(0117);
+	if(bind(socket_local, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+	   listen(socket_local, 16) < 0) {
+		umask(mask);
+		logprintf(LOG_ERR, "cannot listen to local socket %s", path);
+		close(socket_local);
+		socket_local = 0;
+		return -1;
+	}
+	umask(mask);
+
+	if((socket_local_path = MALLOC(strlen(path)+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	strcpy(socket_local_path, path);
+	logprintf(LOG_INFO, "daemon listening to local socket: %s", path);
+
+	return 0;
+#endif
+}
+
+/*
+ * Connects to the local socket of a daemon on this machine,
+ * non-blocking like socket_connect.
+ */
+int socket_connect_local(const char *path) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+#ifdef _WIN32
+	return -1;
+#else
+	struct sockaddr_un address;
+	int sockfd = 0;
+
+	if(strlen(path) >= sizeof(address.sun_path)) {
+		return -1;
+	}
+	if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+
+	memset(&address, '\0', sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, path);
+
+	if(connect(sockfd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		close(sockfd);
+		return -1;
+	}
+	fcntl(sockfd, F_SETFL, O_NONBLOCK);
+
+	return sockfd;
+#endif
+}
+
 int socket_timeout_connect(int sockfd, struct sockaddr *serv_addr, int sec) {
 	struct timeval tv;
 	fd_set fdset;
@@ -230,7 +477,18 @@ int socket_get_fd(void) {
 int socket_get_clients(int i) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	return socket_clients[i];
+	int sd = 0;
+
+	if(socket_lock_init == 0) {
+		return 0;
+	}
+	uv_mutex_lock(&socket_lock);
+	if(i >= 0 && i < socket_nrclients && socket_clients[i] != NULL) {
+		sd = socket_clients[i]->fd;
+	}
+	uv_mutex_unlock(&socket_lock);
+
+	return sd;
 }
 
 int socket_connect(char *address, unsigned short port) {
@@ -311,113 +569,503 @@ int socket_connect(char *address, unsigned short port) {
 	}
 }
 
+/*
+ * Returns the slot of a client of the socket server, or -1
+ * for other sockets. Must be called with the socket lock held.
+ */
+static int socket_find(int sockfd) {
+	int i = 0;
+
+	for(i=0;i<socket_nrclients;i++) {
+		if(socket_clients[i] != NULL && socket_clients[i]->fd == sockfd) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Have the main loop look at the clients, to send their
+ * pending output or to close them.
+ */
+static void socket_wakeup(void) {
+	if(socket_async_req != NULL) {
+		uv_async_send(socket_async_req);
+	}
+}
+
+static int socket_pending_append(struct socket_pending_t *pending, const char *buf, size_t len) {
+	char *p = NULL;
+
+	if((p = REALLOC(pending->buf, pending->len+len)) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	pending->buf = p;
+	memcpy(&p[pending->len], buf, len);
+	pending->len += len;
+	return 0;
+}
+
+/*
+ * Keep the state of a device for a lagging client, replacing
+ * an older state of the same devices key.
+ */
+static void socket_defer(struct socket_pending_t *pending, const char *key, const char *buf, size_t len) {
+	struct socket_deferred_t *tmp = pending->deferred, *last = NULL;
+
+	while(tmp) {
+		if(strcmp(tmp->key, key) == 0) {
+			socket_coalesced++;
+			break;
+		}
+		last = tmp;
+		tmp = tmp->next;
+	}
+	if(tmp == NULL) {
+		if((tmp = MALLOC(sizeof(struct socket_deferred_t))) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(tmp, 0, sizeof(struct socket_deferred_t));
+		if((tmp->key = MALLOC(strlen(key)+1)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		strcpy(tmp->key, key);
+		if(last == NULL) {
+			pending->deferred = tmp;
+		} else {
+			last->next = tmp;
+		}
+	} else {
+		FREE(tmp->buf);
+	}
+	if((tmp->buf = MALLOC(len)) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(tmp->buf, buf, len);
+	tmp->len = len;
+}
+
+/*
+ * Queue the deferred states once a lagging client caught up.
+ */
+static void socket_resume(struct socket_pending_t *pending) {
+	struct socket_deferred_t *tmp = NULL;
+	size_t eoss = strlen(EOSS);
+
+	pending->lagging = 0;
+	while(pending->deferred != NULL) {
+		tmp = pending->deferred;
+		pending->deferred = tmp->next;
+		socket_pending_append(pending, tmp->buf, tmp->len);
+		socket_pending_append(pending, EOSS, eoss);
+		FREE(tmp->key);
+		FREE(tmp->buf);
+		FREE(tmp);
+	}
+}
+
+/*
+ * Track whether a client is lagging. Must be called with the
+ * socket lock held.
+ */
+static void socket_lagging(struct socket_client_t *client) {
+	struct socket_pending_t *pending = &client->pending;
+
+	if(pending->lagging == 0 && pending->len > SOCKET_PENDING_HIGH) {
+		pending->lagging = 1;
+		pending->lagged = time(NULL);
+		logprintf(LOG_DEBUG, "socket client %d is lagging, %zu bytes pending", client->fd, pending->len);
+	} else if(pending->lagging == 1 && pending->len <= SOCKET_PENDING_LOW) {
+		socket_resume(pending);
+	}
+}
+
+/*
+ * Send the part of buf followed by EOSS that starts at offset
+ * off, in a single system call. Returns the number of bytes
+ * sent, 0 when the socket would block, or -1 on errors.
+ */
+static ssize_t socket_send_frame(int sockfd, const char *buf, size_t len, size_t off) {
+	size_t eoss = strlen(EOSS);
+	ssize_t n = 0;
+#ifdef _WIN32
+	if(off < len) {
+		n = send(sockfd, &buf[off], (int)(len-off), MSG_NOSIGNAL);
+	} else {
+		n = send(sockfd, &EOSS[off-len], (int)(eoss-(off-len)), MSG_NOSIGNAL);
+	}
+	if(n == -1 && WSAGetLastError() == WSAEWOULDBLOCK) {
+		return 0;
+	}
+#else
+	struct iovec iov[2];
+	struct msghdr msg;
+	int nr = 0;
+
+	memset(&msg, 0, sizeof(struct msghdr));
+	if(off < len) {
+		iov[nr].iov_base = (void *)&buf[off];
+		iov[nr].iov_len = len-off;
+		nr++;
+		off = len;
+	}
+	iov[nr].iov_base = (void *)&EOSS[off-len];
+	iov[nr].iov_len = eoss-(off-len);
+	nr++;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = nr;
+
+	/* A writev() that does not raise SIGPIPE */
+	while((n = sendmsg(sockfd, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR);
+	if(n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return 0;
+	}
+#endif
+	return n;
+}
+
+/*
+ * Send everything a client has pending. Must be called with
+ * the socket lock held. Returns -1 if the client failed.
+ */
+static int socket_pending_flush(struct socket_client_t *client) {
+	struct socket_pending_t *pending = &client->pending;
+	ssize_t n = 0;
+
+	while(pending->len > 0) {
+		if((n = send(client->fd, pending->buf, pending->len, MSG_NOSIGNAL)) == -1) {
+#ifdef _WIN32
+			if(WSAGetLastError() == WSAEWOULDBLOCK) {
+#else
+			if(errno == EINTR) {
+				continue;
+			} else if(errno == EAGAIN || errno == EWOULDBLOCK) {
+#endif
+				return 0;
+			}
+			FREE(pending->buf);
+			pending->len = 0;
+			return -1;
+		}
+		memmove(pending->buf, &pending->buf[n], pending->len-(size_t)n);
+		pending->len -= (size_t)n;
+	}
+	if(pending->buf != NULL) {
+		FREE(pending->buf);
+	}
+	return 0;
+}
+
+/*
+ * A client of the socket server is closed by the main loop,
+ * so its slot can't be taken by another client while a thread
+ * still works with it.
+ */
 void socket_close(int sockfd) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	int i = 0;
 	struct sockaddr_in address;
-	int addrlen = sizeof(address);
+	int addrlen = sizeof(address), i = -1;
 	char buf[INET_ADDRSTRLEN+1];
 
 	if(sockfd > 0) {
+		if(socket_lock_init == 1) {
+			uv_mutex_lock(&socket_lock);
+			if((i = socket_find(sockfd)) > -1 && socket_clients[i]->closing == 0) {
+				socket_clients[i]->closing = 1;
+				socket_pending_free(&socket_clients[i]->pending);
+				shutdown(sockfd, 2);
+			}
+			uv_mutex_unlock(&socket_lock);
+		}
+		if(i > -1) {
+			socket_wakeup();
+			return;
+		}
+
 		if(getpeername(sockfd, (struct sockaddr*)&address, (socklen_t*)&addrlen) == 0) {
 			memset(&buf, '\0', INET_ADDRSTRLEN+1);
 			inet_ntop(AF_INET, (void *)&(address.sin_addr), buf, INET_ADDRSTRLEN+1);
 			logprintf(LOG_DEBUG, "client disconnected, ip %s, port %d", buf, ntohs(address.sin_port));
 		}
-
-		for(i=0;i<MAX_CLIENTS;i++) {
-			if(socket_clients[i] == sockfd) {
-				socket_clients[i] = 0;
-				break;
-			}
+		if(sockfd == socket_compact_fd) {
+			socket_compact_fd = 0;
 		}
 		shutdown(sockfd, 2);
 		close(sockfd);
 	}
 }
 
-int socket_write(int sockfd, const char *msg, ...) {
-	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
-
-	va_list ap;
-	int bytes = -1;
-	int ptr = 0, n = 0, x = BUFFER_SIZE, len = (int)strlen(EOSS);
-	char *sendBuff = NULL;
-	if(strlen(msg) > 0 && sockfd > 0) {
+static int socket_send_all(int sockfd, const unsigned char *buf, size_t len) {
+	size_t ptr = 0;
+	ssize_t n = 0;
+	fd_set fds;
+	struct timeval tv;
 
-		va_start(ap, msg);
+	while(ptr < len) {
+		if((n = send(sockfd, (const char *)&buf[ptr], len-ptr, MSG_NOSIGNAL)) == -1) {
 #ifdef _WIN32
-		n = _vscprintf(msg, ap);
+			if(WSAGetLastError() != WSAEWOULDBLOCK) {
 #else
-		n = vsnprintf(NULL, 0, msg, ap);
+			if(errno == EINTR) {
+				continue;
+			} else if(errno != EAGAIN && errno != EWOULDBLOCK) {
 #endif
-		if(n == -1) {
-			logprintf(LOG_ERR, "improperly formatted string: %s", msg);
-			return -1;
+				return -1;
+			}
+			FD_ZERO(&fds);
+			FD_SET((unsigned long)sockfd, &fds);
+			tv.tv_sec = 1;
+			tv.tv_usec = 0;
+			if(select(sockfd+1, NULL, &fds, NULL, &tv) <= 0) {
+				return -1;
+			}
+			continue;
 		}
-		n += (int)len;
-		va_end(ap);
+		ptr += (size_t)n;
+	}
+	return 0;
+}
 
-		if((sendBuff = MALLOC((size_t)n)) == NULL) {
-			fprintf(stderr, "out of memory\n");
-			exit(EXIT_FAILURE);
+/*
+ * Mark the connection to the master as compact, or stop
+ * framing its output when sockfd is 0.
+ */
+void socket_compact_output(int sockfd) {
+	pthread_mutex_lock(&socket_compact_lock);
+	socket_compact_fd = sockfd;
+	pthread_mutex_unlock(&socket_compact_lock);
+}
+
+/*
+ * Mark a client as compact. Its input is handed to the
+ * compact callback frame by frame from now on.
+ */
+void socket_compact_input(int sockfd) {
+	int i = 0;
+
+	if(socket_lock_init == 0) {
+		return;
+	}
+	uv_mutex_lock(&socket_lock);
+	if((i = socket_find(sockfd)) > -1) {
+		socket_clients[i]->compact = 1;
+	}
+	uv_mutex_unlock(&socket_lock);
+}
+
+int socket_write_frame(int sockfd, const unsigned char *frame, size_t len) {
+	int ret = 0;
+
+	pthread_mutex_lock(&socket_compact_lock);
+	if(socket_send_all(sockfd, frame, len) == -1) {
+		ret = -1;
+	}
+	pthread_mutex_unlock(&socket_compact_lock);
+
+	return ret;
+}
+
+/*
+ * Puts the header in front of a text message, so it goes
+ * out in a single send.
+ */
+static int socket_write_json(int sockfd, const char *buf, size_t len) {
+	unsigned char stack[BUFFER_SIZE], *frame = stack;
+	size_t n = 0;
+	int ret = 0;
+
+	if(len+COMPACT_HEADER > BUFFER_SIZE) {
+		if((frame = MALLOC(len+COMPACT_HEADER)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		memset(sendBuff, '\0', (size_t)n);
+	}
+	n = compact_header(frame, COMPACT_JSON, len);
+	memcpy(&frame[n], buf, len);
+	ret = socket_write_frame(sockfd, frame, n+len);
 
-		va_start(ap, msg);
-		vsprintf(sendBuff, msg, ap);
-		va_end(ap);
+	if(frame != stack) {
+		FREE(frame);
+	}
+	return ret;
+}
+
+/*
+ * Send a message without formatting it. Output to clients of
+ * the socket server that can not be sent right away is queued
+ * and the message is sent as a whole later on. Messages with
+ * a key are device states that may be replaced by a newer one
+ * while the client is lagging.
+ */
+static int socket_send(int sockfd, const char *key, const char *buf, size_t len) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-		memcpy(&sendBuff[n-len], EOSS, (size_t)len);
+	struct socket_client_t *client = NULL;
+	size_t total = len+strlen(EOSS), ptr = 0;
+	ssize_t n = 0;
+	int x = -1;
+	fd_set fds;
+	struct timeval tv;
 
-		while(ptr < n) {
-			if((n-ptr) < BUFFER_SIZE) {
-				x = (n-ptr);
-			} else {
-				x = BUFFER_SIZE;
+	if(len == 0 || sockfd <= 0) {
+		return 0;
+	}
+
+	/* Callers check for the delimited length, whatever the framing */
+	if(sockfd == socket_compact_fd) {
+		if(socket_write_json(sockfd, buf, len) == -1) {
+			logprintf(LOG_DEBUG, "socket write failed: %.*s", (int)len, buf);
+			return -1;
+		}
+		if(strncmp(buf, "BEAT", 4) != 0) {
+			logprintf(LOG_DEBUG, "socket write succeeded: %.*s", (int)len, buf);
+		}
+		return (int)total;
+	}
+
+	if(socket_lock_init == 1) {
+		uv_mutex_lock(&socket_lock);
+		if((x = socket_find(sockfd)) == -1) {
+			uv_mutex_unlock(&socket_lock);
+		}
+	}
+
+	if(x > -1) {
+		client = socket_clients[x];
+		if(client->closing == 1 ||
+		   (client->pending.len > 0 && socket_pending_flush(client) == -1)) {
+			uv_mutex_unlock(&socket_lock);
+			logprintf(LOG_DEBUG, "socket write failed: %.*s", (int)len, buf);
+			return -1;
+		}
+		socket_lagging(client);
+		if(client->pending.lagging == 1 && key != NULL) {
+			socket_defer(&client->pending, key, buf, len);
+			uv_mutex_unlock(&socket_lock);
+			return (int)total;
+		}
+		if(client->pending.len == 0) {
+			if((n = socket_send_frame(sockfd, buf, len, 0)) == -1) {
+				uv_mutex_unlock(&socket_lock);
+				logprintf(LOG_DEBUG, "socket write failed: %.*s", (int)len, buf);
+				return -1;
 			}
-			if((bytes = (int)send(sockfd, &sendBuff[ptr], (size_t)x, MSG_NOSIGNAL)) == -1) {
-				/* Change the delimiter into regular newlines */
-				sendBuff[n-(len-1)] = '\0';
-				sendBuff[n-(len)] = '\n';
-				logprintf(LOG_DEBUG, "socket write failed: %s", sendBuff);
-				FREE(sendBuff);
+			ptr = (size_t)n;
+		} else if(client->pending.len+total > SOCKET_PENDING_MAX) {
+			/* Nothing of this message was sent yet, so it can be dropped as a whole */
+			socket_dropped++;
+			uv_mutex_unlock(&socket_lock);
+			logprintf(LOG_NOTICE, "socket client %d is too slow, dropping message", sockfd);
+			return -1;
+		}
+		if(ptr < len) {
+			socket_pending_append(&client->pending, &buf[ptr], len-ptr);
+			ptr = len;
+		}
+		if(ptr < total) {
+			socket_pending_append(&client->pending, &EOSS[ptr-len], total-ptr);
+		}
+		if(client->pending.len > 0) {
+			socket_wakeup();
+		}
+		uv_mutex_unlock(&socket_lock);
+	} else {
+		while(ptr < total) {
+			if((n = socket_send_frame(sockfd, buf, len, ptr)) == -1) {
+				logprintf(LOG_DEBUG, "socket write failed: %.*s", (int)len, buf);
 				return -1;
+			} else if(n == 0) {
+				FD_ZERO(&fds);
+				FD_SET((unsigned long)sockfd, &fds);
+				tv.tv_sec = 1;
+				tv.tv_usec = 0;
+				if(select(sockfd+1, NULL, &fds, NULL, &tv) <= 0) {
+					logprintf(LOG_DEBUG, "socket write failed: %.*s", (int)len, buf);
+					return -1;
+				}
 			}
-			ptr += bytes;
+			ptr += (size_t)n;
 		}
+	}
+
+	if(strncmp(buf, "BEAT", 4) != 0) {
+		logprintf(LOG_DEBUG, "socket write succeeded: %.*s", (int)len, buf);
+	}
+	return (int)total;
+}
 
-		if(strncmp(&sendBuff[0], "BEAT", 4) != 0) {
-			/* Change the delimiter into regular newlines */
-			sendBuff[n-(len-1)] = '\0';
-			sendBuff[n-(len)] = '\n';
-			logprintf(LOG_DEBUG, "socket write succeeded: %s", sendBuff);
+int socket_write_buf(int sockfd, const char *buf, size_t len) {
+	return socket_send(sockfd, NULL, buf, len);
+}
+
+int socket_write_state(int sockfd, const char *key, const char *buf, size_t len) {
+	return socket_send(sockfd, key, buf, len);
+}
+
+void socket_stats(struct JsonNode *jstats) {
+	int i = 0, lagging = 0, nrclients = 0;
+
+	if(socket_lock_init == 0) {
+		return;
+	}
+
+	uv_mutex_lock(&socket_lock);
+	for(i=0;i<socket_nrclients;i++) {
+		if(socket_clients[i] != NULL) {
+			nrclients++;
+			if(socket_clients[i]->pending.lagging == 1) {
+				lagging++;
+			}
 		}
-		FREE(sendBuff);
 	}
-	return n;
+	json_append_member(jstats, "socket-clients", json_mknumber(nrclients, 0));
+	json_append_member(jstats, "socket-lagging", json_mknumber(lagging, 0));
+	json_append_member(jstats, "socket-coalesced", json_mknumber((double)socket_coalesced, 0));
+	json_append_member(jstats, "socket-dropped", json_mknumber((double)socket_dropped, 0));
+	json_append_member(jstats, "socket-evicted", json_mknumber((double)socket_evicted, 0));
+	json_append_member(jstats, "socket-compact-frames", json_mknumber((double)socket_compact_frames, 0));
+	uv_mutex_unlock(&socket_lock);
 }
 
-void socket_rm_client(int i, struct socket_callback_t *socket_callback) {
+int socket_write(int sockfd, const char *msg, ...) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	struct sockaddr_in address;
-	int addrlen = sizeof(address);
-	int sd = socket_clients[i];
-	char buf[INET_ADDRSTRLEN+1];
+	va_list ap;
+	char stack[BUFFER_SIZE], *sendBuff = stack;
+	int n = 0;
 
-	//Somebody disconnected, get his details and print
-	getpeername(sd, (struct sockaddr*)&address, (socklen_t*)&addrlen);
-	memset(&buf, '\0', INET_ADDRSTRLEN+1);
-	inet_ntop(AF_INET, (void *)&(address.sin_addr), buf, INET_ADDRSTRLEN+1);
-	logprintf(LOG_DEBUG, "client disconnected, ip %s, port %d", buf, ntohs(address.sin_port));
-	if(socket_callback->client_disconnected_callback)
-		socket_callback->client_disconnected_callback(i);
-	//Close the socket and mark as 0 in list for reuse
-	shutdown(sd, 2);
-	close(sd);
-	socket_clients[i] = 0;
+	if(strlen(msg) == 0 || sockfd <= 0) {
+		return 0;
+	}
+
+	/* Most messages fit the stack buffer and are formatted once */
+	va_start(ap, msg);
+	n = vsnprintf(stack, BUFFER_SIZE, msg, ap);
+	va_end(ap);
+	if(n < 0) {
+		logprintf(LOG_ERR, "improperly formatted string: %s", msg);
+		return -1;
+	}
+	if(n >= BUFFER_SIZE) {
+		if((sendBuff = MALLOC((size_t)n+1)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		va_start(ap, msg);
+		vsnprintf(sendBuff, (size_t)n+1, msg, ap);
+		va_end(ap);
+	}
+
+	n = socket_write_buf(sockfd, sendBuff, (size_t)n);
+
+	if(sendBuff != stack) {
+		FREE(sendBuff);
+	}
+	return n;
 }
 
 int socket_read(int sockfd, char **message, time_t timeout) {
@@ -514,133 +1162,461 @@ int socket_read(int sockfd, char **message, time_t timeout) {
 	return -1;
 }
 
-void *socket_wait(void *param) {
+/*
+ * Closes a client of the socket server and frees its slot.
+ * Only called from the main loop.
+ */
+static void socket_client_remove(int i, int notify) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	struct socket_callback_t *socket_callback = (struct socket_callback_t *)param;
-
-	char buf[INET_ADDRSTRLEN+1];
-	int activity;
-	int i, sd;
-	int max_sd;
+	struct socket_client_t *client = socket_clients[i];
+	struct uv_custom_poll_t *custom_poll_data = NULL;
 	struct sockaddr_in address;
-	int socket_client = 0;
 	int addrlen = sizeof(address);
-	fd_set readfds;
+	char buf[INET_ADDRSTRLEN+1];
+	uv_poll_t *req = client->poll_req;
+
+	if(getpeername(client->fd, (struct sockaddr*)&address, (socklen_t*)&addrlen) == 0 && address.sin_family == AF_INET) {
+		memset(&buf, '\0', INET_ADDRSTRLEN+1);
+		inet_ntop(AF_INET, (void *)&(address.sin_addr), buf, INET_ADDRSTRLEN+1);
+		logprintf(LOG_DEBUG, "client disconnected, ip %s, port %d", buf, ntohs(address.sin_port));
+	} else {
+		logprintf(LOG_DEBUG, "client disconnected, fd %d", client->fd);
+	}
+	if(notify == 1 && socket_callback != NULL && socket_callback->client_disconnected_callback) {
+		socket_callback->client_disconnected_callback(i);
+	}
+
+	uv_mutex_lock(&socket_lock);
+	socket_clients[i] = NULL;
+	socket_pending_free(&client->pending);
+	uv_mutex_unlock(&socket_lock);
+
+	if(client->fd == socket_compact_fd) {
+		socket_compact_fd = 0;
+	}
+
+	custom_poll_data = req->data;
+	uv_poll_stop(req);
 #ifdef _WIN32
-	unsigned long on = 1;
+	shutdown(client->fd, SD_BOTH);
+	closesocket(client->fd);
+#else
+	shutdown(client->fd, SHUT_RDWR);
+	close(client->fd);
 #endif
+	if(!uv_is_closing((uv_handle_t *)req)) {
+		uv_close((uv_handle_t *)req, socket_handle_free);
+	}
+	if(custom_poll_data != NULL) {
+		uv_custom_poll_free(custom_poll_data);
+		req->data = NULL;
+	}
+	FREE(client);
+}
 
-	while(socket_loop) {
-		do {
-			//clear the socket set
-			FD_ZERO(&readfds);
-
-			//add master socket to set
-			FD_SET((unsigned long)socket_get_fd(), &readfds);
-			max_sd = socket_get_fd();
-
-			//add child sockets to set
-			for(i=0;i<MAX_CLIENTS;i++) {
-				//socket descriptor
-				sd = socket_clients[i];
-				//if valid socket descriptor then add to read list
-				if(sd > 0)
-					FD_SET((unsigned long)sd, &readfds);
-
-				//highest file descriptor number, need it for the select function
-				if(sd > max_sd)
-					max_sd = sd;
+static void socket_client_close_cb(uv_poll_t *req) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct socket_client_t *client = NULL;
+
+	if(custom_poll_data != NULL && (client = custom_poll_data->data) != NULL) {
+		socket_client_remove(client->slot, 1);
+	}
+}
+
+static void socket_client_write_cb(uv_poll_t *req) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct socket_client_t *client = custom_poll_data->data;
+	int ret = 0;
+
+	uv_mutex_lock(&socket_lock);
+	if(client->pending.len > 0) {
+		ret = socket_pending_flush(client);
+		socket_lagging(client);
+		if(ret == 0 && client->pending.len > 0) {
+			ret = socket_pending_flush(client);
+		}
+	}
+	if(ret == -1) {
+		/* The poll callback still uses this client */
+		client->closing = 1;
+		socket_wakeup();
+	} else if(client->pending.len > 0) {
+		custom_poll_data->dowrite = 1;
+	}
+	uv_mutex_unlock(&socket_lock);
+}
+
+static void socket_client_message(int i, char *message) {
+	char **array = NULL;
+	unsigned int n = 0, q = 0;
+
+	if(socket_callback == NULL || socket_callback->client_data_callback == NULL || strlen(message) == 0) {
+		return;
+	}
+	if(strstr(message, "\n") != NULL) {
+		n = explode(message, "\n", &array);
+		for(q=0;q<n;q++) {
+			socket_callback->client_data_callback(i, array[q]);
+		}
+		array_free(&array, n);
+	} else {
+		socket_callback->client_data_callback(i, message);
+	}
+}
+
+/*
+ * Hands over every complete message in the input of a client.
+ * Only the input that came in since the last time is searched
+ * for the delimiter. Input of less than a buffer without one
+ * is taken as a whole, for clients that don't send it.
+ */
+static void socket_client_read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct socket_client_t *client = custom_poll_data->data;
+	struct iobuf_t *in = &custom_poll_data->recv_iobuf;
+	size_t eoss = strlen(EOSS), pos = 0, plen = 0;
+	int i = client->slot, type = 0, n = 0;
+	char *p = NULL;
+
+	if(buf == NULL) {
+		socket_client_remove(i, 1);
+		return;
+	}
+
+	while(socket_loop == 1 && client->closing == 0 && in->len > 0) {
+		if(client->compact == 1) {
+			if((n = compact_frame_parse((unsigned char *)in->buf, (size_t)in->len, &type, &plen)) == 0) {
+				break;
+			}
+			if(n == -1) {
+				logprintf(LOG_NOTICE, "socket client %d sent an invalid frame", client->fd);
+				socket_client_remove(i, 1);
+				return;
 			}
-			//wait for an activity on one of the sockets, timeout is NULL, so wait indefinitely
-			activity = select(max_sd + 1, &readfds, NULL, NULL, NULL);
-		} while(activity == -1 && errno == EINTR && socket_loop);
+			socket_compact_frames++;
+			if(socket_callback != NULL && socket_callback->client_compact_callback) {
+				socket_callback->client_compact_callback(i, type, (unsigned char *)&in->buf[n], plen);
+			}
+			iobuf_remove(in, (size_t)n+plen);
+			continue;
+		}
 
-		/* Immediatly stop loop if the select was waken up by the garbage collector */
-		if(socket_loop == 0) {
+		pos = (client->scanned >= eoss) ? client->scanned-(eoss-1) : 0;
+		p = NULL;
+		while(pos+eoss <= (size_t)in->len) {
+			if((p = memchr(&in->buf[pos], EOSS[0], (size_t)in->len-pos)) == NULL) {
+				break;
+			}
+			if((size_t)(p-in->buf)+eoss <= (size_t)in->len && strncmp(p, EOSS, eoss) == 0) {
+				break;
+			}
+			pos = (size_t)(p-in->buf)+1;
+			p = NULL;
+		}
+		if(p != NULL) {
+			pos = (size_t)(p-in->buf);
+			plen = eoss;
+		} else if(in->len < BUFFER_SIZE) {
+			pos = (size_t)in->len;
+			plen = 0;
+		} else {
+			client->scanned = (size_t)in->len;
 			break;
 		}
-		//If something happened on the master socket, then its an incoming connection
-		if(FD_ISSET((unsigned long)socket_get_fd(), &readfds)) {
-			if((socket_client = accept(socket_get_fd(), (struct sockaddr *)&address, (socklen_t *)&addrlen)) < 0) {
-				logprintf(LOG_ERR, "failed to accept client");
-				exit(EXIT_FAILURE);
-			}
-			memset(&buf, '\0', INET_ADDRSTRLEN+1);
-			inet_ntop(AF_INET, (void *)&(address.sin_addr), buf, INET_ADDRSTRLEN+1);
-			if(whitelist_check(buf) != 0) {
-				logprintf(LOG_INFO, "rejected client, ip: %s, port: %d", buf, ntohs(address.sin_port));
-				shutdown(socket_client, 2);
-				close(socket_client);
-			} else {
-				//inform user of socket number - used in send and receive commands
-				logprintf(LOG_INFO, "new client, ip: %s, port: %d", buf, ntohs(address.sin_port));
-				logprintf(LOG_DEBUG, "client fd: %d", socket_client);
-				//send new connection accept message
-				//socket_write(socket_client, "{\"message\":\"accept connection\"}");
-
-				static struct linger linger = { 0, 0 };
-				socklen_t lsize = sizeof(struct linger);
-				setsockopt(socket_client, SOL_SOCKET, SO_LINGER, (void *)&linger, lsize);
+		client->scanned = 0;
+
+		/* The delimiter is replaced, the input is terminated behind the data */
+		in->buf[pos] = '\0';
+		socket_client_message(i, in->buf);
+		iobuf_remove(in, pos+plen);
+	}
+
+	if(client->closing == 0) {
+		uv_custom_read(req);
+	}
+}
+
+/*
+ * Sends what the clients have pending and closes those that
+ * were closed by another thread.
+ */
+static void socket_async_cb(uv_async_t *handle) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct socket_client_t *client = NULL;
+	int i = 0, closing = 0, pending = 0;
+
+	for(i=0;i<socket_nrclients;i++) {
+		if((client = socket_clients[i]) == NULL) {
+			continue;
+		}
+		uv_mutex_lock(&socket_lock);
+		closing = client->closing;
+		pending = (client->pending.len > 0);
+		uv_mutex_unlock(&socket_lock);
+
+		if(closing == 1) {
+			socket_client_remove(i, 1);
+		} else if(pending == 1) {
+			uv_custom_write(client->poll_req);
+		}
+	}
+}
+
+static void socket_timer_cb(uv_timer_t *handle) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct socket_client_t *client = NULL;
+	time_t now = time(NULL);
+	int i = 0, stalled = 0;
+
+	for(i=0;i<socket_nrclients;i++) {
+		if((client = socket_clients[i]) == NULL) {
+			continue;
+		}
+		uv_mutex_lock(&socket_lock);
+		stalled = (client->pending.lagging == 1 && now - client->pending.lagged > SOCKET_STALL_TIMEOUT);
+		uv_mutex_unlock(&socket_lock);
+
+		if(stalled == 1) {
+			logprintf(LOG_NOTICE, "socket client %d stalled, disconnecting", client->fd);
+			socket_evicted++;
+			socket_client_remove(i, 1);
+		}
+	}
+}
+
+/*
+ * Gives a new client the first free slot, there are more
+ * slots when all are taken.
+ */
+static void socket_client_add(int fd) {
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	struct socket_client_t *client = NULL, **slots = NULL;
+	uv_poll_t *poll_req = NULL;
+	int i = 0, r = 0, nrslots = 0;
+
 #ifdef _WIN32
-				int flags = ioctlsocket(socket_client, FIONBIO, &on);
+	unsigned long on = 1;
+	ioctlsocket(fd, FIONBIO, &on);
 #else
- 				int flags = fcntl(socket_client, F_GETFL, 0);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 #endif
- 				if(flags != -1) {
+
+	if((poll_req = MALLOC(sizeof(uv_poll_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((client = MALLOC(sizeof(struct socket_client_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(client, 0, sizeof(struct socket_client_t));
+	client->fd = fd;
+	client->poll_req = poll_req;
+
+	uv_custom_poll_init(&custom_poll_data, poll_req, (void *)client);
+	custom_poll_data->is_server = 1;
+	custom_poll_data->read_cb = socket_client_read_cb;
+	custom_poll_data->write_cb = socket_client_write_cb;
+	custom_poll_data->close_cb = socket_client_close_cb;
+
+	if((r = uv_poll_init_socket(uv_default_loop(), poll_req, fd)) != 0) {
+		/*LCOV_EXCL_START*/
+		logprintf(LOG_ERR, "uv_poll_init_socket: %s", uv_strerror(r));
 #ifdef _WIN32
-					ioctlsocket(socket_client, FIONBIO, &on);
+		closesocket(fd);
 #else
- 					fcntl(socket_client, F_SETFL, flags | O_NONBLOCK);
+		close(fd);
 #endif
-				}
+		uv_custom_poll_free(custom_poll_data);
+		FREE(poll_req);
+		FREE(client);
+		return;
+		/*LCOV_EXCL_STOP*/
+	}
 
-				//add new socket to array of sockets
-				for(i=0;i<MAX_CLIENTS;i++) {
-					//if position is empty
-					if(socket_clients[i] == 0) {
-						socket_clients[i] = socket_client;
-						if(socket_callback->client_connected_callback)
-							socket_callback->client_connected_callback(i);
-						logprintf(LOG_DEBUG, "client id: %d", i);
-						break;
-					}
-				}
-			}
+	uv_mutex_lock(&socket_lock);
+	for(i=0;i<socket_nrclients;i++) {
+		if(socket_clients[i] == NULL) {
+			break;
 		}
-
-		//else its some IO operation on some other socket :)
-		for(i=1;i<MAX_CLIENTS;i++) {
-			sd = socket_clients[i];
-			if(FD_ISSET((unsigned long)socket_clients[i], &readfds)) {
-				FD_CLR((unsigned long)socket_clients[i], &readfds);
-				if(socket_read(sd, &waitMessage, 0) == 0) {
-					if(socket_callback->client_data_callback) {
-						size_t l = strlen(waitMessage);
-						if(l > 0) {
-							if(strstr(waitMessage, "\n") != NULL) {
-								char **array = NULL;
-								unsigned int n = explode(waitMessage, "\n", &array), q = 0;
-								for(q=0;q<n;q++) {
-									socket_callback->client_data_callback(i, array[q]);
-								}
-								array_free(&array, n);
-							} else {
-								socket_callback->client_data_callback(i, waitMessage);
-							}
-						}
-					}
-				} else {
-					socket_rm_client(i, socket_callback);
-					i--;
-				}
-			}
+	}
+	if(i == socket_nrclients) {
+		nrslots = (socket_nrclients == 0) ? MAX_CLIENTS : socket_nrclients*2;
+		if((slots = REALLOC(socket_clients, sizeof(struct socket_client_t *)*(size_t)nrslots)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
+		memset(&slots[socket_nrclients], 0, sizeof(struct socket_client_t *)*(size_t)(nrslots-socket_nrclients));
+		socket_clients = slots;
+		socket_nrclients = nrslots;
+	}
+	client->slot = i;
+	socket_clients[i] = client;
+	uv_mutex_unlock(&socket_lock);
+
+	logprintf(LOG_DEBUG, "client id: %d", i);
+	if(socket_callback != NULL && socket_callback->client_connected_callback) {
+		socket_callback->client_connected_callback(i);
 	}
 
+	uv_custom_read(poll_req);
+}
+
+static void socket_server_read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct sockaddr_in address;
+	socklen_t addrlen = sizeof(address);
+	char ip[INET_ADDRSTRLEN+1];
+	int client = 0;
+
+	if((client = accept(socket_server, (struct sockaddr *)&address, &addrlen)) < 0) {
+		logprintf(LOG_NOTICE, "accept: %s", strerror(errno));
+		uv_custom_read(req);
+		return;
+	}
+
+	memset(&ip, '\0', INET_ADDRSTRLEN+1);
+	inet_ntop(AF_INET, (void *)&(address.sin_addr), ip, INET_ADDRSTRLEN+1);
+	if(whitelist_check(ip) != 0) {
+		logprintf(LOG_INFO, "rejected client, ip: %s, port: %d", ip, ntohs(address.sin_port));
+		shutdown(client, 2);
 #ifdef _WIN32
-	return 0;
+		closesocket(client);
+#else
+		close(client);
+#endif
+	} else {
+		logprintf(LOG_INFO, "new client, ip: %s, port: %d", ip, ntohs(address.sin_port));
+		logprintf(LOG_DEBUG, "client fd: %d", client);
+
+		static struct linger linger = { 0, 0 };
+		socklen_t lsize = sizeof(struct linger);
+		setsockopt(client, SOL_SOCKET, SO_LINGER, (void *)&linger, lsize);
+
+		socket_client_add(client);
+	}
+
+	uv_custom_read(req);
+}
+
+#ifndef _WIN32
+static void socket_local_read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	int client = 0;
+
+	if((client = accept(socket_local, NULL, NULL)) >= 0) {
+		logprintf(LOG_DEBUG, "new local client, fd: %d", client);
+		socket_client_add(client);
+	}
+
+	uv_custom_read(req);
+}
+#endif
+
+static uv_poll_t *socket_listen(int fd, void (*read_cb)(uv_poll_t *, ssize_t *, char *)) {
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	uv_poll_t *poll_req = NULL;
+	int r = 0;
+
+#ifdef _WIN32
+	unsigned long on = 1;
+	ioctlsocket(fd, FIONBIO, &on);
 #else
- 	return NULL;
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
 #endif
+
+	if((poll_req = MALLOC(sizeof(uv_poll_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	uv_custom_poll_init(&custom_poll_data, poll_req, NULL);
+	custom_poll_data->is_server = 1;
+	/* Accepting is done by the read callback */
+	custom_poll_data->custom_recv = 1;
+	custom_poll_data->read_cb = read_cb;
+
+	if((r = uv_poll_init_socket(uv_default_loop(), poll_req, fd)) != 0) {
+		/*LCOV_EXCL_START*/
+		logprintf(LOG_ERR, "uv_poll_init_socket: %s", uv_strerror(r));
+		uv_custom_poll_free(custom_poll_data);
+		FREE(poll_req);
+		return NULL;
+		/*LCOV_EXCL_STOP*/
+	}
+	uv_custom_read(poll_req);
+
+	return poll_req;
+}
+
+/*
+ * Serve the clients of the sockets opened by socket_start and
+ * socket_start_local from the main loop, next to the webserver.
+ */
+int socket_serve(struct socket_callback_t *callback) {
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	if(uv_thread_equal(&pth_main_id, &pth_cur_id) == 0) {
+		/*LCOV_EXCL_START*/
+		logprintf(LOG_ERR, "socket_serve can only be started from the main thread");
+		return -1;
+		/*LCOV_EXCL_STOP*/
+	}
+
+	socket_callback = callback;
+
+	if((socket_async_req = MALLOC(sizeof(uv_async_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	uv_async_init(uv_default_loop(), socket_async_req, socket_async_cb);
+
+	if((socket_timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	uv_timer_init(uv_default_loop(), socket_timer_req);
+	uv_timer_start(socket_timer_req, socket_timer_cb, 1000, 1000);
+
+	if(socket_server > 0) {
+		socket_server_req = socket_listen(socket_server, socket_server_read_cb);
+	}
+#ifndef _WIN32
+	if(socket_local > 0) {
+		socket_local_req = socket_listen(socket_local, socket_local_read_cb);
+	}
+#endif
+
+	return 0;
 }
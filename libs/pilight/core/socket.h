@@ -20,21 +20,33 @@
 #define _SOCKETS_H_
 
 #include <time.h>
+#include <stddef.h>
+
+struct JsonNode;
 
 typedef struct socket_callback_t {
     void (*client_connected_callback)(int);
     void (*client_disconnected_callback)(int);
     void (*client_data_callback)(int, char*);
+    void (*client_compact_callback)(int, int, const unsigned char *, size_t);
 } socket_callback_t;
 
 /* Start the socket server */
 int socket_start(unsigned short port);
+int socket_start_local(const char *path);
+int socket_connect_local(const char *path);
 int socket_connect(char *address, unsigned short port);
 int socket_timeout_connect(int sockfd, struct sockaddr *serv_addr, int usec);
 void socket_close(int i);
 int socket_write(int sockfd, const char *msg, ...);
+int socket_write_buf(int sockfd, const char *buf, size_t len);
+int socket_write_state(int sockfd, const char *key, const char *buf, size_t len);
+int socket_write_frame(int sockfd, const unsigned char *frame, size_t len);
+void socket_compact_input(int sockfd);
+void socket_compact_output(int sockfd);
+void socket_stats(struct JsonNode *jstats);
 int socket_read(int sockfd, char **out, time_t timeout);
-void *socket_wait(void *param);
+int socket_serve(struct socket_callback_t *callback);
 int socket_gc(void);
 unsigned int socket_get_port(void);
 int socket_get_fd(void);
@@ -49,6 +49,9 @@
 static int ssdp_socket = 0;
 static int ssdp_loop = 1;
 
+/* A cached daemon that doesn't answer this fast is searched for again */
+#define SSDP_CACHE_TIMEOUT	250000
+
 int ssdp_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -233,12 +236,150 @@ end:
 		}
 		*ssdp_list = prev;
 
+		ssdp_cache_write(*ssdp_list);
+
 		return 0;
 	} else {
 		return -1;
 	}
 }
 
+/*
+ * The daemons found by the last search, one "ip port" per
+ * line. Returns -1 when there are none.
+ */
+int ssdp_cache_read(struct ssdp_list_t **ssdp_list) {
+	struct ssdp_list_t *node = NULL, *tail = NULL;
+	unsigned short int nip[4], port = 0;
+	char line[64];
+	FILE *fp = NULL;
+
+	if((fp = fopen(SSDP_CACHE, "r")) == NULL) {
+		return -1;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		if(sscanf(line, "%hu.%hu.%hu.%hu %hu", &nip[0], &nip[1], &nip[2], &nip[3], &port) != 5 ||
+		   nip[0] > 255 || nip[1] > 255 || nip[2] > 255 || nip[3] > 255 || port == 0) {
+			continue;
+		}
+		if((node = MALLOC(sizeof(struct ssdp_list_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		snprintf(node->ip, sizeof(node->ip), "%hu.%hu.%hu.%hu", nip[0], nip[1], nip[2], nip[3]);
+		node->port = port;
+		node->next = NULL;
+		if(tail == NULL) {
+			*ssdp_list = node;
+		} else {
+			tail->next = node;
+		}
+		tail = node;
+	}
+	fclose(fp);
+
+	return (tail == NULL) ? -1 : 0;
+}
+
+/*
+ * Written to a temporary file first, so concurrent tools
+ * never read half a cache.
+ */
+void ssdp_cache_write(struct ssdp_list_t *ssdp_list) {
+	char tmp[sizeof(SSDP_CACHE)+16];
+	FILE *fp = NULL;
+
+	snprintf(tmp, sizeof(tmp), "%s.%d", SSDP_CACHE, (int)getpid());
+	if((fp = fopen(tmp, "w")) == NULL) {
+		logprintf(LOG_DEBUG, "could not write the ssdp cache %s", SSDP_CACHE);
+		return;
+	}
+	while(ssdp_list) {
+		fprintf(fp, "%s %hu\n", ssdp_list->ip, ssdp_list->port);
+		ssdp_list = ssdp_list->next;
+	}
+	if(fclose(fp) != 0 || rename(tmp, SSDP_CACHE) != 0) {
+		unlink(tmp);
+	}
+}
+
+static int ssdp_try(char *ip, unsigned short port) {
+	struct sockaddr_in addr;
+	struct timeval tv;
+	fd_set fdset;
+	int sockfd = 0, error = -1;
+	socklen_t len = sizeof(error);
+#ifdef _WIN32
+	unsigned long on = 1;
+#endif
+
+	if((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		return -1;
+	}
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	inet_pton(AF_INET, ip, &addr.sin_addr);
+
+	/* Connect without blocking, so a stale entry fails fast */
+#ifdef _WIN32
+	ioctlsocket(sockfd, FIONBIO, &on);
+#else
+	fcntl(sockfd, F_SETFL, O_NONBLOCK);
+#endif
+	if(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+		return sockfd;
+	}
+
+	FD_ZERO(&fdset);
+	FD_SET((unsigned long)sockfd, &fdset);
+	tv.tv_sec = 0;
+	tv.tv_usec = SSDP_CACHE_TIMEOUT;
+
+	if(select(sockfd+1, NULL, &fdset, NULL, &tv) == 1 &&
+	   getsockopt(sockfd, SOL_SOCKET, SO_ERROR, (char *)&error, &len) == 0 && error == 0) {
+		return sockfd;
+	}
+	close(sockfd);
+	return -1;
+}
+
+/*
+ * Connects to the daemon of the last search when it still
+ * answers, or else searches again. Either way the socket is
+ * non-blocking like those of socket_connect.
+ */
+int ssdp_connect(void) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct ssdp_list_t *ssdp_list = NULL, *tmp = NULL;
+	int sockfd = -1;
+
+	if(ssdp_cache_read(&ssdp_list) == 0) {
+		tmp = ssdp_list;
+		while(tmp) {
+			if((sockfd = ssdp_try(tmp->ip, tmp->port)) > 0) {
+				logprintf(LOG_DEBUG, "ssdp cache: pilight daemon @%s:%hu", tmp->ip, tmp->port);
+				ssdp_free(ssdp_list);
+				return sockfd;
+			}
+			tmp = tmp->next;
+		}
+		ssdp_free(ssdp_list);
+		ssdp_list = NULL;
+	}
+
+	if(ssdp_seek(&ssdp_list) == -1) {
+		return -1;
+	}
+	if((sockfd = socket_connect(ssdp_list->ip, ssdp_list->port)) == -1) {
+		logprintf(LOG_ERR, "could not connect to pilight-daemon");
+	}
+	ssdp_free(ssdp_list);
+
+	return sockfd;
+}
+
 void ssdp_free(struct ssdp_list_t *ssdp_list) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
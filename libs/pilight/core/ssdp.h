@@ -32,6 +32,9 @@ typedef struct ssdp_list_t {
 int ssdp_gc(void);
 int ssdp_start(void);
 int ssdp_seek(struct ssdp_list_t **ssdp_list);
+int ssdp_connect(void);
+int ssdp_cache_read(struct ssdp_list_t **ssdp_list);
+void ssdp_cache_write(struct ssdp_list_t *ssdp_list);
 void ssdp_free(struct ssdp_list_t *ssdp_list);
 void *ssdp_wait(void* param);
 void ssdp_close(int ssdp_socket);
@@ -10,6 +10,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "../../libuv/uv.h"
 #include "pilight.h"
 #include "ssl.h"
 #include "mem.h"
@@ -17,9 +18,117 @@
 
 #include "../config/settings.h"
 
+#define SSL_SESSIONS	8
+
+/* Handshakes of webserver clients kept for them to resume */
+#define SSL_CACHE_SIZE		50
+#define SSL_CACHE_TIMEOUT	86400
+
+/*
+ * Sessions of the servers we connected to last, so the next
+ * connection to the same host can skip the full handshake.
+ * Only used from the main loop.
+ */
+typedef struct ssl_session_t {
+	char *host;
+	mbedtls_ssl_session session;
+} ssl_session_t;
+
+static struct ssl_session_t ssl_sessions[SSL_SESSIONS];
+static unsigned int ssl_session_next = 0;
+
 static int client_success = 0;
 static int server_success = 0;
 
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+static mbedtls_ssl_ticket_context ssl_ticket;
+static int ssl_ticket_init = 0;
+#endif
+
+/*
+ * With ssl-offload the handshakes and records are handled on
+ * the threadpool, see uv_custom_poll_cb. The random generator,
+ * the session cache and the ticket keys are shared by all
+ * connections, so they are used under a lock then.
+ */
+static int offload = 0;
+static uv_mutex_t ssl_rng_lock;
+static uv_mutex_t ssl_store_lock;
+
+static int ssl_rng(void *ctx, unsigned char *buf, size_t len) {
+	int r = 0;
+
+	uv_mutex_lock(&ssl_rng_lock);
+	r = mbedtls_ctr_drbg_random(ctx, buf, len);
+	uv_mutex_unlock(&ssl_rng_lock);
+	return r;
+}
+
+static int ssl_cache_get(void *ctx, mbedtls_ssl_session *session) {
+	int r = 0;
+
+	uv_mutex_lock(&ssl_store_lock);
+	r = mbedtls_ssl_cache_get(ctx, session);
+	uv_mutex_unlock(&ssl_store_lock);
+	return r;
+}
+
+static int ssl_cache_set(void *ctx, const mbedtls_ssl_session *session) {
+	int r = 0;
+
+	uv_mutex_lock(&ssl_store_lock);
+	r = mbedtls_ssl_cache_set(ctx, session);
+	uv_mutex_unlock(&ssl_store_lock);
+	return r;
+}
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+static int ssl_ticket_write(void *ctx, const mbedtls_ssl_session *session, unsigned char *start, const unsigned char *end, size_t *tlen, uint32_t *lifetime) {
+	int r = 0;
+
+	uv_mutex_lock(&ssl_store_lock);
+	r = mbedtls_ssl_ticket_write(ctx, session, start, end, tlen, lifetime);
+	uv_mutex_unlock(&ssl_store_lock);
+	return r;
+}
+
+static int ssl_ticket_parse(void *ctx, mbedtls_ssl_session *session, unsigned char *buf, size_t len) {
+	int r = 0;
+
+	uv_mutex_lock(&ssl_store_lock);
+	r = mbedtls_ssl_ticket_parse(ctx, session, buf, len);
+	uv_mutex_unlock(&ssl_store_lock);
+	return r;
+}
+#endif
+
+/*
+ * Forward secret suites with an AEAD cipher only. ChaCha20 goes
+ * first, on boards without AES instructions it's several times
+ * faster than AES.
+ */
+static const int ssl_fast_ciphers[] = {
+#ifdef MBEDTLS_CHACHAPOLY_C
+	MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+	MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+#endif
+	MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+	MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+	MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_256_GCM_SHA384,
+	MBEDTLS_TLS_ECDHE_RSA_WITH_AES_256_GCM_SHA384,
+	0
+};
+
+#ifdef MBEDTLS_ECP_C
+static const mbedtls_ecp_group_id ssl_fast_curves[] = {
+#ifdef MBEDTLS_ECP_DP_CURVE25519_ENABLED
+	MBEDTLS_ECP_DP_CURVE25519,
+#endif
+	MBEDTLS_ECP_DP_SECP256R1,
+	MBEDTLS_ECP_DP_NONE
+};
+#endif
+
 int ssl_client_init_status(void) {
 	return client_success;
 }
@@ -28,6 +137,10 @@ int ssl_server_init_status(void) {
 	return server_success;
 }
 
+int ssl_offload(void) {
+	return offload;
+}
+
 void ssl_init(void) {
 	char *pemfile = NULL, buffer[BUFFER_SIZE];
 	int ret = 0;
@@ -80,11 +193,66 @@ void ssl_init(void) {
 		}
 	}
 
-	mbedtls_ssl_conf_rng(&ssl_client_conf, mbedtls_ctr_drbg_random, &ssl_ctr_drbg);
-	mbedtls_ssl_conf_rng(&ssl_server_conf, mbedtls_ctr_drbg_random, &ssl_ctr_drbg);
+	config_setting_get_number("ssl-offload", 0, &offload);
+	if(offload == 1) {
+		uv_mutex_init(&ssl_rng_lock);
+		uv_mutex_init(&ssl_store_lock);
+		mbedtls_ssl_conf_rng(&ssl_client_conf, ssl_rng, &ssl_ctr_drbg);
+		mbedtls_ssl_conf_rng(&ssl_server_conf, ssl_rng, &ssl_ctr_drbg);
+		mbedtls_ssl_conf_session_cache(&ssl_client_conf, &ssl_cache, ssl_cache_get, ssl_cache_set);
+	} else {
+		offload = 0;
+		mbedtls_ssl_conf_rng(&ssl_client_conf, mbedtls_ctr_drbg_random, &ssl_ctr_drbg);
+		mbedtls_ssl_conf_rng(&ssl_server_conf, mbedtls_ctr_drbg_random, &ssl_ctr_drbg);
+		mbedtls_ssl_conf_session_cache(&ssl_client_conf, &ssl_cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+	}
 	mbedtls_ssl_conf_authmode(&ssl_client_conf, MBEDTLS_SSL_VERIFY_NONE);
-	mbedtls_ssl_conf_session_cache(&ssl_server_conf, &ssl_cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
-	mbedtls_ssl_conf_session_cache(&ssl_client_conf, &ssl_cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+
+	if(server_success == 0) {
+		int size = SSL_CACHE_SIZE, timeout = SSL_CACHE_TIMEOUT, tickets = 1, fast = 0;
+
+		config_setting_get_number("webserver-ssl-session-cache", 0, &size);
+		config_setting_get_number("webserver-ssl-session-timeout", 0, &timeout);
+		config_setting_get_number("webserver-ssl-session-tickets", 0, &tickets);
+		config_setting_get_number("webserver-ssl-fast-ciphers", 0, &fast);
+		if(timeout <= 0) {
+			timeout = SSL_CACHE_TIMEOUT;
+		}
+
+		/* A maximum of zero means an unlimited cache to mbed TLS */
+		if(size > 0) {
+			mbedtls_ssl_cache_set_max_entries(&ssl_cache, size);
+			mbedtls_ssl_cache_set_timeout(&ssl_cache, timeout);
+			if(offload == 1) {
+				mbedtls_ssl_conf_session_cache(&ssl_server_conf, &ssl_cache, ssl_cache_get, ssl_cache_set);
+			} else {
+				mbedtls_ssl_conf_session_cache(&ssl_server_conf, &ssl_cache, mbedtls_ssl_cache_get, mbedtls_ssl_cache_set);
+			}
+		}
+
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+		/* Clients keep their own session, so nothing is stored for them */
+		if(tickets == 1) {
+			mbedtls_ssl_ticket_init(&ssl_ticket);
+			ssl_ticket_init = 1;
+			if((ret = mbedtls_ssl_ticket_setup(&ssl_ticket, (offload == 1) ? ssl_rng : mbedtls_ctr_drbg_random, &ssl_ctr_drbg, MBEDTLS_CIPHER_AES_256_GCM, (uint32_t)timeout)) != 0) {
+				mbedtls_strerror(ret, (char *)&buffer, BUFFER_SIZE);
+				logprintf(LOG_NOTICE, "mbedtls_ssl_ticket_setup failed: %s", buffer);
+			} else if(offload == 1) {
+				mbedtls_ssl_conf_session_tickets_cb(&ssl_server_conf, ssl_ticket_write, ssl_ticket_parse, &ssl_ticket);
+			} else {
+				mbedtls_ssl_conf_session_tickets_cb(&ssl_server_conf, mbedtls_ssl_ticket_write, mbedtls_ssl_ticket_parse, &ssl_ticket);
+			}
+		}
+#endif
+
+		if(fast == 1) {
+			mbedtls_ssl_conf_ciphersuites(&ssl_server_conf, ssl_fast_ciphers);
+#ifdef MBEDTLS_ECP_C
+			mbedtls_ssl_conf_curves(&ssl_server_conf, ssl_fast_curves);
+#endif
+		}
+	}
 
 	memset(&ssl_server_crt, 0, sizeof(mbedtls_x509_crt));
 	mbedtls_x509_crt_init(&ssl_server_crt);
@@ -123,14 +291,76 @@ void ssl_init(void) {
 	}
 }
 
+void ssl_session_resume(char *host, mbedtls_ssl_context *ctx) {
+	int i = 0;
+
+	for(i=0;i<SSL_SESSIONS;i++) {
+		if(ssl_sessions[i].host != NULL && strcmp(ssl_sessions[i].host, host) == 0) {
+			mbedtls_ssl_set_session(ctx, &ssl_sessions[i].session);
+			break;
+		}
+	}
+}
+
+void ssl_session_store(char *host, mbedtls_ssl_context *ctx) {
+	struct ssl_session_t *node = NULL;
+	int i = 0;
+
+	for(i=0;i<SSL_SESSIONS;i++) {
+		if(ssl_sessions[i].host != NULL && strcmp(ssl_sessions[i].host, host) == 0) {
+			node = &ssl_sessions[i];
+			break;
+		}
+	}
+	if(node == NULL) {
+		node = &ssl_sessions[ssl_session_next++ % SSL_SESSIONS];
+		if(node->host != NULL) {
+			FREE(node->host);
+			node->host = NULL;
+		}
+		if((node->host = STRDUP(host)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	} else {
+		mbedtls_ssl_session_free(&node->session);
+	}
+	mbedtls_ssl_session_init(&node->session);
+	if(mbedtls_ssl_get_session(ctx, &node->session) != 0) {
+		mbedtls_ssl_session_free(&node->session);
+		FREE(node->host);
+		node->host = NULL;
+	}
+}
+
 void ssl_gc(void) {
+	int i = 0;
+
 	client_success = 0;
 	server_success = 0;
 
+	for(i=0;i<SSL_SESSIONS;i++) {
+		if(ssl_sessions[i].host != NULL) {
+			mbedtls_ssl_session_free(&ssl_sessions[i].session);
+			FREE(ssl_sessions[i].host);
+			ssl_sessions[i].host = NULL;
+		}
+	}
+
 	mbedtls_entropy_free(&ssl_entropy);
 	mbedtls_ssl_config_free(&ssl_server_conf);
 	mbedtls_ssl_config_free(&ssl_client_conf);
 	mbedtls_x509_crt_free(&ssl_server_crt);
 	mbedtls_pk_free(&ssl_pk_key);
 	mbedtls_ssl_cache_free(&ssl_cache);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS) && defined(MBEDTLS_SSL_TICKET_C)
+	if(ssl_ticket_init == 1) {
+		mbedtls_ssl_ticket_free(&ssl_ticket);
+		ssl_ticket_init = 0;
+	}
+#endif
+	if(offload == 1) {
+		uv_mutex_destroy(&ssl_rng_lock);
+		uv_mutex_destroy(&ssl_store_lock);
+		offload = 0;
+	}
 }
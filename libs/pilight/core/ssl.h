@@ -25,6 +25,7 @@
 #include <mbedtls/debug.h>
 #include <mbedtls/cipher.h>
 #include <mbedtls/ssl_cache.h>
+#include <mbedtls/ssl_ticket.h>
 
 mbedtls_entropy_context ssl_entropy;
 mbedtls_ctr_drbg_context ssl_ctr_drbg;
@@ -36,7 +37,10 @@ struct mbedtls_ssl_config ssl_server_conf;
 
 int ssl_client_init_status(void);
 int ssl_server_init_status(void);
+int ssl_offload(void);
 void ssl_init(void);
+void ssl_session_resume(char *host, mbedtls_ssl_context *ctx);
+void ssl_session_store(char *host, mbedtls_ssl_context *ctx);
 void ssl_gc(void);
 
 #endif
@@ -0,0 +1,242 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * A stage of the daemon pipeline. Items are kept in a fixed
+ * ring of preallocated slots, so any thread, even a receiver
+ * at realtime priority, can queue one without taking a lock or
+ * allocating memory. Every slot carries a sequence number that
+ * tells if it is free for the producers, or filled for the
+ * workers of the stage. A producer claims a slot, fills it in
+ * place and publishes it, a worker takes it and releases it
+ * after handling it.
+ *
+ * Workers only sleep when the ring is empty, so a burst is
+ * drained without waiting on the semaphore for every item. A
+ * full ring either makes the producer wait a little, or drops
+ * the item when it can't wait.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+	#include <unistd.h>
+#endif
+
+#include "mem.h"
+#include "log.h"
+#include "stage.h"
+
+/* The slot header, in front of the item */
+#define STAGE_HEADER	16
+
+typedef struct stage_slot_t {
+	volatile unsigned int seq;
+} stage_slot_t;
+
+static struct stage_slot_t *stage_slot(struct stage_t *stage, unsigned int pos) {
+	return (struct stage_slot_t *)&stage->slots[(size_t)(pos & (stage->nrslots-1))*stage->stride];
+}
+
+static struct stage_slot_t *stage_item_slot(void *item) {
+	return (struct stage_slot_t *)((unsigned char *)item-STAGE_HEADER);
+}
+
+/*
+ * The number of slots is rounded up to a power of two, so
+ * the positions can wrap around.
+ */
+int stage_init(struct stage_t *stage, const char *name, unsigned int nrslots, size_t size) {
+	unsigned int i = 0, n = 2;
+
+	memset(stage, 0, sizeof(struct stage_t));
+
+	while(n < nrslots) {
+		n <<= 1;
+	}
+	stage->nrslots = n;
+	/* Keep every slot on cache lines of its own */
+	stage->stride = (STAGE_HEADER+size+63) & ~(size_t)63;
+
+	if((stage->slots = MALLOC(stage->stride*n)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(stage->slots, 0, stage->stride*n);
+	for(i=0;i<n;i++) {
+		stage_slot(stage, i)->seq = i;
+	}
+	if((stage->name = STRDUP(name)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+
+	stage->depth = metrics_get(METRIC_GAUGE, "pilight_stage_depth", "Items waiting in a stage of the pipeline", "stage", name);
+	stage->dropped = metrics_get(METRIC_COUNTER, "pilight_stage_dropped_total", "Items dropped because a stage was full", "stage", name);
+	stage->processed = metrics_get(METRIC_COUNTER, "pilight_stage_processed_total", "Items handled by a stage", "stage", name);
+	stage->waited = metrics_get(METRIC_COUNTER, "pilight_stage_waited_total", "Times a producer waited for room in a stage", "stage", name);
+
+	uv_sem_init(&stage->signal, 0);
+	stage->running = 1;
+
+	return 0;
+}
+
+/*
+ * Claims a slot to fill. When the stage is full the producer
+ * waits up to wait milliseconds for room, after that the
+ * item is dropped and NULL returned. A negative wait keeps
+ * waiting until the stage is stopped.
+ */
+void *stage_claim(struct stage_t *stage, int wait) {
+	struct stage_slot_t *slot = NULL;
+	unsigned int pos = 0;
+	int diff = 0, waited = 0;
+
+	if(stage->slots == NULL || stage->running == 0) {
+		return NULL;
+	}
+
+	pos = stage->head;
+	while(1) {
+		slot = stage_slot(stage, pos);
+		diff = (int)(slot->seq - pos);
+		if(diff == 0) {
+			if(__sync_bool_compare_and_swap(&stage->head, pos, pos+1)) {
+				break;
+			}
+		} else if(diff < 0) {
+			if((wait >= 0 && waited >= wait) || stage->running == 0) {
+				metrics_inc(stage->dropped, 1);
+				return NULL;
+			}
+			if(waited == 0) {
+				metrics_inc(stage->waited, 1);
+			}
+			waited++;
+			usleep(1000);
+		}
+		pos = stage->head;
+	}
+
+	return (unsigned char *)slot+STAGE_HEADER;
+}
+
+void stage_publish(struct stage_t *stage, void *item) {
+	struct stage_slot_t *slot = stage_item_slot(item);
+
+	__sync_synchronize();
+	slot->seq = slot->seq+1;
+	__sync_synchronize();
+	if(stage->sleeping > 0) {
+		uv_sem_post(&stage->signal);
+	}
+}
+
+/*
+ * Takes the oldest item, waiting for one when the stage is
+ * empty. Returns NULL once the stage was stopped.
+ */
+void *stage_take(struct stage_t *stage) {
+	struct stage_slot_t *slot = NULL;
+	unsigned int pos = 0;
+	int diff = 0;
+
+	__sync_add_and_fetch(&stage->workers, 1);
+	while(stage->running == 1) {
+		pos = stage->tail;
+		slot = stage_slot(stage, pos);
+		diff = (int)(slot->seq - (pos+1));
+		if(diff == 0) {
+			if(__sync_bool_compare_and_swap(&stage->tail, pos, pos+1)) {
+				__sync_synchronize();
+				return (unsigned char *)slot+STAGE_HEADER;
+			}
+		} else if(diff < 0) {
+			if(stage->head == pos) {
+				__sync_add_and_fetch(&stage->sleeping, 1);
+				/* A producer may have claimed a slot in between */
+				if(stage->running == 1 && stage->head == pos) {
+					uv_sem_wait(&stage->signal);
+				}
+				__sync_sub_and_fetch(&stage->sleeping, 1);
+			} else {
+				/* Claimed, but not yet filled */
+				usleep(1);
+			}
+		}
+	}
+	__sync_sub_and_fetch(&stage->workers, 1);
+
+	return NULL;
+}
+
+/*
+ * Gives the slot of a handled item back to the producers.
+ */
+void stage_release(struct stage_t *stage, void *item) {
+	struct stage_slot_t *slot = stage_item_slot(item);
+
+	__sync_synchronize();
+	slot->seq = slot->seq+stage->nrslots-1;
+	metrics_inc(stage->processed, 1);
+	__sync_sub_and_fetch(&stage->workers, 1);
+}
+
+unsigned int stage_depth(struct stage_t *stage) {
+	return stage->head-stage->tail;
+}
+
+void stage_collect(struct stage_t *stage) {
+	if(stage->slots != NULL) {
+		metrics_set(stage->depth, (double)stage_depth(stage));
+	}
+}
+
+void stage_stop(struct stage_t *stage) {
+	int i = 0;
+
+	if(stage->slots == NULL) {
+		return;
+	}
+	stage->running = 0;
+	__sync_synchronize();
+	for(i=0;i<stage->sleeping;i++) {
+		uv_sem_post(&stage->signal);
+	}
+}
+
+/*
+ * Frees the stage once its workers let go of it. What is
+ * still queued is handed to func first.
+ */
+void stage_gc(struct stage_t *stage, void (*func)(void *)) {
+	struct stage_slot_t *slot = NULL;
+	unsigned int pos = 0;
+
+	if(stage->slots == NULL) {
+		return;
+	}
+	stage_stop(stage);
+	while(stage->workers > 0) {
+		stage_stop(stage);
+		usleep(10);
+	}
+
+	for(pos=stage->tail;pos!=stage->head;pos++) {
+		slot = stage_slot(stage, pos);
+		if(func != NULL && slot->seq == pos+1) {
+			func((unsigned char *)slot+STAGE_HEADER);
+		}
+	}
+
+	uv_sem_destroy(&stage->signal);
+	FREE(stage->slots);
+	FREE(stage->name);
+	stage->nrslots = 0;
+	logprintf(LOG_DEBUG, "garbage collected pipeline stage");
+}
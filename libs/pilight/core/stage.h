@@ -0,0 +1,46 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _STAGE_H_
+#define _STAGE_H_
+
+#include <stddef.h>
+
+#include "../../libuv/uv.h"
+#include "metrics.h"
+
+typedef struct stage_t {
+	char *name;
+	unsigned int nrslots;
+	size_t stride;
+	unsigned char *slots;
+
+	volatile unsigned int head __attribute__((aligned(64)));
+	volatile unsigned int tail __attribute__((aligned(64)));
+	volatile int sleeping;
+	volatile int workers;
+	volatile int running;
+	uv_sem_t signal;
+
+	struct metric_t *depth;
+	struct metric_t *dropped;
+	struct metric_t *processed;
+	struct metric_t *waited;
+} stage_t;
+
+int stage_init(struct stage_t *stage, const char *name, unsigned int nrslots, size_t size);
+void *stage_claim(struct stage_t *stage, int wait);
+void stage_publish(struct stage_t *stage, void *item);
+void *stage_take(struct stage_t *stage);
+void stage_release(struct stage_t *stage, void *item);
+unsigned int stage_depth(struct stage_t *stage);
+void stage_collect(struct stage_t *stage);
+void stage_stop(struct stage_t *stage);
+void stage_gc(struct stage_t *stage, void (*func)(void *));
+
+#endif
@@ -16,6 +16,9 @@
 	along with pilight. If not, see	<http://www.gnu.org/licenses/>
 */
 
+#ifdef __linux__
+	#define _GNU_SOURCE
+#endif
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -27,10 +30,14 @@
 	#endif
 #endif
 #include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <time.h>
 #include <sys/time.h>
 
 #include "threads.h"
 #include "common.h"
+#include "json.h"
 #include "log.h"
 #include "mem.h"
 
@@ -48,6 +55,32 @@ static int threads_loop_running = 0;
 static int thread_started = 0;
 static pthread_t pth;
 
+/* Attributes of the registered threads, with a smaller stack when configured */
+static pthread_attr_t thread_attr;
+static int thread_attr_init = 0;
+
+/* The core every realtime role is pinned to, -1 leaves it free */
+static int thread_rt_cores[THREAD_RT_ROLES] = { -1, -1 };
+static char *thread_rt_names[THREAD_RT_ROLES] = { "receiver", "sender" };
+
+/*
+ * Work that runs on the shared worker pool instead of a
+ * thread of its own. Only its cpu time is accounted, as the
+ * pool threads are shared.
+ */
+typedef struct threadtask_t {
+	char *id;
+	double cpu;
+	double last;
+	/* Share of one cpu over the last sample */
+	double per;
+	struct threadtask_t *next;
+} threadtask_t;
+
+static pthread_mutex_t threadtask_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct threadtask_t *threadtasks = NULL;
+static double threadtask_ts = 0;
+
 struct threadqueue_t *threads_register(const char *id, void *(*function)(void *param), void *param, int force) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -125,6 +158,20 @@ void threads_create(pthread_t *thread, const pthread_attr_t *attr,  void *(*star
 #endif
 }
 
+/*
+ * Threads carry the id they were registered with, so their
+ * cpu time can be told apart in /proc/self/task.
+ */
+static void threads_name(pthread_t thread, const char *id) {
+#ifdef __linux__
+	char name[16];
+
+	strncpy(name, id, sizeof(name)-1);
+	name[sizeof(name)-1] = '\0';
+	pthread_setname_np(thread, name);
+#endif
+}
+
 void thread_signal(char *id, int s) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -158,7 +205,8 @@ static void *threads_loop(void *param) {
 				}
 				tmp_threads = tmp_threads->next;
 			}
-			threads_create(&tmp_threads->pth, NULL, tmp_threads->function, (void *)tmp_threads->param);
+			threads_create(&tmp_threads->pth, (thread_attr_init == 1) ? &thread_attr : NULL, tmp_threads->function, (void *)tmp_threads->param);
+			threads_name(tmp_threads->pth, tmp_threads->id);
 			thread_running++;
 			tmp_threads->running = 1;
 			if(thread_running == 1) {
@@ -236,12 +284,122 @@ void thread_stop(char *id) {
 	}
 }
 
+/*
+ * Set the stack size in bytes of the threads started after
+ * this call.
+ */
+void threads_stack_size(size_t size) {
+#ifdef PTHREAD_STACK_MIN
+	if(size < PTHREAD_STACK_MIN) {
+		size = PTHREAD_STACK_MIN;
+	}
+#endif
+	if(thread_attr_init == 0) {
+		pthread_attr_init(&thread_attr);
+		thread_attr_init = 1;
+	}
+	if(pthread_attr_setstacksize(&thread_attr, size) != 0) {
+		logprintf(LOG_NOTICE, "cannot set the thread stack size to %zu bytes", size);
+	}
+}
+
+void threads_realtime_core(int role, int core) {
+	if(role >= 0 && role < THREAD_RT_ROLES) {
+		thread_rt_cores[role] = core;
+	}
+}
+
+/* The core a role is pinned to, -1 when it can run on any */
+int threads_realtime_pinned(int role) {
+	if(role >= 0 && role < THREAD_RT_ROLES) {
+		return thread_rt_cores[role];
+	}
+	return -1;
+}
+
+/*
+ * Touch the stack the realtime loop will use, so it doesn't
+ * page fault while timing pulses.
+ */
+static void threads_prefault(void) {
+	volatile unsigned char stack[THREAD_RT_PREFAULT];
+	size_t i = 0;
+
+	for(i=0;i<sizeof(stack);i+=256) {
+		stack[i] = 0;
+	}
+}
+
+/*
+ * Gives the calling thread a realtime priority, pins it to
+ * the core configured for its role and prefaults its stack.
+ */
+void threads_realtime(int role, int policy, int priority) {
+#ifdef _WIN32
+	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+#else
+	struct sched_param sched;
+
+	memset(&sched, 0, sizeof(sched));
+	sched.sched_priority = priority;
+	pthread_setschedparam(pthread_self(), policy, &sched);
+
+	#ifdef __linux__
+	if(role >= 0 && role < THREAD_RT_ROLES && thread_rt_cores[role] >= 0) {
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(thread_rt_cores[role], &cpuset);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+			logprintf(LOG_WARNING, "unable to pin the %s to core %d", thread_rt_names[role], thread_rt_cores[role]);
+		}
+	}
+	#endif
+#endif
+	threads_prefault();
+}
+
+/*
+ * Add the cpu time a task used on the worker pool.
+ */
+void threads_task_cpu(const char *id, double seconds) {
+	struct threadtask_t *tmp = NULL;
+
+	pthread_mutex_lock(&threadtask_lock);
+	tmp = threadtasks;
+	while(tmp) {
+		if(strcmp(tmp->id, id) == 0) {
+			break;
+		}
+		tmp = tmp->next;
+	}
+	if(tmp == NULL) {
+		if((tmp = MALLOC(sizeof(struct threadtask_t))) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(tmp, 0, sizeof(struct threadtask_t));
+		if((tmp->id = MALLOC(strlen(id)+1)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		strcpy(tmp->id, id);
+		tmp->next = threadtasks;
+		threadtasks = tmp;
+	}
+	tmp->cpu += seconds;
+	pthread_mutex_unlock(&threadtask_lock);
+}
+
 void threads_cpu_usage(int print) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	if(print == 1) {
 		logprintf(LOG_INFO, "----- Thread Profiling -----");
 	}
+#ifdef __linux__
+	/* One pass over /proc/self/task instead of a query per thread */
+	proc_threads_sample();
+#else
 	struct threadqueue_t *tmp_threads = threadqueue;
 	while(tmp_threads) {
 		if(tmp_threads->running == 1) {
@@ -256,11 +414,68 @@ void threads_cpu_usage(int print) {
 		}
 		tmp_threads = tmp_threads->next;
 	}
+#endif
+
+	/* Tasks report their share of one cpu since the last call */
+	struct threadtask_t *tmp_tasks = NULL;
+	struct timeval tv;
+	double now = 0, elapsed = 0;
+
+	gettimeofday(&tv, NULL);
+	now = (double)tv.tv_sec + (double)tv.tv_usec/1000000;
+	elapsed = now - threadtask_ts;
+
+	pthread_mutex_lock(&threadtask_lock);
+	tmp_tasks = threadtasks;
+	while(tmp_tasks) {
+		if(threadtask_ts > 0 && elapsed > 0) {
+			tmp_tasks->per = ((tmp_tasks->cpu - tmp_tasks->last) / elapsed) * 100;
+			if(print == 1) {
+				logprintf(LOG_INFO, "- task %s: %f%%", tmp_tasks->id, tmp_tasks->per);
+			}
+		}
+		tmp_tasks->last = tmp_tasks->cpu;
+		tmp_tasks = tmp_tasks->next;
+	}
+	pthread_mutex_unlock(&threadtask_lock);
+	threadtask_ts = now;
+
 	if(print == 1) {
 		logprintf(LOG_INFO, "----- Thread Profiling -----");
 	}
 }
 
+/*
+ * The cpu usage of the last threads_cpu_usage call, per
+ * thread name and per worker pool task.
+ */
+void threads_stats(struct JsonNode *jstats) {
+	struct threadtask_t *tmp_tasks = NULL;
+	char key[128];
+
+#ifdef __linux__
+	proc_threads_stats(jstats);
+#else
+	struct threadqueue_t *tmp_threads = threadqueue;
+	while(tmp_threads) {
+		if(tmp_threads->running == 1) {
+			snprintf(key, sizeof(key), "cpu-thread-%s", tmp_threads->id);
+			json_append_member(jstats, key, json_mknumber(tmp_threads->cpu_usage.cpu_per, 2));
+		}
+		tmp_threads = tmp_threads->next;
+	}
+#endif
+
+	pthread_mutex_lock(&threadtask_lock);
+	tmp_tasks = threadtasks;
+	while(tmp_tasks) {
+		snprintf(key, sizeof(key), "cpu-task-%s", tmp_tasks->id);
+		json_append_member(jstats, key, json_mknumber(tmp_tasks->per, 2));
+		tmp_tasks = tmp_tasks->next;
+	}
+	pthread_mutex_unlock(&threadtask_lock);
+}
+
 int threads_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -310,6 +525,22 @@ int threads_gc(void) {
 		pthread_join(pth, NULL);
 	}
 
+	pthread_mutex_lock(&threadtask_lock);
+	struct threadtask_t *tmp_tasks = NULL;
+	while(threadtasks) {
+		tmp_tasks = threadtasks;
+		threadtasks = threadtasks->next;
+		FREE(tmp_tasks->id);
+		FREE(tmp_tasks);
+	}
+	threadtask_ts = 0;
+	pthread_mutex_unlock(&threadtask_lock);
+
+	if(thread_attr_init == 1) {
+		pthread_attr_destroy(&thread_attr);
+		thread_attr_init = 0;
+	}
+
 	logprintf(LOG_DEBUG, "garbage collected threads library");
 	return EXIT_SUCCESS;
 }
@@ -25,6 +25,14 @@
 #include <pthread.h>
 #include "proc.h"
 
+struct JsonNode;
+
+#define THREAD_RT_RECEIVE	0
+#define THREAD_RT_SEND		1
+#define THREAD_RT_ROLES		2
+/* The bytes of stack touched by threads_realtime */
+#define THREAD_RT_PREFAULT	(32*1024)
+
 struct threadqueue_t {
 	unsigned int ts;
 	pthread_t pth;
@@ -45,6 +53,12 @@ void threads_create(pthread_t *pth, const pthread_attr_t *attr,  void *(*start_r
 void threads_start(void);
 void thread_stop(char *id);
 void threads_cpu_usage(int print);
+void threads_stats(struct JsonNode *jstats);
+void threads_stack_size(size_t size);
+void threads_realtime_core(int role, int core);
+int threads_realtime_pinned(int role);
+void threads_realtime(int role, int policy, int priority);
+void threads_task_cpu(const char *id, double seconds);
 int threads_gc(void);
 void thread_signal(char *id, int signal);
 
@@ -0,0 +1,216 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Latency tracing of received codes. A trace is started when
+ * the hardware captured a pulse train and copied along with
+ * it through the receive queue, the parser and the broadcast
+ * queue. The events and the webserver only get the broadcasted
+ * string, so those traces are found back by the contents of
+ * that string. Every stage is kept in a ring of the last events
+ * and the time since the capture is added to a histogram.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../../libuv/uv.h"
+#include "pilight.h"
+#include "mem.h"
+#include "json.h"
+#include "metrics.h"
+#include "trace.h"
+
+#define TRACE_MESSAGES	64
+/* Messages broadcasted longer ago aren't matched anymore */
+#define TRACE_EXPIRE		10000000000ULL
+
+typedef struct trace_event_t {
+	unsigned int id;
+	int stage;
+	uint64_t start;
+	uint64_t end;
+} trace_event_t;
+
+typedef struct trace_message_t {
+	unsigned int hash;
+	struct trace_t trace;
+} trace_message_t;
+
+static const char *stages[TRACE_STAGES] = {
+	"capture", "queued", "parsed", "devices", "broadcast", "events", "websocket"
+};
+
+static struct trace_event_t *events = NULL;
+static unsigned int nrevents = 0;
+static volatile unsigned int events_pos = 0;
+static volatile unsigned int ids = 0;
+
+static struct trace_message_t messages[TRACE_MESSAGES];
+static unsigned int messages_pos = 0;
+static pthread_mutex_t messages_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct metric_t *metric_stages[TRACE_STAGES];
+
+static unsigned int trace_hash(const char *message) {
+	unsigned int hash = 2166136261U;
+
+	while(*message != '\0') {
+		hash ^= (unsigned char)*message++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Enables tracing and keeps the last size stages.
+ */
+void trace_init(int size) {
+	int i = 0;
+
+	if(size <= 0 || events != NULL) {
+		return;
+	}
+	if((events = MALLOC(sizeof(struct trace_event_t)*(size_t)size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(events, 0, sizeof(struct trace_event_t)*(size_t)size);
+	memset(messages, 0, sizeof(messages));
+
+	for(i=0;i<TRACE_STAGES;i++) {
+		metric_stages[i] = metrics_get(METRIC_HISTOGRAM, "pilight_trace_latency_seconds", "Time since the capture of a pulse train at each stage", "stage", stages[i]);
+	}
+	nrevents = (unsigned int)size;
+}
+
+void trace_start(struct trace_t *trace) {
+	if(nrevents == 0) {
+		trace->id = 0;
+		return;
+	}
+	/* Zero is reserved for untraced codes */
+	while((trace->id = __sync_add_and_fetch(&ids, 1)) == 0);
+	trace->stamp = uv_hrtime();
+	trace->last = trace->stamp;
+	trace_stage(trace, TRACE_CAPTURE);
+}
+
+/*
+ * Called by the receivers and parsers as well, so claiming a
+ * slot in the ring doesn't take a lock.
+ */
+void trace_stage(struct trace_t *trace, int stage) {
+	struct trace_event_t *event = NULL;
+	uint64_t now = 0;
+
+	if(trace == NULL || trace->id == 0 || nrevents == 0 || stage < 0 || stage >= TRACE_STAGES) {
+		return;
+	}
+
+	now = uv_hrtime();
+	event = &events[__sync_fetch_and_add(&events_pos, 1) % nrevents];
+	event->id = trace->id;
+	event->stage = stage;
+	event->start = trace->last;
+	event->end = now;
+	trace->last = now;
+
+	metrics_observe(metric_stages[stage], now - trace->stamp);
+}
+
+/*
+ * Remember the trace of a broadcasted message, for those
+ * that only get the message itself.
+ */
+void trace_attach(const char *message, struct trace_t *trace) {
+	if(trace == NULL || trace->id == 0 || nrevents == 0) {
+		return;
+	}
+	pthread_mutex_lock(&messages_lock);
+	messages[messages_pos].hash = trace_hash(message);
+	messages[messages_pos].trace = *trace;
+	messages_pos = (messages_pos + 1) % TRACE_MESSAGES;
+	pthread_mutex_unlock(&messages_lock);
+}
+
+int trace_find(const char *message, struct trace_t *trace) {
+	unsigned int hash = 0, i = 0, x = 0;
+	uint64_t now = 0;
+
+	trace->id = 0;
+	if(nrevents == 0) {
+		return -1;
+	}
+
+	hash = trace_hash(message);
+	now = uv_hrtime();
+
+	pthread_mutex_lock(&messages_lock);
+	/* The same message can be sent again, so look for the latest */
+	for(i=1;i<=TRACE_MESSAGES;i++) {
+		x = (messages_pos + TRACE_MESSAGES - i) % TRACE_MESSAGES;
+		if(messages[x].trace.id != 0 && messages[x].hash == hash &&
+		   now - messages[x].trace.stamp < TRACE_EXPIRE) {
+			*trace = messages[x].trace;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&messages_lock);
+
+	return (trace->id != 0) ? 0 : -1;
+}
+
+/*
+ * Returns the recorded stages in the Chrome trace event format,
+ * every traced code on its own row. The caller has to free the
+ * result with json_free.
+ */
+char *trace_print(size_t *len) {
+	struct JsonNode *jroot = json_mkobject();
+	struct JsonNode *jevents = json_mkarray();
+	struct JsonNode *jevent = NULL;
+	struct trace_event_t event;
+	unsigned int i = 0;
+	char *out = NULL;
+
+	for(i=0;i<nrevents;i++) {
+		event = events[i];
+		if(event.id == 0) {
+			continue;
+		}
+		jevent = json_mkobject();
+		json_append_member(jevent, "name", json_mkstring(stages[event.stage]));
+		json_append_member(jevent, "cat", json_mkstring("receive"));
+		json_append_member(jevent, "ph", json_mkstring("X"));
+		json_append_member(jevent, "ts", json_mknumber((double)event.start / 1000.0, 3));
+		json_append_member(jevent, "dur", json_mknumber((double)(event.end - event.start) / 1000.0, 3));
+		json_append_member(jevent, "pid", json_mknumber(1, 0));
+		json_append_member(jevent, "tid", json_mknumber(event.id, 0));
+		json_append_element(jevents, jevent);
+	}
+	json_append_member(jroot, "traceEvents", jevents);
+	json_append_member(jroot, "displayTimeUnit", json_mkstring("ms"));
+
+	out = json_stringify(jroot, NULL);
+	json_delete(jroot);
+
+	if(len != NULL) {
+		*len = strlen(out);
+	}
+	return out;
+}
+
+void trace_gc(void) {
+	nrevents = 0;
+	events_pos = 0;
+	if(events != NULL) {
+		FREE(events);
+	}
+}
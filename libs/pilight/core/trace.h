@@ -0,0 +1,43 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _TRACE_H_
+#define _TRACE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define TRACE_CAPTURE		0
+#define TRACE_QUEUED		1
+#define TRACE_PARSED		2
+#define TRACE_DEVICES		3
+#define TRACE_BROADCAST	4
+#define TRACE_EVENTS		5
+#define TRACE_WEBSOCKET	6
+#define TRACE_STAGES		7
+
+/*
+ * Travels along a pulse train from the moment it was
+ * captured. An id of zero means the train isn't traced.
+ */
+typedef struct trace_t {
+	unsigned int id;
+	/* Monotonic nanoseconds of the capture and the last stage */
+	uint64_t stamp;
+	uint64_t last;
+} trace_t;
+
+void trace_init(int size);
+void trace_start(struct trace_t *trace);
+void trace_stage(struct trace_t *trace, int stage);
+void trace_attach(const char *message, struct trace_t *trace);
+int trace_find(const char *message, struct trace_t *trace);
+char *trace_print(size_t *len);
+void trace_gc(void);
+
+#endif
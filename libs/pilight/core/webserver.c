@@ -38,6 +38,12 @@
 #include <stdarg.h>
 #include <errno.h>
 #include <ctype.h>
+#include <stdint.h>
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+	#include <arm_neon.h>
+#endif
 #ifdef _WIN32
 #else
 	#ifdef __mips__
@@ -49,23 +55,35 @@
 	#include <pthread.h>
 	#include <unistd.h>
 	#include <sys/time.h>
+#ifdef __linux__
+	#include <sys/sendfile.h>
+#endif
 #endif
 
 #ifdef PILIGHT_REWRITE
 	#include "../storage/storage.h"
 #else
+	#include "../config/config.h"
 	#include "../config/devices.h"
 	#include "../config/settings.h"
 	#include "../config/registry.h"
+	#include "../config/gui.h"
+	#include "../config/history.h"
 #endif
 
 #include "eventpool.h"
 #include "sha256cache.h"
+#include "fcache.h"
 #include "pilight.h"
 #include "network.h"
 #include "gc.h"
 #include "log.h"
 #include "json.h"
+#include "metrics.h"
+#include "trace.h"
+#include "profile.h"
+#include "capture.h"
+#include "http.h"
 #include "webserver.h"
 #include "socket.h"
 #include "ssdp.h"
@@ -101,6 +119,14 @@ static uv_async_t *async_req = NULL;
 static int http_port = WEBSERVER_HTTP_PORT;
 static int websockets = WEBGUI_WEBSOCKETS;
 static int cache = 1;
+#ifdef WEBSERVER_DEFLATE
+static int deflate_enable = 1;
+static int deflate_min = WEBSERVER_DEFLATE_MIN;
+static int deflate_takeover = 1;
+/* Compresses the broadcasts shared by clients without context takeover */
+static z_stream zshared;
+static int zshared_init = 0;
+#endif
 static char *authentication_username = NULL;
 static char *authentication_password = NULL;
 static unsigned short loop = 1;
@@ -109,13 +135,170 @@ static char *root = NULL;
 typedef struct broadcast_list_t {
 	char *out;
 	ssize_t len;
+	/* Length of the leading part naming the updated devices */
+	size_t keylen;
 	int fd;
 
+	/* The updated devices and their type for subscriptions */
+	int update;
+	int type;
+	char **devices;
+	int nrdev;
+
+	/* Of the received code that caused this broadcast */
+	struct trace_t trace;
+
 	struct broadcast_list_t *next;
 } broadcast_list_t;
 
 static struct broadcast_list_t *broadcast_list = NULL;
 
+/*
+ * A websocket client with more than WEBSERVER_SEND_HIGH bytes
+ * unsent is lagging. Until it is back under WEBSERVER_SEND_LOW
+ * only the latest update of each device is kept for it, other
+ * broadcasts are dropped above WEBSERVER_SEND_MAX. Clients that
+ * lag for WEBSERVER_STALL_TIMEOUT seconds are disconnected.
+ */
+#define WEBSERVER_SEND_HIGH			262144
+#define WEBSERVER_SEND_LOW			65536
+#define WEBSERVER_SEND_MAX			1048576
+#define WEBSERVER_STALL_TIMEOUT	30
+
+typedef struct websocket_deferred_t {
+	char *out;
+	ssize_t len;
+	size_t keylen;
+
+	struct websocket_deferred_t *next;
+} websocket_deferred_t;
+
+/*
+ * HTTP/1.1 clients keep their connection for the following
+ * requests, up to WEBSERVER_KEEPALIVE_MAX of them. Connections
+ * idle for WEBSERVER_IDLE_TIMEOUT seconds are closed, just as
+ * the Keep-Alive header tells the clients.
+ */
+#define WEBSERVER_KEEPALIVE_MAX	100
+#define WEBSERVER_IDLE_TIMEOUT	15
+/* Longest request header accepted */
+#define WEBSERVER_REQUEST_MAX		16384
+
+static uv_timer_t *timer_idle_req = NULL;
+
+/*
+ * Read-only clients can follow the broadcasts on /stream as
+ * Server-Sent Events. Each broadcast is serialized once as an
+ * event shared by all of them, and the last WEBSERVER_STREAM_REPLAY
+ * events are kept so a client that reconnects with the id of
+ * the last event it got receives what it missed. A client too
+ * far behind is disconnected, its reconnect catches it up.
+ */
+#define WEBSERVER_STREAM_REPLAY	64
+/* Milliseconds the clients wait before reconnecting */
+#define WEBSERVER_STREAM_RETRY	2000
+/* Length of the content hash in the names of the webgui bundles */
+#define WEBSERVER_FINGERPRINT		16
+
+typedef struct stream_event_t {
+	unsigned long id;
+	char *out;
+	size_t len;
+} stream_event_t;
+
+#ifndef PILIGHT_REWRITE
+/*
+ * The serialized config of the last /bootstrap, valid for as
+ * long as the devices generation and config revision are the
+ * same. The ETag of a bootstrap also holds the devices sequence,
+ * so a client that is behind only gets the changed values.
+ */
+static char *bootstrap_config = NULL;
+static size_t bootstrap_config_len = 0;
+static char bootstrap_media[15];
+static unsigned long bootstrap_generation = 0;
+static unsigned long bootstrap_revision = 0;
+/* Keeps the ETags of an earlier run of the daemon apart */
+static unsigned long bootstrap_epoch = 0;
+#endif
+
+/* The content codings of json responses */
+#define ENCODING_IDENTITY	0
+#define ENCODING_GZIP			1
+#define ENCODING_DEFLATE	2
+
+#ifndef PILIGHT_REWRITE
+/*
+ * The last /config and /values responses as they were sent,
+ * compressed or not, for each media and content encoding. A
+ * snapshot is sent again for as long as the devices, values,
+ * config and registry it was taken at didn't change.
+ */
+typedef struct webserver_snapshot_t {
+	char key[64];
+	/* What the client accepts and what the data is encoded with */
+	int encoding;
+	int coding;
+	unsigned long generation;
+	unsigned long revision;
+	unsigned long registry;
+	unsigned long seq;
+	unsigned long used;
+	char *data;
+	size_t len;
+} webserver_snapshot_t;
+
+static struct webserver_snapshot_t snapshots[WEBSERVER_SNAPSHOTS];
+static unsigned long snapshots_used = 0;
+#endif
+
+#ifndef PILIGHT_REWRITE
+/*
+ * The snapshots of the webcam devices are served on /webcam,
+ * so the cameras are not polled by every client themselves.
+ * A camera is fetched at most once per poll-interval of its
+ * device, through the keep-alive http client, and the latest
+ * frame is shared by all clients. Requests that come in while
+ * the frame is being fetched wait for it. Stream clients get
+ * every new frame as a part of a multipart MJPEG response.
+ */
+#define WEBCAM_BOUNDARY	"pilightframe"
+
+typedef struct webcam_client_t {
+	uv_poll_t *req;
+	struct webcam_client_t *next;
+} webcam_client_t;
+
+typedef struct webcam_t {
+	char *device;
+	int interval;
+	char *frame;
+	int len;
+	char mimetype[255];
+	/* The frame as a part of the MJPEG stream */
+	char *part;
+	int partlen;
+	time_t fetched;
+	int fetching;
+	uv_timer_t *timer_req;
+	struct webcam_client_t *waiting;
+	struct webcam_client_t *streams;
+	struct webcam_t *next;
+} webcam_t;
+
+static struct webcam_t *webcams = NULL;
+
+static void webcam_cache_free(struct webcam_t *cam);
+#endif
+
+static struct stream_event_t stream_replay[WEBSERVER_STREAM_REPLAY];
+static unsigned long stream_id = 0;
+static unsigned long stream_evicted = 0;
+
+static unsigned long websocket_coalesced = 0;
+static unsigned long websocket_dropped = 0;
+static unsigned long websocket_evicted = 0;
+
 enum mg_result {
 	MG_FALSE,
 	MG_TRUE,
@@ -134,19 +317,11 @@ enum {
 typedef struct webserver_clients_t {
 	uv_poll_t *req;
 	int is_websocket;
+	int is_stream;
 
 	struct webserver_clients_t *next;
 } webserver_clients_t;
 
-typedef struct fcache_t {
-	char *name;
-	unsigned long size;
-	unsigned char *bytes;
-	struct fcache_t *next;
-} fcaches_t;
-
-static struct fcache_t *fcache;
-
 #ifdef _WIN32
 	static uv_mutex_t webserver_lock;
 #else
@@ -157,6 +332,10 @@ static int lock_init = 0;
 static struct webserver_clients_t *webserver_clients = NULL;
 
 static void poll_close_cb(uv_poll_t *req);
+static void broadcast_free(struct broadcast_list_t *node);
+static void http_request_done(uv_poll_t *req);
+static void http_requests(uv_poll_t *req);
+static void close_cb(uv_handle_t *handle);
 
 static void *reason_socket_received_free(void *param) {
 	struct reason_socket_received_t *data = param;
@@ -176,6 +355,12 @@ int webserver_gc(void) {
 
 	loop = 0;
 
+	if(timer_idle_req != NULL) {
+		uv_timer_stop(timer_idle_req);
+		uv_close((uv_handle_t *)timer_idle_req, close_cb);
+		timer_idle_req = NULL;
+	}
+
 #ifdef _WIN32
 	uv_mutex_lock(&webserver_lock);
 #else
@@ -194,25 +379,58 @@ int webserver_gc(void) {
 		while(broadcast_list) {
 			tmp = broadcast_list;
 			broadcast_list = broadcast_list->next;
-			FREE(tmp);
+			broadcast_free(tmp);
+		}
+	}
+
+	{
+		int i = 0;
+		for(i=0;i<WEBSERVER_STREAM_REPLAY;i++) {
+			if(stream_replay[i].out != NULL) {
+				FREE(stream_replay[i].out);
+			}
+		}
+		memset(stream_replay, 0, sizeof(stream_replay));
+		stream_id = 0;
+	}
+
+#ifndef PILIGHT_REWRITE
+	if(bootstrap_config != NULL) {
+		json_free(bootstrap_config);
+		bootstrap_config = NULL;
+	}
+	{
+		int i = 0;
+		for(i=0;i<WEBSERVER_SNAPSHOTS;i++) {
+			if(snapshots[i].data != NULL) {
+				FREE(snapshots[i].data);
+			}
+		}
+		memset(snapshots, 0, sizeof(snapshots));
+	}
+	{
+		struct webcam_t *tmp = NULL;
+		while(webcams) {
+			tmp = webcams;
+			webcams = webcams->next;
+			webcam_cache_free(tmp);
 		}
 	}
+#endif
 #ifdef _WIN32
 	uv_mutex_unlock(&webserver_lock);
 #else
 	pthread_mutex_unlock(&webserver_lock);
 #endif
 
-	{
-		struct fcache_t *tmp = fcache;
-		while(fcache) {
-			tmp = fcache;
-			FREE(tmp->name);
-			FREE(tmp->bytes);
-			fcache = fcache->next;
-			FREE(tmp);
-		}
+	fcache_gc();
+
+#ifdef WEBSERVER_DEFLATE
+	if(zshared_init == 1) {
+		deflateEnd(&zshared);
+		zshared_init = 0;
 	}
+#endif
 
 	if(poll_http_req != NULL) {
 		poll_close_cb(poll_http_req);
@@ -243,7 +461,7 @@ int webserver_gc(void) {
 
 void webserver_create_header(char **p, const char *message, char *mimetype, unsigned long len) {
 	*p += sprintf((char *)*p,
-		"HTTP/1.0 %s\r\n"
+		"HTTP/1.1 %s\r\n"
 		"Server: pilight\r\n"
 		"Keep-Alive: timeout=15, max=100\r\n"
 		"Content-Type: %s\r\n",
@@ -304,13 +522,27 @@ int authorize_input(uv_poll_t *req, char *username, char *password) {
 
 	struct uv_custom_poll_t *custom_poll_data = req->data;
 	struct connection_t *conn = custom_poll_data->data;
-	const char *hdr = NULL;
-	char **array = NULL, *decoded = NULL;
-	int n = 0;
+	const char *hdr = NULL, *cookie = NULL;
+	struct span_t rest, uspan, pspan;
+	char *decoded = NULL, token[SHA256CACHE_TOKEN+1], *hash = NULL, *name = NULL, *pass = NULL;
 
 	if(conn == NULL) {
 		return MG_FALSE;
 	}
+	conn->session[0] = '\0';
+
+	/*
+	 * A client that logged in before shows its session, so
+	 * the password doesn't have to be checked again.
+	 */
+	if((hdr = http_get_header(conn, "Cookie")) != NULL &&
+	   (cookie = strstr(hdr, "pilight_session=")) != NULL) {
+		memset(token, '\0', sizeof(token));
+		sscanf(&cookie[16], "%64[0-9a-f]", token);
+		if(sha256cache_session_valid(token) == 0) {
+			return MG_TRUE;
+		}
+	}
 
 	if((hdr = http_get_header(conn, "Authorization")) == NULL ||
 	   (strncmp(hdr, "Basic ", 6) != 0 &&
@@ -329,19 +561,23 @@ int authorize_input(uv_poll_t *req, char *username, char *password) {
 		return MG_FALSE;
 	}
 
-	if((n = explode(decoded, ":", &array)) == 2) {
-		if(strlen(array[1]) < 64) {
-			if((array[1] = REALLOC(array[1], 65)) == NULL) {
-				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-			}
-		}
+	span_init(&rest, decoded);
+	if(span_pair(&rest, ":", &uspan, &pspan) == 0) {
+		name = span_terminate(&uspan);
+		pass = span_terminate(&pspan);
 
-		if(sha256cache_get_hash(array[1]) == NULL) {
-			sha256cache_add(array[1]);
+		if((hash = sha256cache_get_hash(pass)) == NULL) {
+			sha256cache_add(pass);
+			hash = sha256cache_get_hash(pass);
 		}
 
-		if(strcmp(sha256cache_get_hash(array[1]), password) == 0 && strcmp(array[0], username) == 0) {
-			array_free(&array, n);
+		/* Both are checked, so a wrong username takes as long as a wrong password */
+		if((sha256cache_equal(hash, password) | sha256cache_equal(name, username)) == 0) {
+			if(sha256cache_session_add(token) == 0) {
+				snprintf(conn->session, sizeof(conn->session),
+					"Set-Cookie: pilight_session=%s; Max-Age=%d; Path=/; HttpOnly; SameSite=Strict\r\n",
+					token, SHA256CACHE_TIMEOUT);
+			}
 			FREE(user);
 			FREE(decoded);
 			return MG_TRUE;
@@ -349,7 +585,6 @@ int authorize_input(uv_poll_t *req, char *username, char *password) {
 	}
 	FREE(user);
 	FREE(decoded);
-	array_free(&array, n);
 
 	return MG_FALSE;
 }
@@ -368,6 +603,163 @@ static int auth_handler(uv_poll_t *req) {
 	}
 }
 
+static int websocket_header(unsigned char *header, int opcode, unsigned long long data_len) {
+	int index = 2;
+
+	header[0] = 0x80 + (opcode & 0x0f);
+	if(data_len <= 125) {
+		header[1] = data_len;
+	} else if(data_len < 65535) {
+		header[1] = 126;
+		header[2] = (data_len >> 8) & 255;
+		header[3] = (data_len) & 255;
+		index = 4;
+	} else {
+		header[1] = 127;
+		header[2] = (data_len >> 56) & 255;
+		header[3] = (data_len >> 48) & 255;
+		header[4] = (data_len >> 40) & 255;
+		header[5] = (data_len >> 32) & 255;
+		header[6] = (data_len >> 24) & 255;
+		header[7] = (data_len >> 16) & 255;
+		header[8] = (data_len >> 8) & 255;
+		header[9] = (data_len) & 255;
+		index = 10;
+	}
+	return index;
+}
+
+#ifdef WEBSERVER_DEFLATE
+/*
+ * Compress a message as a permessage-deflate payload, which
+ * is a raw deflate stream flushed to a byte boundary without
+ * the trailing 0x00 0x00 0xff 0xff.
+ */
+static char *websocket_deflate(z_stream *zout, int takeover, const char *data, size_t len, size_t *out_len) {
+	char *out = NULL;
+	size_t size = deflateBound(zout, len) + 16;
+
+	if(takeover == 0) {
+		deflateReset(zout);
+	}
+	if((out = MALLOC(size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+
+	zout->next_in = (Bytef *)data;
+	zout->avail_in = (uInt)len;
+	zout->next_out = (Bytef *)out;
+	zout->avail_out = (uInt)size;
+	if(deflate(zout, Z_SYNC_FLUSH) != Z_OK || zout->avail_in > 0 || size - zout->avail_out < 4) {
+		FREE(out);
+		return NULL;
+	}
+	*out_len = size - zout->avail_out - 4;
+	return out;
+}
+
+static char *websocket_inflate(struct connection_t *conn, const unsigned char *data, size_t len, size_t *out_len) {
+	static const unsigned char tail[4] = { 0x00, 0x00, 0xff, 0xff };
+	size_t size = len * 4 + 64, pos = 0;
+	int i = 0, r = Z_OK;
+
+	if(conn->inflated != NULL) {
+		FREE(conn->inflated);
+	}
+	if((conn->inflated = MALLOC(size+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+
+	for(i=0;i<2;i++) {
+		conn->zin.next_in = (Bytef *)((i == 0) ? data : tail);
+		conn->zin.avail_in = (uInt)((i == 0) ? len : sizeof(tail));
+		while(conn->zin.avail_in > 0) {
+			if(pos == size) {
+				if(size >= MAX_UPLOAD_FILESIZE) {
+					return NULL;
+				}
+				size *= 2;
+				if((conn->inflated = REALLOC(conn->inflated, size+1)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+			}
+			conn->zin.next_out = (Bytef *)&conn->inflated[pos];
+			conn->zin.avail_out = (uInt)(size - pos);
+			r = inflate(&conn->zin, Z_SYNC_FLUSH);
+			pos = size - conn->zin.avail_out;
+			if(r != Z_OK && r != Z_BUF_ERROR) {
+				return NULL;
+			}
+		}
+	}
+	conn->inflated[pos] = '\0';
+	*out_len = pos;
+	return conn->inflated;
+}
+
+/*
+ * Accept the first permessage-deflate offer we can honour.
+ * The server window is always the full 15 bits, so offers
+ * limiting it are declined.
+ */
+static int websocket_deflate_offer(struct connection_t *conn, char *response, size_t len) {
+	const char *ext = http_get_header(conn, "Sec-WebSocket-Extensions");
+	const char *p = NULL, *end = NULL;
+	int takeover = deflate_takeover;
+
+	if(deflate_enable == 0 || ext == NULL) {
+		return 0;
+	}
+
+	p = ext;
+	while((p = strstr(p, "permessage-deflate")) != NULL) {
+		if((end = strchr(p, ',')) == NULL) {
+			end = p + strlen(p);
+		}
+		char offer[end-p+1];
+		memcpy(offer, p, end-p);
+		offer[end-p] = '\0';
+		p = end;
+
+		if(strstr(offer, "server_max_window_bits") != NULL) {
+			continue;
+		}
+		if(strstr(offer, "server_no_context_takeover") != NULL) {
+			takeover = 0;
+		}
+
+		memset(&conn->zout, 0, sizeof(z_stream));
+		memset(&conn->zin, 0, sizeof(z_stream));
+		if(deflateInit2(&conn->zout, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			return 0;
+		}
+		if(inflateInit2(&conn->zin, -15) != Z_OK) {
+			deflateEnd(&conn->zout);
+			return 0;
+		}
+		conn->deflate = 1;
+		conn->deflate_takeover = takeover;
+
+		snprintf(response, len, "Sec-WebSocket-Extensions: permessage-deflate%s\r\n",
+			(takeover == 0) ? "; server_no_context_takeover" : "");
+		return 1;
+	}
+	return 0;
+}
+
+static void websocket_deflate_free(struct connection_t *conn) {
+	if(conn->deflate == 1) {
+		deflateEnd(&conn->zout);
+		inflateEnd(&conn->zin);
+		conn->deflate = 0;
+	}
+	if(conn->inflated != NULL) {
+		FREE(conn->inflated);
+		conn->inflated = NULL;
+	}
+}
+#endif
+
 size_t websocket_write(uv_poll_t *req, int opcode, const char *data, unsigned long long data_len) {
 	/*
 	 * Make sure we execute in the main thread
@@ -376,49 +768,59 @@ size_t websocket_write(uv_poll_t *req, int opcode, const char *data, unsigned lo
 	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
 
 	struct uv_custom_poll_t *custom_poll_data = req->data;
-	unsigned char *copy = NULL;
-	size_t copy_len = 0;
-	int index = 2;
+	unsigned char header[10];
+	int index = 0;
 
-	if((copy = REALLOC(copy, data_len + 10)) == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+#ifdef WEBSERVER_DEFLATE
+	struct connection_t *conn = custom_poll_data->data;
+	if(conn != NULL && conn->deflate == 1 && data_len >= deflate_min &&
+	   (opcode == WEBSOCKET_OPCODE_TEXT || opcode == WEBSOCKET_OPCODE_BINARY)) {
+		size_t len = 0;
+		char *out = websocket_deflate(&conn->zout, conn->deflate_takeover, data, data_len, &len);
+		if(out != NULL) {
+			index = websocket_header(header, opcode, len);
+			/* RSV1 marks a compressed message */
+			header[0] |= 0x40;
+			iobuf_append(&custom_poll_data->send_iobuf, (char *)header, index);
+			iobuf_append(&custom_poll_data->send_iobuf, out, (int)len);
+			uv_custom_write(req);
+			FREE(out);
+			return data_len;
+		}
 	}
-	memset(copy, '\0', data_len + 10);
+#endif
 
-	copy[0] = 0x80 + (opcode & 0x0f);
-	if(data_len <= 125) {
-		copy[1] = data_len;
-	} else if(data_len < 65535) {
-		copy[1] = 126;
-		copy[2] = (data_len >> 8) & 255;
-		copy[3] = (data_len) & 255;
-		index = 4;
-	} else {
-		copy[1] = 127;
-		copy[2] = (data_len >> 56) & 255;
-		copy[3] = (data_len >> 48) & 255;
-		copy[4] = (data_len >> 40) & 255;
-		copy[5] = (data_len >> 32) & 255;
-		copy[6] = (data_len >> 24) & 255;
-		copy[7] = (data_len >> 16) & 255;
-		copy[8] = (data_len >> 8) & 255;
-		copy[9] = (data_len) & 255;
-		index = 10;
-	}
-	if(data != NULL) {
-		memcpy(&copy[index], data, data_len);
-	}
-	copy_len = data_len + index;
+	index = websocket_header(header, opcode, data_len);
 
-	if(copy_len > 0) {
-		iobuf_append(&custom_poll_data->send_iobuf, (char *)copy, copy_len);
-		uv_custom_write(req);
+	/* The payload is appended after the header, without an intermediate frame */
+	iobuf_append(&custom_poll_data->send_iobuf, (char *)header, index);
+	if(data != NULL && data_len > 0) {
+		iobuf_append(&custom_poll_data->send_iobuf, data, (int)data_len);
 	}
+	uv_custom_write(req);
 
-	FREE(copy);
 	return data_len;
 }
 
+/*
+ * Frame a message once so it can be written to many
+ * websocket clients.
+ */
+static char *websocket_frame(int opcode, const char *data, unsigned long long data_len, size_t *len) {
+	unsigned char *frame = NULL;
+	int index = 0;
+
+	if((frame = MALLOC(data_len + 10)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	index = websocket_header(frame, opcode, data_len);
+	if(data != NULL && data_len > 0) {
+		memcpy(&frame[index], data, data_len);
+	}
+	*len = data_len + index;
+	return (char *)frame;
+}
+
 static void *webserver_send(int reason, void *param) {
 	struct reason_socket_send_t *data = param;
 	struct connection_t c;
@@ -481,6 +883,108 @@ static void write_chunk(uv_poll_t *req, char *buf, int len) {
 	iobuf_append(&custom_poll_data->send_iobuf, "\r\n", 2);
 }
 
+/*
+ * Whether the Accept-Encoding of the request lists a coding,
+ * without refusing it by a quality of zero.
+ */
+static int webserver_accepts(const char *header, const char *coding) {
+	const char *p = header;
+	size_t len = strlen(coding);
+
+	while((p = strstr(p, coding)) != NULL) {
+		if((p == header || p[-1] == ' ' || p[-1] == ',') &&
+		   (p[len] == '\0' || p[len] == ',' || p[len] == ';' || p[len] == ' ')) {
+			p += len;
+			while(*p == ' ') {
+				p++;
+			}
+			if(strncmp(p, ";q=0", 4) == 0) {
+				p += 4;
+				if(*p == '.') {
+					p++;
+					while(*p == '0') {
+						p++;
+					}
+					return (*p >= '1' && *p <= '9');
+				}
+				return 0;
+			}
+			return 1;
+		}
+		p += len;
+	}
+	return 0;
+}
+
+static int webserver_encoding(struct connection_t *conn) {
+#ifdef WEBSERVER_DEFLATE
+	const char *header = NULL;
+
+	if(conn == NULL || (header = http_get_header(conn, "Accept-Encoding")) == NULL) {
+		return ENCODING_IDENTITY;
+	}
+	if(webserver_accepts(header, "gzip") == 1) {
+		return ENCODING_GZIP;
+	}
+	if(webserver_accepts(header, "deflate") == 1) {
+		return ENCODING_DEFLATE;
+	}
+#endif
+	return ENCODING_IDENTITY;
+}
+
+#ifdef WEBSERVER_DEFLATE
+static char *webserver_compress(const char *data, size_t len, int encoding, size_t *out_len) {
+	z_stream z;
+	char *out = NULL;
+	size_t size = 0;
+
+	memset(&z, 0, sizeof(z));
+	/* A gzip wrapper for gzip, a zlib wrapper for deflate */
+	if(deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, (encoding == ENCODING_GZIP) ? 31 : 15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return NULL;
+	}
+	size = deflateBound(&z, len);
+	if((out = MALLOC(size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	z.next_in = (unsigned char *)data;
+	z.avail_in = len;
+	z.next_out = (unsigned char *)out;
+	z.avail_out = size;
+	if(deflate(&z, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&z);
+		FREE(out);
+		return NULL;
+	}
+	*out_len = size-z.avail_out;
+	deflateEnd(&z);
+
+	return out;
+}
+#endif
+
+static void send_encoded(uv_poll_t *req, char *mimetype, void *data, unsigned long data_len, int encoding) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	char header[1024];
+	int n = 0;
+
+	n = snprintf(header, sizeof(header),
+		"HTTP/1.1 200 OK\r\n"
+		"Server: pilight\r\n"
+		"Keep-Alive: timeout=15, max=100\r\n"
+		"Content-Type: %s\r\n"
+		"%s"
+		"Vary: Accept-Encoding\r\n"
+		"Content-Length: %lu\r\n\r\n",
+		mimetype,
+		(encoding == ENCODING_GZIP) ? "Content-Encoding: gzip\r\n" :
+		(encoding == ENCODING_DEFLATE) ? "Content-Encoding: deflate\r\n" : "",
+		data_len);
+	iobuf_append(&custom_poll_data->send_iobuf, header, n);
+	iobuf_append(&custom_poll_data->send_iobuf, data, (int)data_len);
+}
+
 static size_t send_data(uv_poll_t *req, char *mimetype, void *data, unsigned long data_len) {
 	/*
 	 * Make sure we execute in the main thread
@@ -492,6 +996,20 @@ static size_t send_data(uv_poll_t *req, char *mimetype, void *data, unsigned lon
 	char header[1024], *p = header;
 	memset(header, '\0', 1024);
 
+#ifdef WEBSERVER_DEFLATE
+	/* Larger json responses are compressed when the client accepts it */
+	if(data_len >= WEBSERVER_COMPRESS_MIN && strcmp(mimetype, "application/json") == 0) {
+		int encoding = webserver_encoding(custom_poll_data->data);
+		size_t len = 0;
+		char *out = NULL;
+		if(encoding != ENCODING_IDENTITY && (out = webserver_compress(data, data_len, encoding, &len)) != NULL) {
+			send_encoded(req, mimetype, out, len, encoding);
+			FREE(out);
+			return 0;
+		}
+	}
+#endif
+
 	webserver_create_header(&p, "200 OK", mimetype, data_len);
 	iobuf_append(&custom_poll_data->send_iobuf, header, (int)(p-header));
 	iobuf_append(&custom_poll_data->send_iobuf, data, (int)data_len);
@@ -499,6 +1017,140 @@ static size_t send_data(uv_poll_t *req, char *mimetype, void *data, unsigned lon
 	return 0;
 }
 
+#ifndef PILIGHT_REWRITE
+static void snapshot_state(struct webserver_snapshot_t *state) {
+	state->generation = devices_generation();
+	state->revision = config_revision();
+	state->registry = config_registry_revision();
+	state->seq = devices_sequence();
+}
+
+/* Send the snapshot taken of this response, if it's still valid */
+static int send_snapshot(uv_poll_t *req, const char *key) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct webserver_snapshot_t state;
+	int encoding = webserver_encoding(custom_poll_data->data), i = 0;
+
+	snapshot_state(&state);
+	for(i=0;i<WEBSERVER_SNAPSHOTS;i++) {
+		if(snapshots[i].data != NULL && snapshots[i].encoding == encoding &&
+		   strcmp(snapshots[i].key, key) == 0 &&
+		   snapshots[i].generation == state.generation && snapshots[i].revision == state.revision &&
+		   snapshots[i].registry == state.registry && snapshots[i].seq == state.seq) {
+			snapshots[i].used = ++snapshots_used;
+			send_encoded(req, "application/json", snapshots[i].data, snapshots[i].len, snapshots[i].coding);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Send a json response and keep it as it was sent, replacing
+ * the least recently used snapshot. The state is the one taken
+ * before the response was made, so a change in the meantime
+ * only makes the snapshot expire early.
+ */
+static void send_snapshot_new(uv_poll_t *req, const char *key, struct webserver_snapshot_t *state, char *data, size_t len) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct webserver_snapshot_t *snapshot = NULL;
+	int encoding = webserver_encoding(custom_poll_data->data), coding = ENCODING_IDENTITY, i = 0;
+	char *out = NULL;
+	size_t size = len;
+
+#ifdef WEBSERVER_DEFLATE
+	if(encoding != ENCODING_IDENTITY && len >= WEBSERVER_COMPRESS_MIN &&
+	   (out = webserver_compress(data, len, encoding, &size)) != NULL) {
+		coding = encoding;
+	}
+#endif
+	if(out == NULL) {
+		if((out = MALLOC(len+1)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(out, data, len);
+		out[len] = '\0';
+		size = len;
+	}
+
+	for(i=0;i<WEBSERVER_SNAPSHOTS;i++) {
+		if(strcmp(snapshots[i].key, key) == 0 && snapshots[i].encoding == encoding) {
+			snapshot = &snapshots[i];
+			break;
+		}
+		if(snapshot == NULL || snapshots[i].used < snapshot->used) {
+			snapshot = &snapshots[i];
+		}
+	}
+	if(snapshot->data != NULL) {
+		FREE(snapshot->data);
+	}
+	snprintf(snapshot->key, sizeof(snapshot->key), "%s", key);
+	snapshot->encoding = encoding;
+	snapshot->coding = coding;
+	snapshot->generation = state->generation;
+	snapshot->revision = state->revision;
+	snapshot->registry = state->registry;
+	snapshot->seq = state->seq;
+	snapshot->used = ++snapshots_used;
+	snapshot->data = out;
+	snapshot->len = size;
+
+	send_encoded(req, "application/json", out, size, coding);
+}
+#endif
+
+static void send_json_cb(void *userdata, const char *buf, size_t len) {
+	iobuf_append(userdata, buf, (int)len);
+}
+
+/*
+ * Serialize a json object straight into the send buffer.
+ * The content length is only known afterwards, so room is
+ * kept for it in the header and it is filled in at the end.
+ */
+static size_t send_json(uv_poll_t *req, struct JsonNode *jsend) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct iobuf_t *io = &custom_poll_data->send_iobuf;
+	char header[1024], length[21], *p = header;
+	ssize_t start = 0, field = 0;
+	unsigned long len = 0;
+
+	memset(header, '\0', 1024);
+
+	p += sprintf(p,
+		"HTTP/1.1 200 OK\r\n"
+		"Server: pilight\r\n"
+		"Keep-Alive: timeout=15, max=100\r\n"
+		"Content-Type: application/json\r\n"
+		"Content-Length:");
+	field = p-header;
+	p += sprintf(p, "%20s\r\n\r\n", "");
+
+	uv_mutex_lock(&io->lock);
+	start = io->len;
+	uv_mutex_unlock(&io->lock);
+
+	iobuf_append(io, header, (int)(p-header));
+	json_stream(jsend, send_json_cb, io);
+
+	uv_mutex_lock(&io->lock);
+	if(io->len >= start+(p-header)) {
+		len = (unsigned long)(io->len-start-(p-header));
+		snprintf(length, sizeof(length), "%20lu", len);
+		memcpy(&io->buf[start+field], length, 20);
+	}
+	uv_mutex_unlock(&io->lock);
+
+	return 0;
+}
+
 static size_t send_chunked_data(uv_poll_t *req, void *data, unsigned long data_len) {
 	/*
 	 * Make sure we execute in the main thread
@@ -510,12 +1162,12 @@ static size_t send_chunked_data(uv_poll_t *req, void *data, unsigned long data_l
 	struct connection_t *conn = custom_poll_data->data;
 
 	if(conn->flags == 0) {
-		char a[255], *p = a;
-		memset(p, '\0', 255);
-		int i = snprintf(p, 255,
+		char a[512], *p = a;
+		memset(p, '\0', 512);
+		int i = snprintf(p, 512,
 			"HTTP/1.1 200 OK\r\nKeep-Alive: timeout=15, max=100\r\n"\
-			"Content-Type: %s\r\nTransfer-Encoding: chunked\r\n\r\n",
-			conn->mimetype
+			"Content-Type: %s\r\n%sTransfer-Encoding: chunked\r\n\r\n",
+			conn->mimetype, conn->file_headers
 		);
 
 		iobuf_append(&custom_poll_data->send_iobuf, p, i);
@@ -526,7 +1178,13 @@ static size_t send_chunked_data(uv_poll_t *req, void *data, unsigned long data_l
 	return 0;
 }
 
-static int parse_rest(uv_poll_t *req) {
+#ifdef __linux__
+/*
+ * Plain HTTP files are handed to the kernel with sendfile.
+ * This is called each time the socket can take more data
+ * after the header has been written.
+ */
+static int file_sendfile_cb(uv_poll_t *req) {
 	/*
 	 * Make sure we execute in the main thread
 	 */
@@ -535,17 +1193,59 @@ static int parse_rest(uv_poll_t *req) {
 
 	struct uv_custom_poll_t *custom_poll_data = req->data;
 	struct connection_t *conn = custom_poll_data->data;
+	ssize_t n = 0;
+	int fd = -1, r = 0;
 
-	char **array = NULL, **array1 = NULL;
-	char *key = NULL, *value = NULL;
-	struct JsonNode *jobject = json_mkobject();
-	struct JsonNode *jcode = json_mkobject();
-	struct JsonNode *jvalues = json_mkobject();
-	int a = 0, b = 0, c = 0, has_protocol = 0;
-
-	if(strcmp(conn->request_method, "POST") == 0) {
-		conn->query_string = conn->content;
-	}
+	if((r = uv_fileno((uv_handle_t *)req, (uv_os_fd_t *)&fd)) != 0) {
+		/*LCOV_EXCL_START*/
+		logprintf(LOG_ERR, "uv_fileno: %s", uv_strerror(r));
+		return -1;
+		/*LCOV_EXCL_STOP*/
+	}
+
+	n = sendfile(fd, conn->file_fd, &conn->file_offset, (size_t)(conn->file_size-conn->file_offset));
+	if(n < 0 && errno != EAGAIN && errno != EINTR) {
+		logprintf(LOG_ERR, "sendfile: %s", strerror(errno));
+		close(conn->file_fd);
+		conn->file_fd = -1;
+		return -1;
+	}
+
+	if(n == 0 || conn->file_offset >= conn->file_size) {
+		close(conn->file_fd);
+		conn->file_fd = -1;
+		http_request_done(req);
+		return 0;
+	}
+
+	uv_custom_write(req);
+	return 0;
+}
+#endif
+
+static int parse_rest(uv_poll_t *req) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *conn = custom_poll_data->data;
+
+	struct span_t rest, part, kspan, vspan;
+	char *key = NULL, *value = NULL, *decoded = NULL, *name = NULL, *val = NULL;
+	struct JsonNode *jobject = json_mkobject();
+	struct JsonNode *jcode = json_mkobject();
+	struct JsonNode *jvalues = json_mkobject();
+	/* Every device of a bulk control with its own state and values */
+	struct JsonNode *jbulk = json_mkarray();
+	struct JsonNode *jentry = NULL;
+	int a = 0, has_protocol = 0, nrdev = 0;
+
+	if(strcmp(conn->request_method, "POST") == 0) {
+		conn->query_string = conn->content;
+	}
 	if(strcmp(conn->request_method, "GET") == 0 && conn->query_string == NULL) {
 		conn->query_string = conn->content;
 	}
@@ -555,27 +1255,18 @@ static int parse_rest(uv_poll_t *req) {
 #else
 		struct devices_t *dev = NULL;
 #endif
-		int len = urldecode(conn->query_string, NULL);
-		if(len == -1) {
-			char *z = "{\"message\":\"failed\",\"error\":\"cannot decode url\"}";
-			send_data(req, "application/json", z, strlen(z));
-			return MG_TRUE;
-		}
-
-		char *decoded = MALLOC(len+1);
-		if(decoded == NULL) {
-			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-		}
-
-		if(urldecode(conn->query_string, decoded) == -1) {
+		/* The query lives in the copy of the request, so it's decoded in place */
+		decoded = (char *)conn->query_string;
+		if(urldecode(decoded, decoded) == -1) {
 			char *z = "{\"message\":\"failed\",\"error\":\"cannot decode url\"}";
 			send_data(req, "application/json", z, strlen(z));
-			FREE(decoded);
 			return MG_TRUE;
 		}
 
 		char state[16], *p = NULL;
-		a = explode((char *)decoded, "&", &array), b = 0, c = 0;
+		/* The parts are terminated in place, see span_terminate */
+		a = (int)span_count(decoded, "&");
+		span_init(&rest, decoded);
 		memset(state, 0, 16);
 
 		if(a >= 1) {
@@ -594,44 +1285,62 @@ static int parse_rest(uv_poll_t *req) {
 			}
 
 			if(type == 0 || type == 1) {
-				for(b=0;b<a;b++) {
-					c = explode(array[b], "=", &array1);
-					if(c == 2) {
-						if(strcmp(array1[0], "protocol") == 0) {
+				while(span_next(&rest, "&", &part) == 1) {
+					if(span_pair(&part, "=", &kspan, &vspan) == 0) {
+						name = span_terminate(&kspan);
+						val = span_terminate(&vspan);
+						if(strcmp(name, "protocol") == 0) {
 							struct JsonNode *jprotocol = json_mkarray();
-							json_append_element(jprotocol, json_mkstring(array1[1]));
+							json_append_element(jprotocol, json_mkstring(val));
 							json_append_member(jcode, "protocol", jprotocol);
 							has_protocol = 1;
-						} else if(strcmp(array1[0], "state") == 0) {
-							strcpy(state, array1[1]);
-						} else if(strcmp(array1[0], "device") == 0) {
+						} else if(strcmp(name, "state") == 0) {
+							strcpy(state, val);
+							if(jentry != NULL) {
+								json_append_member(jentry, "state", json_mkstring(val));
+							}
+						} else if(strcmp(name, "device") == 0) {
 // #ifdef PILIGHT_REWRITE
-							// dev = array1[1];
-							// if(devices_select(ORIGIN_WEBSERVER, array1[1], NULL) != 0) {
+							// dev = val;
+							// if(devices_select(ORIGIN_WEBSERVER, val, NULL) != 0) {
 // #else
-							if(devices_get(array1[1], &dev) != 0) {
+							if(devices_get(val, &dev) != 0) {
 // #endif
 								char *z = "{\"message\":\"failed\",\"error\":\"device does not exist\"}";
 								send_data(req, "application/json", z, strlen(z));
 								goto clear;
 							}
-						} else if(strncmp(array1[0], "values", 6) == 0) {
-							char name[255], *ptr = name;
-							if(sscanf(array1[0], "values[%254[a-z]]", ptr) != 1) {
+							/* The state and values that follow are of this device */
+							jentry = json_mkobject();
+							json_append_member(jentry, "device", json_mkstring(val));
+							json_append_member(jentry, "values", json_mkobject());
+							json_append_element(jbulk, jentry);
+							nrdev++;
+						} else if(strncmp(name, "values", 6) == 0) {
+							char vname[255], *ptr = vname;
+							if(sscanf(name, "values[%254[a-z]]", ptr) != 1) {
 								char *z = "{\"message\":\"failed\",\"error\":\"values should be passed like this \'values[dimlevel]=10\'\"}";
 								send_data(req, "application/json", z, strlen(z));
 								goto clear;
 							} else {
-								if(isNumeric(array1[1]) == 0) {
-									json_append_member(jvalues, name, json_mknumber(atof(array1[1]), nrDecimals(array1[1])));
+								if(isNumeric(val) == 0) {
+									json_append_member(jvalues, vname, json_mknumber(atof(val), nrDecimals(val)));
 								} else {
-									json_append_member(jvalues, name, json_mkstring(array1[1]));
+									json_append_member(jvalues, vname, json_mkstring(val));
+								}
+								if(jentry != NULL) {
+									struct JsonNode *jtmp = json_find_member(jentry, "values");
+									if(isNumeric(val) == 0) {
+										json_append_member(jtmp, vname, json_mknumber(atof(val), nrDecimals(val)));
+									} else {
+										json_append_member(jtmp, vname, json_mkstring(val));
+									}
 								}
 							}
-						} else if(isNumeric(array1[1]) == 0) {
-							json_append_member(jcode, array1[0], json_mknumber(atof(array1[1]), nrDecimals(array1[1])));
+						} else if(isNumeric(val) == 0) {
+							json_append_member(jcode, name, json_mknumber(atof(val), nrDecimals(val)));
 						} else {
-							json_append_member(jcode, array1[0], json_mkstring(array1[1]));
+							json_append_member(jcode, name, json_mkstring(val));
 						}
 					}
 				}
@@ -652,7 +1361,13 @@ static int parse_rest(uv_poll_t *req) {
 						}
 					}
 				} else if(type == 1) {
-					if(pilight.control != NULL) {
+					if(nrdev > 1 && pilight.bulk != NULL) {
+						if(pilight.bulk(jbulk, ORIGIN_WEBSERVER) == 0) {
+							char *z = "{\"message\":\"success\"}";
+							send_data(req, "application/json", z, strlen(z));
+							goto clear;
+						}
+					} else if(pilight.control != NULL) {
 						if(dev == NULL) {
 							char *z = "{\"message\":\"failed\",\"error\":\"no device was sent\"}";
 							send_data(req, "application/json", z, strlen(z));
@@ -672,31 +1387,32 @@ static int parse_rest(uv_poll_t *req) {
 			} else if(type == 2) {
 				int getsetrm = 0; // g, s or r
 
-				for(b=0;b<a;b++) {
-					c = explode(array[b], "=", &array1);
-					if((strcmp(array1[0], "get") == 0) ||
-						 (strcmp(array1[0], "set") == 0) ||
-						 (strcmp(array1[0], "remove") == 0)) {
-						getsetrm = array1[0][0];
-						if((key = STRDUP(array1[1])) == NULL) {
+				while(span_next(&rest, "&", &part) == 1) {
+					if(span_pair(&part, "=", &kspan, &vspan) != 0) {
+						continue;
+					}
+					name = span_terminate(&kspan);
+					val = span_terminate(&vspan);
+					if((strcmp(name, "get") == 0) ||
+						 (strcmp(name, "set") == 0) ||
+						 (strcmp(name, "remove") == 0)) {
+						getsetrm = name[0];
+						if((key = STRDUP(val)) == NULL) {
 							OUT_OF_MEMORY
 						}
 					}
-					if(strcmp(array1[0], "value") == 0) {
-						if((value = STRDUP(array1[1])) == NULL) {
+					if(strcmp(name, "value") == 0) {
+						if((value = STRDUP(val)) == NULL) {
 							OUT_OF_MEMORY
 						}
 					}
-					array_free(&array1, c);
 				}
-				c = 0;
 
 				struct varcont_t out;
 				memset(&out, 0, sizeof(struct varcont_t));
 				if(key == NULL) {
 					char *z = "{\"message\":\"failed\"}";
 					send_data(req, "application/json", z, strlen(z));
-					FREE(decoded);
 					goto clear;
 				} else if(getsetrm == 'g') {
 					if(value != NULL) {
@@ -712,7 +1428,6 @@ static int parse_rest(uv_poll_t *req) {
 							send_data(req, "application/json", output, strlen(output));
 							json_free(output);
 							json_delete(jsend);
-							FREE(decoded);
 							FREE(key);
 							goto clear;
 						} else if(out.type_ == LUA_TSTRING) {
@@ -725,13 +1440,11 @@ static int parse_rest(uv_poll_t *req) {
 							json_free(output);
 							json_delete(jsend);
 							FREE(out.string_);
-							FREE(decoded);
 							FREE(key);
 							goto clear;
 						} else {
 							char *z = "{\"message\":\"failed\"}";
 							send_data(req, "application/json", z, strlen(z));
-							FREE(decoded);
 							FREE(key);
 							goto clear;
 						}
@@ -742,7 +1455,6 @@ static int parse_rest(uv_poll_t *req) {
 					if(value == NULL) {
 						char *z = "{\"message\":\"failed\"}";
 						send_data(req, "application/json", z, strlen(z));
-						FREE(decoded);
 						FREE(key);
 						goto clear;
 					} else {
@@ -750,7 +1462,6 @@ static int parse_rest(uv_poll_t *req) {
 							if(config_registry_set_number(key, atof(value)) == 0) {
 								char *z = "{\"message\":\"success\"}";
 								send_data(req, "application/json", z, strlen(z));
-								FREE(decoded);
 								FREE(key);
 								FREE(value);
 								goto clear;
@@ -759,7 +1470,6 @@ static int parse_rest(uv_poll_t *req) {
 							if(config_registry_set_string(key, value) == 0) {
 								char *z = "{\"message\":\"success\"}";
 								send_data(req, "application/json", z, strlen(z));
-								FREE(decoded);
 								FREE(key);
 								FREE(value);
 								goto clear;
@@ -768,7 +1478,6 @@ static int parse_rest(uv_poll_t *req) {
 					}
 					char *z = "{\"message\":\"failed\"}";
 					send_data(req, "application/json", z, strlen(z));
-					FREE(decoded);
 					FREE(key);
 					FREE(value);
 					goto clear;
@@ -783,13 +1492,11 @@ static int parse_rest(uv_poll_t *req) {
 						if(out.type_ == JSON_STRING) {
 							FREE(out.string_);
 						}
-						FREE(decoded);
 						FREE(key);
 						goto clear;
 					}
 					char *z = "{\"message\":\"failed\"}";
 					send_data(req, "application/json", z, strlen(z));
-					FREE(decoded);
 					FREE(key);
 					goto clear;
 				}
@@ -797,22 +1504,20 @@ static int parse_rest(uv_poll_t *req) {
 			json_delete(jvalues);
 			json_delete(jobject);
 		}
-		FREE(decoded);
-		array_free(&array, a);
 	} else {
 		json_delete(jcode);
 		json_delete(jvalues);
 		json_delete(jobject);
 	}
+	json_delete(jbulk);
 	char *z = "{\"message\":\"failed\"}";
 	send_data(req, "application/json", z, strlen(z));
 	return MG_TRUE;
 
 clear:
-	array_free(&array1, c);
-	array_free(&array, a);
 	json_delete(jvalues);
 	json_delete(jobject);
+	json_delete(jbulk);
 
 	return MG_TRUE;
 }
@@ -850,7 +1555,7 @@ static int file_read_cb(int fd, uv_poll_t *req) {
 
 	int ret = select(fd+1, &readset, NULL, NULL, &timeout);
 	if(ret >= 0 && errno == EINTR) {
-		conn->fd = -1;
+		conn->file_fd = -1;
 		close(fd);
 		return -1;
 	} else if((ret == -1 && errno == EINTR) || ret == 0) {
@@ -863,9 +1568,11 @@ static int file_read_cb(int fd, uv_poll_t *req) {
 		send_chunked_data(req, &buffer, bytes);
 		if(bytes < WEBSERVER_CHUNK_SIZE) {
 			iobuf_append(&custom_poll_data->send_iobuf, "0\r\n\r\n", 5);
-			uv_custom_close(req);
-			conn->fd = -1;
+			conn->file_fd = -1;
 			close(fd);
+			uv_custom_write(req);
+			http_request_done(req);
+			return 0;
 		}
 		uv_custom_write(req);
 
@@ -873,20 +1580,612 @@ static int file_read_cb(int fd, uv_poll_t *req) {
 	} else if(bytes == 0) {
 		if(conn->flags == 1) {
 			iobuf_append(&custom_poll_data->send_iobuf, "0\r\n\r\n", 5);
-			uv_custom_close(req);
-			conn->fd = -1;
-			close(fd);
+		} else {
+			/* An empty file, the header and the last chunk only */
+			send_chunked_data(req, &buffer, 0);
 		}
+		conn->file_fd = -1;
+		close(fd);
+		uv_custom_write(req);
+		http_request_done(req);
 		return 0;
 	} else if(bytes < 0) {
 		logprintf(LOG_ERR, "read: %s", strerror(errno));
-		conn->fd = -1;
+		conn->file_fd = -1;
 		close(fd);
 		return -1;
 	}
 	return 0;
 }
 
+/*
+ * /history?device=...&setting=...&tier=minute&from=...&to=...&format=csv
+ */
+static int history_handler(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *conn = custom_poll_data->data;
+	struct JsonNode *jsend = NULL;
+	struct span_t rest, part, kspan, vspan;
+	char *decoded = NULL, *output = NULL, *name = NULL, *val = NULL;
+	char *device = NULL, *setting = NULL;
+	unsigned long from = 0, to = 0;
+	int csv = 0, tier = HISTORY_RAW;
+	size_t outlen = 0;
+
+	if((decoded = (char *)conn->query_string) == NULL || urldecode(decoded, decoded) == -1) {
+		char *z = "{\"message\":\"failed\",\"error\":\"cannot decode url\"}";
+		send_data(req, "application/json", z, strlen(z));
+		return MG_TRUE;
+	}
+
+	span_init(&rest, decoded);
+	while(span_next(&rest, "&", &part) == 1) {
+		if(span_pair(&part, "=", &kspan, &vspan) == 0) {
+			name = span_terminate(&kspan);
+			val = span_terminate(&vspan);
+			if(strcmp(name, "device") == 0 && device == NULL) {
+				device = STRDUP(val);
+			} else if(strcmp(name, "setting") == 0 && setting == NULL) {
+				setting = STRDUP(val);
+			} else if(strcmp(name, "tier") == 0) {
+				tier = history_tier(val);
+			} else if(strcmp(name, "from") == 0) {
+				from = strtoul(val, NULL, 10);
+			} else if(strcmp(name, "to") == 0) {
+				to = strtoul(val, NULL, 10);
+			} else if(strcmp(name, "format") == 0) {
+				csv = (strcmp(val, "csv") == 0);
+			}
+		}
+	}
+
+	if(device != NULL && setting != NULL && tier != -1) {
+		if(csv == 1) {
+			if((output = history_csv(device, setting, tier, from, to, &outlen)) != NULL) {
+				send_data(req, "text/csv", output, outlen);
+				FREE(output);
+			}
+		} else if((jsend = history_get(device, setting, tier, from, to)) != NULL) {
+			send_json(req, jsend);
+			json_delete(jsend);
+		}
+	}
+	if(output == NULL && jsend == NULL) {
+		char *z = "{\"message\":\"failed\",\"error\":\"no history of this device setting\"}";
+		send_data(req, "application/json", z, strlen(z));
+	}
+	if(device != NULL) {
+		FREE(device);
+	}
+	if(setting != NULL) {
+		FREE(setting);
+	}
+
+	return MG_TRUE;
+}
+
+#ifndef PILIGHT_REWRITE
+static void webcam_clients_free(struct webcam_client_t **list) {
+	struct webcam_client_t *tmp = NULL;
+
+	while(*list) {
+		tmp = *list;
+		*list = (*list)->next;
+		FREE(tmp);
+	}
+}
+
+static void webcam_client_add(struct webcam_client_t **list, uv_poll_t *req) {
+	struct webcam_client_t *node = NULL;
+
+	if((node = MALLOC(sizeof(struct webcam_client_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->req = req;
+	node->next = *list;
+	*list = node;
+}
+
+static void webcam_client_take(struct webcam_client_t **list, uv_poll_t *req) {
+	struct webcam_client_t *tmp = *list, *prev = NULL;
+
+	while(tmp) {
+		if(tmp->req == req) {
+			if(prev == NULL) {
+				*list = tmp->next;
+			} else {
+				prev->next = tmp->next;
+			}
+			FREE(tmp);
+			return;
+		}
+		prev = tmp;
+		tmp = tmp->next;
+	}
+}
+
+/* A closed connection no longer waits for any camera */
+static void webcam_client_remove(uv_poll_t *req) {
+	struct webcam_t *cam = webcams;
+
+	while(cam) {
+		webcam_client_take(&cam->waiting, req);
+		webcam_client_take(&cam->streams, req);
+		cam = cam->next;
+	}
+}
+
+static void webcam_cache_free(struct webcam_t *cam) {
+	webcam_clients_free(&cam->waiting);
+	webcam_clients_free(&cam->streams);
+	if(cam->timer_req != NULL) {
+		uv_timer_stop(cam->timer_req);
+		uv_close((uv_handle_t *)cam->timer_req, close_cb);
+	}
+	if(cam->frame != NULL) {
+		FREE(cam->frame);
+	}
+	if(cam->part != NULL) {
+		FREE(cam->part);
+	}
+	FREE(cam->device);
+	FREE(cam);
+}
+
+/* The url of a webcam device, which can be changed at any time */
+static char *webcam_url(const char *device, int *interval) {
+	struct devices_t *dev = NULL;
+	struct devices_settings_t *sptr = NULL;
+
+	if(devices_get((char *)device, &dev) != 0 || dev->protocols == NULL ||
+	   dev->protocols->listener->devtype != WEBCAM) {
+		return NULL;
+	}
+	if((sptr = devices_get_setting(dev, "poll-interval")) != NULL && sptr->values->type == JSON_NUMBER &&
+	   sptr->values->number_ >= 1) {
+		*interval = (int)sptr->values->number_;
+	}
+	if((sptr = devices_get_setting(dev, "url")) == NULL || sptr->values->type != JSON_STRING) {
+		return NULL;
+	}
+	return sptr->values->string_;
+}
+
+static struct webcam_t *webcam_get(const char *device) {
+	struct webcam_t *cam = webcams;
+	int interval = 10;
+
+	while(cam) {
+		if(strcmp(cam->device, device) == 0) {
+			break;
+		}
+		cam = cam->next;
+	}
+	if(webcam_url(device, &interval) == NULL) {
+		return NULL;
+	}
+	if(cam == NULL) {
+		if((cam = MALLOC(sizeof(struct webcam_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(cam, 0, sizeof(struct webcam_t));
+		if((cam->device = STRDUP(device)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		cam->next = webcams;
+		webcams = cam;
+	}
+	cam->interval = interval;
+	return cam;
+}
+
+static void webcam_send(uv_poll_t *req, struct webcam_t *cam) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	char header[1024], *p = header;
+
+	if(cam->frame == NULL) {
+		char *a = "HTTP/1.1 502 Bad Gateway\r\n"
+			"Server: pilight\r\n"
+			"Keep-Alive: timeout=15, max=100\r\n"
+			"Content-Length: 0\r\n\r\n";
+		iobuf_append(&custom_poll_data->send_iobuf, a, strlen(a));
+		return;
+	}
+	webserver_create_header(&p, "200 OK", cam->mimetype, (unsigned long)cam->len);
+	iobuf_append(&custom_poll_data->send_iobuf, header, (int)(p-header));
+	iobuf_append(&custom_poll_data->send_iobuf, cam->frame, cam->len);
+}
+
+/*
+ * The device name is the userdata, as the camera may be gone
+ * by the time the response comes in.
+ */
+static void webcam_done(int code, char *data, int size, char *type, void *userdata) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct webcam_t *cam = webcams;
+	struct webcam_client_t *waiting = NULL, *tmp = NULL;
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	char *device = userdata;
+	int n = 0;
+
+	while(cam) {
+		if(strcmp(cam->device, device) == 0) {
+			break;
+		}
+		cam = cam->next;
+	}
+	FREE(device);
+	if(cam == NULL || loop == 0) {
+		return;
+	}
+	cam->fetching = 0;
+
+	if(code == 200 && data != NULL && size > 0) {
+		if((cam->frame = REALLOC(cam->frame, (size_t)size)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(cam->frame, data, (size_t)size);
+		cam->len = size;
+		snprintf(cam->mimetype, sizeof(cam->mimetype), "%s", (type != NULL && strlen(type) > 0) ? type : "image/jpeg");
+		cam->fetched = time(NULL);
+
+		if((cam->part = REALLOC(cam->part, (size_t)size+sizeof(cam->mimetype)+128)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		n = sprintf(cam->part, "--" WEBCAM_BOUNDARY "\r\nContent-Type: %s\r\nContent-Length: %d\r\n\r\n", cam->mimetype, size);
+		memcpy(&cam->part[n], data, (size_t)size);
+		memcpy(&cam->part[n+size], "\r\n", 2);
+		cam->partlen = n+size+2;
+
+		/* A stream that can't keep up skips frames */
+		for(tmp=cam->streams;tmp!=NULL;tmp=tmp->next) {
+			if((custom_poll_data = tmp->req->data) != NULL &&
+			   custom_poll_data->send_iobuf.len < WEBSERVER_SEND_HIGH) {
+				uv_custom_write_shared(tmp->req, cam->part, (size_t)cam->partlen);
+			}
+		}
+	} else {
+		logprintf(LOG_NOTICE, "could not fetch the snapshot of webcam %s (%d)", cam->device, code);
+	}
+
+	waiting = cam->waiting;
+	cam->waiting = NULL;
+	while(waiting) {
+		tmp = waiting;
+		waiting = waiting->next;
+		if(tmp->req->data != NULL) {
+			webcam_send(tmp->req, cam);
+			uv_custom_write(tmp->req);
+			http_request_done(tmp->req);
+		}
+		FREE(tmp);
+	}
+}
+
+static void webcam_fetch(struct webcam_t *cam) {
+	char *url = NULL, *device = NULL;
+
+	if(cam->fetching == 1 || (url = webcam_url(cam->device, &cam->interval)) == NULL) {
+		return;
+	}
+	if((device = STRDUP(cam->device)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	cam->fetching = 1;
+	http_get_content(url, webcam_done, device);
+}
+
+static void webcam_tick(uv_timer_t *handle) {
+	struct webcam_t *cam = handle->data;
+
+	if(cam->streams == NULL) {
+		uv_timer_stop(handle);
+		return;
+	}
+	webcam_fetch(cam);
+}
+
+/*
+ * /webcam?device=<name> returns the latest snapshot of a webcam
+ * device, adding &stream=1 turns it into an MJPEG stream.
+ */
+static int webcam_handler(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *conn = custom_poll_data->data;
+	struct span_t rest, part, kspan, vspan;
+	struct webcam_t *cam = NULL;
+	char *decoded = NULL, *name = NULL, *val = NULL, *device = NULL;
+	int stream = 0;
+
+	if((decoded = (char *)conn->query_string) != NULL && urldecode(decoded, decoded) != -1) {
+		span_init(&rest, decoded);
+		while(span_next(&rest, "&", &part) == 1) {
+			if(span_pair(&part, "=", &kspan, &vspan) == 0) {
+				name = span_terminate(&kspan);
+				val = span_terminate(&vspan);
+				if(strcmp(name, "device") == 0) {
+					device = val;
+				} else if(strcmp(name, "stream") == 0) {
+					stream = (strcmp(val, "1") == 0);
+				}
+			}
+		}
+	}
+
+	if(device == NULL || (cam = webcam_get(device)) == NULL) {
+		char buffer[1024], *p = buffer;
+		create_404_header(conn->uri, &p);
+		iobuf_append(&custom_poll_data->send_iobuf, buffer, (int)(p-buffer));
+		return MG_TRUE;
+	}
+
+	if(stream == 1) {
+		char *a = "HTTP/1.1 200 OK\r\n"
+			"Server: pilight\r\n"
+			"Content-Type: multipart/x-mixed-replace; boundary=" WEBCAM_BOUNDARY "\r\n"
+			"Cache-Control: no-cache\r\n"
+			"Connection: close\r\n\r\n";
+		iobuf_append(&custom_poll_data->send_iobuf, a, strlen(a));
+		if(cam->part != NULL) {
+			iobuf_append(&custom_poll_data->send_iobuf, cam->part, cam->partlen);
+		}
+		uv_custom_write(req);
+
+		conn->keepalive = 0;
+		webcam_client_add(&cam->streams, req);
+		if(cam->timer_req == NULL) {
+			if((cam->timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+			uv_timer_init(uv_default_loop(), cam->timer_req);
+			cam->timer_req->data = cam;
+		}
+		if(uv_is_active((uv_handle_t *)cam->timer_req) == 0) {
+			uv_timer_start(cam->timer_req, webcam_tick, 0, (uint64_t)cam->interval*1000);
+		}
+		/* The request is never done, so no further requests are read */
+		return MG_MORE;
+	}
+
+	if(cam->frame != NULL && time(NULL)-cam->fetched < cam->interval) {
+		webcam_send(req, cam);
+		return MG_TRUE;
+	}
+	webcam_client_add(&cam->waiting, req);
+	webcam_fetch(cam);
+	if(cam->fetching == 0 && cam->waiting != NULL) {
+		/* The fetch could not be started, or was answered right away */
+		webcam_client_take(&cam->waiting, req);
+		webcam_send(req, cam);
+		return MG_TRUE;
+	}
+	return MG_MORE;
+}
+#endif
+
+#ifndef PILIGHT_REWRITE
+/*
+ * The config and values of a webgui page load in one response:
+ *
+ * {"etag":"...","config":{...},"values":[...]}
+ *
+ * A client that sends the ETag it has, as If-None-Match or as
+ * ?since=, gets a 304 when nothing changed, or only the values
+ * of the devices changed in between:
+ *
+ * {"etag":"...","delta":1,"values":[...]}
+ */
+static int bootstrap_handler(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *conn = custom_poll_data->data;
+	struct JsonNode *jconfig = NULL;
+	const char *hdr = http_get_header(conn, "If-None-Match");
+	char media[15], etag[96], header[512], prefix[128], *values = NULL, *p = NULL;
+	unsigned long generation = devices_generation(), revision = config_revision();
+	unsigned long epoch = 0, cgeneration = 0, crevision = 0, since = 0, seq = 0;
+	int known = 0, len = 0;
+	size_t body = 0;
+
+	strcpy(media, "web");
+	if(conn->query_string != NULL) {
+		if((p = strstr(conn->query_string, "media=")) != NULL) {
+			sscanf(p, "media=%14[^&]", media);
+		}
+		if((p = strstr(conn->query_string, "since=")) != NULL &&
+		   sscanf(p, "since=%lx-%lx-%lx-%lu", &epoch, &cgeneration, &crevision, &since) == 4) {
+			known = 1;
+		}
+	}
+	if(known == 0 && hdr != NULL &&
+	   sscanf(hdr, "\"%lx-%lx-%lx-%lu\"", &epoch, &cgeneration, &crevision, &since) == 4) {
+		known = 1;
+	}
+	/* Only values of the same devices and config can be patched */
+	if(known == 1 && (epoch != bootstrap_epoch || cgeneration != generation ||
+	   crevision != revision || since > devices_sequence())) {
+		known = 0;
+	}
+
+	if(known == 1 && since == devices_sequence()) {
+		snprintf(etag, sizeof(etag), "%lx-%lx-%lx-%lu", bootstrap_epoch, generation, revision, since);
+		len = snprintf(header, sizeof(header),
+			"HTTP/1.1 304 Not Modified\r\n"
+			"Server: pilight\r\n"
+			"Keep-Alive: timeout=15, max=100\r\n"
+			"ETag: \"%s\"\r\n\r\n", etag);
+		iobuf_append(&custom_poll_data->send_iobuf, header, len);
+		return MG_TRUE;
+	}
+
+	values = devices_values_since(media, (known == 1) ? since : 0, &seq);
+	snprintf(etag, sizeof(etag), "%lx-%lx-%lx-%lu", bootstrap_epoch, generation, revision, seq);
+
+	if(known == 0 && (bootstrap_config == NULL || strcmp(bootstrap_media, media) != 0 ||
+	   bootstrap_generation != generation || bootstrap_revision != revision)) {
+		if(bootstrap_config != NULL) {
+			json_free(bootstrap_config);
+			bootstrap_config = NULL;
+		}
+		if((jconfig = config_print(CONFIG_USER, media)) != NULL) {
+			bootstrap_config = json_stringify(jconfig, NULL);
+			json_delete(jconfig);
+		}
+		if(bootstrap_config == NULL) {
+			FREE(values);
+			char *z = "{\"message\":\"failed\",\"error\":\"cannot print config\"}";
+			send_data(req, "application/json", z, strlen(z));
+			return MG_TRUE;
+		}
+		bootstrap_config_len = strlen(bootstrap_config);
+		strcpy(bootstrap_media, media);
+		bootstrap_generation = generation;
+		bootstrap_revision = revision;
+	}
+
+	len = snprintf(prefix, sizeof(prefix), "{\"etag\":\"%s\",%s", etag, (known == 0) ? "\"config\":" : "\"delta\":1");
+	body = (size_t)len+((known == 0) ? bootstrap_config_len : 0)+10+strlen(values)+1;
+
+	len = snprintf(header, sizeof(header),
+		"HTTP/1.1 200 OK\r\n"
+		"Server: pilight\r\n"
+		"Keep-Alive: timeout=15, max=100\r\n"
+		"Content-Type: application/json\r\n"
+		"Cache-Control: no-cache\r\n"
+		"ETag: \"%s\"\r\n"
+		"Content-Length: %lu\r\n\r\n", etag, (unsigned long)body);
+	iobuf_append(&custom_poll_data->send_iobuf, header, len);
+	iobuf_append(&custom_poll_data->send_iobuf, prefix, (int)strlen(prefix));
+	if(known == 0) {
+		iobuf_append(&custom_poll_data->send_iobuf, bootstrap_config, (int)bootstrap_config_len);
+	}
+	iobuf_append(&custom_poll_data->send_iobuf, ",\"values\":", 10);
+	iobuf_append(&custom_poll_data->send_iobuf, values, (int)strlen(values));
+	iobuf_append(&custom_poll_data->send_iobuf, "}", 1);
+	FREE(values);
+
+	return MG_TRUE;
+}
+#endif
+
+/*
+ * Keeps the connection open for the events of the following
+ * broadcasts. The id of the last event seen comes from the
+ * Last-Event-ID header of a reconnecting EventSource, or from
+ * ?last-event-id= for the first connection.
+ */
+static int stream_handler(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *conn = custom_poll_data->data;
+	struct webserver_clients_t *tmp = webserver_clients;
+	const char *hdr = http_get_header(conn, "Last-Event-ID");
+	unsigned long last = 0, id = 0;
+	char buf[256];
+	int len = 0, resume = 0;
+
+	if(hdr != NULL) {
+		last = strtoul(hdr, NULL, 10);
+		resume = 1;
+	} else if(conn->query_string != NULL && sscanf(conn->query_string, "last-event-id=%lu", &last) == 1) {
+		resume = 1;
+	}
+
+	len = snprintf(buf, sizeof(buf),
+		"HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/event-stream\r\n"
+		"Cache-Control: no-cache\r\n"
+		"Connection: keep-alive\r\n"
+		"X-Accel-Buffering: no\r\n\r\n"
+		"retry: %d\n\n", WEBSERVER_STREAM_RETRY);
+	iobuf_append(&custom_poll_data->send_iobuf, buf, len);
+
+	/* An id ahead of ours is from before a restart of the daemon */
+	if(resume == 1 && last < stream_id) {
+		id = last+1;
+		if(stream_id-last > WEBSERVER_STREAM_REPLAY) {
+			id = stream_id-WEBSERVER_STREAM_REPLAY+1;
+		}
+		for(;id<=stream_id;id++) {
+			struct stream_event_t *ev = &stream_replay[id % WEBSERVER_STREAM_REPLAY];
+			if(ev->id == id && ev->out != NULL) {
+				iobuf_append(&custom_poll_data->send_iobuf, ev->out, (int)ev->len);
+			}
+		}
+	}
+	uv_custom_write(req);
+
+	conn->is_stream = 1;
+	conn->keepalive = 0;
+	while(tmp) {
+		if(tmp->req == req) {
+			tmp->is_stream = 1;
+			break;
+		}
+		tmp = tmp->next;
+	}
+
+	/* The request is never done, so no further requests are read */
+	return MG_MORE;
+}
+
+/*
+ * Serializes a broadcast once as an event for all stream clients
+ * and keeps it for the ones that reconnect.
+ */
+static struct stream_event_t *stream_event(struct broadcast_list_t *bc) {
+	struct stream_event_t *ev = NULL;
+	char header[64];
+	int n = 0;
+
+	stream_id++;
+	ev = &stream_replay[stream_id % WEBSERVER_STREAM_REPLAY];
+	if(ev->out != NULL) {
+		FREE(ev->out);
+	}
+
+	n = snprintf(header, sizeof(header), "id: %lu\ndata: ", stream_id);
+	ev->id = stream_id;
+	ev->len = (size_t)n+(size_t)bc->len+2;
+	if((ev->out = MALLOC(ev->len+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(ev->out, header, (size_t)n);
+	memcpy(&ev->out[n], bc->out, (size_t)bc->len);
+	memcpy(&ev->out[n+bc->len], "\n\n", 3);
+
+	return ev;
+}
+
+/*
+ * The bundles of the webgui are named after their content, as
+ * name.<WEBSERVER_FINGERPRINT hex digits>.ext. A new build gets
+ * new names, so these can be cached for good while the index
+ * that refers to them is always revalidated.
+ */
+static int webserver_fingerprinted(const char *file) {
+	const char *base = NULL, *ext = NULL, *c = NULL;
+
+	if((base = strrchr(file, '/')) == NULL) {
+		base = file;
+	}
+	if((ext = strrchr(base, '.')) == NULL || ext-base < WEBSERVER_FINGERPRINT+2) {
+		return 0;
+	}
+	if(*(ext-WEBSERVER_FINGERPRINT-1) != '.') {
+		return 0;
+	}
+	for(c=ext-WEBSERVER_FINGERPRINT;c<ext;c++) {
+		if(!((*c >= '0' && *c <= '9') || (*c >= 'a' && *c <= 'f'))) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
 static int request_handler(uv_poll_t *req) {
 	/*
 	 * Make sure we execute in the main thread
@@ -916,14 +2215,29 @@ static int request_handler(uv_poll_t *req) {
 						internal = CONFIG_INTERNAL;
 					}
 				}
+#ifdef PILIGHT_REWRITE
+				struct JsonNode *jsend = config_print(internal, media);
+				if(jsend != NULL) {
+					send_json(req, jsend);
+					json_delete(jsend);
+				}
+				jsend = NULL;
+#else
+				struct webserver_snapshot_t state;
+				char key[64];
+				snprintf(key, sizeof(key), "/config?%s&%d", media, internal);
+				if(send_snapshot(req, key) == 0) {
+					return MG_TRUE;
+				}
+				snapshot_state(&state);
 				struct JsonNode *jsend = config_print(internal, media);
 				if(jsend != NULL) {
 					char *output = json_stringify(jsend, NULL);
-					send_data(req, "application/json", output, strlen(output));
 					json_delete(jsend);
+					send_snapshot_new(req, key, &state, output, strlen(output));
 					json_free(output);
 				}
-				jsend = NULL;
+#endif
 				return MG_TRUE;
 			} else if(strcmp(conn->uri, "/values") == 0) {
 				char media[15];
@@ -933,16 +2247,72 @@ static int request_handler(uv_poll_t *req) {
 				}
 #ifdef PILIGHT_REWRITE
 				struct JsonNode *jsend = values_print(media);
-#else
-				JsonNode *jsend = devices_values(media);
-#endif
 				if(jsend != NULL) {
-					char *output = json_stringify(jsend, NULL);
-					send_data(req, "application/json", output, strlen(output));
+					send_json(req, jsend);
 					json_delete(jsend);
-					json_free(output);
 				}
 				jsend = NULL;
+#else
+				struct webserver_snapshot_t state;
+				char key[64];
+				snprintf(key, sizeof(key), "/values?%s", media);
+				if(send_snapshot(req, key) == 0) {
+					return MG_TRUE;
+				}
+				snapshot_state(&state);
+				char *output = devices_values_json(media);
+				send_snapshot_new(req, key, &state, output, strlen(output));
+				FREE(output);
+#endif
+				return MG_TRUE;
+			} else if(strcmp(conn->uri, "/trace") == 0) {
+				size_t len = 0;
+				char *output = trace_print(&len);
+				send_data(req, "application/json", output, len);
+				json_free(output);
+				return MG_TRUE;
+			} else if(strcmp(conn->uri, "/profile") == 0) {
+				/* Change the sampling rate, or read the stacks sampled so far */
+				size_t len = 0;
+				int rate = 0;
+				if(conn->query_string != NULL && sscanf(conn->query_string, "rate=%d", &rate) == 1 && rate >= 0) {
+					profile_start((unsigned int)rate);
+				}
+				char *output = profile_print(&len);
+				send_data(req, "text/plain", output, len);
+				FREE(output);
+				return MG_TRUE;
+			} else if(strcmp(conn->uri, "/capture") == 0) {
+				/* Start or stop writing the received trains to the capture-file */
+				char output[64], *file = NULL;
+				if(conn->query_string != NULL && strcmp(conn->query_string, "start") == 0) {
+					if(config_setting_get_string("capture-file", 0, &file) == 0) {
+						capture_start(file);
+						FREE(file);
+					}
+				} else if(conn->query_string != NULL && strcmp(conn->query_string, "stop") == 0) {
+					capture_stop();
+				}
+				snprintf(output, sizeof(output), "{\"capture\":\"%s\"}", (capture_running() == 1) ? "running" : "stopped");
+				send_data(req, "application/json", output, strlen(output));
+				return MG_TRUE;
+#ifndef PILIGHT_REWRITE
+			} else if(strcmp(conn->uri, "/bootstrap") == 0) {
+				return bootstrap_handler(req);
+#endif
+			} else if(strcmp(conn->uri, "/stream") == 0) {
+				return stream_handler(req);
+#ifndef PILIGHT_REWRITE
+			} else if(strcmp(conn->uri, "/webcam") == 0) {
+				return webcam_handler(req);
+#endif
+			} else if(strcmp(conn->uri, "/history") == 0) {
+				return history_handler(req);
+			} else if(strcmp(conn->uri, "/metrics") == 0) {
+				size_t len = 0;
+				char *output = metrics_print(&len);
+				send_data(req, "text/plain; version=0.0.4", output, len);
+				FREE(output);
 				return MG_TRUE;
 			} else if(strstr(conn->uri, "/") != NULL && strcmp(&conn->uri[(rstrstr(conn->uri, "/")-conn->uri)], "/") == 0) {
 				char indexes[2][11] = {"index.html","index.htm"};
@@ -1049,17 +2419,86 @@ static int request_handler(uv_poll_t *req) {
 				}
 			}
 
-			int match = 0;
-			if(cache == 1) {
-				struct fcache_t *tmp = fcache;
-				while(tmp) {
-					if(strcmp(tmp->name, conn->request) == 0) {
-						match = 1;
-						break;
+			/*
+			 * Serve a precompressed sibling when the client accepts it,
+			 * and let the client keep its copy when the ETag matches.
+			 */
+			struct stat st;
+			const char *header = NULL, *caching = "";
+			char etag[64];
+			int gzip = 0, vary = 0;
+
+			if(webserver_fingerprinted(conn->request) == 1) {
+				caching = "Cache-Control: public, max-age=31536000, immutable\r\n";
+			} else if(strcmp(conn->mimetype, "text/html") == 0) {
+				caching = "Cache-Control: no-cache\r\n";
+			}
+
+			if(strlen(conn->request) < 1024) {
+				char gz[1028];
+				snprintf(gz, sizeof(gz), "%s.gz", conn->request);
+				if(stat(gz, &st) == 0 && S_ISREG(st.st_mode)) {
+					vary = 1;
+					if((header = http_get_header(conn, "Accept-Encoding")) != NULL && strstr(header, "gzip") != NULL) {
+						if((conn->request = REALLOC(conn->request, strlen(gz)+1)) == NULL) {
+							OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+						}
+						strcpy(conn->request, gz);
+						gzip = 1;
 					}
-					tmp = tmp->next;
 				}
-				if(match == 1) {
+			}
+			if(stat(conn->request, &st) != 0) {
+				goto filenotfound;
+			}
+			snprintf(etag, sizeof(etag), "\"%lx-%lx-%lx%s\"",
+				(unsigned long)st.st_ino, (unsigned long)st.st_size, (unsigned long)st.st_mtime, (gzip == 1) ? "-gz" : "");
+			snprintf(conn->file_headers, sizeof(conn->file_headers), "ETag: %s\r\n%s%s%s%s",
+				etag, caching, (gzip == 1) ? "Content-Encoding: gzip\r\n" : "", (vary == 1) ? "Vary: Accept-Encoding\r\n" : "",
+				conn->session);
+
+			if((header = http_get_header(conn, "If-None-Match")) != NULL && strstr(header, etag) != NULL) {
+				p += sprintf(p,
+					"HTTP/1.1 304 Not Modified\r\n"
+					"Server: pilight\r\n"
+					"Keep-Alive: timeout=15, max=100\r\n"
+					"%s\r\n",
+					conn->file_headers);
+				iobuf_append(&custom_poll_data->send_iobuf, buffer, (int)(p-buffer));
+				FREE(conn->request);
+				conn->request = NULL;
+				return MG_TRUE;
+			}
+
+#ifdef __linux__
+			if(custom_poll_data->is_ssl == 0) {
+				if((conn->file_fd = open(conn->request, O_RDONLY)) < 0) {
+					logprintf(LOG_ERR, "open: %s", strerror(errno));
+					goto filenotfound;
+				}
+				conn->sendfile = 1;
+				conn->file_offset = 0;
+				conn->file_size = st.st_size;
+
+				p += sprintf(p,
+					"HTTP/1.1 200 OK\r\n"
+					"Server: pilight\r\n"
+					"Keep-Alive: timeout=15, max=100\r\n"
+					"Content-Type: %s\r\n"
+					"Content-Length: %lu\r\n"
+					"%s\r\n",
+					conn->mimetype, (unsigned long)st.st_size, conn->file_headers);
+				iobuf_append(&custom_poll_data->send_iobuf, buffer, (int)(p-buffer));
+				uv_custom_write(req);
+				return MG_MORE;
+			}
+#endif
+
+			int match = 0;
+			if(cache == 1) {
+				struct fcache_t *tmp = fcache_get(conn->request);
+				if(tmp != NULL) {
+					match = 1;
 					send_chunked_data(req, tmp->bytes, tmp->size);
 					iobuf_append(&custom_poll_data->send_iobuf, "0\r\n\r\n", 5);
 					return MG_TRUE;
@@ -1081,7 +2520,7 @@ static int request_handler(uv_poll_t *req) {
 				if(file_read_cb(conn->file_fd, req) == 0) {
 					return MG_MORE;
 				} else {
-					return MG_TRUE;
+					return MG_FALSE;
 				}
 			}
 
@@ -1097,7 +2536,22 @@ static int request_handler(uv_poll_t *req) {
 		strncpy(input, conn->content, conn->content_len);
 		input[conn->content_len] = '\0';
 
-		if(json_validate(input) == true) {
+		size_t errpos = 0;
+		struct JsonNode *json = json_decode_checked(input, &errpos);
+		if(json != NULL) {
+			char *action = NULL;
+			if(json != NULL && json_find_string(json, "action", &action) == 0 && strcmp(action, "identify") == 0) {
+				struct JsonNode *jfilter = json_find_member(json, "filter");
+				if(jfilter == NULL) {
+					gui_filter_free(&conn->filter);
+				} else {
+					gui_filter_parse(jfilter, &conn->filter);
+				}
+			}
+			if(json != NULL) {
+				json_delete(json);
+			}
+
 			struct reason_socket_received_t *data = MALLOC(sizeof(struct reason_socket_received_t));
 			if(data == NULL) {
 				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
@@ -1110,19 +2564,203 @@ static int request_handler(uv_poll_t *req) {
 			strcpy(data->type, "websocket");
 
 			eventpool_trigger(REASON_SOCKET_RECEIVED, reason_socket_received_free, data);
+		} else {
+			logprintf(LOG_DEBUG, "websocket client sent invalid json at byte %zu", errpos);
 		}
 		FREE(input);
 		return MG_TRUE;
 	}
 
-filenotfound:
-	logprintf(LOG_WARNING, "(webserver) could not read %s", conn->request);
-	create_404_header(conn->uri, &p);
-	FREE(conn->request);
-
-	iobuf_append(&custom_poll_data->send_iobuf, buffer, (int)(p-buffer));
+filenotfound:
+	logprintf(LOG_WARNING, "(webserver) could not read %s", conn->request);
+	create_404_header(conn->uri, &p);
+	FREE(conn->request);
+
+	iobuf_append(&custom_poll_data->send_iobuf, buffer, (int)(p-buffer));
+
+	return MG_TRUE;
+}
+
+static void broadcast_free(struct broadcast_list_t *node) {
+	int i = 0;
+
+	for(i=0;i<node->nrdev;i++) {
+		FREE(node->devices[i]);
+	}
+	if(node->devices != NULL) {
+		FREE(node->devices);
+	}
+	if(node->len > 0) {
+		FREE(node->out);
+	}
+	FREE(node);
+}
+
+/*
+ * A client that identified with a filter only receives the
+ * updates of at least one of the devices it subscribed to.
+ */
+static int websocket_subscribed(uv_poll_t *req, struct broadcast_list_t *bc) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *conn = NULL;
+	int i = 0;
+
+	if(bc->update == 0 || custom_poll_data == NULL ||
+	   (conn = custom_poll_data->data) == NULL || conn->filter == NULL) {
+		return 1;
+	}
+	if(gui_filter_type(conn->filter, bc->type) == 0) {
+		return 0;
+	}
+	for(i=0;i<bc->nrdev;i++) {
+		if(gui_filter_device(conn->filter, bc->devices[i]) == 1) {
+			return 1;
+		}
+	}
+	return (bc->nrdev == 0);
+}
+
+static void websocket_deferred_free(struct connection_t *conn) {
+	struct websocket_deferred_t *tmp = NULL;
+
+	while(conn->deferred != NULL) {
+		tmp = conn->deferred;
+		conn->deferred = conn->deferred->next;
+		FREE(tmp->out);
+		FREE(tmp);
+	}
+}
+
+/*
+ * Keep a device update for later, replacing an older update
+ * of the same devices so only the latest values are sent.
+ */
+static void websocket_defer(struct connection_t *conn, struct broadcast_list_t *bc) {
+	struct websocket_deferred_t *tmp = conn->deferred, *last = NULL;
+
+	while(tmp) {
+		if(tmp->keylen == bc->keylen && memcmp(tmp->out, bc->out, bc->keylen) == 0) {
+			websocket_coalesced++;
+			break;
+		}
+		last = tmp;
+		tmp = tmp->next;
+	}
+	if(tmp == NULL) {
+		if((tmp = MALLOC(sizeof(struct websocket_deferred_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(tmp, 0, sizeof(struct websocket_deferred_t));
+		tmp->keylen = bc->keylen;
+		if(last == NULL) {
+			conn->deferred = tmp;
+		} else {
+			last->next = tmp;
+		}
+	} else {
+		FREE(tmp->out);
+	}
+	if((tmp->out = MALLOC(bc->len+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(tmp->out, bc->out, bc->len+1);
+	tmp->len = bc->len;
+}
+
+static void websocket_resume(uv_poll_t *req, struct connection_t *conn) {
+	struct websocket_deferred_t *tmp = conn->deferred;
+
+	conn->lagging = 0;
+	while(tmp) {
+		websocket_write(req, WEBSOCKET_OPCODE_TEXT, tmp->out, tmp->len);
+		tmp = tmp->next;
+	}
+	websocket_deferred_free(conn);
+}
+
+/*
+ * Returns 0 when the broadcast can be written to the client,
+ * 1 when it was held back or dropped, and 2 when the client
+ * was disconnected.
+ */
+static int websocket_backpressure(uv_poll_t *req, struct broadcast_list_t *bc) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *conn = NULL;
+	ssize_t pending = 0;
+	time_t now = time(NULL);
+
+	if(custom_poll_data == NULL || (conn = custom_poll_data->data) == NULL) {
+		return 0;
+	}
+	pending = custom_poll_data->send_iobuf.len;
+
+	if(conn->lagging == 0) {
+		if(pending <= WEBSERVER_SEND_HIGH) {
+			return 0;
+		}
+		conn->lagging = 1;
+		conn->lagged = now;
+		logprintf(LOG_DEBUG, "websocket client %d is lagging, %zd bytes unsent", conn->fd, pending);
+	} else if(pending <= WEBSERVER_SEND_LOW) {
+		websocket_resume(req, conn);
+		return 0;
+	} else if(now - conn->lagged > WEBSERVER_STALL_TIMEOUT) {
+		logprintf(LOG_NOTICE, "websocket client %d stalled, disconnecting", conn->fd);
+		websocket_evicted++;
+		/* Unsent output would otherwise keep the connection open */
+		iobuf_remove(&custom_poll_data->send_iobuf, custom_poll_data->send_iobuf.len);
+		uv_custom_close(req);
+		return 2;
+	}
+
+	if(bc->keylen > 0) {
+		websocket_defer(conn, bc);
+	} else if(pending > WEBSERVER_SEND_MAX) {
+		websocket_dropped++;
+	} else {
+		return 0;
+	}
+	return 1;
+}
+
+void webserver_stats(struct JsonNode *jstats) {
+	struct webserver_clients_t *clients = NULL;
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	struct connection_t *conn = NULL;
+	int lagging = 0, streams = 0;
+
+	if(lock_init == 0) {
+		return;
+	}
+
+#ifdef _WIN32
+	uv_mutex_lock(&webserver_lock);
+#else
+	pthread_mutex_lock(&webserver_lock);
+#endif
+	clients = webserver_clients;
+	while(clients) {
+		custom_poll_data = clients->req->data;
+		if(custom_poll_data != NULL && (conn = custom_poll_data->data) != NULL && conn->lagging == 1) {
+			lagging++;
+		}
+		if(clients->is_stream == 1) {
+			streams++;
+		}
+		clients = clients->next;
+	}
+#ifdef _WIN32
+	uv_mutex_unlock(&webserver_lock);
+#else
+	pthread_mutex_unlock(&webserver_lock);
+#endif
 
-	return MG_TRUE;
+	json_append_member(jstats, "websocket-lagging", json_mknumber(lagging, 0));
+	json_append_member(jstats, "websocket-coalesced", json_mknumber((double)websocket_coalesced, 0));
+	json_append_member(jstats, "websocket-dropped", json_mknumber((double)websocket_dropped, 0));
+	json_append_member(jstats, "websocket-evicted", json_mknumber((double)websocket_evicted, 0));
+	json_append_member(jstats, "stream-clients", json_mknumber(streams, 0));
+	json_append_member(jstats, "stream-evicted", json_mknumber((double)stream_evicted, 0));
 }
 
 static void webserver_process(uv_async_t *handle) {
@@ -1138,10 +2776,27 @@ static void webserver_process(uv_async_t *handle) {
 	pthread_mutex_lock(&webserver_lock);
 #endif
 
-	struct webserver_clients_t *clients = webserver_clients;
+	struct webserver_clients_t *clients = NULL, *next = NULL;
 	struct broadcast_list_t *tmp = NULL;
+	struct stream_event_t *ev = NULL;
+	char *frame = NULL;
+	size_t framelen = 0;
+#ifdef WEBSERVER_DEFLATE
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	struct connection_t *conn = NULL;
+	char *zframe = NULL, *out = NULL;
+	size_t zframelen = 0, len = 0;
+#endif
+
 	while(broadcast_list) {
 		tmp = broadcast_list;
+		clients = webserver_clients;
+
+		/* A broadcast is framed once and shared by all websocket clients */
+		if(tmp->fd <= 0) {
+			frame = websocket_frame(WEBSOCKET_OPCODE_TEXT, tmp->out, tmp->len, &framelen);
+			ev = stream_event(tmp);
+		}
 
 		while(clients) {
 			if(tmp->fd > 0) {
@@ -1157,16 +2812,73 @@ static void webserver_process(uv_async_t *handle) {
 				if(fd == tmp->fd) {
 					websocket_write(clients->req, WEBSOCKET_OPCODE_TEXT, tmp->out, tmp->len);
 				}
+			} else if(clients->is_stream == 1) {
+				struct uv_custom_poll_t *stream_poll_data = clients->req->data;
+				next = clients->next;
+				if(stream_poll_data == NULL || stream_poll_data->doclose == 1) {
+					clients = next;
+					continue;
+				}
+				if(stream_poll_data->send_iobuf.len > WEBSERVER_SEND_MAX) {
+					logprintf(LOG_DEBUG, "stream client is behind, disconnecting");
+					stream_evicted++;
+					iobuf_remove(&stream_poll_data->send_iobuf, stream_poll_data->send_iobuf.len);
+					uv_custom_close(clients->req);
+					clients = next;
+					continue;
+				}
+				if(stream_poll_data->data != NULL) {
+					((struct connection_t *)stream_poll_data->data)->active = time(NULL);
+				}
+				uv_custom_write_shared(clients->req, ev->out, ev->len);
 			} else if(clients->is_websocket == 1) {
-				websocket_write(clients->req, 1, tmp->out, tmp->len);
+				next = clients->next;
+				if(websocket_subscribed(clients->req, tmp) == 0 ||
+				   websocket_backpressure(clients->req, tmp) != 0) {
+					clients = next;
+					continue;
+				}
+#ifdef WEBSERVER_DEFLATE
+				custom_poll_data = clients->req->data;
+				conn = (custom_poll_data != NULL) ? custom_poll_data->data : NULL;
+				if(conn != NULL && conn->deflate == 1 && tmp->len >= deflate_min) {
+					if(conn->deflate_takeover == 1) {
+						/* Each client has its own compression context */
+						websocket_write(clients->req, WEBSOCKET_OPCODE_TEXT, tmp->out, tmp->len);
+						clients = clients->next;
+						continue;
+					}
+					/* Without context takeover the compressed frame is shared as well */
+					if(zframe == NULL && zshared_init == 1 &&
+					   (out = websocket_deflate(&zshared, 0, tmp->out, tmp->len, &len)) != NULL) {
+						zframe = websocket_frame(WEBSOCKET_OPCODE_TEXT, out, len, &zframelen);
+						zframe[0] |= 0x40;
+						FREE(out);
+					}
+					if(zframe != NULL) {
+						uv_custom_write_shared(clients->req, zframe, zframelen);
+						clients = clients->next;
+						continue;
+					}
+				}
+#endif
+				uv_custom_write_shared(clients->req, frame, framelen);
 			}
 			clients = clients->next;
 		}
-		if(tmp->len > 0) {
-			FREE(tmp->out);
+		trace_stage(&tmp->trace, TRACE_WEBSOCKET);
+		if(frame != NULL) {
+			FREE(frame);
+			frame = NULL;
 		}
+#ifdef WEBSERVER_DEFLATE
+		if(zframe != NULL) {
+			FREE(zframe);
+			zframe = NULL;
+		}
+#endif
 		broadcast_list = broadcast_list->next;
-		FREE(tmp);
+		broadcast_free(tmp);
 	}
 	if(broadcast_list != NULL) {
 		uv_async_send(async_req);
@@ -1208,6 +2920,21 @@ static void *broadcast(int reason, void *param) {
 			for(i=0;i<data->nrdev;i++) {
 				node->len += snprintf(&node->out[node->len], 1024-node->len, "\"%s\",", data->devices[i]);
 			}
+			node->update = 1;
+			node->type = data->type;
+			if(data->nrdev > 0) {
+				if((node->devices = MALLOC(sizeof(char *)*data->nrdev)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+				for(i=0;i<data->nrdev;i++) {
+					if((node->devices[i] = MALLOC(strlen(data->devices[i])+1)) == NULL) {
+						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+					}
+					strcpy(node->devices[i], data->devices[i]);
+				}
+				node->nrdev = data->nrdev;
+			}
+			node->keylen = (size_t)node->len-1;
 			node->len += snprintf(&node->out[node->len-1], 1024-node->len, "],\"values\":{");
 			node->len -= 1;
 			for(i=0;i<data->nrval;i++) {
@@ -1229,6 +2956,7 @@ static void *broadcast(int reason, void *param) {
 		case REASON_BROADCAST_CORE:
 			strncpy(node->out, (char *)param, 1024);
 			node->len = strlen(node->out);
+			trace_find((char *)param, &node->trace);
 		break;
 		default:
 			FREE(node);
@@ -1300,16 +3028,42 @@ static void remove_double_dots_and_double_slashes(char *s) {
 	*p = '\0';
 }
 
+/*
+ * A single pass over the header lines. The names and values
+ * are ended in place, so they point into the buffer itself.
+ * Headers beyond the ones that fit in the connection are
+ * ignored.
+ */
 static void parse_http_headers(char **buf, struct connection_t *c) {
-	size_t i;
+	int max = (int)(sizeof(c->http_headers)/sizeof(c->http_headers[0]));
+	char *p = *buf, *name = NULL, *end = NULL, *value = NULL, *vend = NULL;
+
 	c->num_headers = 0;
-	for(i = 0; i < 1024; i++) {
-		c->http_headers[i].name = skip(buf, ": ");
-		c->http_headers[i].value = skip(buf, "\r\n");
-		if(c->http_headers[i].name[0] == '\0')
-			break;
-		c->num_headers = i + 1;
+	while(c->num_headers < max && *p != '\0' && *p != '\r' && *p != '\n') {
+		name = p;
+		p += strcspn(p, ":\r\n");
+		for(end=p;end > name && (end[-1] == ' ' || end[-1] == '\t');end--);
+		if(*p == ':') {
+			p++;
+			p += strspn(p, " \t");
+		}
+		value = p;
+		p += strcspn(p, "\r\n");
+		for(vend=p;vend > value && (vend[-1] == ' ' || vend[-1] == '\t');vend--);
+		if(*p == '\r') {
+			p++;
+		}
+		if(*p == '\n') {
+			p++;
+		}
+		*end = '\0';
+		*vend = '\0';
+
+		c->http_headers[c->num_headers].name = name;
+		c->http_headers[c->num_headers].value = value;
+		c->num_headers++;
 	}
+	*buf = p;
 }
 
 static int _urldecode(const char *src, int src_len, char *dst, int dst_len, int is_form_url_encoded) {
@@ -1340,6 +3094,10 @@ static int _urldecode(const char *src, int src_len, char *dst, int dst_len, int
 int http_parse_request(char *buffer, struct connection_t *c) {
 	int is_request = 0, n = 0;
 
+	c->num_headers = 0;
+	c->query_string = NULL;
+	c->status_code = 0;
+
 	while(*buffer != '\0' && isspace(*(unsigned char *)buffer)) {
 		buffer++;
 	}
@@ -1391,6 +3149,7 @@ static void webserver_client_add(uv_poll_t *req) {
 	}
 	node->req = req;
 	node->is_websocket = 0;
+	node->is_stream = 0;
 
 	node->next = webserver_clients;
 	webserver_clients = node;
@@ -1430,7 +3189,7 @@ static void webserver_client_remove(uv_poll_t *req) {
 #endif
 }
 
-static void send_websocket_handshake(uv_poll_t *req, const char *key) {
+static void send_websocket_handshake(uv_poll_t *req, const char *key, const char *extensions) {
 	/*
 	 * Make sure we execute in the main thread
 	 */
@@ -1455,7 +3214,8 @@ static void send_websocket_handshake(uv_poll_t *req, const char *key) {
               "HTTP/1.1 101 Web Socket Protocol Handshake\r\n"
               "Connection: Upgrade\r\n"
               "Upgrade: websocket\r\n"
-              "Sec-WebSocket-Accept: %s\r\n\r\n", b64_sha);
+              "Sec-WebSocket-Accept: %s\r\n"
+              "%s\r\n", b64_sha, extensions);
 
 	iobuf_append(&custom_poll_data->send_iobuf, buf, i);
 	uv_custom_write(req);
@@ -1475,8 +3235,14 @@ static void send_websocket_handshake_if_requested(uv_poll_t *req) {
 
 	const char *ver = http_get_header(conn, "Sec-WebSocket-Version");
 	const char *key = http_get_header(conn, "Sec-WebSocket-Key");
+	char extensions[128];
+
+	memset(extensions, '\0', sizeof(extensions));
 	if(ver != NULL && key != NULL) {
 		conn->is_websocket = 1;
+#ifdef WEBSERVER_DEFLATE
+		websocket_deflate_offer(conn, extensions, sizeof(extensions));
+#endif
 
 		struct webserver_clients_t *tmp = webserver_clients;
 		while(tmp) {
@@ -1486,8 +3252,86 @@ static void send_websocket_handshake_if_requested(uv_poll_t *req) {
 			}
 			tmp = tmp->next;
 		}
-		send_websocket_handshake(req, key);
+		send_websocket_handshake(req, key, extensions);
+	}
+}
+
+/*
+ * XOR a masked client payload into dst. The destination may
+ * overlap the source as long as it does not start after it,
+ * so a frame can be unmasked in place over its own header.
+ */
+static void websocket_unmask(unsigned char *dst, const unsigned char *src, size_t len, const unsigned char *mask) {
+	uint32_t mask32 = 0;
+	uint64_t mask64 = 0, word = 0;
+	size_t i = 0;
+
+	memcpy(&mask32, mask, 4);
+	mask64 = ((uint64_t)mask32 << 32) | mask32;
+
+#if defined(__SSE2__)
+	{
+		__m128i m = _mm_set1_epi32((int)mask32);
+		for(;i+16<=len;i+=16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)&src[i]);
+			_mm_storeu_si128((__m128i *)&dst[i], _mm_xor_si128(v, m));
+		}
+	}
+#elif defined(__ARM_NEON)
+	{
+		uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(mask32));
+		for(;i+16<=len;i+=16) {
+			vst1q_u8(&dst[i], veorq_u8(vld1q_u8(&src[i]), m));
+		}
+	}
+#endif
+	/* Every step is a multiple of four, so the mask stays in phase */
+	for(;i+8<=len;i+=8) {
+		memcpy(&word, &src[i], 8);
+		word ^= mask64;
+		memcpy(&dst[i], &word, 8);
+	}
+	for(;i<len;i++) {
+		dst[i] = src[i] ^ mask[i % 4];
+	}
+}
+
+/*
+ * Returns the total length of the frame at the start of buf,
+ * 0 when its header is still incomplete, or -1 when the frame
+ * is not acceptable.
+ */
+static ssize_t websocket_frame_length(const unsigned char *buf, size_t len) {
+	unsigned long long length = 0;
+	size_t header = 2;
+	int i = 0;
+
+	if(len < 2) {
+		return 0;
+	}
+	length = buf[1] & 0x7F;
+	if(length == 126) {
+		header = 4;
+	} else if(length == 127) {
+		header = 10;
+	}
+	/* Client frames are always masked */
+	header += 4;
+	if(len < header) {
+		return 0;
+	}
+	if(length == 126) {
+		length = ((unsigned int)buf[2] << 8) | buf[3];
+	} else if(length == 127) {
+		length = 0;
+		for(i=0;i<8;i++) {
+			length = (length << 8) | buf[2+i];
+		}
+	}
+	if(length > MAX_UPLOAD_FILESIZE) {
+		return -1;
 	}
+	return (ssize_t)(header + length);
 }
 
 int websocket_read(uv_poll_t *req, unsigned char *buf, ssize_t buf_len) {
@@ -1500,13 +3344,13 @@ int websocket_read(uv_poll_t *req, unsigned char *buf, ssize_t buf_len) {
 	struct uv_custom_poll_t *custom_poll_data = req->data;
 	struct connection_t *conn = custom_poll_data->data;
 
-	unsigned int i = 0, j = 0;
 	unsigned char mask[4];
 	unsigned int packet_length = 0;
 	unsigned int length_code = 0;
 	int index_first_mask = 0;
 	int index_first_data_byte = 0;
 	int opcode = buf[0] & 0xF;
+	int buf_rsv = buf[0] & 0x70;
 
 	memset(&mask, '\0', 4);
 	length_code = ((unsigned char)buf[1]) & 0x7F;
@@ -1519,9 +3363,7 @@ int websocket_read(uv_poll_t *req, unsigned char *buf, ssize_t buf_len) {
 	memcpy(mask, &buf[index_first_mask], 4);
 	index_first_data_byte = index_first_mask + 4;
 	packet_length = buf_len - index_first_data_byte;
-	for(i = index_first_data_byte, j = 0; i < buf_len; i++, j++) {
-		buf[j] = buf[i] ^ mask[j % 4];
-	}
+	websocket_unmask(buf, &buf[index_first_data_byte], packet_length, mask);
 	buf[packet_length] = '\0';
 
 	switch(opcode) {
@@ -1538,6 +3380,16 @@ int websocket_read(uv_poll_t *req, unsigned char *buf, ssize_t buf_len) {
 			return -1;
 		break;
 		case WEBSOCKET_OPCODE_TEXT:
+#ifdef WEBSERVER_DEFLATE
+			if(conn->deflate == 1 && (buf_rsv & 0x40) == 0x40) {
+				size_t len = 0;
+				if((conn->content = websocket_inflate(conn, buf, packet_length, &len)) == NULL) {
+					return -1;
+				}
+				conn->content_len = len;
+				return 0;
+			}
+#endif
 			conn->content_len = packet_length;
 			conn->content = (char *)buf;
 			return 0;
@@ -1621,6 +3473,10 @@ static void poll_close_cb(uv_poll_t *req) {
 	}
 
 	if(conn != NULL) {
+		if(conn->sendfile == 1 && conn->file_fd >= 0) {
+			close(conn->file_fd);
+			conn->file_fd = -1;
+		}
 		if(conn->fd > 0) {
 #ifdef _WIN32
 			closesocket(conn->fd);
@@ -1632,8 +3488,19 @@ static void poll_close_cb(uv_poll_t *req) {
 		if(conn->request != NULL) {
 			FREE(conn->request);
 		}
+		if(conn->header != NULL) {
+			FREE(conn->header);
+		}
+#ifdef WEBSERVER_DEFLATE
+		websocket_deflate_free(conn);
+#endif
+		websocket_deferred_free(conn);
+		gui_filter_free(&conn->filter);
 	}
 
+#ifndef PILIGHT_REWRITE
+	webcam_client_remove(req);
+#endif
 	webserver_client_remove(req);
 
 	if(!uv_is_closing((uv_handle_t *)req)) {
@@ -1661,14 +3528,155 @@ static void client_write_cb(uv_poll_t *req) {
 	struct uv_custom_poll_t *custom_poll_data = req->data;
 	struct connection_t *c = (struct connection_t *)custom_poll_data->data;
 
+	/* Everything was sent, so a lagging client has caught up */
+	if(c->is_websocket == 1 && c->lagging == 1) {
+		websocket_resume(req, c);
+		return;
+	}
+
 	if(c->file_fd >= 0) {
+#ifdef __linux__
+		if(c->sendfile == 1) {
+			if(file_sendfile_cb(req) != 0) {
+				uv_custom_close(req);
+			}
+			return;
+		}
+#endif
 		if(file_read_cb(c->file_fd, req) != 0) {
 			uv_custom_close(req);
 		}
+		return;
+	}
+
+	/* Pipelined requests wait while a lot is still to be sent */
+	if(c->is_websocket == 0 && c->busy == 0 && c->handling == 0) {
+		http_requests(req);
 	}
 }
 
-static void client_read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
+/*
+ * Handle all complete frames in the receive buffer. A partial
+ * frame is kept for the next read, together with its length
+ * so the header is not parsed again while the payload arrives.
+ */
+static int websocket_receive(uv_poll_t *req, ssize_t *nread, char *buf) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *conn = custom_poll_data->data;
+	size_t pos = 0, len = (size_t)*nread;
+	ssize_t n = 0;
+
+	while(pos < len) {
+		if(conn->frame_len == 0) {
+			if((n = websocket_frame_length((unsigned char *)&buf[pos], len-pos)) == -1) {
+				return -1;
+			} else if(n == 0) {
+				break;
+			}
+			conn->frame_len = (size_t)n;
+		}
+		if(len-pos < conn->frame_len) {
+			break;
+		}
+		n = websocket_read(req, (unsigned char *)&buf[pos], conn->frame_len);
+		pos += conn->frame_len;
+		conn->frame_len = 0;
+		if(n == -1) {
+			return -1;
+		} else if(n == 0) {
+			request_handler(req);
+		}
+	}
+
+	if(pos == len) {
+		*nread = 0;
+	} else if(pos > 0) {
+		iobuf_remove(&custom_poll_data->recv_iobuf, pos);
+	}
+	return 0;
+}
+
+/*
+ * Returns the length of the first request in the buffer, its
+ * headers and the body announced by the Content-Length. Zero
+ * is returned while it hasn't been received completely and -1
+ * when it is larger than accepted.
+ */
+static ssize_t http_request_length(struct connection_t *conn, const char *buf, size_t len, size_t *hlen) {
+	const char *name = "content-length:";
+	unsigned long body = 0;
+	size_t i = 0, x = 0, end = 0;
+
+	/* Only the body was missing the last time */
+	if(conn->request_len > 0) {
+		*hlen = conn->header_len;
+		return (len < conn->request_len) ? 0 : (ssize_t)conn->request_len;
+	}
+
+	/* Carry on where the previous read left off */
+	for(end=(conn->scanned > 3) ? conn->scanned-3 : 0;end+3<len;end++) {
+		if(buf[end] == '\r' && buf[end+1] == '\n' && buf[end+2] == '\r' && buf[end+3] == '\n') {
+			break;
+		}
+	}
+	if(end+3 >= len) {
+		conn->scanned = len;
+		return (len > WEBSERVER_REQUEST_MAX) ? -1 : 0;
+	}
+	*hlen = end+4;
+	if(*hlen > WEBSERVER_REQUEST_MAX) {
+		return -1;
+	}
+
+	for(i=0;i<end;i++) {
+		if(i > 0 && buf[i-1] != '\n') {
+			continue;
+		}
+		for(x=0;name[x] != '\0' && i+x < end && tolower((unsigned char)buf[i+x]) == name[x];x++);
+		if(name[x] == '\0') {
+			for(i+=x;i < end && (buf[i] == ' ' || buf[i] == '\t');i++);
+			for(;i < end && isdigit((unsigned char)buf[i]) && body <= MAX_UPLOAD_FILESIZE;i++) {
+				body = (body*10)+(unsigned long)(buf[i]-'0');
+			}
+			break;
+		}
+	}
+	if(body > MAX_UPLOAD_FILESIZE) {
+		return -1;
+	}
+	conn->header_len = *hlen;
+	conn->request_len = *hlen+body;
+	if(len < *hlen+body) {
+		return 0;
+	}
+	return (ssize_t)(*hlen+body);
+}
+
+static void http_request_reset(struct connection_t *conn) {
+	if(conn->request != NULL) {
+		FREE(conn->request);
+	}
+	conn->query_string = NULL;
+	conn->num_headers = 0;
+	conn->content = NULL;
+	conn->content_len = 0;
+	conn->status_code = 0;
+	conn->flags = 0;
+	conn->file_fd = -1;
+	conn->sendfile = 0;
+	conn->file_offset = 0;
+	conn->file_size = 0;
+	conn->file_headers[0] = '\0';
+	conn->session[0] = '\0';
+}
+
+/*
+ * Handle the requests in the receive buffer one by one. The
+ * next request is only looked at when the response to the
+ * previous one has been queued, so pipelined requests are
+ * answered in the order they were sent.
+ */
+static void http_requests(uv_poll_t *req) {
 	/*
 	 * Make sure we execute in the main thread
 	 */
@@ -1676,46 +3684,194 @@ static void client_read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
 
 	struct uv_custom_poll_t *custom_poll_data = req->data;
-	struct connection_t *c = (struct connection_t *)custom_poll_data->data;
-	int is_websocket = 0;
+	struct connection_t *conn = custom_poll_data->data;
+	struct iobuf_t *io = &custom_poll_data->recv_iobuf;
+	const char *hdr = NULL;
+	size_t hlen = 0;
+	ssize_t len = 0;
+	int x = 0;
+
+	conn->handling = 1;
+	while(conn->busy == 0 && conn->is_websocket == 0 && custom_poll_data->doclose == 0) {
+		/* The client_write_cb picks up again once this has been sent */
+		if(custom_poll_data->send_iobuf.len > WEBSERVER_SEND_HIGH) {
+			break;
+		}
+		if((len = http_request_length(conn, io->buf, (size_t)io->len, &hlen)) == 0) {
+			uv_custom_read(req);
+			break;
+		} else if(len == -1) {
+			char *a = "HTTP/1.1 413 Request Entity Too Large\r\n"
+				"Content-Length: 0\r\n"
+				"Connection: close\r\n\r\n";
+			iobuf_append(&custom_poll_data->send_iobuf, a, strlen(a));
+			uv_custom_close(req);
+			return;
+		}
 
-	if(c != NULL && c->is_websocket == 1) {
-		is_websocket = 1;
-	}
+		/* The headers are parsed in place, so keep them apart from the body */
+		if((conn->header = REALLOC(conn->header, (size_t)len+2)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(conn->header, io->buf, hlen);
+		conn->header[hlen] = '\0';
+		memcpy(&conn->header[hlen+1], &io->buf[hlen], (size_t)len-hlen);
+		conn->header[len+1] = '\0';
+		iobuf_remove(io, (size_t)len);
+		conn->scanned = 0;
+		conn->header_len = 0;
+		conn->request_len = 0;
+
+		http_request_reset(conn);
+		if((size_t)len > hlen) {
+			conn->content = &conn->header[hlen+1];
+			conn->content_len = (size_t)len-hlen;
+		}
+		http_parse_request(conn->header, conn);
+
+		conn->active = time(NULL);
+		conn->keepalive = 0;
+		if(++conn->requests < WEBSERVER_KEEPALIVE_MAX && conn->http_version != NULL &&
+		   strcmp(conn->http_version, "1.1") == 0) {
+			conn->keepalive = 1;
+			if((hdr = http_get_header(conn, "Connection")) != NULL &&
+			   (strstr(hdr, "close") != NULL || strstr(hdr, "Close") != NULL)) {
+				conn->keepalive = 0;
+			}
+		}
 
-	if(*nread > 0 && is_websocket == 0) {
-		buf[*nread-1] = '\0';
-	}
+		send_websocket_handshake_if_requested(req);
 
-	if(*nread > 0) {
-		if(c->is_websocket == 0) {
-			http_parse_request(buf, c);
-			send_websocket_handshake_if_requested(req);
+		if(auth_handler(req) == MG_FALSE) {
+			send_auth_request(req);
+			uv_custom_close(req);
+			return;
+		}
 
-			if(auth_handler(req) == MG_FALSE) {
-				send_auth_request(req);
-				uv_custom_close(req);
-				return;
-			}
-		} else {
-			unsigned char *p = (unsigned char *)buf;
-			if(websocket_read(req, p, *nread) == -1) {
+		if(conn->is_websocket == 1) {
+			conn->handling = 0;
+			/* Frames sent right after the handshake */
+			if(io->len > 0 && websocket_receive(req, &io->len, io->buf) == -1) {
 				uv_custom_close(req);
 				return;
 			}
+			uv_custom_read(req);
+			return;
 		}
-		int x = request_handler(req);
-		if(x == MG_TRUE) {
-			if(c->is_websocket == 1) {
-				uv_custom_read(req);
-				*nread = 0;
-				return;
-			}
 
+		conn->busy = 1;
+		if((x = request_handler(req)) == MG_FALSE) {
+			uv_custom_close(req);
+			return;
+		} else if(x == MG_TRUE) {
+			conn->busy = 0;
+		}
+		if(conn->busy == 0 && conn->keepalive == 0) {
+			uv_custom_close(req);
+			return;
+		}
+	}
+	conn->handling = 0;
+}
+
+/*
+ * Called when the response to a request that took more than
+ * one write has been queued completely.
+ */
+static void http_request_done(uv_poll_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *conn = custom_poll_data->data;
+
+	conn->busy = 0;
+	conn->active = time(NULL);
+
+	/* Called from the request_handler, http_requests carries on itself */
+	if(conn->handling == 1) {
+		return;
+	}
+	if(conn->keepalive == 0) {
+		uv_custom_close(req);
+		return;
+	}
+	http_requests(req);
+}
+
+static void client_read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct connection_t *c = (struct connection_t *)custom_poll_data->data;
+
+	if(c == NULL || *nread <= 0) {
+		return;
+	}
+	if(buf == NULL) {
+		uv_custom_read(req);
+		return;
+	}
+
+	if(c->is_websocket == 1) {
+		if(websocket_receive(req, nread, buf) == -1) {
 			uv_custom_close(req);
 			return;
 		}
+		uv_custom_read(req);
+		return;
+	}
+
+	c->active = time(NULL);
+	if(c->busy == 0 && c->handling == 0) {
+		http_requests(req);
+	}
+}
+
+/*
+ * Close the connections that have been idle for longer than
+ * the Keep-Alive timeout, or never sent a complete request.
+ */
+static void webserver_idle(uv_timer_t *handle) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct webserver_clients_t *node = NULL, *next = NULL;
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	struct connection_t *conn = NULL;
+	time_t now = time(NULL);
+
+#ifdef _WIN32
+	uv_mutex_lock(&webserver_lock);
+#else
+	pthread_mutex_lock(&webserver_lock);
+#endif
+	node = webserver_clients;
+	while(node) {
+		next = node->next;
+		/* A comment keeps proxies from closing a quiet stream */
+		if(node->is_stream == 1 && (custom_poll_data = node->req->data) != NULL &&
+		   (conn = custom_poll_data->data) != NULL && custom_poll_data->doclose == 0 &&
+		   now-conn->active >= WEBSERVER_IDLE_TIMEOUT) {
+			conn->active = now;
+			uv_custom_write_shared(node->req, ":\n\n", 3);
+		} else if(node->is_websocket == 0 && node->is_stream == 0 && (custom_poll_data = node->req->data) != NULL &&
+		   (conn = custom_poll_data->data) != NULL && conn->busy == 0 &&
+		   custom_poll_data->doclose == 0 && custom_poll_data->send_iobuf.len == 0 &&
+		   now-conn->active >= WEBSERVER_IDLE_TIMEOUT) {
+			uv_custom_close(node->req);
+		}
+		node = next;
 	}
+#ifdef _WIN32
+	uv_mutex_unlock(&webserver_lock);
+#else
+	pthread_mutex_unlock(&webserver_lock);
+#endif
 }
 
 static void server_read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
@@ -1819,6 +3975,7 @@ static void server_read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
 	c->flags = 0;
 	c->ping = 0;
 	c->file_fd = -1;
+	c->active = time(NULL);
 #ifdef WEBSERVER_HTTPS
 	c->is_ssl = custom_poll_data->is_ssl = server_poll_data->is_ssl;
 	custom_poll_data->is_server = 1;
@@ -2002,6 +4159,10 @@ int webserver_start(void) {
 	}
 	uv_async_init(uv_default_loop(), async_req, webserver_process);
 
+#ifndef PILIGHT_REWRITE
+	bootstrap_epoch = (unsigned long)time(NULL);
+#endif
+
 	// double itmp = 0.0;
 	// int webserver_enabled = 0;
 	loop = 1;
@@ -2021,6 +4182,12 @@ int webserver_start(void) {
 	if(settings_select_number(ORIGIN_WEBSERVER, "webserver-http-port", &itmp) == 0) { http_port = (int)itmp; }
 	if(settings_select_number(ORIGIN_WEBSERVER, "webgui-websockets", &itmp) == 0) { websockets = (int)itmp; }
 	if(settings_select_number(ORIGIN_WEBSERVER, "webserver-cache", &itmp) == 0) { cache = (int)itmp; }
+#ifdef WEBSERVER_DEFLATE
+	if(settings_select_number(ORIGIN_WEBSERVER, "webgui-websockets-deflate", &itmp) == 0) { deflate_enable = (int)itmp; }
+	if(settings_select_number(ORIGIN_WEBSERVER, "webgui-websockets-deflate-min", &itmp) == 0) { deflate_min = (int)itmp; }
+	if(settings_select_number(ORIGIN_WEBSERVER, "webgui-websockets-deflate-takeover", &itmp) == 0) { deflate_takeover = (int)itmp; }
+#endif
+	if(settings_select_number(ORIGIN_WEBSERVER, "webserver-cache-size", &itmp) == 0) { fcache_set_size((unsigned long)itmp); }
 	if(settings_select_number(ORIGIN_WEBSERVER, "webserver-enable", &itmp) == 0) { webserver_enabled = (int)itmp; }
 #ifdef WEBSERVER_HTTPS
 	if(settings_select_number(ORIGIN_WEBSERVER, "webserver-https-port", &itmp) == 0) { https_port = (int)itmp; }
@@ -2054,21 +4221,47 @@ int webserver_start(void) {
 		strcpy(root, WEBSERVER_ROOT);
 	}
 	config_setting_get_number("webgui-websockets", 0, &websockets);
+#ifdef WEBSERVER_DEFLATE
+	config_setting_get_number("webgui-websockets-deflate", 0, &deflate_enable);
+	config_setting_get_number("webgui-websockets-deflate-min", 0, &deflate_min);
+	config_setting_get_number("webgui-websockets-deflate-takeover", 0, &deflate_takeover);
+#endif
 
 	/* Do we turn on webserver caching. This means that all requested files are
 	   loaded into the memory so they aren't read from the FS anymore */
 	config_setting_get_number("webserver-cache", 0, &cache);
+	{
+		int size = 0;
+		if(config_setting_get_number("webserver-cache-size", 0, &size) == 0) {
+			fcache_set_size((unsigned long)size);
+		}
+	}
 	config_setting_get_string("webserver-authentication", 0, &authentication_username);
 	config_setting_get_string("webserver-authentication", 1, &authentication_password);
 
 #endif
 
+#ifdef WEBSERVER_DEFLATE
+	if(deflate_enable == 1 && zshared_init == 0) {
+		memset(&zshared, 0, sizeof(z_stream));
+		if(deflateInit2(&zshared, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+			zshared_init = 1;
+		}
+	}
+#endif
+
 	eventpool_callback(REASON_CONFIG_UPDATE, broadcast);
 	eventpool_callback(REASON_BROADCAST_CORE, broadcast);
 	// eventpool_callback(REASON_ADHOC_CONNECTED, adhoc_mode);
 	// eventpool_callback(REASON_ADHOC_DISCONNECTED, webserver_restart);
 	eventpool_callback(REASON_SOCKET_SEND, webserver_send);
 
+	if((timer_idle_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	uv_timer_init(uv_default_loop(), timer_idle_req);
+	uv_timer_start(timer_idle_req, webserver_idle, 1000, 1000);
+
 #ifdef WEBSERVER_HTTPS
 	if(https_port > 0 /*&& webserver_enabled == 1*/) {
 		if(ssl_server_init_status() == 0) {
@@ -15,9 +15,15 @@
 
 #include "../libs/libuv/uv.h"
 
+#ifdef WEBSERVER_DEFLATE
+#include <zlib.h>
+#endif
+
 typedef struct connection_t {
 	int fd;
 	char *request;
+	/* Copy of the request being handled, its body after the headers */
+	char *header;
   const char *request_method;
   const char *uri;
   const char *http_version;
@@ -34,6 +40,15 @@ typedef struct connection_t {
   char mimetype[255];
 
   int is_websocket;
+	/* Receives the broadcasts as Server-Sent Events */
+	int is_stream;
+	/* Length of the websocket frame being received, 0 if unknown */
+	size_t frame_len;
+	/* How far the receive buffer was searched for the end of the headers */
+	size_t scanned;
+	/* Lengths of the request being received, 0 until its headers are in */
+	size_t header_len;
+	size_t request_len;
 	int ping;
   int status_code;
 	void *connection_param;
@@ -42,17 +57,50 @@ typedef struct connection_t {
 	unsigned short timer;
 
 	int file_fd;
+	unsigned short sendfile;
+	off_t file_offset;
+	off_t file_size;
+	/* Validator, caching and encoding headers of the file being served */
+	char file_headers[384];
+	/* Session cookie to hand out after a successful login */
+	char session[128];
 
 	char buffer[WEBSERVER_CHUNK_SIZE];
 
+	/* Persistent connection state, see http_requests */
+	int keepalive;
+	int busy;
+	int handling;
+	unsigned int requests;
+	time_t active;
+
 #ifdef WEBSERVER_HTTPS
 	int is_ssl;
 	int handshake;
 	mbedtls_ssl_context ssl;
 #endif
+
+#ifdef WEBSERVER_DEFLATE
+	/* Negotiated permessage-deflate, see RFC 7692 */
+	int deflate;
+	int deflate_takeover;
+	z_stream zout;
+	z_stream zin;
+	char *inflated;
+#endif
+
+	/* Broadcasts held back while the client is behind */
+	int lagging;
+	time_t lagged;
+	struct websocket_deferred_t *deferred;
+	/* Subscription set when the client identified */
+	struct gui_filter_t *filter;
 } connection_t;
 
+struct JsonNode;
+
 int webserver_gc(void);
+void webserver_stats(struct JsonNode *);
 int webserver_start(void);
 void *webserver_broadcast(void *);
 void webserver_create_header(char **, const char *, char *, unsigned long);
@@ -26,13 +26,24 @@ void dt_stack_free(struct stack_dt *stack, void (*func)(void *node)) {
 	FREE(stack);
 }
 
-void dt_stack_push(struct stack_dt *stack, size_t size, void *item) {
-	if(stack->size == 0 || stack->size <= stack->top) {
-		if((stack->list = REALLOC(stack->list, size*(stack->size+12))) == NULL) {
-			OUT_OF_MEMORY
-		}
-		stack->size += 12;
+/*
+ * The list doubles when it's full, so pushing n items takes
+ * about log(n) reallocations.
+ */
+static void dt_stack_grow(struct stack_dt *stack, size_t size) {
+	int n = (stack->size == 0) ? 16 : stack->size*2;
+
+	if(stack->size > stack->top) {
+		return;
+	}
+	if((stack->list = REALLOC(stack->list, size*(size_t)n)) == NULL) {
+		OUT_OF_MEMORY
 	}
+	stack->size = n;
+}
+
+void dt_stack_push(struct stack_dt *stack, size_t size, void *item) {
+	dt_stack_grow(stack, size);
 	stack->list[stack->top++] = item;
 }
 
@@ -41,17 +52,12 @@ int dt_stack_top(struct stack_dt *stack) {
 }
 
 void dt_stack_insert(struct stack_dt *stack, size_t size, int pos, void *item) {
-	int i = stack->top;
-	while(i >= pos) {
+	int i = 0;
+
+	/* Make room before the items are moved up */
+	dt_stack_grow(stack, size);
+	for(i=stack->top;i>pos;i--) {
 		stack->list[i] = stack->list[i-1];
-		i--;
-	}
-	if(stack->size == 0 || stack->size <= stack->top) {
-		if((stack->list = REALLOC(stack->list, size*(stack->size+12))) == NULL) {
-			printf("out of memory\n");
-			exit(-1);
-		}
-		stack->size += 12;
 	}
 	stack->top++;
 	stack->list[pos] = item;
@@ -28,24 +28,19 @@
 #include "../core/dso.h"
 #include "../core/log.h"
 #include "../config/settings.h"
+#include "../config/devices.h"
 #include "../lua_c/lua.h"
 
 #include "action.h"
 
-#ifdef _WIN32
-	#include <windows.h>
-#endif
-
 static int init = 0;
 
-typedef struct execution_t {
-	char *name;
-	unsigned long id;
-
-	struct execution_t *next;
-} execution_t;
-
-static struct execution_t *executions = NULL;
+/*
+ * Execution ids are handed out from a single sequence, so an
+ * id stays unique even when a device is recreated by a config
+ * reload while an older action of it is still running.
+ */
+static unsigned long execution_seq = 0;
 
 void event_action_init(void) {
 
@@ -92,51 +87,28 @@ void event_action_init(void) {
 }
 
 unsigned long event_action_set_execution_id(char *name) {
-	struct timeval tv;
-#ifdef _WIN32
-	SleepEx(1, TRUE);
-#else
-	usleep(1);
-#endif
-	gettimeofday(&tv, NULL);
-
-	int match = 0;
-	struct execution_t *tmp = executions;
-	while(tmp) {
-		if(strcmp(name, tmp->name) == 0) {
-			tmp->id = (unsigned int)tv.tv_sec + (unsigned int)tv.tv_usec;
-			match = 1;
-			break;
-		}
-		tmp = tmp->next;
-	}
-	if(match == 0) {
-		if((tmp = MALLOC(sizeof(struct execution_t))) == NULL) {
-			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-		}
-		if((tmp->name = MALLOC(strlen(name)+1)) == NULL) {
-			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-		}
-		strcpy(tmp->name, name);
-		tmp->id = (unsigned int)tv.tv_sec + (unsigned int)tv.tv_usec;
+	struct devices_t *dev = NULL;
+	unsigned long id = __sync_add_and_fetch(&execution_seq, 1);
 
-		tmp->next = executions;
-		executions = tmp;
+	if(devices_get(name, &dev) == 0) {
+		__sync_lock_test_and_set(&dev->execution_id, id);
 	}
-	return tmp->id;
+	return id;
 }
 
 int event_action_get_execution_id(char *name, unsigned long *ret) {
-	struct execution_t *tmp = executions;
-	while(tmp) {
-		if(strcmp(tmp->name, name) == 0) {
-			*ret = tmp->id;
-			return 0;
-			break;
-		}
-		tmp = tmp->next;
+	struct devices_t *dev = NULL;
+	unsigned long id = 0;
+
+	if(devices_get(name, &dev) != 0) {
+		return -1;
 	}
-	return -1;
+	/* Zero means no action ran for this device yet */
+	if((id = __sync_add_and_fetch(&dev->execution_id, 0)) == 0) {
+		return -1;
+	}
+	*ret = id;
+	return 0;
 }
 
 struct event_action_args_t *event_action_add_argument(struct event_action_args_t *head, char *key, struct varcont_t *var) {
@@ -326,7 +298,7 @@ static int event_action_prepare_call(char *module, char *func, struct event_acti
 		return -1;
 	}
 	if((L = state->L) == NULL) {
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 
@@ -347,7 +319,7 @@ static int event_action_prepare_call(char *module, char *func, struct event_acti
 		event_action_free_argument(args);
 		lua_remove(L, -1);
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 	if(lua_istable(L, -1) != 0) {
@@ -365,20 +337,20 @@ static int event_action_prepare_call(char *module, char *func, struct event_acti
 			if(plua_action_module_call(L, file, func, args) == 0) {
 				lua_pop(L, -1);
 				assert(lua_gettop(L) == 0);
-				uv_mutex_unlock(&state->lock);
+				plua_release_state(state);
 				return -1;
 			}
 		} else {
 			event_action_free_argument(args);
 			assert(lua_gettop(L) == 0);
-			uv_mutex_unlock(&state->lock);
+			plua_release_state(state);
 			return -1;
 		}
 	}
 	lua_remove(L, -1);
 
 	assert(lua_gettop(L) == 0);
-	uv_mutex_unlock(&state->lock);
+	plua_release_state(state);
 
 	return 0;
 }
@@ -446,7 +418,7 @@ int event_action_get_parameters(char *module, int *nr, char ***ret) {
 	}
 
 	if((L = state->L) == NULL) {
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 
@@ -466,7 +438,7 @@ int event_action_get_parameters(char *module, int *nr, char ***ret) {
 	if(lua_isnil(L, -1) != 0) {
 		lua_remove(L, -1);
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 	if(lua_istable(L, -1) != 0) {
@@ -483,14 +455,14 @@ int event_action_get_parameters(char *module, int *nr, char ***ret) {
 		if(event_action_parameters_run(L, file, nr, ret) == 0) {
 			lua_pop(L, -1);
 			assert(lua_gettop(L) == 0);
-			uv_mutex_unlock(&state->lock);
+			plua_release_state(state);
 			return -1;
 		}
 	}
 	lua_pop(L, -1);
 
 	assert(lua_gettop(L) == 0);
-	uv_mutex_unlock(&state->lock);
+	plua_release_state(state);
 
 	return 0;
 }
@@ -504,14 +476,6 @@ int event_action_run(char *module, struct event_action_args_t *args) {
 }
 
 int event_action_gc(void) {
-	struct execution_t *tmp = NULL;
-	while(executions) {
-		tmp = executions;
-		FREE(tmp->name);
-		executions = executions->next;
-		FREE(tmp);
-	}
-
 	init = 0;
 
 	logprintf(LOG_DEBUG, "garbage collected event action library");
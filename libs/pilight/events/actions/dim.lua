@@ -158,172 +158,27 @@ function M.check(parameters)
 	return 1;
 end
 
-function M.timer_for(timer)
-	local data = timer.getUserdata();
-	local devname = data['device'];
-	local config = pilight.config();
-	local devobj = config.getDevice(devname);
-
-	if(devobj.getActionId() ~= data['action_id']) then
-		error("skipping overridden action dim for device " .. devname);
-		return;
-	end
-
-	if devobj.setState("on") == false then
-		error("device \"" .. devname .. "\" could not be set to state \"on\"")
-	end
-
-	if devobj.setDimlevel(data['old_dimlevel']) == false then
-		error("device \"" .. devname .. "\" could not be set to dimlevel \"" .. data['old_dimlevel'] .. "\"")
-	end
-
-	devobj.send();
-
-end
-
-function M.execute_for(data)
-	if data == nil then
-		return;
-	end
-
-	local async = pilight.async.timer();
-
-	if(data['type_for'] == 'SECOND') then
-		async.setTimeout(data['time_for']*1000);
-	elseif(data['type_for'] == 'MINUTE') then
-		async.setTimeout(data['time_for']*1000*60);
-	elseif(data['type_for'] == 'HOUR') then
-		async.setTimeout(data['time_for']*1000*60*60);
-	elseif(data['type_for'] == 'DAY') then
-		async.setTimeout(data['time_for']*1000*60*60);
-	else
-		async.setTimeout(data['time_for']);
-	end
-
-	async.setUserdata(data());
-	async.setRepeat(0);
-	async.setCallback("timer_for");
-	async.start();
-end
-
-function M.timer_in(timer)
-	local data = timer.getUserdata();
-	local devname = data['device'];
-	local config = pilight.config();
-	local devobj = config.getDevice(devname);
-
-	if devobj.setState("on") == false then
-		error("device \"" .. devname .. "\" could not be set to state \"on\"")
-	end
-
-	if devobj.setDimlevel(data['from_dimlevel']) == false then
-		error("device \"" .. devname .. "\" could not be set to dimlevel \"" .. data['from_dimlevel'] .. "\"")
-	end
-
-	devobj.send();
-
-	if data['direction'] == false then
-		data['from_dimlevel'] = data['from_dimlevel'] + 1;
-		if (data['from_dimlevel'] - 1) == data['new_dimlevel'] then
-			if data['time_for'] ~= 0 and data['type_for'] ~= nil then
-				M.execute_for(data);
-			end
-			timer.stop();
-			return;
-		end
-	else
-		data['from_dimlevel'] = data['from_dimlevel'] - 1;
-		if (data['from_dimlevel'] + 1) == data['new_dimlevel'] then
-			if data['time_for'] ~= 0 and data['type_for'] ~= nil then
-				M.execute_for(data);
-			end
-			timer.stop();
-			return;
-		end
-	end
-end
-
-function M.execute_in(data)
-	if data == nil then
-		return;
-	end
-
-	local async = pilight.async.timer();
-	if(data['type_in'] == 'SECOND') then
-		async.setRepeat(data['time_in']*1000);
-		async.setTimeout(data['time_in']*1000);
-	elseif(data['type_in'] == 'MINUTE') then
-		async.setRepeat(data['time_in']*1000*60);
-		async.setTimeout(data['time_in']*1000*60);
-	elseif(data['type_in'] == 'HOUR') then
-		async.setRepeat(data['time_in']*1000*60*60);
-		async.setTimeout(data['time_in']*1000*60*60);
-	elseif(data['type_in'] == 'DAY') then
-		async.setRepeat(data['time_in']*1000*60*60);
-		async.setTimeout(data['time_in']*1000*60*60);
-	else
-		async.setRepeat(data['time_in']);
-		async.setTimeout(data['time_in']);
-	end
-
-	async.setUserdata(data());
-	async.setCallback("timer_in");
-	async.start();
-end
-
-function M.thread(thread)
-	local data = thread.getUserdata();
-	local devname = data['device'];
-	local config = pilight.config();
-	local devobj = config.getDevice(devname);
-
-	if(devobj.getActionId() ~= data['action_id']) then
-		error("skipping overridden action dim for device " .. devname);
-	end
-
-	if devobj.setState("on") == false then
-		error("device \"" .. devname .. "\" could not be set to state \"on\"")
-	end
-
-	if devobj.setDimlevel(data['new_dimlevel']) == false then
-		error("device \"" .. devname .. "\" could not be set to dimlevel \"" .. data['new_dimlevel'] .. "\"")
-	end
-
-	devobj.send();
-
-	if data['time_for'] ~= 0 and data['type_for'] ~= nil then
-		M.execute_for(data);
-	end
-end
-
-function M.timer_after(timer)
-	local data = timer.getUserdata();
-	local devname = data['device'];
-	local config = pilight.config();
-	local devobj = config.getDevice(devname);
-
-	if(devobj.getActionId() ~= data['action_id']) then
-		error("skipping overridden action dim for device " .. devname);
-	end
-
-	if devobj.setState("on") == false then
-		error("device \"" .. devname .. "\" could not be set to state \"on\"")
-	end
-
-	if data['time_in'] > 0 and data['type_in'] ~= nil then
-		M.execute_in(data);
-	else
-		if devobj.setDimlevel(data['new_dimlevel']) == false then
-			error("device \"" .. devname .. "\" could not be set to dimlevel \"" .. data['new_dimlevel'] .. "\"")
-		end
-
-		devobj.send();
-		if data['time_for'] > 0 and data['type_for'] ~= nil then
-			M.execute_for(data);
-		end
-	end
+--
+-- Keep the units as the timers of the other actions
+-- interpret them.
+--
+function M.milliseconds(time, unit)
+	if(unit == 'SECOND') then
+		return time*1000;
+	elseif(unit == 'MINUTE') then
+		return time*1000*60;
+	elseif(unit == 'HOUR') then
+		return time*1000*60*60;
+	elseif(unit == 'DAY') then
+		return time*1000*60*60;
+	end
+	return time;
 end
 
+--
+-- The steps of a dim are run by the transition scheduler,
+-- we only hand it the parameters.
+--
 function M.run(parameters)
 	local nrdev = #parameters['DEVICE']['value'];
 
@@ -331,101 +186,46 @@ function M.run(parameters)
 		local devname = parameters['DEVICE']['value'][i];
 		local config = pilight.config();
 		local devobj = config.getDevice(devname);
-		local old_dimlevel = nil;
-		local new_dimlevel = parameters['TO']['value'][1];
-		local from_dimlevel = nil;
-		local after = nil;
-		local in_ = nil;
-		local for_ = nil;
-		local async = nil;
+		local old_dimlevel = -1;
+		local new_dimlevel = tonumber(parameters['TO']['value'][1]);
+		local from_dimlevel = -1;
+		local time_after = 0;
+		local time_step = 0;
+		local time_for = 0;
 
 		if parameters['FROM'] ~= nil then
 			if #parameters['FROM']['value'] == 1 then
-				from_dimlevel = parameters['FROM']['value'][1];
+				from_dimlevel = tonumber(parameters['FROM']['value'][1]);
 			end
 		end
 
+		if devobj.getDimlevel ~= nil and tonumber(devobj.values.dimlevel) ~= nil then
+			old_dimlevel = tonumber(devobj.values.dimlevel);
+		end
+
 		if parameters['IN'] ~= nil then
-			in_ = pilight.common.explode(parameters['IN']['value'][1], " ");
+			local in_ = pilight.common.explode(parameters['IN']['value'][1], " ");
+			if #in_ == 2 and from_dimlevel ~= new_dimlevel then
+				time_step = math.max(1, M.milliseconds(tonumber(in_[1]), in_[2])/math.abs(from_dimlevel-new_dimlevel));
+			end
 		end
 		if parameters['AFTER'] ~= nil then
-			after = pilight.common.explode(parameters['AFTER']['value'][1], " ");
+			local after = pilight.common.explode(parameters['AFTER']['value'][1], " ");
+			if #after == 2 then
+				time_after = M.milliseconds(tonumber(after[1]), after[2]);
+			end
 		end
 		if parameters['FOR'] ~= nil then
-			for_ = pilight.common.explode(parameters['FOR']['value'][1], " ");
-		end
-
-		if devobj.hasSetting("dimlevel") == true then
-			if devobj.getDimlevel ~= nil then
-				old_dimlevel = devobj.getDimlevel();
+			local for_ = pilight.common.explode(parameters['FOR']['value'][1], " ");
+			if #for_ == 2 then
+				time_for = M.milliseconds(tonumber(for_[1]), for_[2]);
 			end
 		end
 
-		if in_ ~= nil and #in_ == 2 then
-			async = pilight.async.timer();
-		elseif after ~= nil and #after == 2 then
-			async = pilight.async.timer();
-		else
-			async = pilight.async.thread();
-		end
+		devobj.setActionId();
 
-		local data = async.getUserdata();
-
-		data['device'] = devname;
-		data['time_after'] = 0;
-		data['type_after'] = nil;
-		data['time_for'] = 0;
-		data['type_for'] = nil;
-		data['time_in'] = 0;
-		data['type_in'] = nil;
-		data['direction'] = nil;
-		data['steps'] = 1;
-		data['old_dimlevel'] = tonumber(old_dimlevel);
-		data['new_dimlevel'] = tonumber(new_dimlevel);
-		data['from_dimlevel'] = tonumber(from_dimlevel);
-		data['action_id'] = devobj.setActionId();
-
-		if from_dimlevel ~= nil then
-			data['direction'] = tonumber(from_dimlevel) > tonumber(new_dimlevel);
-		end
-
-		if in_ ~= nil and #in_ == 2 then
-			local steps = math.abs(data['from_dimlevel']-data['new_dimlevel']);
-			data['time_in'] = tonumber(in_[1])/steps;
-			data['type_in'] = in_[2];
-		end
-
-		if for_ ~= nil and #for_ == 2 then
-			data['time_for'] = tonumber(for_[1]);
-			data['type_for'] = for_[2];
-		end
-
-		if after ~= nil and #after == 2 then
-			data['time_after'] = tonumber(after[1]);
-			data['type_after'] = after[2];
-		end
-
-		if data['time_after'] > 0 and data['type_after'] ~= nil then
-			if(data['type_after'] == 'SECOND') then
-				async.setTimeout(data['time_after']*1000);
-			elseif(data['type_after'] == 'MINUTE') then
-				async.setTimeout(data['time_after']*1000*60);
-			elseif(data['type_after'] == 'HOUR') then
-				async.setTimeout(data['time_after']*1000*60*60);
-			elseif(data['type_after'] == 'DAY') then
-				async.setTimeout(data['time_after']*1000*60*60);
-			else
-				async.setTimeout(data['time_after']);
-			end
-
-			async.setRepeat(0);
-			async.setCallback("timer_after");
-			async.start();
-		elseif data['time_in'] > 0 and data['type_in'] ~= nil then
-			M.execute_in(data);
-		else
-			async.setCallback("thread");
-			async.trigger();
+		if devobj.transition(from_dimlevel, new_dimlevel, time_after, time_step, time_for, old_dimlevel) == false then
+			error("device \"" .. devname .. "\" could not be dimmed to dimlevel \"" .. new_dimlevel .. "\"")
 		end
 	end
 
@@ -439,7 +239,7 @@ end
 function M.info()
 	return {
 		name = "dim",
-		version = "4.1",
+		version = "5.0",
 		reqversion = "8.1.2",
 		reqcommit = "23"
 	}
@@ -213,10 +213,8 @@ function M.run(parameters)
 		if parameters['FROM'] ~= nil then
 			old_state = parameters['FROM']['value'][1];
 		else
-			if devobj.hasSetting("state") == true then
-				if devobj.getState ~= nil then
-					old_state = devobj.getState();
-				end
+			if devobj.getState ~= nil then
+				old_state = devobj.values.state;
 			end
 		end
 
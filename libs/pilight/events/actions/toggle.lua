@@ -66,10 +66,8 @@ function M.run(parameters)
 		local old_state = nil;
 		local new_state = nil;
 		local async = pilight.async.thread();
-		if devobj.hasSetting("state") == true then
-			if devobj.getState ~= nil then
-				old_state = devobj.getState();
-			end
+		if devobj.getState ~= nil then
+			old_state = devobj.values.state;
 		end
 
 		local data = async.getUserdata();
@@ -33,6 +33,10 @@
 #include "../core/json.h"
 #include "../core/ssdp.h"
 #include "../core/socket.h"
+#include "../core/metrics.h"
+#include "../core/trace.h"
+#include "../core/stage.h"
+#include "../core/threads.h"
 #include "../datatypes/stack.h"
 
 #include "../lua_c/lua.h"
@@ -43,12 +47,33 @@
 #include "../config/rules.h"
 #include "../config/settings.h"
 #include "../config/devices.h"
+#include "../config/snapshot.h"
 
 #include "events.h"
 
 #include "operator.h"
 #include "function.h"
 #include "action.h"
+#include "timer.h"
+#include "transition.h"
+#include "storm.h"
+
+/*
+ * The tokens and nodes of a rule are taken from a few large
+ * blocks owned by the rule. Nothing of a tree is freed on its
+ * own, events_tree_gc drops all blocks of a rule at once.
+ */
+#define EVENTS_POOL_BLOCK	4096
+
+typedef struct events_block_t {
+	size_t used;
+	size_t size;
+	struct events_block_t *next;
+} events_block_t;
+
+typedef struct events_pool_t {
+	struct events_block_t *blocks;
+} events_pool_t;
 
 typedef struct lexer_t {
 	int pos;
@@ -57,18 +82,31 @@ typedef struct lexer_t {
 	char *current_char;
 	struct token_t *current_token;
 	char *text;
+	/* The characters of the token being read */
+	struct stack_dt stack;
+	struct events_pool_t *pool;
 } lexer_t;
 
 typedef struct token_t {
 	int type;
 	int pos;
 	char *value;
+	/* Parsed once for TINTEGER and TBOOL tokens */
+	double number_;
+	int decimals_;
+	/* Resolved TSTRING variable, see event_lookup_variable */
+	int lookup;
+	unsigned long generation;
+	struct devices_settings_t *setting;
 } token_t;
 
 typedef struct tree_t {
 	struct token_t *token;
 	struct tree_t **child;
 	int nrchildren;
+	int childsize;
+	/* Shared by all nodes of a rule */
+	struct events_pool_t *pool;
 } tree_t;
 
 // static struct token_string {
@@ -86,7 +124,8 @@ typedef struct tree_t {
 	// { "TELSE" },
 	// { "TTHEN" },
 	// { "TEND" },
-	// { "TACTION" }
+	// { "TACTION" },
+	// { "TBOOL" }
 // };
 
 typedef enum {
@@ -102,9 +141,17 @@ typedef enum {
 	TELSE = 9,
 	TTHEN = 10,
 	TEND = 11,
-	TACTION = 12
+	TACTION = 12,
+	/* Only created by folding constant expressions */
+	TBOOL = 13
 } token_types;
 
+typedef enum {
+	LOOKUP_NONE = 0,
+	LOOKUP_SETTING = 1,
+	LOOKUP_LITERAL = 2
+} lookup_types;
+
 #define ORIGIN_RULE RULE
 #define ORIGIN_ACTION ACTION
 
@@ -117,21 +164,54 @@ static char dot_[2];
 static char *recvBuff = NULL;
 static int sockfd = 0;
 
-static pthread_mutex_t events_lock;
-static pthread_cond_t events_signal;
-static pthread_mutexattr_t events_attr;
-static unsigned short eventslock_init = 0;
+#define EVENTSQUEUE_SIZE	1024
+/* How long a message may wait for room before it is dropped */
+#define EVENTSQUEUE_WAIT	50
+
+static unsigned short eventsstage_init = 0;
 
 typedef struct eventsqueue_t {
 	struct JsonNode *jconfig;
-	struct eventsqueue_t *next;
+	struct trace_t trace;
 } eventsqueue_t;
 
-static struct eventsqueue_t *eventsqueue;
-static struct eventsqueue_t *eventsqueue_head;
-static int eventsqueue_number = 0;
+static struct stage_t eventsstage;
 static int running = 0;
 
+/* Rules affected by the event currently being handled */
+static struct rules_t **matches = NULL;
+static int nrmatches = 0;
+static int matchsize = 0;
+/* The round of each match, and the matches of one round */
+static int *rounds = NULL;
+static struct rules_t **batch = NULL;
+
+/*
+ * Helpers of the events loop. The matching rules of an event
+ * are run in rounds, the rules of a round don't touch each
+ * others devices, so they are evaluated side by side. A rule
+ * that conflicts with an earlier one goes to a later round,
+ * so those keep the order of the configuration.
+ */
+#define EVENTS_WORKERS	2
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t work;
+	pthread_cond_t done;
+	pthread_t pth[EVENTS_WORKERS];
+	struct rules_t **batch;
+	int nrbatch;
+	int next;
+	int pending;
+	int nrworkers;
+	int stop;
+} workers = {
+	PTHREAD_MUTEX_INITIALIZER,
+	PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER
+};
+
 static int get_precedence(char *symbol) {
 	struct plua_module_t *modules = plua_get_modules();
 	int len = 0, x = 0;
@@ -213,46 +293,121 @@ static int is_operator(char *symbol, int size) {
 	return -1;
 }
 
-void events_tree_gc(struct tree_t *tree) {
-	int i = 0;
-	if(tree == NULL) {
-		return;
+/* Sized for a double, the strictest member of the nodes */
+#define EVENTS_POOL_ALIGN(a) (((a)+sizeof(double)-1) & ~(sizeof(double)-1))
+
+static struct events_pool_t *events_pool_init(void) {
+	struct events_pool_t *pool = MALLOC(sizeof(struct events_pool_t));
+	if(pool == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 	}
-	for(i=0;i<tree->nrchildren;i++) {
-		events_tree_gc(tree->child[i]);
+	pool->blocks = NULL;
+	return pool;
+}
+
+static void *events_pool_alloc(struct events_pool_t *pool, size_t size) {
+	struct events_block_t *block = pool->blocks;
+	size_t header = EVENTS_POOL_ALIGN(sizeof(struct events_block_t)), len = 0;
+	void *out = NULL;
+
+	size = EVENTS_POOL_ALIGN(size);
+	if(block == NULL || block->size-block->used < size) {
+		len = (size > EVENTS_POOL_BLOCK-header) ? header+size : EVENTS_POOL_BLOCK;
+		if((block = MALLOC(len)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		block->used = header;
+		block->size = len;
+		block->next = pool->blocks;
+		pool->blocks = block;
 	}
-	if(tree->token != NULL) {
-		FREE(tree->token->value);
-		FREE(tree->token);
+	out = (char *)block+block->used;
+	block->used += size;
+	return out;
+}
+
+static void events_pool_free(struct events_pool_t *pool) {
+	struct events_block_t *block = NULL;
+
+	if(pool == NULL) {
+		return;
 	}
-	if(tree->nrchildren > 0) {
-		FREE(tree->child);
+	while(pool->blocks != NULL) {
+		block = pool->blocks;
+		pool->blocks = block->next;
+		FREE(block);
+	}
+	FREE(pool);
+}
+
+/*
+ * Frees the tree of a rule as a whole, so only call it with
+ * the root of a parsed rule.
+ */
+void events_tree_gc(struct tree_t *tree) {
+	if(tree == NULL) {
+		return;
 	}
-	FREE(tree);
+	events_pool_free(tree->pool);
+}
+
+static void events_queue_free(void *param) {
+	struct eventsqueue_t *node = param;
+
+	json_delete(node->jconfig);
 }
 
 int events_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
+	int i = 0;
+
 	loop = 0;
 
-	if(eventslock_init == 1) {
-		pthread_mutex_unlock(&events_lock);
-		pthread_cond_signal(&events_signal);
+	if(eventsstage_init == 1) {
+		stage_stop(&eventsstage);
 	}
 
 	while(running == 1) {
 		usleep(10);
 	}
 
+	if(eventsstage_init == 1) {
+		stage_gc(&eventsstage, events_queue_free);
+		eventsstage_init = 0;
+	}
+
+	pthread_mutex_lock(&workers.lock);
+	workers.stop = 1;
+	pthread_cond_broadcast(&workers.work);
+	pthread_mutex_unlock(&workers.lock);
+	for(i=0;i<workers.nrworkers;i++) {
+		pthread_join(workers.pth[i], NULL);
+	}
+	workers.nrworkers = 0;
+	workers.stop = 0;
+
+	if(matches != NULL) {
+		FREE(matches);
+	}
+	if(rounds != NULL) {
+		FREE(rounds);
+	}
+	if(batch != NULL) {
+		FREE(batch);
+	}
+	nrmatches = 0;
+	matchsize = 0;
+
 	event_operator_gc();
+	event_transition_gc();
 	event_action_gc();
 	event_function_gc();
 	logprintf(LOG_DEBUG, "garbage collected events library");
 	return 1;
 }
 
-static int print_error(struct lexer_t *lexer, struct tree_t *p, struct tree_t *node, struct token_t *token, int err, char *expected, int pos, int trunc) {
+static int print_error(struct lexer_t *lexer, int err, char *expected, int pos, int trunc) {
 	char *p_elipses = "...";
 	char *s_elipses = "...";
 	char *s_tmp = "";
@@ -289,21 +444,6 @@ static int print_error(struct lexer_t *lexer, struct tree_t *p, struct tree_t *n
 		}
 		err = -2;
 	}
-	if(node != NULL) {
-		events_tree_gc(node);
-		node = NULL;
-	}
-	if(lexer->current_token != NULL) {
-		FREE(lexer->current_token->value);
-		FREE(lexer->current_token);
-	}
-	if(token != NULL) {
-		FREE(token->value);
-		FREE(token);
-	}
-	if(p != NULL) {
-		events_tree_gc(p);
-	}
 
 	return err;
 }
@@ -332,22 +472,105 @@ void event_cache_device(struct rules_t *obj, char *device) {
 			}
 			strcpy(obj->devices[obj->nrdevices], device);
 			obj->nrdevices++;
+
+			rules_index_add(device, obj);
 		}
 	}
 }
 
+/*
+ * Store the settings of a device read by the conditions of a
+ * rule. Without a name the rule reads the device as a whole.
+ */
+static void event_cache_value(struct rules_t *obj, char *device, char *name) {
+	struct rules_values_t *node = NULL;
+
+	for(node=obj->values;node!=NULL;node=node->next) {
+		if(strcmp(node->device, device) == 0 &&
+		   (node->name == NULL || (name != NULL && strcmp(node->name, name) == 0))) {
+			return;
+		}
+	}
+	if((node = MALLOC(sizeof(struct rules_values_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(node, 0, sizeof(struct rules_values_t));
+	if((node->device = STRDUP(device)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if(name != NULL && (node->name = STRDUP(name)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->next = obj->values;
+	obj->values = node;
+}
+
+/*
+ * Store the devices controlled by the actions of a rule.
+ */
+static void event_cache_target(struct rules_t *obj, char *device) {
+	int o = 0;
+
+	for(o=0;o<obj->nrtargets;o++) {
+		if(strcmp(obj->targets[o], device) == 0) {
+			return;
+		}
+	}
+	if((obj->targets = REALLOC(obj->targets, sizeof(char *)*(unsigned int)(obj->nrtargets+1))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((obj->edges = REALLOC(obj->edges, sizeof(struct event_storm_t)*(unsigned int)(obj->nrtargets+1))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(&obj->edges[obj->nrtargets], 0, sizeof(struct event_storm_t));
+	if((obj->targets[obj->nrtargets] = STRDUP(device)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	obj->nrtargets++;
+}
+
 /*
  * This functions checks if the defined event variable
  * is part of one of devices in the config. If it is,
  * replace the variable with the actual value
  *
+ * When the variable is the value of a TSTRING token, that
+ * token can be passed along. Device settings and plain
+ * literals are then resolved once and reused until the
+ * devices are garbage collected.
+ *
  * Return codes:
  * -1: An error was found and abort rule parsing
  * 0: Found variable and filled varcont
  * 1: Did not find variable and did not fill varcont
  */
-static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_t *varcont, unsigned short validate, int in_action) {
+static int event_lookup_variable(char *var, struct token_t *token, struct rules_t *obj, struct varcont_t *varcont, unsigned short validate, int in_action) {
 	int recvtype = 0;
+
+	if(token != NULL && token->value != var) {
+		token = NULL;
+	}
+	if(validate == 0 && token != NULL && token->lookup != LOOKUP_NONE &&
+		token->generation == devices_generation()) {
+		if(token->lookup == LOOKUP_LITERAL) {
+			varcont->string_ = token->value;
+			varcont->type_ = JSON_STRING;
+			return 0;
+		}
+#ifndef PILIGHT_REWRITE
+		if(token->setting->values->type == JSON_STRING) {
+			varcont->string_ = token->setting->values->string_;
+			varcont->type_ = JSON_STRING;
+			return 0;
+		} else if(token->setting->values->type == JSON_NUMBER) {
+			varcont->number_ = token->setting->values->number_;
+			varcont->decimals_ = token->setting->values->decimals;
+			varcont->type_ = JSON_NUMBER;
+			return 0;
+		}
+#endif
+	}
+
 	// int cached = 0;
 	if(strcmp(true_, "1") != 0) {
 		strcpy(true_, "1");
@@ -384,18 +607,21 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 	}
 
 	if(nrdots == 1) {
-		char **array = NULL;
-		unsigned int n = explode(var, ".", &array);
+		struct span_t rest, first, second;
 
-		if(n < 2) {
+		span_init(&rest, var);
+		if(span_pair(&rest, ".", &first, &second) != 0) {
 			varcont->string_ = dot_;
-			array_free(&array, n);
 			varcont->type_ = JSON_STRING;
 			return 0;
 		}
 
-		char *device = array[0];
-		char *name = array[1];
+		/* The variable itself is left untouched */
+		char device[first.len+1], name[second.len+1];
+		memcpy(device, first.ptr, first.len);
+		device[first.len] = '\0';
+		memcpy(name, second.ptr, second.len);
+		name[second.len] = '\0';
 
 		recvtype = 0;
 		struct protocols_t *tmp_protocols = protocols;
@@ -451,7 +677,6 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 						varcont->string_ = NULL;
 						varcont->number_ = 0;
 						varcont->decimals_ = 0;
-						array_free(&array, n);
 						return -1;
 					}
 				} else if(!(strcmp(name, "repeats") == 0 || strcmp(name, "uuid") == 0)) {
@@ -459,7 +684,6 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 					varcont->string_ = NULL;
 					varcont->number_ = 0;
 					varcont->decimals_ = 0;
-					array_free(&array, n);
 					return -1;
 				}
 			}
@@ -471,23 +695,21 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 					if(jnode->tag == JSON_STRING) {
 						varcont->string_ = jnode->string_;
 						varcont->type_ = JSON_STRING;
-						array_free(&array, n);
 						return 0;
 					} else if(jnode->tag == JSON_NUMBER) {
 						varcont->number_ = jnode->number_;
 						varcont->decimals_ = jnode->decimals_;
 						varcont->type_ = JSON_NUMBER;
-						array_free(&array, n);
 						return 0;
 					}
 				}
 			}
-			array_free(&array, n);
 			return 0;
 		} else if(recvtype == 1) {
 			if(validate == 1) {
 				if(in_action == 0) {
 					event_cache_device(obj, device);
+					event_cache_value(obj, device, name);
 				}
 #ifdef PILIGHT_REWRITE
 				struct protocol_t *tmp = NULL;
@@ -540,7 +762,6 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 					varcont->string_ = NULL;
 					varcont->number_ = 0;
 					varcont->decimals_ = 0;
-					array_free(&array, n);
 					return -1;
 				}
 			}
@@ -558,7 +779,6 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 						// }
 						varcont->string_ = val.string_;
 						varcont->type_ = JSON_STRING;
-						array_free(&array, n);
 						return 0;
 					} else if(val.type_ == JSON_NUMBER) {
 						/* Cache values for faster future lookup */
@@ -568,16 +788,20 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 						varcont->number_ = val.number_;
 						varcont->decimals_ = val.decimals_;
 						varcont->type_ = JSON_NUMBER;
-						array_free(&array, n);
 						return 0;
 					}
 				}
 			}
 #else
-			struct devices_settings_t *tmp_settings = dev->settings;
+			struct devices_settings_t *tmp_settings = devices_get_setting(dev, name);
 			while(tmp_settings) {
 				if(strcmp(tmp_settings->name, name) == 0) {
 					val.type_ = tmp_settings->values->type;
+					if(token != NULL && (val.type_ == JSON_STRING || val.type_ == JSON_NUMBER)) {
+						token->lookup = LOOKUP_SETTING;
+						token->setting = tmp_settings;
+						token->generation = devices_generation();
+					}
 					if(val.type_ == JSON_STRING) {
 						/* Cache values for faster future lookup */
 						// if(obj != NULL) {
@@ -585,7 +809,6 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 						// }
 						varcont->string_ = tmp_settings->values->string_;
 						varcont->type_ = JSON_STRING;
-						array_free(&array, n);
 						return 0;
 					} else if(val.type_ == JSON_NUMBER) {
 						/* Cache values for faster future lookup */
@@ -595,7 +818,6 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 						varcont->number_ = tmp_settings->values->number_;
 						varcont->decimals_ = tmp_settings->values->decimals;
 						varcont->type_ = JSON_NUMBER;
-						array_free(&array, n);
 						return 0;
 					}
 				}
@@ -606,7 +828,6 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 			varcont->string_ = NULL;
 			varcont->number_ = 0;
 			varcont->decimals_ = 0;
-			array_free(&array, n);
 			return -1;
 		}
 		/*
@@ -617,10 +838,8 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 			varcont->string_ = NULL;
 			varcont->number_ = 0;
 			varcont->decimals_ = 0;
-			array_free(&array, n);
 			return -1;
 		}*/
-		array_free(&array, n);
 	}
 	/*
 	 * Multiple dots should also be allowed and not be seen as config device
@@ -639,6 +858,11 @@ static int event_lookup_variable(char *var, struct rules_t *obj, struct varcont_
 		varcont->number_ = atof(var);
 		varcont->decimals_ = nrDecimals(var);
 		varcont->type_ = JSON_NUMBER;
+	} else if(token != NULL) {
+		token->lookup = LOOKUP_LITERAL;
+		token->generation = devices_generation();
+		varcont->string_ = token->value;
+		varcont->type_ = JSON_STRING;
 	} else {
 		if((varcont->string_ = STRDUP(var)) == NULL) {
 			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
@@ -693,8 +917,7 @@ static int lexer_parse_quoted_string(struct lexer_t *lexer, struct stack_dt *t)
 			lexer->current_char = &lexer->text[lexer->pos++];
 		}
 		if(lexer->current_char[0] != '"' && lexer->current_char[0] != '\'') {
-			dt_stack_free(t, NULL);
-			return print_error(lexer, NULL, NULL, NULL, -1, "a ending quote", lexer->pos, lexer->ppos-1);
+			return print_error(lexer, -1, "a ending quote", lexer->pos, lexer->ppos-1);
 		} else if(lexer->pos <= lexer->len) {
 			lexer->current_char = &lexer->text[lexer->pos++];
 			return 0;
@@ -723,21 +946,21 @@ static int lexer_parse_space(struct lexer_t *lexer) {
 	return 0;
 }
 
-static char *stack_to_char(struct stack_dt *stack) {
-	char *c = NULL;
-	char *str = MALLOC(dt_stack_top(stack)+1);
-	int i = 0;
-
-	if(str == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
+/*
+ * The token and its value are taken from the pool together.
+ */
+static struct token_t *lexer_token(struct lexer_t *lexer, struct stack_dt *stack) {
+	int i = 0, len = dt_stack_top(stack);
+	struct token_t *token = events_pool_alloc(lexer->pool, sizeof(struct token_t)+(size_t)len+1);
 
-	while((c = dt_stack_pop(stack, 0)) != NULL) {
-		str[i++] = c[0];
+	memset(token, 0, sizeof(struct token_t));
+	token->value = (char *)&token[1];
+	for(i=0;i<len;i++) {
+		token->value[i] = ((char *)stack->list[i])[0];
 	}
-	str[i] = '\0';
-	dt_stack_free(stack, NULL);
-	return str;
+	token->value[len] = '\0';
+	stack->top = 0;
+	return token;
 }
 
 static char *min(char *numbers[], int n){
@@ -764,14 +987,10 @@ static char *min(char *numbers[], int n){
 }
 
 static int lexer_next_token(struct lexer_t *lexer) {
-	struct stack_dt *t = MALLOC(sizeof(struct stack_dt));
+	struct stack_dt *t = &lexer->stack;
 	int type = TEOF, ret = 0;
 
-	if(t == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
-
-	memset(t, 0, sizeof(struct stack_dt));
+	t->top = 0;
 
 	while(lexer->pos <= lexer->len) {
 		lexer->ppos = lexer->pos;
@@ -866,39 +1085,48 @@ static int lexer_next_token(struct lexer_t *lexer) {
 			type = TSTRING;
 		}
 		if(type != TEOF && ret == 0) {
-			if((lexer->current_token = MALLOC(sizeof(struct token_t))) == NULL) {
-				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-			}
-			lexer->current_token->value = stack_to_char(t);
+			lexer->current_token = lexer_token(lexer, t);
 			lexer->current_token->type = type;
 			lexer->current_token->pos = lexer->pos;
+			lexer->current_token->lookup = LOOKUP_NONE;
+			if(type == TINTEGER) {
+				lexer->current_token->number_ = atof(lexer->current_token->value);
+				lexer->current_token->decimals_ = nrDecimals(lexer->current_token->value);
+			}
 			return 0;
 		} else {
 			return ret;
 		}
 	}
-	if(t != NULL) {
-		FREE(t);
-	}
-
 	lexer->current_token = NULL;
 	return 0;
 }
 
-static struct tree_t *ast_parent(struct token_t *token) {
-	struct tree_t *tree = MALLOC(sizeof(struct tree_t));
-	if(tree == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
+static struct tree_t *ast_parent(struct lexer_t *lexer, struct token_t *token) {
+	struct tree_t *tree = events_pool_alloc(lexer->pool, sizeof(struct tree_t));
+
 	tree->child = NULL;
 	tree->nrchildren = 0;
+	tree->childsize = 0;
 	tree->token = token;
+	tree->pool = lexer->pool;
 	return tree;
 }
 
+/*
+ * The list of children doubles when it's full, the old one is
+ * left in the pool.
+ */
 static struct tree_t *ast_child(struct tree_t *p, struct tree_t *c) {
-	if((p->child = REALLOC(p->child, sizeof(struct tree_t)*(p->nrchildren+1))) == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	struct tree_t **child = NULL;
+
+	if(p->nrchildren == p->childsize) {
+		p->childsize = (p->childsize == 0) ? 2 : p->childsize*2;
+		child = events_pool_alloc(p->pool, sizeof(struct tree_t *)*(size_t)p->childsize);
+		if(p->nrchildren > 0) {
+			memcpy(child, p->child, sizeof(struct tree_t *)*(size_t)p->nrchildren);
+		}
+		p->child = child;
 	}
 	p->child[p->nrchildren] = c;
 	p->nrchildren++;
@@ -915,10 +1143,6 @@ static int lexer_peek(struct lexer_t *lexer, int skip, int type, char *val) {
 			if((ret = lexer_next_token(lexer)) < 0) {
 				goto bad;
 			}
-			if(i < skip-1 && lexer->current_token != NULL) {
-				FREE(lexer->current_token->value);
-				FREE(lexer->current_token);
-			}
 		}
 	}
 
@@ -941,19 +1165,11 @@ static int lexer_peek(struct lexer_t *lexer, int skip, int type, char *val) {
 	}
 
 good:
-	if(skip > 0 && lexer->current_token != NULL) {
-		FREE(lexer->current_token->value);
-		FREE(lexer->current_token);
-	}
 	lexer->pos = pos;
 	lexer->current_token = tmp;
 	lexer->current_char = c;
 	return 0;
 bad:
-	if(skip > 0 && lexer->current_token != NULL) {
-		FREE(lexer->current_token->value);
-		FREE(lexer->current_token);
-	}
 	lexer->pos = pos;
 	lexer->current_token = tmp;
 	lexer->current_char = c;
@@ -972,10 +1188,6 @@ static int lexer_eat(struct lexer_t *lexer, int type, struct token_t **token_out
 			return ret;
 		}
 	} else {
-		if(lexer->current_token != NULL) {
-			FREE(lexer->current_token->value);
-			FREE(lexer->current_token);
-		}
 		*token_out = NULL;
 		return -1;
 	}
@@ -998,22 +1210,20 @@ static int lexer_factor(struct lexer_t *lexer, struct tree_t *tree_in, struct tr
 				if((err = lexer_eat(lexer, TSTRING, &token_ret)) < 0) {
 					goto error;
 				}
-				*tree_out = ast_parent(token);
+				*tree_out = ast_parent(lexer, token);
 				return 0;
 			} break;
 			case TINTEGER: {
 				if((err = lexer_eat(lexer, TINTEGER, &token_ret)) < 0) {
 					goto error;
 				}
-				*tree_out = ast_parent(token);
+				*tree_out = ast_parent(lexer, token);
 				return 0;
 			} break;
 			case LPAREN: {
 				if((err = lexer_eat(lexer, LPAREN, &token_ret)) < 0) {
 					goto error;
 				}
-				FREE(token_ret->value);
-				FREE(token_ret);
 				if((err = lexer_expr(lexer, tree_in, tree_out)) < 0) {
 					goto error;
 				}
@@ -1024,8 +1234,6 @@ static int lexer_factor(struct lexer_t *lexer, struct tree_t *tree_in, struct tr
 					pos += 1;
 					goto error;
 				}
-				FREE(token_ret->value);
-				FREE(token_ret);
 				return 0;
 			} break;
 		}
@@ -1035,13 +1243,13 @@ static int lexer_factor(struct lexer_t *lexer, struct tree_t *tree_in, struct tr
 	return -1;
 
 error:
-	return print_error(lexer, NULL, *tree_out, token_ret, err, expected, pos, lexer->ppos-1);
+	return print_error(lexer, err, expected, pos, lexer->ppos-1);
 }
 
 static int lexer_parse_function(struct lexer_t *lexer, struct tree_t *tree_in, struct tree_t **tree_out) {
 	struct tree_t *node = NULL;
 	struct token_t *token = lexer->current_token, *token_ret = NULL;
-	struct tree_t *p = ast_parent(token);
+	struct tree_t *p = ast_parent(lexer, token);
 	char *expected = NULL;
 	int pos = 0, err = -1, loop = 1;
 
@@ -1053,13 +1261,10 @@ static int lexer_parse_function(struct lexer_t *lexer, struct tree_t *tree_in, s
 		*tree_out = NULL;
 		return err;
 	}
-	FREE(token_ret->value);
-	FREE(token_ret);
 
 	if((err = lexer_term(lexer, tree_in, 0, &node)) == 0) {
 		ast_child(p, node);
 	} else {
-		events_tree_gc(p);
 		*tree_out = NULL;
 		return err;
 	}
@@ -1074,12 +1279,9 @@ static int lexer_parse_function(struct lexer_t *lexer, struct tree_t *tree_in, s
 			pos -= strlen(node->token->value);
 			lexer->ppos -= 2;
 			expected = tmp;
-			events_tree_gc(p);
 			err = -1;
 			goto error;
 		}
-		FREE(token_ret->value);
-		FREE(token_ret);
 		if(lexer_term(lexer, tree_in, 0, &node) == 0) {
 			ast_child(p, node);
 		}
@@ -1103,14 +1305,12 @@ static int lexer_parse_function(struct lexer_t *lexer, struct tree_t *tree_in, s
 		err = -1;
 		goto error;
 	}
-	FREE(token_ret->value);
-	FREE(token_ret);
 
 	*tree_out = p;
 	return 0;
 
 error:
-	return print_error(lexer, NULL, NULL, NULL, err, expected, pos, lexer->ppos-1);
+	return print_error(lexer, err, expected, pos, lexer->ppos-1);
 }
 
 static void print_ast(struct tree_t *tree);
@@ -1124,7 +1324,7 @@ static int lexer_parse_action(struct lexer_t *lexer, struct tree_t *tree_in, str
 	char *expected = NULL;
 	int len = strlen(token->value), match = 0, pos = 0, err = -1;
 
-	p = ast_parent(token);
+	p = ast_parent(lexer, token);
 
 	if(is_action(token->value, len) > 0) {
 		if((err = lexer_eat(lexer, TACTION, &token_ret)) < 0) {
@@ -1191,12 +1391,10 @@ static int lexer_parse_action(struct lexer_t *lexer, struct tree_t *tree_in, str
 					pos -= strlen(token_ret->value)+1;
 					lexer->ppos -= lexer->ppos-pos;
 					expected = tmp;
-					FREE(token_ret->value);
-					FREE(token_ret);
 					err = -1;
 					goto error;
 				}
-				p1 = ast_parent(token_ret);
+				p1 = ast_parent(lexer, token_ret);
 				ast_child(p, p1);
 				/*
 				 * In case we a arguments is combined like this
@@ -1211,7 +1409,7 @@ static int lexer_parse_action(struct lexer_t *lexer, struct tree_t *tree_in, str
 								err = -1;
 								goto error;
 							}
-							ast_child(p1, ast_parent(token_ret));
+							ast_child(p1, ast_parent(lexer, token_ret));
 						} else if(lexer_peek(lexer, 0, TSTRING, NULL) == 0) {
 							if((err = lexer_eat(lexer, TSTRING, &token_ret)) < 0) {
 								char *tmp = "a string,  number or function";
@@ -1219,7 +1417,7 @@ static int lexer_parse_action(struct lexer_t *lexer, struct tree_t *tree_in, str
 								err = -1;
 								goto error;
 							}
-							ast_child(p1, ast_parent(token_ret));
+							ast_child(p1, ast_parent(lexer, token_ret));
 						}
 						if((err = lexer_eat(lexer, TOPERATOR, &token_ret)) < 0) {
 							char *tmp = "an 'and' operator";
@@ -1227,8 +1425,6 @@ static int lexer_parse_action(struct lexer_t *lexer, struct tree_t *tree_in, str
 							err = -1;
 							goto error;
 						}
-						FREE(token_ret->value);
-						FREE(token_ret);
 					}
 					if(lexer_peek(lexer, 0, TINTEGER, NULL) == 0) {
 						if((err = lexer_eat(lexer, TINTEGER, &token_ret)) < 0) {
@@ -1236,7 +1432,7 @@ static int lexer_parse_action(struct lexer_t *lexer, struct tree_t *tree_in, str
 							expected = tmp;
 							goto error;
 						}
-						ast_child(p1, ast_parent(token_ret));
+						ast_child(p1, ast_parent(lexer, token_ret));
 					} else if(lexer_peek(lexer, 0, TSTRING, NULL) == 0) {
 						if((err = lexer_eat(lexer, TSTRING, &token_ret)) < 0) {
 							char *tmp = "a string, number or function";
@@ -1244,7 +1440,7 @@ static int lexer_parse_action(struct lexer_t *lexer, struct tree_t *tree_in, str
 							err = -1;
 							goto error;
 						}
-						ast_child(p1, ast_parent(token_ret));
+						ast_child(p1, ast_parent(lexer, token_ret));
 					}
 				} else {
 					if(lexer_peek(lexer, 0, TACTION, NULL) == 0) {
@@ -1272,13 +1468,13 @@ static int lexer_parse_action(struct lexer_t *lexer, struct tree_t *tree_in, str
 	return 0;
 
 error:
-	return print_error(lexer, p, NULL, NULL, err, expected, pos, lexer->ppos-1);
+	return print_error(lexer, err, expected, pos, lexer->ppos-1);
 }
 
 static int lexer_parse_if(struct lexer_t *lexer, struct tree_t *tree, struct tree_t **tree_out) {
 	struct tree_t *node = NULL;
 	struct token_t *token = lexer->current_token, *token_ret = NULL;
-	struct tree_t *p = ast_parent(token);
+	struct tree_t *p = ast_parent(lexer, token);
 	char *expected = NULL;
 	int pos = 0, err = -1;
 
@@ -1305,8 +1501,6 @@ static int lexer_parse_if(struct lexer_t *lexer, struct tree_t *tree, struct tre
 		goto error;
 	}
 	pos = token->pos;
-	FREE(token->value);
-	FREE(token);
 	if(lexer_peek(lexer, 0, TACTION, NULL) < 0 && lexer_peek(lexer, 0, TIF, NULL) < 0) {
 		if((err = lexer_peek(lexer, 0, TACTION, NULL)) < 0) {
 			char *tmp = "an action";
@@ -1328,8 +1522,6 @@ static int lexer_parse_if(struct lexer_t *lexer, struct tree_t *tree, struct tre
 			*tree_out = NULL;
 			return -1;
 		}
-		FREE(token->value);
-		FREE(token);
 		if(lexer_term(lexer, tree, 0, &node) == 0) {
 			ast_child(p, node);
 		}
@@ -1349,8 +1541,6 @@ static int lexer_parse_if(struct lexer_t *lexer, struct tree_t *tree, struct tre
 			*tree_out = NULL;
 			return -1;
 		}
-		FREE(token->value);
-		FREE(token);
 	} else if(lexer_peek(lexer, 0, TEOF, NULL) == 0) {
 		if((err = lexer_eat(lexer, TEOF, &token_ret)) < 0) {
 			*tree_out = NULL;
@@ -1362,15 +1552,13 @@ static int lexer_parse_if(struct lexer_t *lexer, struct tree_t *tree, struct tre
 			*tree_out = NULL;
 			return -1;
 		}
-		FREE(token->value);
-		FREE(token);
 	}
 
 	*tree_out = p;
 	return 0;
 
 error:
-	return print_error(lexer, p, NULL, NULL, err, expected, pos, lexer->ppos-1);
+	return print_error(lexer, err, expected, pos, lexer->ppos-1);
 }
 
 /*
@@ -1424,16 +1612,7 @@ static int lexer_term(struct lexer_t *lexer, struct tree_t *tree_in, int precede
 				return 0;
 			} break;
 			case TACTION: {
-				if(node != NULL) {
-					if(node->token->value != NULL) {
-						FREE(node->token->value);
-					}
-					if(node->token != NULL) {
-						FREE(node->token);
-					}
-					FREE(node);
-					node = NULL;
-				}
+				node = NULL;
 				if((err = lexer_parse_action(lexer, tree_in, &tree_ret)) < 0) {
 					*tree_out = NULL;
 					goto error;
@@ -1454,7 +1633,6 @@ static int lexer_term(struct lexer_t *lexer, struct tree_t *tree_in, int precede
 					char *tmp = "an operator";
 					expected = tmp;
 					pos = lexer->pos-strlen(lexer->current_token->value)-1;
-					events_tree_gc(tree_ret);
 					err = -1;
 					goto error;
 				}
@@ -1494,10 +1672,9 @@ static int lexer_term(struct lexer_t *lexer, struct tree_t *tree_in, int precede
 							lexer->ppos = tpos;
 							pos = token->pos;
 							err = -1;
-							events_tree_gc(tree_ret);
 							goto error;
 						}
-						p = ast_parent(token);
+						p = ast_parent(lexer, token);
 						ast_child(p, node);
 						ast_child(p, tree_ret);
 						*tree_out = p;
@@ -1516,10 +1693,9 @@ static int lexer_term(struct lexer_t *lexer, struct tree_t *tree_in, int precede
 							pos = token->pos;
 							lexer->ppos = tpos;
 							err = -1;
-							events_tree_gc(tree_ret);
 							goto error;
 						}
-						p = ast_parent(token);
+						p = ast_parent(lexer, token);
 						ast_child(p, node);
 						ast_child(p, tree_ret);
 						*tree_out = p;
@@ -1536,7 +1712,7 @@ static int lexer_term(struct lexer_t *lexer, struct tree_t *tree_in, int precede
 	return 0;
 
 error:
-	return print_error(lexer, p, node, token, err, expected, pos, lexer->ppos-1);
+	return print_error(lexer, err, expected, pos, lexer->ppos-1);
 }
 
 static int lexer_expr(struct lexer_t *lexer, struct tree_t *tree, struct tree_t **out) {
@@ -1544,28 +1720,16 @@ static int lexer_expr(struct lexer_t *lexer, struct tree_t *tree, struct tree_t
 }
 
 static int lexer_parse(struct lexer_t *lexer, struct tree_t **tree_out) {
-	struct tree_t *tree = MALLOC(sizeof(struct tree_t));
+	struct tree_t *tree = ast_parent(lexer, NULL);
 	int err = -1;
 
-	if(tree == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
-	memset(tree, 0, sizeof(struct tree_t));
-
 	if((err = lexer_expr(lexer, tree, tree_out)) < 0) {
 		if(err == -1) {
-			err = print_error(lexer, tree, NULL, NULL, err, NULL, lexer->pos+1, lexer->ppos-1);
-		} else {
-			events_tree_gc(tree);
+			err = print_error(lexer, err, NULL, lexer->pos+1, lexer->ppos-1);
 		}
 		return err;
-	} else {
-		if(lexer->current_token != NULL && lexer->current_token->type != TEOF) {
-			FREE(tree);
-			return -1;
-		}
-
-		FREE(tree);
+	} else if(lexer->current_token != NULL && lexer->current_token->type != TEOF) {
+		return -1;
 	}
 	return 0;
 }
@@ -1616,7 +1780,7 @@ static int run_function(struct tree_t *tree, int in_action, struct rules_t *obj,
 			return -1;
 		}
 		if(v_res.type_ == JSON_STRING) {
-			if(event_lookup_variable(v_res.string_, obj, &v1, validate, in_action) == -1) {
+			if(event_lookup_variable(v_res.string_, tree->child[i]->token, obj, &v1, validate, in_action) == -1) {
 				varcont_free(&v1);
 				varcont_free(&v_res);
 				return -1;
@@ -1630,6 +1794,7 @@ static int run_function(struct tree_t *tree, int in_action, struct rules_t *obj,
 					if(in_action == 0 && devices_get(v1.string_, &dev) == 0) {
 #endif
 						event_cache_device(obj, v1.string_);
+						event_cache_value(obj, v1.string_, NULL);
 					}
 				}
 				args = event_function_add_argument(&v1, args);
@@ -1649,6 +1814,34 @@ static int run_function(struct tree_t *tree, int in_action, struct rules_t *obj,
 	return 0;
 }
 
+/*
+ * Returns -1 when the rule, or the rule on one of the devices
+ * of the action, runs too often, see event_storm_run.
+ */
+static int event_storm_hold(struct rules_t *obj, struct event_action_args_t *args) {
+	int i = 0, x = 0, ret = event_storm_run(&obj->storm, obj->name, NULL);
+
+	while(args != NULL) {
+		if(strcmp(args->key, "DEVICE") == 0) {
+			for(i=0;i<args->nrvalues;i++) {
+				if(args->var[i]->type_ != JSON_STRING) {
+					continue;
+				}
+				for(x=0;x<obj->nrtargets;x++) {
+					if(strcmp(obj->targets[x], args->var[i]->string_) == 0) {
+						if(event_storm_run(&obj->edges[x], obj->name, obj->targets[x]) == -1) {
+							ret = -1;
+						}
+						break;
+					}
+				}
+			}
+		}
+		args = args->next;
+	}
+	return ret;
+}
+
 static int run_action(struct tree_t *tree, struct rules_t *obj, unsigned short validate, struct varcont_t *v_out) {
 	struct event_action_args_t *args = NULL;
 	struct varcont_t v_res, v_res1, v1, v;
@@ -1683,7 +1876,7 @@ static int run_action(struct tree_t *tree, struct rules_t *obj, unsigned short v
 
 			switch(v_res1.type_) {
 				case JSON_STRING: {
-					if(event_lookup_variable(v_res1.string_, obj, &v1, validate, 1) == -1) {
+					if(event_lookup_variable(v_res1.string_, tree->child[i]->child[x]->token, obj, &v1, validate, 1) == -1) {
 						varcont_free(&v1);
 						varcont_free(&v_res);
 						varcont_free(&v_res1);
@@ -1730,13 +1923,27 @@ static int run_action(struct tree_t *tree, struct rules_t *obj, unsigned short v
 
 	if(len > 0) {
 		if(validate == 1) {
-			if(event_action_check_arguments(tree->token->value, args) == -1) {
-				return -1;
+			struct event_action_args_t *tmp = args;
+			while(tmp != NULL) {
+				if(strcmp(tmp->key, "DEVICE") == 0) {
+					for(i=0;i<tmp->nrvalues;i++) {
+						if(tmp->var[i]->type_ == JSON_STRING) {
+							event_cache_target(obj, tmp->var[i]->string_);
+						}
+					}
+				}
+				tmp = tmp->next;
 			}
-		} else {
-			if(event_action_run(tree->token->value, args) == -1) {
+			/* The actions of a config that matches its snapshot were checked before */
+			if(snapshot_validated() == 1) {
+				event_action_free_argument(args);
+			} else if(event_action_check_arguments(tree->token->value, args) == -1) {
 				return -1;
 			}
+		} else if(event_storm_hold(obj, args) == -1) {
+			event_action_free_argument(args);
+		} else if(event_action_run(tree->token->value, args) == -1) {
+			return -1;
 		}
 	}
 
@@ -1771,11 +1978,16 @@ static int interpret(struct tree_t *tree, int in_action, struct rules_t *obj, un
 			return 0;
 		} break;
 		case TINTEGER: {
-			v_out->number_ = atof(tree->token->value);
-			v_out->decimals_ = nrDecimals(tree->token->value);
+			v_out->number_ = tree->token->number_;
+			v_out->decimals_ = tree->token->decimals_;
 			v_out->type_ = JSON_NUMBER;
 			return 0;
 		} break;
+		case TBOOL: {
+			v_out->bool_ = (int)tree->token->number_;
+			v_out->type_ = JSON_BOOL;
+			return 0;
+		} break;
 		case TIF: {
 			if(interpret(tree->child[0], 0, obj, validate, &v_res) == -1) {
 				varcont_free(&v_res);
@@ -1832,12 +2044,8 @@ static int interpret(struct tree_t *tree, int in_action, struct rules_t *obj, un
 					varcont_free(&v1);
 					return -1;
 				}
-				if(interpret(tree->child[1], in_action, obj, validate, &v2) == -1) {
-					varcont_free(&v2);
-					return -1;
-				}
 				if(v1.type_ == JSON_STRING) {
-					if(event_lookup_variable(v1.string_, obj, &v3, validate, in_action) == -1) {
+					if(event_lookup_variable(v1.string_, tree->child[0]->token, obj, &v3, validate, in_action) == -1) {
 						varcont_free(&v1);
 						return -1;
 					} else {
@@ -1863,8 +2071,27 @@ static int interpret(struct tree_t *tree, int in_action, struct rules_t *obj, un
 						varcont_free(&v3);
 					}
 				}
+				/*
+				 * Once the left side of a stock AND / OR decides the
+				 * outcome, the right side with its lookups and calls
+				 * is skipped. Validation still walks both sides.
+				 */
+				if(validate == 0 && v1.type_ == JSON_BOOL &&
+					event_operator_native(tree->token->value) == 1 &&
+					((v1.bool_ == 0 && strcmp(tree->token->value, "AND") == 0) ||
+					 (v1.bool_ == 1 && strcmp(tree->token->value, "OR") == 0))) {
+					v_out->bool_ = v1.bool_;
+					v_out->type_ = JSON_BOOL;
+					varcont_free(&v1);
+					return 0;
+				}
+				if(interpret(tree->child[1], in_action, obj, validate, &v2) == -1) {
+					varcont_free(&v1);
+					varcont_free(&v2);
+					return -1;
+				}
 				if(v2.type_ == JSON_STRING) {
-					if(event_lookup_variable(v2.string_, obj, &v4, validate, in_action) == -1) {
+					if(event_lookup_variable(v2.string_, tree->child[1]->token, obj, &v4, validate, in_action) == -1) {
 						varcont_free(&v2);
 						return -1;
 					} else {
@@ -1910,6 +2137,210 @@ static int interpret(struct tree_t *tree, int in_action, struct rules_t *obj, un
 	return 0;
 }
 
+static int is_constant(struct tree_t *tree) {
+	return (tree != NULL && tree->token != NULL &&
+		(tree->token->type == TINTEGER || tree->token->type == TBOOL));
+}
+
+/*
+ * Replace operators and functions that only have constant
+ * operands by their outcome, so they are evaluated once when
+ * the rule is parsed instead of on every event. Only the
+ * native implementations are folded, as those are known to be
+ * free of side effects.
+ */
+static void events_fold(struct tree_t *tree, struct rules_t *obj) {
+	struct varcont_t v;
+	char *value = NULL;
+	int i = 0, len = 0;
+
+	if(tree == NULL || tree->token == NULL) {
+		return;
+	}
+
+	for(i=0;i<tree->nrchildren;i++) {
+		events_fold(tree->child[i], obj);
+	}
+
+	if(tree->nrchildren == 0) {
+		return;
+	}
+	if(tree->token->type == TOPERATOR) {
+		if(tree->nrchildren != 2 || event_operator_native(tree->token->value) == 0) {
+			return;
+		}
+	} else if(tree->token->type == TFUNCTION) {
+		if(event_function_native(tree->token->value) == 0) {
+			return;
+		}
+	} else {
+		return;
+	}
+	for(i=0;i<tree->nrchildren;i++) {
+		if(is_constant(tree->child[i]) == 0) {
+			return;
+		}
+	}
+
+	memset(&v, '\0', sizeof(struct varcont_t));
+	if(interpret(tree, 0, obj, 0, &v) == -1) {
+		varcont_free(&v);
+		return;
+	}
+
+	switch(v.type_) {
+		case JSON_NUMBER: {
+			len = snprintf(NULL, 0, "%.*f", v.decimals_, v.number_);
+			value = events_pool_alloc(tree->pool, (size_t)len+1);
+			snprintf(value, len+1, "%.*f", v.decimals_, v.number_);
+			tree->token->type = TINTEGER;
+			tree->token->number_ = v.number_;
+			tree->token->decimals_ = v.decimals_;
+		} break;
+		case JSON_BOOL: {
+			value = events_pool_alloc(tree->pool, 2);
+			strcpy(value, (v.bool_ == 1) ? "1" : "0");
+			tree->token->type = TBOOL;
+			tree->token->number_ = v.bool_;
+			tree->token->decimals_ = 0;
+		} break;
+		default: {
+			varcont_free(&v);
+			return;
+		} break;
+	}
+
+	/* The old value and the children stay in the pool */
+	tree->token->value = value;
+	tree->child = NULL;
+	tree->nrchildren = 0;
+	tree->childsize = 0;
+}
+
+/*
+ * Collect the datetime fields compared to a constant in the
+ * AND chain of a rule condition. All of those comparisons have
+ * to hold for the rule to be true, so the clock ticks only need
+ * to evaluate the rule at the moments where they do.
+ */
+static void events_timer_fields(struct tree_t *tree, char **device, int *fields, int *nr) {
+	struct tree_t *var = NULL, *value = NULL;
+	struct devices_t *dev = NULL;
+	char *dot = NULL;
+	int field = 0, len = 0;
+
+	if(tree == NULL || tree->token == NULL || tree->token->type != TOPERATOR || tree->nrchildren != 2) {
+		return;
+	}
+	if(strcmp(tree->token->value, "AND") == 0) {
+		events_timer_fields(tree->child[0], device, fields, nr);
+		events_timer_fields(tree->child[1], device, fields, nr);
+		return;
+	}
+	if(strcmp(tree->token->value, "==") != 0) {
+		return;
+	}
+
+	if(tree->child[0]->token->type == TSTRING && tree->child[1]->token->type == TINTEGER) {
+		var = tree->child[0];
+		value = tree->child[1];
+	} else if(tree->child[1]->token->type == TSTRING && tree->child[0]->token->type == TINTEGER) {
+		var = tree->child[1];
+		value = tree->child[0];
+	} else {
+		return;
+	}
+	if(value->token->decimals_ != 0 || (dot = strchr(var->token->value, '.')) == NULL ||
+	   strchr(dot+1, '.') != NULL || (field = event_timer_field(dot+1)) == -1) {
+		return;
+	}
+
+	len = (int)(dot - var->token->value);
+	char name[len+1];
+	memcpy(name, var->token->value, len);
+	name[len] = '\0';
+
+	if(devices_get(name, &dev) != 0 || dev->protocols == NULL ||
+	   dev->protocols->listener->devtype != DATETIME) {
+		return;
+	}
+	if(*device == NULL) {
+		if((*device = STRDUP(name)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	} else if(strcmp(*device, name) != 0) {
+		return;
+	}
+
+	if(fields[field] > -1 && fields[field] != (int)value->token->number_) {
+		fields[field] = TIMER_NEVER;
+	} else {
+		fields[field] = (int)value->token->number_;
+	}
+	(*nr)++;
+}
+
+/*
+ * Rules without an ELSE that compare datetime fields to
+ * constants get a timer for the moments these can be true.
+ */
+static void events_timer_find(struct rules_t *obj) {
+	char *device = NULL;
+	int fields[TIMER_FIELDS];
+	int i = 0, nr = 0;
+
+	if(obj->tree == NULL || obj->tree->token == NULL ||
+	   obj->tree->token->type != TIF || obj->tree->nrchildren != 2) {
+		return;
+	}
+
+	for(i=0;i<TIMER_FIELDS;i++) {
+		fields[i] = -1;
+	}
+	events_timer_fields(obj->tree->child[0], &device, fields, &nr);
+
+	if(nr > 0) {
+		obj->timer = event_timer_add(obj, device, fields);
+		logprintf(LOG_DEBUG, "rule #%d %s is scheduled on the clock of %s", obj->nr, obj->name, device);
+	}
+	if(device != NULL) {
+		FREE(device);
+	}
+}
+
+/*
+ * Advance the timers of the datetime devices in an update.
+ * Returns 1 when the update only contained clock ticks.
+ */
+static int events_timer_tick(struct JsonNode *jdevices) {
+	struct JsonNode *jchilds = json_first_child(jdevices);
+	struct devices_settings_t *setting = NULL;
+	struct devices_t *dev = NULL;
+	int fields[TIMER_FIELDS];
+	int i = 0, ticks = 0, others = 0;
+
+	while(jchilds) {
+		if(jchilds->tag == JSON_STRING) {
+			if(event_timer_clock(jchilds->string_) == 1 &&
+			   devices_get(jchilds->string_, &dev) == 0) {
+				for(i=0;i<TIMER_FIELDS;i++) {
+					fields[i] = 0;
+					if((setting = devices_get_setting(dev, event_timer_name(i))) != NULL &&
+					   setting->values != NULL && setting->values->type == JSON_NUMBER) {
+						fields[i] = (int)setting->values->number_;
+					}
+				}
+				event_timer_tick(jchilds->string_, fields);
+				ticks++;
+			} else {
+				others++;
+			}
+		}
+		jchilds = jchilds->next;
+	}
+	return (ticks > 0 && others == 0);
+}
+
 int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned short validate) {
 	struct varcont_t v_res;
 
@@ -1926,21 +2357,27 @@ int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned short
 		lexer->pos = 0;
 		lexer->len = strlen(lexer->text);
 		lexer->current_char = &lexer->text[lexer->pos++];
-
-		if(lexer_next_token(lexer) == -1) {
-			FREE(lexer->text);
-			FREE(lexer);
-			return -1;
-		}
-		if(lexer_parse(lexer, &obj->tree) == -1) {
+		lexer->pool = events_pool_init();
+
+		obj->tree = NULL;
+		if(lexer_next_token(lexer) < 0 || lexer_parse(lexer, &obj->tree) < 0 || obj->tree == NULL) {
+			events_pool_free(lexer->pool);
+			obj->tree = NULL;
+			if(lexer->stack.size > 0) {
+				FREE(lexer->stack.list);
+			}
 			FREE(lexer->text);
 			FREE(lexer);
 			return -1;
 		}
+		events_fold(obj->tree, obj);
 		if(pilight.debuglevel >= 1) {
 			logprintf(LOG_DEBUG, "%s", lexer->text);
 			print_ast(obj->tree);
 		}
+		if(lexer->stack.size > 0) {
+			FREE(lexer->stack.list);
+		}
 		FREE(lexer->text);
 		FREE(lexer);
 	}
@@ -1948,126 +2385,297 @@ int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned short
 	if(interpret(obj->tree, 0, obj, validate, &v_res) == -1) {
 		return -1;
 	}
+	if(validate == 1 && obj->timer == NULL) {
+		events_timer_find(obj);
+	}
 	if(v_res.type_ == JSON_BOOL) {
 		return v_res.bool_;
 	}
 	return -1;
 }
 
-void *events_loop(void *param) {
-	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+static int events_match_cmp(const void *a, const void *b) {
+	return (*(struct rules_t **)a)->nr - (*(struct rules_t **)b)->nr;
+}
+
+/*
+ * Whether a rule reads one of the settings of the device that
+ * changed. Without the changed settings every rule reading the
+ * device has to run.
+ */
+static int events_match_values(struct rules_t *obj, char *device, struct JsonNode *jchanged) {
+	struct rules_values_t *node = NULL;
+	struct JsonNode *jchild = NULL;
+	int found = 0;
 
-	if(eventslock_init == 0) {
-		pthread_mutexattr_init(&events_attr);
-		pthread_mutexattr_settype(&events_attr, PTHREAD_MUTEX_RECURSIVE);
-		pthread_mutex_init(&events_lock, &events_attr);
-		pthread_cond_init(&events_signal, NULL);
-		eventslock_init = 1;
+	if(jchanged == NULL || jchanged->tag != JSON_ARRAY) {
+		return 1;
+	}
+	for(node=obj->values;node!=NULL;node=node->next) {
+		if(strcmp(node->device, device) != 0) {
+			continue;
+		}
+		found = 1;
+		if(node->name == NULL) {
+			return 1;
+		}
+		jchild = json_first_child(jchanged);
+		while(jchild) {
+			if(jchild->tag == JSON_STRING && strcmp(jchild->string_, node->name) == 0) {
+				return 1;
+			}
+			jchild = jchild->next;
+		}
 	}
+	/* Not read by a condition, so we don't know what it reads */
+	return (found == 0);
+}
 
-	// struct devices_t *dev = NULL;
-	struct JsonNode *jdevices = NULL, *jchilds = NULL;
-	struct rules_t *tmp_rules = NULL;
-	char *str = NULL, *origin = NULL, *protocol = NULL;
-	unsigned short match = 0;
-	unsigned int i = 0;
+static void events_match_rules(char *name, struct JsonNode *jchanged) {
+	struct rules_list_t *tmp = rules_index_get(name);
 
-	pthread_mutex_lock(&events_lock);
-	while(loop) {
-		if(eventsqueue_number > 0) {
-			pthread_mutex_lock(&events_lock);
+	while(tmp) {
+		if(tmp->rule->matched == 0 && events_match_values(tmp->rule, name, jchanged) == 1) {
+			if(nrmatches == matchsize) {
+				matchsize += 16;
+				if((matches = REALLOC(matches, sizeof(struct rules_t *)*matchsize)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+				if((rounds = REALLOC(rounds, sizeof(int)*matchsize)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+				if((batch = REALLOC(batch, sizeof(struct rules_t *)*matchsize)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+			}
+			tmp->rule->matched = 1;
+			matches[nrmatches++] = tmp->rule;
+		}
+		tmp = tmp->next;
+	}
+}
 
-			logprintf(LOG_STACK, "%s::unlocked", __FUNCTION__);
+static void events_metrics(void) {
+	stage_collect(&eventsstage);
+}
 
-			running = 1;
+static int events_shares(char **a, int nra, char **b, int nrb) {
+	int i = 0, x = 0;
 
-			jdevices = json_find_member(eventsqueue->jconfig, "devices");
-			tmp_rules = rules_get();
-			while(tmp_rules) {
-				if(tmp_rules->active == 1) {
-					if(eventsqueue->jconfig != NULL) {
-						char *conf = json_stringify(eventsqueue->jconfig, NULL);
-						tmp_rules->jtrigger = json_decode(conf);
-						json_free(conf);
-					}
+	for(i=0;i<nra;i++) {
+		for(x=0;x<nrb;x++) {
+			if(strcmp(a[i], b[x]) == 0) {
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
 
-					match = 0;
-					if((str = MALLOC(strlen(tmp_rules->rule)+1)) == NULL) {
-						fprintf(stderr, "out of memory\n");
-						exit(EXIT_FAILURE);
-					}
-					strcpy(str, tmp_rules->rule);
-					if(json_find_string(eventsqueue->jconfig, "origin", &origin) == 0 &&
-					   json_find_string(eventsqueue->jconfig, "protocol", &protocol) == 0) {
-						if(strcmp(origin, "sender") == 0 || strcmp(origin, "receiver") == 0) {
-							for(i=0;i<tmp_rules->nrdevices;i++) {
-								if(strcmp(tmp_rules->devices[i], protocol) == 0) {
-									match = 1;
-									break;
-								}
-							}
-						}
-					}
-					/* Only run those events that affect the updates devices */
-					if(jdevices != NULL && match == 0) {
-						jchilds = json_first_child(jdevices);
-						while(jchilds) {
-							for(i=0;i<tmp_rules->nrdevices;i++) {
-								if(jchilds->tag == JSON_STRING &&
-								   strcmp(jchilds->string_, tmp_rules->devices[i]) == 0) {
-									// if(devices_get(jchilds->string_, &dev) == 0) {
-										// if(dev->lastrule == tmp_rules->nr &&
-											 // tmp_rules->nr == dev->prevrule &&
-											 // dev->lastrule == dev->prevrule) {
-											// logprintf(LOG_ERR, "skipped rule #%d because of an infinite loop triggered by device %s", tmp_rules->nr, jchilds->string_);
-										// } else {
-											// match = 1;
-										// }
-									// } else {
-										match = 1;
-									// }
-									break;
-								}
-							}
-							jchilds = jchilds->next;
-						}
-					}
-					if(match == 1 && tmp_rules->status == 0) {
+/*
+ * Two rules conflict when one controls a device the other one
+ * reads or controls as well.
+ */
+static int events_conflict(struct rules_t *a, struct rules_t *b) {
+	return events_shares(a->targets, a->nrtargets, b->devices, b->nrdevices) ||
+		events_shares(a->targets, a->nrtargets, b->targets, b->nrtargets) ||
+		events_shares(b->targets, b->nrtargets, a->devices, a->nrdevices);
+}
+
+static void events_rule_run(struct rules_t *tmp_rules) {
 #ifndef WIN32
-						clock_gettime(CLOCK_MONOTONIC, &tmp_rules->timestamp.first);
+	clock_gettime(CLOCK_MONOTONIC, &tmp_rules->timestamp.first);
 #endif
-						if(event_parse_rule(str, tmp_rules, 0, 0) == 0) {
-							if(tmp_rules->status == 1) {
-								logprintf(LOG_INFO, "executed rule: %s", tmp_rules->name);
-							}
-						}
+	if(event_parse_rule(tmp_rules->rule, tmp_rules, 0, 0) == 0) {
+		if(tmp_rules->status == 1) {
+			logprintf(LOG_INFO, "executed rule: %s", tmp_rules->name);
+		}
+	}
 #ifndef WIN32
-						clock_gettime(CLOCK_MONOTONIC, &tmp_rules->timestamp.second);
-						logprintf(LOG_DEBUG, "rule #%d %s was parsed in %.6f seconds", tmp_rules->nr, tmp_rules->name,
-							((double)tmp_rules->timestamp.second.tv_sec + 1.0e-9*tmp_rules->timestamp.second.tv_nsec) -
-							((double)tmp_rules->timestamp.first.tv_sec + 1.0e-9*tmp_rules->timestamp.first.tv_nsec));
+	clock_gettime(CLOCK_MONOTONIC, &tmp_rules->timestamp.second);
+	metrics_observe(tmp_rules->metric,
+		(uint64_t)(tmp_rules->timestamp.second.tv_sec-tmp_rules->timestamp.first.tv_sec)*1000000000 +
+		(uint64_t)tmp_rules->timestamp.second.tv_nsec - (uint64_t)tmp_rules->timestamp.first.tv_nsec);
+	logprintf(LOG_DEBUG, "rule #%d %s was parsed in %.6f seconds", tmp_rules->nr, tmp_rules->name,
+		((double)tmp_rules->timestamp.second.tv_sec + 1.0e-9*tmp_rules->timestamp.second.tv_nsec) -
+		((double)tmp_rules->timestamp.first.tv_sec + 1.0e-9*tmp_rules->timestamp.first.tv_nsec));
 #endif
-						tmp_rules->status = 0;
-					}
-					FREE(str);
-					if(tmp_rules->jtrigger != NULL) {
-						json_delete(tmp_rules->jtrigger);
-						tmp_rules->jtrigger = NULL;
+	tmp_rules->status = 0;
+}
+
+/* Call with the lock held, returns with it held */
+static void events_work(void) {
+	struct rules_t *rule = NULL;
+
+	while(workers.next < workers.nrbatch) {
+		rule = workers.batch[workers.next++];
+		pthread_mutex_unlock(&workers.lock);
+		events_rule_run(rule);
+		pthread_mutex_lock(&workers.lock);
+		if(--workers.pending == 0) {
+			pthread_cond_signal(&workers.done);
+		}
+	}
+}
+
+static void *events_worker(void *param) {
+	pthread_mutex_lock(&workers.lock);
+	while(workers.stop == 0) {
+		if(workers.next < workers.nrbatch) {
+			events_work();
+		} else {
+			pthread_cond_wait(&workers.work, &workers.lock);
+		}
+	}
+	pthread_mutex_unlock(&workers.lock);
+	return NULL;
+}
+
+/*
+ * The events loop takes its share of a round as well, and
+ * returns when all of its rules have been run.
+ */
+static void events_round(struct rules_t **list, int n) {
+	if(n == 1 || workers.nrworkers == 0) {
+		int i = 0;
+		for(i=0;i<n;i++) {
+			events_rule_run(list[i]);
+		}
+		return;
+	}
+
+	pthread_mutex_lock(&workers.lock);
+	workers.batch = list;
+	workers.nrbatch = n;
+	workers.next = 0;
+	workers.pending = n;
+	pthread_cond_broadcast(&workers.work);
+	events_work();
+	while(workers.pending > 0) {
+		pthread_cond_wait(&workers.done, &workers.lock);
+	}
+	workers.batch = NULL;
+	workers.nrbatch = 0;
+	workers.next = 0;
+	pthread_mutex_unlock(&workers.lock);
+}
+
+void *events_loop(void *param) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	if(eventsstage_init == 0) {
+		stage_init(&eventsstage, "event", EVENTSQUEUE_SIZE, sizeof(struct eventsqueue_t));
+		eventsstage_init = 1;
+
+		metrics_collector(events_metrics);
+
+		for(workers.nrworkers=0;workers.nrworkers<EVENTS_WORKERS;workers.nrworkers++) {
+			threads_create(&workers.pth[workers.nrworkers], NULL, events_worker, NULL);
+		}
+	}
+
+	struct eventsqueue_t *eventsqueue = NULL;
+	struct JsonNode *jdevices = NULL, *jchilds = NULL, *jchanged = NULL;
+	struct rules_t *tmp_rules = NULL;
+	char *origin = NULL, *protocol = NULL;
+	int i = 0, x = 0, n = 0, nr = 0, step = 0, last = 0, tick = 0;
+
+	while(loop) {
+		running = 0;
+		if((eventsqueue = stage_take(&eventsstage)) == NULL) {
+			break;
+		}
+		logprintf(LOG_STACK, "%s::unlocked", __FUNCTION__);
+
+		running = 1;
+
+		/*
+		 * Only run those events that affect the updated
+		 * devices or the received protocol. Of the updated
+		 * devices only the settings that changed count.
+		 */
+		nrmatches = 0;
+		tick = 0;
+		if(json_find_string(eventsqueue->jconfig, "origin", &origin) == 0 &&
+		   json_find_string(eventsqueue->jconfig, "protocol", &protocol) == 0) {
+			if(strcmp(origin, "sender") == 0 || strcmp(origin, "receiver") == 0) {
+				events_match_rules(protocol, NULL);
+			}
+		}
+		if((jdevices = json_find_member(eventsqueue->jconfig, "devices")) != NULL) {
+			tick = events_timer_tick(jdevices);
+			jchanged = json_find_member(eventsqueue->jconfig, "changed");
+			jchilds = json_first_child(jdevices);
+			while(jchilds) {
+				if(jchilds->tag == JSON_STRING) {
+					events_match_rules(jchilds->string_, jchanged);
+				}
+				jchilds = jchilds->next;
+			}
+		}
+
+		/* Keep the configuration order of the rules */
+		if(nrmatches > 1) {
+			qsort(matches, (size_t)nrmatches, sizeof(struct rules_t *), events_match_cmp);
+		}
+
+		/* Drop the rules that don't run and give the others their round */
+		for(i=0,n=0,last=0;i<nrmatches;i++) {
+			tmp_rules = matches[i];
+			tmp_rules->matched = 0;
+
+			/* A clock tick only runs the rules whose moment has come */
+			if(tick == 1 && tmp_rules->timer != NULL && event_timer_due(tmp_rules->timer) == 0) {
+				continue;
+			}
+
+			/*
+			 * The rule tree was already compiled when the
+			 * rules were parsed, so we only need to walk it.
+			 */
+			if(tmp_rules->active == 1 && tmp_rules->tree != NULL && tmp_rules->status == 0) {
+				if(eventsqueue->jconfig != NULL) {
+					tmp_rules->jtrigger = json_ref(eventsqueue->jconfig);
+				}
+				if(tmp_rules->metric == NULL) {
+					tmp_rules->metric = metrics_get(METRIC_HISTOGRAM, "pilight_rule_evaluation_seconds", "Time spent evaluating a rule", "rule", tmp_rules->name);
+				}
+				rounds[n] = 0;
+				for(x=0;x<n;x++) {
+					if(rounds[x] >= rounds[n] && events_conflict(matches[x], tmp_rules) == 1) {
+						rounds[n] = rounds[x]+1;
 					}
 				}
-				tmp_rules = tmp_rules->next;
+				if(rounds[n] > last) {
+					last = rounds[n];
+				}
+				matches[n++] = tmp_rules;
+			}
+		}
+
+		for(step=0;step<=last && n > 0;step++) {
+			for(i=0,nr=0;i<n;i++) {
+				if(rounds[i] == step) {
+					batch[nr++] = matches[i];
+				}
+			}
+			events_round(batch, nr);
+		}
+
+		/* The references are only touched by this thread */
+		for(i=0;i<n;i++) {
+			if(matches[i]->jtrigger != NULL) {
+				json_delete(matches[i]->jtrigger);
+				matches[i]->jtrigger = NULL;
 			}
-			struct eventsqueue_t *tmp = eventsqueue;
-			json_delete(tmp->jconfig);
-			eventsqueue = eventsqueue->next;
-			FREE(tmp);
-			eventsqueue_number--;
-			pthread_mutex_unlock(&events_lock);
-		} else {
-			running = 0;
-			pthread_cond_wait(&events_signal, &events_lock);
 		}
+		nrmatches = 0;
+		trace_stage(&eventsqueue->trace, TRACE_EVENTS);
+
+		json_delete(eventsqueue->jconfig);
+		stage_release(&eventsstage, eventsqueue);
 	}
+	running = 0;
 	return (void *)NULL;
 }
 
@@ -2079,33 +2687,30 @@ int events_running(void) {
 static void events_queue(char *message) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
-	if(eventslock_init == 1) {
-		pthread_mutex_lock(&events_lock);
-	}
-	if(eventsqueue_number < 1024) {
-		struct eventsqueue_t *enode = MALLOC(sizeof(eventsqueue_t));
-		if(enode == NULL) {
-			fprintf(stderr, "out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-		enode->jconfig = json_decode(message);
-
-		if(eventsqueue_number == 0) {
-			eventsqueue = enode;
-			eventsqueue_head = enode;
-		} else {
-			eventsqueue_head->next = enode;
-			eventsqueue_head = enode;
-		}
+	struct eventsqueue_t *enode = NULL;
 
-		eventsqueue_number++;
+	if(eventsstage_init == 0) {
+		return;
+	}
+	/* The rules may lag a little, before a message is lost */
+	if((enode = stage_claim(&eventsstage, EVENTSQUEUE_WAIT)) != NULL) {
+		enode->jconfig = json_decode_arena(message);
+		trace_find(message, &enode->trace);
+		stage_publish(&eventsstage, enode);
 	} else {
 		logprintf(LOG_ERR, "event queue full");
 	}
-	if(eventslock_init == 1) {
-		pthread_mutex_unlock(&events_lock);
-		pthread_cond_signal(&events_signal);
+}
+
+/*
+ * The datetime ticks are not sent over the events client
+ * socket but handed to us directly by the broadcaster.
+ */
+void events_tick(char *message) {
+	if(eventsstage_init == 0) {
+		return;
 	}
+	events_queue(message);
 }
 
 void *events_clientize(void *param) {
@@ -2150,6 +2755,7 @@ void *events_clientize(void *param) {
 		json_append_member(jclient, "action", json_mkstring("identify"));
 		json_append_member(joptions, "config", json_mknumber(1, 0));
 		json_append_member(joptions, "receiver", json_mknumber(1, 0));
+		json_append_member(joptions, "clock", json_mknumber(0, 0));
 		json_append_member(jclient, "options", joptions);
 		json_append_member(jclient, "media", json_mkstring("all"));
 		out = json_stringify(jclient, NULL);
@@ -16,6 +16,7 @@ void events_tree_gc(struct tree_t *tree);
 void event_cache_device(struct rules_t *obj, char *device);
 int event_parse_rule(char *rule, struct rules_t *obj, int depth, unsigned short validate);
 void *events_clientize(void *param);
+void events_tick(char *message);
 int events_gc(void);
 void event_init(void);
 void *events_loop(void *param);
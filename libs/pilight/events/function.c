@@ -34,6 +34,115 @@
 
 static int init = 0;
 
+/*
+ * Native implementations of the stock functions, used under the
+ * same rules as the native operators: only while the matching
+ * lua module is loaded with the version listed here, and only
+ * for arguments the native function handles itself.
+ */
+typedef struct function_native_t {
+	char *name;
+	char *version;
+	int (*run)(struct event_function_args_t *args, struct varcont_t *v);
+	int active;
+} function_native_t;
+
+/*
+ * Numbers reach the lua modules as "%.*f" strings and come back
+ * through lua_tostring, do the same rounding here.
+ */
+static int function_native_numbers(struct event_function_args_t *args, double *a, double *b) {
+	char tmp[64];
+
+	if(args == NULL || args->next == NULL || args->next->next != NULL ||
+		args->var.type_ != JSON_NUMBER || args->next->var.type_ != JSON_NUMBER) {
+		return 0;
+	}
+
+	if(snprintf(tmp, sizeof(tmp), "%.*f", args->var.decimals_, args->var.number_) >= (int)sizeof(tmp)) {
+		return 0;
+	}
+	*a = atof(tmp);
+	if(snprintf(tmp, sizeof(tmp), "%.*f", args->next->var.decimals_, args->next->var.number_) >= (int)sizeof(tmp)) {
+		return 0;
+	}
+	*b = atof(tmp);
+
+	return 1;
+}
+
+static void function_native_number(struct varcont_t *v, double n) {
+	char tmp[32];
+
+	snprintf(tmp, sizeof(tmp), "%.14g", n);
+	v->number_ = atof(tmp);
+	v->decimals_ = nrDecimals(tmp);
+	v->type_ = JSON_NUMBER;
+}
+
+static int function_native_max(struct event_function_args_t *args, struct varcont_t *v) {
+	double a = 0, b = 0;
+
+	if(function_native_numbers(args, &a, &b) == 0) {
+		return 0;
+	}
+	function_native_number(v, (a > b) ? a : b);
+	return 1;
+}
+
+static int function_native_min(struct event_function_args_t *args, struct varcont_t *v) {
+	double a = 0, b = 0;
+
+	if(function_native_numbers(args, &a, &b) == 0) {
+		return 0;
+	}
+	function_native_number(v, (a < b) ? a : b);
+	return 1;
+}
+
+static struct function_native_t natives[] = {
+	{ "MAX", "2.1", function_native_max, 0 },
+	{ "MIN", "2.1", function_native_min, 0 }
+};
+
+/* Cleared to measure the lua modules on their own */
+static int natives_enabled = 1;
+
+static void function_native_register(void) {
+	struct plua_module_t *tmp = NULL;
+	int i = 0, n = sizeof(natives)/sizeof(natives[0]);
+
+	for(i=0;i<n;i++) {
+		natives[i].active = 0;
+		tmp = plua_get_modules();
+		while(tmp) {
+			if(tmp->type == FUNCTION && strcmp(tmp->name, natives[i].name) == 0) {
+				if(strcmp(tmp->version, natives[i].version) == 0) {
+					natives[i].active = 1;
+				} else {
+					logprintf(LOG_DEBUG, "function %s v%s overrides the native implementation", tmp->name, tmp->version);
+				}
+				break;
+			}
+			tmp = tmp->next;
+		}
+	}
+}
+
+static struct function_native_t *function_native_get(char *module) {
+	int i = 0, n = sizeof(natives)/sizeof(natives[0]);
+
+	if(natives_enabled == 0) {
+		return NULL;
+	}
+	for(i=0;i<n;i++) {
+		if(natives[i].active == 1 && strcmp(natives[i].name, module) == 0) {
+			return &natives[i];
+		}
+	}
+	return NULL;
+}
+
 void event_function_init(void) {
 	if(init == 1) {
 		return;
@@ -74,6 +183,8 @@ void event_function_init(void) {
 	if(functions_root != (void *)FUNCTION_ROOT) {
 		FREE(functions_root);
 	}
+
+	function_native_register();
 }
 
 static int plua_function_module_run(struct lua_State *L, char *file, struct event_function_args_t *args, struct varcont_t *v) {
@@ -159,7 +270,18 @@ static int plua_function_module_run(struct lua_State *L, char *file, struct even
 	return 1;
 }
 
+void event_function_native_enable(int enable) {
+	natives_enabled = enable;
+}
+
+int event_function_native(char *module) {
+	return (function_native_get(module) != NULL);
+}
+
 int event_function_exists(char *module) {
+	if(function_native_get(module) != NULL) {
+		return 0;
+	}
 	return plua_module_exists(module, FUNCTION);
 }
 
@@ -215,15 +337,21 @@ void event_function_free_argument(struct event_function_args_t *args) {
 }
 
 int event_function_callback(char *module, struct event_function_args_t *args, struct varcont_t *v) {
-	struct lua_state_t *state = plua_get_free_state();
+	struct function_native_t *native = function_native_get(module);
+	struct lua_state_t *state = NULL;
 	struct lua_State *L = NULL;
 
-	if(state == NULL) {
+	if(native != NULL && native->run(args, v) == 1) {
+		event_function_free_argument(args);
+		return 0;
+	}
+
+	if((state = plua_get_free_state()) == NULL) {
 		return -1;
 	}
 	if((L = state->L) == NULL) {
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 
@@ -237,7 +365,7 @@ int event_function_callback(char *module, struct event_function_args_t *args, st
 		event_function_free_argument(args);
 		lua_remove(L, -1);
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 	if(lua_istable(L, -1) != 0) {
@@ -255,25 +383,30 @@ int event_function_callback(char *module, struct event_function_args_t *args, st
 			if(plua_function_module_run(L, file, args, v) == 0) {
 				lua_pop(L, -1);
 				assert(lua_gettop(L) == 0);
-				uv_mutex_unlock(&state->lock);
+				plua_release_state(state);
 				return -1;
 			}
 		} else {
 			event_function_free_argument(args);
 			assert(lua_gettop(L) == 0);
-			uv_mutex_unlock(&state->lock);
+			plua_release_state(state);
 			return -1;
 		}
 	}
 	lua_pop(L, -1);
 
 	assert(lua_gettop(L) == 0);
-	uv_mutex_unlock(&state->lock);
+	plua_release_state(state);
 
 	return 0;
 }
 
 int event_function_gc(void) {
+	int i = 0, n = sizeof(natives)/sizeof(natives[0]);
+
+	for(i=0;i<n;i++) {
+		natives[i].active = 0;
+	}
 	init = 0;
 	logprintf(LOG_DEBUG, "garbage collected event function library");
 	return 0;
@@ -23,6 +23,8 @@ int event_function_callback(char *, struct event_function_args_t *, struct varco
 struct event_function_args_t *event_function_add_argument(struct varcont_t *, struct event_function_args_t *);
 void event_function_free_argument(struct event_function_args_t *);
 int event_function_exists(char *);
+int event_function_native(char *);
+void event_function_native_enable(int);
 int event_function_gc(void);
 
 #endif
@@ -16,6 +16,7 @@
 #include <time.h>
 #include <limits.h>
 #include <assert.h>
+#include <math.h>
 
 #ifndef _WIN32
 	#include <libgen.h>
@@ -34,6 +35,230 @@
 
 static int init = 0;
 
+/*
+ * Native implementations of the stock operators. They are
+ * only used as long as the matching lua module is loaded with
+ * the version listed here, so a custom module with the same
+ * name but a different version still takes over. A native
+ * operator returns 0 for operand types it does not handle
+ * itself, in which case the lua module is called instead.
+ */
+typedef struct operator_native_t {
+	char *name;
+	char *version;
+	int (*run)(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v);
+	int active;
+} operator_native_t;
+
+/*
+ * Mirror the lua number to string conversion done by
+ * plua_operator_module_run so both paths return the same
+ * number and decimals.
+ */
+static void operator_native_number(struct varcont_t *v, double n) {
+	char tmp[32];
+
+	snprintf(tmp, sizeof(tmp), "%.14g", n);
+	v->number_ = atof(tmp);
+	v->decimals_ = nrDecimals(tmp);
+	v->type_ = JSON_NUMBER;
+}
+
+static void operator_native_bool(struct varcont_t *v, int b) {
+	v->bool_ = (b != 0);
+	v->type_ = JSON_BOOL;
+}
+
+static int operator_native_equal(struct varcont_t *a, struct varcont_t *b) {
+	if(a->type_ != b->type_) {
+		return 0;
+	}
+	switch(a->type_) {
+		case JSON_NUMBER:
+			return (a->number_ == b->number_);
+		case JSON_STRING:
+			return (strcmp(a->string_, b->string_) == 0);
+		case JSON_BOOL:
+			return (a->bool_ == b->bool_);
+	}
+	return 0;
+}
+
+static int operator_native_eq(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	operator_native_bool(v, operator_native_equal(a, b));
+	return 1;
+}
+
+static int operator_native_ne(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	operator_native_bool(v, !operator_native_equal(a, b));
+	return 1;
+}
+
+static int operator_native_lt(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	operator_native_bool(v, a->number_ < b->number_);
+	return 1;
+}
+
+static int operator_native_le(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	operator_native_bool(v, a->number_ <= b->number_);
+	return 1;
+}
+
+static int operator_native_gt(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	operator_native_bool(v, a->number_ > b->number_);
+	return 1;
+}
+
+static int operator_native_ge(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	operator_native_bool(v, a->number_ >= b->number_);
+	return 1;
+}
+
+static int operator_native_and(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_BOOL || b->type_ != JSON_BOOL) {
+		return 0;
+	}
+	operator_native_bool(v, a->bool_ && b->bool_);
+	return 1;
+}
+
+static int operator_native_or(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_BOOL || b->type_ != JSON_BOOL) {
+		return 0;
+	}
+	operator_native_bool(v, a->bool_ || b->bool_);
+	return 1;
+}
+
+static int operator_native_plus(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	operator_native_number(v, a->number_ + b->number_);
+	return 1;
+}
+
+static int operator_native_minus(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	operator_native_number(v, a->number_ - b->number_);
+	return 1;
+}
+
+static int operator_native_multiply(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	operator_native_number(v, a->number_ * b->number_);
+	return 1;
+}
+
+static int operator_native_divide(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	if(a->number_ == 0 || b->number_ == 0) {
+		operator_native_number(v, 0);
+	} else {
+		operator_native_number(v, a->number_ / b->number_);
+	}
+	return 1;
+}
+
+static int operator_native_intdivide(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	if(a->number_ == 0 || b->number_ == 0) {
+		operator_native_number(v, 0);
+	} else if(a->number_ < 0) {
+		operator_native_number(v, -floor(-a->number_ / b->number_));
+	} else {
+		operator_native_number(v, floor(a->number_ / b->number_));
+	}
+	return 1;
+}
+
+static int operator_native_modulus(struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
+	if(a->type_ != JSON_NUMBER || b->type_ != JSON_NUMBER) {
+		return 0;
+	}
+	if(a->number_ == 0 || b->number_ == 0) {
+		operator_native_number(v, 0);
+	} else {
+		operator_native_number(v, a->number_ - b->number_ * floor(a->number_ / b->number_));
+	}
+	return 1;
+}
+
+static struct operator_native_t natives[] = {
+	{ "==", "1.0", operator_native_eq, 0 },
+	{ "!=", "1.0", operator_native_ne, 0 },
+	{ "<", "1.0", operator_native_lt, 0 },
+	{ "<=", "1.0", operator_native_le, 0 },
+	{ ">", "1.0", operator_native_gt, 0 },
+	{ ">=", "1.0", operator_native_ge, 0 },
+	{ "AND", "1.0", operator_native_and, 0 },
+	{ "OR", "1.0", operator_native_or, 0 },
+	{ "+", "1.0", operator_native_plus, 0 },
+	{ "-", "1.0", operator_native_minus, 0 },
+	{ "*", "1.0", operator_native_multiply, 0 },
+	{ "/", "1.0", operator_native_divide, 0 },
+	{ "\\", "1.0", operator_native_intdivide, 0 },
+	{ "%", "1.0", operator_native_modulus, 0 }
+};
+
+/* Cleared to measure the lua modules on their own */
+static int natives_enabled = 1;
+
+static void operator_native_register(void) {
+	struct plua_module_t *tmp = NULL;
+	int i = 0, n = sizeof(natives)/sizeof(natives[0]);
+
+	for(i=0;i<n;i++) {
+		natives[i].active = 0;
+		tmp = plua_get_modules();
+		while(tmp) {
+			if(tmp->type == OPERATOR && strcmp(tmp->name, natives[i].name) == 0) {
+				if(strcmp(tmp->version, natives[i].version) == 0) {
+					natives[i].active = 1;
+				} else {
+					logprintf(LOG_DEBUG, "operator %s v%s overrides the native implementation", tmp->name, tmp->version);
+				}
+				break;
+			}
+			tmp = tmp->next;
+		}
+	}
+}
+
+static struct operator_native_t *operator_native_get(char *module) {
+	int i = 0, n = sizeof(natives)/sizeof(natives[0]);
+
+	if(natives_enabled == 0) {
+		return NULL;
+	}
+	for(i=0;i<n;i++) {
+		if(natives[i].active == 1 && strcmp(natives[i].name, module) == 0) {
+			return &natives[i];
+		}
+	}
+	return NULL;
+}
+
 void event_operator_init(void) {
 	if(init == 1) {
 		return;
@@ -74,6 +299,8 @@ void event_operator_init(void) {
 	if(operator_root != (void *)OPERATOR_ROOT) {
 		FREE(operator_root);
 	}
+
+	operator_native_register();
 }
 
 static int plua_operator_precedence_run(struct lua_State *L, char *file, int *ret) {
@@ -222,7 +449,18 @@ static int plua_operator_module_run(struct lua_State *L, char *file, struct varc
 	return 1;
 }
 
+void event_operator_native_enable(int enable) {
+	natives_enabled = enable;
+}
+
+int event_operator_native(char *module) {
+	return (operator_native_get(module) != NULL);
+}
+
 int event_operator_exists(char *module) {
+	if(operator_native_get(module) != NULL) {
+		return 0;
+	}
 	return plua_module_exists(module, OPERATOR);
 }
 
@@ -236,7 +474,7 @@ int event_operator_precedence(char *module, int *ret) {
 
 	if((L = state->L) == NULL) {
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 
@@ -248,7 +486,7 @@ int event_operator_precedence(char *module, int *ret) {
 	lua_getglobal(L, name);
 	if(lua_isnil(L, -1) != 0) {
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 	if(lua_istable(L, -1) != 0) {
@@ -265,14 +503,14 @@ int event_operator_precedence(char *module, int *ret) {
 		if(plua_operator_precedence_run(L, file, ret) == 0) {
 			lua_pop(L, -1);
 			assert(lua_gettop(L) == 0);
-			uv_mutex_unlock(&state->lock);
+			plua_release_state(state);
 			return -1;
 		}
 	}
 	lua_pop(L, -1);
 
 	assert(lua_gettop(L) == 0);
-	uv_mutex_unlock(&state->lock);
+	plua_release_state(state);
 
 	return 0;
 }
@@ -287,7 +525,7 @@ int event_operator_associativity(char *module, int *ret) {
 
 	if((L = state->L) == NULL) {
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 
@@ -299,7 +537,7 @@ int event_operator_associativity(char *module, int *ret) {
 	lua_getglobal(L, name);
 	if(lua_isnil(L, -1) != 0) {
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 	if(lua_istable(L, -1) != 0) {
@@ -316,29 +554,34 @@ int event_operator_associativity(char *module, int *ret) {
 		if(plua_operator_associativity_run(L, file, ret) == 0) {
 			lua_pop(L, -1);
 			assert(lua_gettop(L) == 0);
-			uv_mutex_unlock(&state->lock);
+			plua_release_state(state);
 			return -1;
 		}
 	}
 	lua_pop(L, -1);
 
 	assert(lua_gettop(L) == 0);
-	uv_mutex_unlock(&state->lock);
+	plua_release_state(state);
 
 	return 0;
 }
 
 int event_operator_callback(char *module, struct varcont_t *a, struct varcont_t *b, struct varcont_t *v) {
-	struct lua_state_t *state = plua_get_free_state();
+	struct operator_native_t *native = operator_native_get(module);
+	struct lua_state_t *state = NULL;
 	struct lua_State *L = NULL;
 
-	if(state == NULL) {
+	if(native != NULL && native->run(a, b, v) == 1) {
+		return 0;
+	}
+
+	if((state = plua_get_free_state()) == NULL) {
 		return -1;
 	}
 
 	if((L = state->L) == NULL) {
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 
@@ -350,7 +593,7 @@ int event_operator_callback(char *module, struct varcont_t *a, struct varcont_t
 	lua_getglobal(L, name);
 	if(lua_isnil(L, -1) != 0) {
 		assert(lua_gettop(L) == 0);
-		uv_mutex_unlock(&state->lock);
+		plua_release_state(state);
 		return -1;
 	}
 	if(lua_istable(L, -1) != 0) {
@@ -367,19 +610,24 @@ int event_operator_callback(char *module, struct varcont_t *a, struct varcont_t
 		if(plua_operator_module_run(L, file, a, b, v) == 0) {
 			lua_pop(L, -1);
 			assert(lua_gettop(L) == 0);
-			uv_mutex_unlock(&state->lock);
+			plua_release_state(state);
 			return -1;
 		}
 	}
 	lua_pop(L, -1);
 
 	assert(lua_gettop(L) == 0);
-	uv_mutex_unlock(&state->lock);
+	plua_release_state(state);
 
 	return 0;
 }
 
 int event_operator_gc(void) {
+	int i = 0, n = sizeof(natives)/sizeof(natives[0]);
+
+	for(i=0;i<n;i++) {
+		natives[i].active = 0;
+	}
 	init = 0;
 	logprintf(LOG_DEBUG, "garbage collected event operator library");
 	return 0;
@@ -18,6 +18,8 @@ int event_operator_callback(char *, struct varcont_t *, struct varcont_t *, stru
 int event_operator_associativity(char *, int *);
 int event_operator_precedence(char *, int *);
 int event_operator_exists(char *);
+int event_operator_native(char *);
+void event_operator_native_enable(int);
 int event_operator_gc(void);
 
 #endif
@@ -0,0 +1,109 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Damping of rules that keep firing, mostly two rules that
+ * switch each others devices. Every rule and every device a
+ * rule controls keeps a rate of its action runs that decays
+ * by e every minute, so it reads as runs per minute. Once the
+ * rate passes its limit the actions are held back for the
+ * damping time, which doubles each time the rule trips again
+ * while it's still running hot.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../../libuv/uv.h"
+#include "../core/log.h"
+
+#include "storm.h"
+
+/* The time constant of the rates, in seconds */
+#define STORM_PERIOD	60
+/* The damping time doesn't grow beyond 2^STORM_TRIPS times the first */
+#define STORM_TRIPS		7
+
+static int storm_limit = 0;
+static int storm_edge = 0;
+static int storm_damping = 30;
+
+/*
+ * A limit of 0 disables that check. The limits are in action
+ * runs per minute, the damping time in seconds.
+ */
+void event_storm_init(int limit, int edge, int damping) {
+	storm_limit = limit;
+	storm_edge = edge;
+	if(damping > 0) {
+		storm_damping = damping;
+	}
+}
+
+/*
+ * Counts a run of an action of a rule, or of an action of the
+ * rule on a device when that is given. Returns -1 when the
+ * action should be held back.
+ */
+int event_storm_run(struct event_storm_t *storm, const char *rule, const char *device) {
+	uint64_t now = uv_hrtime(), span = 0;
+	int limit = (device == NULL) ? storm_limit : storm_edge;
+	char label[255];
+
+	if(limit <= 0) {
+		return 0;
+	}
+
+	if(storm->runs == NULL) {
+		if(device == NULL) {
+			snprintf(label, sizeof(label), "%s", rule);
+			storm->runs = metrics_get(METRIC_COUNTER, "pilight_rule_runs_total", "Actions run by a rule", "rule", label);
+			storm->damped = metrics_get(METRIC_COUNTER, "pilight_rule_damped_total", "Actions of a rule held back by the storm damping", "rule", label);
+		} else {
+			snprintf(label, sizeof(label), "%s>%s", rule, device);
+			storm->runs = metrics_get(METRIC_COUNTER, "pilight_rule_edge_runs_total", "Actions run by a rule on a device", "edge", label);
+			storm->damped = metrics_get(METRIC_COUNTER, "pilight_rule_edge_damped_total", "Actions of a rule on a device held back by the storm damping", "edge", label);
+		}
+	}
+
+	if(storm->last > 0) {
+		storm->rate *= exp(-(double)(now-storm->last)/(STORM_PERIOD*1000000000.0));
+	}
+	storm->last = now;
+	storm->rate += 1;
+
+	if(now < storm->until) {
+		metrics_inc(storm->damped, 1);
+		return -1;
+	}
+	/* Calmed down since it last tripped */
+	if(storm->trips > 0 && storm->rate < limit/2.0) {
+		storm->trips = 0;
+	}
+	if(storm->rate > limit) {
+		if(storm->trips < STORM_TRIPS) {
+			storm->trips++;
+		}
+		span = (uint64_t)storm_damping << (storm->trips-1);
+		storm->until = now+span*1000000000;
+		if(device == NULL) {
+			logprintf(LOG_WARNING, "rule %s ran its actions %.0f times a minute, holding them back for %lu seconds",
+				rule, storm->rate, (unsigned long)span);
+		} else {
+			logprintf(LOG_WARNING, "rule %s controlled device %s %.0f times a minute, holding it back for %lu seconds",
+				rule, device, storm->rate, (unsigned long)span);
+		}
+		metrics_inc(storm->damped, 1);
+		return -1;
+	}
+
+	metrics_inc(storm->runs, 1);
+	return 0;
+}
@@ -0,0 +1,30 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _EVENTS_STORM_H_
+#define _EVENTS_STORM_H_
+
+#include <stdint.h>
+
+#include "../core/metrics.h"
+
+typedef struct event_storm_t {
+	/* Runs within about the last minute */
+	double rate;
+	uint64_t last;
+	/* Damped until this moment of uv_hrtime */
+	uint64_t until;
+	int trips;
+	struct metric_t *runs;
+	struct metric_t *damped;
+} event_storm_t;
+
+void event_storm_init(int limit, int edge, int damping);
+int event_storm_run(struct event_storm_t *storm, const char *rule, const char *device);
+
+#endif
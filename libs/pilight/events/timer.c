@@ -0,0 +1,392 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "../core/pilight.h"
+#include "../core/common.h"
+#include "../core/mem.h"
+#include "../core/log.h"
+
+#include "timer.h"
+
+/*
+ * Rules that can only become true at certain moments of a
+ * datetime device have their next moment scheduled on a
+ * hierarchical timer wheel. Each datetime device has its own
+ * wheel, which counts in seconds of the local time of that
+ * device and is advanced by its clock ticks. Every level has
+ * TIMER_SLOTS slots, each spanning TIMER_SLOTS times the slots
+ * of the level below. Timers too far ahead for the top level
+ * wait in an overflow list until the top level wraps.
+ */
+#define TIMER_BITS			6
+#define TIMER_SLOTS			(1 << TIMER_BITS)
+#define TIMER_MASK			(TIMER_SLOTS-1)
+#define TIMER_LEVELS		4
+/* Larger jumps of the clock reschedule all timers at once */
+#define TIMER_MAX_STEP	86400
+
+typedef struct event_clock_t {
+	char *device;
+	time_t now;
+	int running;
+	struct event_timer_t *wheel[TIMER_LEVELS][TIMER_SLOTS];
+	struct event_timer_t *overflow;
+	struct event_clock_t *next;
+} event_clock_t;
+
+static struct event_clock_t *clocks = NULL;
+static struct event_timer_t *timers = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static char *fieldnames[TIMER_FIELDS] = {
+	"year", "month", "day", "weekday", "hour", "minute", "second"
+};
+
+int event_timer_field(const char *name) {
+	int i = 0;
+
+	for(i=0;i<TIMER_FIELDS;i++) {
+		if(strcmp(fieldnames[i], name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+char *event_timer_name(int field) {
+	return fieldnames[field];
+}
+
+/* Days since 1970-01-01 of a proleptic gregorian date */
+static long timer_days(long year, long month, long day) {
+	long era = 0, yoe = 0, doy = 0, doe = 0;
+
+	year -= (month <= 2);
+	era = (year >= 0 ? year : year-399) / 400;
+	yoe = year - era * 400;
+	doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+	return era * 146097 + doe - 719468;
+}
+
+static void timer_date(long days, int *fields) {
+	long era = 0, doe = 0, yoe = 0, doy = 0, mp = 0, year = 0;
+
+	days += 719468;
+	era = (days >= 0 ? days : days-146096) / 146097;
+	doe = days - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	year = yoe + era * 400;
+
+	fields[TIMER_DAY] = (int)(doy - (153 * mp + 2) / 5 + 1);
+	fields[TIMER_MONTH] = (int)(mp < 10 ? mp + 3 : mp - 9);
+	fields[TIMER_YEAR] = (int)(year + (fields[TIMER_MONTH] <= 2));
+	/* 1970-01-01 was a thursday, the datetime weekday starts at sunday */
+	fields[TIMER_WEEKDAY] = (int)(((days - 719468) % 7 + 11) % 7) + 1;
+}
+
+static void timer_fields(time_t t, int *fields) {
+	long days = (long)(t / 86400), secs = (long)(t % 86400);
+
+	if(secs < 0) {
+		secs += 86400;
+		days--;
+	}
+	timer_date(days, fields);
+	fields[TIMER_HOUR] = (int)(secs / 3600);
+	fields[TIMER_MINUTE] = (int)((secs / 60) % 60);
+	fields[TIMER_SECOND] = (int)(secs % 60);
+}
+
+/*
+ * The first moment at or after t where all fields of the timer
+ * match, searched by skipping whole years, months, days, hours
+ * and minutes that cannot match. Returns -1 when there is no
+ * such moment within the next four years.
+ */
+static time_t timer_next(struct event_timer_t *timer, time_t t) {
+	time_t limit = t + 4 * 366 * 86400;
+	int *want = timer->fields;
+	int now[TIMER_FIELDS];
+
+	while(t < limit) {
+		timer_fields(t, now);
+		if(want[TIMER_YEAR] > -1 && now[TIMER_YEAR] != want[TIMER_YEAR]) {
+			if(now[TIMER_YEAR] > want[TIMER_YEAR]) {
+				return -1;
+			}
+			t = (time_t)timer_days(now[TIMER_YEAR]+1, 1, 1) * 86400;
+		} else if(want[TIMER_MONTH] > -1 && now[TIMER_MONTH] != want[TIMER_MONTH]) {
+			if(now[TIMER_MONTH] == 12) {
+				t = (time_t)timer_days(now[TIMER_YEAR]+1, 1, 1) * 86400;
+			} else {
+				t = (time_t)timer_days(now[TIMER_YEAR], now[TIMER_MONTH]+1, 1) * 86400;
+			}
+		} else if((want[TIMER_DAY] > -1 && now[TIMER_DAY] != want[TIMER_DAY]) ||
+		          (want[TIMER_WEEKDAY] > -1 && now[TIMER_WEEKDAY] != want[TIMER_WEEKDAY])) {
+			t = t - (t % 86400) + 86400;
+		} else if(want[TIMER_HOUR] > -1 && now[TIMER_HOUR] != want[TIMER_HOUR]) {
+			t = t - (t % 3600) + 3600;
+		} else if(want[TIMER_MINUTE] > -1 && now[TIMER_MINUTE] != want[TIMER_MINUTE]) {
+			t = t - (t % 60) + 60;
+		} else if(want[TIMER_SECOND] > -1 && now[TIMER_SECOND] != want[TIMER_SECOND]) {
+			t++;
+		} else {
+			return t;
+		}
+	}
+	return -1;
+}
+
+static void timer_insert(struct event_clock_t *clock, struct event_timer_t *timer) {
+	time_t delta = 0;
+	int level = 0, slot = 0;
+
+	if(timer->deadline < 0) {
+		return;
+	}
+
+	delta = timer->deadline - clock->now;
+	for(level=0;level<TIMER_LEVELS;level++) {
+		if(delta < ((time_t)1 << (TIMER_BITS*(level+1)))) {
+			break;
+		}
+	}
+	if(level == TIMER_LEVELS) {
+		timer->slot = clock->overflow;
+		clock->overflow = timer;
+	} else {
+		slot = (int)((timer->deadline >> (TIMER_BITS*level)) & TIMER_MASK);
+		timer->slot = clock->wheel[level][slot];
+		clock->wheel[level][slot] = timer;
+	}
+}
+
+/*
+ * Mark the timer as fired at the current time of its clock
+ * when it matches, and schedule its next moment.
+ */
+static void timer_schedule(struct event_clock_t *clock, struct event_timer_t *timer) {
+	time_t t = clock->now;
+
+	if((timer->deadline = timer_next(timer, t)) == t) {
+		timer->fired = t;
+		timer->deadline = timer_next(timer, t+1);
+	}
+	timer_insert(clock, timer);
+}
+
+static void timer_rebuild(struct event_clock_t *clock) {
+	struct event_timer_t *tmp = timers;
+
+	memset(clock->wheel, 0, sizeof(clock->wheel));
+	clock->overflow = NULL;
+
+	while(tmp) {
+		if(tmp->clock == clock) {
+			timer_schedule(clock, tmp);
+		}
+		tmp = tmp->next;
+	}
+}
+
+static void timer_cascade(struct event_clock_t *clock, struct event_timer_t *list) {
+	struct event_timer_t *tmp = NULL;
+
+	while(list) {
+		tmp = list;
+		list = list->slot;
+		if(tmp->deadline <= clock->now) {
+			tmp->fired = clock->now;
+			tmp->deadline = timer_next(tmp, clock->now+1);
+		}
+		timer_insert(clock, tmp);
+	}
+}
+
+static void timer_step(struct event_clock_t *clock) {
+	struct event_timer_t *list = NULL;
+	time_t t = ++clock->now;
+	int level = 0, slot = 0;
+
+	for(level=TIMER_LEVELS-1;level>0;level--) {
+		if((t & (((time_t)1 << (TIMER_BITS*level))-1)) == 0) {
+			break;
+		}
+	}
+	if(level == TIMER_LEVELS-1 && (t & (((time_t)1 << (TIMER_BITS*TIMER_LEVELS))-1)) == 0) {
+		list = clock->overflow;
+		clock->overflow = NULL;
+		timer_cascade(clock, list);
+	}
+	for(;level>=0;level--) {
+		slot = (int)((t >> (TIMER_BITS*level)) & TIMER_MASK);
+		list = clock->wheel[level][slot];
+		clock->wheel[level][slot] = NULL;
+		timer_cascade(clock, list);
+	}
+}
+
+static struct event_clock_t *timer_get_clock(char *device) {
+	struct event_clock_t *tmp = clocks;
+
+	while(tmp) {
+		if(strcmp(tmp->device, device) == 0) {
+			return tmp;
+		}
+		tmp = tmp->next;
+	}
+	return NULL;
+}
+
+struct event_timer_t *event_timer_add(struct rules_t *rule, char *device, int *fields) {
+	struct event_clock_t *clock = NULL;
+	struct event_timer_t *node = NULL;
+
+	pthread_mutex_lock(&lock);
+	if((clock = timer_get_clock(device)) == NULL) {
+		if((clock = MALLOC(sizeof(struct event_clock_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(clock, 0, sizeof(struct event_clock_t));
+		if((clock->device = STRDUP(device)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		clock->next = clocks;
+		clocks = clock;
+	}
+
+	if((node = MALLOC(sizeof(struct event_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(node, 0, sizeof(struct event_timer_t));
+	memcpy(node->fields, fields, sizeof(node->fields));
+	node->rule = rule;
+	node->clock = clock;
+	node->deadline = -1;
+	node->fired = -1;
+	node->next = timers;
+	timers = node;
+
+	if(clock->running == 1) {
+		timer_schedule(clock, node);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return node;
+}
+
+int event_timer_clock(char *device) {
+	int ret = 0;
+
+	pthread_mutex_lock(&lock);
+	ret = (timer_get_clock(device) != NULL);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/*
+ * Advance the wheel of a datetime device to the local time
+ * in its latest values.
+ */
+void event_timer_tick(char *device, int *fields) {
+	struct event_clock_t *clock = NULL;
+	time_t t = 0;
+
+	pthread_mutex_lock(&lock);
+	if((clock = timer_get_clock(device)) != NULL) {
+		t = (time_t)timer_days(fields[TIMER_YEAR], fields[TIMER_MONTH], fields[TIMER_DAY]) * 86400 +
+			fields[TIMER_HOUR] * 3600 + fields[TIMER_MINUTE] * 60 + fields[TIMER_SECOND];
+
+		if(clock->running == 0 || t < clock->now || t - clock->now > TIMER_MAX_STEP) {
+			clock->now = t;
+			clock->running = 1;
+			timer_rebuild(clock);
+		} else {
+			while(clock->now < t) {
+				timer_step(clock);
+			}
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * A timer is due while its clock is still at the moment
+ * the timer last fired.
+ */
+int event_timer_due(struct event_timer_t *timer) {
+	int ret = 0;
+
+	pthread_mutex_lock(&lock);
+	ret = (timer->clock->running == 1 && timer->fired == timer->clock->now);
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+/*
+ * Take the timer of a single rule out, the wheel of its
+ * clock is built again without it.
+ */
+void event_timer_remove(struct event_timer_t *timer) {
+	struct event_timer_t *tmp = NULL, *prev = NULL;
+
+	pthread_mutex_lock(&lock);
+	tmp = timers;
+	while(tmp) {
+		if(tmp == timer) {
+			if(prev == NULL) {
+				timers = tmp->next;
+			} else {
+				prev->next = tmp->next;
+			}
+			if(tmp->clock->running == 1) {
+				timer_rebuild(tmp->clock);
+			}
+			tmp->rule->timer = NULL;
+			FREE(tmp);
+			break;
+		}
+		prev = tmp;
+		tmp = tmp->next;
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+int event_timer_gc(void) {
+	struct event_clock_t *clock = NULL;
+	struct event_timer_t *timer = NULL;
+
+	pthread_mutex_lock(&lock);
+	while(timers) {
+		timer = timers;
+		timers = timers->next;
+		timer->rule->timer = NULL;
+		FREE(timer);
+	}
+	while(clocks) {
+		clock = clocks;
+		clocks = clocks->next;
+		FREE(clock->device);
+		FREE(clock);
+	}
+	pthread_mutex_unlock(&lock);
+
+	logprintf(LOG_DEBUG, "garbage collected events timer library");
+	return 0;
+}
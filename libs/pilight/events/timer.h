@@ -0,0 +1,48 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _EVENTS_TIMER_H_
+#define _EVENTS_TIMER_H_
+
+#include <time.h>
+
+#include "../config/rules.h"
+
+#define TIMER_YEAR			0
+#define TIMER_MONTH			1
+#define TIMER_DAY				2
+#define TIMER_WEEKDAY		3
+#define TIMER_HOUR			4
+#define TIMER_MINUTE		5
+#define TIMER_SECOND		6
+#define TIMER_FIELDS		7
+/* Field value of contradicting comparisons */
+#define TIMER_NEVER			0x40000000
+
+typedef struct event_timer_t {
+	struct rules_t *rule;
+	struct event_clock_t *clock;
+	/* The required value of each datetime field, -1 if any */
+	int fields[TIMER_FIELDS];
+	/* In seconds of local time, -1 if never */
+	time_t deadline;
+	time_t fired;
+	struct event_timer_t *slot;
+	struct event_timer_t *next;
+} event_timer_t;
+
+int event_timer_field(const char *name);
+char *event_timer_name(int field);
+struct event_timer_t *event_timer_add(struct rules_t *rule, char *device, int *fields);
+int event_timer_clock(char *device);
+void event_timer_tick(char *device, int *fields);
+int event_timer_due(struct event_timer_t *timer);
+void event_timer_remove(struct event_timer_t *timer);
+int event_timer_gc(void);
+
+#endif
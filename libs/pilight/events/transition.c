@@ -0,0 +1,306 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "../../libuv/uv.h"
+#include "../core/pilight.h"
+#include "../core/mem.h"
+#include "../core/log.h"
+#include "../core/json.h"
+#include "../core/eventpool.h"
+
+#include "action.h"
+#include "transition.h"
+
+/*
+ * Fades of dimmers run by the dim action. All dimlevels of a
+ * fade are computed when it is started, after that the steps
+ * of all fades are run from a single timer of the main loop,
+ * armed for the step that is due first. The actions only hand
+ * over the parameters, so no lua state is taken by a running
+ * fade. A new fade of the same device replaces the running
+ * one, a step of a fade that was overridden by another action
+ * of its device ends that fade.
+ */
+
+typedef struct transition_t {
+	char *device;
+	unsigned long action_id;
+	/* Each dimlevel is set the delay after the previous one */
+	int *levels;
+	int *delays;
+	int nrlevels;
+	int pos;
+	uint64_t due;
+	struct transition_t *next;
+} transition_t;
+
+/* Sorted by the moment the next step is due */
+static struct transition_t *transitions = NULL;
+/* Started, but not yet scheduled by the main loop */
+static struct transition_t *queued = NULL;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static uv_timer_t *timer_req = NULL;
+static uv_async_t *async_req = NULL;
+static int init = 0;
+
+static void transition_free(struct transition_t *node) {
+	FREE(node->device);
+	FREE(node->levels);
+	FREE(node->delays);
+	FREE(node);
+}
+
+static void *reason_control_device_free(void *param) {
+	struct reason_control_device_t *data = param;
+
+	FREE(data->state);
+	json_delete(data->values);
+	FREE(data->dev);
+	FREE(data);
+	return NULL;
+}
+
+static void transition_send(struct transition_t *node) {
+	struct reason_control_device_t *data = MALLOC(sizeof(struct reason_control_device_t));
+	if(data == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((data->dev = STRDUP(node->device)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((data->state = STRDUP("on")) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	data->values = json_mkobject();
+	json_append_member(data->values, "dimlevel", json_mknumber(node->levels[node->pos], 0));
+
+	eventpool_trigger(REASON_CONTROL_DEVICE, reason_control_device_free, data);
+}
+
+static void transition_insert(struct transition_t *node) {
+	struct transition_t **tmp = &transitions;
+
+	while(*tmp != NULL && (*tmp)->due <= node->due) {
+		tmp = &(*tmp)->next;
+	}
+	node->next = *tmp;
+	*tmp = node;
+}
+
+static int transition_remove(struct transition_t **list, char *device) {
+	struct transition_t **tmp = list, *node = NULL;
+
+	while(*tmp != NULL) {
+		if(strcmp((*tmp)->device, device) == 0) {
+			node = *tmp;
+			*tmp = node->next;
+			transition_free(node);
+			return 0;
+		}
+		tmp = &(*tmp)->next;
+	}
+	return -1;
+}
+
+static void timer_cb(uv_timer_t *req);
+
+/* Call with the lock held */
+static void transition_arm(void) {
+	uint64_t now = uv_now(uv_default_loop());
+
+	if(transitions == NULL) {
+		uv_timer_stop(timer_req);
+	} else {
+		uv_timer_start(timer_req, timer_cb, (transitions->due > now) ? transitions->due-now : 0, 0);
+	}
+}
+
+static void timer_cb(uv_timer_t *req) {
+	struct transition_t *node = NULL;
+	uint64_t now = uv_now(uv_default_loop());
+	unsigned long id = 0;
+
+	pthread_mutex_lock(&lock);
+	if(init == 0) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	while(transitions != NULL && transitions->due <= now) {
+		node = transitions;
+		transitions = node->next;
+
+		if(event_action_get_execution_id(node->device, &id) == 0 && id != node->action_id) {
+			logprintf(LOG_DEBUG, "skipping overridden action dim for device %s", node->device);
+			transition_free(node);
+			continue;
+		}
+
+		transition_send(node);
+		if(++node->pos < node->nrlevels) {
+			node->due += node->delays[node->pos];
+			transition_insert(node);
+		} else {
+			transition_free(node);
+		}
+	}
+	transition_arm();
+	pthread_mutex_unlock(&lock);
+}
+
+static void async_cb(uv_async_t *req) {
+	struct transition_t *node = NULL;
+	uint64_t now = uv_now(uv_default_loop());
+
+	pthread_mutex_lock(&lock);
+	if(init == 0) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	while(queued != NULL) {
+		node = queued;
+		queued = node->next;
+		node->due = now+node->delays[0];
+		transition_insert(node);
+	}
+	transition_arm();
+	pthread_mutex_unlock(&lock);
+}
+
+void event_transition_init(void) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	if(init == 1) {
+		return;
+	}
+
+	if((timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((async_req = MALLOC(sizeof(uv_async_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	uv_timer_init(uv_default_loop(), timer_req);
+	uv_async_init(uv_default_loop(), async_req, async_cb);
+
+	pthread_mutex_lock(&lock);
+	init = 1;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Fade from one dimlevel to another, one level each step
+ * milliseconds, starting after milliseconds from now. Without
+ * a step the device is set to the new dimlevel at once. After
+ * the last level and the hold time the dimlevel is set back to
+ * restore, unless that is negative.
+ */
+int event_transition_start(char *device, unsigned long action_id, int from, int to, int after, int step, int hold, int restore) {
+	struct transition_t *node = NULL;
+	int i = 0, n = 1, dir = (from > to) ? -1 : 1;
+
+	if(step > 0 && from >= 0 && from != to) {
+		n = abs(to-from)+1;
+	} else {
+		step = 0;
+	}
+	if(hold > 0 && restore >= 0) {
+		n++;
+	}
+
+	if((node = MALLOC(sizeof(struct transition_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(node, 0, sizeof(struct transition_t));
+	if((node->device = STRDUP(device)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((node->levels = MALLOC(sizeof(int)*(size_t)n)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((node->delays = MALLOC(sizeof(int)*(size_t)n)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->action_id = action_id;
+	node->nrlevels = n;
+
+	if(step > 0) {
+		for(i=0;i<=abs(to-from);i++) {
+			node->levels[i] = from+(i*dir);
+			node->delays[i] = step;
+		}
+		node->delays[0] = after+step;
+	} else {
+		node->levels[0] = to;
+		node->delays[0] = after;
+	}
+	if(hold > 0 && restore >= 0) {
+		node->levels[n-1] = restore;
+		node->delays[n-1] = hold;
+	}
+
+	pthread_mutex_lock(&lock);
+	if(init == 0) {
+		pthread_mutex_unlock(&lock);
+		transition_free(node);
+		return -1;
+	}
+	if(transition_remove(&transitions, device) == 0 || transition_remove(&queued, device) == 0) {
+		logprintf(LOG_DEBUG, "dim of %s replaced by a new one", device);
+	}
+	node->next = queued;
+	queued = node;
+	pthread_mutex_unlock(&lock);
+
+	uv_async_send(async_req);
+
+	return 0;
+}
+
+void event_transition_stop(char *device) {
+	pthread_mutex_lock(&lock);
+	if(transition_remove(&transitions, device) != 0) {
+		transition_remove(&queued, device);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * The handles are closed together with the other handles of
+ * the main loop.
+ */
+int event_transition_gc(void) {
+	struct transition_t *node = NULL;
+
+	pthread_mutex_lock(&lock);
+	while(transitions != NULL) {
+		node = transitions;
+		transitions = node->next;
+		transition_free(node);
+	}
+	while(queued != NULL) {
+		node = queued;
+		queued = node->next;
+		transition_free(node);
+	}
+	init = 0;
+	pthread_mutex_unlock(&lock);
+
+	logprintf(LOG_DEBUG, "garbage collected event transition library");
+	return 0;
+}
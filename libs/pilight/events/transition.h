@@ -0,0 +1,17 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+#ifndef _EVENTS_TRANSITION_H_
+#define _EVENTS_TRANSITION_H_
+
+void event_transition_init(void);
+int event_transition_start(char *device, unsigned long action_id, int from, int to, int after, int step, int hold, int restore);
+void event_transition_stop(char *device);
+int event_transition_gc(void);
+
+#endif
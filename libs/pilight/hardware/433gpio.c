@@ -6,20 +6,43 @@
   file, You can obtain one at http://mozilla.org/MPL/2.0/.
 */
 
+#ifdef __linux__
+	#ifndef _GNU_SOURCE
+		#define _GNU_SOURCE
+	#endif
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <wiringx.h>
+#ifdef __linux__
+	#include <sys/ioctl.h>
+	#include <sys/prctl.h>
+	#include <linux/gpio.h>
+#endif
 
 #include "../../libuv/uv.h"
 #include "../core/pilight.h"
 #include "../core/common.h"
 #include "../core/dso.h"
 #include "../core/log.h"
+#include "../core/threads.h"
 #include "../core/json.h"
 #include "../core/eventpool.h"
+#include "../core/trace.h"
+#include "../core/metrics.h"
+#include "../core/ntp.h"
+#include "../core/gpiomem.h"
+#include "../protocols/protocol.h"
 #ifdef PILIGHT_REWRITE
 #include "hardware.h"
 #else
@@ -28,9 +51,6 @@
 #endif
 #include "433gpio.h"
 
-static int gpio_433_in = -1;
-static int gpio_433_out = -1;
-static int wait = 0;
 static int loopback = LOOPBACK;
 static int pollpri = UV_PRIORITIZED;
 
@@ -40,28 +60,339 @@ typedef struct timestamp_t {
 	unsigned long second;
 } timestamp_t;
 
+/* Most frames a single footer can be cut into */
+#define SEGMENT_WINDOWS	4
+/* Pulse widths as multiples of the shortest, longer ones share the last */
+#define NOISE_BUCKETS		16
+/* Sends that are remembered to recognize their echoes */
+#define ECHO_SLOTS			8
+
 typedef struct data_t {
 	int rbuffer[1024];
 	int rptr;
+	/* The last pulses, whatever gaps were seen in between */
+	int history[MAXPULSESTREAMLENGTH];
+	int hptr;
+	int hlen;
 } data_t;
 
-static struct data_t data;
-static struct timestamp_t timestamp;
+/*
+ * A send is rendered into the list of edges of the whole
+ * transmission, repeats included. Each edge holds its time
+ * in microseconds since the start, shifted left by one, and
+ * the new level in the lowest bit. The transmit thread plays
+ * it against absolute times of the monotonic clock, so the
+ * timing does not drift with the oversleeping of usleep. It
+ * sleeps until shortly before each edge and only busy waits
+ * the last GPIO433_SPIN microseconds, so on a single core the
+ * rest of the daemon keeps running while a code is sent. A
+ * sender pinned to a core of its own, with the sender-core or
+ * realtime-send-core setting, busy waits the whole send.
+ */
+#define GPIO433_SPIN	50
+
+typedef struct transmit_t {
+	pthread_t pth;
+	pthread_mutex_t lock;
+	pthread_cond_t signal;
+	unsigned long *edges;
+	int nredges;
+	int size;
+	int busy;
+	int running;
+} transmit_t;
 
-static void *reason_received_pulsetrain_free(void *param) {
-	struct reason_received_pulsetrain_t *data = param;
-	FREE(data);
-	return NULL;
+/*
+ * In full duplex the receiver keeps listening while sending,
+ * which needs a receiver that isn't drowned by the sender. What
+ * it picks up of our own sends is recognized by the pulses, in
+ * a window from the start of the send until the echo window
+ * after its last edge. Codes of remotes pressed in between are
+ * received as usual.
+ */
+typedef struct echo_t {
+	int pulses[MAXPULSESTREAMLENGTH];
+	int length;
+	unsigned long until;
+} echo_t;
+
+#endif
+
+/*
+ * The module can run more than once, e.g. as 433gpio and
+ * 433gpio#upstairs with a receiver on each floor. Every
+ * instance has its own pins, noise gate and receive state.
+ * Only one of them can have a sender, the others hear its
+ * sends as an echo or wait for them to finish.
+ */
+typedef struct gpio433_t {
+	struct hardware_t *hw;
+	int in;
+	int out;
+	int core;
+	char *chip;
+	/* The noise gate, each check is off when zero */
+	int noise_min_pulse;
+	double noise_max_jitter;
+	double noise_max_entropy;
+	int full_duplex;
+	int echo_window;
+	int wait;
+
+#if defined(__arm__) || defined(__mips__) || defined(__aarch64__) || defined(PILIGHT_UNITTEST)
+	struct data_t data;
+	struct timestamp_t timestamp;
+	struct pulsetrain_slab_t slab;
+	struct transmit_t transmit;
+	struct echo_t echoes[ECHO_SLOTS];
+	int echo_pos;
+	pthread_mutex_t echo_lock;
+#endif
+
+	struct gpio433_t *next;
+} gpio433_t;
+
+static struct gpio433_t *instances = NULL;
+static pthread_mutex_t instances_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct gpio433_t *gpio433Instance(struct hardware_t *hw) {
+	struct gpio433_t *gpio = hw->instance;
+
+	if(gpio != NULL) {
+		return gpio;
+	}
+	if((gpio = MALLOC(sizeof(struct gpio433_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(gpio, 0, sizeof(struct gpio433_t));
+	gpio->hw = hw;
+	gpio->in = -1;
+	gpio->out = -1;
+	gpio->core = -1;
+	gpio->echo_window = 500;
+#if defined(__arm__) || defined(__mips__) || defined(__aarch64__) || defined(PILIGHT_UNITTEST)
+	pthread_mutex_init(&gpio->echo_lock, NULL);
+#endif
+
+	pthread_mutex_lock(&instances_lock);
+	gpio->next = instances;
+	instances = gpio;
+	pthread_mutex_unlock(&instances_lock);
+
+	hw->instance = gpio;
+	return gpio;
 }
 
+#if defined(__arm__) || defined(__mips__) || defined(__aarch64__) || defined(PILIGHT_UNITTEST)
+static int send_registered = 0;
+
+static struct metric_t *metric_noise_width = NULL;
+static struct metric_t *metric_noise_jitter = NULL;
+static struct metric_t *metric_noise_entropy = NULL;
+static struct metric_t *metric_echo = NULL;
+
 static void *reason_send_code_success_free(void *param) {
 	struct reason_send_code_success_free *data = param;
 	FREE(data);
 	return NULL;
 }
 
-static void poll_cb(uv_poll_t *req, int status, int events) {
+/*
+ * Random noise has pulses shorter than any code, that aren't
+ * a multiple of the shortest one, and that are spread over many
+ * widths. Those trains are dropped here, before they take a
+ * trip through the queue and every protocol of their length.
+ * Returns 0 when the train can be a code.
+ */
+static int gpio433Noise(struct gpio433_t *gpio, const int *pulses, int length) {
+	int buckets[NOISE_BUCKETS], i = 0, x = 0, min = 0, nr = length-1;
+	double jitter = 0, entropy = 0, p = 0;
+
+	if((gpio->noise_min_pulse <= 0 && gpio->noise_max_jitter <= 0 && gpio->noise_max_entropy <= 0) || length < 2) {
+		return 0;
+	}
+
+	/* The footer is left out, it is no multiple of anything */
+	min = pulses[0];
+	for(i=1;i<nr;i++) {
+		if(pulses[i] < min) {
+			min = pulses[i];
+		}
+	}
+	if(gpio->noise_min_pulse > 0 && min < gpio->noise_min_pulse) {
+		metrics_inc(metric_noise_width, 1);
+		return -1;
+	}
+	if(min <= 0) {
+		min = 1;
+	}
+
+	memset(buckets, 0, sizeof(buckets));
+	for(i=0;i<nr;i++) {
+		x = (pulses[i]+(min/2))/min;
+		jitter += fabs((double)(pulses[i]-(x*min)))/(double)min;
+		buckets[(x < NOISE_BUCKETS) ? x : NOISE_BUCKETS-1]++;
+	}
+	if(gpio->noise_max_jitter > 0 && jitter/(double)nr > gpio->noise_max_jitter) {
+		metrics_inc(metric_noise_jitter, 1);
+		return -1;
+	}
+
+	if(gpio->noise_max_entropy > 0) {
+		for(i=0;i<NOISE_BUCKETS;i++) {
+			if(buckets[i] > 0) {
+				p = (double)buckets[i]/(double)nr;
+				entropy -= p*log2(p);
+			}
+		}
+		if(entropy > gpio->noise_max_entropy) {
+			metrics_inc(metric_noise_entropy, 1);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void gpio433EchoAdd(struct gpio433_t *gpio, int *code, int rawlen, unsigned long duration) {
+	struct echo_t *echo = NULL;
+
+	if(rawlen > MAXPULSESTREAMLENGTH) {
+		rawlen = MAXPULSESTREAMLENGTH;
+	}
+	pthread_mutex_lock(&gpio->echo_lock);
+	echo = &gpio->echoes[gpio->echo_pos];
+	gpio->echo_pos = (gpio->echo_pos+1) % ECHO_SLOTS;
+	memcpy(echo->pulses, code, sizeof(int)*(size_t)rawlen);
+	echo->length = rawlen;
+	echo->until = pilight_monotonic_us()+duration+(unsigned long)gpio->echo_window*1000;
+	pthread_mutex_unlock(&gpio->echo_lock);
+}
+
+/*
+ * Returns 0 when the train isn't one of our recent sends. The
+ * footer is left out, as the gap after the last repeat is only
+ * ended by whatever comes next.
+ */
+static int gpio433Echo(struct gpio433_t *gpio, const int *pulses, int length) {
+	struct echo_t *echo = NULL;
+	unsigned long now = 0;
+	int i = 0, x = 0, d = 0;
+
+	if(gpio->full_duplex == 0) {
+		return 0;
+	}
+
+	now = pilight_monotonic_us();
+	pthread_mutex_lock(&gpio->echo_lock);
+	for(i=0;i<ECHO_SLOTS;i++) {
+		echo = &gpio->echoes[i];
+		if(echo->length != length || echo->until < now) {
+			continue;
+		}
+		for(x=0;x<length-1;x++) {
+			d = abs(pulses[x]-echo->pulses[x]);
+			if(d > (echo->pulses[x]/4)+50) {
+				break;
+			}
+		}
+		if(x == length-1) {
+			pthread_mutex_unlock(&gpio->echo_lock);
+			metrics_inc(metric_echo, 1);
+			return -1;
+		}
+	}
+	pthread_mutex_unlock(&gpio->echo_lock);
+
+	return 0;
+}
+
+static void gpio433Emit(struct gpio433_t *gpio, int length) {
+	struct reason_received_pulsetrain_t *data1 = NULL;
+	int i = 0, x = 0;
+
+	data1 = eventpool_pulsetrain_get(&gpio->slab, length);
+	x = (gpio->data.hptr+MAXPULSESTREAMLENGTH-length) % MAXPULSESTREAMLENGTH;
+	for(i=0;i<length;i++) {
+		data1->pulses[i] = gpio->data.history[(x+i) % MAXPULSESTREAMLENGTH];
+	}
+	if(gpio433Noise(gpio, data1->pulses, length) != 0 || gpio433Echo(gpio, data1->pulses, length) != 0) {
+		eventpool_pulsetrain_free(data1);
+		return;
+	}
+	data1->length = length;
+	data1->hardware = gpio->hw->id;
+	trace_start(&data1->trace);
+
+	eventpool_trigger(REASON_RECEIVED_PULSETRAIN, eventpool_pulsetrain_free, data1);
+}
+
+/*
+ * Noise between two frames makes the pulses since the last gap
+ * longer than the frame itself, or a frame follows another one
+ * without a gap long enough to split them. So the frames of the
+ * protocols that can end with this footer are cut from the last
+ * pulses as well, next to the train since the last gap. Those
+ * that aren't a frame at all are rejected by the protocols.
+ */
+static void gpio433Segments(struct gpio433_t *gpio, int footer, int sent) {
+	int lengths[SEGMENT_WINDOWS], nr = 0, i = 0;
+
+	nr = protocol_index_footers(footer, lengths, SEGMENT_WINDOWS);
+	for(i=0;i<nr;i++) {
+		if(lengths[i] != sent && lengths[i] <= gpio->data.hlen) {
+			gpio433Emit(gpio, lengths[i]);
+		}
+	}
+}
+
+/* Store the duration between two edges, timestamps are in microseconds */
+static void gpio433Edge(struct gpio433_t *gpio, unsigned long stamp) {
+	struct hardware_t *hw = gpio->hw;
+	struct data_t *data = &gpio->data;
 	int duration = 0;
+
+	gpio->timestamp.first = gpio->timestamp.second;
+	gpio->timestamp.second = stamp;
+
+	if((gpio->wait == 0 && loopback == 0) || loopback == 1) {
+		duration = (int)((int)gpio->timestamp.second-(int)gpio->timestamp.first);
+
+		if(duration > 0) {
+			data->rbuffer[data->rptr++] = duration;
+			if(data->rptr > MAXPULSESTREAMLENGTH-1) {
+				data->rptr = 0;
+			}
+			data->history[data->hptr] = duration;
+			data->hptr = (data->hptr+1) % MAXPULSESTREAMLENGTH;
+			if(data->hlen < MAXPULSESTREAMLENGTH) {
+				data->hlen++;
+			}
+			if(duration > hw->mingaplen) {
+				int sent = 0;
+
+				/* Let's do a little filtering here as well */
+				if(data->rptr >= hw->minrawlen && data->rptr <= hw->maxrawlen &&
+				   gpio433Noise(gpio, data->rbuffer, data->rptr) == 0 && gpio433Echo(gpio, data->rbuffer, data->rptr) == 0) {
+					struct reason_received_pulsetrain_t *data1 = eventpool_pulsetrain_get(&gpio->slab, data->rptr);
+					data1->length = data->rptr;
+					memcpy(data1->pulses, data->rbuffer, data->rptr*sizeof(int));
+					data1->hardware = hw->id;
+					trace_start(&data1->trace);
+
+					eventpool_trigger(REASON_RECEIVED_PULSETRAIN, eventpool_pulsetrain_free, data1);
+					sent = data->rptr;
+				}
+				gpio433Segments(gpio, duration, sent);
+				data->rptr = 0;
+			}
+		}
+	} else {
+		data->rptr = 0;
+		data->hlen = 0;
+	}
+}
+
+static void poll_cb(uv_poll_t *req, int status, int events) {
 	int fd = req->io_watcher.fd;
 
 	if(events & pollpri) {
@@ -70,97 +401,268 @@ static void poll_cb(uv_poll_t *req, int status, int events) {
 		(void)read(fd, &c, 1);
 		lseek(fd, 0, SEEK_SET);
 
-		struct timeval tv;
-		gettimeofday(&tv, NULL);
-		timestamp.first = timestamp.second;
-		timestamp.second = 1000000 * (unsigned int)tv.tv_sec + (unsigned int)tv.tv_usec;
+		gpio433Edge(req->data, pilight_monotonic_us());
+	};
+	if(events & UV_DISCONNECT) {
+		FREE(req); /*LCOV_EXCL_LINE*/
+	}
+	return;
+}
 
-		if((wait == 0 && loopback == 0) || loopback == 1) {
-			duration = (int)((int)timestamp.second-(int)timestamp.first);
+#ifdef GPIOEVENT_REQUEST_BOTH_EDGES
+/*
+ * The GPIO character device timestamps each edge in the
+ * kernel and queues them, so a single read can return many
+ * edges and the durations don't include any scheduling delay
+ * of the event loop.
+ */
+static void chip_poll_cb(uv_poll_t *req, int status, int events) {
+	struct gpioevent_data edges[64];
+	int fd = req->io_watcher.fd;
+	ssize_t n = 0;
+	int i = 0;
 
-			if(duration > 0) {
-				data.rbuffer[data.rptr++] = duration;
-				if(data.rptr > MAXPULSESTREAMLENGTH-1) {
-					data.rptr = 0;
-				}
-				if(duration > gpio433->mingaplen) {
-					/* Let's do a little filtering here as well */
-					if(data.rptr >= gpio433->minrawlen && data.rptr <= gpio433->maxrawlen) {
-						struct reason_received_pulsetrain_t *data1 = MALLOC(sizeof(struct reason_received_pulsetrain_t));
-						if(data1 == NULL) {
-							OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-						}
-						data1->length = data.rptr;
-						memcpy(data1->pulses, data.rbuffer, data.rptr*sizeof(int));
-						data1->hardware = gpio433->id;
-
-						eventpool_trigger(REASON_RECEIVED_PULSETRAIN, reason_received_pulsetrain_free, data1);
-					}
-					data.rptr = 0;
-				}
+	if(events & UV_READABLE) {
+		while((n = read(fd, edges, sizeof(edges))) > 0) {
+			for(i=0;i<(int)(n/(ssize_t)sizeof(struct gpioevent_data));i++) {
+				gpio433Edge(req->data, (unsigned long)(edges[i].timestamp/1000));
+			}
+			if(n < (ssize_t)sizeof(edges)) {
+				break;
 			}
-		} else {
-			data.rptr = 0;
 		}
-	};
+	}
 	if(events & UV_DISCONNECT) {
 		FREE(req); /*LCOV_EXCL_LINE*/
 	}
 	return;
 }
 
+static int gpio433ChipOpen(struct gpio433_t *gpio) {
+	struct gpioevent_request request;
+	int fd = -1;
+
+	if((fd = open(gpio->chip, O_RDONLY)) < 0) {
+		logprintf(LOG_ERR, "unable to open %s", gpio->chip);
+		return -1;
+	}
+
+	memset(&request, 0, sizeof(request));
+	request.lineoffset = (unsigned int)gpio->in;
+	request.handleflags = GPIOHANDLE_REQUEST_INPUT;
+	request.eventflags = GPIOEVENT_REQUEST_BOTH_EDGES;
+	strncpy(request.consumer_label, "pilight", sizeof(request.consumer_label)-1);
+
+	if(ioctl(fd, GPIO_GET_LINEEVENT_IOCTL, &request) < 0) {
+		logprintf(LOG_ERR, "unable to request edge events for line %d of %s", gpio->in, gpio->chip);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	fcntl(request.fd, F_SETFL, fcntl(request.fd, F_GETFL, 0) | O_NONBLOCK);
+
+	return request.fd;
+}
+#endif
+
+static void gpio433Play(struct gpio433_t *gpio, int spin) {
+	struct transmit_t *transmit = &gpio->transmit;
+	struct timespec start, now, wake;
+	unsigned long elapsed = 0, at = 0, nsec = 0;
+	int i = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i=0;i<transmit->nredges;i++) {
+		at = transmit->edges[i] >> 1;
+		if(spin == 0 && at > elapsed+GPIO433_SPIN) {
+			nsec = (unsigned long)start.tv_nsec+(at-GPIO433_SPIN)*1000;
+			wake.tv_sec = start.tv_sec+(time_t)(nsec/1000000000);
+			wake.tv_nsec = (long)(nsec%1000000000);
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR);
+		}
+		do {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			elapsed = (unsigned long)((now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000);
+		} while(elapsed < at);
+		gpio_write(gpio->out, (int)(transmit->edges[i] & 1));
+	}
+	gpio_write(gpio->out, 0);
+}
+
+static void *gpio433Transmit(void *param) {
+	struct gpio433_t *gpio = param;
+	struct transmit_t *transmit = &gpio->transmit;
+	int spin = 0;
+
+	/* The sender-core of the hardware wins over the realtime profile */
+	threads_realtime(THREAD_RT_SEND, SCHED_FIFO, 80);
+
+	/* Busy waiting a whole send only leaves the other cores running */
+	if((gpio->core >= 0 || threads_realtime_pinned(THREAD_RT_SEND) >= 0) && sysconf(_SC_NPROCESSORS_ONLN) > 1) {
+		spin = 1;
+	}
+#ifdef __linux__
+	/* Without a realtime priority the sleeps are rounded up by the timer slack */
+	if(spin == 0) {
+		prctl(PR_SET_TIMERSLACK, 1, 0, 0, 0);
+	}
+#endif
+
+#ifdef __linux__
+	if(gpio->core >= 0) {
+		cpu_set_t cpuset;
+		CPU_ZERO(&cpuset);
+		CPU_SET(gpio->core, &cpuset);
+		if(pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &cpuset) != 0) {
+			logprintf(LOG_WARNING, "unable to pin the %s sender to core %d", gpio->hw->id, gpio->core);
+		}
+	}
+#endif
+
+	pthread_mutex_lock(&transmit->lock);
+	while(transmit->running == 1) {
+		if(transmit->busy == 0) {
+			pthread_cond_wait(&transmit->signal, &transmit->lock);
+			continue;
+		}
+		pthread_mutex_unlock(&transmit->lock);
+
+		gpio433Play(gpio, spin);
+
+		pthread_mutex_lock(&transmit->lock);
+		transmit->busy = 0;
+		pthread_cond_broadcast(&transmit->signal);
+	}
+	pthread_mutex_unlock(&transmit->lock);
+
+	return NULL;
+}
+
+static void gpio433Render(struct transmit_t *transmit, int *code, int rawlen, int repeats) {
+	unsigned long at = 0;
+	int r = 0, x = 0, size = repeats*(rawlen+1);
+
+	if(size > transmit->size) {
+		if((transmit->edges = REALLOC(transmit->edges, sizeof(unsigned long)*(size_t)size)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		transmit->size = size;
+	}
+
+	transmit->nredges = 0;
+	for(r=0;r<repeats;r++) {
+		for(x=0;x<rawlen;x+=2) {
+			transmit->edges[transmit->nredges++] = (at << 1) | 1;
+			at += (unsigned long)code[x];
+			transmit->edges[transmit->nredges++] = (at << 1);
+			if(x+1 < rawlen) {
+				at += (unsigned long)code[x+1];
+			}
+		}
+	}
+}
+
+/*
+ * The send callback is registered once for all instances. The
+ * receivers of all of them pick up the send, so its echo is
+ * remembered by, or the wait is set for, every instance.
+ */
 static void *gpio433Send(int reason, void *param) {
 	struct reason_send_code_t *data1 = param;
+	struct gpio433_t *gpio = NULL, *tmp = NULL;
+	struct transmit_t *transmit = NULL;
+	unsigned long duration = 0;
 	int *code = data1->pulses;
 	int rawlen = data1->rawlen;
 	int repeats = data1->txrpt;
 
-	wait = 1;
-	
-	int r = 0, x = 0;
-	if(gpio_433_out >= 0) {
-		for(r=0;r<repeats;r++) {
-			for(x=0;x<rawlen;x+=2) {
-				digitalWrite(gpio_433_out, 1);
-				usleep((__useconds_t)code[x]);
-				digitalWrite(gpio_433_out, 0);
-				if(x+1 < rawlen) {
-					usleep((__useconds_t)code[x+1]);
-				}
-			}
+	if(data1->hwtype != gpio433->hwtype) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&instances_lock);
+	tmp = instances;
+	while(tmp) {
+		if(tmp->out >= 0 && tmp->transmit.running == 1) {
+			gpio = tmp;
+			break;
 		}
-		digitalWrite(gpio_433_out, 0);
+		tmp = tmp->next;
 	}
+	pthread_mutex_unlock(&instances_lock);
+
+	if(gpio != NULL) {
+		transmit = &gpio->transmit;
+		pthread_mutex_lock(&transmit->lock);
+		/* Only one transmission at a time */
+		while(transmit->busy == 1) {
+			pthread_cond_wait(&transmit->signal, &transmit->lock);
+		}
+		gpio433Render(transmit, code, rawlen, repeats);
+
+		/* The first repeat ends with the footer, the other ones are alike */
+		duration = (transmit->nredges > 0) ? transmit->edges[transmit->nredges-1] >> 1 : 0;
+		pthread_mutex_lock(&instances_lock);
+		tmp = instances;
+		while(tmp) {
+			if(tmp->full_duplex == 1) {
+				gpio433EchoAdd(tmp, code, rawlen, duration);
+			} else {
+				tmp->wait = 1;
+			}
+			tmp = tmp->next;
+		}
+		pthread_mutex_unlock(&instances_lock);
+
+		transmit->busy = 1;
+		pthread_cond_broadcast(&transmit->signal);
+		while(transmit->busy == 1) {
+			pthread_cond_wait(&transmit->signal, &transmit->lock);
+		}
 
-	wait = 0;
+		pthread_mutex_lock(&instances_lock);
+		tmp = instances;
+		while(tmp) {
+			tmp->wait = 0;
+			tmp = tmp->next;
+		}
+		pthread_mutex_unlock(&instances_lock);
+		pthread_mutex_unlock(&transmit->lock);
+	}
 
 	struct reason_code_sent_success_t *data2 = MALLOC(sizeof(struct reason_code_sent_success_t));
 	strcpy(data2->message, data1->message);
 	strcpy(data2->uuid, data1->uuid);
+	data2->hwtype = data1->hwtype;
 	eventpool_trigger(REASON_CODE_SEND_SUCCESS, reason_send_code_success_free, data2);
 	return NULL;
 }
 #endif
 
-static unsigned short int gpio433HwInit(void) {
+static unsigned short int gpio433HwInit(struct hardware_t *hw) {
 #if defined(__arm__) || defined(__mips__) || defined(__aarch64__) || defined(PILIGHT_UNITTEST)
+	struct gpio433_t *gpio = gpio433Instance(hw);
 
 	/* Make sure the pilight sender gets
 	   the highest priority available */
-#ifdef _WIN32
-	SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
-#else
-	struct sched_param sched;
-	memset(&sched, 0, sizeof(sched));
-	sched.sched_priority = 80;
-	pthread_setschedparam(pthread_self(), SCHED_FIFO, &sched);
-#endif
+	threads_realtime(-1, SCHED_FIFO, 80);
 
 	uv_poll_t *poll_req = NULL;
 	char *platform = GPIO_PLATFORM;
 
 	config_setting_get_number("loopback", 0, &loopback);
 
+	if(gpio->noise_min_pulse > 0 || gpio->noise_max_jitter > 0 || gpio->noise_max_entropy > 0) {
+		metric_noise_width = metrics_get(METRIC_COUNTER, "pilight_hardware_noise_dropped_total", "Pulse trains dropped by the noise gate of a receiver", "reason", "width");
+		metric_noise_jitter = metrics_get(METRIC_COUNTER, "pilight_hardware_noise_dropped_total", "Pulse trains dropped by the noise gate of a receiver", "reason", "jitter");
+		metric_noise_entropy = metrics_get(METRIC_COUNTER, "pilight_hardware_noise_dropped_total", "Pulse trains dropped by the noise gate of a receiver", "reason", "entropy");
+	}
+	if(gpio->full_duplex == 1) {
+		metric_echo = metrics_get(METRIC_COUNTER, "pilight_hardware_echo_dropped_total", "Pulse trains dropped as an echo of our own sends", NULL, NULL);
+		memset(gpio->echoes, 0, sizeof(gpio->echoes));
+	}
+
 	if(config_setting_get_string("gpio-platform", 0, &platform) != 0) {
 		logprintf(LOG_ERR, "no gpio-platform configured");
 		return EXIT_FAILURE;
@@ -174,34 +676,66 @@ static unsigned short int gpio433HwInit(void) {
 		FREE(platform);
 		return EXIT_FAILURE;
 	}
+	gpiomem_setup(platform);
 	FREE(platform);
 
-	if(gpio_433_out >= 0) {
-		if(wiringXValidGPIO(gpio_433_out) != 0) {
-			logprintf(LOG_ERR, "invalid sender pin: %d", gpio_433_out);
+	if(gpio->out >= 0) {
+		if(wiringXValidGPIO(gpio->out) != 0) {
+			logprintf(LOG_ERR, "invalid sender pin: %d", gpio->out);
+			return EXIT_FAILURE;
+		}
+		gpio_mode(gpio->out, PINMODE_OUTPUT);
+
+		memset(&gpio->transmit, 0, sizeof(gpio->transmit));
+		pthread_mutex_init(&gpio->transmit.lock, NULL);
+		pthread_cond_init(&gpio->transmit.signal, NULL);
+		gpio->transmit.running = 1;
+		if(pthread_create(&gpio->transmit.pth, NULL, gpio433Transmit, gpio) != 0) {
+			logprintf(LOG_ERR, "unable to start the %s sender", hw->id);
+			gpio->transmit.running = 0;
 			return EXIT_FAILURE;
 		}
-		pinMode(gpio_433_out, PINMODE_OUTPUT);
 	}
-	if(gpio_433_in >= 0) {
-		if(wiringXValidGPIO(gpio_433_in) != 0) {
-			logprintf(LOG_ERR, "invalid receiver pin: %d", gpio_433_in);
+	if(gpio->in >= 0 && gpio->chip != NULL) {
+#ifdef GPIOEVENT_REQUEST_BOTH_EDGES
+		/* The receiver is a line offset of the gpio chip */
+		int fd = -1;
+		if((fd = gpio433ChipOpen(gpio)) < 0) {
+			return EXIT_FAILURE;
+		}
+		if((poll_req = MALLOC(sizeof(uv_poll_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(gpio->data.rbuffer, '\0', sizeof(gpio->data.rbuffer));
+		gpio->data.rptr = 0;
+		gpio->data.hlen = 0;
+
+		uv_poll_init(uv_default_loop(), poll_req, fd);
+		poll_req->data = gpio;
+		uv_poll_start(poll_req, UV_READABLE, chip_poll_cb);
+#else
+		logprintf(LOG_ERR, "gpio character devices are not supported on this system");
+		return EXIT_FAILURE;
+#endif
+	} else if(gpio->in >= 0) {
+		if(wiringXValidGPIO(gpio->in) != 0) {
+			logprintf(LOG_ERR, "invalid receiver pin: %d", gpio->in);
 			return EXIT_FAILURE;
 		}
-		if(wiringXISR(gpio_433_in, ISR_MODE_BOTH) < 0) {
-			logprintf(LOG_ERR, "unable to register interrupt for pin %d", gpio_433_in);
+		if(wiringXISR(gpio->in, ISR_MODE_BOTH) < 0) {
+			logprintf(LOG_ERR, "unable to register interrupt for pin %d", gpio->in);
 			return EXIT_FAILURE;
 		}
-	}
-	if(gpio_433_in >= 0) {
 		if((poll_req = MALLOC(sizeof(uv_poll_t))) == NULL) {
 			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		int fd = wiringXSelectableFd(gpio_433_in);
-		memset(data.rbuffer, '\0', sizeof(data.rbuffer));
-		data.rptr = 0;
+		int fd = wiringXSelectableFd(gpio->in);
+		memset(gpio->data.rbuffer, '\0', sizeof(gpio->data.rbuffer));
+		gpio->data.rptr = 0;
+		gpio->data.hlen = 0;
 
 		uv_poll_init(uv_default_loop(), poll_req, fd);
+		poll_req->data = gpio;
 
 #ifdef PILIGHT_UNITTEST
 		char *dev = getenv("PILIGHT_433GPIO_READ");
@@ -214,37 +748,153 @@ static unsigned short int gpio433HwInit(void) {
 		uv_poll_start(poll_req, pollpri, poll_cb);
 	}
 
-	eventpool_callback(REASON_SEND_CODE, gpio433Send);
+	if(send_registered == 0) {
+		send_registered = 1;
+		eventpool_callback(REASON_SEND_CODE, gpio433Send);
+	}
 
 	return EXIT_SUCCESS;
 #else
-	logprintf(LOG_ERR, "the 433gpio module is not supported on this hardware", gpio_433_in);
+	logprintf(LOG_ERR, "the 433gpio module is not supported on this hardware");
 	return EXIT_FAILURE;
 #endif
 }
 
-static unsigned short gpio433Settings(struct JsonNode *json) {
+static unsigned short gpio433Settings(struct hardware_t *hw, struct JsonNode *json) {
+	struct gpio433_t *gpio = gpio433Instance(hw), *tmp = NULL;
+
 	if(strcmp(json->key, "receiver") == 0) {
 		if(json->tag == JSON_NUMBER) {
-			gpio_433_in = (int)json->number_;
+			gpio->in = (int)json->number_;
 		} else {
 			return EXIT_FAILURE;
 		}
 	}
 	if(strcmp(json->key, "sender") == 0) {
 		if(json->tag == JSON_NUMBER) {
-			gpio_433_out = (int)json->number_;
+			gpio->out = (int)json->number_;
+		} else {
+			return EXIT_FAILURE;
+		}
+		/* A code is sent once, by a single instance */
+		if(gpio->out >= 0) {
+			pthread_mutex_lock(&instances_lock);
+			tmp = instances;
+			while(tmp) {
+				if(tmp != gpio && tmp->out >= 0) {
+					pthread_mutex_unlock(&instances_lock);
+					logprintf(LOG_ERR, "%s and %s can't both have a sender", tmp->hw->id, hw->id);
+					return EXIT_FAILURE;
+				}
+				tmp = tmp->next;
+			}
+			pthread_mutex_unlock(&instances_lock);
+		}
+	}
+	if(strcmp(json->key, "sender-core") == 0) {
+		if(json->tag == JSON_NUMBER) {
+			gpio->core = (int)json->number_;
+		} else {
+			return EXIT_FAILURE;
+		}
+	}
+	if(strcmp(json->key, "noise-min-pulse") == 0) {
+		if(json->tag == JSON_NUMBER) {
+			gpio->noise_min_pulse = (int)json->number_;
+		} else {
+			return EXIT_FAILURE;
+		}
+	}
+	if(strcmp(json->key, "noise-max-jitter") == 0) {
+		if(json->tag == JSON_NUMBER) {
+			gpio->noise_max_jitter = json->number_;
+		} else {
+			return EXIT_FAILURE;
+		}
+	}
+	if(strcmp(json->key, "noise-max-entropy") == 0) {
+		if(json->tag == JSON_NUMBER) {
+			gpio->noise_max_entropy = json->number_;
+		} else {
+			return EXIT_FAILURE;
+		}
+	}
+	if(strcmp(json->key, "full-duplex") == 0) {
+		if(json->tag == JSON_NUMBER) {
+			gpio->full_duplex = (int)json->number_;
+		} else {
+			return EXIT_FAILURE;
+		}
+	}
+	if(strcmp(json->key, "echo-window") == 0) {
+		if(json->tag == JSON_NUMBER) {
+			gpio->echo_window = (int)json->number_;
 		} else {
 			return EXIT_FAILURE;
 		}
 	}
-	if(gpio_433_out > -1 && gpio_433_in > -1 && gpio_433_in == gpio_433_out) {
+	if(strcmp(json->key, "chip") == 0) {
+		if(json->tag == JSON_STRING) {
+			if(gpio->chip != NULL) {
+				FREE(gpio->chip);
+			}
+			if((gpio->chip = STRDUP(json->string_)) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+		} else {
+			return EXIT_FAILURE;
+		}
+	}
+	if(gpio->out > -1 && gpio->in > -1 && gpio->in == gpio->out) {
 		return EXIT_FAILURE;
 	}
 
 	return EXIT_SUCCESS;
 }
 
+static int gpio433gc(struct hardware_t *hw) {
+	struct gpio433_t *gpio = hw->instance, *tmp = NULL;
+
+	if(gpio == NULL) {
+		return 1;
+	}
+
+	pthread_mutex_lock(&instances_lock);
+	if(instances == gpio) {
+		instances = gpio->next;
+	} else {
+		tmp = instances;
+		while(tmp != NULL && tmp->next != gpio) {
+			tmp = tmp->next;
+		}
+		if(tmp != NULL) {
+			tmp->next = gpio->next;
+		}
+	}
+	pthread_mutex_unlock(&instances_lock);
+
+#if defined(__arm__) || defined(__mips__) || defined(__aarch64__) || defined(PILIGHT_UNITTEST)
+	if(gpio->transmit.running == 1) {
+		pthread_mutex_lock(&gpio->transmit.lock);
+		gpio->transmit.running = 0;
+		pthread_cond_broadcast(&gpio->transmit.signal);
+		pthread_mutex_unlock(&gpio->transmit.lock);
+		pthread_join(gpio->transmit.pth, NULL);
+	}
+	if(gpio->transmit.edges != NULL) {
+		FREE(gpio->transmit.edges);
+	}
+	pthread_mutex_destroy(&gpio->echo_lock);
+#endif
+	if(gpio->chip != NULL) {
+		FREE(gpio->chip);
+	}
+	FREE(gpio);
+	hw->instance = NULL;
+
+	return 1;
+}
+
 #if !defined(MODULE) && !defined(_WIN32)
 __attribute__((weak))
 #endif
@@ -254,16 +904,25 @@ void gpio433Init(void) {
 
 	options_add(&gpio433->options, "r", "receiver", OPTION_HAS_VALUE, DEVICES_VALUE, JSON_NUMBER, NULL, "^[0-9-]+$");
 	options_add(&gpio433->options, "s", "sender", OPTION_HAS_VALUE, DEVICES_VALUE, JSON_NUMBER, NULL, "^[0-9-]+$");
+	options_add(&gpio433->options, "a", "sender-core", OPTION_OPT_VALUE, DEVICES_VALUE, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&gpio433->options, "n", "noise-min-pulse", OPTION_OPT_VALUE, DEVICES_VALUE, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&gpio433->options, "j", "noise-max-jitter", OPTION_OPT_VALUE, DEVICES_VALUE, JSON_NUMBER, NULL, "^[0-9]+(\\.[0-9]+)?$");
+	options_add(&gpio433->options, "e", "noise-max-entropy", OPTION_OPT_VALUE, DEVICES_VALUE, JSON_NUMBER, NULL, "^[0-9]+(\\.[0-9]+)?$");
+	options_add(&gpio433->options, "u", "full-duplex", OPTION_OPT_VALUE, DEVICES_VALUE, JSON_NUMBER, NULL, "^[10]{1}$");
+	options_add(&gpio433->options, "w", "echo-window", OPTION_OPT_VALUE, DEVICES_VALUE, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&gpio433->options, "c", "chip", OPTION_OPT_VALUE, DEVICES_VALUE, JSON_STRING, NULL, "^/dev/gpiochip[0-9]+$");
 
 	gpio433->minrawlen = 1000;
 	gpio433->maxrawlen = 0;
 	gpio433->mingaplen = 5100;
 	gpio433->maxgaplen = 10000;
 
+	gpio433->multiple=1;
 	gpio433->hwtype=RF433;
 	gpio433->comtype=COMOOK;
 	gpio433->init=&gpio433HwInit;
 	gpio433->settings=&gpio433Settings;
+	gpio433->gc=&gpio433gc;
 }
 
 #if defined(MODULE) && !defined(_WIN32)
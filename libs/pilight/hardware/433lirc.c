@@ -51,7 +51,7 @@ static int lirc_433_setfreq = 0;
 static int lirc_433_fd = 0;
 static char *lirc_433_socket = NULL;
 
-static unsigned short lirc433HwInit(void) {
+static unsigned short lirc433HwInit(struct hardware_t *hw) {
 	unsigned int freq = 0;
 	int fd = 0, i = 0, count = 0;
 	int c = 0;
@@ -89,7 +89,7 @@ static unsigned short lirc433HwInit(void) {
 	return EXIT_SUCCESS;
 }
 
-static unsigned short lirc433HwDeinit(void) {
+static unsigned short lirc433HwDeinit(struct hardware_t *hw) {
 	unsigned int freq = 0;
 
 	if(lirc_433_initialized == 1) {
@@ -165,7 +165,7 @@ static int lirc433Receive(void) {
 	}
 }
 
-static unsigned short lirc433Settings(JsonNode *json) {
+static unsigned short lirc433Settings(struct hardware_t *hw, JsonNode *json) {
 	if(strcmp(json->key, "socket") == 0) {
 		if(json->tag == JSON_STRING) {
 			if((lirc_433_socket = MALLOC(strlen(json->string_)+1)) == NULL) {
@@ -181,7 +181,7 @@ static unsigned short lirc433Settings(JsonNode *json) {
 }
 
 
-static int lirc433gc(void) {
+static int lirc433gc(struct hardware_t *hw) {
 	if(lirc_433_socket != NULL) {
 		FREE(lirc_433_socket);
 	}
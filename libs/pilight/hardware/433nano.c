@@ -39,7 +39,9 @@
 #include "../core/log.h"
 #include "../core/dso.h"
 #include "../core/eventpool.h"
+#include "../core/trace.h"
 #include "../core/firmware.h"
+#include "../core/ntp.h"
 #include "../config/registry.h"
 #include "../config/hardware.h"
 #include "433nano.h"
@@ -51,15 +53,32 @@ typedef struct timestamp_t {
 
 timestamp_t timestamp;
 
+/*
+ * The frames of the nano are parsed while the bytes come
+ * in. The version frame is kept as text, a code frame is
+ * kept as the pulse indexes followed by the pulse lengths.
+ */
+#define NANO_READ_SIZE	256
+
+typedef enum {
+	NANO_IDLE,
+	NANO_VERSION,
+	NANO_CODE,
+	NANO_PULSES
+} nano_state_t;
+
 typedef struct data_t {
+	nano_state_t state;
 	char buffer[1024];
-	int startv;
-	int start;
-	int startp;
 	int bytes;
+	int pulses[10];
+	int nrpulses;
+	int digits;
+	int error;
 } data_t;
 
 static struct data_t data;
+static struct pulsetrain_slab_t slab;
 
 /* What is the minimum rawlenth to consider a pulse stream valid */
 static int minrawlen = 1000;
@@ -77,11 +96,62 @@ static int serial_433_fd = 0;
 static int nano_433_initialized = 0;
 #endif
 
+/*
+ * Firmware that sets this bit in the capabilities of its
+ * version frame also takes the binary code frame.
+ */
+#define NANO_CAP_BINARY	0x01
+/*
+ * Firmware that sets this bit only forwards the pulse trains
+ * that match one of the templates of the filter frame.
+ */
+#define NANO_CAP_FILTER	0x02
+/* Pulse indexes are packed in a nibble */
+#define NANO_MAX_PULSES	16
+/* As many as fit in the memory of the nano */
+#define NANO_MAX_TEMPLATES	16
+
+/*
+ * The rough shape of the pulse trains of one or more protocols,
+ * zero being no bound.
+ */
+typedef struct nano_template_t {
+	int minrawlen;
+	int maxrawlen;
+	int minfooter;
+	int minratio;
+	int maxratio;
+	int minlong;
+	int maxlong;
+} nano_template_t;
+
 static char com[255];
+static int binary = 0;
 static unsigned short loop = 1;
 static unsigned short threads = 0;
 static unsigned short sendSync = 0;
+static unsigned short filtered = 0;
 static pthread_t pth;
+/* The sync, filter and code frames are written from several threads */
+static pthread_mutex_t write_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int nano433Write(char *buf, int len) {
+#ifdef _WIN32
+	DWORD n;
+#else
+	int n = 0;
+#endif
+
+	pthread_mutex_lock(&write_lock);
+#ifdef _WIN32
+	WriteFile(serial_433_fd, buf, len, &n, NULL);
+#else
+	n = write(serial_433_fd, buf, len);
+#endif
+	pthread_mutex_unlock(&write_lock);
+
+	return (int)n;
+}
 
 static void *reason_send_code_success_free(void *param) {
 	struct reason_send_code_success_free *data = param;
@@ -95,23 +165,12 @@ static void *reason_send_code_fail_free(void *param) {
 	return NULL;
 }
 
-static void *reason_received_pulsetrain_free(void *param) {
-	struct reason_received_pulsetrain_t *data = param;
-	FREE(data);
-	return NULL;
-}
-
 void *syncFW(void *param) {
 
 	threads++;
 
-#ifdef _WIN32
-	DWORD n;
-#else
-	int n;
-#endif
 	char send[MAXPULSESTREAMLENGTH+1];
-	int len = 0;
+	int len = 0, n = 0;
 
 	memset(&send, '\0', sizeof(send));
 
@@ -140,12 +199,7 @@ void *syncFW(void *param) {
 	}
 
 	len = sprintf(send, "s:%d,%d,%d,%d@", minrawlen, maxrawlen, mingaplen, maxgaplen);
-
-#ifdef _WIN32
-	WriteFile(serial_433_fd, &send, len, &n, NULL);
-#else
-	n = write(serial_433_fd, send, len);
-#endif
+	n = nano433Write(send, len);
 
 	if(n != len) {
 		logprintf(LOG_NOTICE, "could not sync FW values");
@@ -191,24 +245,114 @@ static int serial_interface_attribs(int fd, speed_t speed, tcflag_t parity) {
 }
 #endif
 
+static unsigned int nano433Varint(unsigned char *buf, unsigned int value) {
+	unsigned int len = 0;
+
+	while(value >= 0x80) {
+		buf[len++] = (unsigned char)((value & 0x7F) | 0x80);
+		value >>= 7;
+	}
+	buf[len++] = (unsigned char)value;
+	return len;
+}
+
+/* CRC-16/CCITT-FALSE */
+static unsigned short nano433Crc(unsigned char *buf, unsigned int len) {
+	unsigned short crc = 0xFFFF;
+	unsigned int i = 0, x = 0;
+
+	for(i=0;i<len;i++) {
+		crc ^= (unsigned short)(buf[i] << 8);
+		for(x=0;x<8;x++) {
+			crc = (crc & 0x8000) ? (unsigned short)((crc << 1) ^ 0x1021) : (unsigned short)(crc << 1);
+		}
+	}
+	return crc;
+}
+
+/*
+ * c:<indexes>;p:<pulses>;r:<repeats>@
+ */
+static unsigned int nano433EncodeText(char *send, unsigned char *index, unsigned int rawlen, int *pulses, unsigned int nrpulses, int repeats) {
+	unsigned int i = 0, y = 0, len = 0;
+	char c[16];
+
+	strncpy(&send[0], "c:", 2);
+	len += 2;
+	for(i=0;i<rawlen;i++) {
+		send[len++] = (char)(((int)'0')+index[i]);
+	}
+
+	strncpy(&send[len], ";p:", 3);
+	len += 3;
+	for(i=0;i<nrpulses;i++) {
+		y = (unsigned int)snprintf(c, sizeof(c), "%d", pulses[i]);
+		strncpy(&send[len], c, y);
+		len += y;
+		if(i+1 < nrpulses) {
+			strncpy(&send[len++], ",", 1);
+		}
+	}
+	strncpy(&send[len], ";r:", 3);
+	len += 3;
+	y = (unsigned int)snprintf(c, sizeof(c), "%d", repeats);
+	strncpy(&send[len], c, y);
+	len += y;
+	strncpy(&send[len], "@", 3);
+	len += 3;
+
+	return len;
+}
+
+/*
+ * b<length><payload><crc>, where the payload is the number of
+ * pulses, the pulses, the repeats and the number of indexes
+ * as varints, followed by the indexes two to a byte, high
+ * nibble first. The length is a varint as well, the crc of the
+ * payload is sent big endian.
+ */
+static unsigned int nano433EncodeBinary(char *send, unsigned char *index, unsigned int rawlen, int *pulses, unsigned int nrpulses, int repeats) {
+	unsigned char payload[MAXPULSESTREAMLENGTH];
+	unsigned int i = 0, len = 0, plen = 0;
+	unsigned short crc = 0;
+
+	plen += nano433Varint(&payload[plen], nrpulses);
+	for(i=0;i<nrpulses;i++) {
+		plen += nano433Varint(&payload[plen], (unsigned int)pulses[i]);
+	}
+	plen += nano433Varint(&payload[plen], (unsigned int)repeats);
+	plen += nano433Varint(&payload[plen], rawlen);
+	for(i=0;i<rawlen;i+=2) {
+		payload[plen++] = (unsigned char)((index[i] << 4) | ((i+1 < rawlen) ? index[i+1] : 0));
+	}
+	crc = nano433Crc(payload, plen);
+
+	send[len++] = 'b';
+	len += nano433Varint((unsigned char *)&send[len], plen);
+	memcpy(&send[len], payload, plen);
+	len += plen;
+	send[len++] = (char)(crc >> 8);
+	send[len++] = (char)(crc & 0xFF);
+
+	return len;
+}
+
 static void *nano433Send(int reason, void *param) {
 	struct reason_send_code_t *data1 = param;
 	int *code = data1->pulses;
 	int rawlen = data1->rawlen;
 	int repeats = data1->txrpt;
 
-	unsigned int i = 0, x = 0, y = 0, len = 0, nrpulses = 0;
-	int pulses[10], match = 0;
-	char c[16], send[MAXPULSESTREAMLENGTH+1];
-#ifdef _WIN32
-	DWORD n;
-#else
+	unsigned int i = 0, x = 0, len = 0, nrpulses = 0;
+	unsigned int maxpulses = (binary == 1) ? NANO_MAX_PULSES : 10;
+	int pulses[NANO_MAX_PULSES], match = 0;
+	unsigned char index[MAXPULSESTREAMLENGTH];
+	char send[MAXPULSESTREAMLENGTH+1];
 	int n = 0;
-#endif
 
-	memset(send, 0, MAXPULSESTREAMLENGTH);
-	strncpy(&send[0], "c:", 2);
-	len += 2;
+	if(data1->hwtype != nano433->hwtype) {
+		return NULL;
+	}
 
 	for(i=0;i<rawlen;i++) {
 		match = -1;
@@ -218,76 +362,299 @@ static void *nano433Send(int reason, void *param) {
 				break;
 			}
 		}
-		if(match == -1) {
+		if(match == -1 && nrpulses < maxpulses) {
 			pulses[nrpulses] = code[i];
 			match = (int)nrpulses;
 			nrpulses++;
 		}
-		if(match < 10) {
-			send[len++] = (char)(((int)'0')+match);
+		if(match >= 0) {
+			index[i] = (unsigned char)match;
 		} else {
 			logprintf(LOG_ERR, "too many distinct pulses for pilight usb nano to send");
 			struct reason_code_sent_fail_t *data2 = MALLOC(sizeof(struct reason_code_sent_fail_t));
 			strcpy(data2->message, data1->message);
 			strcpy(data2->uuid, data1->uuid);
+			data2->hwtype = data1->hwtype;
 			eventpool_trigger(REASON_CODE_SEND_FAIL, reason_send_code_fail_free, data2);
 			return NULL;
 		}
 	}
 
-	strncpy(&send[len], ";p:", 3);
-	len += 3;
-	for(i=0;i<nrpulses;i++) {
-		y = (unsigned int)snprintf(c, sizeof(c), "%d", pulses[i]);
-		strncpy(&send[len], c, y);
-		len += y;
-		if(i+1 < nrpulses) {
-			strncpy(&send[len++], ",", 1);
-		}
+	memset(send, 0, MAXPULSESTREAMLENGTH);
+	if(binary == 1) {
+		len = nano433EncodeBinary(send, index, (unsigned int)rawlen, pulses, nrpulses, repeats);
+	} else {
+		len = nano433EncodeText(send, index, (unsigned int)rawlen, pulses, nrpulses, repeats);
 	}
-	strncpy(&send[len], ";r:", 3);
-	len += 3;
-	y = (unsigned int)snprintf(c, sizeof(c), "%d", repeats);
-	strncpy(&send[len], c, y);
-	len += y;
-	strncpy(&send[len], "@", 3);
-	len += 3;
 
-#ifdef _WIN32
-	WriteFile(serial_433_fd, &send, len, &n, NULL);
-#else
-	n = write(serial_433_fd, send, len);
-#endif
+	n = nano433Write(send, (int)len);
 
-	struct timeval tv;
-	gettimeofday(&tv, NULL);
 	timestamp.first = timestamp.second;
-	timestamp.second = 1000000 * (unsigned int)tv.tv_sec + (unsigned int)tv.tv_usec;
+	timestamp.second = pilight_monotonic_us();
 
 	if(((int)timestamp.second-(int)timestamp.first) < 1000000) {
 		sleep(1);
 	}
 
-	if(n == len) {
+	if(n == (int)len) {
 		struct reason_code_sent_success_t *data2 = MALLOC(sizeof(struct reason_code_sent_success_t));
 		strcpy(data2->message, data1->message);
 		strcpy(data2->uuid, data1->uuid);
+		data2->hwtype = data1->hwtype;
 		eventpool_trigger(REASON_CODE_SEND_SUCCESS, reason_send_code_success_free, data2);
 	} else {
 		struct reason_code_sent_fail_t *data2 = MALLOC(sizeof(struct reason_code_sent_fail_t));
 		strcpy(data2->message, data1->message);
 		strcpy(data2->uuid, data1->uuid);
+		data2->hwtype = data1->hwtype;
 		eventpool_trigger(REASON_CODE_SEND_FAIL, reason_send_code_fail_free, data2);
 	}
 	return NULL;
 }
 
+static void nano433TemplateAdd(struct nano_template_t *templates, int *nr, struct protocol_t *proto) {
+	struct nano_template_t tmp;
+	int i = 0;
+
+	memset(&tmp, 0, sizeof(struct nano_template_t));
+	tmp.minrawlen = proto->minrawlen;
+	tmp.maxrawlen = proto->maxrawlen;
+	/* The upper footer bound is left to validate, see protocol_index_init */
+	if(proto->mingaplen > 0 && proto->maxgaplen > 0) {
+		tmp.minfooter = (proto->mingaplen < proto->maxgaplen) ? proto->mingaplen : proto->maxgaplen;
+	}
+	tmp.minratio = proto->minfingerprint.ratio;
+	tmp.maxratio = proto->maxfingerprint.ratio;
+	tmp.minlong = proto->minfingerprint.nrlong;
+	tmp.maxlong = proto->maxfingerprint.nrlong;
+
+	for(i=0;i<*nr;i++) {
+		if(memcmp(&templates[i], &tmp, sizeof(struct nano_template_t)) == 0) {
+			return;
+		}
+	}
+	if(*nr < NANO_MAX_TEMPLATES) {
+		memcpy(&templates[*nr], &tmp, sizeof(struct nano_template_t));
+	}
+	/* One over the maximum tells there were too many */
+	if(*nr <= NANO_MAX_TEMPLATES) {
+		(*nr)++;
+	}
+}
+
+/*
+ * f:<template>;<template>;...@, where a template is the minimum
+ * and maximum rawlen, the minimum footer, the minimum and maximum
+ * ratio of the longest to the shortest pulse and the minimum and
+ * maximum number of long pulses. The templates are derived from
+ * the protocols that take part in receiving, so only when the
+ * configuration selected those.
+ */
+static void nano433SyncFilter(void) {
+	struct nano_template_t templates[NANO_MAX_TEMPLATES];
+	struct protocol_t *seen[MAXPULSESTREAMLENGTH];
+	struct protocol_index_t *node = NULL;
+	char send[MAXPULSESTREAMLENGTH+1];
+	int nr = 0, nrseen = 0, len = 0, i = 0, x = 0, n = 0, y = 0;
+
+	if(filtered == 1 || protocol_index_filtered() == 0) {
+		return;
+	}
+	filtered = 1;
+
+	for(i=1;i<MAXPULSESTREAMLENGTH && nr<=NANO_MAX_TEMPLATES;i++) {
+		n = protocol_index_get(i, &node);
+		for(y=0;y<n;y++,node++) {
+			if(node->hwtype != RF433) {
+				continue;
+			}
+			for(x=0;x<nrseen;x++) {
+				if(seen[x] == node->listener) {
+					break;
+				}
+			}
+			if(x < nrseen) {
+				continue;
+			}
+			if(nrseen < MAXPULSESTREAMLENGTH) {
+				seen[nrseen++] = node->listener;
+			}
+			nano433TemplateAdd(templates, &nr, node->listener);
+		}
+	}
+
+	if(nr == 0) {
+		return;
+	}
+	if(nr > NANO_MAX_TEMPLATES) {
+		logprintf(LOG_NOTICE, "too many distinct protocols for the pilight usb nano to filter");
+		return;
+	}
+
+	len = snprintf(send, sizeof(send), "f:");
+	for(i=0;i<nr;i++) {
+		len += snprintf(&send[len], sizeof(send)-(size_t)len, "%s%d,%d,%d,%d,%d,%d,%d", (i > 0) ? ";" : "",
+			templates[i].minrawlen, templates[i].maxrawlen, templates[i].minfooter,
+			templates[i].minratio, templates[i].maxratio, templates[i].minlong, templates[i].maxlong);
+	}
+	len += snprintf(&send[len], sizeof(send)-(size_t)len, "@");
+
+	if(nano433Write(send, len) != len) {
+		logprintf(LOG_NOTICE, "could not sync FW filter");
+	} else {
+		logprintf(LOG_DEBUG, "pilight-usb-nano filters on %d templates", nr);
+	}
+}
+
+static void nano433ParseVersion(void) {
+	double values[8];
+	char *p = &data.buffer[0], *end = NULL;
+	int nr = 0;
+
+	data.buffer[data.bytes] = '\0';
+	while(nr < 8) {
+		values[nr] = strtod(p, &end);
+		if(end == p) {
+			break;
+		}
+		nr++;
+		if(*end != ',') {
+			break;
+		}
+		p = end+1;
+	}
+	if(nr < 7) {
+		return;
+	}
+	/* Older firmware has no capabilities */
+	binary = (nr == 8 && ((int)values[7] & NANO_CAP_BINARY) != 0);
+
+	if(!(minrawlen == (int)values[0] && maxrawlen == (int)values[1] &&
+			 mingaplen == (int)values[2] && maxgaplen == (int)values[3])) {
+		logprintf(LOG_WARNING, "could not sync FW values");
+	}
+	firmware.version = values[4];
+	firmware.lpf = values[5];
+	firmware.hpf = values[6];
+
+	if(firmware.version > 0 && firmware.lpf > 0 && firmware.hpf > 0) {
+		config_registry_set_number("pilight.firmware.version", firmware.version);
+		config_registry_set_number("pilight.firmware.lpf", firmware.lpf);
+		config_registry_set_number("pilight.firmware.hpf", firmware.hpf);
+		logprintf(LOG_INFO, "pilight-usb-nano version: %d, lpf: %d, hpf: %d%s", (int)firmware.version, (int)firmware.lpf, (int)firmware.hpf, (binary == 1) ? ", binary codes" : "");
+	}
+
+	if(nr == 8 && ((int)values[7] & NANO_CAP_FILTER) != 0) {
+		nano433SyncFilter();
+	}
+}
+
+static void nano433ParseCode(void) {
+	struct reason_received_pulsetrain_t *data1 = NULL;
+	int i = 0, y = 0;
+
+	if(data.error == 0 && (data.nrpulses == 0 || data.bytes*2 > MAXPULSESTREAMLENGTH)) {
+		data.error = 1;
+	}
+	for(i=0;data.error == 0 && i<data.bytes;i++) {
+		if(data.buffer[i] >= data.nrpulses) {
+			data.error = 1;
+		}
+	}
+	if(data.error == 1) {
+		logprintf(LOG_NOTICE, "433nano: discarded invalid pulse train");
+		return;
+	}
+
+	data1 = eventpool_pulsetrain_get(&slab, data.bytes*2);
+	data1->length = 0;
+	trace_start(&data1->trace);
+
+	for(i=0;i<data.bytes;i++) {
+		y = data.buffer[i];
+		data1->pulses[data1->length++] = data.pulses[0];
+		data1->pulses[data1->length++] = data.pulses[y];
+	}
+
+	data1->hardware = nano433->id;
+
+	eventpool_trigger(REASON_RECEIVED_PULSETRAIN, eventpool_pulsetrain_free, data1);
+}
+
+static void nano433ParseByte(char c) {
+	if(c == '\n') {
+		sendSync = 1;
+		return;
+	}
+	switch(c) {
+		case 'v':
+			data.state = NANO_VERSION;
+			data.bytes = 0;
+			return;
+		case 'c':
+			data.state = NANO_CODE;
+			data.bytes = 0;
+			data.error = 0;
+			return;
+		case 'p':
+			if(data.state == NANO_CODE) {
+				data.state = NANO_PULSES;
+				data.nrpulses = 0;
+				data.digits = 0;
+			}
+			return;
+		case '@':
+			if(data.state == NANO_VERSION) {
+				nano433ParseVersion();
+			} else if(data.state == NANO_PULSES) {
+				nano433ParseCode();
+			}
+			data.state = NANO_IDLE;
+			data.bytes = 0;
+			return;
+		default:
+		break;
+	}
+
+	switch(data.state) {
+		case NANO_VERSION:
+			if(c != ':' && data.bytes < (int)sizeof(data.buffer)-1) {
+				data.buffer[data.bytes++] = c;
+			}
+		break;
+		case NANO_CODE:
+			if(c >= '0' && c <= '9') {
+				if(data.bytes < (int)sizeof(data.buffer)) {
+					data.buffer[data.bytes++] = (char)(c - '0');
+				} else {
+					data.error = 1;
+				}
+			}
+		break;
+		case NANO_PULSES:
+			if(c >= '0' && c <= '9') {
+				if(data.digits == 0) {
+					if(data.nrpulses > 9) {
+						data.error = 1;
+						break;
+					}
+					data.pulses[data.nrpulses++] = 0;
+				}
+				data.pulses[data.nrpulses-1] = (data.pulses[data.nrpulses-1]*10) + (c - '0');
+				data.digits++;
+			} else if(c == ',') {
+				data.digits = 0;
+			}
+		break;
+		case NANO_IDLE:
+		default:
+		break;
+	}
+}
+
 static void poll_cb(uv_poll_t *req, int status, int events) {
-	char c[1];
-	int s = 0, nrpulses = 0, y = 0;
-	int pulses[10];
-	size_t x = 0;
-	int error = 0;
+	char c[NANO_READ_SIZE];
+	int i = 0;
 
 	int fd = req->io_watcher.fd;
 #ifdef _WIN32
@@ -297,96 +664,14 @@ static void poll_cb(uv_poll_t *req, int status, int events) {
 #endif
 
 	if(events & UV_READABLE) {
+		/* Drain all bytes that are available in a single call */
 #ifdef _WIN32
-		ReadFile(fd, c, 1, &n, NULL);
+		ReadFile(fd, c, sizeof(c), &n, NULL);
 #else
-		n = read(fd, c, 1);
+		n = read(fd, c, sizeof(c));
 #endif
-		if(n > 0) {
-			if(c[0] == '\n') {
-				sendSync = 1;
-				return;
-			} else {
-				if(c[0] == 'v') {
-					data.startv = 1;
-					data.start = 1;
-					data.bytes = 0;
-				}
-				if(c[0] == 'c') {
-					data.start = 1;
-					data.bytes = 0;
-				}
-				if(c[0] == 'p') {
-					data.startp = data.bytes+2;
-					data.buffer[data.bytes-1] = '\0';
-				}
-				if(c[0] == '@') {
-					data.buffer[data.bytes] = '\0';
-					if(data.startv == 1) {
-						data.start = 0;
-						data.startv = 0;
-						char **array = NULL;
-						int c = explode(&data.buffer[2], ",", &array);
-						if(c == 7) {
-							if(!(minrawlen == atoi(array[0]) && maxrawlen == atoi(array[1]) &&
-							     mingaplen == atoi(array[2]) && maxgaplen == atoi(array[3]))) {
-								logprintf(LOG_WARNING, "could not sync FW values");
-							}
-							firmware.version = atof(array[4]);
-							firmware.lpf = atof(array[5]);
-							firmware.hpf = atof(array[6]);
-
-							if(firmware.version > 0 && firmware.lpf > 0 && firmware.hpf > 0) {
-								config_registry_set_number("pilight.firmware.version", firmware.version);
-								config_registry_set_number("pilight.firmware.lpf", firmware.lpf);
-								config_registry_set_number("pilight.firmware.hpf", firmware.hpf);
-								logprintf(LOG_INFO, "pilight-usb-nano version: %d, lpf: %d, hpf: %d", (int)firmware.version, (int)firmware.lpf, (int)firmware.hpf);
-							}
-						}
-						array_free(&array, c);
-					} else {
-						x = strlen(&data.buffer[data.startp]);
-						s = data.startp;
-						nrpulses = 0;
-						for(y = data.startp; y < data.startp + (int)x; y++) {
-							if(data.buffer[y] == ',') {
-								data.buffer[y] = '\0';
-								pulses[nrpulses++] = atoi(&data.buffer[s]);
-								s = y+1;
-							}
-							if(nrpulses > 9 || s > 1023) {
-								logprintf(LOG_NOTICE, "433nano: discarded invalid pulse train");
-								error = 1;
-								break;
-							}
-						}
-						if(error == 0) {
-							pulses[nrpulses++] = atoi(&data.buffer[s]);
-							x = strlen(&data.buffer[2]);
-
-							struct reason_received_pulsetrain_t *data1 = MALLOC(sizeof(struct reason_received_pulsetrain_t));
-							if(data1 == NULL) {
-								OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-							}
-
-							data1->length = 0;
-
-							for(y = 2; y < 2 + x; y++) {
-								data1->pulses[data1->length++] = pulses[0];
-								data1->pulses[data1->length++] = pulses[data.buffer[y] - '0'];
-							}
-
-							data1->hardware = nano433->id;
-
-							eventpool_trigger(REASON_RECEIVED_PULSETRAIN, reason_received_pulsetrain_free, data1);
-						}
-						data.bytes = 0;
-					}
-				}
-				if(data.start == 1) {
-					data.buffer[data.bytes++] = c[0];
-				}
-			}
+		for(i=0;i<(int)n;i++) {
+			nano433ParseByte(c[i]);
 		}
 	}
 	if(events == 0) {
@@ -395,7 +680,7 @@ static void poll_cb(uv_poll_t *req, int status, int events) {
 	}
 }
 
-static unsigned short int nano433HwInit(void) {
+static unsigned short int nano433HwInit(struct hardware_t *hw) {
 #ifdef _WIN32
 	COMMTIMEOUTS timeouts;
 	DCB port;
@@ -447,8 +732,9 @@ static unsigned short int nano433HwInit(void) {
 		if((poll_req = MALLOC(sizeof(uv_poll_t))) == NULL) {
 			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		memset(data.buffer, '\0', sizeof(data.buffer));
-		data.bytes = 0;
+		memset(&data, '\0', sizeof(data));
+		data.state = NANO_IDLE;
+		filtered = 0;
 
 		uv_poll_init(uv_default_loop(), poll_req, serial_433_fd);
 		uv_poll_start(poll_req, UV_READABLE, poll_cb);
@@ -467,7 +753,7 @@ static unsigned short int nano433HwInit(void) {
 	return EXIT_SUCCESS;
 }
 
-static unsigned short nano433HwDeinit(void) {
+static unsigned short nano433HwDeinit(struct hardware_t *hw) {
 	loop = 0;
 #ifdef _WIN32
 	CloseHandle(serial_433_fd);
@@ -480,7 +766,7 @@ static unsigned short nano433HwDeinit(void) {
 	return EXIT_SUCCESS;
 }
 
-static unsigned short nano433Settings(JsonNode *json) {
+static unsigned short nano433Settings(struct hardware_t *hw, JsonNode *json) {
 	if(strcmp(json->key, "comport") == 0) {
 		if(json->tag == JSON_STRING) {
 			strcpy(com, json->string_);
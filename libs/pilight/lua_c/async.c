@@ -39,15 +39,51 @@ typedef struct lua_thread_t {
 typedef struct lua_timer_t {
 	struct plua_metatable_t *table;
 	struct plua_module_t *module;
-	uv_timer_t *timer_req;
 	lua_State *L;
 	int running;
 	int timeout;
 	int repeat;
 	char *callback;
+
+	/* Its place in the timer wheel */
+	uint64_t expiry;
+	int period;
+	int level;
+	int slot;
+	int linked;
+	struct lua_timer_t *prev;
+	struct lua_timer_t *next;
+	/* Run in the current batch, and stopped by it */
+	int firing;
+	int stopped;
+	struct lua_timer_t *bnext;
 } lua_timer_t;
 
-static void timer_callback(uv_timer_t *req);
+/*
+ * All lua timers share one timer wheel driven by a single uv
+ * timer, ticking in milliseconds. A timer sits in the level
+ * covering its expiry and moves down a level each time the
+ * lower level wraps around. The uv timer is only armed for the
+ * next slot holding any timers, and the timers expiring by then
+ * are run as one batch on one lua state.
+ */
+#define WHEEL_BITS		6
+#define WHEEL_SLOTS		(1 << WHEEL_BITS)
+#define WHEEL_MASK		(WHEEL_SLOTS-1)
+#define WHEEL_LEVELS	5
+/* When no lua state was free to run a batch */
+#define WHEEL_RETRY		10
+
+static struct {
+	uv_timer_t *timer_req;
+	/* The next tick to run, all before it did */
+	uint64_t current;
+	uint64_t used[WHEEL_LEVELS];
+	struct lua_timer_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+	int nr;
+} wheel;
+
+static void timer_free(struct lua_timer_t *timer);
 static void thread_callback(uv_work_t *req);
 static int plua_async_timer_start(lua_State *L);
 
@@ -93,7 +129,7 @@ static int plua_async_thread_trigger(lua_State *L) {
 		return 0;
 	}
 
-	if(uv_queue_work(uv_default_loop(), thread->work_req, "lua thread", thread_callback, thread_free) < 0) {
+	if(uv_queue_work_priority(uv_default_loop(), thread->work_req, "lua thread", UV_PRIORITY_LOW, thread_callback, thread_free) < 0) {
 		plua_ret_false(L);
 		return 0;
 	}
@@ -378,17 +414,236 @@ int plua_async_thread(struct lua_State *L) {
 	return 1;
 }
 
+static void wheel_add(struct lua_timer_t *timer) {
+	uint64_t expiry = timer->expiry, delta = 0, range = (uint64_t)1 << (WHEEL_BITS*WHEEL_LEVELS);
+	int level = 0, slot = 0;
+
+	if(expiry < wheel.current) {
+		expiry = wheel.current;
+	}
+	/* Longer timers come back here when their slot cascades */
+	if((delta = expiry - wheel.current) >= range) {
+		delta = range-1;
+		expiry = wheel.current + delta;
+	}
+	while(level < WHEEL_LEVELS-1 && delta >= ((uint64_t)1 << (WHEEL_BITS*(level+1)))) {
+		level++;
+	}
+	slot = (int)((expiry >> (WHEEL_BITS*level)) & WHEEL_MASK);
+
+	timer->level = level;
+	timer->slot = slot;
+	timer->prev = NULL;
+	timer->next = wheel.slots[level][slot];
+	if(timer->next != NULL) {
+		timer->next->prev = timer;
+	}
+	wheel.slots[level][slot] = timer;
+	wheel.used[level] |= ((uint64_t)1 << slot);
+	timer->linked = 1;
+	wheel.nr++;
+}
+
+static void wheel_remove(struct lua_timer_t *timer) {
+	if(timer->linked == 0) {
+		return;
+	}
+	if(timer->prev != NULL) {
+		timer->prev->next = timer->next;
+	} else {
+		wheel.slots[timer->level][timer->slot] = timer->next;
+	}
+	if(timer->next != NULL) {
+		timer->next->prev = timer->prev;
+	}
+	if(wheel.slots[timer->level][timer->slot] == NULL) {
+		wheel.used[timer->level] &= ~((uint64_t)1 << timer->slot);
+	}
+	timer->prev = NULL;
+	timer->next = NULL;
+	timer->linked = 0;
+	wheel.nr--;
+}
+
+/* Takes all timers out of a slot */
+static struct lua_timer_t *wheel_take(int level, int slot) {
+	struct lua_timer_t *list = wheel.slots[level][slot], *tmp = list;
+
+	while(tmp) {
+		tmp->linked = 0;
+		wheel.nr--;
+		tmp = tmp->next;
+	}
+	wheel.slots[level][slot] = NULL;
+	wheel.used[level] &= ~((uint64_t)1 << slot);
+
+	return list;
+}
+
+/* Collects the timers expired up to now, in the order they expired */
+static struct lua_timer_t *wheel_advance(uint64_t now) {
+	struct lua_timer_t *expired = NULL, **tail = &expired, *list = NULL, *tmp = NULL;
+	uint64_t next = 0, mask = 0;
+	int idx = 0, level = 0, slot = 0;
+
+	while(wheel.nr > 0 && wheel.current <= now) {
+		idx = (int)(wheel.current & WHEEL_MASK);
+		if(idx == 0) {
+			for(level=1;level<WHEEL_LEVELS;level++) {
+				slot = (int)((wheel.current >> (WHEEL_BITS*level)) & WHEEL_MASK);
+				list = wheel_take(level, slot);
+				while(list) {
+					tmp = list;
+					list = list->next;
+					wheel_add(tmp);
+				}
+				if(slot != 0) {
+					break;
+				}
+			}
+		}
+
+		list = wheel_take(0, idx);
+		while(list) {
+			tmp = list;
+			list = list->next;
+			tmp->prev = NULL;
+			tmp->next = NULL;
+			/* Repeating timers are armed again before they run, as uv does */
+			if(tmp->period > 0) {
+				tmp->expiry = now + (uint64_t)tmp->period;
+			}
+			tmp->firing = 1;
+			tmp->bnext = NULL;
+			*tail = tmp;
+			tail = &tmp->bnext;
+		}
+
+		/* Skip the empty slots up to the next one in use or the next wrap */
+		next = (wheel.current | WHEEL_MASK) + 1;
+		mask = (idx == WHEEL_MASK) ? 0 : (wheel.used[0] & (~(uint64_t)0 << (idx+1)));
+		if(mask != 0) {
+			next = (wheel.current & ~(uint64_t)WHEEL_MASK) + (uint64_t)__builtin_ctzll(mask);
+		}
+		wheel.current = (next > now+1) ? now+1 : next;
+	}
+	if(wheel.current <= now) {
+		wheel.current = now+1;
+	}
+
+	for(tmp=expired;tmp!=NULL;tmp=tmp->bnext) {
+		if(tmp->period > 0) {
+			wheel_add(tmp);
+		}
+	}
+
+	return expired;
+}
+
+/* The first tick at which a slot expires or cascades */
+static uint64_t wheel_next(void) {
+	uint64_t best = UINT64_MAX, base = 0, round = 0, tick = 0, mask = 0;
+	int level = 0, slot = 0, shift = 0;
+
+	if(wheel.used[0] != 0) {
+		base = wheel.current & ~(uint64_t)WHEEL_MASK;
+		mask = wheel.used[0] & (~(uint64_t)0 << (wheel.current & WHEEL_MASK));
+		if(mask != 0) {
+			best = base + (uint64_t)__builtin_ctzll(mask);
+		} else {
+			best = base + WHEEL_SLOTS + (uint64_t)__builtin_ctzll(wheel.used[0]);
+		}
+	}
+	for(level=1;level<WHEEL_LEVELS;level++) {
+		if(wheel.used[level] == 0) {
+			continue;
+		}
+		shift = WHEEL_BITS*level;
+		round = (uint64_t)1 << (shift+WHEEL_BITS);
+		base = (wheel.current >> (shift+WHEEL_BITS)) << (shift+WHEEL_BITS);
+		for(slot=0;slot<WHEEL_SLOTS;slot++) {
+			if((wheel.used[level] & ((uint64_t)1 << slot)) == 0) {
+				continue;
+			}
+			if((tick = base + ((uint64_t)slot << shift)) < wheel.current) {
+				tick += round;
+			}
+			if(tick < best) {
+				best = tick;
+			}
+		}
+	}
+	return best;
+}
+
+static void wheel_callback(uv_timer_t *req);
+
+static void wheel_arm(void) {
+	uint64_t now = 0, next = 0;
+
+	if(wheel.nr == 0) {
+		if(wheel.timer_req != NULL) {
+			uv_timer_stop(wheel.timer_req);
+		}
+		return;
+	}
+	if(wheel.timer_req == NULL) {
+		if((wheel.timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		uv_timer_init(uv_default_loop(), wheel.timer_req);
+	}
+	now = uv_now(uv_default_loop());
+	next = wheel_next();
+	uv_timer_start(wheel.timer_req, wheel_callback, (next > now) ? next - now : 0, 0);
+}
+
+static void timer_arm(struct lua_timer_t *timer, int timeout, int period) {
+	uint64_t now = uv_now(uv_default_loop());
+
+	wheel_remove(timer);
+	/* An empty wheel starts over at the current time */
+	if(wheel.nr == 0 && wheel.current < now) {
+		wheel.current = now;
+	}
+	timer->expiry = now + (uint64_t)timeout;
+	timer->period = period;
+	wheel_add(timer);
+	wheel_arm();
+}
+
+static void wheel_close(uv_handle_t *handle) {
+	FREE(handle);
+}
+
+void plua_async_gc(void) {
+	if(wheel.timer_req != NULL) {
+		uv_timer_stop(wheel.timer_req);
+		uv_close((uv_handle_t *)wheel.timer_req, wheel_close);
+		wheel.timer_req = NULL;
+	}
+}
+
+static void timer_free(struct lua_timer_t *timer) {
+	if(timer->callback != NULL) {
+		FREE(timer->callback);
+	}
+	if(timer->table != NULL) {
+		plua_metatable_free(timer->table);
+	}
+	FREE(timer);
+}
+
 void plua_async_timer_gc(void *ptr) {
 	struct lua_timer_t *lua_timer = ptr;
 	if(lua_timer != NULL) {
-		if(lua_timer->callback != NULL) {
-			FREE(lua_timer->callback);
-		}
-		if(lua_timer->table != NULL) {
-			plua_metatable_free(lua_timer->table);
+		wheel_remove(lua_timer);
+		/* Freed once the batch it runs in is done */
+		if(lua_timer->firing == 1) {
+			lua_timer->stopped = 1;
+			return;
 		}
-		FREE(lua_timer);
-		lua_timer = NULL;
+		timer_free(lua_timer);
 	}
 }
 
@@ -396,10 +651,8 @@ static void timer_stop(lua_State *L, struct lua_timer_t *timer) {
 	if(timer != NULL) {
 		timer->running = 0;
 		plua_gc_unreg(NULL, timer);
-		if(timer->timer_req != NULL) {
-			uv_timer_stop(timer->timer_req);
-		}
 		plua_async_timer_gc(timer);
+		wheel_arm();
 	}
 }
 
@@ -423,7 +676,6 @@ static int plua_async_timer_stop(lua_State *L) {
 
 static int plua_async_timer_set_timeout(lua_State *L) {
 	struct lua_timer_t *timer = (void *)lua_topointer(L, lua_upvalueindex(1));
-	uv_timer_t *timer_req = NULL;
 
 	if(lua_gettop(L) != 1) {
 		luaL_error(L, "timer.setTimeout requires 1 argument, %d given", lua_gettop(L));
@@ -435,8 +687,6 @@ static int plua_async_timer_set_timeout(lua_State *L) {
 		return 0;
 	}
 
-	timer_req = timer->timer_req;
-
 	char buf[128] = { '\0' }, *p = buf;
 	char *error = "number expected, got %s";
 	int timeout = 0;
@@ -460,7 +710,7 @@ static int plua_async_timer_set_timeout(lua_State *L) {
 	timer->timeout = timeout;
 
 	if(timer->running == 1) {
-		uv_timer_start(timer_req, timer_callback, timer->timeout, timer->timeout);
+		timer_arm(timer, timer->timeout, timer->timeout);
 	}
 
 	plua_ret_true(L);
@@ -470,7 +720,6 @@ static int plua_async_timer_set_timeout(lua_State *L) {
 
 static int plua_async_timer_set_repeat(lua_State *L) {
 	struct lua_timer_t *timer = (void *)lua_topointer(L, lua_upvalueindex(1));
-	uv_timer_t *timer_req = NULL;
 
 	if(lua_gettop(L) != 1) {
 		luaL_error(L, "timer.setRepeat requires 1 argument, %d given", lua_gettop(L));
@@ -482,8 +731,6 @@ static int plua_async_timer_set_repeat(lua_State *L) {
 		return 0;
 	}
 
-	timer_req = timer->timer_req;
-
 	char buf[128] = { '\0' }, *p = buf;
 	char *error = "number expected, got %s";
 	int repeat = 0;
@@ -507,7 +754,7 @@ static int plua_async_timer_set_repeat(lua_State *L) {
 	timer->repeat = repeat;
 
 	if(timer->running == 1) {
-		uv_timer_start(timer_req, timer_callback, timer->timeout, timer->repeat);
+		timer_arm(timer, timer->timeout, timer->repeat);
 	}
 
 	plua_ret_true(L);
@@ -586,7 +833,6 @@ static int plua_async_timer_set_callback(lua_State *L) {
 
 static int plua_async_timer_start(lua_State *L) {
 	struct lua_timer_t *timer = (void *)lua_topointer(L, lua_upvalueindex(1));
-	uv_timer_t *timer_req = NULL;
 
 	if(lua_gettop(L) != 0) {
 		luaL_error(L, "timer.start requires 0 arguments, %d given", lua_gettop(L));
@@ -598,8 +844,6 @@ static int plua_async_timer_start(lua_State *L) {
 		return 0;
 	}
 
-	timer_req = timer->timer_req;
-
 	if(timer->callback == NULL) {
 		if(timer->module != NULL) {
 			luaL_error(L, "%s: timer callback has not been set", timer->module->file);
@@ -614,7 +858,7 @@ static int plua_async_timer_start(lua_State *L) {
 	}
 	timer->running = 1;
 
-	uv_timer_start(timer_req, timer_callback, timer->timeout, timer->repeat);
+	timer_arm(timer, timer->timeout, timer->repeat);
 
 	plua_ret_true(L);
 
@@ -727,19 +971,12 @@ static void plua_async_timer_object(lua_State *L, struct lua_timer_t *timer) {
 	lua_settable(L, -3);
 }
 
-static void timer_callback(uv_timer_t *req) {
-	struct lua_timer_t *timer = req->data;
+static void timer_run(struct lua_state_t *state, struct lua_timer_t *timer) {
 	char name[255], *p = name;
 	memset(name, '\0', 255);
 
-	/*
-	 * Only create a new state once the timer is triggered
-	 */
-	struct lua_state_t *state = plua_get_free_state();
 	state->module = timer->module;
 
-	logprintf(LOG_DEBUG, "lua timer on state #%d", state->idx);
-
 	switch(state->module->type) {
 		case UNITTEST: {
 			sprintf(p, "unittest.%s", state->module->name);
@@ -757,13 +994,15 @@ static void timer_callback(uv_timer_t *req) {
 
 	lua_getglobal(state->L, name);
 	if(lua_type(state->L, -1) == LUA_TNIL) {
-		luaL_error(state->L, "cannot find %s lua module", name);
+		logprintf(LOG_ERR, "cannot find %s lua module", name);
+		lua_settop(state->L, 0);
 		return;
 	}
 
 	lua_getfield(state->L, -1, timer->callback);
 	if(lua_type(state->L, -1) != LUA_TFUNCTION) {
-		luaL_error(state->L, "%s: timer callback %s does not exist", state->module->file, timer->callback);
+		logprintf(LOG_ERR, "%s: timer callback %s does not exist", state->module->file, timer->callback);
+		lua_settop(state->L, 0);
 		return;
 	}
 
@@ -772,18 +1011,60 @@ static void timer_callback(uv_timer_t *req) {
 	if(lua_pcall(state->L, 1, 0, 0) == LUA_ERRRUN) {
 		if(lua_type(state->L, -1) == LUA_TNIL) {
 			logprintf(LOG_ERR, "%s: syntax error", state->module->file);
-			return;
-		}
-		if(lua_type(state->L, -1) == LUA_TSTRING) {
+		} else if(lua_type(state->L, -1) == LUA_TSTRING) {
 			logprintf(LOG_ERR, "%s", lua_tostring(state->L,  -1));
-			lua_pop(state->L, -1);
-			plua_clear_state(state);
-			return;
 		}
 	}
 
-	lua_remove(state->L, 1);
+	lua_settop(state->L, 0);
+}
+
+static void wheel_callback(uv_timer_t *req) {
+	struct lua_timer_t *expired = NULL, *timer = NULL;
+	struct lua_state_t *state = NULL;
+	uint64_t now = uv_now(uv_default_loop());
+	int nr = 0;
+
+	if((expired = wheel_advance(now)) == NULL) {
+		wheel_arm();
+		return;
+	}
+
+	/*
+	 * Only take a state once timers are triggered, and
+	 * share it between all of them.
+	 */
+	if((state = plua_get_free_state()) == NULL) {
+		for(timer=expired;timer!=NULL;timer=timer->bnext) {
+			timer->firing = 0;
+			if(timer->stopped == 0 && timer->linked == 0) {
+				timer->expiry = now + WHEEL_RETRY;
+				wheel_add(timer);
+			}
+		}
+		wheel_arm();
+		return;
+	}
+
+	for(timer=expired;timer!=NULL;timer=timer->bnext) {
+		if(timer->stopped == 0) {
+			timer_run(state, timer);
+			nr++;
+		}
+	}
+	logprintf(LOG_DEBUG, "%d lua timer(s) on state #%d", nr, state->idx);
+
+	while(expired) {
+		timer = expired;
+		expired = expired->bnext;
+		timer->firing = 0;
+		if(timer->stopped == 1) {
+			timer_free(timer);
+		}
+	}
+
 	plua_clear_state(state);
+	wheel_arm();
 }
 
 int plua_async_timer(struct lua_State *L) {
@@ -797,11 +1078,6 @@ int plua_async_timer(struct lua_State *L) {
 		return 0;
 	}
 
-	uv_timer_t *timer_req = MALLOC(sizeof(uv_timer_t));
-	if(timer_req == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
-
 	struct lua_timer_t *lua_timer = MALLOC(sizeof(struct lua_timer_t));
 	if(lua_timer == NULL) {
 		OUT_OF_MEMORY
@@ -814,12 +1090,9 @@ int plua_async_timer(struct lua_State *L) {
 	memset(lua_timer->table, 0, sizeof(struct plua_metatable_t));
 
 	lua_timer->module = state->module;
-	lua_timer->timer_req = timer_req;
 	lua_timer->timeout = -1;
 	lua_timer->L = L;
-	timer_req->data = lua_timer;
 
-	uv_timer_init(uv_default_loop(), timer_req);
 	plua_gc_reg(NULL, lua_timer, plua_async_timer_gc);
 
 	plua_async_timer_object(L, lua_timer);
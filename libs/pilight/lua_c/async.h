@@ -13,6 +13,7 @@
 
 extern int plua_async_thread(struct lua_State *L);
 extern int plua_async_timer(struct lua_State *L);
+extern void plua_async_gc(void);
 
 static const luaL_Reg pilight_async_lib[] = {
 	{"thread", plua_async_thread},
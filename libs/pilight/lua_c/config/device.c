@@ -28,6 +28,9 @@
 #include "../../core/log.h"
 #include "../config.h"
 #include "../../config/config.h"
+#ifndef PILIGHT_REWRITE
+#include "../../config/devices.h"
+#endif
 #include "../../protocols/protocol.h"
 #include "devices/switch.h"
 #include "devices/label.h"
@@ -213,6 +216,172 @@ static int plua_config_device_get_id(lua_State *L) {
 	return 0;
 }
 
+#ifndef PILIGHT_REWRITE
+/*
+ * Read-only views on the live devices structures. Reading
+ * device.values.state or device.values.id[1].unit goes
+ * straight to the settings of the device, instead of first
+ * copying them into lua tables. A view stops returning
+ * values once the devices are garbage collected.
+ */
+#define DEVICE_VIEW "pilight.config.device.view"
+
+typedef enum {
+	VIEW_DEVICE = 0,
+	VIEW_IDS = 1,
+	VIEW_VALUES = 2
+} view_types;
+
+typedef struct plua_device_view_t {
+	int type;
+	unsigned long generation;
+	struct devices_t *device;
+	struct devices_settings_t *setting;
+} plua_device_view_t;
+
+static void plua_config_device_view_push(lua_State *L, int type, struct devices_t *device, struct devices_settings_t *setting);
+
+static void plua_config_device_view_value(lua_State *L, struct devices_values_t *value) {
+	if(value->type == JSON_NUMBER) {
+		lua_pushnumber(L, value->number_);
+	} else if(value->type == JSON_STRING) {
+		lua_pushstring(L, value->string_);
+	} else {
+		lua_pushnil(L);
+	}
+}
+
+static int plua_config_device_view_index(lua_State *L) {
+	struct plua_device_view_t *view = luaL_checkudata(L, 1, DEVICE_VIEW);
+	struct devices_settings_t *setting = NULL;
+	struct devices_values_t *value = NULL;
+	int i = 0, n = 0;
+
+	if(view->generation != devices_generation()) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	switch(view->type) {
+		case VIEW_DEVICE: {
+			if(lua_type(L, 2) != LUA_TSTRING) {
+				break;
+			}
+			if(strcmp(lua_tostring(L, 2), "id") == 0) {
+				plua_config_device_view_push(L, VIEW_IDS, view->device, NULL);
+				return 1;
+			}
+			if((setting = devices_get_setting(view->device, lua_tostring(L, 2))) == NULL ||
+				setting->values == NULL) {
+				break;
+			}
+			if(setting->values->next == NULL) {
+				plua_config_device_view_value(L, setting->values);
+			} else {
+				plua_config_device_view_push(L, VIEW_VALUES, view->device, setting);
+			}
+			return 1;
+		} break;
+		case VIEW_IDS: {
+			if(lua_type(L, 2) != LUA_TNUMBER) {
+				break;
+			}
+			n = (int)lua_tonumber(L, 2);
+			setting = devices_get_setting(view->device, "id");
+			while(setting) {
+				if(strcmp(setting->name, "id") == 0 && ++i == n) {
+					plua_config_device_view_push(L, VIEW_VALUES, view->device, setting);
+					return 1;
+				}
+				setting = setting->next;
+			}
+		} break;
+		case VIEW_VALUES: {
+			value = view->setting->values;
+			if(lua_type(L, 2) == LUA_TNUMBER) {
+				n = (int)lua_tonumber(L, 2);
+				while(value) {
+					if(++i == n) {
+						plua_config_device_view_value(L, value);
+						return 1;
+					}
+					value = value->next;
+				}
+			} else if(lua_type(L, 2) == LUA_TSTRING) {
+				while(value) {
+					if(value->name != NULL && strcmp(value->name, lua_tostring(L, 2)) == 0) {
+						plua_config_device_view_value(L, value);
+						return 1;
+					}
+					value = value->next;
+				}
+			}
+		} break;
+	}
+
+	lua_pushnil(L);
+	return 1;
+}
+
+static int plua_config_device_view_len(lua_State *L) {
+	struct plua_device_view_t *view = luaL_checkudata(L, 1, DEVICE_VIEW);
+	struct devices_settings_t *setting = NULL;
+	struct devices_values_t *value = NULL;
+	int n = 0;
+
+	if(view->generation == devices_generation()) {
+		if(view->type == VIEW_IDS) {
+			setting = devices_get_setting(view->device, "id");
+			while(setting) {
+				if(strcmp(setting->name, "id") == 0) {
+					n++;
+				}
+				setting = setting->next;
+			}
+		} else if(view->type == VIEW_VALUES) {
+			value = view->setting->values;
+			while(value) {
+				n++;
+				value = value->next;
+			}
+		}
+	}
+
+	lua_pushnumber(L, n);
+	return 1;
+}
+
+static int plua_config_device_view_newindex(lua_State *L) {
+	luaL_error(L, "device values are read-only");
+	return 0;
+}
+
+static void plua_config_device_view_push(lua_State *L, int type, struct devices_t *device, struct devices_settings_t *setting) {
+	struct plua_device_view_t *view = lua_newuserdata(L, sizeof(struct plua_device_view_t));
+
+	view->type = type;
+	view->generation = devices_generation();
+	view->device = device;
+	view->setting = setting;
+
+	/* The metatable is shared by all views of a lua state */
+	if(luaL_newmetatable(L, DEVICE_VIEW) == 1) {
+		lua_pushstring(L, "__index");
+		lua_pushcfunction(L, plua_config_device_view_index);
+		lua_settable(L, -3);
+
+		lua_pushstring(L, "__newindex");
+		lua_pushcfunction(L, plua_config_device_view_newindex);
+		lua_settable(L, -3);
+
+		lua_pushstring(L, "__len");
+		lua_pushcfunction(L, plua_config_device_view_len);
+		lua_settable(L, -3);
+	}
+	lua_setmetatable(L, -2);
+}
+#endif
+
 static void plua_config_device_gc(void *ptr) {
 	struct plua_device_t *dev  = ptr;
 	FREE(dev->name);
@@ -237,10 +406,18 @@ int plua_config_device(lua_State *L) {
 		lua_remove(L, -1);
 	}
 
+#ifdef PILIGHT_REWRITE
 	if(devices_select(0, (char *)name, NULL) != 0) {
 		lua_pushnil(L);
 		return 0;
 	}
+#else
+	struct devices_t *device = NULL;
+	if(devices_get((char *)name, &device) != 0) {
+		lua_pushnil(L);
+		return 0;
+	}
+#endif
 
 	struct plua_device_t *dev = MALLOC(sizeof(struct plua_device_t));
 	if(dev == NULL) {
@@ -283,6 +460,12 @@ int plua_config_device(lua_State *L) {
 	lua_pushcclosure(L, plua_config_device_get_action_id, 1);
 	lua_settable(L, -3);
 
+#ifndef PILIGHT_REWRITE
+	lua_pushstring(L, "values");
+	plua_config_device_view_push(L, VIEW_DEVICE, device, NULL);
+	lua_settable(L, -3);
+#endif
+
 	while(devices_select_protocol(0, (char *)name, x++, &protocol) == 0) {
 		switch(protocol->devtype) {
 			case DATETIME:
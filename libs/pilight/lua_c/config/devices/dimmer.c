@@ -16,6 +16,8 @@
 #include "../../../protocols/protocol.h"
 
 #include "../../../core/log.h"
+#include "../../../events/action.h"
+#include "../../../events/transition.h"
 #include "../../config.h"
 #include "dimmer.h"
 
@@ -402,6 +404,46 @@ static int plua_config_device_dimmer_set_dimlevel(lua_State *L) {
 	return 1;
 }
 
+/*
+ * Hands a fade over to the transition scheduler. It runs for
+ * the action that last set the action id of the device.
+ */
+static int plua_config_device_dimmer_transition(lua_State *L) {
+	struct plua_device_t *dev = (void *)lua_topointer(L, lua_upvalueindex(1));
+	unsigned long id = 0;
+	int args[6], i = 0;
+
+	if(dev == NULL) {
+		luaL_error(L, "internal error: device object not passed");
+	}
+
+	if(lua_gettop(L) != 6) {
+		luaL_error(L, "config transition requires 6 arguments, %d given", lua_gettop(L));
+		return 0;
+	}
+
+	for(i=0;i<6;i++) {
+		char buf[128] = { '\0' }, *p = buf;
+		char *error = "number expected, got %s";
+
+		sprintf(p, error, lua_typename(L, lua_type(L, i+1)));
+
+		luaL_argcheck(L,
+			(lua_type(L, i+1) == LUA_TNUMBER),
+			i+1, buf);
+
+		args[i] = (int)lua_tonumber(L, i+1);
+	}
+	lua_pop(L, 6);
+
+	event_action_get_execution_id(dev->name, &id);
+
+	lua_pushboolean(L, event_transition_start(dev->name, id, args[0], args[1], args[2], args[3], args[4], args[5]) == 0);
+
+	assert(lua_gettop(L) == 1);
+
+	return 1;
+}
 
 int plua_config_device_dimmer(lua_State *L, struct plua_device_t *dev) {
 	lua_pushstring(L, "getState");
@@ -439,5 +481,10 @@ int plua_config_device_dimmer(lua_State *L, struct plua_device_t *dev) {
 	lua_pushcclosure(L, plua_config_device_dimmer_send, 1);
 	lua_settable(L, -3);
 
+	lua_pushstring(L, "transition");
+	lua_pushlightuserdata(L, dev);
+	lua_pushcclosure(L, plua_config_device_dimmer_transition, 1);
+	lua_settable(L, -3);
+
 	return 1;
 }
\ No newline at end of file
@@ -62,7 +62,7 @@ int plua_datetime_strptime(struct lua_State *L) {
 	struct tm tm;
 	memset(&tm, 0, sizeof(struct tm));
 
-	if(strptime(datetime, format, &tm) == NULL) {
+	if(datetime_strptime(datetime, format, &tm) == NULL) {
 		luaL_error(L, "strptime is unable to parse \"%s\" as \"%s\" ", datetime, format);
 	}
 
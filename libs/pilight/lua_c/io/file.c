@@ -29,6 +29,9 @@
 #include "../../config/config.h"
 #include "../io.h"
 
+#define ASYNC_READ	0
+#define ASYNC_WRITE	1
+
 typedef struct lua_file_t {
 	struct plua_metatable_t *table;
 	struct plua_module_t *module;
@@ -38,13 +41,33 @@ typedef struct lua_file_t {
 	char *mode;
 	FILE *fp;
 
+	/* Reading and writing in the threadpool */
+	char *callback;
+	char *data;
+	int status;
+	int type;
+	uv_work_t *work_req;
 } lua_file_t;
 
+static void plua_io_file_object(lua_State *L, struct lua_file_t *file);
+
 void plua_io_file_gc(void *ptr) {
 	struct lua_file_t *data = ptr;
 
 	plua_metatable_free(data->table);
 
+	if(data->callback != NULL) {
+		FREE(data->callback);
+	}
+
+	if(data->data != NULL) {
+		FREE(data->data);
+	}
+
+	if(data->work_req != NULL) {
+		FREE(data->work_req);
+	}
+
 	if(data->fp != NULL) {
 		if(fclose(data->fp) != 0) {
 			logprintf(LOG_ERR, "file.gc: could not close file %s with fd (%p)", data->file, data->fp);
@@ -473,9 +496,321 @@ int plua_io_file_seek(struct lua_State *L) {
 	return 1;
 }
 
+static int plua_io_file_set_callback(lua_State *L) {
+	struct lua_file_t *file = (void *)lua_topointer(L, lua_upvalueindex(1));
+	char *func = NULL;
+
+	if(lua_gettop(L) != 1) {
+		luaL_error(L, "file.setCallback requires 1 argument, %d given", lua_gettop(L));
+	}
+
+	if(file == NULL) {
+		luaL_error(L, "internal error: file object not passed");
+	}
+
+	if(file->module == NULL) {
+		luaL_error(L, "internal error: lua state not properly initialized");
+	}
+
+	char buf[128] = { '\0' }, *p = buf, name[255] = { '\0' };
+	char *error = "string expected, got %s";
+
+	sprintf(p, error, lua_typename(L, lua_type(L, -1)));
+
+	luaL_argcheck(L,
+		(lua_type(L, -1) == LUA_TSTRING),
+		1, buf);
+
+	func = (void *)lua_tostring(L, -1);
+	lua_remove(L, -1);
+
+	p = name;
+	switch(file->module->type) {
+		case UNITTEST: {
+			sprintf(p, "unittest.%s", file->module->name);
+		} break;
+		case FUNCTION: {
+			sprintf(p, "function.%s", file->module->name);
+		} break;
+		case OPERATOR: {
+			sprintf(p, "operator.%s", file->module->name);
+		} break;
+		case ACTION: {
+			sprintf(p, "action.%s", file->module->name);
+		} break;
+	}
+
+	lua_getglobal(L, name);
+	if(lua_type(L, -1) == LUA_TNIL) {
+		luaL_error(L, "cannot find %s lua module", file->module->name);
+	}
+
+	lua_getfield(L, -1, func);
+	if(lua_type(L, -1) != LUA_TFUNCTION) {
+		luaL_error(L, "%s: file callback %s does not exist", file->module->file, func);
+	}
+	lua_remove(L, -1);
+	lua_remove(L, -1);
+
+	if(file->callback != NULL) {
+		FREE(file->callback);
+	}
+	if((file->callback = STRDUP(func)) == NULL) {
+		OUT_OF_MEMORY
+	}
+
+	lua_pushboolean(L, 1);
+
+	assert(lua_gettop(L) == 1);
+
+	return 1;
+}
+
+static int plua_io_file_get_data(lua_State *L) {
+	struct lua_file_t *file = (void *)lua_topointer(L, lua_upvalueindex(1));
+
+	if(lua_gettop(L) != 0) {
+		luaL_error(L, "file.getData requires 0 arguments, %d given", lua_gettop(L));
+	}
+
+	if(file == NULL) {
+		luaL_error(L, "internal error: file object not passed");
+	}
+
+	if(file->data != NULL) {
+		lua_pushstring(L, file->data);
+	} else {
+		lua_pushnil(L);
+	}
+
+	assert(lua_gettop(L) == 1);
+
+	return 1;
+}
+
+static int plua_io_file_get_status(lua_State *L) {
+	struct lua_file_t *file = (void *)lua_topointer(L, lua_upvalueindex(1));
+
+	if(lua_gettop(L) != 0) {
+		luaL_error(L, "file.getStatus requires 0 arguments, %d given", lua_gettop(L));
+	}
+
+	if(file == NULL) {
+		luaL_error(L, "internal error: file object not passed");
+	}
+
+	lua_pushboolean(L, file->status);
+
+	assert(lua_gettop(L) == 1);
+
+	return 1;
+}
+
+/*
+ * Runs in the threadpool, so a slow disk doesn't hold the lua
+ * state of the caller for the time it takes.
+ */
+static void async_work(uv_work_t *req) {
+	struct lua_file_t *file = req->data;
+	FILE *fp = NULL;
+	size_t len = 0;
+
+	file->status = 0;
+	if(file->type == ASYNC_READ) {
+		if(file->data != NULL) {
+			FREE(file->data);
+		}
+		if(file_get_contents(file->file, &file->data) == 0) {
+			file->status = 1;
+		}
+	} else {
+		/* Only appending is kept, all other modes replace the file */
+		if(file->mode != NULL && file->mode[0] == 'a') {
+			fp = fopen(file->file, "a");
+		} else {
+			fp = fopen(file->file, "w");
+		}
+		if(fp == NULL) {
+			logprintf(LOG_ERR, "file.writeAsync: could not open file \"%s\"", file->file);
+			return;
+		}
+		len = strlen(file->data);
+		if(fwrite(file->data, 1, len, fp) == len) {
+			file->status = 1;
+		}
+		if(fclose(fp) != 0) {
+			file->status = 0;
+		}
+		FREE(file->data);
+	}
+}
+
+/*
+ * Called in the main loop once the file was read or written,
+ * just like the http callback.
+ */
+static void async_done(uv_work_t *req, int status) {
+	struct lua_file_t *file = req->data;
+	char name[255], *p = name;
+	memset(name, '\0', 255);
+
+	struct lua_state_t *state = plua_get_free_state();
+	state->module = file->module;
+
+	logprintf(LOG_DEBUG, "lua file on state #%d", state->idx);
+
+	switch(state->module->type) {
+		case UNITTEST: {
+			sprintf(p, "unittest.%s", state->module->name);
+		} break;
+		case FUNCTION: {
+			sprintf(p, "function.%s", state->module->name);
+		} break;
+		case OPERATOR: {
+			sprintf(p, "operator.%s", state->module->name);
+		} break;
+		case ACTION: {
+			sprintf(p, "action.%s", state->module->name);
+		} break;
+	}
+
+	lua_getglobal(state->L, name);
+	if(lua_type(state->L, -1) == LUA_TNIL) {
+		luaL_error(state->L, "cannot find %s lua module", name);
+	}
+
+	lua_getfield(state->L, -1, file->callback);
+
+	if(lua_type(state->L, -1) != LUA_TFUNCTION) {
+		luaL_error(state->L, "%s: file callback %s does not exist", state->module->file, file->callback);
+	}
+
+	plua_io_file_object(state->L, file);
+
+	if(lua_pcall(state->L, 1, 0, 0) == LUA_ERRRUN) {
+		if(lua_type(state->L, -1) == LUA_TNIL) {
+			logprintf(LOG_ERR, "%s: syntax error", state->module->file);
+			goto error;
+		}
+		if(lua_type(state->L, -1) == LUA_TSTRING) {
+			logprintf(LOG_ERR, "%s", lua_tostring(state->L,  -1));
+			lua_pop(state->L, -1);
+			plua_clear_state(state);
+			goto error;
+		}
+	}
+	lua_remove(state->L, 1);
+	plua_clear_state(state);
+
+error:
+	plua_io_file_gc(file);
+}
+
+static int async_start(lua_State *L, struct lua_file_t *file, int type) {
+	if(file->callback == NULL) {
+		luaL_error(L, "%s: file callback has not been set", file->module->file);
+	}
+
+	if(file->work_req == NULL) {
+		if((file->work_req = MALLOC(sizeof(uv_work_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+	file->work_req->data = file;
+	file->type = type;
+
+	/* The file object now belongs to the callback */
+	plua_gc_unreg(L, file);
+
+	if(uv_queue_work_priority(uv_default_loop(), file->work_req, "lua file", UV_PRIORITY_LOW, async_work, async_done) < 0) {
+		plua_gc_reg(L, file, plua_io_file_gc);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int plua_io_file_read_async(lua_State *L) {
+	struct lua_file_t *file = (void *)lua_topointer(L, lua_upvalueindex(1));
+
+	if(lua_gettop(L) != 0) {
+		luaL_error(L, "file.readAsync requires 0 arguments, %d given", lua_gettop(L));
+	}
+
+	if(file == NULL) {
+		luaL_error(L, "internal error: file object not passed");
+	}
+
+	lua_pushboolean(L, async_start(L, file, ASYNC_READ) == 0);
+
+	assert(lua_gettop(L) == 1);
+
+	return 1;
+}
+
+static int plua_io_file_write_async(lua_State *L) {
+	struct lua_file_t *file = (void *)lua_topointer(L, lua_upvalueindex(1));
+
+	if(lua_gettop(L) != 1) {
+		luaL_error(L, "file.writeAsync requires 1 argument, %d given", lua_gettop(L));
+	}
+
+	if(file == NULL) {
+		luaL_error(L, "internal error: file object not passed");
+	}
+
+	char buf[128] = { '\0' }, *p = buf;
+	char *error = "string expected, got %s";
+
+	sprintf(p, error, lua_typename(L, lua_type(L, -1)));
+
+	luaL_argcheck(L,
+		(lua_type(L, -1) == LUA_TSTRING),
+		1, buf);
+
+	if(file->data != NULL) {
+		FREE(file->data);
+	}
+	if((file->data = STRDUP((char *)lua_tostring(L, -1))) == NULL) {
+		OUT_OF_MEMORY
+	}
+	lua_remove(L, -1);
+
+	lua_pushboolean(L, async_start(L, file, ASYNC_WRITE) == 0);
+
+	assert(lua_gettop(L) == 1);
+
+	return 1;
+}
+
 static void plua_io_file_object(lua_State *L, struct lua_file_t *file) {
 	lua_newtable(L);
 
+	lua_pushstring(L, "setCallback");
+	lua_pushlightuserdata(L, file);
+	lua_pushcclosure(L, plua_io_file_set_callback, 1);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "readAsync");
+	lua_pushlightuserdata(L, file);
+	lua_pushcclosure(L, plua_io_file_read_async, 1);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "writeAsync");
+	lua_pushlightuserdata(L, file);
+	lua_pushcclosure(L, plua_io_file_write_async, 1);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "getData");
+	lua_pushlightuserdata(L, file);
+	lua_pushcclosure(L, plua_io_file_get_data, 1);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "getStatus");
+	lua_pushlightuserdata(L, file);
+	lua_pushcclosure(L, plua_io_file_get_status, 1);
+	lua_settable(L, -3);
+
 	lua_pushstring(L, "open");
 	lua_pushlightuserdata(L, file);
 	lua_pushcclosure(L, plua_io_file_open, 1);
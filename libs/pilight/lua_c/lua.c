@@ -25,11 +25,13 @@
 
 #include "lua.h"
 #include "lualibrary.h"
+#include "async.h"
 
 #include "../core/log.h"
 #include "../core/json.h"
 #include "../core/mem.h"
 #include "../core/common.h"
+#include "../core/pilight.h"
 
 #ifdef PILIGHT_UNITTEST
 static struct info_t {
@@ -65,6 +67,22 @@ static int init = 0;
 static struct lua_state_t lua_state[NRLUASTATES+1];
 static struct plua_module_t *modules = NULL;
 
+/*
+ * Indexes of the idle states. The pool lock also
+ * guards nrstates and the contention counters.
+ */
+static struct {
+	uv_mutex_t lock;
+	uv_cond_t signal;
+	int free[NRLUASTATES];
+	int nrfree;
+	int nrstates;
+	unsigned long waits;
+	unsigned long timeouts;
+	uint64_t wait;
+	uint64_t maxwait;
+} pool;
+
 /* LCOV_EXCL_START */
 void plua_stack_dump(lua_State *L) {
 	int i = 0;
@@ -199,7 +217,116 @@ void plua_metatable_push(lua_State *L, struct plua_metatable_t *table) {
 	lua_setmetatable(L, -2);
 }
 
-void plua_metatable_free(struct plua_metatable_t *table) {
+/*
+ * Tables with at least this many keys are looked up
+ * through an open-addressing index instead of a scan.
+ */
+#define PLUA_METATABLE_INDEX_MIN	8
+
+static unsigned int plua_metatable_hash(struct varcont_t *key) {
+	if(key->type_ == LUA_TNUMBER) {
+		return (unsigned int)(int)key->number_ * 2654435761u;
+	}
+	return strhash(key->string_);
+}
+
+static void plua_metatable_index_drop(struct plua_metatable_t *node) {
+	if(node->index != NULL) {
+		FREE(node->index);
+	}
+	node->index = NULL;
+	node->nrindex = 0;
+}
+
+static void plua_metatable_index_insert(struct plua_metatable_t *node, int x) {
+	unsigned int mask = (unsigned int)node->nrindex-1;
+	unsigned int i = plua_metatable_hash(&node->table[x].key) & mask;
+
+	while(node->index[i] != 0) {
+		i = (i+1) & mask;
+	}
+	node->index[i] = (unsigned int)x+1;
+}
+
+static void plua_metatable_index_build(struct plua_metatable_t *node) {
+	int x = 0, size = 16;
+
+	plua_metatable_index_drop(node);
+	while(size < node->nrvar*2) {
+		size *= 2;
+	}
+	if((node->index = MALLOC(sizeof(unsigned int)*size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(node->index, 0, sizeof(unsigned int)*size);
+	node->nrindex = size;
+
+	for(x=0;x<node->nrvar;x++) {
+		plua_metatable_index_insert(node, x);
+	}
+}
+
+/*
+ * Returns the position of the key at stack index idx,
+ * or -1 when the table does not hold it.
+ */
+static int plua_metatable_find(lua_State *L, struct plua_metatable_t *node, int idx) {
+	struct varcont_t key;
+	unsigned int mask = 0, i = 0;
+	int x = 0, type = lua_type(L, idx);
+
+	if(node->index == NULL && node->ref == NULL && node->nrvar >= PLUA_METATABLE_INDEX_MIN) {
+		plua_metatable_index_build(node);
+	}
+
+	if(node->index == NULL) {
+		for(x=0;x<node->nrvar;x++) {
+			switch(type) {
+				case LUA_TNUMBER: {
+					if(node->table[x].key.type_ == LUA_TNUMBER &&
+						node->table[x].key.number_ == (int)lua_tonumber(L, idx)) {
+						return x;
+					}
+				} break;
+				case LUA_TSTRING: {
+					if(node->table[x].key.type_ == LUA_TSTRING &&
+						strcmp(node->table[x].key.string_, lua_tostring(L, idx)) == 0) {
+						return x;
+					}
+				} break;
+			}
+		}
+		return -1;
+	}
+
+	memset(&key, 0, sizeof(struct varcont_t));
+	key.type_ = type;
+	if(type == LUA_TNUMBER) {
+		key.number_ = (int)lua_tonumber(L, idx);
+	} else {
+		key.string_ = (char *)lua_tostring(L, idx);
+	}
+
+	mask = (unsigned int)node->nrindex-1;
+	i = plua_metatable_hash(&key) & mask;
+	while(node->index[i] != 0) {
+		x = (int)node->index[i]-1;
+		if(node->table[x].key.type_ == type) {
+			if(type == LUA_TNUMBER && node->table[x].key.number_ == key.number_) {
+				return x;
+			}
+			if(type == LUA_TSTRING && strcmp(node->table[x].key.string_, key.string_) == 0) {
+				return x;
+			}
+		}
+		i = (i+1) & mask;
+	}
+	return -1;
+}
+
+static void plua_metatable_share(struct plua_metatable_t *src, struct plua_metatable_t **dst);
+
+static void plua_metatable_free_entries(struct plua_metatable_t *table) {
 	int x = 0;
 	for(x=0;x<table->nrvar;x++) {
 		if(table->table[x].val.type_ == LUA_TSTRING) {
@@ -215,6 +342,92 @@ void plua_metatable_free(struct plua_metatable_t *table) {
 	if(table->table != NULL) {
 		FREE(table->table);
 	}
+	plua_metatable_index_drop(table);
+}
+
+/*
+ * Give a table that shares its entries with one of its
+ * clones its own copy before it is written to, or before
+ * one of its child tables is handed out. The old entries
+ * are only released after they are copied, so the other
+ * owners can keep reading them meanwhile.
+ */
+static void plua_metatable_unshare(struct plua_metatable_t *node) {
+	struct plua_metatable_t old;
+	int i = 0;
+
+	if(node->ref == NULL) {
+		return;
+	}
+	/* The last owner can take over the entries as they are */
+	if(*node->ref == 1) {
+		FREE(node->ref);
+		node->ref = NULL;
+		return;
+	}
+
+	memcpy(&old, node, sizeof(struct plua_metatable_t));
+
+	node->table = NULL;
+	node->index = NULL;
+	node->nrindex = 0;
+	node->ref = NULL;
+
+	if(old.nrvar > 0) {
+		if((node->table = MALLOC(sizeof(*node->table)*(old.nrvar))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(node->table, 0, sizeof(*node->table)*(old.nrvar));
+	}
+	for(i=0;i<old.nrvar;i++) {
+		node->table[i].key.type_ = old.table[i].key.type_;
+		node->table[i].val.type_ = old.table[i].val.type_;
+
+		if(old.table[i].key.type_ == LUA_TSTRING) {
+			if((node->table[i].key.string_ = STRDUP(old.table[i].key.string_)) == NULL) {
+				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+			}
+		} else {
+			node->table[i].key.number_ = old.table[i].key.number_;
+		}
+
+		switch(old.table[i].val.type_) {
+			case LUA_TSTRING: {
+				if((node->table[i].val.string_ = STRDUP(old.table[i].val.string_)) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+			} break;
+			case LUA_TTABLE: {
+				plua_metatable_share(old.table[i].val.void_, (struct plua_metatable_t **)&node->table[i].val.void_);
+			} break;
+			default: {
+				node->table[i].val.number_ = old.table[i].val.number_;
+			} break;
+		}
+	}
+	if(old.index != NULL) {
+		if((node->index = MALLOC(sizeof(unsigned int)*old.nrindex)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(node->index, old.index, sizeof(unsigned int)*old.nrindex);
+		node->nrindex = old.nrindex;
+	}
+
+	if(__sync_sub_and_fetch(old.ref, 1) == 0) {
+		FREE(old.ref);
+		plua_metatable_free_entries(&old);
+	}
+}
+
+void plua_metatable_free(struct plua_metatable_t *table) {
+	if(table->ref != NULL) {
+		if(__sync_sub_and_fetch(table->ref, 1) > 0) {
+			FREE(table);
+			return;
+		}
+		FREE(table->ref);
+	}
+	plua_metatable_free_entries(table);
 	FREE(table);
 }
 
@@ -231,47 +444,47 @@ int plua_metatable_call(lua_State *L) {
 	return 1;
 }
 
-void plua_metatable_clone(struct plua_metatable_t **src, struct plua_metatable_t **dst) {
-	int i = 0;
-	struct plua_metatable_t *a = *src;
+/*
+ * Let dst share the entries of src. Entries are only
+ * copied by plua_metatable_unshare once either of them
+ * is written to.
+ */
+static void plua_metatable_share(struct plua_metatable_t *src, struct plua_metatable_t **dst) {
+	int *ref = NULL;
 
-	if((*dst) != NULL) {
-		plua_metatable_free((*dst));
-	}
 	if(((*dst) = MALLOC(sizeof(struct plua_metatable_t))) == NULL) {
 		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 	}
 	memset((*dst), 0, sizeof(struct plua_metatable_t));
-	if(((*dst)->table = MALLOC(sizeof(*a->table)*(a->nrvar))) == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-	}
-	memset((*dst)->table, 0, sizeof(*a->table)*(a->nrvar));
-	for(i=0;i<a->nrvar;i++) {
-		(*dst)->table[i].key.type_ = a->table[i].key.type_;
-		(*dst)->table[i].val.type_ = a->table[i].val.type_;
 
-		if(a->table[i].key.type_ == LUA_TSTRING) {
-			if(((*dst)->table[i].key.string_ = STRDUP(a->table[i].key.string_)) == NULL) {
-				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-			}
+	if(src->ref == NULL) {
+		if((ref = MALLOC(sizeof(int))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		if(a->table[i].key.type_ == LUA_TNUMBER) {
-			(*dst)->table[i].key.number_ = a->table[i].key.number_;
+		*ref = 1;
+		if(__sync_bool_compare_and_swap(&src->ref, NULL, ref) == 0) {
+			FREE(ref);
 		}
+	}
+	__sync_add_and_fetch(src->ref, 1);
 
-		if(a->table[i].val.type_ == LUA_TSTRING) {
-			if(((*dst)->table[i].val.string_ = STRDUP(a->table[i].val.string_)) == NULL) {
-				OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-			}
-		}
-		if(a->table[i].val.type_ == LUA_TNUMBER || a->table[i].val.type_ == LUA_TBOOLEAN) {
-			(*dst)->table[i].val.number_ = a->table[i].val.number_;
-		}
-		if(a->table[i].val.type_ == LUA_TTABLE) {
-			plua_metatable_clone((struct plua_metatable_t **)&a->table[i].val.void_, (struct plua_metatable_t **)&(*dst)->table[i].val.void_);
-		}
+	(*dst)->table = src->table;
+	(*dst)->nrvar = src->nrvar;
+	(*dst)->index = src->index;
+	(*dst)->nrindex = src->nrindex;
+	(*dst)->ref = src->ref;
+}
+
+void plua_metatable_clone(struct plua_metatable_t **src, struct plua_metatable_t **dst) {
+	struct plua_metatable_t *a = *src;
+
+	if((*dst) != NULL) {
+		plua_metatable_free((*dst));
+	}
+	if(a->ref == NULL && a->index == NULL && a->nrvar >= PLUA_METATABLE_INDEX_MIN) {
+		plua_metatable_index_build(a);
 	}
-	(*dst)->nrvar = a->nrvar;
+	plua_metatable_share(a, dst);
 }
 
 int plua_metatable_next(lua_State *L) {
@@ -301,6 +514,7 @@ int plua_metatable_next(lua_State *L) {
 				lua_pushstring(L, node->table[iter].val.string_);
 			} break;
 			case LUA_TTABLE: {
+				plua_metatable_unshare(node);
 				plua_metatable_push(L, (struct plua_metatable_t *)node->table[iter].val.void_);
 			} break;
 		}
@@ -349,7 +563,7 @@ int plua_metatable_get(lua_State *L) {
 	struct plua_metatable_t *node = (void *)lua_topointer(L, lua_upvalueindex(1));
 	char buf[128] = { '\0' }, *p = buf;
 	char *error = "string or number expected, got %s";
-	int x = 0, match = 0;
+	int x = 0;
 
 	if(node == NULL) {
 		logprintf(LOG_ERR, "internal error: table object not passed");
@@ -362,42 +576,26 @@ int plua_metatable_get(lua_State *L) {
 		((lua_type(L, -1) == LUA_TSTRING) || (lua_type(L, -1) == LUA_TNUMBER)),
 		1, buf);
 
-	for(x=0;x<node->nrvar;x++) {
-		match = 0;
-		switch(lua_type(L, -1)) {
+	if((x = plua_metatable_find(L, node, -1)) >= 0) {
+		switch(node->table[x].val.type_) {
+			case LUA_TBOOLEAN: {
+				lua_pushboolean(L, node->table[x].val.number_);
+			} break;
 			case LUA_TNUMBER: {
-				if(node->table[x].key.type_ == LUA_TNUMBER &&
-					node->table[x].key.number_ == (int)lua_tonumber(L, -1)) {
-					match = 1;
-				}
+				lua_pushnumber(L, node->table[x].val.number_);
 			} break;
 			case LUA_TSTRING: {
-				if(node->table[x].key.type_ == LUA_TSTRING &&
-				 strcmp(node->table[x].key.string_, lua_tostring(L, -1)) == 0) {
-					match = 1;
-				}
-			}
-		}
-		if(match == 1) {
-			switch(node->table[x].val.type_) {
-				case LUA_TBOOLEAN: {
-					lua_pushboolean(L, node->table[x].val.number_);
-				} break;
-				case LUA_TNUMBER: {
-					lua_pushnumber(L, node->table[x].val.number_);
-				} break;
-				case LUA_TSTRING: {
-					lua_pushstring(L, node->table[x].val.string_);
-				} break;
-				case LUA_TTABLE: {
-					plua_metatable_push(L, (struct plua_metatable_t *)node->table[x].val.void_);
-				} break;
-				default: {
-					lua_pushnil(L);
-				} break;
-			}
-			return 1;
+				lua_pushstring(L, node->table[x].val.string_);
+			} break;
+			case LUA_TTABLE: {
+				plua_metatable_unshare(node);
+				plua_metatable_push(L, (struct plua_metatable_t *)node->table[x].val.void_);
+			} break;
+			default: {
+				lua_pushnil(L);
+			} break;
 		}
+		return 1;
 	}
 	lua_pushnil(L);
 
@@ -423,143 +621,100 @@ void plua_metatable_parse_set(lua_State *L, void *data) {
 		((lua_type(L, -2) == LUA_TSTRING) || (lua_type(L, -2) == LUA_TNUMBER)),
 		1, buf);
 
-	for(x=0;x<node->nrvar;x++) {
-		switch(lua_type(L, -2)) {
+	plua_metatable_unshare(node);
+
+	if((x = plua_metatable_find(L, node, -2)) >= 0) {
+		match = 1;
+		switch(lua_type(L, -1)) {
+			case LUA_TBOOLEAN: {
+				if(node->table[x].val.type_ == LUA_TSTRING) {
+					FREE(node->table[x].val.string_);
+				}
+				if(node->table[x].val.type_ == LUA_TTABLE) {
+					plua_metatable_free(node->table[x].val.void_);
+				}
+				node->table[x].val.number_ = lua_toboolean(L, -1);
+				node->table[x].val.type_ = LUA_TBOOLEAN;
+			} break;
 			case LUA_TNUMBER: {
-				if(node->table[x].key.type_ == LUA_TNUMBER &&
-					node->table[x].key.number_ == (int)lua_tonumber(L, -2)) {
-					match = 1;
+				if(node->table[x].val.type_ == LUA_TSTRING) {
+					FREE(node->table[x].val.string_);
 				}
+				if(node->table[x].val.type_ == LUA_TTABLE) {
+					plua_metatable_free(node->table[x].val.void_);
+				}
+				node->table[x].val.number_ = lua_tonumber(L, -1);
+				node->table[x].val.type_ = LUA_TNUMBER;
 			} break;
 			case LUA_TSTRING: {
-				if(node->table[x].key.type_ == LUA_TSTRING &&
-					strcmp(node->table[x].key.string_, lua_tostring(L, -2)) == 0) {
-					match = 1;
+				if(node->table[x].val.type_ == LUA_TSTRING) {
+					FREE(node->table[x].val.string_);
+				}
+				if(node->table[x].val.type_ == LUA_TTABLE) {
+					plua_metatable_free(node->table[x].val.void_);
+				}
+				if((node->table[x].val.string_ = STRDUP((char *)lua_tostring(L, -1))) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 				}
+				node->table[x].val.type_ = LUA_TSTRING;
 			} break;
-		}
-		if(match == 1) {
-			switch(lua_type(L, -1)) {
-				case LUA_TBOOLEAN: {
-					if(node->table[x].val.type_ == LUA_TSTRING) {
-						FREE(node->table[x].val.string_);
-					}
-					if(node->table[x].val.type_ == LUA_TTABLE) {
-						plua_metatable_free(node->table[x].val.void_);
-					}
-					node->table[x].val.number_ = lua_toboolean(L, -1);
-					node->table[x].val.type_ = LUA_TBOOLEAN;
-				} break;
-				case LUA_TNUMBER: {
-					if(node->table[x].val.type_ == LUA_TSTRING) {
-						FREE(node->table[x].val.string_);
-					}
-					if(node->table[x].val.type_ == LUA_TTABLE) {
-						plua_metatable_free(node->table[x].val.void_);
-					}
-					node->table[x].val.number_ = lua_tonumber(L, -1);
-					node->table[x].val.type_ = LUA_TNUMBER;
-				} break;
-				case LUA_TSTRING: {
-					if(node->table[x].val.type_ == LUA_TSTRING) {
-						FREE(node->table[x].val.string_);
-					}
-					if(node->table[x].val.type_ == LUA_TTABLE) {
-						plua_metatable_free(node->table[x].val.void_);
-					}
-					if((node->table[x].val.string_ = STRDUP((char *)lua_tostring(L, -1))) == NULL) {
-						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-					}
-					node->table[x].val.type_ = LUA_TSTRING;
-				} break;
-				case LUA_TTABLE: {
-					int is_metatable = 0;
-					if(node->table[x].val.type_ == LUA_TSTRING) {
-						FREE(node->table[x].val.string_);
-					}
-					if(node->table[x].val.type_ == LUA_TTABLE) {
-						plua_metatable_free(node->table[x].val.void_);
-					}
-					if((node->table[x].val.void_ = MALLOC(sizeof(struct plua_metatable_t))) == NULL) {
-						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
-					}
-					memset(node->table[x].val.void_, 0, sizeof(struct plua_metatable_t));
-					node->table[x].val.type_ = LUA_TTABLE;
-					if((is_metatable = lua_getmetatable(L, -1)) == 1) {
-						lua_remove(L, -1);
-						if(luaL_getmetafield(L, -1, "__call")) {
-							if(lua_pcall(L, 1, 1, 0) == LUA_ERRRUN) {
-								if(lua_type(L, -1) == LUA_TSTRING) {
-									logprintf(LOG_ERR, "%s", lua_tostring(L, -1));
-									lua_remove(L, -1);
-								}
-							} else {
-								if(lua_type(L, -1) == LUA_TLIGHTUSERDATA) {
-									struct plua_metatable_t *table = lua_touserdata(L, -1);
-									plua_metatable_free(node->table[x].val.void_);
-									plua_metatable_clone(&table, (struct plua_metatable_t **)&node->table[x].val.void_);
-								} else {
-									logprintf(LOG_ERR, "metatable metafield __call does not return userdata");
-								}
+			case LUA_TTABLE: {
+				int is_metatable = 0;
+				if(node->table[x].val.type_ == LUA_TSTRING) {
+					FREE(node->table[x].val.string_);
+				}
+				if(node->table[x].val.type_ == LUA_TTABLE) {
+					plua_metatable_free(node->table[x].val.void_);
+				}
+				if((node->table[x].val.void_ = MALLOC(sizeof(struct plua_metatable_t))) == NULL) {
+					OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+				}
+				memset(node->table[x].val.void_, 0, sizeof(struct plua_metatable_t));
+				node->table[x].val.type_ = LUA_TTABLE;
+				if((is_metatable = lua_getmetatable(L, -1)) == 1) {
+					lua_remove(L, -1);
+					if(luaL_getmetafield(L, -1, "__call")) {
+						if(lua_pcall(L, 1, 1, 0) == LUA_ERRRUN) {
+							if(lua_type(L, -1) == LUA_TSTRING) {
+								logprintf(LOG_ERR, "%s", lua_tostring(L, -1));
+								lua_remove(L, -1);
 							}
 						} else {
-							logprintf(LOG_ERR, "metatable does not the call metafield");
+							if(lua_type(L, -1) == LUA_TLIGHTUSERDATA) {
+								struct plua_metatable_t *table = lua_touserdata(L, -1);
+								plua_metatable_clone(&table, (struct plua_metatable_t **)&node->table[x].val.void_);
+							} else {
+								logprintf(LOG_ERR, "metatable metafield __call does not return userdata");
+							}
 						}
 					} else {
-						lua_pushnil(L);
-						while(lua_next(L, -2) != 0) {
-							plua_metatable_parse_set(L, node->table[x].val.void_);
-							lua_pop(L, 1);
-						}
-					}
-				} break;
-				/*
-				 * Remove key
-				 */
-				case LUA_TNIL: {
-					int i = 0;
-					match = 0;
-					if(node->table[x].key.type_ == LUA_TSTRING) {
-						FREE(node->table[x].key.string_);
-					}
-					if(node->table[x].val.type_ == LUA_TSTRING) {
-						FREE(node->table[x].val.string_);
+						logprintf(LOG_ERR, "metatable does not the call metafield");
 					}
-					if(node->table[x].val.type_ == LUA_TTABLE) {
-						plua_metatable_free(node->table[x].val.void_);
-						FREE(node->table);
-					} else {
-						for(i=x;i<node->nrvar-1;i++) {
-							switch(node->table[i+1].val.type_) {
-								case LUA_TNUMBER: {
-									node->table[i].val.number_ = node->table[i+1].val.number_;
-									node->table[i].val.type_ = node->table[i+1].val.type_;
-								} break;
-								case LUA_TSTRING: {
-									node->table[i].val.string_ = node->table[i+1].val.string_;
-									node->table[i].val.type_ = node->table[i+1].val.type_;
-								} break;
-								case LUA_TTABLE: {
-									node->table[i].val.void_ = node->table[i+1].val.void_;
-									node->table[i].val.type_ = node->table[i+1].val.type_;
-								} break;
-							}
-							switch(node->table[i+1].key.type_) {
-								case LUA_TNUMBER: {
-									node->table[i].key.number_ = node->table[i+1].key.number_;
-									node->table[i].key.type_ = node->table[i+1].key.type_;
-								} break;
-								case LUA_TSTRING: {
-									node->table[i].key.string_ = node->table[i+1].key.string_;
-									node->table[i].key.type_ = node->table[i+1].key.type_;
-								}
-							}
-						}
+				} else {
+					lua_pushnil(L);
+					while(lua_next(L, -2) != 0) {
+						plua_metatable_parse_set(L, node->table[x].val.void_);
+						lua_pop(L, 1);
 					}
-					node->nrvar--;
-				} break;
-			}
-			break;
+				}
+			} break;
+			/*
+			 * Remove key
+			 */
+			case LUA_TNIL: {
+				if(node->table[x].key.type_ == LUA_TSTRING) {
+					FREE(node->table[x].key.string_);
+				}
+				if(node->table[x].val.type_ == LUA_TSTRING) {
+					FREE(node->table[x].val.string_);
+				}
+				if(node->table[x].val.type_ == LUA_TTABLE) {
+					plua_metatable_free(node->table[x].val.void_);
+				}
+				memmove(&node->table[x], &node->table[x+1], sizeof(*node->table)*(node->nrvar-x-1));
+				node->nrvar--;
+				plua_metatable_index_drop(node);
+			} break;
 		}
 	}
 
@@ -602,7 +757,7 @@ void plua_metatable_parse_set(lua_State *L, void *data) {
 							} else {
 								if(lua_type(L, -1) == LUA_TLIGHTUSERDATA) {
 									struct plua_metatable_t *table = lua_touserdata(L, -1);
-									plua_metatable_clone(&table, (struct plua_metatable_t **)&node->table[x].val.void_);
+									plua_metatable_clone(&table, (struct plua_metatable_t **)&node->table[idx].val.void_);
 								} else {
 									logprintf(LOG_ERR, "metatable metafield __call does not return userdata");
 								}
@@ -613,7 +768,7 @@ void plua_metatable_parse_set(lua_State *L, void *data) {
 					} else {
 						lua_pushnil(L);
 						while(lua_next(L, -2) != 0) {
-							plua_metatable_parse_set(L, node->table[x].val.void_);
+							plua_metatable_parse_set(L, node->table[idx].val.void_);
 							lua_pop(L, 1);
 						}
 					}
@@ -632,6 +787,13 @@ void plua_metatable_parse_set(lua_State *L, void *data) {
 				} break;
 			}
 			node->nrvar++;
+			if(node->index != NULL) {
+				if(node->nrvar*2 > node->nrindex) {
+					plua_metatable_index_build(node);
+				} else {
+					plua_metatable_index_insert(node, idx);
+				}
+			}
 		}
 	}
 }
@@ -654,14 +816,313 @@ int plua_metatable_gc(lua_State *L){
 	return 1;
 }
 
-struct lua_state_t *plua_get_free_state(void) {
+static void plua_module_name(struct plua_module_t *module, char *p) {
+	switch(module->type) {
+		case UNITTEST:
+			sprintf(p, "unittest.%s", module->name);
+		break;
+		case OPERATOR:
+			sprintf(p, "operator.%s", module->name);
+		break;
+		case FUNCTION:
+			sprintf(p, "function.%s", module->name);
+		break;
+		case ACTION:
+			sprintf(p, "action.%s", module->name);
+		break;
+		case PROTOCOL:
+			sprintf(p, "protocol.%s", module->name);
+		break;
+		case STORAGE:
+			sprintf(p, "storage.%s", module->name);
+		break;
+	}
+}
+
+#ifdef PILIGHT_UNITTEST
+static void hook(lua_State *L, lua_Debug *ar);
+#endif
+
+/*
+ * Modules are only run in the first state when they are
+ * loaded. The other states run the shared bytecode of a
+ * module the first time they look it up, so a state only
+ * holds the modules it actually used and a new state is up
+ * right away.
+ */
+static int plua_module_index(lua_State *L) {
+	struct plua_module_t *tmp = modules;
+	const char *key = NULL;
+	char name[255];
+
+	if(lua_type(L, 2) != LUA_TSTRING) {
+		return 0;
+	}
+	key = lua_tostring(L, 2);
+	/* All module names are prefixed by their type */
+	if(strchr(key, '.') == NULL) {
+		return 0;
+	}
+
+	while(tmp) {
+		memset(name, '\0', sizeof(name));
+		plua_module_name(tmp, name);
+		if(strcmp(name, key) == 0) {
+			break;
+		}
+		tmp = tmp->next;
+	}
+	if(tmp == NULL) {
+		return 0;
+	}
+
+	if(luaL_loadbuffer(L, tmp->bytecode, tmp->size, tmp->file) != 0 ||
+	   lua_pcall(L, 0, 1, 0) != 0) {
+		logprintf(LOG_ERR, "%s: %s", tmp->file, lua_tostring(L, -1));
+		lua_pop(L, 1);
+		return 0;
+	}
+	if(lua_type(L, -1) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, 1);
+
+	return 1;
+}
+
+/* The most memory in bytes a single state may use, 0 means no limit */
+static size_t memory_limit = 0;
+
+void plua_memory_limit(size_t limit) {
+	memory_limit = limit;
+}
+
+static int plua_pool_class(size_t size) {
+	if(size == 0 || size > LUA_POOL_STEP*LUA_POOL_CLASSES) {
+		return -1;
+	}
+	return (int)((size-1)/LUA_POOL_STEP);
+}
+
+static void plua_pool_put(struct lua_state_t *state, int class, void *ptr) {
+	if(class > -1 && state->mem.nrpool[class] < LUA_POOL_MAX) {
+		*(void **)ptr = state->mem.pool[class];
+		state->mem.pool[class] = ptr;
+		state->mem.nrpool[class]++;
+	} else {
+		_FREE(ptr);
+	}
+}
+
+static void *plua_pool_get(struct lua_state_t *state, int class) {
+	void *ptr = NULL;
+
+	if((ptr = state->mem.pool[class]) != NULL) {
+		state->mem.pool[class] = *(void **)ptr;
+		state->mem.nrpool[class]--;
+		return ptr;
+	}
+	return _MALLOC((size_t)(class+1)*LUA_POOL_STEP);
+}
+
+static void plua_pool_free(struct lua_state_t *state) {
+	void *ptr = NULL;
 	int i = 0;
-	for(i=0;i<NRLUASTATES;i++) {
-		if(uv_mutex_trylock(&lua_state[i].lock) == 0) {
-			return &lua_state[i];
+
+	for(i=0;i<LUA_POOL_CLASSES;i++) {
+		while((ptr = state->mem.pool[i]) != NULL) {
+			state->mem.pool[i] = *(void **)ptr;
+			_FREE(ptr);
 		}
+		state->mem.nrpool[i] = 0;
 	}
-	return NULL;
+}
+
+/*
+ * A state is only used by one thread at a time, so its
+ * pools and counters need no locking. Lua turns a NULL into
+ * a memory error, which stops a runaway script in the state
+ * that went over its limit instead of the whole daemon.
+ * Freeing and shrinking may never fail.
+ */
+static void *plua_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+	struct lua_state_t *state = ud;
+	size_t old = (ptr != NULL) ? osize : 0;
+	int oclass = (ptr != NULL) ? plua_pool_class(osize) : -1;
+	int nclass = plua_pool_class(nsize);
+	void *block = NULL;
+
+	if(nsize == 0) {
+		if(ptr != NULL) {
+			state->mem.used -= old;
+			plua_pool_put(state, oclass, ptr);
+		}
+		return NULL;
+	}
+
+	if(nsize > old && memory_limit > 0 && state->mem.used-old+nsize > memory_limit) {
+		state->mem.rejected++;
+		return NULL;
+	}
+
+	if(ptr != NULL && oclass > -1 && oclass == nclass) {
+		block = ptr;
+	} else if(nclass > -1) {
+		if((block = plua_pool_get(state, nclass)) == NULL) {
+			return (nsize <= old) ? ptr : NULL;
+		}
+		if(ptr != NULL) {
+			memcpy(block, ptr, (old < nsize) ? old : nsize);
+			plua_pool_put(state, oclass, ptr);
+		}
+	} else if(ptr != NULL && oclass == -1) {
+		if((block = _REALLOC(ptr, nsize)) == NULL) {
+			return (nsize <= old) ? ptr : NULL;
+		}
+	} else {
+		if((block = _MALLOC(nsize)) == NULL) {
+			return NULL;
+		}
+		if(ptr != NULL) {
+			memcpy(block, ptr, (old < nsize) ? old : nsize);
+			plua_pool_put(state, oclass, ptr);
+		}
+	}
+
+	state->mem.used = state->mem.used-old+nsize;
+	if(state->mem.used > state->mem.peak) {
+		state->mem.peak = state->mem.used;
+	}
+
+	return block;
+}
+
+static void plua_state_new(struct lua_state_t *state) {
+	lua_State *L = NULL;
+
+	/* LuaJIT on 64 bits only runs with its own allocator */
+	if((L = lua_newstate(plua_alloc, state)) == NULL) {
+		L = luaL_newstate();
+	}
+
+	luaL_openlibs(L);
+	plua_register_library(L);
+
+	lua_getglobal(L, "_G");
+	lua_pushcfunction(L, luaB_pairs);
+	lua_setfield(L, -2, "pairs");
+	lua_pushcfunction(L, luaB_ipairs);
+	lua_setfield(L, -2, "ipairs");
+	lua_pushcfunction(L, luaB_next);
+	lua_setfield(L, -2, "next");
+
+	lua_newtable(L);
+	lua_pushcfunction(L, plua_module_index);
+	lua_setfield(L, -2, "__index");
+	lua_setmetatable(L, -2);
+	lua_remove(L, -1);
+
+#ifdef PILIGHT_UNITTEST
+	lua_sethook(L, hook, LUA_MASKLINE, 0);
+#endif
+
+	lua_gc(L, LUA_GCSETPAUSE, LUA_GC_PAUSE);
+
+	state->L = L;
+}
+
+/*
+ * Take an idle state from the pool, or grow the pool when
+ * it is exhausted. Only other threads than the main thread
+ * wait for a state to come free, the event loop should not
+ * be blocked by a slow action.
+ */
+struct lua_state_t *plua_get_free_state(void) {
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	struct lua_state_t *state = NULL;
+	uint64_t start = 0, now = 0, timeout = (uint64_t)LUASTATE_TIMEOUT * 1000000;
+	int idx = -1, grow = 0;
+
+	uv_mutex_lock(&pool.lock);
+	while(pool.nrfree == 0 && pool.nrstates >= NRLUASTATES) {
+		if(uv_thread_equal(&pth_main_id, &pth_cur_id)) {
+			break;
+		}
+		now = uv_hrtime();
+		if(start == 0) {
+			start = now;
+			pool.waits++;
+		} else if(now - start >= timeout) {
+			break;
+		}
+		if(uv_cond_timedwait(&pool.signal, &pool.lock, timeout - (now - start)) == UV_ETIMEDOUT) {
+			break;
+		}
+	}
+	if(pool.nrfree > 0) {
+		idx = pool.free[--pool.nrfree];
+	} else if(pool.nrstates < NRLUASTATES) {
+		idx = pool.nrstates++;
+		grow = 1;
+	} else {
+		pool.timeouts++;
+	}
+	if(start > 0) {
+		now = uv_hrtime() - start;
+		pool.wait += now;
+		if(now > pool.maxwait) {
+			pool.maxwait = now;
+		}
+	}
+	uv_mutex_unlock(&pool.lock);
+
+	if(idx == -1) {
+		logprintf(LOG_NOTICE, "no lua state available");
+		return NULL;
+	}
+
+	state = &lua_state[idx];
+	uv_mutex_lock(&state->lock);
+	if(grow == 1) {
+		logprintf(LOG_DEBUG, "growing lua state pool to %d states", idx+1);
+		plua_state_new(state);
+	}
+	state->busy = 1;
+	state->uses++;
+
+	return state;
+}
+
+void plua_pool_stats(struct JsonNode *jstats) {
+	unsigned long rejected = 0;
+	size_t used = 0, peak = 0;
+	int busy = 0, i = 0;
+
+	uv_mutex_lock(&pool.lock);
+	busy = pool.nrstates - pool.nrfree;
+	json_append_member(jstats, "lua-states", json_mknumber(pool.nrstates, 0));
+	json_append_member(jstats, "lua-busy", json_mknumber(busy, 0));
+	json_append_member(jstats, "lua-waits", json_mknumber((double)pool.waits, 0));
+	json_append_member(jstats, "lua-timeouts", json_mknumber((double)pool.timeouts, 0));
+	/* In milliseconds */
+	json_append_member(jstats, "lua-wait", json_mknumber((double)pool.wait / 1000000.0, 3));
+	json_append_member(jstats, "lua-maxwait", json_mknumber((double)pool.maxwait / 1000000.0, 3));
+	uv_mutex_unlock(&pool.lock);
+
+	/* Read without locking the states, so just an indication */
+	for(i=0;i<NRLUASTATES;i++) {
+		used += lua_state[i].mem.used;
+		peak = (lua_state[i].mem.peak > peak) ? lua_state[i].mem.peak : peak;
+		rejected += lua_state[i].mem.rejected;
+	}
+	/* In kilobytes */
+	json_append_member(jstats, "lua-memory", json_mknumber((double)used / 1024.0, 0));
+	json_append_member(jstats, "lua-memory-peak", json_mknumber((double)peak / 1024.0, 0));
+	json_append_member(jstats, "lua-memory-rejected", json_mknumber((double)rejected, 0));
 }
 
 struct lua_state_t *plua_get_current_state(lua_State *L) {
@@ -693,9 +1154,30 @@ void plua_clear_state(struct lua_state_t *state) {
 
 	if(state->L != NULL) {
 		assert(lua_gettop(state->L) == 0);
+
+		/* Let the collector catch up before the state nears its limit */
+		if(memory_limit > 0 && state->mem.used > (memory_limit/4)*3) {
+			lua_gc(state->L, LUA_GCSTEP, 0);
+		}
 	}
 
-	uv_mutex_unlock(&state->lock);
+	plua_release_state(state);
+}
+
+/* Unlock a state taken with plua_get_free_state and return it to the pool */
+void plua_release_state(struct lua_state_t *state) {
+	if(state->busy == 1) {
+		state->busy = 0;
+		state->collected = 0;
+		uv_mutex_unlock(&state->lock);
+
+		uv_mutex_lock(&pool.lock);
+		pool.free[pool.nrfree++] = state->idx;
+		uv_mutex_unlock(&pool.lock);
+		uv_cond_signal(&pool.signal);
+	} else {
+		uv_mutex_unlock(&state->lock);
+	}
 }
 
 static int plua_get_table_string_by_key(struct lua_State *L, const char *key, const char **ret) {
@@ -1016,30 +1498,134 @@ static int plua_writer(lua_State *L, const void* p, size_t sz, void* ud) {
 	return 0;
 }
 
+/*
+ * Compiled modules are kept in LUA_CACHE_ROOT, one file per
+ * module path. The first line of a cache file identifies the
+ * source and lua version it was compiled from, any difference
+ * makes it stale and it is simply compiled and written again.
+ */
+static void plua_module_cache_key(char *file, char *key, size_t len) {
+	struct stat st;
+
+	memset(&st, 0, sizeof(struct stat));
+	stat(file, &st);
+	snprintf(key, len, "pilight-bytecode %s %d %lu %lu %s\n",
+#ifdef PILIGHT_LUAJIT
+		LUAJIT_VERSION,
+#else
+		LUA_VERSION,
+#endif
+		(int)sizeof(void *), (unsigned long)st.st_mtime, (unsigned long)st.st_size, file);
+}
+
+static void plua_module_cache_path(char *file, char *path, size_t len) {
+	snprintf(path, len, "%s%08x.luac", LUA_CACHE_ROOT, strhash(file));
+}
+
+static int plua_module_cache_read(char *file, struct plua_module_t *module) {
+	char path[PATH_MAX], key[PATH_MAX+128], line[PATH_MAX+128];
+	struct stat st;
+	FILE *fp = NULL;
+	long size = 0;
+
+	plua_module_cache_path(file, path, sizeof(path));
+	if(stat(path, &st) != 0 || (fp = fopen(path, "rb")) == NULL) {
+		return -1;
+	}
+
+	plua_module_cache_key(file, key, sizeof(key));
+	if(fgets(line, sizeof(line), fp) == NULL || strcmp(line, key) != 0) {
+		fclose(fp);
+		return -1;
+	}
+
+	if((size = (long)st.st_size-(long)strlen(key)) <= 0) {
+		fclose(fp);
+		return -1;
+	}
+	if((module->bytecode = MALLOC(size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if(fread(module->bytecode, 1, size, fp) != (size_t)size) {
+		FREE(module->bytecode);
+		fclose(fp);
+		return -1;
+	}
+	module->size = (int)size;
+	fclose(fp);
+	return 0;
+}
+
+static void plua_module_cache_write(char *file, struct plua_module_t *module) {
+	char path[PATH_MAX], tmp[PATH_MAX+4], key[PATH_MAX+128];
+	FILE *fp = NULL;
+
+#ifdef _WIN32
+	mkdir(LUA_CACHE_ROOT);
+#else
+	mkdir(LUA_CACHE_ROOT, 0755);
+#endif
+
+	plua_module_cache_path(file, path, sizeof(path));
+	plua_module_cache_key(file, key, sizeof(key));
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	if((fp = fopen(tmp, "wb")) == NULL) {
+		logprintf(LOG_DEBUG, "cannot write lua cache %s: %s", tmp, strerror(errno));
+		return;
+	}
+	if(fwrite(key, 1, strlen(key), fp) != strlen(key) ||
+	   fwrite(module->bytecode, 1, module->size, fp) != (size_t)module->size) {
+		fclose(fp);
+		unlink(tmp);
+		return;
+	}
+	fclose(fp);
+#ifdef _WIN32
+	unlink(path);
+#endif
+	if(rename(tmp, path) != 0) {
+		unlink(tmp);
+	}
+}
+
 void plua_module_load(char *file, int type) {
 	struct plua_module_t *module = MALLOC(sizeof(struct plua_module_t));
 	lua_State *L = lua_state[0].L;
 	char name[255] = { '\0' }, *p = name;
-	int i = 0;
+	int cached = 0;
 	if(module == NULL) {
 		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 	}
 	memset(module, 0, sizeof(struct plua_module_t));
 
-	if(luaL_loadfile(L, file) != 0) {
-		logprintf(LOG_ERR, "cannot load lua file: %s", file);
-		lua_pop(L, 1);
-		FREE(module);
-		return;
+	if(plua_module_cache_read(file, module) == 0) {
+		if(luaL_loadbuffer(L, module->bytecode, module->size, file) == 0) {
+			cached = 1;
+		} else {
+			lua_pop(L, 1);
+			FREE(module->bytecode);
+			module->size = 0;
+		}
 	}
-	strcpy(module->file, file);
-	if(lua_dump(L, plua_writer, module) != 0) {
-		logprintf(LOG_ERR, "cannot dump lua file: %s", file);
-		lua_pop(L, 1);
-		FREE(module->bytecode);
-		FREE(module);
-		return;
+
+	if(cached == 0) {
+		if(luaL_loadfile(L, file) != 0) {
+			logprintf(LOG_ERR, "cannot load lua file: %s", file);
+			lua_pop(L, 1);
+			FREE(module);
+			return;
+		}
+		if(lua_dump(L, plua_writer, module) != 0) {
+			logprintf(LOG_ERR, "cannot dump lua file: %s", file);
+			lua_pop(L, 1);
+			FREE(module->bytecode);
+			FREE(module);
+			return;
+		}
+		plua_module_cache_write(file, module);
 	}
+	strcpy(module->file, file);
 
 	lua_pcall(L, 0, LUA_MULTRET, 0);
 
@@ -1055,26 +1641,7 @@ void plua_module_load(char *file, int type) {
 	strcpy(module->file, file);
 	if(plua_module_init(L, file, module) != 0) {
 		memset(p, '\0', sizeof(name));
-		switch(module->type) {
-			case UNITTEST:
-				sprintf(p, "unittest.%s", module->name);
-			break;
-			case OPERATOR:
-				sprintf(p, "operator.%s", module->name);
-			break;
-			case FUNCTION:
-				sprintf(p, "function.%s", module->name);
-			break;
-			case ACTION:
-				sprintf(p, "action.%s", module->name);
-			break;
-			case PROTOCOL:
-				sprintf(p, "protocol.%s", module->name);
-			break;
-			case STORAGE:
-				sprintf(p, "storage.%s", module->name);
-			break;
-		}
+		plua_module_name(module, p);
 
 		module->next = modules;
 		modules = module;
@@ -1085,14 +1652,6 @@ void plua_module_load(char *file, int type) {
 	}
 	lua_setglobal(L, name);
 
-	for(i=1;i<NRLUASTATES;i++) {
-		L = lua_state[i].L;
-		luaL_loadbuffer(L, module->bytecode, module->size, module->name);
-		lua_pcall(L, 0, LUA_MULTRET, 0);
-		assert(lua_type(L, -1) == LUA_TTABLE);
-		lua_setglobal(L, name);
-	}
-
 	lua_getglobal(L, name);
 	if(lua_type(L, -1) == LUA_TNIL) {
 		lua_pop(L, -1);
@@ -1305,27 +1864,23 @@ void plua_init(void) {
 	init = 1;
 
 	int i = 0;
+	memset(&pool, 0, sizeof(pool));
+	uv_mutex_init(&pool.lock);
+	uv_cond_init(&pool.signal);
+
 	for(i=0;i<NRLUASTATES;i++) {
 		memset(&lua_state[i], 0, sizeof(struct lua_state_t));
 		uv_mutex_init(&lua_state[i].lock);
 		uv_mutex_init(&lua_state[i].gc.lock);
-
-		lua_State *L = luaL_newstate();
-
-		luaL_openlibs(L);
-		plua_register_library(L);
-		lua_state[i].L = L;
 		lua_state[i].idx = i;
 
-#ifdef PILIGHT_UNITTEST
-		lua_sethook(L, hook, LUA_MASKLINE, 0);
-#endif
+		if(i < LUASTATES_INIT) {
+			plua_state_new(&lua_state[i]);
+			pool.free[pool.nrfree++] = i;
+			pool.nrstates++;
+		}
 	}
 
-	plua_override_global("pairs", luaB_pairs);
-	plua_override_global("ipairs", luaB_ipairs);
-	plua_override_global("next", luaB_next);
-
 	/*
 	 * Initialize global state garbage collector
 	 */
@@ -1373,10 +1928,12 @@ int plua_module_exists(char *module, int type) {
 	lua_getglobal(L, name);
 	if(lua_type(L, -1) == LUA_TNIL) {
 		lua_pop(L, -1);
+		plua_clear_state(state);
 		return -1;
 	}
 	if(lua_type(L, -1) != LUA_TTABLE) {
 		lua_pop(L, -1);
+		plua_clear_state(state);
 		return -1;
 	}
 	lua_pop(L, -1);
@@ -1472,6 +2029,9 @@ void plua_ret_false(lua_State *L) {
 void plua_override_global(char *name, int (*func)(lua_State *L)) {
 	int i = 0;
 	for(i=0;i<NRLUASTATES;i++) {
+		if(lua_state[i].L == NULL) {
+			continue;
+		}
 		uv_mutex_lock(&lua_state[i].lock);
 
 		lua_getglobal(lua_state[i].L, "_G");
@@ -1513,8 +2073,113 @@ int plua_pcall(struct lua_State *L, char *file, int args, int ret) {
 	return 0;
 }
 
+static uv_prepare_t *gc_req = NULL;
+static uint64_t gc_last = 0;
+static int gc_next = 0;
+
+/*
+ * The global state only registers objects, so its list
+ * is the one that keeps growing. Free slots are dropped and
+ * the list shrinks back to what is still in use.
+ */
+static void plua_gc_compact(struct lua_state_t *state) {
+	int i = 0, x = 0;
+
+	uv_mutex_lock(&state->gc.lock);
+	for(i=0;i<state->gc.nr;i++) {
+		if(state->gc.list[i]->free == 1) {
+			FREE(state->gc.list[i]);
+		} else {
+			state->gc.list[x++] = state->gc.list[i];
+		}
+	}
+	for(i=x;i<state->gc.size;i++) {
+		if(i >= state->gc.nr && state->gc.list[i] != NULL) {
+			FREE(state->gc.list[i]);
+		}
+	}
+	state->gc.nr = x;
+	if(x == 0) {
+		if(state->gc.size > 0) {
+			FREE(state->gc.list);
+		}
+		state->gc.size = 0;
+	} else if(state->gc.size > x+12) {
+		if((state->gc.list = REALLOC(state->gc.list, sizeof(**state->gc.list)*(x+12))) == NULL) {
+			OUT_OF_MEMORY
+		}
+		memset(&state->gc.list[x], 0, sizeof(**state->gc.list)*12);
+		state->gc.size = x+12;
+	} else {
+		for(i=x;i<state->gc.size;i++) {
+			state->gc.list[i] = NULL;
+		}
+	}
+	uv_mutex_unlock(&state->gc.lock);
+}
+
+/*
+ * Runs before the loop waits for events. A state that is
+ * in use is simply skipped, it is tried again next round.
+ */
+static void plua_gc_prepare(uv_prepare_t *req) {
+	struct lua_state_t *state = NULL;
+	uint64_t now = uv_now(uv_default_loop());
+	int i = 0;
+
+	if(now - gc_last < LUA_GC_INTERVAL) {
+		return;
+	}
+	gc_last = now;
+
+	for(i=0;i<NRLUASTATES;i++) {
+		state = &lua_state[gc_next];
+		gc_next = (gc_next+1) % NRLUASTATES;
+
+		if(state->L == NULL || state->collected == 1) {
+			continue;
+		}
+		if(uv_mutex_trylock(&state->lock) != 0) {
+			continue;
+		}
+		if(state->busy == 0) {
+			if(lua_gc(state->L, LUA_GCSTEP, LUA_GC_STEP) == 1) {
+				state->collected = 1;
+			}
+		}
+		uv_mutex_unlock(&state->lock);
+		break;
+	}
+
+	plua_gc_compact(&lua_state[NRLUASTATES]);
+}
+
+void plua_gc_start(void) {
+	if(gc_req != NULL) {
+		return;
+	}
+	if((gc_req = MALLOC(sizeof(uv_prepare_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	uv_prepare_init(uv_default_loop(), gc_req);
+	uv_prepare_start(gc_req, plua_gc_prepare);
+	/* Don't keep the loop alive for this */
+	uv_unref((uv_handle_t *)gc_req);
+}
+
+static void plua_gc_close(uv_handle_t *handle) {
+	FREE(handle);
+}
+
 int plua_gc(void) {
 	struct plua_module_t *tmp = NULL;
+
+	if(gc_req != NULL) {
+		uv_prepare_stop(gc_req);
+		uv_close((uv_handle_t *)gc_req, plua_gc_close);
+		gc_req = NULL;
+	}
+
 	while(modules) {
 		tmp = modules;
 		FREE(tmp->bytecode);
@@ -1528,6 +2193,8 @@ int plua_gc(void) {
 			lua_close(lua_state[i].L);
 			lua_state[i].L = NULL;
 		}
+		plua_pool_free(&lua_state[i]);
+		memset(&lua_state[i].mem, 0, sizeof(lua_state[i].mem));
 		for(x=0;x<lua_state[i].gc.nr;x++) {
 			if(lua_state[i].gc.list[x]->free == 0) {
 				lua_state[i].gc.list[x]->callback(lua_state[i].gc.list[x]->ptr);
@@ -1540,6 +2207,8 @@ int plua_gc(void) {
 		lua_state[i].gc.nr = 0;
 		lua_state[i].gc.size = 0;
 	}
+	/* The timers are gone with their states */
+	plua_async_gc();
 
 	init = 0;
 	logprintf(LOG_DEBUG, "garbage collected lua library");
@@ -12,10 +12,38 @@
 #include <luajit-2.0/lua.h>
 #include <luajit-2.0/lualib.h>
 #include <luajit-2.0/lauxlib.h>
+#include <luajit-2.0/luajit.h>
 
 #include "../libs/pilight/core/common.h"
 
-#define NRLUASTATES	4
+/*
+ * LUASTATES_INIT states are created at start, the pool
+ * grows on demand up to NRLUASTATES. When all of them are
+ * busy, other threads wait up to LUASTATE_TIMEOUT ms.
+ */
+#define LUASTATES_INIT		4
+#define NRLUASTATES				8
+#define LUASTATE_TIMEOUT	1000
+
+/*
+ * Blocks up to LUA_POOL_CLASSES*LUA_POOL_STEP bytes are
+ * rounded up to a multiple of LUA_POOL_STEP and kept for
+ * reuse when freed, up to LUA_POOL_MAX of each size.
+ */
+#define LUA_POOL_STEP			16
+#define LUA_POOL_CLASSES	16
+#define LUA_POOL_MAX			256
+
+/*
+ * Idle states are collected from the event loop, at most
+ * every LUA_GC_INTERVAL ms one state takes a step of about
+ * LUA_GC_STEP kilobytes. The collector itself waits until
+ * memory grew by LUA_GC_PAUSE percent, so it seldom runs while
+ * an action is busy.
+ */
+#define LUA_GC_INTERVAL		100
+#define LUA_GC_STEP				16
+#define LUA_GC_PAUSE			300
 
 #define UNITTEST	0
 #define OPERATOR	1
@@ -31,6 +59,11 @@ typedef struct plua_metatable_t {
 	} *table;
 	int nrvar;
 	int iter[NRLUASTATES];
+	/* Key index, see plua_metatable_find */
+	unsigned int *index;
+	int nrindex;
+	/* Owners of table, NULL while it is not shared */
+	int *ref;
 } plua_metatable_t;
 
 typedef struct plua_module_t {
@@ -52,6 +85,18 @@ typedef struct lua_state_t {
 	struct plua_module_t *module;
 	struct plua_metatable_t *table;
 	int idx;
+	int busy;
+	/* Nothing left to collect since the state was last used */
+	int collected;
+	unsigned long uses;
+
+	struct {
+		size_t used;
+		size_t peak;
+		unsigned long rejected;
+		void *pool[LUA_POOL_CLASSES];
+		int nrpool[LUA_POOL_CLASSES];
+	} mem;
 
 	struct {
 		struct {
@@ -88,6 +133,10 @@ int plua_module_exists(char *, int);
 void plua_metatable_clone(struct plua_metatable_t **, struct plua_metatable_t **);
 struct lua_state_t *plua_get_free_state(void);
 void plua_clear_state(struct lua_state_t *state);
+void plua_release_state(struct lua_state_t *state);
+void plua_pool_stats(struct JsonNode *jstats);
+void plua_memory_limit(size_t limit);
+void plua_gc_start(void);
 struct lua_state_t *plua_get_current_state(lua_State *L);
 struct plua_module_t *plua_get_modules(void);
 void plua_init(void);
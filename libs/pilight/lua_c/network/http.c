@@ -41,10 +41,12 @@ typedef struct lua_http_t {
 	char *mimetype;
 	char *data;
 	char *callback;
+	char *chunk;
 
 	int code;
 	int size;
 	int type;
+	int maxsize;
 } lua_http_t;
 
 static void plua_network_http_object(lua_State *L, struct lua_http_t *http);
@@ -317,9 +319,184 @@ error:
 
 	plua_metatable_free(data->table);
 	FREE(data->callback);
+	if(data->chunk != NULL) {
+		FREE(data->chunk);
+	}
 	FREE(data);
 }
 
+/*
+ * Every piece of a streamed body runs the chunk callback on its
+ * own state. The object stays alive until the normal callback
+ * was called for the end of the response.
+ */
+static void plua_network_http_chunk(char *content, int size, void *userdata) {
+	struct lua_http_t *data = userdata;
+	char name[255], *p = name;
+	memset(name, '\0', 255);
+
+	struct lua_state_t *state = plua_get_free_state();
+	if(state == NULL) {
+		logprintf(LOG_ERR, "no free lua state for the http chunk callback");
+		return;
+	}
+	state->module = data->module;
+
+	switch(state->module->type) {
+		case UNITTEST: {
+			sprintf(p, "unittest.%s", state->module->name);
+		} break;
+		case FUNCTION: {
+			sprintf(p, "function.%s", state->module->name);
+		} break;
+		case OPERATOR: {
+			sprintf(p, "operator.%s", state->module->name);
+		} break;
+		case ACTION: {
+			sprintf(p, "action.%s", state->module->name);
+		} break;
+	}
+
+	lua_getglobal(state->L, name);
+	if(lua_type(state->L, -1) == LUA_TNIL) {
+		luaL_error(state->L, "cannot find %s lua module", name);
+	}
+
+	lua_getfield(state->L, -1, data->chunk);
+
+	if(lua_type(state->L, -1) != LUA_TFUNCTION) {
+		luaL_error(state->L, "%s: http chunk callback %s does not exist", state->module->file, data->chunk);
+	}
+
+	plua_network_http_object(state->L, data);
+
+	data->size = size;
+
+	if(data->data != NULL) {
+		FREE(data->data);
+	}
+	if((data->data = MALLOC(size+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(data->data, content, size);
+	data->data[size] = '\0';
+
+	if(lua_pcall(state->L, 1, 0, 0) == LUA_ERRRUN) {
+		if(lua_type(state->L, -1) == LUA_TNIL) {
+			logprintf(LOG_ERR, "%s: syntax error", state->module->file);
+			return;
+		}
+		if(lua_type(state->L, -1) == LUA_TSTRING) {
+			logprintf(LOG_ERR, "%s", lua_tostring(state->L,  -1));
+			lua_pop(state->L, -1);
+			plua_clear_state(state);
+			return;
+		}
+	}
+	lua_remove(state->L, 1);
+	plua_clear_state(state);
+}
+
+static int plua_network_http_set_chunk_callback(lua_State *L) {
+	struct lua_http_t *http = (void *)lua_topointer(L, lua_upvalueindex(1));
+	char *func = NULL;
+
+	if(lua_gettop(L) != 1) {
+		luaL_error(L, "http.setChunkCallback requires 1 argument, %d given", lua_gettop(L));
+	}
+
+	if(http == NULL) {
+		luaL_error(L, "internal error: http object not passed");
+	}
+
+	if(http->module == NULL) {
+		luaL_error(L, "internal error: lua state not properly initialized");
+	}
+
+	char buf[128] = { '\0' }, *p = buf, name[255] = { '\0' };
+	char *error = "string expected, got %s";
+
+	sprintf(p, error, lua_typename(L, lua_type(L, -1)));
+
+	luaL_argcheck(L,
+		(lua_type(L, -1) == LUA_TSTRING),
+		1, buf);
+
+	func = (void *)lua_tostring(L, -1);
+	lua_remove(L, -1);
+
+	p = name;
+	switch(http->module->type) {
+		case UNITTEST: {
+			sprintf(p, "unittest.%s", http->module->name);
+		} break;
+		case FUNCTION: {
+			sprintf(p, "function.%s", http->module->name);
+		} break;
+		case OPERATOR: {
+			sprintf(p, "operator.%s", http->module->name);
+		} break;
+		case ACTION: {
+			sprintf(p, "action.%s", http->module->name);
+		} break;
+	}
+
+	lua_getglobal(L, name);
+	if(lua_type(L, -1) == LUA_TNIL) {
+		luaL_error(L, "cannot find %s lua module", http->module->name);
+	}
+
+	lua_getfield(L, -1, func);
+	if(lua_type(L, -1) != LUA_TFUNCTION) {
+		luaL_error(L, "%s: http chunk callback %s does not exist", http->module->file, func);
+	}
+	lua_remove(L, -1);
+	lua_remove(L, -1);
+
+	if(http->chunk != NULL) {
+		FREE(http->chunk);
+	}
+	if((http->chunk = STRDUP(func)) == NULL) {
+		OUT_OF_MEMORY
+	}
+
+	lua_pushboolean(L, 1);
+
+	assert(lua_gettop(L) == 1);
+
+	return 1;
+}
+
+static int plua_network_http_set_maxsize(lua_State *L) {
+	struct lua_http_t *http = (void *)lua_topointer(L, lua_upvalueindex(1));
+
+	if(lua_gettop(L) != 1) {
+		luaL_error(L, "http.setMaxSize requires 1 argument, %d given", lua_gettop(L));
+	}
+
+	if(http == NULL) {
+		luaL_error(L, "internal error: http object not passed");
+	}
+
+	char buf[128] = { '\0' }, *p = buf;
+	char *error = "number expected, got %s";
+
+	sprintf(p, error, lua_typename(L, lua_type(L, -1)));
+
+	luaL_argcheck(L,
+		(lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0),
+		1, buf);
+
+	http->maxsize = (int)lua_tonumber(L, -1);
+	lua_remove(L, -1);
+
+	lua_pushboolean(L, 1);
+
+	assert(lua_gettop(L) == 1);
+
+	return 1;
+}
+
 static int plua_network_http_set_callback(lua_State *L) {
 	struct lua_http_t *http = (void *)lua_topointer(L, lua_upvalueindex(1));
 	char *func = NULL;
@@ -390,6 +567,44 @@ static int plua_network_http_set_callback(lua_State *L) {
 	return 1;
 }
 
+static void plua_network_http_work(uv_work_t *req) {
+	struct lua_http_t *http = req->data;
+
+	if(http->type == GET && (http->chunk != NULL || http->maxsize > 0)) {
+		http_get_stream(http->url, http->maxsize, (http->chunk != NULL) ? plua_network_http_chunk : NULL, plua_network_http_callback, http);
+	} else if(http->type == GET) {
+		http_get_content(http->url, plua_network_http_callback, http);
+	} else {
+		http_post_content(http->url, http->mimetype, http->data, plua_network_http_callback, http);
+	}
+}
+
+static void plua_network_http_work_done(uv_work_t *req, int status) {
+	FREE(req);
+}
+
+/*
+ * Resolving the host and connecting can take seconds, so the
+ * request is started from the threadpool. The lua state doesn't
+ * have to wait for it, the result always comes in through the
+ * callback.
+ */
+static int plua_network_http_start(struct lua_http_t *http) {
+	uv_work_t *req = NULL;
+
+	if((req = MALLOC(sizeof(uv_work_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	req->data = http;
+
+	if(uv_queue_work_priority(uv_default_loop(), req, "lua http", UV_PRIORITY_LOW, plua_network_http_work, plua_network_http_work_done) < 0) {
+		FREE(req);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int plua_network_http_get(lua_State *L) {
 	struct lua_http_t *http = (void *)lua_topointer(L, lua_upvalueindex(1));
 
@@ -411,8 +626,13 @@ static int plua_network_http_get(lua_State *L) {
 		luaL_error(L, "http callback not set");
 	}
 
-	if(http_get_content(http->url, plua_network_http_callback, http) != 0) {
-		plua_gc_unreg(http->L, http);
+	/*
+	 * The callback can run as soon as the request is
+	 * queued, so the object is handed over first.
+	 */
+	plua_gc_unreg(http->L, http);
+
+	if(plua_network_http_start(http) != 0) {
 		plua_network_http_gc((void *)http);
 
 		lua_pushboolean(L, 0);
@@ -421,8 +641,6 @@ static int plua_network_http_get(lua_State *L) {
 		return 1;
 	}
 
-	plua_gc_unreg(http->L, http);
-
 	lua_pushboolean(L, 1);
 	assert(lua_gettop(L) == 1);
 
@@ -458,8 +676,13 @@ static int plua_network_http_post(lua_State *L) {
 		luaL_error(L, "http callback not set");
 	}
 
-	if(http_post_content(http->url, http->mimetype, http->data, plua_network_http_callback, http) != 0) {
-		plua_gc_unreg(http->L, http);
+	/*
+	 * The callback can run as soon as the request is
+	 * queued, so the object is handed over first.
+	 */
+	plua_gc_unreg(http->L, http);
+
+	if(plua_network_http_start(http) != 0) {
 		plua_network_http_gc((void *)http);
 
 		lua_pushboolean(L, 0);
@@ -468,8 +691,6 @@ static int plua_network_http_post(lua_State *L) {
 		return 1;
 	}
 
-	plua_gc_unreg(http->L, http);
-
 	lua_pushboolean(L, 1);
 	assert(lua_gettop(L) == 1);
 
@@ -626,6 +847,9 @@ static void plua_network_http_gc(void *ptr) {
 	if(data->callback != NULL) {
 		FREE(data->callback);
 	}
+	if(data->chunk != NULL) {
+		FREE(data->chunk);
+	}
 	FREE(data);
 }
 
@@ -672,6 +896,16 @@ static void plua_network_http_object(lua_State *L, struct lua_http_t *http) {
 	lua_pushcclosure(L, plua_network_http_get_callback, 1);
 	lua_settable(L, -3);
 
+	lua_pushstring(L, "setChunkCallback");
+	lua_pushlightuserdata(L, http);
+	lua_pushcclosure(L, plua_network_http_set_chunk_callback, 1);
+	lua_settable(L, -3);
+
+	lua_pushstring(L, "setMaxSize");
+	lua_pushlightuserdata(L, http);
+	lua_pushcclosure(L, plua_network_http_set_maxsize, 1);
+	lua_settable(L, -3);
+
 	lua_pushstring(L, "get");
 	lua_pushlightuserdata(L, http);
 	lua_pushcclosure(L, plua_network_http_get, 1);
@@ -560,6 +560,45 @@ error:
 	FREE(data);
 }
 
+/*
+ * Resolving the host and connecting can take seconds, so the
+ * mail is sent from the threadpool. Once the request is made
+ * every error is passed on to the callback, so the return value
+ * of sendmail isn't needed.
+ */
+static void plua_network_mail_work(uv_work_t *req) {
+	struct lua_mail_t *mail = req->data;
+
+	sendmail(
+		mail->host,
+		mail->user,
+		mail->password,
+		mail->port,
+		mail->is_ssl,
+		&mail->mail,
+		plua_network_mail_callback);
+}
+
+static void plua_network_mail_work_done(uv_work_t *req, int status) {
+	FREE(req);
+}
+
+static int plua_network_mail_start(struct lua_mail_t *mail) {
+	uv_work_t *req = NULL;
+
+	if((req = MALLOC(sizeof(uv_work_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	req->data = mail;
+
+	if(uv_queue_work_priority(uv_default_loop(), req, "lua mail", UV_PRIORITY_LOW, plua_network_mail_work, plua_network_mail_work_done) < 0) {
+		FREE(req);
+		return -1;
+	}
+
+	return 0;
+}
+
 static int plua_network_mail_send(lua_State *L) {
 	struct lua_mail_t *mail = (void *)lua_topointer(L, lua_upvalueindex(1));
 
@@ -609,14 +648,12 @@ static int plua_network_mail_send(lua_State *L) {
 
 	mail->mail.data = mail;
 
-	if(sendmail(
-		mail->host,
-		mail->user,
-		mail->password,
-		mail->port,
-		mail->is_ssl,
-		&mail->mail,
-		plua_network_mail_callback) != 0) {
+	/*
+	 * Checked here, because once sendmail runs from the
+	 * threadpool there is no one to return the error to.
+	 */
+	if(strcmp(mail->mail.message, ".") == 0) {
+		logprintf(LOG_ERR, "SMTP: message cannot be a single .");
 
 		plua_gc_unreg(mail->L, mail);
 		plua_network_mail_gc((void *)mail);
@@ -627,8 +664,21 @@ static int plua_network_mail_send(lua_State *L) {
 		return 1;
 	}
 
+	/*
+	 * The callback can run as soon as the mail is
+	 * queued, so the object is handed over first.
+	 */
 	plua_gc_unreg(mail->L, mail);
 
+	if(plua_network_mail_start(mail) != 0) {
+		plua_network_mail_gc((void *)mail);
+
+		lua_pushboolean(L, 0);
+		assert(lua_gettop(L) == 1);
+
+		return 1;
+	}
+
 	lua_pushboolean(L, 1);
 	assert(lua_gettop(L) == 1);
 
@@ -82,29 +82,24 @@ static void createMessage(int id, int unit, int state, int all, int dimlevel, in
 }
 
 static void parseCode(void) {
-	int binary[MAX_RAW_LENGTH/4], x = 0, i = 0;
+	unsigned long long binary = 0;
+	int nrbits = arctech_dimmer->rawlen/4;
 
 	if(arctech_dimmer->rawlen>MAX_RAW_LENGTH) {
 		logprintf(LOG_ERR, "arctech_dimmer: parsecode - invalid parameter passed %d", arctech_dimmer->rawlen);
 		return;
 	}
 
-	for(x=0;x<arctech_dimmer->rawlen;x+=4) {
-		if(arctech_dimmer->raw[x+3] > (int)((double)AVG_PULSE_LENGTH*((double)PULSE_MULTIPLIER/2))) {
-			binary[i++] = 1;
-		} else {
-			binary[i++] = 0;
-		}
-	}
+	binary = pulsesToBits(arctech_dimmer->raw, 3, 4, nrbits, (int)((double)AVG_PULSE_LENGTH*((double)PULSE_MULTIPLIER/2)));
 
 	int dimlevel = -1;
 	if(arctech_dimmer->rawlen == MAX_RAW_LENGTH) {
-		dimlevel = binToDecRev(binary, 32, 35);
+		dimlevel = (int)bitsToDecRev(binary, nrbits, 32, 35);
 	}
-	int unit = binToDecRev(binary, 28, 31);
-	int state = binary[27];
-	int all = binary[26];
-	int id = binToDecRev(binary, 0, 25);
+	int unit = (int)bitsToDecRev(binary, nrbits, 28, 31);
+	int state = bitAt(binary, nrbits, 27);
+	int all = bitAt(binary, nrbits, 26);
+	int id = (int)bitsToDecRev(binary, nrbits, 0, 25);
 
 	createMessage(id, unit, state, all, dimlevel, 0);
 }
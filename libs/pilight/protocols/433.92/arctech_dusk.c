@@ -64,25 +64,20 @@ static void createMessage(int id, int unit, int state, int all) {
 }
 
 static void parseCode(void) {
-	int binary[RAW_LENGTH/4], x = 0, i = 0;
+	unsigned long long binary = 0;
+	int nrbits = arctech_dusk->rawlen/4;
 
 	if(arctech_dusk->rawlen>RAW_LENGTH) {
 		logprintf(LOG_ERR, "arctech_dusk: parsecode - invalid parameter passed %d", arctech_dusk->rawlen);
 		return;
 	}
 
-	for(x=0;x<arctech_dusk->rawlen;x+=4) {
-		if(arctech_dusk->raw[x+3] > AVG_PULSE_LENGTH*PULSE_MULTIPLIER) {
-			binary[i++] = 1;
-		} else {
-			binary[i++] = 0;
-		}
-	}
+	binary = pulsesToBits(arctech_dusk->raw, 3, 4, nrbits, AVG_PULSE_LENGTH*PULSE_MULTIPLIER);
 
-	int unit = binToDecRev(binary, 28, 31);
-	int state = binary[27];
-	int all = binary[26];
-	int id = binToDecRev(binary, 0, 25);
+	int unit = (int)bitsToDecRev(binary, nrbits, 28, 31);
+	int state = bitAt(binary, nrbits, 27);
+	int all = bitAt(binary, nrbits, 26);
+	int id = (int)bitsToDecRev(binary, nrbits, 0, 25);
 
 	createMessage(id, unit, state, all);
 }
@@ -73,25 +73,20 @@ static void createMessage(int id, int unit, int state, int all, int learn) {
 }
 
 static void parseCode(void) {
-	int binary[RAW_LENGTH/4], x = 0, i = 0;
+	unsigned long long binary = 0;
+	int nrbits = arctech_screen->rawlen/4;
 
 	if(arctech_screen->rawlen>RAW_LENGTH) {
 		logprintf(LOG_ERR, "arctech_screen: parsecode - invalid parameter passed %d", arctech_screen->rawlen);
 		return;
 	}
 
-	for(x=0;x<arctech_screen->rawlen;x+=4) {
-		if(arctech_screen->raw[x+3] > (int)((double)AVG_PULSE_LENGTH*((double)PULSE_MULTIPLIER/2))) {
-			binary[i++] = 1;
-		} else {
-			binary[i++] = 0;
-		}
-	}
+	binary = pulsesToBits(arctech_screen->raw, 3, 4, nrbits, (int)((double)AVG_PULSE_LENGTH*((double)PULSE_MULTIPLIER/2)));
 
-	int unit = binToDecRev(binary, 28, 31);
-	int state = binary[27];
-	int all = binary[26];
-	int id = binToDecRev(binary, 0, 25);
+	int unit = (int)bitsToDecRev(binary, nrbits, 28, 31);
+	int state = bitAt(binary, nrbits, 27);
+	int all = bitAt(binary, nrbits, 26);
+	int id = (int)bitsToDecRev(binary, nrbits, 0, 25);
 
 	createMessage(id, unit, state, all, 0);
 }
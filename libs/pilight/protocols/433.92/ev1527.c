@@ -58,23 +58,18 @@ static void createMessage(int unitcode, int state) {
 }
 
 static void parseCode(void) {
-	int binary[RAW_LENGTH/2], x = 0, i = 0;
+	unsigned long long binary = 0;
+	int nrbits = (ev1527->rawlen-2)/2;
 
 	if(ev1527->rawlen>RAW_LENGTH) {
 		logprintf(LOG_ERR, "ev1527: parsecode - invalid parameter passed %d", ev1527->rawlen);
 		return;
 	}
 
-	for(x=0;x<ev1527->rawlen-2;x+=2) {
-		if(ev1527->raw[x+3] > (int)((double)AVG_PULSE_LENGTH*((double)PULSE_MULTIPLIER/2))) {
-			binary[i++] = 1;
-		} else {
-			binary[i++] = 0;
-		}
-	}
+	binary = pulsesToBits(ev1527->raw, 3, 2, nrbits, (int)((double)AVG_PULSE_LENGTH*((double)PULSE_MULTIPLIER/2)));
 
-	int unitcode = binToDec(binary, 0, 19);
-	int state = binary[20];
+	int unitcode = (int)bitsToDec(binary, nrbits, 0, 19);
+	int state = bitAt(binary, nrbits, 20);
 	createMessage(unitcode, state);
 }
 
@@ -396,6 +396,8 @@ void quiggGT1000Init(void) {
 	quigg_gt1000->devtype = SWITCH;
 	quigg_gt1000->hwtype = RF433;
 	quigg_gt1000->txrpt = NORMAL_REPEATS;
+	/* A random sequence number is picked when none is given */
+	quigg_gt1000->cache = 0;
 	quigg_gt1000->minrawlen = RAW_LENGTH;
 	quigg_gt1000->maxrawlen = RAW_LENGTH;
 	quigg_gt1000->maxgaplen = (int)PROG_SPACE*1.1;
@@ -78,35 +78,25 @@ static void createMessage(int id, int state, int unit, int all, int learn) {
 }
 
 static void parseCode(void) {
-	int binary[RAW_LENGTH/2], x = 0, dec_unit[4] = {0, 3, 1, 2};
-	int iParity=1, iParityData=-1; // init for even parity
+	unsigned long long binary = 0;
+	int nrbits = quigg_gt7000->rawlen/2, dec_unit[4] = {0, 3, 1, 2};
+	int iParityData = 0;
 
 	if(quigg_gt7000->rawlen>RAW_LENGTH) {
 		logprintf(LOG_ERR, "quigg_gt7000: parsecode - invalid parameter passed %d", quigg_gt7000->rawlen);
 		return;
 	}
 
-	for(x=0; x<quigg_gt7000->rawlen-1; x+=2) {
-		if(quigg_gt7000->raw[x+1] > PULSE_QUIGG_50) {
-			binary[x/2] = 1;
-			if((x / 2) > 11 && (x / 2) < 19) {
-				iParityData = iParity;
-				iParity = -iParity;
-			}
-		} else {
-			binary[x/2] = 0;
-		}
-	}
-
-	if(iParityData < 0)
-		iParityData=0;
+	binary = pulsesToBits(quigg_gt7000->raw, 1, 2, nrbits, PULSE_QUIGG_50);
+	/* Even parity over the bits 12 .. 18 */
+	iParityData = bitsParity(bitsToDecRev(binary, nrbits, 12, 18));
 
-	int id = binToDecRev(binary, 0, 11);
-	int unit = binToDecRev(binary, 12, 13);
-	int all = binToDecRev(binary, 14, 14);
-	int state = binToDecRev(binary, 15, 15);
-	int dimm = binToDecRev(binary, 16, 16);
-	int parity = binToDecRev(binary, 19, 19);
+	int id = (int)bitsToDecRev(binary, nrbits, 0, 11);
+	int unit = (int)bitsToDecRev(binary, nrbits, 12, 13);
+	int all = (int)bitsToDecRev(binary, nrbits, 14, 14);
+	int state = (int)bitsToDecRev(binary, nrbits, 15, 15);
+	int dimm = (int)bitsToDecRev(binary, nrbits, 16, 16);
+	int parity = (int)bitsToDecRev(binary, nrbits, 19, 19);
 	int learn = 0;
 
 	unit = dec_unit[unit];
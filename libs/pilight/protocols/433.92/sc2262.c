@@ -26,58 +26,37 @@
 #include "../../core/dso.h"
 #include "../../core/log.h"
 #include "../protocol.h"
+#include "../ook.h"
 #include "../../core/binary.h"
 #include "../../core/gc.h"
 #include "sc2262.h"
 
-#define PULSE_MULTIPLIER	3
-#define MIN_PULSE_LENGTH	427
-#define MAX_PULSE_LENGTH	444
-#define AVG_PULSE_LENGTH	432
-#define RAW_LENGTH				50
+static const struct ook_field_t fields[] = {
+	{ "systemcode", OOK_NUMBER, 0, 4, 0, 31, { NULL, NULL }, { 0, 0 }, 0 },
+	{ "unitcode", OOK_NUMBER, 5, 9, 0, 31, { NULL, NULL }, { 0, 0 }, 0 },
+	{ "state", OOK_STATE, 11, 11, 0, 0, { "opened", "closed" }, { 0, 1 }, 1 }
+};
+
+static struct ook_t ook = {
+	.pulse = 432,
+	.multiplier = 3,
+	.minfooter = 427,
+	.maxfooter = 444,
+	.rawlen = 50,
+	.period = 4,
+	.offset = 3,
+	.symbols = { { 1, 3, 3, 1 }, { 1, 3, 1, 3 } },
+	.footer = { 1, PULSE_DIV },
+	.fields = fields,
+	.nrfields = sizeof(fields)/sizeof(fields[0])
+};
 
 static int validate(void) {
-	if(sc2262->rawlen == RAW_LENGTH) {
-		if(sc2262->raw[sc2262->rawlen-1] >= (MIN_PULSE_LENGTH*PULSE_DIV) &&
-		   sc2262->raw[sc2262->rawlen-1] <= (MAX_PULSE_LENGTH*PULSE_DIV)) {
-			return 0;
-		}
-	}
-
-	return -1;
-}
-
-static void createMessage(int systemcode, int unitcode, int state) {
-	sc2262->message = json_mkobject();
-	json_append_member(sc2262->message, "systemcode", json_mknumber(systemcode, 0));
-	json_append_member(sc2262->message, "unitcode", json_mknumber(unitcode, 0));
-	if(state == 0) {
-		json_append_member(sc2262->message, "state", json_mkstring("opened"));
-	} else {
-		json_append_member(sc2262->message, "state", json_mkstring("closed"));
-	}
+	return ook_validate(sc2262, &ook);
 }
 
 static void parseCode(void) {
-	int binary[RAW_LENGTH/4], x = 0, i = 0;
-
-	if(sc2262->rawlen>RAW_LENGTH) {
-		logprintf(LOG_ERR, "sc2262: parsecode - invalid parameter passed %d", sc2262->rawlen);
-		return;
-	}
-
-	for(x=0;x<sc2262->rawlen-2;x+=4) {
-		if(sc2262->raw[x+3] > (int)((double)AVG_PULSE_LENGTH*((double)PULSE_MULTIPLIER/2))) {
-			binary[i++] = 1;
-		} else {
-			binary[i++] = 0;
-		}
-	}
-
-	int systemcode = binToDec(binary, 0, 4);
-	int unitcode = binToDec(binary, 5, 9);
-	int state = binary[11];
-	createMessage(systemcode, unitcode, state);
+	ook_parse(sc2262, &ook);
 }
 
 #if !defined(MODULE) && !defined(_WIN32)
@@ -90,10 +69,7 @@ void sc2262Init(void) {
 	protocol_device_add(sc2262, "sc2262", "sc2262 contact sensor");
 	sc2262->devtype = CONTACT;
 	sc2262->hwtype = RF433;
-	sc2262->minrawlen = RAW_LENGTH;
-	sc2262->maxrawlen = RAW_LENGTH;
-	sc2262->maxgaplen = MAX_PULSE_LENGTH*PULSE_DIV;
-	sc2262->mingaplen = MIN_PULSE_LENGTH*PULSE_DIV;
+	ook_init(sc2262, &ook);
 
 	options_add(&sc2262->options, "s", "systemcode", OPTION_HAS_VALUE, DEVICES_ID, JSON_NUMBER, NULL, "^(3[012]?|[012][0-9]|[0-9]{1})$");
 	options_add(&sc2262->options, "u", "unitcode", OPTION_HAS_VALUE, DEVICES_ID, JSON_NUMBER, NULL, "^(3[012]?|[012][0-9]|[0-9]{1})$");
@@ -170,19 +170,26 @@ static int time_override = -1;
 typedef struct data_t {
 	char *name;
 	int id;
-	int interval;
-	uv_timer_t *timer_req;
 
 	double longitude;
 	double latitude;
 
 	char *tz;
+	struct tm tm;
 
 	struct data_t *next;
 } data_t;
 
 static struct data_t *data = NULL;
 
+/*
+ * All datetime devices share a single clock tick. It is
+ * rearmed for every whole second, so the ticks starting a
+ * new minute are not skipped by a drifting timer.
+ */
+static uv_timer_t *timer_req = NULL;
+static time_t last_tick = 0;
+
 #ifdef PILIGHT_REWRITE
 static void *reason_code_received_free(void *param) {
 	struct reason_code_received_t *data = param;
@@ -216,31 +223,44 @@ static void *adaptDevice(int reason, void *param) {
 }
 #endif
 
-static void *thread(void *param) {
-	uv_timer_t *timer_req = param;
-	struct data_t *settings = timer_req->data;
-	struct tm tm;
-	time_t t;
+static void *thread(void *param);
 
-	if(time_override > -1) {
-		t = time_override;
-	} else {
-		t = time(NULL);
-		if(isntpsynced() == 0) {
-			t -= getntpdiff();
+static void timer_close(uv_handle_t *handle) {
+	FREE(handle);
+}
+
+static void timer_arm(void) {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	uv_timer_start(timer_req, (void (*)(uv_timer_t *))thread, 1000-(tv.tv_usec/1000), 0);
+}
+
+static int datetime_local(struct data_t *settings, time_t t) {
+	struct data_t *tmp = data;
+
+	/* Devices in the same timezone share the conversion */
+	while(tmp != settings) {
+		if(strcmp(tmp->tz, settings->tz) == 0) {
+			memcpy(&settings->tm, &tmp->tm, sizeof(struct tm));
+			return 0;
 		}
+		tmp = tmp->next;
 	}
+	return localtime_l(t, &settings->tm, settings->tz);
+}
 
+static void datetime_tick(struct data_t *settings, time_t t) {
 	/* Get UTC time */
-	if(localtime_l(t, &tm, settings->tz) == 0) {
-		int year = tm.tm_year+1900;
-		int month = tm.tm_mon+1;
-		int day = tm.tm_mday;
-		int hour = tm.tm_hour;
-		int minute = tm.tm_min;
-		int second = tm.tm_sec;
-		int weekday = tm.tm_wday+1;
-		int dst = tm.tm_isdst;
+	if(datetime_local(settings, t) == 0) {
+		int year = settings->tm.tm_year+1900;
+		int month = settings->tm.tm_mon+1;
+		int day = settings->tm.tm_mday;
+		int hour = settings->tm.tm_hour;
+		int minute = settings->tm.tm_min;
+		int second = settings->tm.tm_sec;
+		int weekday = settings->tm.tm_wday+1;
+		int dst = settings->tm.tm_isdst;
 
 #ifdef PILIGHT_REWRITE
 		struct reason_code_received_t *data = MALLOC(sizeof(struct reason_code_received_t));
@@ -278,6 +298,33 @@ static void *thread(void *param) {
 	datetime->message = NULL;
 #endif
 	}
+}
+
+static void *thread(void *param) {
+	struct data_t *tmp = data;
+	time_t t;
+
+	if(time_override > -1) {
+		t = time_override;
+	} else {
+		t = time(NULL);
+		if(isntpsynced() == 0) {
+			t -= getntpdiff();
+		}
+		/* The timer fired just before the second boundary */
+		if(t == last_tick) {
+			timer_arm();
+			return (void *)NULL;
+		}
+		last_tick = t;
+	}
+
+	while(tmp) {
+		datetime_tick(tmp, t);
+		tmp = tmp->next;
+	}
+
+	timer_arm();
 
 	return (void *)NULL;
 }
@@ -336,7 +383,6 @@ static struct threadqueue_t *initDev(JsonNode *jdevice) {
 		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 	}
 	memset(node, '\0', sizeof(struct data_t));
-	node->interval = 1;
 
 	if((jid = json_find_member(jdevice, "id"))) {
 		jchild = json_first_child(jid);
@@ -368,17 +414,15 @@ static struct threadqueue_t *initDev(JsonNode *jdevice) {
 	strcpy(node->name, jdevice->key);
 
 	node->next = data;
-	node->timer_req = NULL;
 	data = node;
 
-	if((node->timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
-		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	if(timer_req == NULL) {
+		if((timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		uv_timer_init(uv_default_loop(), timer_req);
+		timer_arm();
 	}
-	node->timer_req->data = node;
-	uv_timer_init(uv_default_loop(), node->timer_req);
-
-	assert(node->interval > 0);
-	uv_timer_start(node->timer_req, (void (*)(uv_timer_t *))thread, node->interval*1000, node->interval*1000);
 #endif
 	return NULL;
 }
@@ -393,12 +437,10 @@ static void threadGC(void) {
 	}
 	protocol_thread_free(datetime);
 #else
-	struct data_t *tmp = data;
-	while(tmp) {
-#ifndef PILIGHT_REWRITE
-		uv_timer_stop(tmp->timer_req);
-#endif
-		tmp = tmp->next;
+	if(timer_req != NULL) {
+		uv_timer_stop(timer_req);
+		uv_close((uv_handle_t *)timer_req, timer_close);
+		timer_req = NULL;
 	}
 #endif
 }
@@ -408,9 +450,6 @@ static void gc(void) {
 	struct data_t *tmp = NULL;
 	while(data) {
 		tmp = data;
-#ifndef PILIGHT_REWRITE
-		uv_timer_stop(tmp->timer_req);
-#endif
 		FREE(tmp->name);
 		data = data->next;
 		FREE(tmp);
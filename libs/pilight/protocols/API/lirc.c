@@ -41,6 +41,7 @@
 #endif
 #include <stdint.h>
 #include <math.h>
+#include <assert.h>
 
 #include "../../core/threads.h"
 #include "../../core/pilight.h"
@@ -52,170 +53,207 @@
 #include "../../core/binary.h"
 #include "../../core/json.h"
 #include "../../core/gc.h"
+#include "../../core/eventpool.h"
 #include "lirc.h"
 
 #ifndef _WIN32
+/* Seconds between connection attempts */
+#define RECONNECT	3
+/* Longest line lircd sends, anything longer is dropped */
+#define MAXLINE		1024
+
 static char socket_path[BUFFER_SIZE];
-static int sockfd = -1;
 
 static unsigned short loop = 1;
-static unsigned short threads = 0;
 static unsigned short initialized = 0;
 
+static uv_poll_t *poll_req = NULL;
+static uv_timer_t *timer_req = NULL;
 
-// Windows
-// #define UNIX_PATH_MAX 108
+static void lirc_connect(uv_timer_t *req);
 
-// struct sockaddr_un {
-	// uint16_t sun_family;
-	// char sun_path[UNIX_PATH_MAX];
-// };
+/*
+ * A line looks like "<code> <repeat> <button> <remote>", it
+ * is split in place so a held key doesn't cost an allocation
+ * per repeat.
+ */
+static void parse(char *line) {
+	char *fields[4], *p = line;
+	int nr = 0, r = 0;
+
+	while(nr < 4) {
+		fields[nr++] = p;
+		if((p = strchr(p, ' ')) == NULL) {
+			break;
+		}
+		*p++ = '\0';
+	}
+	if(nr != 4 || p != NULL) {
+		return;
+	}
 
-static void *thread(void *param) {
-	struct protocol_threads_t *node = (struct protocol_threads_t *)param;
-	struct sockaddr_un addr;
-	struct timeval timeout;
+	r = strtol(fields[1], NULL, 16);
+	lirc->message = json_mkobject();
+	JsonNode *code = json_mkobject();
+	json_append_member(code, "code", json_mkstring(fields[0]));
+	json_append_member(code, "repeat", json_mknumber(r, 0));
+	json_append_member(code, "button", json_mkstring(fields[2]));
+	json_append_member(code, "remote", json_mkstring(fields[3]));
 
-	int nrloops = 0, n = -1, bytes = 0, retry = 0;
-	char recvBuff[BUFFER_SIZE];
-	fd_set fdsread;
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 0;
+	json_append_member(lirc->message, "message", code);
+	json_append_member(lirc->message, "origin", json_mkstring("receiver"));
+	json_append_member(lirc->message, "protocol", json_mkstring(lirc->id));
 
-	/* Clear the server address */
-	memset(&addr, '\0', sizeof(addr));
-	memset(&recvBuff, '\0', BUFFER_SIZE);
+	if(pilight.broadcast != NULL) {
+		pilight.broadcast(lirc->id, lirc->message, PROTOCOL);
+	}
+	json_delete(lirc->message);
+	lirc->message = NULL;
+}
+
+static void close_cb(uv_handle_t *handle) {
+	FREE(handle);
+}
+
+static void lirc_close(void) {
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	uv_poll_t *req = poll_req;
+	int fd = -1, r = 0;
 
-	threads++;
+	if(req != NULL) {
+		poll_req = NULL;
+		custom_poll_data = req->data;
 
-	while(loop) {
-		if(sockfd > -1) {
-			close(sockfd);
-			sockfd = -1;
+		if((r = uv_fileno((uv_handle_t *)req, (uv_os_fd_t *)&fd)) != 0) {
+			logprintf(LOG_ERR, "uv_fileno: %s", uv_strerror(r)); /*LCOV_EXCL_LINE*/
+		}
+		if(fd > -1) {
+			shutdown(fd, SHUT_RDWR);
+			close(fd);
 		}
 
-		if(path_exists(socket_path) == EXIT_SUCCESS) {
-			/* Try to open a new socket */
-			if((sockfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
-				logprintf(LOG_NOTICE, "could not create Lirc socket");
-				break;
-			}
-
-			addr.sun_family=AF_UNIX;
-			strcpy(addr.sun_path, socket_path);
-
-			retry = 0;
-			/* Connect to the server */
-			switch(socket_timeout_connect(sockfd, (struct sockaddr *)&addr, 3)) {
-				case -1:
-					logprintf(LOG_NOTICE, "could not connect to Lirc socket @%s", socket_path);
-					protocol_thread_wait(node, 3, &nrloops);
-					retry = 1;
-				break;
-				case -2:
-					logprintf(LOG_NOTICE, "Lirc socket timeout @%s", socket_path);
-					protocol_thread_wait(node, 3, &nrloops);
-					retry = 1;
-				break;
-				case -3:
-					logprintf(LOG_NOTICE, "Error in Lirc socket connection @%s", socket_path);
-					protocol_thread_wait(node, 3, &nrloops);
-					retry = 1;
-				break;
-				default:
-				break;
-			}
-			if(retry == 1) {
-				continue;
-			}
-
-			while(loop) {
-				FD_ZERO(&fdsread);
-				FD_SET((unsigned long)sockfd, &fdsread);
-
-				do {
-					n = select(sockfd+1, &fdsread, NULL, NULL, &timeout);
-				} while(n == -1 && errno == EINTR && loop);
-
-				if(loop == 0) {
-					break;
-				}
-
-				if(path_exists(socket_path) == EXIT_FAILURE) {
-					break;
-				}
-
-				if(n == -1) {
-					break;
-				} else if(n == 0) {
-					usleep(100000);
-				} else if(n > 0) {
-					if(FD_ISSET((unsigned long)sockfd, &fdsread)) {
-						bytes = (int)recv(sockfd, recvBuff, BUFFER_SIZE, 0);
-						if(bytes <= 0) {
-							break;
-						} else {
-							char **nlarray = NULL;
-							unsigned int e = explode(recvBuff, "\n", &nlarray), t = 0;
-							for(t=0;t<e;t++) {
-								int x = 0, nrspace = 0;
-								for(x=0;x<strlen(nlarray[t]);x++) {
-									if(nlarray[t][x] == ' ') {
-										nrspace++;
-									}
-								}
-								if(nrspace >= 3) {
-									char **array = NULL;
-									unsigned int q = explode(nlarray[t], " ", &array);
-									if(q == 4) {
-										char *code1 = array[0];
-										char *rep = array[1];
-										char *btn = array[2];
-										char *remote = array[3];
-										char *y = NULL;
-										if((y = strstr(remote, "\n")) != NULL) {
-											size_t pos = (size_t)(y-remote);
-											remote[pos] = '\0';
-										}
-										int r = strtol(rep, NULL, 16);
-										lirc->message = json_mkobject();
-										JsonNode *code = json_mkobject();
-										json_append_member(code, "code", json_mkstring(code1));
-										json_append_member(code, "repeat", json_mknumber(r, 0));
-										json_append_member(code, "button", json_mkstring(btn));
-										json_append_member(code, "remote", json_mkstring(remote));
-
-										json_append_member(lirc->message, "message", code);
-										json_append_member(lirc->message, "origin", json_mkstring("receiver"));
-										json_append_member(lirc->message, "protocol", json_mkstring(lirc->id));
-
-										if(pilight.broadcast != NULL) {
-											pilight.broadcast(lirc->id, lirc->message, PROTOCOL);
-										}
-										json_delete(lirc->message);
-										lirc->message = NULL;
-									}
-									array_free(&array, q);
-								}
-							}
-							array_free(&nlarray, t);
-							memset(recvBuff, '\0', BUFFER_SIZE);
-						}
-					}
-				}
-			}
-		} else {
-			sleep(1);
+		uv_poll_stop(req);
+		if(!uv_is_closing((uv_handle_t *)req)) {
+			uv_close((uv_handle_t *)req, close_cb);
+		}
+		if(custom_poll_data != NULL) {
+			uv_custom_poll_free(custom_poll_data);
 		}
+		req->data = NULL;
+	}
+
+	if(loop == 1) {
+		uv_timer_start(timer_req, lirc_connect, RECONNECT*1000, 0);
 	}
+}
+
+static void custom_close_cb(uv_poll_t *req) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
 
-	if(sockfd > -1) {
-		close(sockfd);
-		sockfd = -1;
+	if(req == poll_req) {
+		lirc_close();
 	}
+}
 
-	threads--;
-	return (void *)NULL;
+static void write_cb(uv_poll_t *req) {
+	uv_custom_read(req);
+}
+
+static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct iobuf_t *io = &custom_poll_data->recv_iobuf;
+	char line[MAXLINE+1], *nl = NULL;
+	ssize_t len = 0;
+
+	if(*nread == -1) {
+		lirc_close();
+		return;
+	}
+	if(buf == NULL) {
+		uv_custom_read(req);
+		return;
+	}
+
+	while(io->len > 0 && (nl = memchr(io->buf, '\n', (size_t)io->len)) != NULL) {
+		len = nl-io->buf;
+		if(len <= MAXLINE) {
+			memcpy(line, io->buf, (size_t)len);
+			line[len] = '\0';
+			parse(line);
+		}
+		iobuf_remove(io, (size_t)len+1);
+	}
+	if(io->len > MAXLINE) {
+		iobuf_remove(io, (size_t)io->len);
+	}
+
+	uv_custom_read(req);
+}
+
+static void lirc_connect(uv_timer_t *req) {
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	struct sockaddr_un addr;
+	uv_poll_t *poll = NULL;
+	int fd = -1, r = 0;
+
+	if(path_exists(socket_path) != EXIT_SUCCESS) {
+		lirc_close();
+		return;
+	}
+
+	if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+		logprintf(LOG_NOTICE, "could not create Lirc socket");
+		lirc_close();
+		return;
+	}
+
+	long arg = fcntl(fd, F_GETFL, NULL);
+	fcntl(fd, F_SETFL, arg | O_NONBLOCK);
+
+	memset(&addr, '\0', sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, socket_path, sizeof(addr.sun_path)-1);
+
+	if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 &&
+	   !(errno == EINPROGRESS || errno == EAGAIN || errno == EISCONN)) {
+		logprintf(LOG_NOTICE, "could not connect to Lirc socket @%s", socket_path);
+		close(fd);
+		lirc_close();
+		return;
+	}
+
+	if((poll = MALLOC(sizeof(uv_poll_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+
+	uv_custom_poll_init(&custom_poll_data, poll, NULL);
+	custom_poll_data->write_cb = write_cb;
+	custom_poll_data->read_cb = read_cb;
+	custom_poll_data->close_cb = custom_close_cb;
+
+	if((r = uv_poll_init_socket(uv_default_loop(), poll, fd)) != 0) {
+		/*LCOV_EXCL_START*/
+		logprintf(LOG_ERR, "uv_poll_init_socket: %s", uv_strerror(r));
+		uv_custom_poll_free(custom_poll_data);
+		FREE(poll);
+		close(fd);
+		lirc_close();
+		return;
+		/*LCOV_EXCL_STOP*/
+	}
+
+	poll_req = poll;
+	uv_custom_write(poll);
 }
 
 struct threadqueue_t *initDev(JsonNode *jdevice) {
@@ -223,20 +261,26 @@ struct threadqueue_t *initDev(JsonNode *jdevice) {
 
 	if(initialized == 0) {
 		initialized = 1;
-		struct protocol_threads_t *node = protocol_thread_init(lirc, NULL);
-		return threads_register("lirc", &thread, (void *)node, 0);
-	} else {
-		return NULL;
+
+		if((timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		uv_timer_init(uv_default_loop(), timer_req);
+		lirc_connect(timer_req);
 	}
+	return NULL;
 }
 
 static void threadGC(void) {
 	loop = 0;
-	protocol_thread_stop(lirc);
-	while(threads > 0) {
-		usleep(10);
+	if(timer_req != NULL) {
+		uv_timer_stop(timer_req);
+	}
+	lirc_close();
+	if(timer_req != NULL) {
+		uv_close((uv_handle_t *)timer_req, close_cb);
+		timer_req = NULL;
 	}
-	protocol_thread_free(lirc);
 	initialized = 0;
 }
 #endif
@@ -268,7 +312,7 @@ void lircInit(void) {
 #if defined(MODULE) && !defined(_WIN32)
 void compatibility(struct module_t *module) {
 	module->name = "lirc";
-	module->version = "1.10";
+	module->version = "2.0";
 	module->reqversion = "6.0";
 	module->reqcommit = "84";
 }
@@ -528,7 +528,7 @@ static void thread(uv_work_t *req) {
 	snprintf(parsed, 1024, url, enc, settings->country, settings->api);
 	FREE(enc);
 
-	http_get_content(parsed, callback, settings);
+	http_get_content_cached(parsed, min_interval, callback, settings);
 	return;
 }
 
@@ -541,7 +541,7 @@ static void *update(void *param) {
 		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 	}
 	work_req->data = settings;
-	uv_queue_work(uv_default_loop(), work_req, "openweathermap", thread, thread_free);
+	uv_queue_work_priority(uv_default_loop(), work_req, "openweathermap", UV_PRIORITY_LOW, thread, thread_free);
 	if(time_override > -1) {
 		settings->update = time_override;
 	} else {
@@ -819,7 +819,7 @@ static int createCode(JsonNode *code) {
 						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 					}
 					work_req->data = tmp;
-					uv_queue_work(uv_default_loop(), work_req, "openweathermap", thread, thread_free);
+					uv_queue_work_priority(uv_default_loop(), work_req, "openweathermap", UV_PRIORITY_LOW, thread, thread_free);
 
 					if(time_override > -1) {
 						tmp->update = time_override;
@@ -27,6 +27,7 @@
 #include <sys/stat.h>
 #include <signal.h>
 #include <math.h>
+#include <assert.h>
 #ifndef _WIN32
 	#ifdef __mips__
 		#define __USE_UNIX98
@@ -47,12 +48,6 @@
 #include "program.h"
 
 #ifndef _WIN32
-static unsigned short loop = 1;
-static unsigned short threads = 0;
-
-static pthread_mutex_t lock;
-static pthread_mutexattr_t attr;
-
 typedef struct settings_t {
 	char *name;
 	char *arguments;
@@ -60,91 +55,225 @@ typedef struct settings_t {
 	char *start;
 	char *stop;
 	int wait;
+	/* What the pending command should do, 1 is start */
+	int action;
+	int interval;
 	int currentstate;
 	int laststate;
-	pthread_t pth;
-	int hasthread;
-	protocol_threads_t *thread;
+	/* Last known pid of the program */
+	pid_t pid;
+	uv_timer_t *timer_req;
+	uv_async_t *async_req;
+	uv_process_t *process_req;
 	struct settings_t *next;
 } settings_t;
 
 static struct settings_t *settings = NULL;
 
-static void *thread(void *param) {
-	struct protocol_threads_t *pnode = (struct protocol_threads_t *)param;
-	struct JsonNode *json = (struct JsonNode *)pnode->param;
+/*
+ * Checks if the pid we found before still runs the same
+ * program, which only takes a read of its command line
+ * instead of a scan of all of /proc.
+ */
+static int procmatch(pid_t pid, char *prog, char *args) {
+	char fname[64], cmdline[1024];
+	int fd = -1, len = 0, i = 0, match = 0;
+
+	snprintf(fname, sizeof(fname), "/proc/%d/cmdline", (int)pid);
+	if((fd = open(fname, O_RDONLY, 0)) < 0) {
+		return 0;
+	}
+	memset(cmdline, '\0', sizeof(cmdline));
+	len = (int)read(fd, cmdline, sizeof(cmdline)-1);
+	close(fd);
+	if(len <= 0) {
+		return 0;
+	}
+
+	/* The arguments are compared as one space separated string */
+	for(i=(int)strlen(cmdline)+1;i<len-1;i++) {
+		if(cmdline[i] == '\0') {
+			cmdline[i] = ' ';
+		}
+	}
+	if(strcmp(cmdline, prog) == 0) {
+		i = (int)strlen(cmdline)+1;
+		if(args == NULL) {
+			match = 1;
+		} else if(i < len && strcmp(&cmdline[i], args) == 0) {
+			match = 1;
+		}
+	}
+
+	return match;
+}
+
+static pid_t running(struct settings_t *node) {
+	pid_t pid = node->pid;
+	int *ret = NULL, n = 0;
+
+	if(node->program == NULL) {
+		return 0;
+	}
+	if(pid > 0 && procmatch(pid, node->program, node->arguments) == 1) {
+		return pid;
+	}
+
+	pid = 0;
+	if((n = (int)findproc(node->program, node->arguments, 0, &ret)) > 0) {
+		pid = ret[0];
+		FREE(ret);
+	}
+	return pid;
+}
+
+static void poll_cb(uv_timer_t *req) {
+	struct settings_t *lnode = req->data;
+
+	if(lnode->wait == 0) {
+		struct JsonNode *message = json_mkobject();
+
+		JsonNode *code = json_mkobject();
+		json_append_member(code, "name", json_mkstring(lnode->name));
+
+		if((lnode->pid = running(lnode)) > 0) {
+			lnode->currentstate = 1;
+			json_append_member(code, "state", json_mkstring("running"));
+			json_append_member(code, "pid", json_mknumber(lnode->pid, 0));
+		} else {
+			lnode->currentstate = 0;
+			json_append_member(code, "state", json_mkstring("stopped"));
+			json_append_member(code, "pid", json_mknumber(0, 0));
+		}
+		json_append_member(message, "message", code);
+		json_append_member(message, "origin", json_mkstring("receiver"));
+		json_append_member(message, "protocol", json_mkstring(program->id));
+
+		if(lnode->currentstate != lnode->laststate) {
+			lnode->laststate = lnode->currentstate;
+			if(pilight.broadcast != NULL) {
+				pilight.broadcast(program->id, message, PROTOCOL);
+			}
+		}
+		json_delete(message);
+		message = NULL;
+	}
+}
+
+static void close_cb(uv_handle_t *handle) {
+	FREE(handle);
+}
+
+static void exit_cb(uv_process_t *req, int64_t exit_status, int term_signal) {
+	struct settings_t *p = req->data;
+
+	uv_close((uv_handle_t *)req, close_cb);
+
+	if(p == NULL) {
+		return;
+	}
+	p->process_req = NULL;
+	p->wait = 0;
+	p->laststate = -1;
+	p->pid = 0;
+
+	/* Report the new state right away */
+	proc_cache_clear();
+	poll_cb(p->timer_req);
+}
+
+/*
+ * The command runs through the shell like system() would,
+ * but without a thread waiting for it to finish.
+ */
+static void execute(uv_async_t *req) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct settings_t *p = req->data;
+	uv_process_options_t options;
+	char *args[4];
+	int r = 0;
+
+	if(p->wait == 0 || p->process_req != NULL) {
+		return;
+	}
+
+	args[0] = "sh";
+	args[1] = "-c";
+	args[2] = (p->action == 1) ? p->start : p->stop;
+	args[3] = NULL;
+
+	memset(&options, 0, sizeof(uv_process_options_t));
+	options.file = "/bin/sh";
+	options.args = args;
+	options.exit_cb = exit_cb;
+
+	if((p->process_req = MALLOC(sizeof(uv_process_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	p->process_req->data = p;
+
+	if((r = uv_spawn(uv_default_loop(), p->process_req, &options)) != 0) {
+		logprintf(LOG_NOTICE, "program \"%s\" could not be executed: %s", p->name, uv_strerror(r));
+		uv_close((uv_handle_t *)p->process_req, close_cb);
+		p->process_req = NULL;
+		p->wait = 0;
+		p->laststate = -1;
+	}
+}
+
+static struct threadqueue_t *initDev(JsonNode *jdevice) {
 	struct JsonNode *jid = NULL;
 	struct JsonNode *jchild = NULL;
 	struct JsonNode *jchild1 = NULL;
 	char *prog = NULL, *args = NULL, *stopcmd = NULL, *startcmd = NULL;
-
-	int interval = 1, nrloops = 0;
 	double itmp = 0;
 
-	threads++;
-
-	json_find_string(json, "program", &prog);
-	json_find_string(json, "arguments", &args);
-	json_find_string(json, "stop-command", &stopcmd);
-	json_find_string(json, "start-command", &startcmd);
+	json_find_string(jdevice, "program", &prog);
+	json_find_string(jdevice, "arguments", &args);
+	json_find_string(jdevice, "stop-command", &stopcmd);
+	json_find_string(jdevice, "start-command", &startcmd);
 
 	struct settings_t *lnode = MALLOC(sizeof(struct settings_t));
-	lnode->wait = 0;
-	lnode->hasthread = 0;
-	memset(&lnode->pth, '\0', sizeof(pthread_t));
+	if(lnode == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(lnode, '\0', sizeof(struct settings_t));
 
 	if(args != NULL && strlen(args) > 0) {
-		if((lnode->arguments = MALLOC(strlen(args)+1)) == NULL) {
-			fprintf(stderr, "out of memory\n");
-			exit(EXIT_FAILURE);
+		if((lnode->arguments = STRDUP(args)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		strcpy(lnode->arguments, args);
-	} else {
-		lnode->arguments = NULL;
 	}
-
 	if(prog != NULL) {
-		if((lnode->program = MALLOC(strlen(prog)+1)) == NULL) {
-			fprintf(stderr, "out of memory\n");
-			exit(EXIT_FAILURE);
+		if((lnode->program = STRDUP(prog)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		strcpy(lnode->program, prog);
-	} else {
-		lnode->program = NULL;
 	}
-
 	if(stopcmd != NULL) {
-		if((lnode->stop = MALLOC(strlen(stopcmd)+1)) == NULL) {
-			fprintf(stderr, "out of memory\n");
-			exit(EXIT_FAILURE);
+		if((lnode->stop = STRDUP(stopcmd)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		strcpy(lnode->stop, stopcmd);
-	} else {
-		lnode->stop = NULL;
 	}
-
 	if(startcmd != NULL) {
-		if((lnode->start = MALLOC(strlen(startcmd)+1)) == NULL) {
-			fprintf(stderr, "out of memory\n");
-			exit(EXIT_FAILURE);
+		if((lnode->start = STRDUP(startcmd)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-		strcpy(lnode->start, startcmd);
-	} else {
-		lnode->start = NULL;
 	}
 
-	lnode->name = NULL;
-	if((jid = json_find_member(json, "id"))) {
+	if((jid = json_find_member(jdevice, "id"))) {
 		jchild = json_first_child(jid);
 		while(jchild) {
 			jchild1 = json_first_child(jchild);
 			while(jchild1) {
 				if(strcmp(jchild1->key, "name") == 0) {
-					if((lnode->name = MALLOC(strlen(jchild1->string_)+1)) == NULL) {
-						fprintf(stderr, "out of memory\n");
-						exit(EXIT_FAILURE);
+					if((lnode->name = STRDUP(jchild1->string_)) == NULL) {
+						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 					}
-					strcpy(lnode->name, jchild1->string_);
 				}
 				jchild1 = jchild1->next;
 			}
@@ -152,97 +281,29 @@ static void *thread(void *param) {
 		}
 	}
 
-	lnode->thread = pnode;
 	lnode->laststate = -1;
+	lnode->interval = 1;
+	if(json_find_number(jdevice, "poll-interval", &itmp) == 0)
+		lnode->interval = (int)round(itmp);
+	if(lnode->interval <= 0) {
+		lnode->interval = 1;
+	}
 
 	lnode->next = settings;
 	settings = lnode;
 
-	if(json_find_number(json, "poll-interval", &itmp) == 0)
-		interval = (int)round(itmp);
-
-	while(loop) {
-		if(protocol_thread_wait(pnode, interval, &nrloops) == ETIMEDOUT) {
-			pthread_mutex_lock(&lock);
-			if(lnode->wait == 0) {
-				struct JsonNode *message = json_mkobject();
-
-				JsonNode *code = json_mkobject();
-				json_append_member(code, "name", json_mkstring(lnode->name));
-
-				int *ret = NULL, n = 0;
-				if((n = (int)findproc(lnode->program, lnode->arguments, 0, &ret)) > 0) {
-					lnode->currentstate = 1;
-					json_append_member(code, "state", json_mkstring("running"));
-					json_append_member(code, "pid", json_mknumber(ret[0], 0));
-					FREE(ret);
-				} else {
-					lnode->currentstate = 0;
-					json_append_member(code, "state", json_mkstring("stopped"));
-					json_append_member(code, "pid", json_mknumber(0, 0));
-				}
-				json_append_member(message, "message", code);
-				json_append_member(message, "origin", json_mkstring("receiver"));
-				json_append_member(message, "protocol", json_mkstring(program->id));
-
-				if(lnode->currentstate != lnode->laststate) {
-					lnode->laststate = lnode->currentstate;
-					if(pilight.broadcast != NULL) {
-						pilight.broadcast(program->id, message, PROTOCOL);
-					}
-				}
-				json_delete(message);
-				message = NULL;
-			}
-			pthread_mutex_unlock(&lock);
-		}
+	if((lnode->async_req = MALLOC(sizeof(uv_async_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 	}
-	pthread_mutex_unlock(&lock);
-
-	threads--;
-	return (void *)NULL;
-}
+	lnode->async_req->data = lnode;
+	uv_async_init(uv_default_loop(), lnode->async_req, execute);
 
-static struct threadqueue_t *initDev(JsonNode *jdevice) {
-	loop = 1;
-	char *output = json_stringify(jdevice, NULL);
-	JsonNode *json = json_decode(output);
-	json_free(output);
-
-	struct protocol_threads_t *node = protocol_thread_init(program, json);
-	return threads_register("program", &thread, (void *)node, 0);
-}
-
-static void *execute(void *param) {
-	struct settings_t *p = (struct settings_t *)param;
-	int result = 0;
-	int n = 0;
-	int *ret = NULL;
-
-	if((n = (int)findproc(p->program, p->arguments, 0, &ret)) > 0) {
-		result = system(p->stop);
-		FREE(ret);
-	} else {
-		result = system(p->start);
-	}
-
-	/* Check of the user wanted to stop pilight */
-	if(WIFSIGNALED(result)) {
-		int n = 0, *ret = NULL;
-		/* Find the pilight daemon pid */
-		if((n = (int)findproc(progname, NULL, 0, &ret)) > 0) {
-			/* Send a sigint to ourself */
-			kill(ret[0], SIGINT);
-		}
+	if((lnode->timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 	}
-
-	p->wait = 0;
-	memset(&p->pth, '\0', sizeof(pthread_t));
-	p->hasthread = 0;
-	p->laststate = -1;
-
-	pthread_mutex_unlock(&p->thread->mutex);
-	pthread_cond_signal(&p->thread->cond);
+	lnode->timer_req->data = lnode;
+	uv_timer_init(uv_default_loop(), lnode->timer_req);
+	uv_timer_start(lnode->timer_req, poll_cb, lnode->interval*1000, lnode->interval*1000);
 
 	return NULL;
 }
@@ -252,7 +313,6 @@ static int createCode(JsonNode *code) {
 	double itmp = -1;
 	int state = -1;
 	int n = 0;
-	int *ret = NULL;
 
 	if(json_find_string(code, "name", &name) == 0) {
 		if(strstr(progname, "daemon") != NULL) {
@@ -267,7 +327,7 @@ static int createCode(JsonNode *code) {
 							else if(json_find_number(code, "stopped", &itmp) == 0)
 								state = 0;
 
-							if((n = (int)findproc(tmp->program, tmp->arguments, 0, &ret)) > 0 && state == 1) {
+							if((n = (running(tmp) > 0)) == 1 && state == 1) {
 								logprintf(LOG_INFO, "program \"%s\" already running", tmp->name);
 							} else if(n == 0 && state == 0) {
 								logprintf(LOG_INFO, "program \"%s\" already stopped", tmp->name);
@@ -295,10 +355,9 @@ static int createCode(JsonNode *code) {
 									program->message = NULL;
 								}
 
+								tmp->action = (n == 1) ? 0 : 1;
 								tmp->wait = 1;
-								threads_create(&tmp->pth, NULL, execute, (void *)tmp);
-								tmp->hasthread = 1;
-								pthread_detach(tmp->pth);
+								uv_async_send(tmp->async_req);
 
 								program->message = json_mkobject();
 								json_append_member(program->message, "name", json_mkstring(name));
@@ -333,28 +392,24 @@ static int createCode(JsonNode *code) {
 }
 
 static void threadGC(void) {
-	loop = 0;
-	protocol_thread_stop(program);
-	while(threads > 0) {
-		usleep(10);
-	}
-	protocol_thread_free(program);
-
 	struct settings_t *tmp;
 	while(settings) {
 		tmp = settings;
+		uv_timer_stop(tmp->timer_req);
+		uv_close((uv_handle_t *)tmp->timer_req, close_cb);
+		uv_close((uv_handle_t *)tmp->async_req, close_cb);
+		/* A command still running is left alone */
+		if(tmp->process_req != NULL) {
+			tmp->process_req->data = NULL;
+		}
 		if(tmp->stop) FREE(tmp->stop);
 		if(tmp->start) FREE(tmp->start);
 		if(tmp->name) FREE(tmp->name);
 		if(tmp->arguments) FREE(tmp->arguments);
 		if(tmp->program) FREE(tmp->program);
-		if(tmp->hasthread > 0) pthread_cancel(tmp->pth);
 		settings = settings->next;
 		FREE(tmp);
 	}
-	if(settings != NULL) {
-		FREE(settings);
-	}
 }
 
 static void printHelp(void) {
@@ -368,12 +423,6 @@ static void printHelp(void) {
 __attribute__((weak))
 #endif
 void programInit(void) {
-#ifndef _WIN32
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&lock, &attr);
-#endif
-
 	protocol_register(&program);
 	protocol_set_id(program, "program");
 	protocol_device_add(program, "program", "Start / Stop / State of a program");
@@ -406,7 +455,7 @@ void programInit(void) {
 #if defined(MODULE) && !defined(_WIN32)
 void compatibility(struct module_t *module) {
 	module->name = "program";
-	module->version = "1.6";
+	module->version = "2.0";
 	module->reqversion = "6.0";
 	module->reqcommit = "84";
 }
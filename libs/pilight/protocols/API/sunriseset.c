@@ -220,11 +220,28 @@ static void *thread(void *param) {
 #else
 static int time_override = -1;
 
+/*
+ * The sunrise and sunset in UTC of every day of a year, as
+ * hours*100+minutes. Devices at the same location share a
+ * table, which is only worked out again when the year changes.
+ */
+typedef struct ephemeris_t {
+	double longitude;
+	double latitude;
+	int year;
+	short rise[366];
+	short set[366];
+	struct ephemeris_t *next;
+} ephemeris_t;
+
+static struct ephemeris_t *ephemeris = NULL;
+
 typedef struct data_t {
 	char *name;
 	int interval;
 	int target_offset;
 	uv_timer_t *timer_req;
+	struct ephemeris_t *table;
 
 	double longitude;
 	double latitude;
@@ -297,6 +314,55 @@ static double calculate(int year, int month, int day, double lon, double lat, in
 	return ((round(hour)+min))*100;
 }
 
+static int isleap(int year) {
+	return ((year % 4 == 0 && year % 100 != 0) || year % 400 == 0);
+}
+
+static struct ephemeris_t *ephemeris_get(double longitude, double latitude) {
+	struct ephemeris_t *table = ephemeris;
+
+	while(table) {
+		if(table->longitude == longitude && table->latitude == latitude) {
+			return table;
+		}
+		table = table->next;
+	}
+
+	if((table = MALLOC(sizeof(struct ephemeris_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(table, 0, sizeof(struct ephemeris_t));
+	table->longitude = longitude;
+	table->latitude = latitude;
+	table->next = ephemeris;
+	ephemeris = table;
+
+	return table;
+}
+
+static int ephemeris_lookup(struct ephemeris_t *table, int year, int month, int day, int rising) {
+	static const int days[12] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31 };
+	int m = 0, d = 0, yday = 0;
+
+	if(table->year != year) {
+		for(m=1;m<=12;m++) {
+			for(d=1;d<=days[m-1]+((m == 2) ? isleap(year) : 0);d++) {
+				table->rise[yday] = (short)calculate(year, m, d, table->longitude, table->latitude, 1);
+				table->set[yday] = (short)calculate(year, m, d, table->longitude, table->latitude, 0);
+				yday++;
+			}
+		}
+		table->year = year;
+	}
+
+	for(m=1;m<month;m++) {
+		yday += days[m-1]+((m == 2) ? isleap(year) : 0);
+	}
+	yday += day-1;
+
+	return (rising == 1) ? table->rise[yday] : table->set[yday];
+}
+
 #undef min
 static unsigned long min(unsigned long a, unsigned long b, unsigned long c) {
 	unsigned long m = a;
@@ -335,8 +401,8 @@ static void *thread(void *param) {
 		int hour = tm.tm_hour;
 		int minute = tm.tm_min;
 
-		risetime = (int)calculate(year, month, day, settings->longitude, settings->latitude, 1);
-		settime = (int)calculate(year, month, day, settings->longitude, settings->latitude, 0);
+		risetime = ephemeris_lookup(settings->table, year, month, day, 1);
+		settime = ephemeris_lookup(settings->table, year, month, day, 0);
 
 		t = datetime2ts(year, month, day, risetime / 100, risetime % 100, 0);
 		localtime_l(t, &rise, settings->tz);
@@ -507,6 +573,8 @@ static struct threadqueue_t *initDev(JsonNode *jdevice) {
 		}
 	}
 
+	node->table = ephemeris_get(node->longitude, node->latitude);
+
 	if((node->tz = coord2tz(node->longitude, node->latitude)) == NULL) {
 		logprintf(LOG_INFO, "sunriseset %s, could not determine timezone, defaulting to UTC", jdevice->key);
 		node->tz = UTC;
@@ -557,6 +625,13 @@ static void threadGC(void) {
 	if(data != NULL) {
 		FREE(data);
 	}
+
+	struct ephemeris_t *table = NULL;
+	while(ephemeris) {
+		table = ephemeris;
+		ephemeris = ephemeris->next;
+		FREE(table);
+	}
 #endif
 }
 
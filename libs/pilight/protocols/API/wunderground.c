@@ -613,7 +613,7 @@ static void callback1(int code, char *data, int size, char *type, void *userdata
 											snprintf(parsed, 1024, url[1], settings->api, settings->country, enc);
 											FREE(enc);
 
-											http_get_content(parsed, callback2, userdata);
+											http_get_content_cached(parsed, min_interval, callback2, userdata);
 										}
 									}
 								} else {
@@ -653,7 +653,7 @@ static void thread(uv_work_t *req) {
 	snprintf(parsed, 1024, url[0], settings->api, settings->country, enc);
 	FREE(enc);
 
-	http_get_content(parsed, callback1, settings);
+	http_get_content_cached(parsed, min_interval, callback1, settings);
 
 	return;
 }
@@ -667,7 +667,7 @@ static void *update(void *param) {
 		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 	}
 	work_req->data = settings;
-	uv_queue_work(uv_default_loop(), work_req, "wunderground", thread, thread_free);
+	uv_queue_work_priority(uv_default_loop(), work_req, "wunderground", UV_PRIORITY_LOW, thread, thread_free);
 	if(time_override > -1) {
 		settings->update = time_override;
 	} else {
@@ -947,7 +947,7 @@ static int createCode(JsonNode *code) {
 						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 					}
 					work_req->data = tmp;
-					uv_queue_work(uv_default_loop(), work_req, "wunderground", thread, thread_free);
+					uv_queue_work_priority(uv_default_loop(), work_req, "wunderground", UV_PRIORITY_LOW, thread, thread_free);
 
 					if(time_override > -1) {
 						tmp->update = time_override;
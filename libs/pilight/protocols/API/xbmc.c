@@ -44,6 +44,7 @@
 #include <pthread.h>
 #include <stdint.h>
 #include <math.h>
+#include <assert.h>
 
 #include "../../core/threads.h"
 #include "../../core/pilight.h"
@@ -55,21 +56,34 @@
 #include "../../core/binary.h"
 #include "../../core/json.h"
 #include "../../core/gc.h"
+#include "../../core/eventpool.h"
 #include "xbmc.h"
 
+/* Seconds between connection attempts */
+#define RECONNECT	3
+/* Largest notification we are willing to buffer */
+#define MAXFRAME	65536
+
 typedef struct data_t {
 	char *server;
 	int port;
-	int sockfd;
+	int connected;
+	/* How far the current object was scanned */
+	struct {
+		ssize_t pos;
+		int depth;
+		int quoted;
+		int escaped;
+	} frame;
+	uv_poll_t *poll_req;
+	uv_timer_t *timer_req;
 	struct data_t *next;
 } data_t;
 
-static pthread_mutex_t xbmclock;
-static pthread_mutexattr_t xbmcattr;
-
-static struct data_t *data;
+static struct data_t *data = NULL;
 static unsigned short loop = 1;
-static unsigned short threads = 0;
+
+static void xbmc_connect(struct data_t *node);
 
 static void createMessage(char *server, int port, char *action, char *media) {
 	xbmc->message = json_mkobject();
@@ -90,260 +104,379 @@ static void createMessage(char *server, int port, char *action, char *media) {
 	xbmc->message = NULL;
 }
 
-static void *thread(void *param) {
-	struct protocol_threads_t *node = (struct protocol_threads_t *)param;
-	struct JsonNode *json = (struct JsonNode *)node->param;
-	struct JsonNode *jid = NULL;
-	struct JsonNode *jchild = NULL;
-	struct JsonNode *jchild1 = NULL;
-	struct sockaddr_in serv_addr;
-	struct data_t *xnode = MALLOC(sizeof(struct data_t));
-
-	char recvBuff[BUFFER_SIZE], action[10], media[15];
-	char *m = NULL, *t = NULL;
-	char shut[] = "shutdown";
-	char home[] = "home";
-	char none[] = "none";
-	int nrloops = 0, bytes = 0, n = 0, has_server = 0;
-	int has_port = 0, reset = 1, maxfd = 0, retry = 0;
-	fd_set fdsread;
-	struct timeval timeout;
-	timeout.tv_sec = 1;
-	timeout.tv_usec = 0;
-
-	if(xnode == NULL) {
-		fprintf(stderr, "out of memory\n");
-		exit(EXIT_FAILURE);
+static void notification(struct data_t *node, char *content) {
+	struct JsonNode *joutput = NULL;
+	struct JsonNode *params = NULL;
+	struct JsonNode *jdata = NULL;
+	struct JsonNode *item = NULL;
+	char action[10], media[15], *m = NULL, *t = NULL;
+
+	if(json_validate(content) == false) {
+		return;
 	}
 
-	/* Clear the server address */
-	memset(&serv_addr, '\0', sizeof(serv_addr));
-	memset(&recvBuff, '\0', BUFFER_SIZE);
 	memset(&action, '\0', 10);
 	memset(&media, '\0', 15);
 
-	threads++;
-
-	if((jid = json_find_member(json, "id"))) {
-		jchild = json_first_child(jid);
-		while(jchild) {
-			jchild1 = json_first_child(jchild);
-
-			while(jchild1) {
-				if(strcmp(jchild1->key, "server") == 0) {
-					if((xnode->server = MALLOC(strlen(jchild1->string_)+1)) == NULL) {
-						fprintf(stderr, "out of memory\n");
-						exit(EXIT_FAILURE);
+	joutput = json_decode(content);
+	if(json_find_string(joutput, "method", &m) == 0) {
+		if(strcmp(m, "GUI.OnScreensaverActivated") == 0) {
+			strcpy(media, "screensaver");
+			strcpy(action, "active");
+		} else if(strcmp(m, "GUI.OnScreensaverDeactivated") == 0) {
+			strcpy(media, "screensaver");
+			strcpy(action, "inactive");
+		} else {
+			if((params = json_find_member(joutput, "params")) != NULL) {
+				if((jdata = json_find_member(params, "data")) != NULL) {
+					if((item = json_find_member(jdata, "item")) != NULL) {
+						if(json_find_string(item, "type", &t) == 0) {
+							strncpy(media, t, 14);
+							if(strcmp(m, "Player.OnPlay") == 0) {
+								strcpy(action, "play");
+							} else if(strcmp(m, "Player.OnStop") == 0) {
+								strcpy(action, "home");
+								strcpy(media, "none");
+							} else if(strcmp(m, "Player.OnPause") == 0) {
+								strcpy(action, "pause");
+							}
+						}
 					}
-					strcpy(xnode->server, jchild1->string_);
-					has_server = 1;
-				}
-				if(strcmp(jchild1->key, "port") == 0) {
-					xnode->port = (int)round(jchild1->number_);
-					has_port = 1;
 				}
-				jchild1 = jchild1->next;
-			}
-			if(has_server == 1 && has_port == 1) {
-				xnode->sockfd = -1;
-				xnode->next = data;
-				data = xnode;
-			} else {
-				if(has_server == 1) {
-					FREE(xnode->server);
-				}
-				FREE(xnode);
-				xnode = NULL;
 			}
-			jchild = jchild->next;
+		}
+		if(strlen(media) > 0 && strlen(action) > 0) {
+			createMessage(node->server, node->port, action, media);
 		}
 	}
+	json_delete(joutput);
+}
 
-	if(xnode == NULL) {
-		return (void *)NULL;;
-	}
+static void close_cb(uv_handle_t *handle) {
+	FREE(handle);
+}
 
+/*
+ * Drops the connection, and unless we are shutting down,
+ * tries again in a little while.
+ */
+static void xbmc_close(struct data_t *node) {
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	uv_poll_t *req = node->poll_req;
+	int fd = -1, r = 0;
+
+	uv_timer_stop(node->timer_req);
+
+	if(req != NULL) {
+		node->poll_req = NULL;
+		custom_poll_data = req->data;
+
+		if((r = uv_fileno((uv_handle_t *)req, (uv_os_fd_t *)&fd)) != 0) {
+			logprintf(LOG_ERR, "uv_fileno: %s", uv_strerror(r)); /*LCOV_EXCL_LINE*/
+		}
+		if(fd > -1) {
 #ifdef _WIN32
-		WSADATA wsa;
+			shutdown(fd, SD_BOTH);
+			closesocket(fd);
+#else
+			shutdown(fd, SHUT_RDWR);
+			close(fd);
+#endif
+		}
 
-		if(WSAStartup(0x202, &wsa) != 0) {
-			logprintf(LOG_ERR, "could not initialize new socket");
-			return (void *)NULL;
+		uv_poll_stop(req);
+		if(!uv_is_closing((uv_handle_t *)req)) {
+			uv_close((uv_handle_t *)req, close_cb);
 		}
-#endif
+		if(custom_poll_data != NULL) {
+			uv_custom_poll_free(custom_poll_data);
+		}
+		req->data = NULL;
+	}
 
-	while(loop) {
+	if(node->connected == 1) {
+		node->connected = 0;
+		createMessage(node->server, node->port, "shutdown", "none");
+	}
+	memset(&node->frame, 0, sizeof(node->frame));
 
-		if(reset == 1) {
-			createMessage(xnode->server, xnode->port, shut, none);
-			reset = 0;
-		}
+	if(loop == 1) {
+		uv_timer_start(node->timer_req, (void (*)(uv_timer_t *))xbmc_connect, RECONNECT*1000, 0);
+	}
+}
 
-		if(xnode->sockfd > -1) {
-			close(xnode->sockfd);
-			xnode->sockfd = -1;
-		}
+static void custom_close_cb(uv_poll_t *req) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
 
-		/* Try to open a new socket */
-		if((xnode->sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-			logprintf(LOG_NOTICE, "could not create XBMC/Kodi socket");
-			break;
-		}
+	struct uv_custom_poll_t *custom_poll_data = req->data;
 
-		serv_addr.sin_family = AF_INET;
-		serv_addr.sin_port = htons((unsigned short)xnode->port);
+	if(custom_poll_data != NULL && custom_poll_data->data != NULL) {
+		xbmc_close(custom_poll_data->data);
+	}
+}
 
-		inet_pton(AF_INET, xnode->server, &serv_addr.sin_addr);
+/*
+ * The first time the socket turns writable the connection
+ * is made, after that we only listen.
+ */
+static void write_cb(uv_poll_t *req) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct data_t *node = custom_poll_data->data;
+
+	if(node->connected == 0) {
+		uv_timer_stop(node->timer_req);
+		node->connected = 1;
+		createMessage(node->server, node->port, "home", "none");
+	}
+	uv_custom_read(req);
+}
 
-		retry = 0;
-		/* Connect to the server */
-		switch(socket_timeout_connect(xnode->sockfd, (struct sockaddr *)&serv_addr, 3)) {
-			case -1:
-				logprintf(LOG_NOTICE, "could not connect to XBMC/Kodi server @%s", xnode->server);
-				protocol_thread_wait(node, 3, &nrloops);
-				retry = 1;
-			break;
-			case -2:
-				logprintf(LOG_NOTICE, "XBMC/Kodi connection timeout @%s", xnode->server);
-				protocol_thread_wait(node, 3, &nrloops);
-				retry = 1;
-			break;
-			case -3:
-				logprintf(LOG_NOTICE, "Error in XBMC/Kodi socket connection @%s", xnode->server);
-				protocol_thread_wait(node, 3, &nrloops);
-				retry = 1;
-			break;
-			default:
-				createMessage(xnode->server, xnode->port, home, none);
-				reset = 1;
-			break;
-		}
-		if(retry == 1) {
-			continue;
-		}
+/*
+ * Kodi sends its notifications as bare JSON objects without
+ * any delimiter. An object can be spread over several reads
+ * or a read can hold several objects, so the braces outside
+ * of strings are counted to find where each one ends.
+ */
+static void read_cb(uv_poll_t *req, ssize_t *nread, char *buf) {
+	/*
+	 * Make sure we execute in the main thread
+	 */
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	assert(uv_thread_equal(&pth_main_id, &pth_cur_id));
+
+	struct uv_custom_poll_t *custom_poll_data = req->data;
+	struct data_t *node = custom_poll_data->data;
+	struct iobuf_t *io = &custom_poll_data->recv_iobuf;
+	char *content = NULL, c = 0;
+	ssize_t i = 0;
+
+	if(*nread == -1) {
+		xbmc_close(node);
+		return;
+	}
+	if(buf == NULL) {
+		uv_custom_read(req);
+		return;
+	}
 
-		struct data_t *xtmp = data;
-		while(xtmp) {
-			if(xtmp->sockfd > -1) {
-				if(maxfd < xtmp->sockfd) {
-					maxfd = xtmp->sockfd;
+	while(io->len > 0) {
+		for(i=node->frame.pos;i<io->len;i++) {
+			c = io->buf[i];
+			if(node->frame.depth == 0 && c != '{') {
+				continue;
+			}
+			if(node->frame.quoted == 1) {
+				if(node->frame.escaped == 1) {
+					node->frame.escaped = 0;
+				} else if(c == '\\') {
+					node->frame.escaped = 1;
+				} else if(c == '"') {
+					node->frame.quoted = 0;
+				}
+			} else if(c == '"') {
+				node->frame.quoted = 1;
+			} else if(c == '{' || c == '[') {
+				node->frame.depth++;
+			} else if(c == '}' || c == ']') {
+				if(--node->frame.depth == 0) {
+					break;
 				}
 			}
-			xtmp = xtmp->next;
 		}
 
-		while(loop) {
-			pthread_mutex_lock(&xbmclock);
-			FD_ZERO(&fdsread);
-			FD_SET((unsigned long)xnode->sockfd, &fdsread);
+		if(i == io->len) {
+			node->frame.pos = i;
+			break;
+		}
 
-			do {
-				n = select(maxfd+1, &fdsread, NULL, NULL, &timeout);
-			} while(n == -1 && errno == EINTR && loop);
+		if((content = MALLOC(i+2)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memcpy(content, io->buf, i+1);
+		content[i+1] = '\0';
+		iobuf_remove(io, i+1);
+		memset(&node->frame, 0, sizeof(node->frame));
 
-			if(loop == 0) {
-				pthread_mutex_unlock(&xbmclock);
-				break;
-			}
+		notification(node, content);
+		FREE(content);
+	}
 
-			if(n == -1) {
-				pthread_mutex_unlock(&xbmclock);
-				break;
-			} else if(n == 0) {
-				usleep(100000);
-			} else if(n > 0) {
-				if(FD_ISSET((unsigned long)xnode->sockfd, &fdsread)) {
-					bytes = (int)recv(xnode->sockfd, recvBuff, BUFFER_SIZE, 0);
-					if(bytes <= 0) {
-						pthread_mutex_unlock(&xbmclock);
-						break;
-					} else {
-						if(json_validate(recvBuff) == true) {
-							JsonNode *joutput = json_decode(recvBuff);
-							JsonNode *params = NULL;
-							JsonNode *data = NULL;
-							JsonNode *item = NULL;
-
-							if(json_find_string(joutput, "method", &m) == 0) {
-								if(strcmp(m, "GUI.OnScreensaverActivated") == 0) {
-									strcpy(media, "screensaver");
-									strcpy(action, "active");
-								} else if(strcmp(m, "GUI.OnScreensaverDeactivated") == 0) {
-									strcpy(media, "screensaver");
-									strcpy(action, "inactive");
-								} else {
-									if((params = json_find_member(joutput, "params")) != NULL) {
-										if((data = json_find_member(params, "data")) != NULL) {
-											if((item = json_find_member(data, "item")) != NULL) {
-												if(json_find_string(item, "type", &t) == 0) {
-													xbmc->message = json_mkobject();
-
-													strcpy(media, t);
-													if(strcmp(m, "Player.OnPlay") == 0) {
-														strcpy(action, "play");
-													} else if(strcmp(m, "Player.OnStop") == 0) {
-														strcpy(action, home);
-														strcpy(media, none);
-													} else if(strcmp(m, "Player.OnPause") == 0) {
-														strcpy(action, "pause");
-													}
-												}
-											}
-										}
-									}
-								}
-								if(strlen(media) > 0 && strlen(action) > 0) {
-									createMessage(xnode->server, xnode->port, action, media);
-									reset = 1;
-								}
-							}
-							json_delete(joutput);
-						}
-						memset(recvBuff, '\0', BUFFER_SIZE);
-						memset(&action, '\0', 10);
-						memset(&media, '\0', 15);
-					}
-				}
-			}
-			pthread_mutex_unlock(&xbmclock);
+	if(io->len > MAXFRAME) {
+		logprintf(LOG_NOTICE, "XBMC/Kodi notification too large @%s", node->server);
+		iobuf_remove(io, io->len);
+		memset(&node->frame, 0, sizeof(node->frame));
+	}
+
+	uv_custom_read(req);
+}
+
+static void connect_timeout(uv_timer_t *req) {
+	struct data_t *node = req->data;
+
+	logprintf(LOG_NOTICE, "XBMC/Kodi connection timeout @%s", node->server);
+	xbmc_close(node);
+}
+
+static void xbmc_connect(struct data_t *node) {
+	struct uv_custom_poll_t *custom_poll_data = NULL;
+	struct sockaddr_in addr;
+	uv_poll_t *poll_req = NULL;
+	int sockfd = 0, r = 0;
+
+	memset(&addr, '\0', sizeof(struct sockaddr_in));
+	if((r = uv_ip4_addr(node->server, node->port, &addr)) != 0) {
+		logprintf(LOG_NOTICE, "could not connect to XBMC/Kodi server @%s", node->server);
+		xbmc_close(node);
+		return;
+	}
+
+	if((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+		logprintf(LOG_NOTICE, "could not create XBMC/Kodi socket");
+		xbmc_close(node);
+		return;
+	}
+
+#ifdef _WIN32
+	unsigned long on = 1;
+	ioctlsocket(sockfd, FIONBIO, &on);
+#else
+	long arg = fcntl(sockfd, F_GETFL, NULL);
+	fcntl(sockfd, F_SETFL, arg | O_NONBLOCK);
+#endif
+
+	if(connect(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+#ifdef _WIN32
+		if(!(WSAGetLastError() == WSAEWOULDBLOCK || WSAGetLastError() == WSAEISCONN)) {
+#else
+		if(!(errno == EINPROGRESS || errno == EISCONN)) {
+#endif
+			logprintf(LOG_NOTICE, "could not connect to XBMC/Kodi server @%s", node->server);
+#ifdef _WIN32
+			closesocket(sockfd);
+#else
+			close(sockfd);
+#endif
+			xbmc_close(node);
+			return;
 		}
 	}
-	pthread_mutex_unlock(&xbmclock);
 
-	threads--;
-	return (void *)NULL;
+	if((poll_req = MALLOC(sizeof(uv_poll_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+
+	uv_custom_poll_init(&custom_poll_data, poll_req, (void *)node);
+	custom_poll_data->write_cb = write_cb;
+	custom_poll_data->read_cb = read_cb;
+	custom_poll_data->close_cb = custom_close_cb;
+
+	if((r = uv_poll_init_socket(uv_default_loop(), poll_req, sockfd)) != 0) {
+		/*LCOV_EXCL_START*/
+		logprintf(LOG_ERR, "uv_poll_init_socket: %s", uv_strerror(r));
+		uv_custom_poll_free(custom_poll_data);
+		FREE(poll_req);
+#ifdef _WIN32
+		closesocket(sockfd);
+#else
+		close(sockfd);
+#endif
+		xbmc_close(node);
+		return;
+		/*LCOV_EXCL_STOP*/
+	}
+
+	node->poll_req = poll_req;
+	uv_timer_start(node->timer_req, connect_timeout, RECONNECT*1000, 0);
+	uv_custom_write(poll_req);
 }
 
 static struct threadqueue_t *initDev(JsonNode *jdevice) {
+	struct JsonNode *jid = NULL;
+	struct JsonNode *jchild = NULL;
+	struct JsonNode *jchild1 = NULL;
+	struct data_t *node = NULL;
+	char *server = NULL;
+	int port = -1;
+
 	loop = 1;
-	char *output = json_stringify(jdevice, NULL);
-	JsonNode *json = json_decode(output);
-	json_free(output);
 
-	struct protocol_threads_t *node = protocol_thread_init(xbmc, json);
-	return threads_register("xbmc", &thread, (void *)node, 0);
+	if((jid = json_find_member(jdevice, "id"))) {
+		jchild = json_first_child(jid);
+		while(jchild) {
+			jchild1 = json_first_child(jchild);
+			while(jchild1) {
+				if(strcmp(jchild1->key, "server") == 0 && jchild1->tag == JSON_STRING) {
+					server = jchild1->string_;
+				}
+				if(strcmp(jchild1->key, "port") == 0 && jchild1->tag == JSON_NUMBER) {
+					port = (int)round(jchild1->number_);
+				}
+				jchild1 = jchild1->next;
+			}
+			jchild = jchild->next;
+		}
+	}
+
+	if(server == NULL || port == -1) {
+		return NULL;
+	}
+
+#ifdef _WIN32
+	WSADATA wsa;
+
+	if(WSAStartup(0x202, &wsa) != 0) {
+		logprintf(LOG_ERR, "could not initialize new socket");
+		return NULL;
+	}
+#endif
+
+	if((node = MALLOC(sizeof(struct data_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(node, '\0', sizeof(struct data_t));
+	if((node->server = STRDUP(server)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->port = port;
+
+	if((node->timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->timer_req->data = node;
+	uv_timer_init(uv_default_loop(), node->timer_req);
+
+	node->next = data;
+	data = node;
+
+	createMessage(node->server, node->port, "shutdown", "none");
+	xbmc_connect(node);
+
+	return NULL;
 }
 
 static void threadGC(void) {
-	loop = 0;
-	struct data_t *xtmp = NULL;
+	struct data_t *tmp = NULL;
 
+	loop = 0;
 	while(data) {
-		xtmp = data;
-		if(xtmp->sockfd > -1) {
-			close(xtmp->sockfd);
-			xtmp->sockfd = -1;
-		}
-		FREE(xtmp->server);
+		tmp = data;
+		tmp->connected = 0;
+		xbmc_close(tmp);
+		uv_close((uv_handle_t *)tmp->timer_req, close_cb);
+		FREE(tmp->server);
 		data = data->next;
-		FREE(xtmp);
-	}
-
-	protocol_thread_stop(xbmc);
-	while(threads > 0) {
-		usleep(10);
+		FREE(tmp);
 	}
-	protocol_thread_free(xbmc);
 }
 
 static int checkValues(JsonNode *code) {
@@ -386,10 +519,6 @@ static int checkValues(JsonNode *code) {
 __attribute__((weak))
 #endif
 void xbmcInit(void) {
-	pthread_mutexattr_init(&xbmcattr);
-	pthread_mutexattr_settype(&xbmcattr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&xbmclock, &xbmcattr);
-
 	protocol_register(&xbmc);
 	protocol_set_id(xbmc, "xbmc");
 	protocol_device_add(xbmc, "xbmc", "XBMC API");
@@ -414,7 +543,7 @@ void xbmcInit(void) {
 #if defined(MODULE) && !defined(_WIN32)
 void compatibility(struct module_t *module) {
 	module->name = "xbmc";
-	module->version = "1.8";
+	module->version = "2.0";
 	module->reqversion = "6.0";
 	module->reqcommit = "84";
 }
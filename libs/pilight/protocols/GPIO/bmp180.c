@@ -43,6 +43,7 @@
 #include "../../core/binary.h"
 #include "../../core/gc.h"
 #include "../../core/json.h"
+#include "../../core/i2c.h"
 #include "../../config/settings.h"
 #include "../protocol.h"
 #include "bmp180.h"
@@ -53,7 +54,11 @@ typedef struct settings_t {
 	char **id;
 	int nrid;
 	char path[PATH_MAX];
-	int *fd;
+	struct i2c_bus_t *bus;
+	int *addr;
+	unsigned char oversampling;
+	double temp_offset;
+	double pressure_offset;
 	// calibration values (stored in each BMP180/085)
 	short *ac1;
 	short *ac2;
@@ -68,51 +73,200 @@ typedef struct settings_t {
 	short *md;
 } settings_t;
 
-static unsigned short loop = 1;
-static int threads = 0;
+// helper function with built-in result conversion
+static int readReg16(unsigned char *buf, int reg) {
+	// registers are big-endian, counted from the first calibration register
+	return (buf[reg-0xAA] << 8) | buf[reg-0xAA+1];
+}
+
+static void thread(struct protocol_poll_t *poll) {
+	struct settings_t *bmp180data = (struct settings_t *)poll->data;
+	unsigned char oversampling = bmp180data->oversampling;
+	unsigned char buf[3];
+	int y = 0;
+
+	for (y = 0; y < bmp180data->nrid; y++) {
+		// write 0x2E into Register 0xF4 to request a temperature reading.
+		if (i2c_write_reg8(bmp180data->bus, bmp180data->addr[y], 0xF4, 0x2E) == 0) {
+			// uncompensated temperature value
+			unsigned short ut = 0;
+
+			// wait at least 4.5ms: we suspend execution for 5000 microseconds.
+			usleep(5000);
+
+			// read the two byte result from address 0xF6.
+			if (i2c_read_block(bmp180data->bus, bmp180data->addr[y], 0xF6, buf, 2) != 0) {
+				logprintf(LOG_NOTICE, "error reading bmp180");
+				continue;
+			}
+			ut = (unsigned short) ((buf[0] << 8) | buf[1]);
+
+			// calculate temperature (in units of 0.1 deg C) given uncompensated value
+			int x1, x2;
+			x1 = (((int) ut - (int) bmp180data->ac6[y])) * (int) bmp180data->ac5[y] >> 15;
+			x2 = ((int) bmp180data->mc[y] << 11) / (x1 + bmp180data->md[y]);
+			int b5 = x1 + x2;
+			int temp = ((b5 + 8) >> 4);
+
+			// uncompensated pressure value
+			unsigned int up = 0;
+
+			// write 0x34+(BMP085_OVERSAMPLING_SETTING<<6) into register 0xF4
+			// request a pressure reading with specified oversampling setting
+			i2c_write_reg8(bmp180data->bus, bmp180data->addr[y], 0xF4,
+					0x34 + (oversampling << 6));
+
+			// wait for conversion, delay time dependent on oversampling setting
+			unsigned int delay = (unsigned int) ((2 + (3 << oversampling)) * 1000);
+			usleep(delay);
+
+			// read the three byte result (block data): 0xF6 = MSB, 0xF7 = LSB and 0xF8 = XLSB
+			if (i2c_read_block(bmp180data->bus, bmp180data->addr[y], 0xF6, buf, 3) != 0) {
+				logprintf(LOG_NOTICE, "error reading bmp180");
+				continue;
+			}
+			up = (((unsigned int) buf[0] << 16) | ((unsigned int) buf[1] << 8) | (unsigned int) buf[2])
+					>> (8 - oversampling);
+
+			// calculate pressure (in Pa) given uncompensated value
+			int x3, b3, b6, pressure;
+			unsigned int b4, b7;
+
+			// calculate B6
+			b6 = b5 - 4000;
+
+			// calculate B3
+			x1 = (bmp180data->b2[y] * (b6 * b6) >> 12) >> 11;
+			x2 = (bmp180data->ac2[y] * b6) >> 11;
+			x3 = x1 + x2;
+			b3 = (((bmp180data->ac1[y] * 4 + x3) << oversampling) + 2) >> 2;
+
+			// calculate B4
+			x1 = (bmp180data->ac3[y] * b6) >> 13;
+			x2 = (bmp180data->b1[y] * ((b6 * b6) >> 12)) >> 16;
+			x3 = ((x1 + x2) + 2) >> 2;
+			b4 = (bmp180data->ac4[y] * (unsigned int) (x3 + 32768)) >> 15;
+
+			// calculate B7
+			b7 = ((up - (unsigned int) b3) * ((unsigned int) 50000 >> oversampling));
+
+			// calculate pressure in Pa
+			pressure = b7 < 0x80000000 ? (int) ((b7 << 1) / b4) : (int) ((b7 / b4) << 1);
+			x1 = (pressure >> 8) * (pressure >> 8);
+			x1 = (x1 * 3038) >> 16;
+			x2 = (-7357 * pressure) >> 16;
+			pressure += (x1 + x2 + 3791) >> 4;
+
+			bmp180->message = json_mkobject();
+			JsonNode *code = json_mkobject();
+			json_append_member(code, "id", json_mkstring(bmp180data->id[y]));
+			json_append_member(code, "temperature", json_mknumber(((double) temp / 10) + bmp180data->temp_offset, 1)); // in deg C
+			json_append_member(code, "pressure", json_mknumber(((double) pressure / 100) + bmp180data->pressure_offset, 1)); // in hPa
+
+			json_append_member(bmp180->message, "message", code);
+			json_append_member(bmp180->message, "origin", json_mkstring("receiver"));
+			json_append_member(bmp180->message, "protocol", json_mkstring(bmp180->id));
+
+			if(pilight.broadcast != NULL) {
+				pilight.broadcast(bmp180->id, bmp180->message, PROTOCOL);
+			}
+			json_delete(bmp180->message);
+			bmp180->message = NULL;
+		} else {
+			logprintf(LOG_NOTICE, "error connecting to bmp180");
+			logprintf(LOG_DEBUG, "(probably i2c bus error)");
+			logprintf(LOG_DEBUG, "(maybe wrong id? use i2cdetect to find out)");
+		}
+	}
+}
 
-static pthread_mutex_t lock;
-static pthread_mutexattr_t attr;
+static void pollGC(struct protocol_poll_t *poll) {
+	struct settings_t *bmp180data = (struct settings_t *)poll->data;
+	int y = 0;
 
-// helper function with built-in result conversion
-static int readReg16(int fd, int reg) {
-	int res = wiringXI2CReadReg16(fd, reg);
-	// convert result to 16 bits and swap bytes
-	return ((res << 8) & 0xFF00) | ((res >> 8) & 0xFF);
+	if (bmp180data == NULL) {
+		return;
+	}
+	if (bmp180data->id) {
+		for (y = 0; y < bmp180data->nrid; y++) {
+			FREE(bmp180data->id[y]);
+		}
+		FREE(bmp180data->id);
+	}
+	if (bmp180data->ac1) {
+		FREE(bmp180data->ac1);
+	}
+	if (bmp180data->ac2) {
+		FREE(bmp180data->ac2);
+	}
+	if (bmp180data->ac3) {
+		FREE(bmp180data->ac3);
+	}
+	if (bmp180data->ac4) {
+		FREE(bmp180data->ac4);
+	}
+	if (bmp180data->ac5) {
+		FREE(bmp180data->ac5);
+	}
+	if (bmp180data->ac6) {
+		FREE(bmp180data->ac6);
+	}
+	if (bmp180data->b1) {
+		FREE(bmp180data->b1);
+	}
+	if (bmp180data->b2) {
+		FREE(bmp180data->b2);
+	}
+	if (bmp180data->mb) {
+		FREE(bmp180data->mb);
+	}
+	if (bmp180data->mc) {
+		FREE(bmp180data->mc);
+	}
+	if (bmp180data->md) {
+		FREE(bmp180data->md);
+	}
+	if (bmp180data->addr) {
+		FREE(bmp180data->addr);
+	}
+	i2c_close(bmp180data->bus);
+	FREE(bmp180data);
 }
 
-static void *thread(void *param) {
-	struct protocol_threads_t *node = (struct protocol_threads_t *) param;
-	struct JsonNode *json = (struct JsonNode *) node->param;
+static struct threadqueue_t *initDev(JsonNode *jdevice) {
+	struct protocol_poll_t *poll = NULL;
+	struct settings_t *bmp180data = NULL;
 	struct JsonNode *jid = NULL;
 	struct JsonNode *jchild = NULL;
-	struct settings_t *bmp180data = MALLOC(sizeof(struct settings_t));
-	int y = 0, interval = 10, nrloops = 0;
-	char *stmp = NULL;
-	double itmp = -1, temp_offset = 0, pressure_offset = 0;
-	unsigned char oversampling = 1;
+	char *platform = GPIO_PLATFORM, *stmp = NULL;
+	int y = 0, interval = 10;
+	double itmp = -1;
+
+	if(config_setting_get_string("gpio-platform", 0, &platform) != 0) {
+		logprintf(LOG_ERR, "no gpio-platform configured");
+		return NULL;
+	}
+	if(strcmp(platform, "none") == 0) {
+		FREE(platform);
+		logprintf(LOG_ERR, "no gpio-platform configured");
+		return NULL;
+	}
+	if(wiringXSetup(platform, logprintf1) < 0) {
+		FREE(platform);
+		return NULL;
+	}
+	FREE(platform);
 
-	if(bmp180data == NULL) {
+	char *output = json_stringify(jdevice, NULL);
+	JsonNode *json = json_decode(output);
+	json_free(output);
+
+	if((bmp180data = MALLOC(sizeof(struct settings_t))) == NULL) {
 		fprintf(stderr, "out of memory\n");
 		exit(EXIT_FAILURE);
 	}
-
-	bmp180data->nrid = 0;
-	bmp180data->id = NULL;
-	bmp180data->fd = 0;
-	bmp180data->ac1 = 0;
-	bmp180data->ac2 = 0;
-	bmp180data->ac3 = 0;
-	bmp180data->ac4 = 0;
-	bmp180data->ac5 = 0;
-	bmp180data->ac6 = 0;
-	bmp180data->b1 = 0;
-	bmp180data->b2 = 0;
-	bmp180data->mb = 0;
-	bmp180data->mc = 0;
-	bmp180data->md = 0;
-
-	threads++;
+	memset(bmp180data, 0, sizeof(struct settings_t));
+	bmp180data->oversampling = 1;
 
 	if((jid = json_find_member(json, "id"))) {
 		jchild = json_first_child(jid);
@@ -138,17 +292,17 @@ static void *thread(void *param) {
 
 	if(json_find_number(json, "poll-interval", &itmp) == 0)
 		interval = (int) round(itmp);
-	json_find_number(json, "temperature-offset", &temp_offset);
-	json_find_number(json, "pressure-offset", &pressure_offset);
+	json_find_number(json, "temperature-offset", &bmp180data->temp_offset);
+	json_find_number(json, "pressure-offset", &bmp180data->pressure_offset);
 	if(json_find_number(json, "oversampling", &itmp) == 0) {
-		oversampling = (unsigned char) itmp;
+		bmp180data->oversampling = (unsigned char) itmp;
 	}
 
 	// resize the memory blocks pointed to by the different pointers
 	size_t sz = (size_t) (bmp180data->nrid + 1);
 	unsigned long int sizeShort = sizeof(short) * sz;
 	unsigned long int sizeUShort = sizeof(unsigned short) * sz;
-	bmp180data->fd = REALLOC(bmp180data->fd, (sizeof(int) * sz));
+	bmp180data->addr = REALLOC(bmp180data->addr, (sizeof(int) * sz));
 	bmp180data->ac1 = REALLOC(bmp180data->ac1, sizeShort);
 	bmp180data->ac2 = REALLOC(bmp180data->ac2, sizeShort);
 	bmp180data->ac3 = REALLOC(bmp180data->ac3, sizeShort);
@@ -162,41 +316,47 @@ static void *thread(void *param) {
 	bmp180data->md = REALLOC(bmp180data->md, sizeShort);
 	if(bmp180data->ac1 == NULL || bmp180data->ac2 == NULL || bmp180data->ac3 == NULL || bmp180data->ac4 == NULL ||
 		bmp180data->ac5 == NULL || bmp180data->ac6 == NULL || bmp180data->b1 == NULL || bmp180data->b2 == NULL ||
-		bmp180data->mb == NULL || bmp180data->mc == NULL || bmp180data->md == NULL || bmp180data->fd == NULL) {
+		bmp180data->mb == NULL || bmp180data->mc == NULL || bmp180data->md == NULL || bmp180data->addr == NULL) {
 		fprintf(stderr, "out of memory\n");
 		exit(EXIT_FAILURE);
 	}
 
+	// setup i2c, shared with the other sensors on the same bus
+	bmp180data->bus = i2c_open(bmp180data->path);
 	for(y = 0; y < bmp180data->nrid; y++) {
-		// setup i2c
-		bmp180data->fd[y] = wiringXI2CSetup(bmp180data->path, (int)strtol(bmp180data->id[y], NULL, 16));
-		if(bmp180data->fd[y] > 0) {
-			// read 0xD0 to check chip id: must equal 0x55 for BMP085/180
-			int id = wiringXI2CReadReg8(bmp180data->fd[y], 0xD0);
-			if(id != 0x55) {
+		unsigned char chip[2], cal[22];
+
+		bmp180data->addr[y] = (int)strtol(bmp180data->id[y], NULL, 16);
+		// read 0xD0 and 0xD1 to check the chip
+		if(i2c_read_block(bmp180data->bus, bmp180data->addr[y], 0xD0, chip, 2) == 0) {
+			// chip id: must equal 0x55 for BMP085/180
+			if(chip[0] != 0x55) {
 				logprintf(LOG_ERR, "wrong device detected");
 				exit(EXIT_FAILURE);
 			}
 
-			// read 0xD1 to check chip version: must equal 0x01 for BMP085 or 0x02 for BMP180
-			int version = wiringXI2CReadReg8(bmp180data->fd[y], 0xD1);
-			if(version != 0x01 && version != 0x02) {
+			// chip version: must equal 0x01 for BMP085 or 0x02 for BMP180
+			if(chip[1] != 0x01 && chip[1] != 0x02) {
 				logprintf(LOG_ERR, "wrong device detected");
 				exit(EXIT_FAILURE);
 			}
 
-			// read calibration coefficients from register addresses
-			bmp180data->ac1[y] = (short) readReg16(bmp180data->fd[y], 0xAA);
-			bmp180data->ac2[y] = (short) readReg16(bmp180data->fd[y], 0xAC);
-			bmp180data->ac3[y] = (short) readReg16(bmp180data->fd[y], 0xAE);
-			bmp180data->ac4[y] = (unsigned short) readReg16(bmp180data->fd[y], 0xB0);
-			bmp180data->ac5[y] = (unsigned short) readReg16(bmp180data->fd[y], 0xB2);
-			bmp180data->ac6[y] = (unsigned short) readReg16(bmp180data->fd[y], 0xB4);
-			bmp180data->b1[y] = (short) readReg16(bmp180data->fd[y], 0xB6);
-			bmp180data->b2[y] = (short) readReg16(bmp180data->fd[y], 0xB8);
-			bmp180data->mb[y] = (short) readReg16(bmp180data->fd[y], 0xBA);
-			bmp180data->mc[y] = (short) readReg16(bmp180data->fd[y], 0xBC);
-			bmp180data->md[y] = (short) readReg16(bmp180data->fd[y], 0xBE);
+			// read all calibration coefficients in one burst, 0xAA to 0xBF
+			if(i2c_read_block(bmp180data->bus, bmp180data->addr[y], 0xAA, cal, sizeof(cal)) != 0) {
+				logprintf(LOG_ERR, "data communication error");
+				exit(EXIT_FAILURE);
+			}
+			bmp180data->ac1[y] = (short) readReg16(cal, 0xAA);
+			bmp180data->ac2[y] = (short) readReg16(cal, 0xAC);
+			bmp180data->ac3[y] = (short) readReg16(cal, 0xAE);
+			bmp180data->ac4[y] = (unsigned short) readReg16(cal, 0xB0);
+			bmp180data->ac5[y] = (unsigned short) readReg16(cal, 0xB2);
+			bmp180data->ac6[y] = (unsigned short) readReg16(cal, 0xB4);
+			bmp180data->b1[y] = (short) readReg16(cal, 0xB6);
+			bmp180data->b2[y] = (short) readReg16(cal, 0xB8);
+			bmp180data->mb[y] = (short) readReg16(cal, 0xBA);
+			bmp180data->mc[y] = (short) readReg16(cal, 0xBC);
+			bmp180data->md[y] = (short) readReg16(cal, 0xBE);
 
 			// check communication: no result must equal 0 or 0xFFFF (=65535)
 			if (bmp180data->ac1[y] == 0 || bmp180data->ac1[y] == 0xFFFF ||
@@ -216,191 +376,15 @@ static void *thread(void *param) {
 		}
 	}
 
-	while (loop) {
-		if (protocol_thread_wait(node, interval, &nrloops) == ETIMEDOUT) {
-			pthread_mutex_lock(&lock);
-			for (y = 0; y < bmp180data->nrid; y++) {
-				if (bmp180data->fd[y] > 0) {
-					// uncompensated temperature value
-					unsigned short ut = 0;
-
-					// write 0x2E into Register 0xF4 to request a temperature reading.
-					wiringXI2CWriteReg8(bmp180data->fd[y], 0xF4, 0x2E);
-
-					// wait at least 4.5ms: we suspend execution for 5000 microseconds.
-					usleep(5000);
-
-					// read the two byte result from address 0xF6.
-					ut = (unsigned short) readReg16(bmp180data->fd[y], 0xF6);
-
-					// calculate temperature (in units of 0.1 deg C) given uncompensated value
-					int x1, x2;
-					x1 = (((int) ut - (int) bmp180data->ac6[y])) * (int) bmp180data->ac5[y] >> 15;
-					x2 = ((int) bmp180data->mc[y] << 11) / (x1 + bmp180data->md[y]);
-					int b5 = x1 + x2;
-					int temp = ((b5 + 8) >> 4);
-
-					// uncompensated pressure value
-					unsigned int up = 0;
-
-					// write 0x34+(BMP085_OVERSAMPLING_SETTING<<6) into register 0xF4
-					// request a pressure reading with specified oversampling setting
-					wiringXI2CWriteReg8(bmp180data->fd[y], 0xF4,
-							0x34 + (oversampling << 6));
-
-					// wait for conversion, delay time dependent on oversampling setting
-					unsigned int delay = (unsigned int) ((2 + (3 << oversampling)) * 1000);
-					usleep(delay);
-
-					// read the three byte result (block data): 0xF6 = MSB, 0xF7 = LSB and 0xF8 = XLSB
-					int msb = wiringXI2CReadReg8(bmp180data->fd[y], 0xF6);
-					int lsb = wiringXI2CReadReg8(bmp180data->fd[y], 0xF7);
-					int xlsb = wiringXI2CReadReg8(bmp180data->fd[y], 0xF8);
-					up = (((unsigned int) msb << 16) | ((unsigned int) lsb << 8) | (unsigned int) xlsb)
-							>> (8 - oversampling);
-
-					// calculate pressure (in Pa) given uncompensated value
-					int x3, b3, b6, pressure;
-					unsigned int b4, b7;
-
-					// calculate B6
-					b6 = b5 - 4000;
-
-					// calculate B3
-					x1 = (bmp180data->b2[y] * (b6 * b6) >> 12) >> 11;
-					x2 = (bmp180data->ac2[y] * b6) >> 11;
-					x3 = x1 + x2;
-					b3 = (((bmp180data->ac1[y] * 4 + x3) << oversampling) + 2) >> 2;
-
-					// calculate B4
-					x1 = (bmp180data->ac3[y] * b6) >> 13;
-					x2 = (bmp180data->b1[y] * ((b6 * b6) >> 12)) >> 16;
-					x3 = ((x1 + x2) + 2) >> 2;
-					b4 = (bmp180data->ac4[y] * (unsigned int) (x3 + 32768)) >> 15;
-
-					// calculate B7
-					b7 = ((up - (unsigned int) b3) * ((unsigned int) 50000 >> oversampling));
-
-					// calculate pressure in Pa
-					pressure = b7 < 0x80000000 ? (int) ((b7 << 1) / b4) : (int) ((b7 / b4) << 1);
-					x1 = (pressure >> 8) * (pressure >> 8);
-					x1 = (x1 * 3038) >> 16;
-					x2 = (-7357 * pressure) >> 16;
-					pressure += (x1 + x2 + 3791) >> 4;
-
-					bmp180->message = json_mkobject();
-					JsonNode *code = json_mkobject();
-					json_append_member(code, "id", json_mkstring(bmp180data->id[y]));
-					json_append_member(code, "temperature", json_mknumber(((double) temp / 10) + temp_offset, 1)); // in deg C
-					json_append_member(code, "pressure", json_mknumber(((double) pressure / 100) + pressure_offset, 1)); // in hPa
-
-					json_append_member(bmp180->message, "message", code);
-					json_append_member(bmp180->message, "origin", json_mkstring("receiver"));
-					json_append_member(bmp180->message, "protocol", json_mkstring(bmp180->id));
-
-					if(pilight.broadcast != NULL) {
-						pilight.broadcast(bmp180->id, bmp180->message, PROTOCOL);
-					}
-					json_delete(bmp180->message);
-					bmp180->message = NULL;
-				} else {
-					logprintf(LOG_NOTICE, "error connecting to bmp180");
-					logprintf(LOG_DEBUG, "(probably i2c bus error from wiringXI2CSetup)");
-					logprintf(LOG_DEBUG, "(maybe wrong id? use i2cdetect to find out)");
-					protocol_thread_wait(node, 1, &nrloops);
-				}
-			}
-			pthread_mutex_unlock(&lock);
-		}
-	}
-
-	if (bmp180data->id) {
-		for (y = 0; y < bmp180data->nrid; y++) {
-			FREE(bmp180data->id[y]);
-		}
-		FREE(bmp180data->id);
-	}
-	if (bmp180data->ac1) {
-		FREE(bmp180data->ac1);
-	}
-	if (bmp180data->ac2) {
-		FREE(bmp180data->ac2);
-	}
-	if (bmp180data->ac3) {
-		FREE(bmp180data->ac3);
-	}
-	if (bmp180data->ac4) {
-		FREE(bmp180data->ac4);
-	}
-	if (bmp180data->ac5) {
-		FREE(bmp180data->ac5);
-	}
-	if (bmp180data->ac6) {
-		FREE(bmp180data->ac6);
-	}
-	if (bmp180data->b1) {
-		FREE(bmp180data->b1);
-	}
-	if (bmp180data->b2) {
-		FREE(bmp180data->b2);
-	}
-	if (bmp180data->mb) {
-		FREE(bmp180data->mb);
-	}
-	if (bmp180data->mc) {
-		FREE(bmp180data->mc);
-	}
-	if (bmp180data->md) {
-		FREE(bmp180data->md);
-	}
-	if (bmp180data->fd) {
-		for (y = 0; y < bmp180data->nrid; y++) {
-			if (bmp180data->fd[y] > 0) {
-				close(bmp180data->fd[y]);
-			}
-		}
-		FREE(bmp180data->fd);
-	}
-	FREE(bmp180data);
-	threads--;
-
-	return (void *) NULL;
-}
-
-static struct threadqueue_t *initDev(JsonNode *jdevice) {
-	char *platform = GPIO_PLATFORM;
-
-	if(config_setting_get_string("gpio-platform", 0, &platform) != 0) {
-		logprintf(LOG_ERR, "no gpio-platform configured");
-		return NULL;
-	}
-	if(strcmp(platform, "none") == 0) {
-		FREE(platform);
-		logprintf(LOG_ERR, "no gpio-platform configured");
-		return NULL;
-	}
-	if(wiringXSetup(platform, logprintf1) < 0) {
-		FREE(platform);
-		return NULL;
-	} else {
-		FREE(platform);
-		loop = 1;
-		char *output = json_stringify(jdevice, NULL);
-		JsonNode *json = json_decode(output);
-		json_free(output);
+	/* Polled by the shared worker pool, no thread of its own */
+	poll = protocol_poll_init(bmp180, json, interval, thread, pollGC);
+	poll->data = bmp180data;
 
-		struct protocol_threads_t *node = protocol_thread_init(bmp180, json);
-		return threads_register("bmp180", &thread, (void *) node, 0);
-	}
+	return NULL;
 }
 
 static void threadGC(void) {
-	loop = 0;
-	protocol_thread_stop(bmp180);
-	while (threads > 0) {
-		usleep(10);
-	}
-	protocol_thread_free(bmp180);
+	protocol_poll_free(bmp180);
 }
 #endif
 
@@ -408,12 +392,6 @@ static void threadGC(void) {
 __attribute__((weak))
 #endif
 void bmp180Init(void) {
-#if !defined(__FreeBSD__) && !defined(_WIN32)
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&lock, &attr);
-#endif
-
 	protocol_register(&bmp180);
 	protocol_set_id(bmp180, "bmp180");
 	protocol_device_add(bmp180, "bmp180", "I2C Barometric Pressure and Temperature Sensor");
@@ -45,6 +45,7 @@
 #include "../../core/json.h"
 #include "../../config/settings.h"
 #include "../protocol.h"
+#include "../iio.h"
 #include "dht22.h"
 
 #define MAXTIMINGS 100
@@ -68,6 +69,24 @@ static uint8_t sizecvt(const int read_value) {
 	return (uint8_t)read_value;
 }
 
+static void broadcast(int gpio, double t, double h) {
+	dht22->message = json_mkobject();
+	JsonNode *code = json_mkobject();
+	json_append_member(code, "gpio", json_mknumber(gpio, 0));
+	json_append_member(code, "temperature", json_mknumber(t/10, 1));
+	json_append_member(code, "humidity", json_mknumber(h/10, 1));
+
+	json_append_member(dht22->message, "message", code);
+	json_append_member(dht22->message, "origin", json_mkstring("receiver"));
+	json_append_member(dht22->message, "protocol", json_mkstring(dht22->id));
+
+	if(pilight.broadcast != NULL) {
+		pilight.broadcast(dht22->id, dht22->message, PROTOCOL);
+	}
+	json_delete(dht22->message);
+	dht22->message = NULL;
+}
+
 static void *thread(void *param) {
 	struct protocol_threads_t *node = (struct protocol_threads_t *)param;
 	struct JsonNode *json = (struct JsonNode *)node->param;
@@ -76,6 +95,8 @@ static void *thread(void *param) {
 	int *id = 0;
 	int nrid = 0, y = 0, interval = 10, nrloops = 0, x = 0;
 	double temp_offset = 0.0, humi_offset = 0.0, itmp = 0.0;
+	char iio[256];
+	int useiio = 0, mt = 0, mh = 0;
 
 	threads++;
 
@@ -96,6 +117,19 @@ static void *thread(void *param) {
 	json_find_number(json, "temperature-offset", &temp_offset);
 	json_find_number(json, "humidity-offset", &humi_offset);
 
+	/*
+	 * When the kernel driver owns the sensor it does the timing
+	 * of the reads. The devices of the driver only tell their
+	 * gpio through the device tree, so without an iio-device the
+	 * driver must have a single one.
+	 */
+	itmp = -1;
+	json_find_number(json, "iio-device", &itmp);
+	if(nrid == 1 && iio_find("dht11", (int)itmp, iio, sizeof(iio)) == 0) {
+		logprintf(LOG_INFO, "dht22: reading gpio %d through %s", id[0], iio);
+		useiio = 1;
+	}
+
 	while(loop) {
 		if(protocol_thread_wait(node, interval, &nrloops) == ETIMEDOUT) {
 			pthread_mutex_lock(&lock);
@@ -103,6 +137,23 @@ static void *thread(void *param) {
 				int tries = 5;
 				unsigned short got_correct_date = 0;
 				while(tries && !got_correct_date && loop) {
+					if(useiio == 1) {
+						if(iio_read(iio, "in_temp_input", &mt) != 0 || iio_read(iio, "in_humidityrelative_input", &mh) != 0) {
+							logprintf(LOG_DEBUG, "dht22 read through %s failed", iio);
+							tries--;
+							protocol_thread_wait(node, 2, &nrloops);
+							continue;
+						}
+						got_correct_date = 1;
+
+						double t = (double)mt/100;
+						double h = (double)mh/100;
+						t += temp_offset;
+						h += humi_offset;
+
+						broadcast(id[y], t, h);
+						continue;
+					}
 
 					uint8_t laststate = HIGH;
 					uint8_t counter = 0;
@@ -161,21 +212,7 @@ static void *thread(void *param) {
 						if((dht22_dat[2] & 0x80) != 0)
 							t *= -1;
 
-						dht22->message = json_mkobject();
-						JsonNode *code = json_mkobject();
-						json_append_member(code, "gpio", json_mknumber(id[y], 0));
-						json_append_member(code, "temperature", json_mknumber(t/10, 1));
-						json_append_member(code, "humidity", json_mknumber(h/10, 1));
-
-						json_append_member(dht22->message, "message", code);
-						json_append_member(dht22->message, "origin", json_mkstring("receiver"));
-						json_append_member(dht22->message, "protocol", json_mkstring(dht22->id));
-
-						if(pilight.broadcast != NULL) {
-							pilight.broadcast(dht22->id, dht22->message, PROTOCOL);
-						}
-						json_delete(dht22->message);
-						dht22->message = NULL;
+						broadcast(id[y], t, h);
 					} else {
 						logprintf(LOG_DEBUG, "dht22 data checksum was wrong");
 						tries--;
@@ -296,6 +333,7 @@ void dht22Init(void) {
 	options_add(&dht22->options, "0", "humidity-decimals", OPTION_HAS_VALUE, GUI_SETTING, JSON_NUMBER, (void *)1, "[0-9]");
 	options_add(&dht22->options, "0", "show-temperature", OPTION_HAS_VALUE, GUI_SETTING, JSON_NUMBER, (void *)1, "^[10]{1}$");
 	options_add(&dht22->options, "0", "show-humidity", OPTION_HAS_VALUE, GUI_SETTING, JSON_NUMBER, (void *)1, "^[10]{1}$");
+	options_add(&dht22->options, "0", "iio-device", OPTION_HAS_VALUE, DEVICES_SETTING, JSON_NUMBER, (void *)-1, "^-?[0-9]+$");
 	options_add(&dht22->options, "0", "poll-interval", OPTION_HAS_VALUE, DEVICES_SETTING, JSON_NUMBER, (void *)10, "[0-9]");
 
 #if !defined(__FreeBSD__) && !defined(_WIN32)
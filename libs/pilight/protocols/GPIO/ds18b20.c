@@ -25,6 +25,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <limits.h>
 #include <sys/stat.h>
 #ifndef _WIN32
 	#ifdef __mips__
@@ -44,19 +45,102 @@
 #include "../../core/gc.h"
 #include "ds18b20.h"
 
-static unsigned short loop = 1;
-static unsigned short threads = 0;
+/*
+ * All sensors of all devices are read in one sweep of the
+ * bus, so a bus master that supports it can convert them
+ * all at once instead of one by one.
+ */
+typedef struct sensor_t {
+	char *id;
+	double temp_offset;
+} sensor_t;
+
+/*
+ * The sensors belong to the poll of the bus, so a sweep that
+ * still runs after a reload keeps its own list while the new
+ * devices get a new poll.
+ */
+typedef struct sensors_t {
+	struct sensor_t *sensor;
+	int nr;
+} sensors_t;
+
+static struct protocol_poll_t *bus = NULL;
+static char *sensor = NULL;
+static char *content = NULL;
+
 static char source_path[21];
 
 static pthread_mutex_t lock;
 static pthread_mutexattr_t attr;
 
-static void *ds18b20Parse(void *param) {
-	struct protocol_threads_t *node = (struct protocol_threads_t *)param;
-	struct JsonNode *json = (struct JsonNode *)node->param;
-	struct JsonNode *jid = NULL;
-	struct JsonNode *jchild = NULL;
+#ifndef _WIN32
+/*
+ * Start a conversion on every sensor of every bus master
+ * at once, and wait until they are all done. Afterwards
+ * the w1_slave files return the results without starting
+ * a conversion of their own.
+ */
+static void bulkRead(void) {
+	struct dirent *file = NULL;
+	DIR *d = NULL;
+	FILE *fp = NULL;
+	char path[PATH_MAX], **masters = NULL, state[8];
+	int nrmasters = 0, x = 0, i = 0, done = 0;
+
+	if((d = opendir(source_path)) == NULL) {
+		return;
+	}
+	while((file = readdir(d)) != NULL) {
+		if(strncmp(file->d_name, "w1_bus_master", 13) != 0) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s%s/therm_bulk_read", source_path, file->d_name);
+		if((fp = fopen(path, "w")) == NULL) {
+			continue;
+		}
+		if(fputs("trigger\n", fp) >= 0) {
+			if((masters = REALLOC(masters, sizeof(char *)*(size_t)(nrmasters+1))) == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+			if((masters[nrmasters] = STRDUP(path)) == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(EXIT_FAILURE);
+			}
+			nrmasters++;
+		}
+		fclose(fp);
+	}
+	closedir(d);
+
+	/* A conversion at the highest resolution takes 750ms */
+	for(i=0;i<100 && done < nrmasters;i++) {
+		usleep(10000);
+		done = 0;
+		for(x=0;x<nrmasters;x++) {
+			memset(state, '\0', sizeof(state));
+			if((fp = fopen(masters[x], "r")) != NULL) {
+				if(fgets(state, sizeof(state), fp) == NULL || atoi(state) != -1) {
+					done++;
+				}
+				fclose(fp);
+			} else {
+				done++;
+			}
+		}
+	}
+
+	for(x=0;x<nrmasters;x++) {
+		FREE(masters[x]);
+	}
+	if(masters != NULL) {
+		FREE(masters);
+	}
+}
+#endif
 
+static void ds18b20Parse(struct protocol_poll_t *poll) {
 #ifndef _WIN32
 	struct dirent *file = NULL;
 	struct stat st;
@@ -67,155 +151,182 @@ static void *ds18b20Parse(void *param) {
 	int w1valid = 0;
 	double w1temp = 0.0;
 	size_t bytes = 0;
-#endif
-	char **id = NULL, *stmp = NULL, *content = NULL;
-	char *ds18b20_sensor = NULL;
-	int nrid = 0, interval = 10, nrloops = 0, y = 0;
-	double temp_offset = 0.0, itmp = 0.0;
+	int y = 0, nrsensors = 0;
+	struct sensor_t *sensors = NULL;
+
+	pthread_mutex_lock(&lock);
+	sensors = ((struct sensors_t *)poll->data)->sensor;
+	nrsensors = ((struct sensors_t *)poll->data)->nr;
+	bulkRead();
+	for(y=0;y<nrsensors;y++) {
+		if((sensor = REALLOC(sensor, strlen(source_path)+strlen(sensors[y].id)+5)) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		sprintf(sensor, "%s28-%s/", source_path, sensors[y].id);
+		if((d = opendir(sensor))) {
+			while((file = readdir(d)) != NULL) {
+				if(file->d_type == DT_REG) {
+					if(strcmp(file->d_name, "w1_slave") == 0) {
+						size_t w1slavelen = strlen(sensor)+10;
+						char ds18b20_w1slave[w1slavelen];
+						memset(ds18b20_w1slave, '\0', w1slavelen);
+						strncpy(ds18b20_w1slave, sensor, strlen(sensor));
+						strcat(ds18b20_w1slave, "w1_slave");
+
+						if(!(fp = fopen(ds18b20_w1slave, "rb"))) {
+							logprintf(LOG_ERR, "cannot read w1 file: %s", ds18b20_w1slave);
+							break;
+						}
 
-	threads++;
+						fstat(fileno(fp), &st);
+						bytes = (size_t)st.st_size;
 
-	if((jid = json_find_member(json, "id"))) {
-		jchild = json_first_child(jid);
-		while(jchild) {
-			if(json_find_string(jchild, "id", &stmp) == 0) {
-				if((id = REALLOC(id, (sizeof(char *)*(size_t)(nrid+1)))) == NULL) {
-					fprintf(stderr, "out of memory\n");
-					exit(EXIT_FAILURE);
-				}
-				if((id[nrid] = MALLOC(strlen(stmp)+1)) == NULL) {
-					fprintf(stderr, "out of memory\n");
-					exit(EXIT_FAILURE);
-				}
-				strcpy(id[nrid], stmp);
-				nrid++;
-			}
-			jchild = jchild->next;
-		}
-	}
+						if((content = REALLOC(content, bytes+1)) == NULL) {
+							fprintf(stderr, "out of memory\n");
+							fclose(fp);
+							break;
+						}
+						memset(content, '\0', bytes+1);
 
-	if(json_find_number(json, "poll-interval", &itmp) == 0)
-		interval = (int)round(itmp);
-	json_find_number(json, "temperature-offset", &temp_offset);
+						if(fread(content, sizeof(char), bytes, fp) == -1) {
+							logprintf(LOG_ERR, "cannot read config file: %s", ds18b20_w1slave);
+							fclose(fp);
+							break;
+						}
+						fclose(fp);
+						w1valid = 0;
+
+						char **array = NULL;
+						unsigned int n = explode(content, "\n", &array);
+						if(n > 0) {
+							sscanf(array[0], "%*x %*x %*x %*x %*x %*x %*x %*x %*x : crc=%*x %s", crcVar);
+							if(strncmp(crcVar, "YES", 3) == 0 && n > 1) {
+								w1valid = 1;
+								sscanf(array[1], "%*x %*x %*x %*x %*x %*x %*x %*x %*x t=%lf", &w1temp);
+								w1temp = (w1temp/1000)+sensors[y].temp_offset;
+							}
+						}
+						array_free(&array, n);
 
-	while(loop) {
-		if(protocol_thread_wait(node, interval, &nrloops) == ETIMEDOUT) {
-#ifndef _WIN32
-			pthread_mutex_lock(&lock);
-			for(y=0;y<nrid;y++) {
-				if((ds18b20_sensor = REALLOC(ds18b20_sensor, strlen(source_path)+strlen(id[y])+5)) == NULL) {
-					fprintf(stderr, "out of memory\n");
-					exit(EXIT_FAILURE);
-				}
-				sprintf(ds18b20_sensor, "%s28-%s/", source_path, id[y]);
-				if((d = opendir(ds18b20_sensor))) {
-					while((file = readdir(d)) != NULL) {
-						if(file->d_type == DT_REG) {
-							if(strcmp(file->d_name, "w1_slave") == 0) {
-								size_t w1slavelen = strlen(ds18b20_sensor)+10;
-								char ds18b20_w1slave[w1slavelen];
-								memset(ds18b20_w1slave, '\0', w1slavelen);
-								strncpy(ds18b20_w1slave, ds18b20_sensor, strlen(ds18b20_sensor));
-								strcat(ds18b20_w1slave, "w1_slave");
-
-								if(!(fp = fopen(ds18b20_w1slave, "rb"))) {
-									logprintf(LOG_ERR, "cannot read w1 file: %s", ds18b20_w1slave);
-									break;
-								}
-
-								fstat(fileno(fp), &st);
-								bytes = (size_t)st.st_size;
-
-								if((content = REALLOC(content, bytes+1)) == NULL) {
-									fprintf(stderr, "out of memory\n");
-									fclose(fp);
-									break;
-								}
-								memset(content, '\0', bytes+1);
-
-								if(fread(content, sizeof(char), bytes, fp) == -1) {
-									logprintf(LOG_ERR, "cannot read config file: %s", ds18b20_w1slave);
-									fclose(fp);
-									break;
-								}
-								fclose(fp);
-								w1valid = 0;
-
-								char **array = NULL;
-								unsigned int n = explode(content, "\n", &array);
-								if(n > 0) {
-									sscanf(array[0], "%*x %*x %*x %*x %*x %*x %*x %*x %*x : crc=%*x %s", crcVar);
-									if(strncmp(crcVar, "YES", 3) == 0 && n > 1) {
-										w1valid = 1;
-										sscanf(array[1], "%*x %*x %*x %*x %*x %*x %*x %*x %*x t=%lf", &w1temp);
-										w1temp = (w1temp/1000)+temp_offset;
-									}
-								}
-								array_free(&array, n);
-
-								if(w1valid) {
-									ds18b20->message = json_mkobject();
-
-									JsonNode *code = json_mkobject();
-
-									json_append_member(code, "id", json_mkstring(id[y]));
-									json_append_member(code, "temperature", json_mknumber(w1temp, 3));
-
-									json_append_member(ds18b20->message, "message", code);
-									json_append_member(ds18b20->message, "origin", json_mkstring("receiver"));
-									json_append_member(ds18b20->message, "protocol", json_mkstring(ds18b20->id));
-
-									if(pilight.broadcast != NULL) {
-										pilight.broadcast(ds18b20->id, ds18b20->message, PROTOCOL);
-									}
-									json_delete(ds18b20->message);
-									ds18b20->message = NULL;
-								}
+						if(w1valid) {
+							ds18b20->message = json_mkobject();
+
+							JsonNode *code = json_mkobject();
+
+							json_append_member(code, "id", json_mkstring(sensors[y].id));
+							json_append_member(code, "temperature", json_mknumber(w1temp, 3));
+
+							json_append_member(ds18b20->message, "message", code);
+							json_append_member(ds18b20->message, "origin", json_mkstring("receiver"));
+							json_append_member(ds18b20->message, "protocol", json_mkstring(ds18b20->id));
+
+							if(pilight.broadcast != NULL) {
+								pilight.broadcast(ds18b20->id, ds18b20->message, PROTOCOL);
 							}
+							json_delete(ds18b20->message);
+							ds18b20->message = NULL;
 						}
 					}
-					closedir(d);
-				} else {
-					logprintf(LOG_ERR, "1-wire device %s does not exist", ds18b20_sensor);
 				}
 			}
-#endif
-			pthread_mutex_unlock(&lock);
+			closedir(d);
+		} else {
+			logprintf(LOG_ERR, "1-wire device %s does not exist", sensor);
 		}
 	}
 	pthread_mutex_unlock(&lock);
+#endif
+}
 
-	if(ds18b20_sensor) {
-		FREE(ds18b20_sensor);
+static void pollGC(struct protocol_poll_t *poll) {
+	struct sensors_t *sensors = poll->data;
+	int y = 0;
+
+	pthread_mutex_lock(&lock);
+	if(sensor != NULL) {
+		FREE(sensor);
 	}
-	if(content) {
+	if(content != NULL) {
 		FREE(content);
 	}
-	for(y=0;y<nrid;y++) {
-		FREE(id[y]);
+	for(y=0;y<sensors->nr;y++) {
+		FREE(sensors->sensor[y].id);
+	}
+	if(sensors->sensor != NULL) {
+		FREE(sensors->sensor);
 	}
-	FREE(id);
-	threads--;
-	return (void *)NULL;
+	FREE(sensors);
+	pthread_mutex_unlock(&lock);
 }
 
 static struct threadqueue_t *initDev(JsonNode *jdevice) {
-	loop = 1;
+	struct JsonNode *jid = NULL;
+	struct JsonNode *jchild = NULL;
+	struct sensors_t *sensors = NULL;
+	char *stmp = NULL;
+	int interval = 10;
+	double itmp = 0.0, temp_offset = 0.0;
+
 	char *output = json_stringify(jdevice, NULL);
 	JsonNode *json = json_decode(output);
 	json_free(output);
 
-	struct protocol_threads_t *node = protocol_thread_init(ds18b20, json);
-	return threads_register("ds18b20", &ds18b20Parse, (void *)node, 0);
+	if(json_find_number(json, "poll-interval", &itmp) == 0)
+		interval = (int)round(itmp);
+	json_find_number(json, "temperature-offset", &temp_offset);
+
+	pthread_mutex_lock(&lock);
+	/* The bus is swept at the shortest interval of all devices */
+	if(bus == NULL) {
+		if((sensors = MALLOC(sizeof(struct sensors_t))) == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		sensors->sensor = NULL;
+		sensors->nr = 0;
+		bus = protocol_poll_init(ds18b20, json, interval, ds18b20Parse, pollGC);
+		bus->data = sensors;
+	} else {
+		sensors = bus->data;
+		protocol_poll_interval(bus, interval);
+	}
+
+	if((jid = json_find_member(json, "id"))) {
+		jchild = json_first_child(jid);
+		while(jchild) {
+			if(json_find_string(jchild, "id", &stmp) == 0) {
+				if((sensors->sensor = REALLOC(sensors->sensor, (sizeof(struct sensor_t)*(size_t)(sensors->nr+1)))) == NULL) {
+					fprintf(stderr, "out of memory\n");
+					exit(EXIT_FAILURE);
+				}
+				if((sensors->sensor[sensors->nr].id = MALLOC(strlen(stmp)+1)) == NULL) {
+					fprintf(stderr, "out of memory\n");
+					exit(EXIT_FAILURE);
+				}
+				strcpy(sensors->sensor[sensors->nr].id, stmp);
+				sensors->sensor[sensors->nr].temp_offset = temp_offset;
+				sensors->nr++;
+			}
+			jchild = jchild->next;
+		}
+	}
+
+	/* The first device hands its json to the poll */
+	if(bus->param != json) {
+		json_delete(json);
+	}
+	pthread_mutex_unlock(&lock);
+
+	return NULL;
 }
 
 static void threadGC(void) {
-	loop = 0;
-	protocol_thread_stop(ds18b20);
-	while(threads > 0) {
-		usleep(10);
-	}
-	protocol_thread_free(ds18b20);
+	/* A sweep that still runs frees its sensors when it's done */
+	pthread_mutex_lock(&lock);
+	bus = NULL;
+	pthread_mutex_unlock(&lock);
+	protocol_poll_free(ds18b20);
 }
 
 #if !defined(MODULE) && !defined(_WIN32)
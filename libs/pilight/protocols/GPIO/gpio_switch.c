@@ -19,10 +19,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
 #ifndef _WIN32
+#include <poll.h>
 #include <wiringx.h>
 #endif
 
@@ -32,15 +36,41 @@
 #include "../../core/log.h"
 #include "../../core/irq.h"
 #include "../../core/gc.h"
+#include "../../core/ntp.h"
+#include "../../core/gpiomem.h"
 #include "../../config/settings.h"
 #include "../protocol.h"
 #include "gpio_switch.h"
 
+#define DEBOUNCE	20
+
 #if !defined(__FreeBSD__) && !defined(_WIN32)
 
+/*
+ * All inputs are watched by a single thread, blocked on the
+ * interrupt of every gpio. An edge only starts the debounce
+ * time, the pin is read once it stopped bouncing, so a contact
+ * is reported once per change.
+ */
+typedef struct input_t {
+	int gpio;
+	int fd;
+	int state;
+	int debounce;
+	/* The first edge since the pin settled, 0 when it did */
+	unsigned long edge;
+	struct input_t *next;
+} input_t;
+
 static unsigned short loop = 1;
 static int threads = 0;
 
+static struct input_t *inputs = NULL;
+static int nrinputs = 0;
+static int running = 0;
+static int wakeup[2] = { -1, -1 };
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
 static void createMessage(int gpio, int state) {
 	gpio_switch->message = json_mkobject();
 	JsonNode *code = json_mkobject();
@@ -63,35 +93,79 @@ static void createMessage(int gpio, int state) {
 }
 
 static void *thread(void *param) {
-	struct protocol_threads_t *node = (struct protocol_threads_t *)param;
-	struct JsonNode *json = (struct JsonNode *)node->param;
-	struct JsonNode *jid = NULL;
-	struct JsonNode *jchild = NULL;
-	int id = 0, state = 0, nstate = 0;
-	double itmp = 0.0;
+	struct input_t **watched = NULL, *tmp = NULL;
+	struct pollfd *fds = NULL;
+	unsigned long now = 0, due = 0;
+	int i = 0, n = 0, timeout = -1, nstate = 0;
+	uint8_t c = 0;
 
 	threads++;
 
-	if((jid = json_find_member(json, "id"))) {
-		jchild = json_first_child(jid);
-		if(json_find_number(jchild, "gpio", &itmp) == 0) {
-			id = (int)round(itmp);
-			pinMode(id, PINMODE_INPUT);
-			state = digitalRead(id);
+	while(loop) {
+		pthread_mutex_lock(&lock);
+		if((fds = REALLOC(fds, sizeof(struct pollfd)*(size_t)(nrinputs+1))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
 		}
-	}
+		if((watched = REALLOC(watched, sizeof(struct input_t *)*(size_t)(nrinputs+1))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		fds[0].fd = wakeup[0];
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		n = 1;
+		timeout = -1;
+		now = pilight_monotonic_us();
+		tmp = inputs;
+		while(tmp) {
+			fds[n].fd = tmp->fd;
+			fds[n].events = POLLPRI;
+			fds[n].revents = 0;
+			watched[n++] = tmp;
+			if(tmp->edge > 0) {
+				due = tmp->edge+(unsigned long)tmp->debounce*1000;
+				i = (due > now) ? (int)((due-now+999)/1000) : 0;
+				if(timeout == -1 || i < timeout) {
+					timeout = i;
+				}
+			}
+			tmp = tmp->next;
+		}
+		pthread_mutex_unlock(&lock);
 
-	createMessage(id, state);
+		if(poll(fds, (nfds_t)n, timeout) < 0) {
+			continue;
+		}
+		now = pilight_monotonic_us();
 
-	while(loop) {
-		nstate = digitalRead(id);
-		if(nstate != state) {
-			state = nstate;
-			createMessage(id, state);
+		pthread_mutex_lock(&lock);
+		if((fds[0].revents & POLLIN) != 0) {
+			while(read(wakeup[0], &c, 1) == 1 && loop);
 		}
-		usleep(100000);
+		for(i=1;i<n && loop;i++) {
+			tmp = watched[i];
+			if((fds[i].revents & (POLLPRI | POLLERR)) != 0) {
+				(void)read(tmp->fd, &c, 1);
+				lseek(tmp->fd, 0, SEEK_SET);
+				if(tmp->edge == 0) {
+					tmp->edge = now;
+				}
+			}
+			if(tmp->edge > 0 && now >= tmp->edge+(unsigned long)tmp->debounce*1000) {
+				nstate = gpio_read(tmp->gpio);
+				if(nstate != tmp->state) {
+					logprintf(LOG_DEBUG, "gpio_switch: gpio %d changed %lu us after its first edge", tmp->gpio, now-tmp->edge);
+					tmp->state = nstate;
+					createMessage(tmp->gpio, tmp->state);
+				}
+				tmp->edge = 0;
+			}
+		}
+		pthread_mutex_unlock(&lock);
 	}
 
+	FREE(fds);
+	FREE(watched);
+
 	threads--;
 	return (void *)NULL;
 }
@@ -112,13 +186,68 @@ static struct threadqueue_t *initDev(JsonNode *jdevice) {
 		FREE(platform);
 		return NULL;
 	}
+	gpiomem_setup(platform);
 	FREE(platform);
 
-	loop = 1;
+	struct JsonNode *jid = NULL;
+	struct JsonNode *jchild = NULL;
+	struct input_t *input = NULL;
+	double itmp = 0.0;
+	int gpio = -1, fd = -1, debounce = DEBOUNCE;
+
 	char *output = json_stringify(jdevice, NULL);
 	JsonNode *json = json_decode(output);
 	json_free(output);
 
+	if((jid = json_find_member(json, "id"))) {
+		jchild = json_first_child(jid);
+		if(json_find_number(jchild, "gpio", &itmp) == 0) {
+			gpio = (int)round(itmp);
+		}
+	}
+	if(json_find_number(json, "debounce", &itmp) == 0) {
+		debounce = (int)round(itmp);
+	}
+
+	if(gpio < 0 || wiringXISR(gpio, ISR_MODE_BOTH) < 0 || (fd = wiringXSelectableFd(gpio)) < 0) {
+		logprintf(LOG_ERR, "gpio_switch: unable to register interrupt for gpio %d", gpio);
+		json_delete(json);
+		return NULL;
+	}
+
+	if((input = MALLOC(sizeof(struct input_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(input, 0, sizeof(struct input_t));
+	input->gpio = gpio;
+	input->fd = fd;
+	input->debounce = debounce;
+	input->state = gpio_read(gpio);
+
+	createMessage(input->gpio, input->state);
+
+	pthread_mutex_lock(&lock);
+	input->next = inputs;
+	inputs = input;
+	nrinputs++;
+	if(running == 1) {
+		pthread_mutex_unlock(&lock);
+		json_delete(json);
+		/* Let the running thread watch the new input as well */
+		(void)write(wakeup[1], "w", 1);
+		return NULL;
+	}
+	if(pipe(wakeup) != 0) {
+		pthread_mutex_unlock(&lock);
+		logprintf(LOG_ERR, "gpio_switch: unable to create a pipe");
+		json_delete(json);
+		return NULL;
+	}
+	fcntl(wakeup[0], F_SETFL, fcntl(wakeup[0], F_GETFL, 0) | O_NONBLOCK);
+	running = 1;
+	loop = 1;
+	pthread_mutex_unlock(&lock);
+
 	struct protocol_threads_t *node = protocol_thread_init(gpio_switch, json);
 	return threads_register("gpio_switch", &thread, (void *)node, 0);
 }
@@ -172,12 +301,34 @@ static int checkValues(struct JsonNode *jvalues) {
 }
 
 static void threadGC(void) {
+	struct input_t *tmp = NULL;
+
 	loop = 0;
+	if(running == 1) {
+		(void)write(wakeup[1], "w", 1);
+	}
 	protocol_thread_stop(gpio_switch);
 	while(threads > 0) {
 		usleep(10);
 	}
 	protocol_thread_free(gpio_switch);
+
+	pthread_mutex_lock(&lock);
+	/* The interrupt fds belong to wiringX */
+	while(inputs) {
+		tmp = inputs;
+		inputs = inputs->next;
+		FREE(tmp);
+	}
+	nrinputs = 0;
+	if(running == 1) {
+		close(wakeup[0]);
+		close(wakeup[1]);
+		wakeup[0] = -1;
+		wakeup[1] = -1;
+		running = 0;
+	}
+	pthread_mutex_unlock(&lock);
 }
 #endif
 
@@ -196,6 +347,7 @@ void gpioSwitchInit(void) {
 	options_add(&gpio_switch->options, "f", "off", OPTION_NO_VALUE, DEVICES_STATE, JSON_STRING, NULL, NULL);
 	options_add(&gpio_switch->options, "g", "gpio", OPTION_HAS_VALUE, DEVICES_ID, JSON_NUMBER, NULL, "^([0-9]{1}|1[0-9]|20)$");
 
+	options_add(&gpio_switch->options, "0", "debounce", OPTION_HAS_VALUE, DEVICES_SETTING, JSON_NUMBER, (void *)DEBOUNCE, "^[0-9]+$");
 	options_add(&gpio_switch->options, "0", "readonly", OPTION_HAS_VALUE, GUI_SETTING, JSON_NUMBER, (void *)1, "^[10]{1}$");
 	options_add(&gpio_switch->options, "0", "confirm", OPTION_HAS_VALUE, GUI_SETTING, JSON_NUMBER, (void *)1, "^[10]{1}$");
 
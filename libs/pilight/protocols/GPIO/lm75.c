@@ -43,6 +43,7 @@
 #include "../../core/binary.h"
 #include "../../core/gc.h"
 #include "../../core/json.h"
+#include "../../core/i2c.h"
 #include "../../config/settings.h"
 #include "../protocol.h"
 #include "lm75.h"
@@ -52,35 +53,94 @@ typedef struct settings_t {
 	char **id;
 	char path[PATH_MAX];
 	int nrid;
-	int *fd;
+	struct i2c_bus_t *bus;
+	int *addr;
+	double temp_offset;
 } settings_t;
 
-static unsigned short loop = 1;
-static int threads = 0;
+static void thread(struct protocol_poll_t *poll) {
+	struct settings_t *lm75data = (struct settings_t *)poll->data;
+	int y = 0, raw = 0;
 
-static pthread_mutex_t lock;
-static pthread_mutexattr_t attr;
+	for(y=0;y<lm75data->nrid;y++) {
+		if((raw = i2c_read_reg16(lm75data->bus, lm75data->addr[y], 0x00)) >= 0) {
+			float temp = ((float)((raw&0x00ff)+((raw>>15)?0:0.5))*10);
+
+			lm75->message = json_mkobject();
+			JsonNode *code = json_mkobject();
+			json_append_member(code, "id", json_mkstring(lm75data->id[y]));
+			json_append_member(code, "temperature", json_mknumber((temp+lm75data->temp_offset)/10, 1));
+
+			json_append_member(lm75->message, "message", code);
+			json_append_member(lm75->message, "origin", json_mkstring("receiver"));
+			json_append_member(lm75->message, "protocol", json_mkstring(lm75->id));
+
+			if(pilight.broadcast != NULL) {
+				pilight.broadcast(lm75->id, lm75->message, PROTOCOL);
+			}
+			json_delete(lm75->message);
+			lm75->message = NULL;
+		} else {
+			logprintf(LOG_NOTICE, "error connecting to lm75");
+			logprintf(LOG_DEBUG, "(probably i2c bus error)");
+			logprintf(LOG_DEBUG, "(maybe wrong id? use i2cdetect to find out)");
+		}
+	}
+}
+
+static void pollGC(struct protocol_poll_t *poll) {
+	struct settings_t *lm75data = (struct settings_t *)poll->data;
+	int y = 0;
+
+	if(lm75data == NULL) {
+		return;
+	}
+	if(lm75data->id) {
+		for(y=0;y<lm75data->nrid;y++) {
+			FREE(lm75data->id[y]);
+		}
+		FREE(lm75data->id);
+	}
+	if(lm75data->addr) {
+		FREE(lm75data->addr);
+	}
+	i2c_close(lm75data->bus);
+	FREE(lm75data);
+}
 
-static void *thread(void *param) {
-	struct protocol_threads_t *node = (struct protocol_threads_t *)param;
-	struct JsonNode *json = (struct JsonNode *)node->param;
+static struct threadqueue_t *initDev(JsonNode *jdevice) {
+	struct protocol_poll_t *poll = NULL;
+	struct settings_t *lm75data = NULL;
 	struct JsonNode *jid = NULL;
 	struct JsonNode *jchild = NULL;
-	struct settings_t *lm75data = MALLOC(sizeof(struct settings_t));
-	int y = 0, interval = 10, nrloops = 0;
-	char *stmp = NULL;
-	double itmp = -1, temp_offset = 0.0;
+	char *platform = GPIO_PLATFORM, *stmp = NULL;
+	int y = 0, interval = 10;
+	double itmp = -1;
 
-	if(lm75data == NULL) {
-		fprintf(stderr, "out of memory\n");
-		exit(EXIT_FAILURE);
+	if(config_setting_get_string("gpio-platform", 0, &platform) != 0) {
+		logprintf(LOG_ERR, "no gpio-platform configured");
+		return NULL;
+	}
+	if(strcmp(platform, "none") == 0) {
+		FREE(platform);
+		logprintf(LOG_ERR, "no gpio-platform configured");
+		return NULL;
+	}
+	if(wiringXSetup(platform, logprintf1) < 0) {
+		FREE(platform);
+		return NULL;
 	}
+	FREE(platform);
 
-	lm75data->nrid = 0;
-	lm75data->id = NULL;
-	lm75data->fd = 0;
+	char *output = json_stringify(jdevice, NULL);
+	JsonNode *json = json_decode(output);
+	json_free(output);
 
-	threads++;
+	if((lm75data = MALLOC(sizeof(struct settings_t))) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(lm75data, 0, sizeof(struct settings_t));
 
 	if((jid = json_find_member(json, "id"))) {
 		jchild = json_first_child(jid);
@@ -106,105 +166,27 @@ static void *thread(void *param) {
 
 	if(json_find_number(json, "poll-interval", &itmp) == 0)
 		interval = (int)round(itmp);
-	json_find_number(json, "temperature-offset", &temp_offset);
+	json_find_number(json, "temperature-offset", &lm75data->temp_offset);
 
-	if((lm75data->fd = REALLOC(lm75data->fd, (sizeof(int)*(size_t)(lm75data->nrid+1)))) == NULL) {
+	if((lm75data->addr = REALLOC(lm75data->addr, (sizeof(int)*(size_t)(lm75data->nrid+1)))) == NULL) {
 		fprintf(stderr, "out of memory\n");
 		exit(EXIT_FAILURE);
 	}
 	for(y=0;y<lm75data->nrid;y++) {
-		lm75data->fd[y] = wiringXI2CSetup(lm75data->path, (int)strtol(lm75data->id[y], NULL, 16));
+		lm75data->addr[y] = (int)strtol(lm75data->id[y], NULL, 16);
 	}
+	/* Shared with the other sensors on the same bus */
+	lm75data->bus = i2c_open(lm75data->path);
 
-	while(loop) {
-		if(protocol_thread_wait(node, interval, &nrloops) == ETIMEDOUT) {
-			pthread_mutex_lock(&lock);
-			for(y=0;y<lm75data->nrid;y++) {
-				if(lm75data->fd[y] > 0) {
-					int raw = wiringXI2CReadReg16(lm75data->fd[y], 0x00);
-					float temp = ((float)((raw&0x00ff)+((raw>>15)?0:0.5))*10);
-
-					lm75->message = json_mkobject();
-					JsonNode *code = json_mkobject();
-					json_append_member(code, "id", json_mkstring(lm75data->id[y]));
-					json_append_member(code, "temperature", json_mknumber((temp+temp_offset)/10, 1));
-
-					json_append_member(lm75->message, "message", code);
-					json_append_member(lm75->message, "origin", json_mkstring("receiver"));
-					json_append_member(lm75->message, "protocol", json_mkstring(lm75->id));
-
-					if(pilight.broadcast != NULL) {
-						pilight.broadcast(lm75->id, lm75->message, PROTOCOL);
-					}
-					json_delete(lm75->message);
-					lm75->message = NULL;
-				} else {
-					logprintf(LOG_NOTICE, "error connecting to lm75");
-					logprintf(LOG_DEBUG, "(probably i2c bus error from wiringXI2CSetup)");
-					logprintf(LOG_DEBUG, "(maybe wrong id? use i2cdetect to find out)");
-					protocol_thread_wait(node, 1, &nrloops);
-				}
-			}
-			pthread_mutex_unlock(&lock);
-		}
-	}
-	pthread_mutex_unlock(&lock);
-
-	if(lm75data->id) {
-		for(y=0;y<lm75data->nrid;y++) {
-			FREE(lm75data->id[y]);
-		}
-		FREE(lm75data->id);
-	}
-	if(lm75data->fd) {
-		for(y=0;y<lm75data->nrid;y++) {
-			if(lm75data->fd[y] > 0) {
-				close(lm75data->fd[y]);
-			}
-		}
-		FREE(lm75data->fd);
-	}
-	FREE(lm75data);
-	threads--;
-
-	return (void *)NULL;
-}
-
-static struct threadqueue_t *initDev(JsonNode *jdevice) {
-	char *platform = GPIO_PLATFORM;
+	/* Polled by the shared worker pool, no thread of its own */
+	poll = protocol_poll_init(lm75, json, interval, thread, pollGC);
+	poll->data = lm75data;
 
-	if(config_setting_get_string("gpio-platform", 0, &platform) != 0) {
-		logprintf(LOG_ERR, "no gpio-platform configured");
-		return NULL;
-	}
-	if(strcmp(platform, "none") == 0) {
-		FREE(platform);
-		logprintf(LOG_ERR, "no gpio-platform configured");
-		return NULL;
-	}
-	if(wiringXSetup(platform, logprintf1) < 0) {
-		FREE(platform);
-		return NULL;
-	} else {
-		FREE(platform);
-
-		loop = 1;
-		char *output = json_stringify(jdevice, NULL);
-		JsonNode *json = json_decode(output);
-		json_free(output);
-
-		struct protocol_threads_t *node = protocol_thread_init(lm75, json);
-		return threads_register("lm75", &thread, (void *)node, 0);
-	}
+	return NULL;
 }
 
 static void threadGC(void) {
-	loop = 0;
-	protocol_thread_stop(lm75);
-	while(threads > 0) {
-		usleep(10);
-	}
-	protocol_thread_free(lm75);
+	protocol_poll_free(lm75);
 }
 #endif
 
@@ -212,12 +194,6 @@ static void threadGC(void) {
 __attribute__((weak))
 #endif
 void lm75Init(void) {
-#if !defined(__FreeBSD__) && !defined(_WIN32)
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&lock, &attr);
-#endif
-
 	protocol_register(&lm75);
 	protocol_set_id(lm75, "lm75");
 	protocol_device_add(lm75, "lm75", "TI I2C Temperature Sensor");
@@ -43,6 +43,7 @@
 #include "../../core/binary.h"
 #include "../../core/gc.h"
 #include "../../core/json.h"
+#include "../../core/i2c.h"
 #include "../../config/settings.h"
 #include "../protocol.h"
 #include "lm76.h"
@@ -52,35 +53,94 @@ typedef struct settings_t {
 	char **id;
 	char path[PATH_MAX];
 	int nrid;
-	int *fd;
+	struct i2c_bus_t *bus;
+	int *addr;
+	double temp_offset;
 } settings_t;
 
-static unsigned short loop = 1;
-static int threads = 0;
+static void thread(struct protocol_poll_t *poll) {
+	struct settings_t *lm76data = (struct settings_t *)poll->data;
+	int y = 0, raw = 0;
 
-static pthread_mutex_t lock;
-static pthread_mutexattr_t attr;
+	for(y=0;y<lm76data->nrid;y++) {
+		if((raw = i2c_read_reg16(lm76data->bus, lm76data->addr[y], 0x00)) >= 0) {
+			float temp = ((float)((raw&0x00ff)+((raw>>12)*0.0625)));
+
+			lm76->message = json_mkobject();
+			JsonNode *code = json_mkobject();
+			json_append_member(code, "id", json_mkstring(lm76data->id[y]));
+			json_append_member(code, "temperature", json_mknumber(temp+lm76data->temp_offset, 3));
+
+			json_append_member(lm76->message, "message", code);
+			json_append_member(lm76->message, "origin", json_mkstring("receiver"));
+			json_append_member(lm76->message, "protocol", json_mkstring(lm76->id));
+
+			if(pilight.broadcast != NULL) {
+				pilight.broadcast(lm76->id, lm76->message, PROTOCOL);
+			}
+			json_delete(lm76->message);
+			lm76->message = NULL;
+		} else {
+			logprintf(LOG_NOTICE, "error connecting to lm76");
+			logprintf(LOG_DEBUG, "(probably i2c bus error)");
+			logprintf(LOG_DEBUG, "(maybe wrong id? use i2cdetect to find out)");
+		}
+	}
+}
+
+static void pollGC(struct protocol_poll_t *poll) {
+	struct settings_t *lm76data = (struct settings_t *)poll->data;
+	int y = 0;
+
+	if(lm76data == NULL) {
+		return;
+	}
+	if(lm76data->id) {
+		for(y=0;y<lm76data->nrid;y++) {
+			FREE(lm76data->id[y]);
+		}
+		FREE(lm76data->id);
+	}
+	if(lm76data->addr) {
+		FREE(lm76data->addr);
+	}
+	i2c_close(lm76data->bus);
+	FREE(lm76data);
+}
 
-static void *thread(void *param) {
-	struct protocol_threads_t *node = (struct protocol_threads_t *)param;
-	struct JsonNode *json = (struct JsonNode *)node->param;
+static struct threadqueue_t *initDev(JsonNode *jdevice) {
+	struct protocol_poll_t *poll = NULL;
+	struct settings_t *lm76data = NULL;
 	struct JsonNode *jid = NULL;
 	struct JsonNode *jchild = NULL;
-	struct settings_t *lm76data = MALLOC(sizeof(struct settings_t));
-	int y = 0, interval = 10, nrloops = 0;
-	char *stmp = NULL;
-	double itmp = -1, temp_offset = 0;
+	char *platform = GPIO_PLATFORM, *stmp = NULL;
+	int y = 0, interval = 10;
+	double itmp = -1;
 
-	if(lm76data == NULL) {
-		fprintf(stderr, "out of memory\n");
-		exit(EXIT_FAILURE);
+	if(config_setting_get_string("gpio-platform", 0, &platform) != 0) {
+		logprintf(LOG_ERR, "no gpio-platform configured");
+		return NULL;
+	}
+	if(strcmp(platform, "none") == 0) {
+		FREE(platform);
+		logprintf(LOG_ERR, "no gpio-platform configured");
+		return NULL;
+	}
+	if(wiringXSetup(platform, logprintf1) < 0) {
+		FREE(platform);
+		return NULL;
 	}
+	FREE(platform);
 
-	lm76data->nrid = 0;
-	lm76data->id = NULL;
-	lm76data->fd = 0;
+	char *output = json_stringify(jdevice, NULL);
+	JsonNode *json = json_decode(output);
+	json_free(output);
 
-	threads++;
+	if((lm76data = MALLOC(sizeof(struct settings_t))) == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(lm76data, 0, sizeof(struct settings_t));
 
 	if((jid = json_find_member(json, "id"))) {
 		jchild = json_first_child(jid);
@@ -106,106 +166,27 @@ static void *thread(void *param) {
 
 	if(json_find_number(json, "poll-interval", &itmp) == 0)
 		interval = (int)round(itmp);
-	json_find_number(json, "temperature-offset", &temp_offset);
+	json_find_number(json, "temperature-offset", &lm76data->temp_offset);
 
-	if((lm76data->fd = REALLOC(lm76data->fd, (sizeof(int)*(size_t)(lm76data->nrid+1)))) == NULL) {
+	if((lm76data->addr = REALLOC(lm76data->addr, (sizeof(int)*(size_t)(lm76data->nrid+1)))) == NULL) {
 		fprintf(stderr, "out of memory\n");
 		exit(EXIT_FAILURE);
 	}
 	for(y=0;y<lm76data->nrid;y++) {
-		lm76data->fd[y] = wiringXI2CSetup(lm76data->path, (int)strtol(lm76data->id[y], NULL, 16));
+		lm76data->addr[y] = (int)strtol(lm76data->id[y], NULL, 16);
 	}
+	/* Shared with the other sensors on the same bus */
+	lm76data->bus = i2c_open(lm76data->path);
 
-	while(loop) {
-		if(protocol_thread_wait(node, interval, &nrloops) == ETIMEDOUT) {
-			pthread_mutex_lock(&lock);
-			for(y=0;y<lm76data->nrid;y++) {
-				if(lm76data->fd[y] > 0) {
-					int raw = wiringXI2CReadReg16(lm76data->fd[y], 0x00);
-					float temp = ((float)((raw&0x00ff)+((raw>>12)*0.0625)));
-
-					lm76->message = json_mkobject();
-					JsonNode *code = json_mkobject();
-					json_append_member(code, "id", json_mkstring(lm76data->id[y]));
-					json_append_member(code, "temperature", json_mknumber(temp+temp_offset, 3));
-
-					json_append_member(lm76->message, "message", code);
-					json_append_member(lm76->message, "origin", json_mkstring("receiver"));
-					json_append_member(lm76->message, "protocol", json_mkstring(lm76->id));
-
-					if(pilight.broadcast != NULL) {
-						pilight.broadcast(lm76->id, lm76->message, PROTOCOL);
-					}
-					json_delete(lm76->message);
-					lm76->message = NULL;
-				} else {
-					logprintf(LOG_NOTICE, "error connecting to lm76");
-					logprintf(LOG_DEBUG, "(probably i2c bus error from wiringXI2CSetup)");
-					logprintf(LOG_DEBUG, "(maybe wrong id? use i2cdetect to find out)");
-					protocol_thread_wait(node, 1, &nrloops);
-				}
-			}
-			pthread_mutex_unlock(&lock);
-		}
-	}
-	pthread_mutex_unlock(&lock);
-
-	if(lm76data->id) {
-		for(y=0;y<lm76data->nrid;y++) {
-			FREE(lm76data->id[y]);
-		}
-		FREE(lm76data->id);
-	}
-	if(lm76data->fd) {
-		for(y=0;y<lm76data->nrid;y++) {
-			if(lm76data->fd[y] > 0) {
-				close(lm76data->fd[y]);
-			}
-		}
-		FREE(lm76data->fd);
-	}
-	FREE(lm76data);
-	threads--;
-
-	return (void *)NULL;
-}
-
-static struct threadqueue_t *initDev(JsonNode *jdevice) {
-	char *platform = GPIO_PLATFORM;
-
-	if(config_setting_get_string("gpio-platform", 0, &platform) != 0) {
-		logprintf(LOG_ERR, "no gpio-platform configured");
-		return NULL;
-	}
-	if(strcmp(platform, "none") == 0) {
-		FREE(platform);
-		logprintf(LOG_ERR, "no gpio-platform configured");
-		return NULL;
-	}
-	if(wiringXSetup(platform, logprintf1) < 0) {
-		FREE(platform);
-		return NULL;
-	} else {
-		FREE(platform);
-
-		loop = 1;
-
-		char *output = json_stringify(jdevice, NULL);
-		JsonNode *json = json_decode(output);
-		json_free(output);
+	/* Polled by the shared worker pool, no thread of its own */
+	poll = protocol_poll_init(lm76, json, interval, thread, pollGC);
+	poll->data = lm76data;
 
-		struct protocol_threads_t *node = protocol_thread_init(lm76, json);
-		return threads_register("lm76", &thread, (void *)node, 0);
-	}
+	return NULL;
 }
 
 static void threadGC(void) {
-	loop = 0;
-	protocol_thread_stop(lm76);
-	while(threads > 0) {
-		usleep(10);
-	}
-	protocol_thread_free(lm76);
+	protocol_poll_free(lm76);
 }
 #endif
 
@@ -213,12 +194,6 @@ static void threadGC(void) {
 __attribute__((weak))
 #endif
 void lm76Init(void) {
-#if !defined(__FreeBSD__) && !defined(_WIN32)
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&lock, &attr);
-#endif
-
 	protocol_register(&lm76);
 	protocol_set_id(lm76, "lm76");
 	protocol_device_add(lm76, "lm76", "TI I2C Temperature Sensor");
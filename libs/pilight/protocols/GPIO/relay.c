@@ -31,6 +31,7 @@
 #include "../../core/dso.h"
 #include "../../core/log.h"
 #include "../../core/gc.h"
+#include "../../core/gpiomem.h"
 #include "../../config/settings.h"
 #include "../protocol.h"
 #include "relay.h"
@@ -98,6 +99,7 @@ static int createCode(JsonNode *code) {
 		have_error = 1;
 		goto clear;
 	}
+	gpiomem_setup(platform);
 	FREE(platform);
 
 	if(wiringXValidGPIO(gpio) != 0) {
@@ -106,18 +108,18 @@ static int createCode(JsonNode *code) {
 		goto clear;
 	} else {
 		if(strstr(progname, "daemon") != NULL) {
-			pinMode(gpio, PINMODE_OUTPUT);
+			gpio_mode(gpio, PINMODE_OUTPUT);
 			if(strcmp(def, "off") == 0) {
 				if(state == 1) {
-					digitalWrite(gpio, LOW);
+					gpio_write(gpio, LOW);
 				} else if(state == 0) {
-					digitalWrite(gpio, HIGH);
+					gpio_write(gpio, HIGH);
 				}
 			} else {
 				if(state == 0) {
-					digitalWrite(gpio, LOW);
+					gpio_write(gpio, LOW);
 				} else if(state == 1) {
-					digitalWrite(gpio, HIGH);
+					gpio_write(gpio, HIGH);
 				}
 			}
 		} else {
@@ -183,8 +185,8 @@ static int checkValues(JsonNode *code) {
 					logprintf(LOG_ERR, "relay: invalid gpio range");
 					return -1;
 				} else {
-					pinMode(gpio, PINMODE_INPUT);
-					state = digitalRead(gpio);
+					gpio_mode(gpio, PINMODE_INPUT);
+					state = gpio_read(gpio);
 					if(strcmp(def, "on") == 0) {
 						state ^= 1;
 					}
@@ -0,0 +1,129 @@
+/*
+	Copyright (C) 2013 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+/*
+ * Sensors that are read by a kernel driver, and exposed by
+ * the industrial I/O subsystem. The driver handles the timing,
+ * so a reading is a read of a sysfs attribute.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __linux__
+	#include <dirent.h>
+	#include <fcntl.h>
+	#include <unistd.h>
+#endif
+
+#include "iio.h"
+
+#define IIO_ROOT	"/sys/bus/iio/devices"
+
+#ifdef __linux__
+static int iio_name(const char *path, const char *name) {
+	char buf[64], file[512];
+	ssize_t n = 0;
+	int fd = -1;
+
+	snprintf(file, sizeof(file), "%s/name", path);
+	if((fd = open(file, O_RDONLY)) == -1) {
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf)-1);
+	close(fd);
+	if(n <= 0) {
+		return -1;
+	}
+	buf[n] = '\0';
+	buf[strcspn(buf, "\n")] = '\0';
+	return (strcmp(buf, name) == 0) ? 0 : -1;
+}
+#endif
+
+/*
+ * Finds the device of a driver. With a number that device is
+ * checked, without one (a negative number) the driver must
+ * have exactly one device, as the devices can't be told apart.
+ */
+int iio_find(const char *name, int nr, char *path, size_t len) {
+#ifdef __linux__
+	struct dirent *file = NULL;
+	DIR *d = NULL;
+	char tmp[512];
+	int found = 0;
+
+	if(nr >= 0) {
+		snprintf(tmp, sizeof(tmp), "%s/iio:device%d", IIO_ROOT, nr);
+		if(iio_name(tmp, name) == 0) {
+			snprintf(path, len, "%s", tmp);
+			return 0;
+		}
+		return -1;
+	}
+
+	if((d = opendir(IIO_ROOT)) == NULL) {
+		return -1;
+	}
+	while((file = readdir(d)) != NULL) {
+		if(strncmp(file->d_name, "iio:device", 10) != 0) {
+			continue;
+		}
+		snprintf(tmp, sizeof(tmp), "%s/%s", IIO_ROOT, file->d_name);
+		if(iio_name(tmp, name) == 0) {
+			snprintf(path, len, "%s", tmp);
+			found++;
+		}
+	}
+	closedir(d);
+
+	return (found == 1) ? 0 : -1;
+#else
+	return -1;
+#endif
+}
+
+/*
+ * Reads a processed channel, e.g. in_temp_input. The driver
+ * fails the read when the sensor didn't answer in time.
+ */
+int iio_read(const char *path, const char *attr, int *value) {
+#ifdef __linux__
+	char buf[32], file[512], *end = NULL;
+	ssize_t n = 0;
+	int fd = -1;
+
+	snprintf(file, sizeof(file), "%s/%s", path, attr);
+	if((fd = open(file, O_RDONLY)) == -1) {
+		return -1;
+	}
+	n = read(fd, buf, sizeof(buf)-1);
+	close(fd);
+	if(n <= 0) {
+		return -1;
+	}
+	buf[n] = '\0';
+	*value = (int)strtol(buf, &end, 10);
+	if(end == buf) {
+		return -1;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
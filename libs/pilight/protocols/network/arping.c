@@ -131,17 +131,13 @@ static void *thread(void *param) {
 	while(loop) {
 		if(protocol_thread_wait(node, interval, &nrloops) == ETIMEDOUT) {
 			pthread_mutex_lock(&lock);
-			if(strlen(dstip) == 0) {
-				for(i=0;i<255;i++) {
-					memset(ip, '\0', INET_ADDRSTRLEN+1);
-					snprintf(ip, sizeof(ip), "%d.%d.%d.%d", srcip[0], srcip[1], srcip[2], i);
-					arp_add_host(ip);
-				}
-			} else {
-				arp_add_host(dstip);
-			}
+			/*
+			 * The subnet is swept once for all devices, a host
+			 * that missed a few probes is not yet gone.
+			 */
+			arp_scan(devs[0], srcmac, srcip, interval*3);
 
-			if(arp_resolv(devs[0], srcmac, dstmac, &p) == 0) {
+			if(arp_lease_ip(dstmac, &p, interval*3) == 0) {
 				if(strlen(dstip) == 0) {
 					strcpy(dstip, ip);
 				}
@@ -44,28 +44,69 @@
 #include "../../core/gc.h"
 #include "ping.h"
 
-static unsigned short loop = 1;
-static unsigned short threads = 0;
-
-static pthread_mutex_t lock;
-static pthread_mutexattr_t attr;
-
 #define CONNECTED				1
 #define DISCONNECTED 		0
+/* Milliseconds to wait for an echo reply */
+#define TIMEOUT					1000
+
+typedef struct data_t {
+	char *name;
+	char *ip;
+	int interval;
+	int state;
+	uv_timer_t *timer_req;
+	struct data_t *next;
+} data_t;
+
+static struct data_t *data = NULL;
+
+static void broadcast(struct data_t *node) {
+	pping->message = json_mkobject();
+	JsonNode *code = json_mkobject();
+	json_append_member(code, "ip", json_mkstring(node->ip));
+	json_append_member(code, "state", json_mkstring((node->state == CONNECTED) ? "connected" : "disconnected"));
+
+	json_append_member(pping->message, "message", code);
+	json_append_member(pping->message, "origin", json_mkstring("receiver"));
+	json_append_member(pping->message, "protocol", json_mkstring(pping->id));
+
+	if(pilight.broadcast != NULL) {
+		pilight.broadcast(pping->id, pping->message, PROTOCOL);
+	}
+	json_delete(pping->message);
+	pping->message = NULL;
+}
 
-static void *thread(void *param) {
-	struct protocol_threads_t *node = (struct protocol_threads_t *)param;
-	struct JsonNode *json = (struct JsonNode *)node->param;
+static void callback(char *ip, int status, double rtt, void *userdata) {
+	struct data_t *node = userdata;
+
+	if(status == 0) {
+		if(node->state == DISCONNECTED) {
+			node->state = CONNECTED;
+			broadcast(node);
+		}
+	} else if(node->state == CONNECTED) {
+		node->state = DISCONNECTED;
+		broadcast(node);
+	}
+}
+
+static void thread(uv_timer_t *req) {
+	struct data_t *node = req->data;
+
+	if(ping_start(node->ip, TIMEOUT, callback, node) != 0) {
+		callback(node->ip, -1, 0, node);
+	}
+}
+
+static struct threadqueue_t *initDev(JsonNode *jdevice) {
 	struct JsonNode *jid = NULL;
 	struct JsonNode *jchild = NULL;
-	char *ip = NULL;
-	char *pstate = NULL;
+	struct data_t *node = NULL;
+	char *ip = NULL, *pstate = NULL;
 	double itmp = 0.0;
-	int state = 0, nrloops = 0, interval = 1;
-
-	threads++;
 
-	if((jid = json_find_member(json, "id"))) {
+	if((jid = json_find_member(jdevice, "id"))) {
 		jchild = json_first_child(jid);
 		while(jchild) {
 			if(json_find_string(jchild, "ip", &ip) == 0) {
@@ -74,90 +115,72 @@ static void *thread(void *param) {
 			jchild = jchild->next;
 		}
 	}
+	if(ip == NULL) {
+		return NULL;
+	}
 
-	if(json_find_number(json, "poll-interval", &itmp) == 0)
-		interval = (int)round(itmp);
-
-   if(json_find_string(json, "state", &pstate) == 0) {
-      if(strcmp(pstate,"connected") == 0) state = CONNECTED;
-      if(strcmp(pstate,"disconnected") == 0) state = DISCONNECTED;
-      }
-
-	while(loop) {
-		if(protocol_thread_wait(node, interval, &nrloops) == ETIMEDOUT) {
-			pthread_mutex_lock(&lock);
-			if(ping(ip) == 0) {
-				if(state == DISCONNECTED) {
-					state = CONNECTED;
-					pping->message = json_mkobject();
-					JsonNode *code = json_mkobject();
-					json_append_member(code, "ip", json_mkstring(ip));
-					json_append_member(code, "state", json_mkstring("connected"));
-
-					json_append_member(pping->message, "message", code);
-					json_append_member(pping->message, "origin", json_mkstring("receiver"));
-					json_append_member(pping->message, "protocol", json_mkstring(pping->id));
-
-					if(pilight.broadcast != NULL) {
-						pilight.broadcast(pping->id, pping->message, PROTOCOL);
-					}
-					json_delete(pping->message);
-					pping->message = NULL;
-				}
-			} else if(state == CONNECTED) {
-				state = DISCONNECTED;
-
-				pping->message = json_mkobject();
-				JsonNode *code = json_mkobject();
-				json_append_member(code, "ip", json_mkstring(ip));
-				json_append_member(code, "state", json_mkstring("disconnected"));
-
-				json_append_member(pping->message, "message", code);
-				json_append_member(pping->message, "origin", json_mkstring("receiver"));
-				json_append_member(pping->message, "protocol", json_mkstring(pping->id));
-
-				if(pilight.broadcast != NULL) {
-					pilight.broadcast(pping->id, pping->message, PROTOCOL);
-				}
-				json_delete(pping->message);
-				pping->message = NULL;
-			}
-			pthread_mutex_unlock(&lock);
-		}
+	if((node = MALLOC(sizeof(struct data_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(node, '\0', sizeof(struct data_t));
+	node->interval = 1;
+	node->state = DISCONNECTED;
+
+	if(json_find_number(jdevice, "poll-interval", &itmp) == 0)
+		node->interval = (int)round(itmp);
+	if(node->interval <= 0) {
+		node->interval = 1;
 	}
-	pthread_mutex_unlock(&lock);
 
-	threads--;
-	return (void *)NULL;
-}
+	if(json_find_string(jdevice, "state", &pstate) == 0) {
+		if(strcmp(pstate, "connected") == 0) node->state = CONNECTED;
+		if(strcmp(pstate, "disconnected") == 0) node->state = DISCONNECTED;
+	}
 
-static struct threadqueue_t *initDev(JsonNode *jdevice) {
-	loop = 1;
-	char *output = json_stringify(jdevice, NULL);
-	JsonNode *json = json_decode(output);
-	json_free(output);
+	if((node->ip = STRDUP(ip)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((node->name = STRDUP(jdevice->key)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->next = data;
+	data = node;
+
+	if((node->timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->timer_req->data = node;
+	uv_timer_init(uv_default_loop(), node->timer_req);
+	uv_timer_start(node->timer_req, thread, node->interval*1000, node->interval*1000);
 
-	struct protocol_threads_t *node = protocol_thread_init(pping, json);
-	return threads_register("ping", &thread, (void *)node, 0);
+	return NULL;
+}
+
+static void close_cb(uv_handle_t *handle) {
+	FREE(handle);
 }
 
 static void threadGC(void) {
-	loop = 0;
-	protocol_thread_stop(pping);
-	while(threads > 0) {
-		usleep(10);
+	struct data_t *tmp = NULL;
+
+	/* Drops the echoes still pointing to our devices */
+	ping_gc();
+
+	while(data) {
+		tmp = data;
+		uv_timer_stop(tmp->timer_req);
+		uv_close((uv_handle_t *)tmp->timer_req, close_cb);
+		FREE(tmp->name);
+		FREE(tmp->ip);
+		data = data->next;
+		FREE(tmp);
 	}
-	protocol_thread_free(pping);
 }
 
 #if !defined(MODULE) && !defined(_WIN32)
 __attribute__((weak))
 #endif
 void pingInit(void) {
-	pthread_mutexattr_init(&attr);
-	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	pthread_mutex_init(&lock, &attr);
-
 	protocol_register(&pping);
 	protocol_set_id(pping, "ping");
 	protocol_device_add(pping, "ping", "Ping network devices");
@@ -0,0 +1,199 @@
+/*
+	Copyright (C) 2013 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+/*
+ * Many of the 433.92 protocols only differ in their pulse
+ * lengths and in which bits hold which value. Those can be
+ * described by an ook_t, so decoding and encoding are done
+ * here once for all of them. The protocol itself just passes
+ * its description from its own callbacks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "../core/pilight.h"
+#include "../core/common.h"
+#include "../core/log.h"
+#include "../core/binary.h"
+#include "protocol.h"
+#include "ook.h"
+
+/*
+ * Everything that follows from the description is worked out
+ * once, so receiving a code only compares and shifts.
+ */
+void ook_init(struct protocol_t *proto, struct ook_t *ook) {
+	int i = 0, x = 0, nrlong[2] = { 0, 0 };
+
+	ook->nrbits = (ook->rawlen-2)/ook->period;
+	if(ook->nrbits > OOK_MAXBITS) {
+		ook->nrbits = OOK_MAXBITS; /*LCOV_EXCL_LINE*/
+	}
+	ook->threshold = (int)((double)ook->pulse*((double)ook->multiplier/2));
+
+	/* A long pulse can just as well mean a "0" */
+	if(ook->symbols[1][ook->offset] < ook->symbols[0][ook->offset]) {
+		ook->invert = (ook->nrbits == 64) ? ~0ULL : ((1ULL << ook->nrbits) - 1);
+	} else {
+		ook->invert = 0;
+	}
+
+	proto->minrawlen = ook->rawlen;
+	proto->maxrawlen = ook->rawlen;
+	proto->maxgaplen = ook->maxfooter*PULSE_DIV;
+	proto->mingaplen = ook->minfooter*PULSE_DIV;
+
+	/*
+	 * Leave room for receivers that stretch or shorten the
+	 * pulses, the number of long pulses is what sets them apart.
+	 */
+	for(i=0;i<2;i++) {
+		for(x=0;x<ook->period;x++) {
+			nrlong[i] += (ook->symbols[i][x] > 2);
+		}
+	}
+	proto->minfingerprint.ratio = ook->multiplier-1;
+	proto->maxfingerprint.ratio = ook->multiplier*2;
+	proto->minfingerprint.footer = ook->footer[1]/(ook->footer[0]*2);
+	proto->maxfingerprint.footer = (ook->footer[1]*2)/ook->footer[0];
+	proto->minfingerprint.nrlong = ((nrlong[0] < nrlong[1]) ? nrlong[0] : nrlong[1])*ook->nrbits + (ook->footer[0] > 2);
+	proto->maxfingerprint.nrlong = ((nrlong[0] > nrlong[1]) ? nrlong[0] : nrlong[1])*ook->nrbits + (ook->footer[0] > 2);
+}
+
+int ook_validate(struct protocol_t *proto, struct ook_t *ook) {
+	if(proto->rawlen == ook->rawlen) {
+		if(proto->raw[proto->rawlen-1] >= (ook->minfooter*PULSE_DIV) &&
+		   proto->raw[proto->rawlen-1] <= (ook->maxfooter*PULSE_DIV)) {
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+static int field_state(const struct ook_field_t *field, int value) {
+	return ((value & field->mask) == (field->values[0] & field->mask)) ? 0 : 1;
+}
+
+static void create_message(struct protocol_t *proto, struct ook_t *ook, int *values) {
+	const struct ook_field_t *field = NULL;
+	int i = 0;
+
+	proto->message = json_mkobject();
+	for(i=0;i<ook->nrfields;i++) {
+		field = &ook->fields[i];
+		if(field->type == OOK_STATE) {
+			json_append_member(proto->message, "state", json_mkstring(field->states[values[i]]));
+		} else {
+			json_append_member(proto->message, field->name, json_mknumber(values[i], 0));
+		}
+	}
+}
+
+void ook_parse(struct protocol_t *proto, struct ook_t *ook) {
+	const struct ook_field_t *field = NULL;
+	unsigned long long bits = 0;
+	int values[ook->nrfields], i = 0;
+
+	if(proto->rawlen > ook->rawlen) {
+		logprintf(LOG_ERR, "%s: parsecode - invalid parameter passed %d", proto->id, proto->rawlen);
+		return;
+	}
+
+	bits = pulsesToBits(proto->raw, ook->offset, ook->period, ook->nrbits, ook->threshold) ^ ook->invert;
+
+	for(i=0;i<ook->nrfields;i++) {
+		field = &ook->fields[i];
+		if(field->msbfirst == 1) {
+			values[i] = (int)bitsToDecRev(bits, ook->nrbits, field->first, field->last);
+		} else {
+			values[i] = (int)bitsToDec(bits, ook->nrbits, field->first, field->last);
+		}
+		if(field->type == OOK_STATE) {
+			values[i] = field_state(field, values[i]);
+		}
+	}
+
+	create_message(proto, ook, values);
+}
+
+int ook_create(struct protocol_t *proto, struct ook_t *ook, struct JsonNode *code) {
+	const struct ook_field_t *field = NULL;
+	int values[ook->nrfields], binary[OOK_MAXBITS];
+	int i = 0, x = 0, value = 0, *raw = NULL;
+	double itmp = 0;
+
+	for(i=0;i<ook->nrfields;i++) {
+		field = &ook->fields[i];
+		values[i] = -1;
+		if(field->type == OOK_STATE) {
+			/* The last state given wins */
+			for(x=0;x<2;x++) {
+				if(json_find_number(code, field->states[x], &itmp) == 0) {
+					values[i] = x;
+				}
+			}
+		} else if(json_find_number(code, field->name, &itmp) == 0) {
+			values[i] = (int)round(itmp);
+		}
+	}
+
+	for(i=0;i<ook->nrfields;i++) {
+		if(values[i] == -1) {
+			logprintf(LOG_ERR, "%s: insufficient number of arguments", proto->id);
+			return EXIT_FAILURE;
+		}
+	}
+	for(i=0;i<ook->nrfields;i++) {
+		field = &ook->fields[i];
+		if(field->type == OOK_NUMBER && (values[i] < 0 || values[i] > field->max)) {
+			logprintf(LOG_ERR, "%s: invalid %s range", proto->id, field->name);
+			return EXIT_FAILURE;
+		}
+	}
+
+	create_message(proto, ook, values);
+
+	memset(binary, 0, sizeof(binary));
+	for(i=0;i<ook->nrfields;i++) {
+		field = &ook->fields[i];
+		value = (field->type == OOK_STATE) ? field->values[values[i]] : values[i];
+		for(x=0;x<=field->last-field->first;x++) {
+			if(field->msbfirst == 1) {
+				binary[field->last-x] = (value >> x) & 1;
+			} else {
+				binary[field->first+x] = (value >> x) & 1;
+			}
+		}
+	}
+
+	raw = proto->raw;
+	for(i=0;i<ook->nrbits;i++) {
+		for(x=0;x<ook->period;x++) {
+			*raw++ = ook->symbols[binary[i]][x]*ook->pulse;
+		}
+	}
+	*raw++ = ook->footer[0]*ook->pulse;
+	*raw++ = ook->footer[1]*ook->pulse;
+	proto->rawlen = ook->rawlen;
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,79 @@
+/*
+	Copyright (C) 2013 CurlyMo
+
+	This file is part of pilight.
+
+	pilight is free software: you can redistribute it and/or modify it under the
+	terms of the GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later
+	version.
+
+	pilight is distributed in the hope that it will be useful, but WITHOUT ANY
+	WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+	A PARTICULAR PURPOSE.  See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with pilight. If not, see	<http://www.gnu.org/licenses/>
+*/
+
+#ifndef _PROTOCOL_OOK_H_
+#define _PROTOCOL_OOK_H_
+
+#include "protocol.h"
+
+#define OOK_NUMBER	0
+#define OOK_STATE		1
+
+#define OOK_MAXBITS	64
+
+/*
+ * A value sent as the bits first up to last. Numbers are
+ * sent as they are, a state is sent as values[0] or values[1]
+ * and received as the first state when the bits in mask
+ * match those of values[0].
+ */
+typedef struct ook_field_t {
+	const char *name;
+	int type;
+	int first;
+	int last;
+	/* Whether the first bit is the most significant one */
+	int msbfirst;
+	int max;
+	const char *states[2];
+	int values[2];
+	int mask;
+} ook_field_t;
+
+/*
+ * A fixed length On-Off-Keying protocol. Every bit takes
+ * period pulses, one of which tells a "0" from a "1" by being
+ * long or short. All lengths are multiples of pulse.
+ */
+typedef struct ook_t {
+	int pulse;
+	int multiplier;
+	/* Bounds of the footer pulse, before the PULSE_DIV */
+	int minfooter;
+	int maxfooter;
+	int rawlen;
+	int period;
+	/* The pulse of a period that carries the bit */
+	int offset;
+	int symbols[2][4];
+	int footer[2];
+	const struct ook_field_t *fields;
+	int nrfields;
+
+	/* Filled in by ook_init */
+	int nrbits;
+	int threshold;
+	unsigned long long invert;
+} ook_t;
+
+void ook_init(struct protocol_t *proto, struct ook_t *ook);
+int ook_validate(struct protocol_t *proto, struct ook_t *ook);
+void ook_parse(struct protocol_t *proto, struct ook_t *ook);
+int ook_create(struct protocol_t *proto, struct ook_t *ook, struct JsonNode *code);
+
+#endif
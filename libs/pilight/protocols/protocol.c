@@ -21,8 +21,10 @@
 #include <string.h>
 #include <dirent.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/stat.h>
 #ifndef _WIN32
+	#include <unistd.h>
 	#ifdef __mips__
 		#define __USE_UNIX98
 	#endif
@@ -34,6 +36,7 @@
 #include "../core/dso.h"
 #include "../core/options.h"
 #include "../core/log.h"
+#include "../core/threads.h"
 
 #include "../config/settings.h"
 
@@ -47,6 +50,78 @@
 
 struct protocols_t *protocols;
 
+/*
+ * Candidate protocols per pulse train length. Every
+ * rawlen bucket only holds those protocols that can
+ * possibly validate a train of that length. Protocols
+ * that don't announce their raw length range are added
+ * to every bucket. The buckets follow each other in one
+ * array, bucket i running from offset i up to offset i+1.
+ */
+static struct protocol_index_t *protocol_index = NULL;
+static int protocol_index_offset[MAXPULSESTREAMLENGTH+1];
+
+/* The footer bounds of the protocols with a fixed length */
+typedef struct protocol_footer_t {
+	int rawlen;
+	int min;
+	int max;
+} protocol_footer_t;
+
+static struct protocol_footer_t *protocol_footers = NULL;
+static int protocol_nrfooters = 0;
+/* Protocols that take part in receive matching, NULL for all */
+static int (*protocol_index_select)(struct protocol_t *proto) = NULL;
+
+/*
+ * The protocol ids and device names as small handles, so the
+ * queues between the threads pass those instead of copies of
+ * the names. A name gets its handle when a protocol registers
+ * it and keeps it until the protocols are freed, the table is
+ * only read afterwards. Handle 0 is a name no protocol knows.
+ */
+static char **protocol_interned = NULL;
+static unsigned int protocol_nrinterned = 0;
+static unsigned int *protocol_intern_table = NULL;
+static unsigned int protocol_intern_size = 0;
+
+/*
+ * The device names of all protocols in an open addressing
+ * table, so sending and configuring don't have to walk every
+ * device list of every protocol to find one by its name. The
+ * names only change while the protocols are registered, so
+ * the table is built once together with the receive index.
+ */
+typedef struct protocol_name_t {
+	const char *id;
+	unsigned int hash;
+	struct protocol_t *listener;
+} protocol_name_t;
+
+static struct protocol_name_t *protocol_names = NULL;
+static unsigned int protocol_nrnames = 0;
+
+/*
+ * The pulse trains of recently sent codes, keyed on the
+ * protocol and the stringified code arguments. Each key maps
+ * to a single slot, a newer code simply replaces an older one
+ * in the same slot. Only 433 and 868 protocols are cached,
+ * because the createCode of other protocols has side effects.
+ */
+#define CODE_CACHE_SIZE		64
+
+typedef struct code_cache_t {
+	struct protocol_t *protocol;
+	unsigned long hash;
+	char *key;
+	char *message;
+	int *raw;
+	int rawlen;
+} code_cache_t;
+
+static struct code_cache_t code_cache[CODE_CACHE_SIZE];
+static pthread_mutex_t code_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
 #ifndef _WIN32
 void protocol_remove(char *name) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
@@ -95,6 +170,208 @@ void protocol_remove(char *name) {
 }
 #endif
 
+#ifndef _WIN32
+/*
+ * What the external protocol modules registered the last time
+ * they were loaded, so a daemon that only needs the protocols of
+ * its devices doesn't dlopen all others. An entry is trusted as
+ * long as its module keeps the same mtime and size, a changed or
+ * new module is loaded and its entry rebuilt. One module per line:
+ * <file> <mtime> <size> <name> <version> <hwtype> <devtype> <id>[,<id>]
+ */
+typedef struct module_cache_t {
+	char file[256];
+	unsigned long mtime;
+	unsigned long size;
+	char name[64];
+	char version[32];
+	int hwtype;
+	int devtype;
+	char ids[1024];
+	int seen;
+	struct module_cache_t *next;
+} module_cache_t;
+
+static struct module_cache_t *module_cache = NULL;
+static int module_cache_changed = 0;
+/* The device ids to load the modules of, all when nrprotocol_wanted is -1 */
+static char **protocol_wanted = NULL;
+static int nrprotocol_wanted = -1;
+
+static void module_cache_gc(void) {
+	struct module_cache_t *tmp = NULL;
+
+	while(module_cache) {
+		tmp = module_cache;
+		module_cache = module_cache->next;
+		FREE(tmp);
+	}
+	module_cache_changed = 0;
+}
+
+static void module_cache_read(void) {
+	struct module_cache_t *node = NULL;
+	char line[1536];
+	FILE *fp = NULL;
+
+	if((fp = fopen(MODULE_CACHE, "r")) == NULL) {
+		return;
+	}
+	while(fgets(line, sizeof(line), fp) != NULL) {
+		if((node = MALLOC(sizeof(struct module_cache_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(node, 0, sizeof(struct module_cache_t));
+		if(sscanf(line, "%255s %lu %lu %63s %31s %d %d %1023s", node->file, &node->mtime, &node->size,
+		   node->name, node->version, &node->hwtype, &node->devtype, node->ids) != 8) {
+			FREE(node);
+			continue;
+		}
+		node->next = module_cache;
+		module_cache = node;
+	}
+	fclose(fp);
+}
+
+/* Written to a temporary file first, like the ssdp cache */
+static void module_cache_write(void) {
+	struct module_cache_t *tmp = module_cache;
+	char path[sizeof(MODULE_CACHE)+16];
+	FILE *fp = NULL;
+
+	snprintf(path, sizeof(path), "%s.%d", MODULE_CACHE, (int)getpid());
+	if((fp = fopen(path, "w")) == NULL) {
+		logprintf(LOG_DEBUG, "could not write the module cache %s", MODULE_CACHE);
+		return;
+	}
+	while(tmp) {
+		if(tmp->seen == 1) {
+			fprintf(fp, "%s %lu %lu %s %s %d %d %s\n", tmp->file, tmp->mtime, tmp->size,
+				tmp->name, tmp->version, tmp->hwtype, tmp->devtype, tmp->ids);
+		}
+		tmp = tmp->next;
+	}
+	if(fclose(fp) != 0 || rename(path, MODULE_CACHE) != 0) {
+		unlink(path);
+	}
+}
+
+static struct module_cache_t *module_cache_find(const char *file, struct stat *s) {
+	struct module_cache_t *tmp = module_cache;
+
+	while(tmp) {
+		if(strcmp(tmp->file, file) == 0) {
+			tmp->seen = 1;
+			if(tmp->mtime == (unsigned long)s->st_mtime && tmp->size == (unsigned long)s->st_size) {
+				return tmp;
+			}
+			return NULL;
+		}
+		tmp = tmp->next;
+	}
+	return NULL;
+}
+
+static int module_cache_wanted(struct module_cache_t *node) {
+	char ids[sizeof(node->ids)], *id = NULL, *p = NULL;
+	int i = 0;
+
+	strcpy(ids, node->ids);
+	id = strtok_r(ids, ",", &p);
+	while(id != NULL) {
+		for(i=0;i<nrprotocol_wanted;i++) {
+			if(strcmp(protocol_wanted[i], id) == 0) {
+				return 1;
+			}
+		}
+		id = strtok_r(NULL, ",", &p);
+	}
+	return 0;
+}
+
+/* The protocols from the head of the list until last were registered by the module */
+static void module_cache_update(const char *file, struct stat *s, struct module_t *module, struct protocols_t *last) {
+	struct module_cache_t *node = module_cache;
+	struct protocols_t *pnode = protocols;
+	struct protocol_devices_t *dnode = NULL;
+	size_t len = 0;
+
+	while(node) {
+		if(strcmp(node->file, file) == 0) {
+			break;
+		}
+		node = node->next;
+	}
+	if(node != NULL && node->mtime == (unsigned long)s->st_mtime && node->size == (unsigned long)s->st_size) {
+		node->seen = 1;
+		return;
+	}
+	if(node == NULL) {
+		if((node = MALLOC(sizeof(struct module_cache_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(node, 0, sizeof(struct module_cache_t));
+		node->next = module_cache;
+		module_cache = node;
+	}
+	snprintf(node->file, sizeof(node->file), "%s", file);
+	node->mtime = (unsigned long)s->st_mtime;
+	node->size = (unsigned long)s->st_size;
+	snprintf(node->name, sizeof(node->name), "%s", module->name);
+	snprintf(node->version, sizeof(node->version), "%s", module->version);
+	node->hwtype = (pnode != last) ? pnode->listener->hwtype : NONE;
+	node->devtype = (pnode != last) ? pnode->listener->devtype : 0;
+	node->ids[0] = '\0';
+	while(pnode != NULL && pnode != last) {
+		dnode = pnode->listener->devices;
+		while(dnode) {
+			len += (size_t)snprintf(&node->ids[len], sizeof(node->ids)-len, "%s%s", (len > 0) ? "," : "", dnode->id);
+			if(len >= sizeof(node->ids)) {
+				len = sizeof(node->ids)-1;
+			}
+			dnode = dnode->next;
+		}
+		pnode = pnode->next;
+	}
+	if(len == 0) {
+		strcpy(node->ids, "-");
+	}
+	node->seen = 1;
+	module_cache_changed = 1;
+}
+
+/*
+ * Only load the external modules of these device ids, the built
+ * in protocols are always there. Without a call all modules are
+ * loaded. Has to be called before protocol_init.
+ */
+void protocol_init_filter(char **ids, int nr) {
+	int i = 0;
+
+	if((protocol_wanted = REALLOC(protocol_wanted, sizeof(char *)*(size_t)(nr+1))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	for(i=0;i<nr;i++) {
+		if((protocol_wanted[i] = STRDUP(ids[i])) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+	nrprotocol_wanted = nr;
+}
+
+static void protocol_init_filter_gc(void) {
+	int i = 0;
+
+	for(i=0;i<nrprotocol_wanted;i++) {
+		FREE(protocol_wanted[i]);
+	}
+	if(protocol_wanted != NULL) {
+		FREE(protocol_wanted);
+	}
+	nrprotocol_wanted = -1;
+}
+#endif
+
 void protocol_init(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -118,10 +395,13 @@ void protocol_init(void) {
 	strcpy(pilight_version, PILIGHT_VERSION);
 
 	struct dirent *file = NULL;
+	struct module_cache_t *cached = NULL;
+	struct protocols_t *last = NULL;
 	DIR *d = NULL;
 	struct stat s;
 
 	memset(pilight_commit, '\0', 3);
+	module_cache_read();
 
 	if(config_setting_get_string("protocol-root", 0, &protocol_root) != 0) {
 		/* If no protocol root was set, use the default protocol root */
@@ -146,7 +426,10 @@ void protocol_init(void) {
 				if(S_ISREG(s.st_mode)) {
 					if(strstr(file->d_name, ".so") != NULL) {
 						valid = 1;
-						if((handle = dso_load(path)) != NULL) {
+						if((cached = module_cache_find(path, &s)) != NULL &&
+						   nrprotocol_wanted > -1 && module_cache_wanted(cached) == 0) {
+							logprintf(LOG_DEBUG, "skipped protocol %s v%s, no device uses it", file->d_name, cached->version);
+						} else if((handle = dso_load(path)) != NULL) {
 
 							init = dso_function(handle, "init");
 							compatibility = dso_function(handle, "compatibility");
@@ -173,7 +456,9 @@ void protocol_init(void) {
 										char tmp[strlen(module.name)+1];
 										strcpy(tmp, module.name);
 										protocol_remove(tmp);
+										last = protocols;
 										init();
+										module_cache_update(path, &s, &module, last);
 										logprintf(LOG_DEBUG, "loaded protocol %s v%s", file->d_name, module.version);
 									} else {
 										if(module.reqcommit != NULL) {
@@ -195,10 +480,289 @@ void protocol_init(void) {
 		}
 		closedir(d);
 	}
+	/* Leave out the modules that were removed */
+	cached = module_cache;
+	while(cached) {
+		if(cached->seen == 0) {
+			module_cache_changed = 1;
+		}
+		cached = cached->next;
+	}
+	if(module_cache_changed == 1) {
+		module_cache_write();
+	}
+	module_cache_gc();
 	if(protocol_root_free == 1) {
 		FREE(protocol_root);
 	}
 #endif
+
+	protocol_index_init();
+}
+
+static void protocol_index_gc(void) {
+	if(protocol_index != NULL) {
+		FREE(protocol_index);
+	}
+	memset(protocol_index_offset, 0, sizeof(protocol_index_offset));
+	if(protocol_footers != NULL) {
+		FREE(protocol_footers);
+	}
+	protocol_nrfooters = 0;
+	if(protocol_names != NULL) {
+		FREE(protocol_names);
+	}
+	protocol_nrnames = 0;
+}
+
+static void protocol_names_init(void) {
+	struct protocols_t *pnode = NULL;
+	struct protocol_devices_t *dnode = NULL;
+	struct protocol_name_t *name = NULL;
+	unsigned int nr = 0, size = 16, hash = 0, i = 0;
+
+	pnode = protocols;
+	while(pnode) {
+		dnode = pnode->listener->devices;
+		while(dnode) {
+			nr++;
+			dnode = dnode->next;
+		}
+		pnode = pnode->next;
+	}
+	/* Keep the table at most half full */
+	while(size < nr*2) {
+		size <<= 1;
+	}
+	if((protocol_names = MALLOC(sizeof(struct protocol_name_t)*size)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(protocol_names, 0, sizeof(struct protocol_name_t)*size);
+	protocol_nrnames = size;
+
+	pnode = protocols;
+	while(pnode) {
+		dnode = pnode->listener->devices;
+		while(dnode) {
+			hash = strhash(dnode->id);
+			for(i=hash&(size-1);protocol_names[i].id!=NULL;i=(i+1)&(size-1)) {
+				if(protocol_names[i].hash == hash && strcmp(protocol_names[i].id, dnode->id) == 0) {
+					break;
+				}
+			}
+			/* The first protocol with a name wins, as in the protocols list */
+			name = &protocol_names[i];
+			if(name->id == NULL) {
+				name->id = dnode->id;
+				name->hash = hash;
+				name->listener = pnode->listener;
+			}
+			dnode = dnode->next;
+		}
+		pnode = pnode->next;
+	}
+}
+
+static void protocol_footers_init(void) {
+	struct protocol_index_t *node = NULL;
+	struct protocol_footer_t *footer = NULL;
+	struct protocol_t *proto = NULL;
+	int i = 0;
+
+	for(i=1;i<MAXPULSESTREAMLENGTH;i++) {
+		footer = NULL;
+		for(node=&protocol_index[protocol_index_offset[i]];node<&protocol_index[protocol_index_offset[i+1]];node++) {
+			proto = node->listener;
+			if(proto->minrawlen == i && proto->maxrawlen == i &&
+			   proto->mingaplen > 0 && proto->maxgaplen > 0) {
+				if(footer == NULL) {
+					if((protocol_footers = REALLOC(protocol_footers, sizeof(struct protocol_footer_t)*(size_t)(protocol_nrfooters+1))) == NULL) {
+						OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+					}
+					footer = &protocol_footers[protocol_nrfooters++];
+					footer->rawlen = i;
+					footer->min = proto->mingaplen;
+					footer->max = proto->maxgaplen;
+				}
+				if(proto->mingaplen < footer->min) {
+					footer->min = proto->mingaplen;
+				}
+				if(proto->maxgaplen > footer->max) {
+					footer->max = proto->maxgaplen;
+				}
+			}
+		}
+	}
+}
+
+void protocol_index_init(void) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct protocols_t *pnode = NULL;
+	struct protocol_index_t *node = NULL;
+	struct protocol_t *proto = NULL;
+	int i = 0, x = 0, nr = 0, total = 0, pass = 0;
+
+	protocol_index_gc();
+
+	pnode = protocols;
+	while(pnode) {
+		nr++;
+		pnode = pnode->next;
+	}
+
+	char selected[nr+1];
+	pnode = protocols;
+	for(x=0,i=0;x<nr;x++) {
+		selected[x] = (protocol_index_select == NULL || protocol_index_select(pnode->listener) == 1);
+		i += selected[x];
+		pnode = pnode->next;
+	}
+	if(protocol_index_select != NULL) {
+		logprintf(LOG_DEBUG, "%d of %d protocols take part in receiving", i, nr);
+	}
+
+	/* The first pass counts the candidates, the second fills them in */
+	for(pass=0;pass<2;pass++) {
+		if(pass == 1) {
+			if(total == 0) {
+				break;
+			}
+			if((protocol_index = MALLOC(sizeof(struct protocol_index_t)*(size_t)total)) == NULL) {
+				OUT_OF_MEMORY
+			}
+		}
+		total = 0;
+		for(i=1;i<MAXPULSESTREAMLENGTH;i++) {
+			protocol_index_offset[i] = total;
+			pnode = protocols;
+			x = 0;
+			while(pnode) {
+				proto = pnode->listener;
+				if(selected[x++] == 0) {
+					pnode = pnode->next;
+					continue;
+				}
+				if(proto->parseCode != NULL && proto->validate != NULL &&
+					 ((proto->minrawlen == 0 && proto->maxrawlen == 0) ||
+					 (i >= proto->minrawlen && i <= proto->maxrawlen))) {
+					if(pass == 1) {
+						/* Keep the order of the protocols list */
+						node = &protocol_index[total];
+						node->listener = proto;
+						node->hwtype = proto->hwtype;
+						node->minfingerprint = proto->minfingerprint;
+						node->maxfingerprint = proto->maxfingerprint;
+						/*
+						 * Only the lower footer bound is used to skip
+						 * protocols. Some protocols accept any trailing
+						 * gap, so the upper bound is left to validate().
+						 */
+						node->minfooter = 0;
+						if(proto->mingaplen > 0 && proto->maxgaplen > 0) {
+							node->minfooter = (proto->mingaplen < proto->maxgaplen) ? proto->mingaplen : proto->maxgaplen;
+						}
+					}
+					total++;
+				}
+				pnode = pnode->next;
+			}
+		}
+		protocol_index_offset[MAXPULSESTREAMLENGTH] = total;
+	}
+
+	protocol_footers_init();
+	protocol_names_init();
+}
+
+/*
+ * Rebuild the receive index with only the protocols the callback
+ * selects, or with all protocols again when it is NULL.
+ */
+void protocol_index_filter(int (*select)(struct protocol_t *proto)) {
+	protocol_index_select = select;
+	protocol_index_init();
+}
+
+/* Whether only the protocols of a select callback take part */
+int protocol_index_filtered(void) {
+	return (protocol_index_select != NULL);
+}
+
+/*
+ * Fills in the lengths of the fixed length protocols that can
+ * end with this footer, shortest first. Receivers use these to
+ * cut frames out of a stream without a clean gap before them.
+ */
+int protocol_index_footers(int footer, int *lengths, int size) {
+	int i = 0, nr = 0;
+
+	for(i=0;i<protocol_nrfooters && nr<size;i++) {
+		if(footer >= protocol_footers[i].min && footer <= protocol_footers[i].max) {
+			lengths[nr++] = protocol_footers[i].rawlen;
+		}
+	}
+	return nr;
+}
+
+/* The number of candidates for a train of this length */
+int protocol_index_get(int rawlen, struct protocol_index_t **candidates) {
+	*candidates = NULL;
+	if(protocol_index == NULL || rawlen <= 0 || rawlen >= MAXPULSESTREAMLENGTH) {
+		return 0;
+	}
+	*candidates = &protocol_index[protocol_index_offset[rawlen]];
+	return protocol_index_offset[rawlen+1] - protocol_index_offset[rawlen];
+}
+
+void protocol_fingerprint(const int *pulses, int length, struct protocol_fingerprint_t *fingerprint) {
+	int i = 0, min = 0, max = 0;
+
+	memset(fingerprint, 0, sizeof(struct protocol_fingerprint_t));
+	if(length < 2) {
+		return;
+	}
+
+	min = max = pulses[0];
+	for(i=1;i<length-1;i++) {
+		if(pulses[i] < min) {
+			min = pulses[i];
+		}
+		if(pulses[i] > max) {
+			max = pulses[i];
+		}
+	}
+	if(min <= 0) {
+		min = 1;
+	}
+	for(i=0;i<length-1;i++) {
+		fingerprint->nrlong += (pulses[i] > min*2);
+	}
+	fingerprint->ratio = max/min;
+	fingerprint->footer = pulses[length-1]/min;
+}
+
+static int fingerprint_outside(int value, int min, int max) {
+	return (min > 0 && value < min) || (max > 0 && value > max);
+}
+
+/*
+ * Returns 0 when a train with this fingerprint can be of the
+ * protocol, so it is worth to validate.
+ */
+/*
+ * Whether a candidate can validate a train, without touching
+ * the protocol. A hwtype of -1 on either side matches all.
+ */
+int protocol_index_match(const struct protocol_index_t *candidate, int hwtype, int footer, const struct protocol_fingerprint_t *fingerprint) {
+	if((candidate->hwtype != hwtype && candidate->hwtype != -1 && hwtype != -1) ||
+	   footer < candidate->minfooter ||
+	   fingerprint_outside(fingerprint->ratio, candidate->minfingerprint.ratio, candidate->maxfingerprint.ratio) ||
+	   fingerprint_outside(fingerprint->footer, candidate->minfingerprint.footer, candidate->maxfingerprint.footer) ||
+	   fingerprint_outside(fingerprint->nrlong, candidate->minfingerprint.nrlong, candidate->maxfingerprint.nrlong)) {
+		return -1;
+	}
+	return 0;
 }
 
 void protocol_register(protocol_t **proto) {
@@ -216,12 +780,15 @@ void protocol_register(protocol_t **proto) {
 	(*proto)->maxrawlen = 0;
 	(*proto)->mingaplen = 0;
 	(*proto)->maxgaplen = 0;
+	memset(&(*proto)->minfingerprint, 0, sizeof(struct protocol_fingerprint_t));
+	memset(&(*proto)->maxfingerprint, 0, sizeof(struct protocol_fingerprint_t));
 	(*proto)->txrpt = 10;
 	(*proto)->rxrpt = 1;
 	(*proto)->hwtype = NONE;
 	(*proto)->multipleId = 1;
 	(*proto)->config = 1;
 	(*proto)->masterOnly = 0;
+	(*proto)->cache = 1;
 	(*proto)->parseCode = NULL;
 	(*proto)->parseCommand = NULL;
 	(*proto)->createCode = NULL;
@@ -232,12 +799,17 @@ void protocol_register(protocol_t **proto) {
 	(*proto)->gc = NULL;
 	(*proto)->message = NULL;
 	(*proto)->threads = NULL;
+	(*proto)->polls = NULL;
+	(*proto)->metric_hits = NULL;
+	(*proto)->metric_misses = NULL;
+	(*proto)->metric_parse = NULL;
 
 	(*proto)->repeats = 0;
 	(*proto)->first = 0;
 	(*proto)->second = 0;
 
 	(*proto)->raw = NULL;
+	pthread_mutex_init(&(*proto)->lock, NULL);
 
 	struct protocols_t *pnode = MALLOC(sizeof(struct protocols_t));
 	if(pnode == NULL) {
@@ -325,6 +897,193 @@ void protocol_thread_free(protocol_t *proto) {
 	}
 }
 
+static void protocol_poll_destroy(struct protocol_poll_t *node) {
+	if(node->gc != NULL) {
+		node->gc(node);
+	}
+	if(node->param != NULL) {
+		json_delete(node->param);
+	}
+	FREE(node);
+}
+
+/*
+ * The worker pool accounts the cpu time under the name the
+ * work was queued with, which is the protocol id.
+ */
+static void protocol_poll_work(uv_work_t *req) {
+	struct protocol_poll_t *node = req->data;
+
+	node->run(node);
+}
+
+static void protocol_poll_done(uv_work_t *req, int status) {
+	struct protocol_poll_t *node = req->data;
+	node->busy = 0;
+	if(node->stopped == 1) {
+		protocol_poll_destroy(node);
+	}
+}
+
+static void protocol_poll_timer(uv_timer_t *req) {
+	struct protocol_poll_t *node = req->data;
+
+	/* Skip this round when the previous poll still runs */
+	if(node->busy == 1 || node->stopped == 1) {
+		return;
+	}
+	node->busy = 1;
+	node->work_req.data = node;
+	if(uv_queue_work_priority(uv_default_loop(), &node->work_req, node->proto->id, UV_PRIORITY_LOW, protocol_poll_work, protocol_poll_done) != 0) {
+		node->busy = 0;
+	}
+}
+
+static void protocol_poll_close(uv_handle_t *handle) {
+	FREE(handle);
+}
+
+/*
+ * Run a poll of a device every interval seconds, the first
+ * one after a second. The param is owned by the poll.
+ */
+struct protocol_poll_t *protocol_poll_init(protocol_t *proto, struct JsonNode *param, int interval, void (*run)(struct protocol_poll_t *), void (*gc)(struct protocol_poll_t *)) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct protocol_poll_t *node = NULL;
+
+	if((node = MALLOC(sizeof(struct protocol_poll_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memset(node, 0, sizeof(struct protocol_poll_t));
+	node->proto = proto;
+	node->param = param;
+	node->run = run;
+	node->gc = gc;
+	node->interval = (interval > 0) ? interval : 1;
+
+	if((node->timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	node->timer_req->data = node;
+	uv_timer_init(uv_default_loop(), node->timer_req);
+	uv_timer_start(node->timer_req, protocol_poll_timer, 1000, (uint64_t)node->interval*1000);
+
+	node->next = proto->polls;
+	proto->polls = node;
+
+	return node;
+}
+
+/*
+ * Shorten the interval of a poll shared by several devices.
+ * A poll that was stopped has no timer anymore.
+ */
+void protocol_poll_interval(struct protocol_poll_t *node, int interval) {
+	if(node == NULL || node->stopped == 1 || node->timer_req == NULL) {
+		return;
+	}
+	if(interval > 0 && interval < node->interval) {
+		node->interval = interval;
+		uv_timer_set_repeat(node->timer_req, (uint64_t)interval*1000);
+	}
+}
+
+/*
+ * A poll that is still running is freed by the worker
+ * pool once it is done.
+ */
+void protocol_poll_free(protocol_t *proto) {
+	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
+
+	struct protocol_poll_t *node = NULL;
+
+	while(proto->polls) {
+		node = proto->polls;
+		proto->polls = node->next;
+
+		node->stopped = 1;
+		uv_timer_stop(node->timer_req);
+		uv_close((uv_handle_t *)node->timer_req, protocol_poll_close);
+		node->timer_req = NULL;
+		if(node->busy == 0) {
+			protocol_poll_destroy(node);
+		}
+	}
+}
+
+static unsigned int protocol_intern_find(const char *name, unsigned int hash, unsigned int *slot) {
+	unsigned int i = 0;
+
+	for(i=hash&(protocol_intern_size-1);protocol_intern_table[i]!=0;i=(i+1)&(protocol_intern_size-1)) {
+		if(strcmp(protocol_interned[protocol_intern_table[i]-1], name) == 0) {
+			break;
+		}
+	}
+	if(slot != NULL) {
+		*slot = i;
+	}
+	return protocol_intern_table[i];
+}
+
+/* The name is owned by the protocol that registers it */
+static void protocol_intern_add(char *name) {
+	unsigned int i = 0, x = 0, slot = 0;
+
+	if(protocol_intern_table != NULL && protocol_intern_find(name, strhash(name), NULL) != 0) {
+		return;
+	}
+
+	if((protocol_interned = REALLOC(protocol_interned, sizeof(char *)*(protocol_nrinterned+1))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	protocol_interned[protocol_nrinterned++] = name;
+
+	/* Keep the table at most half full */
+	if(protocol_nrinterned*2 > protocol_intern_size) {
+		if(protocol_intern_table != NULL) {
+			FREE(protocol_intern_table);
+		}
+		protocol_intern_size = (protocol_intern_size == 0) ? 64 : protocol_intern_size*2;
+		if((protocol_intern_table = MALLOC(sizeof(unsigned int)*protocol_intern_size)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		memset(protocol_intern_table, 0, sizeof(unsigned int)*protocol_intern_size);
+		x = 0;
+	} else {
+		x = protocol_nrinterned-1;
+	}
+	for(i=x;i<protocol_nrinterned;i++) {
+		protocol_intern_find(protocol_interned[i], strhash(protocol_interned[i]), &slot);
+		protocol_intern_table[slot] = i+1;
+	}
+}
+
+static void protocol_intern_gc(void) {
+	if(protocol_interned != NULL) {
+		FREE(protocol_interned);
+	}
+	if(protocol_intern_table != NULL) {
+		FREE(protocol_intern_table);
+	}
+	protocol_nrinterned = 0;
+	protocol_intern_size = 0;
+}
+
+unsigned int protocol_intern(const char *name) {
+	if(protocol_intern_table == NULL || name == NULL) {
+		return 0;
+	}
+	return protocol_intern_find(name, strhash(name), NULL);
+}
+
+const char *protocol_interned_name(unsigned int handle) {
+	if(handle == 0 || handle > protocol_nrinterned) {
+		return "";
+	}
+	return protocol_interned[handle-1];
+}
+
 void protocol_set_id(protocol_t *proto, const char *id) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
@@ -333,6 +1092,7 @@ void protocol_set_id(protocol_t *proto, const char *id) {
 		exit(EXIT_FAILURE);
 	}
 	strcpy(proto->id, id);
+	protocol_intern_add(proto->id);
 }
 
 void protocol_device_add(protocol_t *proto, const char *id, const char *desc) {
@@ -355,6 +1115,7 @@ void protocol_device_add(protocol_t *proto, const char *id, const char *desc) {
 	strcpy(dnode->desc, desc);
 	dnode->next	= proto->devices;
 	proto->devices = dnode;
+	protocol_intern_add(dnode->id);
 }
 
 int protocol_device_exists(protocol_t *proto, const char *id) {
@@ -375,11 +1136,126 @@ int protocol_device_exists(protocol_t *proto, const char *id) {
 	return 1;
 }
 
+/*
+ * Returns the protocol that has a device of this name, or NULL
+ * when there is none.
+ */
+struct protocol_t *protocol_device_get(const char *id) {
+	unsigned int hash = 0, i = 0;
+
+	if(protocol_names == NULL || id == NULL) {
+		return NULL;
+	}
+
+	hash = strhash(id);
+	for(i=hash&(protocol_nrnames-1);protocol_names[i].id!=NULL;i=(i+1)&(protocol_nrnames-1)) {
+		if(protocol_names[i].hash == hash && strcmp(protocol_names[i].id, id) == 0) {
+			return protocol_names[i].listener;
+		}
+	}
+
+	return NULL;
+}
+
+static void code_cache_clear(struct code_cache_t *node) {
+	if(node->key != NULL) {
+		FREE(node->key);
+	}
+	if(node->message != NULL) {
+		FREE(node->message);
+	}
+	if(node->raw != NULL) {
+		FREE(node->raw);
+	}
+	memset(node, 0, sizeof(struct code_cache_t));
+}
+
+/*
+ * Fill the raw pulses and message of a protocol for a code,
+ * either from the cache or by calling its createCode.
+ */
+int protocol_create_code(protocol_t *proto, struct JsonNode *code) {
+	struct code_cache_t *node = NULL;
+	unsigned long hash = 5381;
+	char *key = NULL, *p = NULL;
+	int ret = 0;
+
+	if(proto->cache == 0 || (proto->hwtype != RF433 && proto->hwtype != RF868)) {
+		return proto->createCode(code);
+	}
+
+	key = json_stringify(code, NULL);
+	for(p=proto->id;*p != '\0';p++) {
+		hash = ((hash << 5) + hash) + (unsigned char)*p;
+	}
+	for(p=key;*p != '\0';p++) {
+		hash = ((hash << 5) + hash) + (unsigned char)*p;
+	}
+	node = &code_cache[hash % CODE_CACHE_SIZE];
+
+	pthread_mutex_lock(&code_cache_lock);
+	if(node->protocol == proto && node->hash == hash && strcmp(node->key, key) == 0) {
+		memcpy(proto->raw, node->raw, sizeof(int)*(size_t)node->rawlen);
+		proto->rawlen = node->rawlen;
+		proto->message = NULL;
+		if(node->message != NULL) {
+			proto->message = json_decode(node->message);
+		}
+		pthread_mutex_unlock(&code_cache_lock);
+		json_free(key);
+		return 0;
+	}
+	pthread_mutex_unlock(&code_cache_lock);
+
+	if((ret = proto->createCode(code)) != 0) {
+		json_free(key);
+		return ret;
+	}
+
+	pthread_mutex_lock(&code_cache_lock);
+	code_cache_clear(node);
+	node->protocol = proto;
+	node->hash = hash;
+	node->rawlen = proto->rawlen;
+	if((node->key = STRDUP(key)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((node->raw = MALLOC(sizeof(int)*(size_t)(proto->rawlen+1))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(node->raw, proto->raw, sizeof(int)*(size_t)proto->rawlen);
+	if(proto->message != NULL) {
+		char *message = json_stringify(proto->message, NULL);
+		if((node->message = STRDUP(message)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		json_free(message);
+	}
+	pthread_mutex_unlock(&code_cache_lock);
+	json_free(key);
+
+	return 0;
+}
+
 int protocol_gc(void) {
 	logprintf(LOG_STACK, "%s(...)", __FUNCTION__);
 
 	struct protocols_t *ptmp;
 	struct protocol_devices_t *dtmp;
+	int i = 0;
+
+	protocol_index_gc();
+	protocol_intern_gc();
+	protocol_index_select = NULL;
+#ifndef _WIN32
+	protocol_init_filter_gc();
+#endif
+
+	pthread_mutex_lock(&code_cache_lock);
+	for(i=0;i<CODE_CACHE_SIZE;i++) {
+		code_cache_clear(&code_cache[i]);
+	}
+	pthread_mutex_unlock(&code_cache_lock);
 
 	while(protocols) {
 		ptmp = protocols;
@@ -393,6 +1269,7 @@ int protocol_gc(void) {
 			logprintf(LOG_DEBUG, "ran garbage collector");
 		}
 		FREE(ptmp->listener->id);
+		pthread_mutex_destroy(&ptmp->listener->lock);
 		options_delete(ptmp->listener->options);
 		if(ptmp->listener->devices) {
 			while(ptmp->listener->devices) {
@@ -28,10 +28,13 @@
 #endif
 #include <pthread.h>
 
+#include "../../libuv/uv.h"
 #include "defines.h"
 #include "../core/options.h"
 #include "../core/threads.h"
 #include "../core/json.h"
+#include "../core/metrics.h"
+#include "../core/binary.h"
 
 #include "../config/devices.h"
 #include "../config/hardware.h"
@@ -72,6 +75,37 @@ typedef struct protocol_threads_t {
 	struct protocol_threads_t *next;
 } protocol_threads_t;
 
+/*
+ * A periodic poll of a device. The polls of all protocols
+ * share the timers of the main loop and the worker pool of
+ * libuv, instead of running a sleeping thread per device.
+ */
+typedef struct protocol_poll_t {
+	struct protocol_t *proto;
+	struct JsonNode *param;
+	void *data;
+	void (*run)(struct protocol_poll_t *);
+	void (*gc)(struct protocol_poll_t *);
+	int interval;
+	int busy;
+	int stopped;
+	uv_timer_t *timer_req;
+	uv_work_t work_req;
+	struct protocol_poll_t *next;
+} protocol_poll_t;
+
+/*
+ * A rough shape of a pulse train, worked out once for all
+ * protocols of its length. The ratios are against the shortest
+ * pulse, the footer being the last pulse. Long pulses are those
+ * over twice the shortest one.
+ */
+typedef struct protocol_fingerprint_t {
+	int ratio;
+	int footer;
+	int nrlong;
+} protocol_fingerprint_t;
+
 typedef struct protocol_t {
 	char *id;
 	int rawlen;
@@ -79,11 +113,16 @@ typedef struct protocol_t {
 	int maxrawlen;
 	int mingaplen;
 	int maxgaplen;
+	/* Trains outside these are skipped before validate, zero is no bound */
+	struct protocol_fingerprint_t minfingerprint;
+	struct protocol_fingerprint_t maxfingerprint;
 	short txrpt;
 	short rxrpt;
 	short multipleId;
 	short config;
 	short masterOnly;
+	/* Whether createCode always gives the same train for the same arguments */
+	short cache;
 	struct options_t *options;
 	struct JsonNode *message;
 
@@ -93,10 +132,19 @@ typedef struct protocol_t {
 
 	int *raw;
 
+	/* Held by a receive parser while it decodes with this protocol */
+	pthread_mutex_t lock;
+
 	hwtype_t hwtype;
 	devtype_t devtype;
 	struct protocol_devices_t *devices;
 	struct protocol_threads_t *threads;
+	struct protocol_poll_t *polls;
+
+	/* Receive metrics, created by the parser on first use */
+	struct metric_t *metric_hits;
+	struct metric_t *metric_misses;
+	struct metric_t *metric_parse;
 
 	union {
 		void (*parseCode)(void);
@@ -117,18 +165,49 @@ typedef struct protocols_t {
 	struct protocols_t *next;
 } protocols_;
 
+/*
+ * The fields the receive loop matches on, copied out of the
+ * protocol so all candidates of a length are checked from one
+ * contiguous array. The protocol itself is only touched when
+ * a candidate passes these checks.
+ */
+typedef struct protocol_index_t {
+	hwtype_t hwtype;
+	int minfooter;
+	struct protocol_fingerprint_t minfingerprint;
+	struct protocol_fingerprint_t maxfingerprint;
+	struct protocol_t *listener;
+} protocol_index_t;
+
 extern struct protocols_t *protocols;
 
 void protocol_init(void);
+#ifndef _WIN32
+void protocol_init_filter(char **ids, int nr);
+#endif
 struct protocol_threads_t *protocol_thread_init(protocol_t *proto, struct JsonNode *param);
 int protocol_thread_wait(struct protocol_threads_t *node, int interval, int *nrloops);
 void protocol_thread_free(protocol_t *proto);
 void protocol_thread_stop(protocol_t *proto);
+struct protocol_poll_t *protocol_poll_init(protocol_t *proto, struct JsonNode *param, int interval, void (*run)(struct protocol_poll_t *), void (*gc)(struct protocol_poll_t *));
+void protocol_poll_interval(struct protocol_poll_t *node, int interval);
+void protocol_poll_free(protocol_t *proto);
 void protocol_set_id(protocol_t *proto, const char *id);
 void protocol_plslen_add(protocol_t *proto, int plslen);
 void protocol_register(protocol_t **proto);
 void protocol_device_add(protocol_t *proto, const char *id, const char *desc);
 int protocol_device_exists(protocol_t *proto, const char *id);
+struct protocol_t *protocol_device_get(const char *id);
+unsigned int protocol_intern(const char *name);
+const char *protocol_interned_name(unsigned int handle);
+int protocol_create_code(protocol_t *proto, struct JsonNode *code);
+void protocol_index_init(void);
+void protocol_index_filter(int (*select)(struct protocol_t *proto));
+int protocol_index_filtered(void);
+int protocol_index_get(int rawlen, struct protocol_index_t **candidates);
+int protocol_index_footers(int footer, int *lengths, int size);
+void protocol_fingerprint(const int *pulses, int length, struct protocol_fingerprint_t *fingerprint);
+int protocol_index_match(const struct protocol_index_t *candidate, int hwtype, int footer, const struct protocol_fingerprint_t *fingerprint);
 int protocol_gc(void);
 
 #endif
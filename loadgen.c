@@ -0,0 +1,599 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Puts a running daemon under the load of many guis. A number
+ * of socket and websocket clients identify themselves like the
+ * webgui and request the config, while a separate connection
+ * controls a device and requests the values at a fixed rate.
+ * Every control changes the state of the device, so it is
+ * broadcasted to all guis. Reported are the latencies of the
+ * control and values requests, and the delay from a control
+ * until each gui received the update of the device.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include "libs/libuv/uv.h"
+#include "libs/pilight/core/pilight.h"
+#include "libs/pilight/core/common.h"
+#include "libs/pilight/core/options.h"
+#include "libs/pilight/core/socket.h"
+#include "libs/pilight/core/log.h"
+#include "libs/pilight/core/json.h"
+#include "libs/pilight/core/mem.h"
+
+#define LOADGEN_SOCKET		0
+#define LOADGEN_WEBSOCKET	1
+#define LOADGEN_BUFSIZE		65536
+/* Requests waiting for their answer */
+#define LOADGEN_PENDING		1024
+
+typedef struct loadgen_client_t {
+	int fd;
+	int type;
+	int open;
+	/* The last control this gui received the update of */
+	unsigned long seen;
+	char *buf;
+	size_t len;
+} loadgen_client_t;
+
+typedef struct loadgen_samples_t {
+	char *name;
+	uint64_t *values;
+	unsigned long nr;
+	unsigned long size;
+} loadgen_samples_t;
+
+typedef struct loadgen_queue_t {
+	uint64_t sent[LOADGEN_PENDING];
+	unsigned int head;
+	unsigned int tail;
+} loadgen_queue_t;
+
+static struct loadgen_client_t *clients = NULL;
+static int nrclients = 0;
+static struct loadgen_client_t control;
+
+static struct loadgen_samples_t controls = { "control", NULL, 0, 0 };
+static struct loadgen_samples_t values = { "values", NULL, 0, 0 };
+static struct loadgen_samples_t fanout = { "fan-out", NULL, 0, 0 };
+
+static struct loadgen_queue_t pending_controls;
+static struct loadgen_queue_t pending_values;
+
+/* The moment and number of the last control sent */
+static uint64_t control_ts = 0;
+static unsigned long control_nr = 0;
+
+static char *device = NULL;
+static unsigned long broadcasts = 0;
+static unsigned long failures = 0;
+static unsigned long lost = 0;
+static int running = 1;
+
+int main_gc(void) {
+	int i = 0;
+
+	log_shell_disable();
+
+	for(i=0;i<nrclients;i++) {
+		if(clients[i].open == 1) {
+			close(clients[i].fd);
+		}
+		FREE(clients[i].buf);
+	}
+	if(clients != NULL) {
+		FREE(clients);
+	}
+	nrclients = 0;
+	if(control.open == 1) {
+		close(control.fd);
+	}
+	if(control.buf != NULL) {
+		FREE(control.buf);
+	}
+	if(controls.values != NULL) {
+		FREE(controls.values);
+	}
+	if(values.values != NULL) {
+		FREE(values.values);
+	}
+	if(fanout.values != NULL) {
+		FREE(fanout.values);
+	}
+
+	options_gc();
+	log_gc();
+	FREE(progname);
+
+	return EXIT_SUCCESS;
+}
+
+static void loadgen_signal(int sig) {
+	running = 0;
+}
+
+static void loadgen_sample(struct loadgen_samples_t *samples, uint64_t ns) {
+	if(samples->nr == samples->size) {
+		samples->size += 1024;
+		if((samples->values = REALLOC(samples->values, sizeof(uint64_t)*samples->size)) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+	}
+	samples->values[samples->nr++] = ns;
+}
+
+static int loadgen_sample_cmp(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double loadgen_percentile(struct loadgen_samples_t *samples, int p) {
+	if(samples->nr == 0) {
+		return 0.0;
+	}
+	return (double)samples->values[(samples->nr-1)*(unsigned long)p/100] / 1000000.0;
+}
+
+static void loadgen_report_samples(struct loadgen_samples_t *samples) {
+	if(samples->nr > 1) {
+		qsort(samples->values, (size_t)samples->nr, sizeof(uint64_t), loadgen_sample_cmp);
+	}
+	printf("%-8s %10lu %10.2f %10.2f %10.2f %10.2f\n", samples->name, samples->nr,
+		loadgen_percentile(samples, 50), loadgen_percentile(samples, 90),
+		loadgen_percentile(samples, 99), loadgen_percentile(samples, 100));
+}
+
+static void loadgen_push(struct loadgen_queue_t *queue, uint64_t now) {
+	if(queue->head-queue->tail == LOADGEN_PENDING) {
+		queue->tail++;
+		lost++;
+	}
+	queue->sent[queue->head++ % LOADGEN_PENDING] = now;
+}
+
+static void loadgen_answer(struct loadgen_queue_t *queue, struct loadgen_samples_t *samples, uint64_t now) {
+	if(queue->head != queue->tail) {
+		loadgen_sample(samples, now - queue->sent[queue->tail++ % LOADGEN_PENDING]);
+	}
+}
+
+static int loadgen_send(int fd, const char *buf, size_t len) {
+	ssize_t n = 0;
+	size_t done = 0;
+
+	while(done < len) {
+		if((n = send(fd, &buf[done], len-done, MSG_NOSIGNAL)) <= 0) {
+			if(n < 0 && (errno == EINTR || errno == EAGAIN)) {
+				continue;
+			}
+			return -1;
+		}
+		done += (size_t)n;
+	}
+	return 0;
+}
+
+static int loadgen_socket_write(int fd, const char *msg) {
+	if(loadgen_send(fd, msg, strlen(msg)) == -1 ||
+	   loadgen_send(fd, EOSS, strlen(EOSS)) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Clients have to mask their frames, an empty mask leaves the
+ * payload as it is.
+ */
+static int loadgen_websocket_write(int fd, const char *msg) {
+	unsigned char header[8];
+	size_t len = strlen(msg), n = 0;
+
+	header[n++] = 0x81;
+	if(len < 126) {
+		header[n++] = (unsigned char)(0x80 | len);
+	} else {
+		header[n++] = 0x80 | 126;
+		header[n++] = (unsigned char)(len >> 8);
+		header[n++] = (unsigned char)(len & 0xFF);
+	}
+	memset(&header[n], 0, 4);
+	n += 4;
+
+	if(loadgen_send(fd, (char *)header, n) == -1 || loadgen_send(fd, msg, len) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+static int loadgen_write(struct loadgen_client_t *client, const char *msg) {
+	if(client->type == LOADGEN_WEBSOCKET) {
+		return loadgen_websocket_write(client->fd, msg);
+	}
+	return loadgen_socket_write(client->fd, msg);
+}
+
+static int loadgen_handshake(int fd, char *server, int port) {
+	char buf[1024];
+	ssize_t n = 0;
+	size_t len = 0;
+
+	len = (size_t)snprintf(buf, sizeof(buf),
+		"GET /websocket HTTP/1.1\r\n"
+		"Host: %s:%d\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+		"Sec-WebSocket-Version: 13\r\n\r\n", server, port);
+	if(loadgen_send(fd, buf, len) == -1) {
+		return -1;
+	}
+
+	len = 0;
+	while(len < sizeof(buf)-1) {
+		if((n = recv(fd, &buf[len], 1, 0)) <= 0) {
+			return -1;
+		}
+		len++;
+		buf[len] = '\0';
+		if(len >= 4 && strcmp(&buf[len-4], "\r\n\r\n") == 0) {
+			break;
+		}
+	}
+	if(strstr(buf, " 101 ") == NULL) {
+		return -1;
+	}
+	return 0;
+}
+
+static int loadgen_connect(struct loadgen_client_t *client, int type, char *server, int port) {
+	memset(client, 0, sizeof(struct loadgen_client_t));
+	client->type = type;
+	if((client->buf = MALLOC(LOADGEN_BUFSIZE)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((client->fd = socket_connect(server, (unsigned short)port)) == -1) {
+		return -1;
+	}
+	client->open = 1;
+	if(type == LOADGEN_WEBSOCKET && loadgen_handshake(client->fd, server, port) == -1) {
+		logprintf(LOG_ERR, "websocket handshake with %s:%d failed", server, port);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * A broadcast counts for the last control when it holds the
+ * controlled device, and was not counted before by this gui.
+ */
+static void loadgen_message(struct loadgen_client_t *client, const char *msg, uint64_t now) {
+	if(client == &control) {
+		if(strstr(msg, "\"status\"") != NULL) {
+			if(strstr(msg, "\"success\"") == NULL) {
+				failures++;
+			}
+			loadgen_answer(&pending_controls, &controls, now);
+		} else if(strstr(msg, "\"values\"") != NULL) {
+			loadgen_answer(&pending_values, &values, now);
+		}
+		return;
+	}
+	if(strstr(msg, "\"devices\"") != NULL) {
+		broadcasts++;
+		if(device != NULL && client->seen < control_nr && strstr(msg, device) != NULL) {
+			loadgen_sample(&fanout, now - control_ts);
+			client->seen = control_nr;
+		}
+	}
+}
+
+static void loadgen_split_socket(struct loadgen_client_t *client, uint64_t now) {
+	size_t eoss = strlen(EOSS), pos = 0;
+	char *end = NULL;
+
+	client->buf[client->len] = '\0';
+	while((end = strstr(&client->buf[pos], EOSS)) != NULL) {
+		*end = '\0';
+		loadgen_message(client, &client->buf[pos], now);
+		pos = (size_t)(end - client->buf) + eoss;
+	}
+	memmove(client->buf, &client->buf[pos], client->len-pos);
+	client->len -= pos;
+}
+
+static void loadgen_split_websocket(struct loadgen_client_t *client, uint64_t now) {
+	unsigned char *p = (unsigned char *)client->buf;
+	unsigned long long plen = 0;
+	size_t pos = 0, hlen = 0;
+	char c = 0;
+	int i = 0;
+
+	while(client->len-pos >= 2) {
+		hlen = 2;
+		plen = p[pos+1] & 0x7F;
+		if(plen == 126) {
+			hlen = 4;
+		} else if(plen == 127) {
+			hlen = 10;
+		}
+		if(client->len-pos < hlen) {
+			break;
+		}
+		if(hlen > 2) {
+			plen = 0;
+			for(i=2;i<(int)hlen;i++) {
+				plen = (plen << 8) | p[pos+i];
+			}
+		}
+		if(client->len-pos-hlen < plen) {
+			break;
+		}
+		if((p[pos] & 0x0F) == 0x01) {
+			c = client->buf[pos+hlen+plen];
+			client->buf[pos+hlen+plen] = '\0';
+			loadgen_message(client, &client->buf[pos+hlen], now);
+			client->buf[pos+hlen+plen] = c;
+		}
+		pos += hlen+(size_t)plen;
+	}
+	memmove(client->buf, &client->buf[pos], client->len-pos);
+	client->len -= pos;
+}
+
+static void loadgen_read(struct loadgen_client_t *client) {
+	ssize_t n = 0;
+
+	if(client->len >= LOADGEN_BUFSIZE-1) {
+		/* A message larger than the buffer */
+		client->len = 0;
+	}
+	if((n = recv(client->fd, &client->buf[client->len], LOADGEN_BUFSIZE-1-client->len, 0)) <= 0) {
+		logprintf(LOG_ERR, "the daemon closed a connection");
+		close(client->fd);
+		client->open = 0;
+		return;
+	}
+	client->len += (size_t)n;
+
+	if(client->type == LOADGEN_WEBSOCKET) {
+		loadgen_split_websocket(client, uv_hrtime());
+	} else {
+		loadgen_split_socket(client, uv_hrtime());
+	}
+}
+
+static void loadgen_run(int duration, int crate, int vrate, char *on, char *off) {
+	struct pollfd *fds = NULL;
+	struct loadgen_client_t **map = NULL;
+	uint64_t begin = uv_hrtime(), end = begin+(uint64_t)duration*1000000000ULL;
+	uint64_t cnext = begin, vnext = begin, now = 0, next = 0;
+	char msg[1024];
+	int i = 0, n = 0, timeout = 0;
+
+	if((fds = MALLOC(sizeof(struct pollfd)*(size_t)(nrclients+1))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	if((map = MALLOC(sizeof(struct loadgen_client_t *)*(size_t)(nrclients+1))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+
+	while(running == 1 && (now = uv_hrtime()) < end) {
+		if(device != NULL && crate > 0 && now >= cnext) {
+			snprintf(msg, sizeof(msg),
+				"{\"action\":\"control\",\"code\":{\"device\":\"%s\",\"state\":\"%s\"}}",
+				device, (control_nr % 2 == 0) ? on : off);
+			if(loadgen_socket_write(control.fd, msg) == 0) {
+				loadgen_push(&pending_controls, now);
+				control_ts = now;
+				control_nr++;
+			}
+			cnext += 1000000000ULL/(uint64_t)crate;
+		}
+		if(vrate > 0 && now >= vnext) {
+			if(loadgen_socket_write(control.fd, "{\"action\":\"request values\"}") == 0) {
+				loadgen_push(&pending_values, now);
+			}
+			vnext += 1000000000ULL/(uint64_t)vrate;
+		}
+
+		n = 0;
+		if(control.open == 1) {
+			fds[n].fd = control.fd;
+			fds[n].events = POLLIN;
+			map[n++] = &control;
+		}
+		for(i=0;i<nrclients;i++) {
+			if(clients[i].open == 1) {
+				fds[n].fd = clients[i].fd;
+				fds[n].events = POLLIN;
+				map[n++] = &clients[i];
+			}
+		}
+		if(n == 0) {
+			break;
+		}
+
+		next = end;
+		if(device != NULL && crate > 0 && cnext < next) {
+			next = cnext;
+		}
+		if(vrate > 0 && vnext < next) {
+			next = vnext;
+		}
+		timeout = (next > now) ? (int)((next-now)/1000000) : 0;
+
+		if(poll(fds, (nfds_t)n, timeout) > 0) {
+			for(i=0;i<n;i++) {
+				if((fds[i].revents & (POLLIN | POLLHUP | POLLERR)) != 0) {
+					loadgen_read(map[i]);
+				}
+			}
+		}
+	}
+
+	FREE(fds);
+	FREE(map);
+}
+
+static void loadgen_report(uint64_t elapsed) {
+	double seconds = (double)elapsed/1000000000.0;
+
+	printf("%-8s %10s %10s %10s %10s %10s\n", "", "samples", "p50 (ms)", "p90 (ms)", "p99 (ms)", "max (ms)");
+	loadgen_report_samples(&controls);
+	loadgen_report_samples(&values);
+	loadgen_report_samples(&fanout);
+	printf("\n");
+	printf("controls sent:       %lu (%lu failed, %lu unanswered)\n", control_nr, failures,
+		(unsigned long)(pending_controls.head-pending_controls.tail));
+	printf("broadcasts received: %lu (%.1f per second)\n", broadcasts, (seconds > 0) ? (double)broadcasts/seconds : 0.0);
+	if(lost > 0) {
+		printf("requests not timed:  %lu\n", lost);
+	}
+}
+
+int main(int argc, char **argv) {
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	memcpy((void *)&pth_main_id, &pth_cur_id, sizeof(uv_thread_t));
+
+	struct options_t *options = NULL;
+	char *server = "127.0.0.1", *on = "on", *off = "off";
+	char msg[256];
+	int help = 0, port = 5000, wport = 5001, nrsockets = 10, nrwebsockets = 0;
+	int crate = 1, vrate = 1, duration = 10, i = 0;
+	uint64_t begin = 0;
+
+	pilight.process = PROCESS_CLIENT;
+
+	log_shell_enable();
+	log_file_disable();
+	log_level_set(LOG_NOTICE);
+
+	if((progname = MALLOC(16)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	strcpy(progname, "pilight-loadgen");
+
+	options_add(&options, "H", "help", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, "V", "version", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, "S", "server", OPTION_HAS_VALUE, 0, JSON_STRING, NULL, NULL);
+	options_add(&options, "P", "port", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "W", "webserver-port", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "c", "sockets", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "w", "websockets", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "d", "device", OPTION_HAS_VALUE, 0, JSON_STRING, NULL, NULL);
+	options_add(&options, "s", "state", OPTION_HAS_VALUE, 0, JSON_STRING, NULL, NULL);
+	options_add(&options, "o", "other-state", OPTION_HAS_VALUE, 0, JSON_STRING, NULL, NULL);
+	options_add(&options, "r", "control-rate", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "q", "values-rate", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+	options_add(&options, "t", "time", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-9]+$");
+
+	if(options_parse(options, argc, argv) == -1) {
+		help = 1;
+	}
+
+	if(options_exists(options, "H") == 0 || help == 1) {
+		printf("Usage: %s [options]\n", progname);
+		printf("\t -H --help\t\t\tdisplay usage summary\n");
+		printf("\t -V --version\t\t\tdisplay version\n");
+		printf("\t -S --server=x.x.x.x\t\tconnect to server address\n");
+		printf("\t -P --port=xxxx\t\t\tconnect to the socket on this port\n");
+		printf("\t -W --webserver-port=xxxx\tconnect the websockets to this port\n");
+		printf("\t -c --sockets=number\t\tnumber of socket guis\n");
+		printf("\t -w --websockets=number\t\tnumber of websocket guis\n");
+		printf("\t -d --device=device\t\tthe device that is controlled\n");
+		printf("\t -s --state=state\t\tthe first state the device is switched to\n");
+		printf("\t -o --other-state=state\t\tthe state the device is switched back to\n");
+		printf("\t -r --control-rate=number\tcontrols per second, 0 disables them\n");
+		printf("\t -q --values-rate=number\tvalues requests per second, 0 disables them\n");
+		printf("\t -t --time=seconds\t\thow long the load is generated\n");
+		goto close;
+	}
+
+	if(options_exists(options, "V") == 0) {
+		printf("%s v%s\n", progname, PILIGHT_VERSION);
+		goto close;
+	}
+
+	options_get_string(options, "S", &server);
+	options_get_number(options, "P", &port);
+	options_get_number(options, "W", &wport);
+	options_get_number(options, "c", &nrsockets);
+	options_get_number(options, "w", &nrwebsockets);
+	options_get_string(options, "d", &device);
+	options_get_string(options, "s", &on);
+	options_get_string(options, "o", &off);
+	options_get_number(options, "r", &crate);
+	options_get_number(options, "q", &vrate);
+	options_get_number(options, "t", &duration);
+
+	if(device == NULL && crate > 0) {
+		logprintf(LOG_NOTICE, "no device given, not sending controls");
+	}
+	if(duration <= 0) {
+		logprintf(LOG_ERR, "the time must be larger than 0");
+		goto close;
+	}
+
+	signal(SIGINT, loadgen_signal);
+	signal(SIGTERM, loadgen_signal);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* The requests of the control connection are answered in order */
+	if(loadgen_connect(&control, LOADGEN_SOCKET, server, port) == -1 ||
+	   loadgen_socket_write(control.fd, "{\"action\":\"identify\"}") == -1) {
+		logprintf(LOG_ERR, "could not connect to pilight-daemon on %s:%d", server, port);
+		goto close;
+	}
+
+	if((clients = MALLOC(sizeof(struct loadgen_client_t)*(size_t)(nrsockets+nrwebsockets))) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	for(i=0;i<nrsockets+nrwebsockets;i++) {
+		nrclients++;
+		if(i < nrsockets) {
+			if(loadgen_connect(&clients[i], LOADGEN_SOCKET, server, port) == -1) {
+				logprintf(LOG_ERR, "could not connect gui %d to %s:%d", i, server, port);
+				goto close;
+			}
+		} else if(loadgen_connect(&clients[i], LOADGEN_WEBSOCKET, server, wport) == -1) {
+			logprintf(LOG_ERR, "could not connect gui %d to %s:%d", i, server, wport);
+			goto close;
+		}
+
+		snprintf(msg, sizeof(msg), "{\"action\":\"identify\",\"options\":{\"config\":1},\"media\":\"all\",\"uuid\":\"0000-00-00-00-%06x\"}", i);
+		if(loadgen_write(&clients[i], msg) == -1 ||
+		   loadgen_write(&clients[i], "{\"action\":\"request config\"}") == -1) {
+			logprintf(LOG_ERR, "could not identify gui %d", i);
+			goto close;
+		}
+	}
+
+	logprintf(LOG_NOTICE, "%d socket and %d websocket guis connected", nrsockets, nrwebsockets);
+
+	begin = uv_hrtime();
+	loadgen_run(duration, crate, vrate, on, off);
+	loadgen_report(uv_hrtime() - begin);
+
+close:
+	options_delete(options);
+	main_gc();
+
+	return (EXIT_SUCCESS);
+}
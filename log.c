@@ -0,0 +1,278 @@
+/*
+	Copyright (C) 2013 - 2016 CurlyMo
+
+  This Source Code Form is subject to the terms of the Mozilla Public
+  License, v. 2.0. If a copy of the MPL was not distributed with this
+  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+*/
+
+/*
+ * Renders a binary log written by the daemon as the lines of
+ * the normal log. The timestamps are derived from the monotonic
+ * clock of the entries and the realtime clock of the header
+ * they follow.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libs/libuv/uv.h"
+#include "libs/pilight/core/pilight.h"
+#include "libs/pilight/core/common.h"
+#include "libs/pilight/core/options.h"
+#include "libs/pilight/core/log.h"
+#include "libs/pilight/core/mem.h"
+#include "libs/pilight/core/binlog.h"
+
+#define LOG_RENDER_SIZE		4096
+
+static char **formats = NULL;
+static unsigned int nrformats = 0;
+static FILE *fp = NULL;
+
+static void log_formats_gc(void) {
+	unsigned int i = 0;
+
+	for(i=0;i<nrformats;i++) {
+		if(formats[i] != NULL) {
+			FREE(formats[i]);
+		}
+	}
+	if(formats != NULL) {
+		FREE(formats);
+	}
+	formats = NULL;
+	nrformats = 0;
+}
+
+int main_gc(void) {
+	log_shell_disable();
+
+	log_formats_gc();
+	if(fp != NULL) {
+		fclose(fp);
+		fp = NULL;
+	}
+
+	options_gc();
+	log_gc();
+	FREE(progname);
+
+	return EXIT_SUCCESS;
+}
+
+static void log_format_add(uint32_t id, const char *format, size_t len) {
+	unsigned int i = 0;
+
+	if(id >= nrformats) {
+		if((formats = REALLOC(formats, sizeof(char *)*(id+1))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		for(i=nrformats;i<=id;i++) {
+			formats[i] = NULL;
+		}
+		nrformats = id+1;
+	}
+	if(formats[id] != NULL) {
+		FREE(formats[id]);
+	}
+	if((formats[id] = MALLOC(len+1)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	memcpy(formats[id], format, len);
+	formats[id][len] = '\0';
+}
+
+static const char *log_prefix(int prio) {
+	switch(prio) {
+		case LOG_WARNING:
+			return "WARNING: ";
+		case LOG_ERR:
+			return "ERROR: ";
+		case LOG_INFO:
+			return "INFO: ";
+		case LOG_NOTICE:
+			return "NOTICE: ";
+		case LOG_DEBUG:
+			return "DEBUG: ";
+		case LOG_STACK:
+			return "STACK: ";
+		default:
+			return "";
+	}
+}
+
+static void log_print(uint64_t usec, const char *name, int prio, const char *line) {
+	struct tm tm;
+	time_t sec = (time_t)(usec/1000000);
+	char fmt[64], buf[64];
+
+	memset(&tm, '\0', sizeof(struct tm));
+	memset(buf, '\0', sizeof(buf));
+
+#ifdef _WIN32
+	struct tm *tm1;
+	if((tm1 = gmtime(&sec)) != 0) {
+		memcpy(&tm, tm1, sizeof(struct tm));
+#else
+	if((gmtime_r(&sec, &tm)) != 0) {
+#endif
+		strftime(fmt, sizeof(fmt), "%b %d %H:%M:%S", &tm);
+		snprintf(buf, sizeof(buf), "%s:%03u", fmt, (unsigned int)(usec%1000000));
+	}
+	printf("[%22.22s] %s: %s%s\n", buf, name, log_prefix(prio), line);
+}
+
+int main(int argc, char **argv) {
+	const uv_thread_t pth_cur_id = uv_thread_self();
+	memcpy((void *)&pth_main_id, &pth_cur_id, sizeof(uv_thread_t));
+
+	struct options_t *options = NULL;
+	char *file = NULL, name[64], header[BINLOG_MAGIC_SIZE+4], out[LOG_RENDER_SIZE];
+	unsigned char record[BINLOG_RECORD];
+	char *payload = NULL;
+	uint64_t realtime = 0, monotonic = 0, ts = 0, usec = 0;
+	uint32_t order = 0, id = 0;
+	uint16_t len = 0;
+	unsigned long entries = 0, unknown = 0;
+	int help = 0, level = LOG_DEBUG, prio = 0, n = 0;
+	size_t x = 0;
+
+	pilight.process = PROCESS_CLIENT;
+
+	log_shell_enable();
+	log_file_disable();
+	log_level_set(LOG_NOTICE);
+
+	if((progname = MALLOC(12)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+	strcpy(progname, "pilight-log");
+	strcpy(name, "pilight-daemon");
+
+	options_add(&options, "H", "help", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, "V", "version", OPTION_NO_VALUE, 0, JSON_NULL, NULL, NULL);
+	options_add(&options, "F", "file", OPTION_HAS_VALUE, 0, JSON_STRING, NULL, NULL);
+	options_add(&options, "L", "level", OPTION_HAS_VALUE, 0, JSON_NUMBER, NULL, "^[0-7]$");
+
+	if(options_parse(options, argc, argv) == -1) {
+		help = 1;
+	}
+
+	if(options_exists(options, "H") == 0 || help == 1) {
+		printf("Usage: %s [options]\n", progname);
+		printf("\t -H --help\t\tdisplay usage summary\n");
+		printf("\t -V --version\t\tdisplay version\n");
+		printf("\t -F --file=file\t\tthe binary log written by the daemon\n");
+		printf("\t -L --level=level\tonly show messages up to this log level\n");
+		goto close;
+	}
+
+	if(options_exists(options, "V") == 0) {
+		printf("%s v%s\n", progname, PILIGHT_VERSION);
+		goto close;
+	}
+
+	if(options_get_string(options, "F", &file) != 0) {
+		logprintf(LOG_ERR, "no binary log given");
+		goto close;
+	}
+	options_get_number(options, "L", &level);
+
+	if((fp = fopen(file, "rb")) == NULL) {
+		logprintf(LOG_ERR, "cannot open %s", file);
+		goto close;
+	}
+	if(fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+	   memcmp(header, BINLOG_MAGIC, BINLOG_MAGIC_SIZE) != 0) {
+		logprintf(LOG_ERR, "%s is not a binary log", file);
+		goto close;
+	}
+	memcpy(&order, &header[BINLOG_MAGIC_SIZE], 4);
+	if(order != BINLOG_ORDER) {
+		logprintf(LOG_ERR, "%s was written on a system with another byte order", file);
+		goto close;
+	}
+
+	if((payload = MALLOC(0xFFFF)) == NULL) {
+		OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+	}
+
+	while(fread(record, 1, BINLOG_RECORD, fp) == BINLOG_RECORD) {
+		memcpy(&len, &record[1], 2);
+		if(fread(payload, 1, len, fp) != len) {
+			logprintf(LOG_NOTICE, "the last record of %s is incomplete", file);
+			break;
+		}
+
+		switch(record[0]) {
+			case BINLOG_HEADER:
+				if(len < 16) {
+					goto corrupt;
+				}
+				memcpy(&realtime, &payload[0], 8);
+				memcpy(&monotonic, &payload[8], 8);
+				x = (size_t)len-16;
+				if(x >= sizeof(name)) {
+					x = sizeof(name)-1;
+				}
+				memcpy(name, &payload[16], x);
+				name[x] = '\0';
+				/* The formats of the previous run are no longer valid */
+				log_formats_gc();
+			break;
+			case BINLOG_FORMAT:
+				if(len < 4) {
+					goto corrupt;
+				}
+				memcpy(&id, payload, 4);
+				log_format_add(id, &payload[4], (size_t)len-4);
+			break;
+			case BINLOG_ENTRY:
+				if(len < 13) {
+					goto corrupt;
+				}
+				memcpy(&ts, &payload[0], 8);
+				prio = (unsigned char)payload[8];
+				memcpy(&id, &payload[9], 4);
+				if(prio > level && prio != LOG_STACK) {
+					break;
+				}
+				usec = realtime;
+				if(ts >= monotonic) {
+					usec += (ts-monotonic)/1000;
+				}
+				entries++;
+				if(id >= nrformats || formats[id] == NULL) {
+					snprintf(out, sizeof(out), "<unknown format %u>", (unsigned int)id);
+					unknown++;
+				} else if((n = binlog_render(formats[id], &payload[13], (size_t)len-13, out, sizeof(out))) == -1) {
+					snprintf(out, sizeof(out), "<arguments do not match \"%s\">", formats[id]);
+					unknown++;
+				}
+				log_print(usec, name, prio, out);
+			break;
+			default:
+				goto corrupt;
+		}
+	}
+
+	if(unknown > 0) {
+		logprintf(LOG_NOTICE, "%lu of %lu messages could not be decoded", unknown, entries);
+	}
+	goto close;
+
+corrupt:
+	logprintf(LOG_ERR, "%s contains an invalid record", file);
+
+close:
+	if(payload != NULL) {
+		FREE(payload);
+	}
+	options_delete(options);
+	main_gc();
+
+	return (EXIT_SUCCESS);
+}
@@ -41,6 +41,7 @@
 #include "libs/pilight/core/threads.h"
 #include "libs/pilight/core/dso.h"
 #include "libs/pilight/core/gc.h"
+#include "libs/pilight/core/rawtap.h"
 #include "libs/pilight/config/config.h"
 #include "libs/pilight/config/hardware.h"
 #include "libs/pilight/lua_c/lua.h"
@@ -56,6 +57,8 @@ static uv_signal_t *signal_req = NULL;
 
 static unsigned short main_loop = 1;
 static unsigned short linefeed = 0;
+static int tap = 0;
+static unsigned int tap_tail = 0;
 
 static char *lua_root = LUA_ROOT;
 
@@ -76,6 +79,7 @@ int main_gc(void) {
 #endif
 	config_gc();
 	protocol_gc();
+	rawtap_gc();
 	whitelist_free();
 	threads_gc();
 
@@ -127,7 +131,7 @@ static void *receivePulseTrain(int reason, void *param) {
 
 	if(data->hardware != NULL && data->pulses != NULL && data->length > 0) {
 #ifndef PILIGHT_REWRITE
-		char *id = NULL;
+		char *id = data->hardware;
 		struct conf_hardware_t *tmp_confhw = conf_hardware;
 		while(tmp_confhw) {
 			if(strcmp(tmp_confhw->hardware->id, data->hardware) == 0) {
@@ -161,6 +165,23 @@ static void *receivePulseTrain(int reason, void *param) {
 }
 
 #ifndef PILIGHT_DEVELOPMENT
+/* Follow the trains a running daemon publishes */
+static void tap_cb(uv_timer_t *req) {
+	struct reason_received_pulsetrain_t data;
+	char hardware[RAWTAP_HWLEN];
+	int pulses[MAXPULSESTREAMLENGTH+1];
+	int r = 0;
+
+	memset(&data, 0, sizeof(data));
+	data.pulses = pulses;
+	while(main_loop && (r = rawtap_read(&tap_tail, hardware, sizeof(hardware), data.pulses, &data.length)) != 0) {
+		if(r == 1) {
+			data.hardware = hardware;
+			receivePulseTrain(REASON_RECEIVED_PULSETRAIN, &data);
+		}
+	}
+}
+
 static void signal_cb(uv_signal_t *handle, int signum) {
 	uv_stop(uv_default_loop());
 	main_gc();
@@ -321,9 +342,14 @@ int main(int argc, char **argv) {
 	}
 
 	if((n = isrunning("pilight-daemon", &ret)) > 0) {
-		logprintf(LOG_NOTICE, "pilight-daemon instance found (%d)", ret[0]);
+		if(rawtap_open(&tap_tail) != 0) {
+			logprintf(LOG_NOTICE, "pilight-daemon instance found (%d), enable its raw-tap setting to follow it", ret[0]);
+			FREE(ret);
+			goto close;
+		}
+		logprintf(LOG_NOTICE, "following the pulse trains of pilight-daemon (%d)", ret[0]);
 		FREE(ret);
-		goto close;
+		tap = 1;
 	}
 
 	if((n = isrunning("pilight-debug", &ret)) > 0) {
@@ -354,6 +380,18 @@ int main(int argc, char **argv) {
 
 	int has_hardware = 0;
 	struct conf_hardware_t *tmp_confhw = conf_hardware;
+#ifndef PILIGHT_DEVELOPMENT
+	if(tap == 1) {
+		uv_timer_t *timer_req = NULL;
+		if((timer_req = MALLOC(sizeof(uv_timer_t))) == NULL) {
+			OUT_OF_MEMORY /*LCOV_EXCL_LINE*/
+		}
+		uv_timer_init(uv_default_loop(), timer_req);
+		uv_timer_start(timer_req, tap_cb, 10, 10);
+		has_hardware = 1;
+		tmp_confhw = NULL;
+	}
+#endif
 	while(tmp_confhw) {
 		if(tmp_confhw->hardware->init) {
 			if(tmp_confhw->hardware->comtype == COMOOK) {
@@ -362,7 +400,7 @@ int main(int argc, char **argv) {
 				tmp_confhw->hardware->maxgaplen = 99999;
 				tmp_confhw->hardware->mingaplen = 0;
 			}
-			if(tmp_confhw->hardware->init() == EXIT_FAILURE) {
+			if(tmp_confhw->hardware->init(tmp_confhw->hardware) == EXIT_FAILURE) {
 				logprintf(LOG_ERR, "could not initialize %s hardware mode", tmp_confhw->hardware->id);
 				goto close;
 			} else {
@@ -78,7 +78,6 @@ int main(int argc, char **argv) {
 	}
 	strcpy(progname, "pilight-receive");
 	struct options_t *options = NULL;
-	struct ssdp_list_t *ssdp_list = NULL;
 
 	char *server = NULL;
 	char *filter = NULL;
@@ -163,17 +162,11 @@ int main(int argc, char **argv) {
 			logprintf(LOG_ERR, "could not connect to pilight-daemon");
 			return EXIT_FAILURE;
 		}
-	} else if(ssdp_seek(&ssdp_list) == -1) {
+	} else if((sockfd = socket_connect_local(SOCKET_LOCAL)) > 0) {
+		logprintf(LOG_DEBUG, "connected to the local pilight-daemon");
+	} else if((sockfd = ssdp_connect()) == -1) {
 		logprintf(LOG_NOTICE, "no pilight ssdp connections found");
 		goto close;
-	} else {
-		if((sockfd = socket_connect(ssdp_list->ip, ssdp_list->port)) == -1) {
-			logprintf(LOG_ERR, "could not connect to pilight-daemon");
-			goto close;
-		}
-	}
-	if(ssdp_list != NULL) {
-		ssdp_free(ssdp_list);
 	}
 	if(server != NULL) {
 		FREE(server);
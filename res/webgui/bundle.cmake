@@ -0,0 +1,64 @@
+# Bundles the scripts and stylesheets of the webgui index into
+# one file each, named after a hash of their content, and writes
+# an index that refers to the bundles instead.
+#
+#   cmake -DSRC=libs/webgui -DDST=build/webgui -P bundle.cmake
+#
+# The order of the tags in the index is kept in the bundles. The
+# images are left as they are, the scripts refer to them by name.
+
+if(NOT SRC OR NOT DST)
+	message(FATAL_ERROR "usage: cmake -DSRC=<webgui> -DDST=<output> -P bundle.cmake")
+endif()
+
+# Keep in sync with WEBSERVER_FINGERPRINT in webserver.c
+set(FINGERPRINT 16)
+
+file(READ ${SRC}/index.html INDEX)
+
+string(REGEX MATCHALL "<script type=\"text/javascript\" src=\"[^\":]+\"></script>\n?" SCRIPTS "${INDEX}")
+string(REGEX MATCHALL "<link rel=\"stylesheet\" href=\"[^\":]+\" />\n?" STYLES "${INDEX}")
+
+file(MAKE_DIRECTORY ${DST})
+file(GLOB STALE ${DST}/pilight.*.js ${DST}/pilight.*.js.gz ${DST}/pilight.*.css ${DST}/pilight.*.css.gz)
+if(STALE)
+	file(REMOVE ${STALE})
+endif()
+
+# Concatenates the files the tags refer to and replaces the
+# first tag by one for the bundle, the others are dropped.
+function(bundle TAGS ATTR EXT SEPARATOR TAG)
+	set(CONTENT "")
+	foreach(ELEMENT ${TAGS})
+		string(REGEX REPLACE ".*${ATTR}=\"([^\"]+)\".*" "\\1" FILE "${ELEMENT}")
+		file(READ ${SRC}/${FILE} PART)
+		set(CONTENT "${CONTENT}${PART}${SEPARATOR}")
+	endforeach()
+
+	if(NOT "${CONTENT}" STREQUAL "")
+		string(SHA256 HASH "${CONTENT}")
+		string(SUBSTRING ${HASH} 0 ${FINGERPRINT} HASH)
+		set(NAME pilight.${HASH}.${EXT})
+		file(WRITE ${DST}/${NAME} "${CONTENT}")
+		if(NOT CMAKE_VERSION VERSION_LESS 3.18)
+			file(ARCHIVE_CREATE OUTPUT ${DST}/${NAME}.gz PATHS ${DST}/${NAME} FORMAT raw COMPRESSION GZip)
+		endif()
+
+		string(REPLACE "%NAME%" ${NAME} TAG "${TAG}")
+		set(FIRST 1)
+		foreach(ELEMENT ${TAGS})
+			if(FIRST)
+				string(REPLACE "${ELEMENT}" "${TAG}\n" INDEX "${INDEX}")
+				set(FIRST 0)
+			else()
+				string(REPLACE "${ELEMENT}" "" INDEX "${INDEX}")
+			endif()
+		endforeach()
+		set(INDEX "${INDEX}" PARENT_SCOPE)
+	endif()
+endfunction()
+
+bundle("${SCRIPTS}" src js ";\n" "<script type=\"text/javascript\" src=\"%NAME%\"></script>")
+bundle("${STYLES}" href css "\n" "<link rel=\"stylesheet\" href=\"%NAME%\" />")
+
+file(WRITE ${DST}/index.html "${INDEX}")
@@ -101,9 +101,8 @@ int main(int argc, char **argv) {
 	strcpy(progname, "pilight-send");
 
 	struct options_t *options = NULL;
-	struct ssdp_list_t *ssdp_list = NULL;
 
-	int sockfd = 0;
+	int sockfd = 0, local = 0;
 	int raw[MAXPULSESTREAMLENGTH-1];
 	char *recvBuff = NULL;
 
@@ -187,23 +186,17 @@ int main(int argc, char **argv) {
 		if(strlen(protobuffer) > 0 && version) {
 			logprintf(LOG_NOTICE, "-p and -V cannot be combined");
 		} else {
-			struct protocols_t *pnode = protocols;
 			/* Retrieve the used protocol */
-			while(pnode) {
-				/* Check if the protocol exists */
-				protocol = pnode->listener;
-				if(protocol_device_exists(protocol, protobuffer) == 0 && match == 0 && protocol->createCode != NULL) {
-					match=1;
-					/* Check if the protocol requires specific CLI arguments
-					   and merge them with the main CLI arguments */
-					if(protocol->options != NULL && help == 0) {
-						options_merge(&options, &protocol->options);
-					} else if(help == 1) {
-						protohelp=1;
-					}
-					break;
+			protocol = protocol_device_get(protobuffer);
+			if(protocol != NULL && protocol->createCode != NULL) {
+				match=1;
+				/* Check if the protocol requires specific CLI arguments
+				   and merge them with the main CLI arguments */
+				if(protocol->options != NULL && help == 0) {
+					options_merge(&options, &protocol->options);
+				} else if(help == 1) {
+					protohelp=1;
 				}
-				pnode = pnode->next;
 			}
 			/* If no protocols matches the requested protocol */
 			if(match == 0) {
@@ -333,23 +326,21 @@ int main(int argc, char **argv) {
 				logprintf(LOG_ERR, "could not connect to pilight-daemon");
 				goto close;
 			}
-		} else if(ssdp_seek(&ssdp_list) == -1) {
+		} else if((sockfd = socket_connect_local(SOCKET_LOCAL)) > 0) {
+			logprintf(LOG_DEBUG, "connected to the local pilight-daemon");
+			local = 1;
+		} else if((sockfd = ssdp_connect()) == -1) {
 			logprintf(LOG_NOTICE, "no pilight ssdp connections found");
 			goto close;
-		} else {
-			if((sockfd = socket_connect(ssdp_list->ip, ssdp_list->port)) == -1) {
-				logprintf(LOG_ERR, "could not connect to pilight-daemon");
-				goto close;
-			}
-		}
-		if(ssdp_list) {
-			ssdp_free(ssdp_list);
 		}
 
-		socket_write(sockfd, "{\"action\":\"identify\"}");
-		if(socket_read(sockfd, &recvBuff, 0) != 0
-		   || strcmp(recvBuff, "{\"status\":\"success\"}") != 0) {
-			goto close;
+		/* The local daemon takes codes without an introduction */
+		if(local == 0) {
+			socket_write(sockfd, "{\"action\":\"identify\"}");
+			if(socket_read(sockfd, &recvBuff, 0) != 0
+			   || strcmp(recvBuff, "{\"status\":\"success\"}") != 0) {
+				goto close;
+			}
 		}
 
 		JsonNode *json = json_mkobject();